@@ -0,0 +1,24 @@
+#include "AlignmentBackend.h"
+
+namespace {
+// Backends are stateless, so a single instance of each is shared by all of the genotypers
+std::vector<AlignmentBackend*>& backends(){
+  static CpuAlignmentBackend cpu_backend;
+  static std::vector<AlignmentBackend*> instances = { &cpu_backend };
+  return instances;
+}
+}
+
+AlignmentBackend* AlignmentBackend::get(const std::string& name){
+  for (AlignmentBackend* backend : backends())
+    if (name == backend->name())
+      return backend;
+  return NULL;
+}
+
+std::vector<std::string> AlignmentBackend::available(){
+  std::vector<std::string> names;
+  for (AlignmentBackend* backend : backends())
+    names.push_back(backend->name());
+  return names;
+}
@@ -0,0 +1,51 @@
+#ifndef ALIGNMENT_BACKEND_H_
+#define ALIGNMENT_BACKEND_H_
+
+#include <string>
+#include <vector>
+
+#include "AlignmentData.h"
+#include "HapAligner.h"
+#include "../base_quality.h"
+#include "../task_queue.h"
+
+/*
+ * Interface through which the genotypers compute the LL of each pooled read for each haplotype, so that the forward
+ * alignments can be performed by other devices. Backends must store the same LLs and seed positions as
+ * HapAligner::process_reads(), as the optimal alignments are subsequently retraced on the CPU using the HapAligner
+ */
+class AlignmentBackend {
+ public:
+  virtual ~AlignmentBackend(){}
+
+  virtual const char* name() const = 0;
+
+  /*
+   * Align each read in ALIGNMENTS to each haplotype of HAP_ALIGNER and store the LLs in consecutive rows of ALN_PROBS
+   * and the seed base of each read in SEED_POSITIONS. Only the reads flagged in REALIGN_READ are aligned. Backends may
+   * either reuse or recompute the seeds that HAP_ALIGNER flags as known, as both yield the same seeds
+   */
+  virtual void align_reads(HapAligner& hap_aligner, std::vector<Alignment>& alignments, BaseQuality* base_quality,
+			   std::vector<bool>& realign_read, double* aln_probs, int* seed_positions, TaskQueue* task_queue) = 0;
+
+  // Returns the backend with the provided name, or NULL if this build doesn't include it
+  static AlignmentBackend* get(const std::string& name);
+
+  // Names of the backends included in this build
+  static std::vector<std::string> available();
+
+  static AlignmentBackend* cpu(){ return get("cpu"); }
+};
+
+// Aligns the reads on this thread, sharing large sets of reads with the idle threads in the task queue
+class CpuAlignmentBackend : public AlignmentBackend {
+ public:
+  const char* name() const { return "cpu"; }
+
+  void align_reads(HapAligner& hap_aligner, std::vector<Alignment>& alignments, BaseQuality* base_quality,
+		   std::vector<bool>& realign_read, double* aln_probs, int* seed_positions, TaskQueue* task_queue){
+    hap_aligner.process_reads(alignments, 0, base_quality, realign_read, aln_probs, seed_positions, task_queue);
+  }
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define ALIGNMENT_DATA_H_
 
 #include <assert.h>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -28,15 +29,31 @@ class CigarElement {
 
 class Alignment {
  private:
+  // The alignment string and CIGAR are shared by reads with the same realignment, and only copied when one of them is modified
+  struct AlignmentPath {
+    std::string alignment;
+    std::vector<CigarElement> cigar_list;
+  };
+
   int32_t start_;
   int32_t stop_;
-  std::vector<CigarElement> cigar_list_;
+  std::shared_ptr<AlignmentPath> path_;
   std::string name_;
   std::string base_qualities_;
   std::string sequence_;
-  std::string alignment_;
   std::vector<bool> use_for_haps_;
 
+  // Log probabilities that each base is incorrect and correct given its quality score, in read order. Only
+  // available once cache_log_probs() has been invoked, and discarded whenever the base qualities change
+  std::vector<double> log_wrong_;
+  std::vector<double> log_correct_;
+
+  AlignmentPath& mutable_path(){
+    if (path_.use_count() > 1)
+      path_ = std::make_shared<AlignmentPath>(*path_);
+    return *path_;
+  }
+
  public:
   Alignment(int32_t start, int32_t stop,
 	    const std::string& name,
@@ -48,8 +65,8 @@ class Alignment {
     name_           = name;
     base_qualities_ = base_qualities;
     sequence_       = sequence;
-    alignment_      = alignment;
-    cigar_list_     = std::vector<CigarElement>();
+    path_           = std::make_shared<AlignmentPath>();
+    path_->alignment = alignment;
     use_for_haps_   = std::vector<bool>();
   }
 
@@ -59,8 +76,7 @@ class Alignment {
     stop_           = -1;
     base_qualities_ = "";
     sequence_       = "";
-    alignment_      = "";
-    cigar_list_     = std::vector<CigarElement>();
+    path_           = std::make_shared<AlignmentPath>();
     use_for_haps_   = std::vector<bool>();
   }
 
@@ -80,14 +96,14 @@ class Alignment {
 
   void check_CIGAR_string(){
     unsigned int num = 0;
-    for (std::vector<CigarElement>::const_iterator iter = cigar_list_.begin(); iter != cigar_list_.end(); iter++)
+    for (std::vector<CigarElement>::const_iterator iter = path_->cigar_list.begin(); iter != path_->cigar_list.end(); iter++)
       if (iter->get_type() != 'D' && iter->get_type() != 'H')
 	num += iter->get_num();
     if (num != sequence_.size()){
       std::cerr << "CIGAR check failed for read " << name_ << ": "
 		<< num << " " << sequence_.size() << std::endl
 		<< sequence_  << std::endl
-		<< alignment_ << std::endl
+		<< path_->alignment << std::endl
 		<< getCigarString() << std::endl;
       assert(false);
     }
@@ -95,6 +111,11 @@ class Alignment {
   
   double sum_log_prob_correct(BaseQuality& base_quality) const {
     double total = 0.0;
+    if (has_log_probs()){
+      for (unsigned int i = 0; i < log_correct_.size(); i++)
+	total += log_correct_[i];
+      return total;
+    }
     for (unsigned int i = 0; i < base_qualities_.size(); i++)
       total += base_quality.log_prob_correct(base_qualities_[i]);
     return total;
@@ -102,7 +123,7 @@ class Alignment {
 
   int num_indels() const{
     int num = 0;
-    for (std::vector<CigarElement>::const_iterator iter = cigar_list_.begin(); iter != cigar_list_.end(); iter++)
+    for (std::vector<CigarElement>::const_iterator iter = path_->cigar_list.begin(); iter != path_->cigar_list.end(); iter++)
       if (iter->get_type() == 'I' || iter->get_type() == 'D')
 	num++;
     return num;
@@ -110,7 +131,7 @@ class Alignment {
   
   int num_mismatches() const{
     int num = 0;
-    for (std::vector<CigarElement>::const_iterator iter = cigar_list_.begin(); iter != cigar_list_.end(); iter++)
+    for (std::vector<CigarElement>::const_iterator iter = path_->cigar_list.begin(); iter != path_->cigar_list.end(); iter++)
       if (iter->get_type() == 'X')
 	num++;
     return num;
@@ -118,32 +139,48 @@ class Alignment {
 
   int num_matched_bases() const{
     int num = 0;
-    for (std::vector<CigarElement>::const_iterator iter = cigar_list_.begin(); iter != cigar_list_.end(); iter++)
+    for (std::vector<CigarElement>::const_iterator iter = path_->cigar_list.begin(); iter != path_->cigar_list.end(); iter++)
       if (iter->get_type() == 'M' || iter->get_type() == '=')
 	num += iter->get_num();
     return num;
   }
 
-  inline void set_base_qualities(const std::string& base_qualities)       { base_qualities_.assign(base_qualities); }
+  inline void set_base_qualities(const std::string& base_qualities){
+    base_qualities_.assign(base_qualities);
+    log_wrong_.clear();
+    log_correct_.clear();
+  }
   inline void set_sequence(const std::string& sequence)                   { sequence_.assign(sequence);             }
-  inline void set_alignment(const std::string& alignment)                 { alignment_.assign(alignment);           }
-  inline void set_hap_gen_info(const std::vector<bool>& use_for_haps)     { use_for_haps_ = use_for_haps;           }
-  inline void add_cigar_element(CigarElement e)                           { cigar_list_.push_back(e);               }
-  inline void set_cigar_list(const std::vector<CigarElement>& cigar_list) {
-    cigar_list_.clear();
-    for (unsigned int i = 0; i < cigar_list.size(); i++)
-      cigar_list_.push_back(cigar_list[i]);
+  inline void set_alignment(const std::string& alignment)                 { mutable_path().alignment.assign(alignment); }
+  inline void set_hap_gen_info(const std::vector<bool>& use_for_haps)     { use_for_haps_ = use_for_haps;               }
+  inline void add_cigar_element(CigarElement e)                           { mutable_path().cigar_list.push_back(e);     }
+  inline void set_cigar_list(const std::vector<CigarElement>& cigar_list) { mutable_path().cigar_list = cigar_list;     }
+
+  /* Converts the base qualities into log probabilities once, so that they're reused by every alignment of the read */
+  void cache_log_probs(const BaseQuality& base_quality){
+    log_wrong_.resize(base_qualities_.size());
+    log_correct_.resize(base_qualities_.size());
+    for (unsigned int i = 0; i < base_qualities_.size(); i++){
+      log_wrong_[i]   = base_quality.log_prob_error(base_qualities_[i]);
+      log_correct_[i] = base_quality.log_prob_correct(base_qualities_[i]);
+    }
   }
+  inline bool has_log_probs() const { return !base_qualities_.empty() && log_correct_.size() == base_qualities_.size(); }
+  inline const double* get_log_prob_errors()   const { return log_wrong_.data();   }
+  inline const double* get_log_prob_corrects() const { return log_correct_.data(); }
+
+  /* Shares the alignment string and CIGAR of OTHER, without copying them */
+  inline void share_path(const Alignment& other){ path_ = other.path_; }
 
-  inline const std::string& get_base_qualities()           const { return base_qualities_; }
-  inline const std::string& get_sequence()                 const { return sequence_;       }
-  inline const std::string& get_alignment()                const { return alignment_;      }
-  inline const std::vector<CigarElement>& get_cigar_list() const { return cigar_list_;     }
+  inline const std::string& get_base_qualities()           const { return base_qualities_;    }
+  inline const std::string& get_sequence()                 const { return sequence_;          }
+  inline const std::string& get_alignment()                const { return path_->alignment;   }
+  inline const std::vector<CigarElement>& get_cigar_list() const { return path_->cigar_list;  }
   bool use_for_hap_generation(int region_index) const { return use_for_haps_[region_index]; }
 
   std::string getCigarString() const {
     std::stringstream cigar_str;
-    for (auto iter = cigar_list_.begin(); iter != cigar_list_.end(); iter++)
+    for (auto iter = path_->cigar_list.begin(); iter != path_->cigar_list.end(); iter++)
       cigar_str << iter->get_num() << iter->get_type();
     return cigar_str.str();
   }
@@ -0,0 +1,308 @@
+#include <algorithm>
+
+#include "AlignmentKernels.h"
+#include "AlignmentModel.h"
+
+#ifdef HAVE_X86_ALIGN_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+ * Within a row, only the insertion matrix depends on the preceding column, so it's computed first using a serial scan.
+ * The match and deletion entries then only depend on values that are already available and can be computed for several
+ * read positions at once. Each kernel performs exactly the same additions and maximums as the scalar version of the same precision,
+ * so the resulting log-likelihoods are identical
+ */
+
+template<typename T>
+static inline void fill_insert_row(int seq_len, const T* base_log_correct, const T* prev_match, T* cur_insert){
+  for (int j = 1; j < seq_len; ++j)
+    cur_insert[j] = base_log_correct[j] + std::max(prev_match[j-1] + (T)LOG_INS_TO_MATCH, cur_insert[j-1] + (T)LOG_INS_TO_INS);
+}
+
+// Computes the match and deletion entries for columns START -> SEQ_LEN-1 one column at a time
+template<typename T>
+static inline void fill_match_del_row(int start, int seq_len, const T* match_emit,
+				      T log_match_to_match, T log_match_to_ins, T log_match_to_del,
+				      const T* prev_match, const T* prev_del,
+				      T* cur_match, const T* cur_insert, T* cur_del){
+  for (int j = start; j < seq_len; ++j){
+    cur_match[j] = match_emit[j] + std::max(cur_insert[j-1] + log_match_to_ins,
+					    std::max(prev_match[j-1] + log_match_to_match, prev_del[j-1] + log_match_to_del));
+    cur_del[j]   = std::max(prev_match[j] + (T)LOG_DEL_TO_MATCH, prev_del[j] + (T)LOG_DEL_TO_DEL);
+  }
+}
+
+template<typename T>
+void align_row_scalar(int seq_len, const T* match_emit, const T* base_log_correct,
+		      T log_match_to_match, T log_match_to_ins, T log_match_to_del,
+		      const T* prev_match, const T* prev_del,
+		      T* cur_match, T* cur_insert, T* cur_del){
+  for (int j = 1; j < seq_len; ++j){
+    cur_match[j]  = match_emit[j]       + std::max(cur_insert[j-1] + log_match_to_ins,
+						   std::max(prev_match[j-1] + log_match_to_match, prev_del[j-1] + log_match_to_del));
+    cur_insert[j] = base_log_correct[j] + std::max(prev_match[j-1] + (T)LOG_INS_TO_MATCH, cur_insert[j-1] + (T)LOG_INS_TO_INS);
+    cur_del[j]    = std::max(prev_match[j] + (T)LOG_DEL_TO_MATCH, prev_del[j] + (T)LOG_DEL_TO_DEL);
+  }
+}
+
+template void align_row_scalar<double>(int seq_len, const double* match_emit, const double* base_log_correct,
+				       double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+				       const double* prev_match, const double* prev_del,
+				       double* cur_match, double* cur_insert, double* cur_del);
+template void align_row_scalar<float>(int seq_len, const float* match_emit, const float* base_log_correct,
+				      float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+				      const float* prev_match, const float* prev_del,
+				      float* cur_match, float* cur_insert, float* cur_del);
+
+void align_batch_row_scalar(int seq_len, const double* match_emit, const double* base_log_correct,
+			    double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+			    const double* prev_match, const double* prev_del,
+			    double* cur_match, double* cur_insert, double* cur_del){
+  const int L = ALIGN_BATCH_LANES;
+  for (int i = L; i < seq_len*L; ++i){
+    cur_match[i]  = match_emit[i]       + std::max(cur_insert[i-L] + log_match_to_ins,
+						   std::max(prev_match[i-L] + log_match_to_match, prev_del[i-L] + log_match_to_del));
+    cur_insert[i] = base_log_correct[i] + std::max(prev_match[i-L] + LOG_INS_TO_MATCH, cur_insert[i-L] + LOG_INS_TO_INS);
+    cur_del[i]    = std::max(prev_match[i] + LOG_DEL_TO_MATCH, prev_del[i] + LOG_DEL_TO_DEL);
+  }
+}
+
+#ifdef HAVE_X86_ALIGN_KERNELS
+
+static_assert(ALIGN_BATCH_LANES == 4, "The batched SIMD kernels assume that each column contains four lanes");
+
+__attribute__((target("sse2")))
+void align_batch_row_sse2(int seq_len, const double* match_emit, const double* base_log_correct,
+			  double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+			  const double* prev_match, const double* prev_del,
+			  double* cur_match, double* cur_insert, double* cur_del){
+  const __m128d mm = _mm_set1_pd(log_match_to_match), mi = _mm_set1_pd(log_match_to_ins), md = _mm_set1_pd(log_match_to_del);
+  const __m128d im = _mm_set1_pd(LOG_INS_TO_MATCH),   ii = _mm_set1_pd(LOG_INS_TO_INS);
+  const __m128d dm = _mm_set1_pd(LOG_DEL_TO_MATCH),   dd = _mm_set1_pd(LOG_DEL_TO_DEL);
+  for (int i = 4; i < seq_len*4; i += 2){
+    __m128d pm = _mm_loadu_pd(prev_match+i-4), ins = _mm_loadu_pd(cur_insert+i-4);
+    __m128d best = _mm_max_pd(_mm_add_pd(pm, mm), _mm_add_pd(_mm_loadu_pd(prev_del+i-4), md));
+    best = _mm_max_pd(_mm_add_pd(ins, mi), best);
+    _mm_storeu_pd(cur_match+i,  _mm_add_pd(_mm_loadu_pd(match_emit+i), best));
+    _mm_storeu_pd(cur_insert+i, _mm_add_pd(_mm_loadu_pd(base_log_correct+i), _mm_max_pd(_mm_add_pd(pm, im), _mm_add_pd(ins, ii))));
+    _mm_storeu_pd(cur_del+i,    _mm_max_pd(_mm_add_pd(_mm_loadu_pd(prev_match+i), dm), _mm_add_pd(_mm_loadu_pd(prev_del+i), dd)));
+  }
+}
+
+__attribute__((target("avx2")))
+void align_batch_row_avx2(int seq_len, const double* match_emit, const double* base_log_correct,
+			  double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+			  const double* prev_match, const double* prev_del,
+			  double* cur_match, double* cur_insert, double* cur_del){
+  const __m256d mm = _mm256_set1_pd(log_match_to_match), mi = _mm256_set1_pd(log_match_to_ins), md = _mm256_set1_pd(log_match_to_del);
+  const __m256d im = _mm256_set1_pd(LOG_INS_TO_MATCH),   ii = _mm256_set1_pd(LOG_INS_TO_INS);
+  const __m256d dm = _mm256_set1_pd(LOG_DEL_TO_MATCH),   dd = _mm256_set1_pd(LOG_DEL_TO_DEL);
+  __m256d ins = _mm256_loadu_pd(cur_insert);
+  for (int i = 4; i < seq_len*4; i += 4){
+    __m256d pm   = _mm256_loadu_pd(prev_match+i-4);
+    __m256d best = _mm256_max_pd(_mm256_add_pd(pm, mm), _mm256_add_pd(_mm256_loadu_pd(prev_del+i-4), md));
+    best = _mm256_max_pd(_mm256_add_pd(ins, mi), best);
+    _mm256_storeu_pd(cur_match+i, _mm256_add_pd(_mm256_loadu_pd(match_emit+i), best));
+    ins = _mm256_add_pd(_mm256_loadu_pd(base_log_correct+i), _mm256_max_pd(_mm256_add_pd(pm, im), _mm256_add_pd(ins, ii)));
+    _mm256_storeu_pd(cur_insert+i, ins);
+    _mm256_storeu_pd(cur_del+i, _mm256_max_pd(_mm256_add_pd(_mm256_loadu_pd(prev_match+i), dm), _mm256_add_pd(_mm256_loadu_pd(prev_del+i), dd)));
+  }
+}
+
+__attribute__((target("sse2")))
+void align_row_sse2(int seq_len, const double* match_emit, const double* base_log_correct,
+		    double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+		    const double* prev_match, const double* prev_del,
+		    double* cur_match, double* cur_insert, double* cur_del){
+  fill_insert_row(seq_len, base_log_correct, prev_match, cur_insert);
+
+  const __m128d mm = _mm_set1_pd(log_match_to_match), mi = _mm_set1_pd(log_match_to_ins), md = _mm_set1_pd(log_match_to_del);
+  const __m128d dm = _mm_set1_pd((double)LOG_DEL_TO_MATCH), dd = _mm_set1_pd((double)LOG_DEL_TO_DEL);
+  int j = 1;
+  for (; j+2 <= seq_len; j += 2){
+    __m128d best = _mm_max_pd(_mm_add_pd(_mm_loadu_pd(prev_match+j-1), mm), _mm_add_pd(_mm_loadu_pd(prev_del+j-1), md));
+    best = _mm_max_pd(_mm_add_pd(_mm_loadu_pd(cur_insert+j-1), mi), best);
+    _mm_storeu_pd(cur_match+j, _mm_add_pd(_mm_loadu_pd(match_emit+j), best));
+    _mm_storeu_pd(cur_del+j,   _mm_max_pd(_mm_add_pd(_mm_loadu_pd(prev_match+j), dm), _mm_add_pd(_mm_loadu_pd(prev_del+j), dd)));
+  }
+  fill_match_del_row(j, seq_len, match_emit, log_match_to_match, log_match_to_ins, log_match_to_del,
+		     prev_match, prev_del, cur_match, cur_insert, cur_del);
+}
+
+__attribute__((target("sse2")))
+void align_row_sse2(int seq_len, const float* match_emit, const float* base_log_correct,
+		    float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+		    const float* prev_match, const float* prev_del,
+		    float* cur_match, float* cur_insert, float* cur_del){
+  fill_insert_row(seq_len, base_log_correct, prev_match, cur_insert);
+
+  const __m128 mm = _mm_set1_ps(log_match_to_match), mi = _mm_set1_ps(log_match_to_ins), md = _mm_set1_ps(log_match_to_del);
+  const __m128 dm = _mm_set1_ps((float)LOG_DEL_TO_MATCH), dd = _mm_set1_ps((float)LOG_DEL_TO_DEL);
+  int j = 1;
+  for (; j+4 <= seq_len; j += 4){
+    __m128 best = _mm_max_ps(_mm_add_ps(_mm_loadu_ps(prev_match+j-1), mm), _mm_add_ps(_mm_loadu_ps(prev_del+j-1), md));
+    best = _mm_max_ps(_mm_add_ps(_mm_loadu_ps(cur_insert+j-1), mi), best);
+    _mm_storeu_ps(cur_match+j, _mm_add_ps(_mm_loadu_ps(match_emit+j), best));
+    _mm_storeu_ps(cur_del+j,   _mm_max_ps(_mm_add_ps(_mm_loadu_ps(prev_match+j), dm), _mm_add_ps(_mm_loadu_ps(prev_del+j), dd)));
+  }
+  fill_match_del_row(j, seq_len, match_emit, log_match_to_match, log_match_to_ins, log_match_to_del,
+		     prev_match, prev_del, cur_match, cur_insert, cur_del);
+}
+
+__attribute__((target("avx2")))
+void align_row_avx2(int seq_len, const double* match_emit, const double* base_log_correct,
+		    double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+		    const double* prev_match, const double* prev_del,
+		    double* cur_match, double* cur_insert, double* cur_del){
+  fill_insert_row(seq_len, base_log_correct, prev_match, cur_insert);
+
+  const __m256d mm = _mm256_set1_pd(log_match_to_match), mi = _mm256_set1_pd(log_match_to_ins), md = _mm256_set1_pd(log_match_to_del);
+  const __m256d dm = _mm256_set1_pd((double)LOG_DEL_TO_MATCH), dd = _mm256_set1_pd((double)LOG_DEL_TO_DEL);
+  int j = 1;
+  for (; j+4 <= seq_len; j += 4){
+    __m256d best = _mm256_max_pd(_mm256_add_pd(_mm256_loadu_pd(prev_match+j-1), mm), _mm256_add_pd(_mm256_loadu_pd(prev_del+j-1), md));
+    best = _mm256_max_pd(_mm256_add_pd(_mm256_loadu_pd(cur_insert+j-1), mi), best);
+    _mm256_storeu_pd(cur_match+j, _mm256_add_pd(_mm256_loadu_pd(match_emit+j), best));
+    _mm256_storeu_pd(cur_del+j,   _mm256_max_pd(_mm256_add_pd(_mm256_loadu_pd(prev_match+j), dm), _mm256_add_pd(_mm256_loadu_pd(prev_del+j), dd)));
+  }
+  fill_match_del_row(j, seq_len, match_emit, log_match_to_match, log_match_to_ins, log_match_to_del,
+		     prev_match, prev_del, cur_match, cur_insert, cur_del);
+}
+
+__attribute__((target("avx2")))
+void align_row_avx2(int seq_len, const float* match_emit, const float* base_log_correct,
+		    float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+		    const float* prev_match, const float* prev_del,
+		    float* cur_match, float* cur_insert, float* cur_del){
+  fill_insert_row(seq_len, base_log_correct, prev_match, cur_insert);
+
+  const __m256 mm = _mm256_set1_ps(log_match_to_match), mi = _mm256_set1_ps(log_match_to_ins), md = _mm256_set1_ps(log_match_to_del);
+  const __m256 dm = _mm256_set1_ps((float)LOG_DEL_TO_MATCH), dd = _mm256_set1_ps((float)LOG_DEL_TO_DEL);
+  int j = 1;
+  for (; j+8 <= seq_len; j += 8){
+    __m256 best = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(prev_match+j-1), mm), _mm256_add_ps(_mm256_loadu_ps(prev_del+j-1), md));
+    best = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(cur_insert+j-1), mi), best);
+    _mm256_storeu_ps(cur_match+j, _mm256_add_ps(_mm256_loadu_ps(match_emit+j), best));
+    _mm256_storeu_ps(cur_del+j,   _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(prev_match+j), dm), _mm256_add_ps(_mm256_loadu_ps(prev_del+j), dd)));
+  }
+  fill_match_del_row(j, seq_len, match_emit, log_match_to_match, log_match_to_ins, log_match_to_del,
+		     prev_match, prev_del, cur_match, cur_insert, cur_del);
+}
+
+__attribute__((target("avx512f")))
+void align_row_avx512(int seq_len, const double* match_emit, const double* base_log_correct,
+		      double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+		      const double* prev_match, const double* prev_del,
+		      double* cur_match, double* cur_insert, double* cur_del){
+  fill_insert_row(seq_len, base_log_correct, prev_match, cur_insert);
+
+  const __m512d mm = _mm512_set1_pd(log_match_to_match), mi = _mm512_set1_pd(log_match_to_ins), md = _mm512_set1_pd(log_match_to_del);
+  const __m512d dm = _mm512_set1_pd((double)LOG_DEL_TO_MATCH), dd = _mm512_set1_pd((double)LOG_DEL_TO_DEL);
+  int j = 1;
+  for (; j+8 <= seq_len; j += 8){
+    __m512d best = _mm512_max_pd(_mm512_add_pd(_mm512_loadu_pd(prev_match+j-1), mm), _mm512_add_pd(_mm512_loadu_pd(prev_del+j-1), md));
+    best = _mm512_max_pd(_mm512_add_pd(_mm512_loadu_pd(cur_insert+j-1), mi), best);
+    _mm512_storeu_pd(cur_match+j, _mm512_add_pd(_mm512_loadu_pd(match_emit+j), best));
+    _mm512_storeu_pd(cur_del+j,   _mm512_max_pd(_mm512_add_pd(_mm512_loadu_pd(prev_match+j), dm), _mm512_add_pd(_mm512_loadu_pd(prev_del+j), dd)));
+  }
+  fill_match_del_row(j, seq_len, match_emit, log_match_to_match, log_match_to_ins, log_match_to_del,
+		     prev_match, prev_del, cur_match, cur_insert, cur_del);
+}
+
+__attribute__((target("avx512f")))
+void align_row_avx512(int seq_len, const float* match_emit, const float* base_log_correct,
+		      float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+		      const float* prev_match, const float* prev_del,
+		      float* cur_match, float* cur_insert, float* cur_del){
+  fill_insert_row(seq_len, base_log_correct, prev_match, cur_insert);
+
+  const __m512 mm = _mm512_set1_ps(log_match_to_match), mi = _mm512_set1_ps(log_match_to_ins), md = _mm512_set1_ps(log_match_to_del);
+  const __m512 dm = _mm512_set1_ps((float)LOG_DEL_TO_MATCH), dd = _mm512_set1_ps((float)LOG_DEL_TO_DEL);
+  int j = 1;
+  for (; j+16 <= seq_len; j += 16){
+    __m512 best = _mm512_max_ps(_mm512_add_ps(_mm512_loadu_ps(prev_match+j-1), mm), _mm512_add_ps(_mm512_loadu_ps(prev_del+j-1), md));
+    best = _mm512_max_ps(_mm512_add_ps(_mm512_loadu_ps(cur_insert+j-1), mi), best);
+    _mm512_storeu_ps(cur_match+j, _mm512_add_ps(_mm512_loadu_ps(match_emit+j), best));
+    _mm512_storeu_ps(cur_del+j,   _mm512_max_ps(_mm512_add_ps(_mm512_loadu_ps(prev_match+j), dm), _mm512_add_ps(_mm512_loadu_ps(prev_del+j), dd)));
+  }
+  fill_match_del_row(j, seq_len, match_emit, log_match_to_match, log_match_to_ins, log_match_to_del,
+		     prev_match, prev_del, cur_match, cur_insert, cur_del);
+}
+
+#endif
+
+static const char* KERNEL_ISA_NAMES[] = {"scalar", "sse2", "avx2", "avx512"};
+
+// Most capable instruction set supported by the CPU
+static int cpu_kernel_isa(){
+#ifdef HAVE_X86_ALIGN_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return KERNEL_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return KERNEL_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return KERNEL_SSE2;
+#endif
+  return KERNEL_SCALAR;
+}
+
+// -1 unless set_kernel_isa() restricted the instruction set
+static int max_kernel_isa = -1;
+
+static int selected_kernel_isa(){
+  return (max_kernel_isa == -1 ? cpu_kernel_isa() : max_kernel_isa);
+}
+
+std::vector<std::string> supported_kernel_isas(){
+  return std::vector<std::string>(KERNEL_ISA_NAMES, KERNEL_ISA_NAMES + cpu_kernel_isa() + 1);
+}
+
+bool set_kernel_isa(const std::string& name){
+  for (int isa = KERNEL_SCALAR; isa <= cpu_kernel_isa(); isa++){
+    if (name == KERNEL_ISA_NAMES[isa]){
+      max_kernel_isa = isa;
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename T>
+AlignRowKernel<T> select_align_row_kernel(){
+#ifdef HAVE_X86_ALIGN_KERNELS
+  int isa = selected_kernel_isa();
+  if (isa >= KERNEL_AVX512)
+    return align_row_avx512;
+  if (isa >= KERNEL_AVX2)
+    return align_row_avx2;
+  if (isa >= KERNEL_SSE2)
+    return align_row_sse2;
+#endif
+  return align_row_scalar<T>;
+}
+
+template AlignRowKernel<double> select_align_row_kernel<double>();
+template AlignRowKernel<float>  select_align_row_kernel<float>();
+
+AlignBatchRowKernel select_align_batch_row_kernel(){
+#ifdef HAVE_X86_ALIGN_KERNELS
+  int isa = selected_kernel_isa();
+  if (isa >= KERNEL_AVX2)
+    return align_batch_row_avx2;
+  if (isa >= KERNEL_SSE2)
+    return align_batch_row_sse2;
+#endif
+  return align_batch_row_scalar;
+}
+
+std::string align_row_kernel_name(){
+  AlignRowKernel<double> kernel = select_align_row_kernel<double>();
+#ifdef HAVE_X86_ALIGN_KERNELS
+  if (kernel == (AlignRowKernel<double>) align_row_avx512) return "AVX-512";
+  if (kernel == (AlignRowKernel<double>) align_row_avx2)   return "AVX2";
+  if (kernel == (AlignRowKernel<double>) align_row_sse2)   return "SSE2";
+#endif
+  return "scalar";
+}
@@ -0,0 +1,110 @@
+#ifndef ALIGNMENT_KERNELS_H_
+#define ALIGNMENT_KERNELS_H_
+
+#include <string>
+#include <vector>
+
+/*
+ * Fills columns 1 -> SEQ_LEN-1 of a single non-stutter row of the haplotype alignment matrices.
+ * PREV_MATCH and PREV_DEL point to the preceding haplotype row and CUR_MATCH, CUR_INSERT and CUR_DEL
+ * to the current row, whose column 0 must already be initialized. MATCH_EMIT contains the log-probability of
+ * each read base given the row's haplotype character. Kernels are available in double and single precision
+ */
+template<typename T>
+using AlignRowKernel = void (*)(int seq_len, const T* match_emit, const T* base_log_correct,
+				T log_match_to_match, T log_match_to_ins, T log_match_to_del,
+				const T* prev_match, const T* prev_del,
+				T* cur_match, T* cur_insert, T* cur_del);
+
+template<typename T>
+void align_row_scalar(int seq_len, const T* match_emit, const T* base_log_correct,
+		      T log_match_to_match, T log_match_to_ins, T log_match_to_del,
+		      const T* prev_match, const T* prev_del,
+		      T* cur_match, T* cur_insert, T* cur_del);
+
+// Number of reads whose rows are filled simultaneously by the batched row kernels
+const int ALIGN_BATCH_LANES = 4;
+
+/*
+ * Equivalent to an AlignRowKernel<double> applied to ALIGN_BATCH_LANES reads aligned in lockstep to the same haplotype.
+ * Every array is stored in lane-major order, so that the entry for column j of lane l is at index j*ALIGN_BATCH_LANES + l.
+ * Each SIMD lane holds a different read, so the insertion recurrence along the row is vectorized as well
+ */
+using AlignBatchRowKernel = void (*)(int seq_len, const double* match_emit, const double* base_log_correct,
+				     double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+				     const double* prev_match, const double* prev_del,
+				     double* cur_match, double* cur_insert, double* cur_del);
+
+void align_batch_row_scalar(int seq_len, const double* match_emit, const double* base_log_correct,
+			    double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+			    const double* prev_match, const double* prev_del,
+			    double* cur_match, double* cur_insert, double* cur_del);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_ALIGN_KERNELS 1
+
+void align_batch_row_sse2(int seq_len, const double* match_emit, const double* base_log_correct,
+			  double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+			  const double* prev_match, const double* prev_del,
+			  double* cur_match, double* cur_insert, double* cur_del);
+
+void align_batch_row_avx2(int seq_len, const double* match_emit, const double* base_log_correct,
+			  double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+			  const double* prev_match, const double* prev_del,
+			  double* cur_match, double* cur_insert, double* cur_del);
+
+void align_row_sse2(int seq_len, const double* match_emit, const double* base_log_correct,
+		    double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+		    const double* prev_match, const double* prev_del,
+		    double* cur_match, double* cur_insert, double* cur_del);
+
+void align_row_sse2(int seq_len, const float* match_emit, const float* base_log_correct,
+		    float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+		    const float* prev_match, const float* prev_del,
+		    float* cur_match, float* cur_insert, float* cur_del);
+
+void align_row_avx2(int seq_len, const double* match_emit, const double* base_log_correct,
+		    double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+		    const double* prev_match, const double* prev_del,
+		    double* cur_match, double* cur_insert, double* cur_del);
+
+void align_row_avx2(int seq_len, const float* match_emit, const float* base_log_correct,
+		    float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+		    const float* prev_match, const float* prev_del,
+		    float* cur_match, float* cur_insert, float* cur_del);
+
+void align_row_avx512(int seq_len, const double* match_emit, const double* base_log_correct,
+		      double log_match_to_match, double log_match_to_ins, double log_match_to_del,
+		      const double* prev_match, const double* prev_del,
+		      double* cur_match, double* cur_insert, double* cur_del);
+
+void align_row_avx512(int seq_len, const float* match_emit, const float* base_log_correct,
+		      float log_match_to_match, float log_match_to_ins, float log_match_to_del,
+		      const float* prev_match, const float* prev_del,
+		      float* cur_match, float* cur_insert, float* cur_del);
+#endif
+
+// Instruction sets for which kernels are compiled, in increasing order of preference
+enum KernelISA { KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2, KERNEL_AVX512 };
+
+// Names of the instruction sets supported by both this build and the current CPU (e.g. scalar, sse2, avx2 or avx512)
+std::vector<std::string> supported_kernel_isas();
+
+/*
+ * Restrict the kernels selected below to those using at most the named instruction set, so that the slower variants can be
+ * benchmarked and validated on newer CPUs. Must be invoked before any reads are aligned, as the aligners cache their
+ * kernels. Returns false if the instruction set isn't supported
+ */
+bool set_kernel_isa(const std::string& name);
+
+// Returns the fastest row kernel supported by the current CPU
+template<typename T>
+AlignRowKernel<T> select_align_row_kernel();
+
+// Returns the fastest batched row kernel supported by the current CPU
+AlignBatchRowKernel select_align_batch_row_kernel();
+
+// Returns the name of the double-precision kernel selected by select_align_row_kernel()
+std::string align_row_kernel_name();
+
+#endif
@@ -9,11 +9,33 @@ const double LOG_INS_TO_MATCH    = -0.4586751453870818910216436; // log(1-e^-1)
 const double LOG_DEL_TO_DEL      = -1.0; // log(e^-1)
 const double LOG_DEL_TO_MATCH    = -0.4586751453870818910216436; // log(1-e^-1)
 
-extern double LOG_MATCH_TO_MATCH[MAX_HOMOP_LEN+1];
-extern double LOG_MATCH_TO_INS[MAX_HOMOP_LEN+1];
-extern double LOG_MATCH_TO_DEL[MAX_HOMOP_LEN+1];
+/*
+  Transition log-probabilities out of a match state for each homopolymer length
+  LOG_MATCH_TO_INS and LOG_MATCH_TO_DEL values are obtained by logging the values utilized in Dindel v1.01, where lengths above 10
+  use log(1.4e-3 + 4.3e-4*(len-10)). LOG_MATCH_TO_MATCH is equal to log(1-P(M->I)-P(M->D))
+  Values for length 0 won't be used anyways as homopolymer length >= 1
+ */
+constexpr double LOG_MATCH_TO_INS[MAX_HOMOP_LEN+1] = {
+  0.0, -10.448214727977801, -10.448214727977801, -10.448214727977801,
+  -10.448214727977801, -10.054310442270712, -9.1150301921718579, -8.3348716346222833,
+  -7.4698741971356784, -6.9077552789821368, -6.5712830423609239, -6.3034393121288073,
+  -6.0923904656979424, -5.9182140853683896, -5.7699222771607461, -5.6408076754948127
+};
+
+constexpr double LOG_MATCH_TO_DEL[MAX_HOMOP_LEN+1] = {
+  0.0, -10.448214727977801, -10.448214727977801, -10.448214727977801,
+  -10.448214727977801, -10.054310442270712, -9.1150301921718579, -8.3348716346222833,
+  -7.4698741971356784, -6.9077552789821368, -6.5712830423609239, -6.3034393121288073,
+  -6.0923904656979424, -5.9182140853683896, -5.7699222771607461, -5.6408076754948127
+};
+
+constexpr double LOG_MATCH_TO_MATCH[MAX_HOMOP_LEN+1] = {
+  0.0, -5.800168206493163e-05, -5.800168206493163e-05, -5.800168206493163e-05,
+  -5.800168206493163e-05, -8.6003698212062842e-05, -0.0002200242035500281, -0.00048011523687731212,
+  -0.0011406502942705443, -0.0020020026706730793, -0.0028039273327341479, -0.0036667141876242748,
+  -0.0045302460865318155, -0.0053945243173073561, -0.0062595501711442273, -0.0071253249425887386
+};
 
-void init_alignment_model();
 void print_alignment_model(std::ostream& out);
 
 #endif
@@ -5,12 +5,13 @@
 #include <vector>
 
 #include "../bam_io.h"
+#include "../reference_sequence.h"
 #include "AlignmentData.h"
 
 extern const int ALIGN_WINDOW_WIDTH;
 
-bool realign(BamAlignment& alignment, std::string& ref_sequence, Alignment& new_alignment);
+bool realign(BamAlignment& alignment, const ReferenceSequence& ref_sequence, Alignment& new_alignment);
 
-void convertAlignment(BamAlignment& alignment, std::string& ref_sequence, Alignment& new_alignment);
+void convertAlignment(BamAlignment& alignment, const ReferenceSequence& ref_sequence, Alignment& new_alignment);
 
 #endif
@@ -4,11 +4,10 @@
 #include "AlignmentTraceback.h"
 #include "AlignmentData.h"
 
-std::string stitch(const std::string& hap_aln, const std::string& read_aln, int h_index, int r_index, int increment){
-  std::stringstream stitched_aln;
+void stitch(const std::string& hap_aln, const std::string& read_aln, int h_index, int r_index, int increment, std::string& stitched_aln){
   while (r_index >= 0 && r_index < read_aln.size()){
     if (read_aln[r_index] == 'S'){
-      stitched_aln << 'S';
+      stitched_aln.push_back('S');
       r_index += increment;
       continue;
     }
@@ -16,25 +15,23 @@ std::string stitch(const std::string& hap_aln, const std::string& read_aln, int
     assert(h_index >= 0 && h_index < hap_aln.size());
     if (hap_aln[h_index] == 'D'){
       if (read_aln[r_index] == 'I'){
-	stitched_aln << 'M';
+	stitched_aln.push_back('M');
 	r_index += increment;
 	h_index += increment;
       }
       else {
-	stitched_aln << 'D';
+	stitched_aln.push_back('D');
 	h_index += increment;
       }
     }    
     else if (read_aln[r_index] == 'I'){
-      stitched_aln << 'I';
+      stitched_aln.push_back('I');
       r_index += increment;
     }
     else if (read_aln[r_index] == 'D'){
       if (hap_aln[h_index] == 'M')
-	stitched_aln << 'D';
-      else if (hap_aln[h_index] == 'I')
-	stitched_aln << "";
-      else
+	stitched_aln.push_back('D');
+      else if (hap_aln[h_index] != 'I')
 	printErrorAndDie("Logical error in stitch_alignment_trace()");
       r_index += increment;
       h_index += increment;
@@ -42,19 +39,18 @@ std::string stitch(const std::string& hap_aln, const std::string& read_aln, int
     else if (read_aln[r_index] == 'M'){
       if (hap_aln[h_index] != 'M' && hap_aln[h_index] != 'I')
 	printErrorAndDie("Logical error in stitch_alignment_trace()");
-      stitched_aln << hap_aln[h_index];
+      stitched_aln.push_back(hap_aln[h_index]);
       r_index += increment;
       h_index += increment;
     }
     else
       printErrorAndDie("Logical error in stitch_alignment_trace()");
    }
-   return stitched_aln.str();
 }
 
 void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref, const std::string& read_aln_to_hap, 
 			    int hap_index, int seed_base, Alignment& orig_aln,
-			    Alignment& new_aln){
+			    Alignment& new_aln, TraceBuffers& buffers){
   int hap_aln_index = 0;
   int32_t seed_pos  = hap_start;
 
@@ -79,10 +75,17 @@ void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref
     read_aln_index++;
   assert(read_aln_index != read_aln_to_hap.size());
     
-  std::string left_aln  = stitch(hap_aln_to_ref, read_aln_to_hap, hap_aln_index-1, read_aln_index-1, -1);
+  std::string& left_aln = buffers.stitch_left;
+  left_aln.clear();
+  stitch(hap_aln_to_ref, read_aln_to_hap, hap_aln_index-1, read_aln_index-1, -1, left_aln);
   std::reverse(left_aln.begin(), left_aln.end());
-  std::string right_aln = stitch(hap_aln_to_ref, read_aln_to_hap, hap_aln_index+1, read_aln_index+1,  1);
-  std::string full_aln  = left_aln + "M" + right_aln;
+  std::string& right_aln = buffers.stitch_right;
+  right_aln.clear();
+  stitch(hap_aln_to_ref, read_aln_to_hap, hap_aln_index+1, read_aln_index+1,  1, right_aln);
+  std::string& full_aln = buffers.full_ops;
+  full_aln.assign(left_aln);
+  full_aln.push_back('M');
+  full_aln.append(right_aln);
 
   for (int i = 0; i < full_aln.size(); i++){
     if (full_aln[i] == 'I')
@@ -102,7 +105,8 @@ void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref
       stop++;
 
   // Construct the CIGAR string elements
-  std::vector<CigarElement> cigar_list;
+  std::vector<CigarElement>& cigar_list = buffers.cigar_list;
+  cigar_list.clear();
   char cigar_char = full_aln[0];
   int  num        = 1;
   char new_cigar_char;
@@ -120,7 +124,8 @@ void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref
 
   // Construct the actual alignment string (from the string describing the alignment operations)
   int read_index = 0;
-  std::stringstream aln_ss;
+  std::string& aln_bases = buffers.aln_bases;
+  aln_bases.clear();
   const std::string& bases = orig_aln.get_sequence();
   for (unsigned int i = 0; i < full_aln.size(); i++){
     switch (full_aln[i]){
@@ -129,11 +134,11 @@ void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref
       break;
     case 'M':
     case 'I':
-      aln_ss << bases[read_index];
+      aln_bases.push_back(bases[read_index]);
       read_index++;
       break;
     case 'D':
-      aln_ss << "-";
+      aln_bases.push_back('-');
       break;
     default:
       printErrorAndDie("Invalid character encountered in stitch_alignment_trace()");
@@ -141,6 +146,11 @@ void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref
     }
   }
 
-  new_aln = Alignment(start, stop, "TRACE", orig_aln.get_base_qualities(), orig_aln.get_sequence(), aln_ss.str());
+  // The traced alignment is filled in place, so its strings are only copied once from the buffers
+  new_aln.set_start(start);
+  new_aln.set_stop(stop);
+  new_aln.set_base_qualities(orig_aln.get_base_qualities());
+  new_aln.set_sequence(orig_aln.get_sequence());
+  new_aln.set_alignment(aln_bases);
   new_aln.set_cigar_list(cigar_list);
 }
@@ -1,6 +1,9 @@
 #ifndef ALIGNMENT_TRACEBACK_H_
 #define ALIGNMENT_TRACEBACK_H_
 
+#include <assert.h>
+
+#include <iterator>
 #include <string>
 #include <vector>
 
@@ -12,14 +15,25 @@ class AlignmentTrace {
   // Simple class for traceback data related to STR blocks
   class STRTraceData {
   private:
+    bool traced_;              // True iff the read's alignment spans the STR block
     int stutter_size_;         // Size of stutter artifact in STR block
     std::string str_seq_;      // Sequence in STR region
   public:
-    STRTraceData(int stutter_size, std::string& str_seq){
+    STRTraceData(){
+      traced_       = false;
+      stutter_size_ = 0;
+    }
+
+    void set(int stutter_size, const char* seq, int length, bool reverse){
+      traced_       = true;
       stutter_size_ = stutter_size;
-      str_seq_      = str_seq;
+      if (reverse)
+	str_seq_.assign(std::reverse_iterator<const char*>(seq+length), std::reverse_iterator<const char*>(seq));
+      else
+	str_seq_.assign(seq, length);
     }
 
+    bool traced()               { return traced_;       }
     int stutter_size()          { return stutter_size_; }
     std::string& str_seq()      { return str_seq_;      }
   };
@@ -28,7 +42,7 @@ class AlignmentTrace {
   Alignment trace_vs_ref_;   // Alignment trace relative to the reference allele
   int flank_ins_size_;       // Number of inserted base pairs in sequences flanking the STR (positive)
   int flank_del_size_;       // Number of deleted base pairs in sequences flanking the STR (positive)
-  std::vector<STRTraceData*> str_data_;
+  std::vector<STRTraceData> str_data_;
   std::vector<std::string> flank_seqs_;
   std::vector< std::pair<int32_t,int32_t> > flank_indel_data_;
   std::vector< std::pair<int32_t, char> > flank_snp_data_;
@@ -38,17 +52,10 @@ class AlignmentTrace {
     hap_aln_        = "";
     flank_ins_size_ = 0;
     flank_del_size_ = 0;
-    str_data_       = std::vector<STRTraceData*>(num_haplotype_blocks, NULL);
+    str_data_       = std::vector<STRTraceData>(num_haplotype_blocks);
     flank_seqs_     = std::vector<std::string>(num_haplotype_blocks, "");
   }
 
-  ~AlignmentTrace(){
-    for (auto str_trace_iter = str_data_.begin(); str_trace_iter != str_data_.end(); ++str_trace_iter)
-      if (*str_trace_iter != NULL)
-	delete *str_trace_iter;
-    str_data_.clear();
-  }
-
   int flank_ins_size()     { return flank_ins_size_; }
   int flank_del_size()     { return flank_del_size_; }
   std::string& hap_aln()   { return hap_aln_;        }
@@ -60,15 +67,20 @@ class AlignmentTrace {
   }
   void inc_flank_ins()                    { flank_ins_size_++;   }
   void inc_flank_del()                    { flank_del_size_++;   }
-  void set_hap_aln(std::string& aln)      { hap_aln_ = aln;      }
 
-  void add_flank_data(int block_index, std::string& flank_seq){
-    flank_seqs_[block_index].append(flank_seq);
+  // Append the LENGTH bases starting at SEQ to the block's flanking sequence, in reverse order if REVERSE is true
+  void add_flank_data(int block_index, const char* seq, int length, bool reverse){
+    std::string& flank_seq = flank_seqs_[block_index];
+    if (reverse)
+      flank_seq.append(std::reverse_iterator<const char*>(seq+length), std::reverse_iterator<const char*>(seq));
+    else
+      flank_seq.append(seq, length);
   }
 
-  void add_str_data(int block_index, int stutter_size, std::string& str_seq){
-    assert(str_data_[block_index] == NULL);
-    str_data_[block_index] = new STRTraceData(stutter_size, str_seq);
+  // Store the LENGTH bases starting at SEQ as the block's STR sequence, in reverse order if REVERSE is true
+  void add_str_data(int block_index, int stutter_size, const char* seq, int length, bool reverse){
+    assert(!str_data_[block_index].traced());
+    str_data_[block_index].set(stutter_size, seq, length, reverse);
   }
 
   std::vector< std::pair<int32_t,int32_t> >& flank_indel_data() { return flank_indel_data_; }
@@ -76,23 +88,21 @@ class AlignmentTrace {
 
   bool has_stutter(){
     for (unsigned int i = 0; i < str_data_.size(); ++i)
-      if (str_data_[i] != NULL)
-	if (str_data_[i]->stutter_size() != 0)
-	  return true;
+      if (str_data_[i].stutter_size() != 0)
+	return true;
     return false;
   }
 
   int total_stutter_size(){
     int total_size = 0;
     for (unsigned int i = 0; i < str_data_.size(); ++i)
-      if (str_data_[i] != NULL)
-	total_size += str_data_[i]->stutter_size();
+      total_size += str_data_[i].stutter_size();
     return total_size;
   }
 
   int stutter_size(int block_index){
-    assert(str_data_[block_index] != NULL);
-    return str_data_[block_index]->stutter_size();
+    assert(str_data_[block_index].traced());
+    return str_data_[block_index].stutter_size();
   }
 
   std::string& flank_seq(int block_index){
@@ -100,16 +110,29 @@ class AlignmentTrace {
   }
 
   std::string& str_seq(int block_index){
-    assert(str_data_[block_index] != NULL);
-    return str_data_[block_index]->str_seq();
+    assert(str_data_[block_index].traced());
+    return str_data_[block_index].str_seq();
   }
 };
 
+/*
+ * Buffers used to retrace and stitch a read's alignment, in which each alignment operation (M, I, D or S) is stored as
+ * a single character. The buffers retain their capacity, so tracing additional reads doesn't require any intermediate
+ * heap allocations. Each thread's AlignmentWorkspace holds its own buffers
+ */
+struct TraceBuffers {
+  std::string left_ops, right_ops;       // Operations aligning the read to the left and right of its seed to the haplotype
+  std::string stitch_left, stitch_right; // Operations for the bases to the left and right of the seed relative to the reference
+  std::string full_ops;                  // Operations for the entire read relative to the reference
+  std::string aln_bases;                 // Alignment string for the read relative to the reference
+  std::vector<CigarElement> cigar_list;
+};
 
-std::string stitch(const std::string& hap_aln, const std::string& read_aln, int h_index, int r_index, int increment);
+// Append the operations for the read relative to the reference to STITCHED_ALN, starting from the provided indices and moving in the direction of INCREMENT
+void stitch(const std::string& hap_aln, const std::string& read_aln, int h_index, int r_index, int increment, std::string& stitched_aln);
 
 void stitch_alignment_trace(int32_t hap_start, const std::string& hap_aln_to_ref, 
 			    const std::string& read_aln_to_hap, int hap_index, int seed_base, Alignment& orig_aln,
-			    Alignment& new_aln);
+			    Alignment& new_aln, TraceBuffers& buffers);
 
 #endif
@@ -141,7 +141,7 @@ void overlayAlignments(std::vector<Alignment>& alignments,
   }
 }
 
-std::string arrangeReferenceString(std::string& chrom_seq, 
+std::string arrangeReferenceString(const ReferenceSequence& chrom_seq, 
 				   std::map<int32_t,int>& max_insertions,
 				   std::string& locus_id,
 				   int32_t str_start,
@@ -185,9 +185,9 @@ void get_alignment_bounds(std::vector<Alignment>& alignments,
 
 void visualizeAlignments(std::vector< std::vector<Alignment> >& alns, std::vector<std::string>& sample_names, 
 			 std::map<std::string, std::string>& sample_info, std::vector<HapBlock*>& hap_blocks,
-			 std::string& chrom_seq, std::string locus_id, bool draw_locus_id,
+			 const ReferenceSequence& chrom_seq, std::string locus_id, bool draw_locus_id,
 			 std::ostream& output) {
-  assert(hap_blocks.size() == 3 && alns.size() == sample_names.size());
+  assert(hap_blocks.size() >= 3 && alns.size() == sample_names.size());
 
 
   // Sort samples by name
@@ -216,9 +216,9 @@ void visualizeAlignments(std::vector< std::vector<Alignment> >& alns, std::vecto
   int32_t min_start, max_stop;
   overlayAlignments(alignments, max_insertions, align_results, min_start, max_stop);
 
-  // Arrange reference sequence
+  // Arrange reference sequence, highlighting the repeat blocks from the first to the last STR
   std::string ref_alignment = arrangeReferenceString(chrom_seq, max_insertions, locus_id, 
-						     hap_blocks[1]->start(), hap_blocks[1]->end(), min_start, max_stop,
+						     hap_blocks[1]->start(), hap_blocks[hap_blocks.size()-2]->end(), min_start, max_stop,
 						     draw_locus_id, output);
 
   // Write to HTML
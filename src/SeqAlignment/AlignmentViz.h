@@ -8,12 +8,13 @@
 #include <sstream>
 #include <vector>
 
+#include "../reference_sequence.h"
 #include "AlignmentData.h"
 #include "HapBlock.h"
 
 void visualizeAlignments(std::vector< std::vector<Alignment> >& alns, std::vector<std::string>& sample_names,
 			 std::map<std::string, std::string>& sample_info, std::vector<HapBlock*>& hap_blocks,
-			 std::string& chrom_seq, std::string locus_id, bool draw_locus_id,
+			 const ReferenceSequence& chrom_seq, std::string locus_id, bool draw_locus_id,
 			 std::ostream& output);
 
 #endif
@@ -0,0 +1,89 @@
+#ifndef ALIGNMENT_WORKSPACE_H_
+#define ALIGNMENT_WORKSPACE_H_
+
+#include <string>
+#include <vector>
+
+#include "AlignmentTraceback.h"
+#include "HugePageAllocator.h"
+
+// Returns a pointer to storage for at least SIZE elements, growing the buffer if required
+template<typename T, typename A>
+T* grow_buffer(std::vector<T, A>& buffer, size_t size){
+  if (buffer.size() < size)
+    buffer.resize(size);
+  return buffer.data();
+}
+
+template<typename T, typename A>
+size_t buffer_bytes(const std::vector<T, A>& buffer){ return buffer.capacity()*sizeof(T); }
+
+// Alignment matrices and per-row scratch arrays for a single scalar type. The matrices are allocated using HugePages
+template<typename T>
+struct AlignmentMatrices {
+  DPVector<T> l_match, l_insert, l_deletion;
+  DPVector<T> r_match, r_insert, r_deletion;
+  std::vector<T> log_correct, emit_probs;
+  std::vector<T> l_columns; // Final left-flank column for each haplotype (see HapAligner::align_read_bidirectional)
+
+  size_t bytes() const {
+    return buffer_bytes(l_match) + buffer_bytes(l_insert) + buffer_bytes(l_deletion) + buffer_bytes(r_match) + buffer_bytes(r_insert)
+      + buffer_bytes(r_deletion) + buffer_bytes(log_correct) + buffer_bytes(emit_probs) + buffer_bytes(l_columns);
+  }
+};
+
+/*
+ * Storage for the arrays HapAligner uses to align reads to haplotypes. Buffers only ever grow,
+ * so once they can accommodate the longest read and largest haplotype, aligning additional reads
+ * (including those at subsequent loci) doesn't require any heap allocations. Each thread has its
+ * own workspace, as its contents are overwritten by every alignment
+ */
+class AlignmentWorkspace {
+ private:
+  AlignmentMatrices<double> double_matrices_;
+  AlignmentMatrices<float>  float_matrices_;
+
+ public:
+  DPVector<int> l_best_artifact_size, l_best_artifact_pos;
+  DPVector<int> r_best_artifact_size, r_best_artifact_pos;
+  std::vector<double> base_log_wrong, base_log_correct;
+  std::vector<double> block_probs, hap_LLs;
+  std::vector<double> stutter_probs;   // Cached stutter block alignment LLs (see HapAligner::align_seq_to_hap)
+  std::vector<int>    stutter_art_pos; // Cached artifact positions corresponding to each stutter_probs entry
+  std::vector<int> band_read_index, band_widths; // Banded alignment diagonals (see HapAligner::init_alignment_bands)
+  std::vector<int> l_band_cols, r_band_cols;     // Initialized columns in each banded matrix row, stored as (first, last) pairs
+  std::string rev_rseq;
+  TraceBuffers trace_buffers; // Operations and sequences used to retrace the optimal alignments
+
+  // Arrays for reads aligned in lockstep (see HapAligner::align_read_batch). The matrices and the log_correct and emit_probs
+  // rows are stored in lane-major order, while each read's base quality arrays and reversed right flank are stored separately
+  DPVector<double> batch_l_match, batch_l_insert, batch_l_deletion;
+  DPVector<double> batch_r_match, batch_r_insert, batch_r_deletion;
+  std::vector<double> batch_log_correct, batch_emit_probs;
+  std::vector<double> batch_base_log_wrong, batch_base_log_correct;
+  std::vector<std::string> batch_rev_rseqs;
+
+  template<typename T> AlignmentMatrices<T>& matrices();
+
+  /* Number of bytes reserved by the numeric buffers, which dominate the workspace's memory usage */
+  size_t bytes() const {
+    return double_matrices_.bytes() + float_matrices_.bytes()
+      + buffer_bytes(l_best_artifact_size) + buffer_bytes(l_best_artifact_pos) + buffer_bytes(r_best_artifact_size) + buffer_bytes(r_best_artifact_pos)
+      + buffer_bytes(base_log_wrong) + buffer_bytes(base_log_correct) + buffer_bytes(block_probs) + buffer_bytes(hap_LLs)
+      + buffer_bytes(stutter_probs) + buffer_bytes(stutter_art_pos) + buffer_bytes(band_read_index) + buffer_bytes(band_widths)
+      + buffer_bytes(l_band_cols) + buffer_bytes(r_band_cols)
+      + buffer_bytes(batch_l_match) + buffer_bytes(batch_l_insert) + buffer_bytes(batch_l_deletion)
+      + buffer_bytes(batch_r_match) + buffer_bytes(batch_r_insert) + buffer_bytes(batch_r_deletion)
+      + buffer_bytes(batch_log_correct) + buffer_bytes(batch_emit_probs) + buffer_bytes(batch_base_log_wrong) + buffer_bytes(batch_base_log_correct);
+  }
+
+  static AlignmentWorkspace& thread_workspace(){
+    static thread_local AlignmentWorkspace workspace;
+    return workspace;
+  }
+};
+
+template<> inline AlignmentMatrices<double>& AlignmentWorkspace::matrices<double>(){ return double_matrices_; }
+template<> inline AlignmentMatrices<float>&  AlignmentWorkspace::matrices<float>() { return float_matrices_;  }
+
+#endif
@@ -1,14 +1,20 @@
 #include <algorithm>
+#include <atomic>
 #include <climits>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
+#include <thread>
 
+#include "AlignmentKernels.h"
 #include "AlignmentModel.h"
 #include "AlignmentTraceback.h"
 #include "HapAligner.h"
 #include "HapBlock.h"
+#include "../error.h"
 #include "../mathops.h"
+#include "../perf_counters.h"
 #include "RepeatBlock.h"
 #include "StutterAlignerClass.h"
 
@@ -23,24 +29,99 @@ const double IMPOSSIBLE = -1000000000;
 // is above this threshold
 const double MIN_SNP_LOG_PROB_CORRECT = -0.0043648054;
 
-void HapAligner::align_seq_to_hap(Haplotype* haplotype, bool reuse_alns,
+// Single-precision LLs are recomputed in double precision if any two haplotypes' LLs are within this margin
+const double SINGLE_PRECISION_LL_MARGIN = 0.1;
+
+// Minimum half-width of the band used for banded alignments, which accommodates flank indels absent from the read's CIGAR string
+const int BAND_MARGIN = 8;
+
+// Banded alignments are recomputed using the full matrices if the best haplotype's LL
+// is more than this margin below the LL of an alignment in which every base matches
+const double BANDED_LL_MARGIN = 15;
+
+// When pruning is enabled, a read's second flank isn't aligned to a haplotype if an upper bound on the haplotype's LL
+// is more than this margin below the best LL among the haplotypes aligned so far. The haplotype is assigned the bound instead
+const double PRUNE_LL_MARGIN = 15;
+
+// Minimum number of reads aligned by each thread when a locus's reads are split across idle threads,
+// and the number of reads claimed by a thread at a time
+const int MIN_READS_PER_THREAD = 500;
+const int READ_CHUNK_SIZE      = 16;
+
+template<typename T>
+void HapAligner::align_seq_to_hap(Haplotype* haplotype, int first_block,
 				  const char* seq_0, int seq_len, const double* base_log_wrong, const double* base_log_correct,
-				  double* match_matrix, double* insert_matrix, double* deletion_matrix,
+				  T* match_matrix, T* insert_matrix, T* deletion_matrix,
 				  int* best_artifact_size, int* best_artifact_pos, double& left_prob){
+  PerfScope perf_scope(PERF_HAP_ALIGNMENT);
+  // Row kernel used to fill the alignment matrices for non-stutter haplotype bases, selected once based on the CPU
+  static const AlignRowKernel<T> align_row = select_align_row_kernel<T>();
+
   // NOTE: Input matrix structure: Row = Haplotype position, Column = Read index
-  double* L_log_probs = new double[seq_len];
+
+  // Match emission probabilities for each read base, computed once for each haplotype character
+  std::vector<T>& log_correct = workspace_->matrices<T>().log_correct;
+  std::vector<T>& emit_probs  = workspace_->matrices<T>().emit_probs;
+  log_correct.assign(base_log_correct, base_log_correct+seq_len);
+  emit_probs.clear();
+  int emit_offsets[256];
+  std::fill(emit_offsets, emit_offsets+256, -1);
  
+  // For banded alignments, the (first, last) columns of each row that have been initialized. Cells outside of a row's
+  // band are only assigned IMPOSSIBLE once a subsequent row needs to read them
+  int* band_cols = (!use_bands_ ? NULL : (haplotype->reversed() ? workspace_->r_band_cols.data() : workspace_->l_band_cols.data()));
+  auto init_row_cells = [&](int row, int start, int end){
+    T* match = match_matrix + seq_len*row, *del = deletion_matrix + seq_len*row;
+    start    = std::max(0, start);
+    end      = std::min(seq_len-1, end);
+    for (int j = start; j <= std::min(end, band_cols[2*row]-1); ++j)
+      match[j] = del[j] = IMPOSSIBLE;
+    for (int j = std::max(start, band_cols[2*row+1]+1); j <= end; ++j)
+      match[j] = del[j] = IMPOSSIBLE;
+  };
+  auto set_band_guard = [&](int row, int col){
+    if (col >= 0 && col < seq_len)
+      match_matrix[seq_len*row+col] = insert_matrix[seq_len*row+col] = deletion_matrix[seq_len*row+col] = IMPOSSIBLE;
+  };
+  auto finish_band_row = [&](int row, int band_start, int band_end){
+    set_band_guard(row, band_start-1);
+    set_band_guard(row, band_end+1);
+    band_cols[2*row]   = std::max(0, band_start-1);
+    band_cols[2*row+1] = std::min(seq_len-1, band_end+1);
+    if (band_cols[2*row] > seq_len-1 || band_cols[2*row+1] < seq_len-1)
+      match_matrix[seq_len*row+seq_len-1] = IMPOSSIBLE; // The final column is always required to combine the two flanks
+  };
+  auto set_full_row = [&](int row){
+    band_cols[2*row]   = 0;
+    band_cols[2*row+1] = seq_len-1;
+  };
+
   // Initialize first row of matrix (each base position matched with leftmost haplotype base)
   left_prob = 0.0;
   char first_hap_base = haplotype->get_first_char();
-  for (int j = 0; j < seq_len; ++j){
-    match_matrix[j]    = (seq_0[j] == first_hap_base ? base_log_correct[j] : base_log_wrong[j]) + left_prob;
-    insert_matrix[j]   = base_log_correct[j] + left_prob;
-    deletion_matrix[j] = IMPOSSIBLE;
-    left_prob         += base_log_correct[j];
-    L_log_probs[j]     = left_prob;
+  if (use_bands_){
+    int band_start, band_end;
+    get_row_band(haplotype->reversed(), haplotype->get_block(0)->start(), seq_len, band_start, band_end);
+    for (int j = 0; j < seq_len; ++j){
+      if (j >= band_start && j <= band_end){
+	match_matrix[j]    = (seq_0[j] == first_hap_base ? base_log_correct[j] : base_log_wrong[j]) + left_prob;
+	insert_matrix[j]   = base_log_correct[j] + left_prob;
+	deletion_matrix[j] = IMPOSSIBLE;
+      }
+      left_prob += base_log_correct[j];
+    }
+    finish_band_row(0, band_start, band_end);
+  }
+  else {
+    for (int j = 0; j < seq_len; ++j){
+      match_matrix[j]    = (seq_0[j] == first_hap_base ? base_log_correct[j] : base_log_wrong[j]) + left_prob;
+      insert_matrix[j]   = base_log_correct[j] + left_prob;
+      deletion_matrix[j] = IMPOSSIBLE;
+      left_prob         += base_log_correct[j];
+    }
   }
 
+  const MatchTransitions* match_transitions = get_match_transitions(haplotype);
   int haplotype_index = 1;
   int matrix_index    = seq_len;
   int stutter_R       = -1; // Haplotype index for right boundary of most recent stutter block
@@ -50,14 +131,15 @@ void HapAligner::align_seq_to_hap(Haplotype* haplotype, bool reuse_alns,
     const std::string& block_seq = haplotype->get_seq(block_index);
     bool stutter_block           = (haplotype->get_block(block_index)->get_repeat_info()) != NULL;
 
-    // Skip any blocks to the left of the last changed block (as we can reuse the alignments)
-    if (reuse_alns && block_index < haplotype->last_changed()){
+    // Skip any blocks to the left of the first changed block (as we can reuse the alignments)
+    if (block_index < first_block){
       haplotype_index += block_seq.size() + (block_index == 0 ? -1 : 0);
       matrix_index     = seq_len*haplotype_index;
       if (stutter_block)
 	stutter_R = haplotype_index - 1;
       continue;
     }
+    num_dp_cells_ += (int64_t)block_seq.size()*seq_len;
 
     if (stutter_block){
       int* artifact_size_ptr = best_artifact_size + seq_len*block_index;
@@ -70,25 +152,49 @@ void HapAligner::align_seq_to_hap(Haplotype* haplotype, bool reuse_alns,
       int prev_row_index            = seq_len*(haplotype_index-1);            // Index into matrix for haplotype character preceding stutter block (column = 0) 
       matrix_index                  = seq_len*(haplotype_index+block_len-1);  // Index into matrix for rightmost character in stutter block (column = 0)
       int num_stutter_artifacts     = (rep_info->max_insertion()-rep_info->max_deletion())/period + 1;
-      StutterAlignerClass* stutter_aligner = haplotype->get_block(block_index)->get_stutter_aligner(block_option);
-      stutter_aligner->load_read(seq_len, seq_0+seq_len-1, base_log_wrong+seq_len-1, base_log_correct+seq_len-1, rep_info->max_deletion(), rep_info->max_insertion());
 
-      std::vector<double> block_probs(num_stutter_artifacts); // Reuse in each iteration to avoid reallocation penalty
-      int offset = seq_len-1;
-      for (int j = 0; j < seq_len; ++j, ++matrix_index, --offset){
+      // The stutter block's row depends on every column of the preceding row
+      if (use_bands_){
+	init_row_cells(haplotype_index-1, 0, seq_len-1);
+	set_full_row(haplotype_index+block_len-1);
+      }
+
+      // Align the read to the stutter region for each artifact size, unless this flank was already aligned to the block option
+      int slot                  = stutter_slots_[(haplotype == rev_haplotype_ ? haplotype->num_blocks() : 0) + block_index] + block_option;
+      double* stutter_probs     = workspace_->stutter_probs.data()   + ((size_t)slot)*stutter_cache_stride_;
+      int* stutter_art_pos      = workspace_->stutter_art_pos.data() + ((size_t)slot)*stutter_cache_stride_;
+      assert(seq_len*num_stutter_artifacts <= stutter_cache_stride_);
+      if (!stutter_cache_valid_[slot]){
+	StutterAlignerClass* stutter_aligner = haplotype->get_block(block_index)->get_stutter_aligner(block_option);
+	stutter_aligner->load_read(seq_len, seq_0+seq_len-1, base_log_wrong+seq_len-1, base_log_correct+seq_len-1, rep_info->max_deletion(), rep_info->max_insertion());
+	int offset = seq_len-1, cache_index = 0;
+	for (int j = 0; j < seq_len; ++j, --offset){
+	  for (int artifact_size = rep_info->max_deletion(); artifact_size <= rep_info->max_insertion(); artifact_size += period, ++cache_index){
+	    int base_len = std::min(block_len+artifact_size, j+1);
+	    stutter_art_pos[cache_index] = -1;
+	    stutter_probs[cache_index]   = stutter_aligner->align_stutter_region_reverse(base_len, seq_0+j, offset, base_log_wrong+j, base_log_correct+j,
+											 artifact_size, stutter_art_pos[cache_index]);
+	  }
+	}
+	stutter_cache_valid_[slot] = true;
+      }
+
+      std::vector<double>& block_probs = workspace_->block_probs; // Reuse in each iteration to avoid reallocation penalty
+      block_probs.resize(num_stutter_artifacts);
+      const double* artifact_log_probs = rep_info->artifact_log_probs(block_option);
+      int cache_index = 0;
+      for (int j = 0; j < seq_len; ++j, ++matrix_index){
 	// Consider valid range of insertions and deletions, including no stutter artifact
 	int art_idx    = 0;
 	double best_LL = IMPOSSIBLE;
 	artifact_size_ptr[j] = -10000;
-	for (int artifact_size = rep_info->max_deletion(); artifact_size <= rep_info->max_insertion(); artifact_size += period){
-	  int art_pos          = -1;
+	for (int artifact_size = rep_info->max_deletion(); artifact_size <= rep_info->max_insertion(); artifact_size += period, ++cache_index){
 	  int base_len         = std::min(block_len+artifact_size, j+1);
-	  double prob          = stutter_aligner->align_stutter_region_reverse(base_len, seq_0+j, offset, base_log_wrong+j, base_log_correct+j, artifact_size, art_pos);
 	  double pre_prob      = (j-base_len < 0 ? 0 : match_matrix[j-base_len + prev_row_index]);
-	  block_probs[art_idx] = rep_info->log_prob_pcr_artifact(block_option, artifact_size) + prob + pre_prob;
+	  block_probs[art_idx] = artifact_log_probs[art_idx] + stutter_probs[cache_index] + pre_prob;
 	  if (block_probs[art_idx] > best_LL){
 	    artifact_size_ptr[j] = artifact_size;
-	    artifact_pos_ptr[j]  = art_pos;
+	    artifact_pos_ptr[j]  = stutter_art_pos[cache_index];
 	    best_LL              = block_probs[art_idx];
 	  }
 	  art_idx++;
@@ -105,19 +211,49 @@ void HapAligner::align_seq_to_hap(Haplotype* haplotype, bool reuse_alns,
     }
     else {
       // Handle normal n -> n-1 transitions while preventing sequencing indels from extending into preceding stutter blocks
-      int coord_index      = (block_index == 0 ? 1 : 0);
-      int homopolymer_len  = haplotype->homopolymer_length(block_index, std::max(0, coord_index-1));
-
+      int coord_index = (block_index == 0 ? 1 : 0);
       for (; coord_index < block_seq.size(); ++coord_index, ++haplotype_index){
 	assert(matrix_index == seq_len*haplotype_index);
 	char hap_char = block_seq[coord_index];
-	
-	// Update the homopolymer tract length
-	homopolymer_len = std::min(MAX_HOMOP_LEN, std::max(haplotype->homopolymer_length(block_index, coord_index),
-							   haplotype->homopolymer_length(block_index, std::max(0, coord_index-1))));
+	int& emit_offset = emit_offsets[(unsigned char)hap_char];
+	if (emit_offset == -1){
+	  emit_offset = emit_probs.size();
+	  for (int j = 0; j < seq_len; ++j)
+	    emit_probs.push_back(seq_0[j] == hap_char ? base_log_correct[j] : base_log_wrong[j]);
+	}
+	const T* match_emit = emit_probs.data() + emit_offset;
+	const MatchTransitions& transitions = match_transitions[haplotype_index];
+
+	// Only compute the entries in the read's band, except for the row following a stutter block, which is always computed in full
+	if (use_bands_ && haplotype_index != stutter_R+1){
+	  int band_start, band_end;
+	  int32_t ref_pos = haplotype->get_block(block_index)->start() + (haplotype->reversed() ? -coord_index : coord_index);
+	  get_row_band(haplotype->reversed(), ref_pos, seq_len, band_start, band_end);
+	  init_row_cells(haplotype_index-1, band_start-1, band_end);
+	  if (band_start <= band_end){
+	    int first_col = std::max(0, band_start-1);
+	    if (band_start == 0){
+	      match_matrix[matrix_index]    = match_emit[0];
+	      insert_matrix[matrix_index]   = base_log_correct[0];
+	      deletion_matrix[matrix_index] = std::max(deletion_matrix[matrix_index-seq_len]+LOG_DEL_TO_DEL, match_matrix[matrix_index-seq_len]+LOG_DEL_TO_MATCH);
+	    }
+	    else
+	      set_band_guard(haplotype_index, first_col);
+	    int prev_index = matrix_index + first_col - seq_len;
+	    align_row(band_end-first_col+1, match_emit+first_col, log_correct.data()+first_col,
+		      (T)transitions.to_match, (T)transitions.to_ins, (T)transitions.to_del,
+		      match_matrix+prev_index, deletion_matrix+prev_index,
+		      match_matrix+matrix_index+first_col, insert_matrix+matrix_index+first_col, deletion_matrix+matrix_index+first_col);
+	  }
+	  finish_band_row(haplotype_index, band_start, band_end);
+	  matrix_index += seq_len;
+	  continue;
+	}
+	if (use_bands_)
+	  set_full_row(haplotype_index);
 
 	// Boundary conditions for leftmost base in read
-	match_matrix[matrix_index]    = (seq_0[0] == hap_char ? base_log_correct[0] : base_log_wrong[0]);
+	match_matrix[matrix_index]    = match_emit[0];
 	insert_matrix[matrix_index]   = (haplotype_index == stutter_R+1 ? IMPOSSIBLE : base_log_correct[0]);
 	deletion_matrix[matrix_index] = (haplotype_index == stutter_R+1 ? IMPOSSIBLE :
 					 std::max(deletion_matrix[matrix_index-seq_len]+LOG_DEL_TO_DEL, match_matrix[matrix_index-seq_len]+LOG_DEL_TO_MATCH));
@@ -127,102 +263,284 @@ void HapAligner::align_seq_to_hap(Haplotype* haplotype, bool reuse_alns,
 	if (haplotype_index == stutter_R + 1){
 	  int prev_match_index = matrix_index - seq_len - 1;
 	  for (int j = 1; j < seq_len; ++j, ++matrix_index, ++prev_match_index){
-	    double match_emit             = (seq_0[j] == hap_char ? base_log_correct[j] : base_log_wrong[j]);
-	    match_matrix[matrix_index]    = match_emit + match_matrix[prev_match_index];
+	    match_matrix[matrix_index]    = match_emit[j] + match_matrix[prev_match_index];
 	    insert_matrix[matrix_index]   = IMPOSSIBLE;
 	    deletion_matrix[matrix_index] = IMPOSSIBLE;
 	  }
 	  continue;
 	}
 
-	std::vector<double> match_probs; match_probs.reserve(3); // Reuse for each iteration to avoid reallocation penalty
-	for (int j = 1; j < seq_len; ++j, ++matrix_index){
-	  // Compute all match-related deletion probabilities (including normal read extension, where k = 1)
-	  match_probs.push_back(insert_matrix[matrix_index-1]           + LOG_MATCH_TO_INS[homopolymer_len]);
-	  match_probs.push_back(match_matrix[matrix_index-seq_len-1]    + LOG_MATCH_TO_MATCH[homopolymer_len]);
-	  match_probs.push_back(deletion_matrix[matrix_index-seq_len-1] + LOG_MATCH_TO_DEL[homopolymer_len]);
-
-	  double match_emit             = (seq_0[j] == hap_char ? base_log_correct[j] : base_log_wrong[j]);
-	  match_matrix[matrix_index]    = match_emit          + std::max(match_probs[0], std::max(match_probs[1], match_probs[2]));
-	  insert_matrix[matrix_index]   = base_log_correct[j] + std::max(match_matrix[matrix_index-seq_len-1] + LOG_INS_TO_MATCH,
-									insert_matrix[matrix_index-1]         + LOG_INS_TO_INS);
-	  deletion_matrix[matrix_index] = std::max(match_matrix[matrix_index-seq_len]    + LOG_DEL_TO_MATCH,
-						   deletion_matrix[matrix_index-seq_len] + LOG_DEL_TO_DEL);
-	  match_probs.clear();
-	}	
+	// Fill in the remainder of the row using the fastest kernel supported by the CPU
+	int prev_index = matrix_index - 1 - seq_len;
+	align_row(seq_len, match_emit, log_correct.data(),
+		  (T)transitions.to_match, (T)transitions.to_ins, (T)transitions.to_del,
+		  match_matrix+prev_index, deletion_matrix+prev_index,
+		  match_matrix+matrix_index-1, insert_matrix+matrix_index-1, deletion_matrix+matrix_index-1);
+	matrix_index += seq_len-1;	
       }
     }
   }
-  delete [] L_log_probs;
   assert(haplotype_index == haplotype->cur_size());
 }
 
-double HapAligner::compute_aln_logprob(int base_seq_len, int seed_base,
-				       char seed_char, double log_seed_wrong, double log_seed_correct,
-				       double* l_match_matrix, double* l_insert_matrix, double* l_deletion_matrix, double l_prob,
-				       double* r_match_matrix, double* r_insert_matrix, double* r_deletion_matrix, double r_prob,
-				       int& max_index){
-  int lflank_len = seed_base;
-  int rflank_len = base_seq_len-seed_base-1;
-  int hapsize    = fw_haplotype_->cur_size();
-
-  // Compute number of viable seed positions and the corresponding uniform prior
-  int num_seeds = 0;
-  for (int block_index = 0; block_index < fw_haplotype_->num_blocks(); block_index++)
-    if (fw_haplotype_->get_block(block_index)->get_repeat_info() == NULL)
-      num_seeds += fw_haplotype_->get_seq(block_index).size();
-  double SEED_LOG_MATCH_PRIOR = -int_log(num_seeds);
-  
-  double max_LL;
-  std::vector<double> log_probs;
-  // Left flank entirely outside of haplotype window, seed aligned with 0   
-  log_probs.push_back(SEED_LOG_MATCH_PRIOR + (seed_char == fw_haplotype_->get_first_char() ? log_seed_correct: log_seed_wrong)
-		      + l_prob + r_match_matrix[rflank_len*(hapsize-1)-1]);
-  max_index = 0;
-  max_LL    = log_probs[0];
+void HapAligner::align_seqs_to_hap_batch(Haplotype* haplotype, int first_block, const char* const* seqs, const int* seq_lens, int max_seq_len,
+					 const double* const* base_log_wrong, const double* const* base_log_correct,
+					 double* match_matrix, double* insert_matrix, double* deletion_matrix, double* left_probs){
+  PerfScope perf_scope(PERF_HAP_ALIGNMENT);
+  static const AlignBatchRowKernel align_row = select_align_batch_row_kernel();
+  const int L    = ALIGN_BATCH_LANES;
+  const int ROW  = L*max_seq_len; // Number of entries in each lane-major matrix row
+
+  // Lane-major base quality and match emission rows. Columns beyond a lane's sequence are padded with zeros
+  std::vector<double>& log_correct = workspace_->batch_log_correct;
+  std::vector<double>& emit_probs  = workspace_->batch_emit_probs;
+  log_correct.assign(ROW, 0.0);
+  for (int lane = 0; lane < L; lane++)
+    for (int j = 0; j < seq_lens[lane]; ++j)
+      log_correct[j*L + lane] = base_log_correct[lane][j];
+  emit_probs.clear();
+  int emit_offsets[256];
+  std::fill(emit_offsets, emit_offsets+256, -1);
 
-  // Right flank entirely outside of haplotype window, seed aligned with n-1
-  log_probs.push_back(SEED_LOG_MATCH_PRIOR + (seed_char == fw_haplotype_->get_last_char() ? log_seed_correct: log_seed_wrong)
-		      + r_prob + l_match_matrix[lflank_len*(hapsize-1)-1]);
-  if (log_probs[1] > max_LL){
-    max_index = fw_haplotype_->cur_size()-1;
-    max_LL    = log_probs[1];
+  // Initialize first row of matrix (each base position matched with leftmost haplotype base)
+  char first_hap_base = haplotype->get_first_char();
+  for (int lane = 0; lane < L; lane++){
+    double left_prob = 0.0;
+    for (int j = 0; j < max_seq_len; ++j){
+      int index = j*L + lane;
+      if (j < seq_lens[lane]){
+	match_matrix[index]    = (seqs[lane][j] == first_hap_base ? base_log_correct[lane][j] : base_log_wrong[lane][j]) + left_prob;
+	insert_matrix[index]   = base_log_correct[lane][j] + left_prob;
+	deletion_matrix[index] = IMPOSSIBLE;
+	left_prob             += base_log_correct[lane][j];
+      }
+      else
+	match_matrix[index] = insert_matrix[index] = deletion_matrix[index] = IMPOSSIBLE;
+    }
+    left_probs[lane] = left_prob;
   }
 
-  // NOTE: Rationale for matrix indices:
-  // lflank_len-1 with i-1 = lflank_len-1 with i-1 = lflank_len*(i-1) + lflank_len-1  = lflank_len*i - 1 ;
-  // rflank_len-1 with i+1 = rflank_len-1 with hap_size-1-(i+1)       = rflank_len-1 with (hap_size-i-2) 
-  //                       = rflank_len*(hap_size-i-2) + rflank_len-1 = rflank_len*(hap_size-i-1) -1;
+  const MatchTransitions* match_transitions = get_match_transitions(haplotype);
+  int haplotype_index = 1;
+  int stutter_R       = -1; // Haplotype index for right boundary of most recent stutter block
 
-  // Seed base aligned with each haplotype base
-  double* l_match_ptr  = l_match_matrix  + (lflank_len - 1);
-  double* r_match_ptr  = r_match_matrix  + (rflank_len*(hapsize-2) - 1);
-  int hap_index = 1;
-  for (int block_index = 0; block_index < fw_haplotype_->num_blocks(); ++block_index){
-    const std::string& block_seq = fw_haplotype_->get_seq(block_index);
-    bool stutter_block           = fw_haplotype_->get_block(block_index)->get_repeat_info() != NULL;
-    if (stutter_block){
-      // Update matrix pointers
-      l_match_ptr += lflank_len*block_seq.size();
-      r_match_ptr -= rflank_len*block_seq.size();
-      hap_index   += block_seq.size();
+  // Fill in matrix row by row, iterating through each haplotype block
+  for (int block_index = 0; block_index < haplotype->num_blocks(); block_index++){
+    const std::string& block_seq = haplotype->get_seq(block_index);
+    bool stutter_block           = (haplotype->get_block(block_index)->get_repeat_info()) != NULL;
+
+    // Skip any blocks to the left of the first changed block (as we can reuse the alignments)
+    if (block_index < first_block){
+      haplotype_index += block_seq.size() + (block_index == 0 ? -1 : 0);
+      if (stutter_block)
+	stutter_R = haplotype_index - 1;
       continue;
     }
+    num_dp_cells_ += (int64_t)block_seq.size()*ROW;
+
+    if (stutter_block){
+      RepeatStutterInfo* rep_info = haplotype->get_block(block_index)->get_repeat_info();
+      int period                  = rep_info->get_period();
+      int block_option            = haplotype->cur_index(block_index);
+      int block_len               = block_seq.size();
+      double* prev_match_row      = match_matrix + ROW*(haplotype_index-1);
+      size_t row_index            = ((size_t)ROW)*(haplotype_index+block_len-1);
+      int num_stutter_artifacts   = (rep_info->max_insertion()-rep_info->max_deletion())/period + 1;
+
+      // Align each lane's sequence to the stutter region for each artifact size, unless it was already aligned to the block option
+      int slot = stutter_slots_[(haplotype == rev_haplotype_ ? haplotype->num_blocks() : 0) + block_index] + block_option;
+      assert(max_seq_len*num_stutter_artifacts <= stutter_cache_stride_);
+      bool cached = stutter_cache_valid_[slot];
+      stutter_cache_valid_[slot] = true;
+
+      std::vector<double>& block_probs = workspace_->block_probs;
+      block_probs.resize(num_stutter_artifacts);
+      const double* artifact_log_probs = rep_info->artifact_log_probs(block_option);
+      for (int lane = 0; lane < L; lane++){
+	int seq_len           = seq_lens[lane];
+	const char* seq_0     = seqs[lane];
+	double* stutter_probs = workspace_->stutter_probs.data()   + (((size_t)slot)*L + lane)*stutter_cache_stride_;
+	int* stutter_art_pos  = workspace_->stutter_art_pos.data() + (((size_t)slot)*L + lane)*stutter_cache_stride_;
+	if (!cached){
+	  StutterAlignerClass* stutter_aligner = haplotype->get_block(block_index)->get_stutter_aligner(block_option);
+	  stutter_aligner->load_read(seq_len, seq_0+seq_len-1, base_log_wrong[lane]+seq_len-1, base_log_correct[lane]+seq_len-1,
+				     rep_info->max_deletion(), rep_info->max_insertion());
+	  int offset = seq_len-1, cache_index = 0;
+	  for (int j = 0; j < seq_len; ++j, --offset){
+	    for (int artifact_size = rep_info->max_deletion(); artifact_size <= rep_info->max_insertion(); artifact_size += period, ++cache_index){
+	      int base_len = std::min(block_len+artifact_size, j+1);
+	      stutter_art_pos[cache_index] = -1;
+	      stutter_probs[cache_index]   = stutter_aligner->align_stutter_region_reverse(base_len, seq_0+j, offset, base_log_wrong[lane]+j,
+											   base_log_correct[lane]+j, artifact_size, stutter_art_pos[cache_index]);
+	    }
+	  }
+	}
+
+	int cache_index = 0;
+	for (int j = 0; j < max_seq_len; ++j){
+	  size_t index = row_index + j*L + lane;
+	  insert_matrix[index] = deletion_matrix[index] = IMPOSSIBLE;
+	  if (j >= seq_len){
+	    match_matrix[index] = IMPOSSIBLE;
+	    continue;
+	  }
+
+	  // Consider valid range of insertions and deletions, including no stutter artifact
+	  int art_idx = 0;
+	  for (int artifact_size = rep_info->max_deletion(); artifact_size <= rep_info->max_insertion(); artifact_size += period, ++cache_index){
+	    int base_len         = std::min(block_len+artifact_size, j+1);
+	    double pre_prob      = (j-base_len < 0 ? 0 : prev_match_row[(j-base_len)*L + lane]);
+	    block_probs[art_idx] = artifact_log_probs[art_idx] + stutter_probs[cache_index] + pre_prob;
+	    art_idx++;
+	  }
+	  match_matrix[index] = fast_log_sum_exp(block_probs);
+	}
+      }
+
+      // Adjust indices appropriately
+      stutter_R         = haplotype_index + block_len - 1;
+      haplotype_index  += block_len;
+    }
     else {
-      int coord_index     = (block_index == 0 ? 1 : 0); // Avoid situation where seed is aligned with first base
-      int end_coord_index = (block_index == fw_haplotype_->num_blocks()-1 ? block_seq.size()-1 : block_seq.size()); // Avoid situation where seed is aligned with last base
-      for (; coord_index < end_coord_index; ++coord_index, ++hap_index){
-	log_probs.push_back(SEED_LOG_MATCH_PRIOR + (seed_char == block_seq[coord_index] ? log_seed_correct : log_seed_wrong) + *l_match_ptr + *r_match_ptr);
-	if (log_probs.back() > max_LL){
-	  max_index = hap_index;
-	  max_LL    = log_probs.back();
+      // Handle normal n -> n-1 transitions while preventing sequencing indels from extending into preceding stutter blocks
+      int coord_index = (block_index == 0 ? 1 : 0);
+      for (; coord_index < block_seq.size(); ++coord_index, ++haplotype_index){
+	char hap_char = block_seq[coord_index];
+	int& emit_offset = emit_offsets[(unsigned char)hap_char];
+	if (emit_offset == -1){
+	  emit_offset = emit_probs.size();
+	  emit_probs.resize(emit_offset + ROW, 0.0);
+	  for (int lane = 0; lane < L; lane++)
+	    for (int j = 0; j < seq_lens[lane]; ++j)
+	      emit_probs[emit_offset + j*L + lane] = (seqs[lane][j] == hap_char ? base_log_correct[lane][j] : base_log_wrong[lane][j]);
+	}
+	const double* match_emit = emit_probs.data() + emit_offset;
+	const MatchTransitions& transitions = match_transitions[haplotype_index];
+
+	size_t row_index      = ((size_t)ROW)*haplotype_index;
+	double* cur_match     = match_matrix    + row_index;
+	double* cur_insert    = insert_matrix   + row_index;
+	double* cur_del       = deletion_matrix + row_index;
+	const double* prev_match = cur_match - ROW;
+	const double* prev_del   = cur_del   - ROW;
+
+	// Boundary conditions for leftmost base in read
+	for (int lane = 0; lane < L; lane++){
+	  cur_match[lane]  = match_emit[lane];
+	  cur_insert[lane] = (haplotype_index == stutter_R+1 ? IMPOSSIBLE : log_correct[lane]);
+	  cur_del[lane]    = (haplotype_index == stutter_R+1 ? IMPOSSIBLE : std::max(prev_del[lane]+LOG_DEL_TO_DEL, prev_match[lane]+LOG_DEL_TO_MATCH));
+	}
+
+	// Stutter block must be followed by a match
+	if (haplotype_index == stutter_R + 1){
+	  for (int i = L; i < ROW; ++i){
+	    cur_match[i]  = match_emit[i] + prev_match[i-L];
+	    cur_insert[i] = IMPOSSIBLE;
+	    cur_del[i]    = IMPOSSIBLE;
+	  }
+	  continue;
 	}
-	l_match_ptr += lflank_len;
-	r_match_ptr -= rflank_len;
+
+	align_row(max_seq_len, match_emit, log_correct.data(),
+		  transitions.to_match, transitions.to_ins, transitions.to_del,
+		  prev_match, prev_del, cur_match, cur_insert, cur_del);
+      }
+    }
+  }
+  assert(haplotype_index == haplotype->cur_size());
+}
+
+template<typename T>
+double HapAligner::flank_LL_bound(const T* match_column, int stride, double flank_prob, double log_seed_wrong, double log_seed_correct){
+  int hapsize = fw_haplotype_->cur_size();
+
+  // Every term in compute_aln_logprob() combines an entry of the flank's final column (or its unaligned LL) with a non-positive LL
+  // for the other flank. The log-sum-exp of at most HAPSIZE+1 such terms is bounded using the maximum entry
+  double max_LL = flank_prob;
+  for (int i = 0; i < hapsize-1; i++)
+    max_LL = std::max(max_LL, (double)match_column[stride*i]);
+  return get_seed_layout().log_prior + std::max(log_seed_wrong, log_seed_correct) + max_LL + int_log(hapsize+1);
+}
+
+const HapAligner::SeedLayout& HapAligner::get_seed_layout(){
+  SeedLayout& layout = seed_layouts_[fw_haplotype_->cur_index()];
+  if (layout.num_seeds >= 0)
+    return layout;
+
+  // The seed can be aligned with any non-stutter position, but the first and last positions are handled separately
+  layout.num_seeds = 0;
+  int hap_index    = 0;
+  for (int block_index = 0; block_index < fw_haplotype_->num_blocks(); block_index++){
+    const std::string& block_seq = fw_haplotype_->get_seq(block_index);
+    if (fw_haplotype_->get_block(block_index)->get_repeat_info() == NULL){
+      layout.num_seeds   += block_seq.size();
+      int coord_index     = (block_index == 0 ? 1 : 0);
+      int end_coord_index = (block_index == fw_haplotype_->num_blocks()-1 ? block_seq.size()-1 : block_seq.size());
+      for (; coord_index < end_coord_index; ++coord_index){
+	layout.hap_indices.push_back(hap_index + coord_index);
+	layout.chars.push_back(block_seq[coord_index]);
       }
     }
+    hap_index += block_seq.size();
+  }
+  layout.log_prior = -int_log(layout.num_seeds);
+  return layout;
+}
+
+template<typename T>
+double HapAligner::compute_aln_logprob(int base_seq_len, int seed_base,
+				       char seed_char, double log_seed_wrong, double log_seed_correct,
+				       const T* l_match_column, int l_stride, double l_prob,
+				       const T* r_match_column, int r_stride, double r_prob,
+				       int& max_index){
+  int hapsize = fw_haplotype_->cur_size();
+  const SeedLayout& layout = get_seed_layout();
+  const double SEED_LOG_MATCH_PRIOR = layout.log_prior;
+
+  // Left flank entirely outside of haplotype window, seed aligned with 0
+  double first_LL = SEED_LOG_MATCH_PRIOR + (seed_char == fw_haplotype_->get_first_char() ? log_seed_correct: log_seed_wrong)
+    + l_prob + r_match_column[r_stride*(hapsize-2)];
+
+  // Right flank entirely outside of haplotype window, seed aligned with n-1
+  double last_LL = SEED_LOG_MATCH_PRIOR + (seed_char == fw_haplotype_->get_last_char() ? log_seed_correct: log_seed_wrong)
+    + r_prob + l_match_column[l_stride*(hapsize-2)];
+
+  // NOTE: Rationale for column indices:
+  // lflank_len-1 with i-1 = row i-1 of the left column
+  // rflank_len-1 with i+1 = rflank_len-1 with hap_size-1-(i+1) = row hap_size-i-2 of the right column
+  const int* hap_indices = layout.hap_indices.data();
+  const char* hap_chars  = layout.chars.data();
+  const int num_seeds    = layout.chars.size();
+  auto seed_LL = [&](int i){
+    return SEED_LOG_MATCH_PRIOR + (seed_char == hap_chars[i] ? log_seed_correct : log_seed_wrong)
+      + l_match_column[l_stride*(hap_indices[i]-1)] + r_match_column[r_stride*(hapsize-2-hap_indices[i])];
+  };
+
+  // Seed base aligned with each haplotype base. The terms are cheap to regenerate, so instead of storing them, the first pass
+  // finds their maximum and the second sums them relative to it, in the same order as fast_log_sum_exp() would
+  double max_LL = first_LL;
+  max_index     = 0;
+  if (last_LL > max_LL){
+    max_index = fw_haplotype_->cur_size()-1;
+    max_LL    = last_LL;
+  }
+  int max_seed = -1;
+  for (int i = 0; i < num_seeds; ++i){
+    double LL = seed_LL(i);
+    if (LL > max_LL){
+      max_seed = i;
+      max_LL   = LL;
+    }
   }
-  double total_LL = fast_log_sum_exp(log_probs);
+  if (max_seed != -1)
+    max_index = hap_indices[max_seed];
+
+  double total = 0;
+  add_weighted_fast_exp(first_LL, 1, max_LL, total);
+  add_weighted_fast_exp(last_LL,  1, max_LL, total);
+  for (int i = 0; i < num_seeds; ++i)
+    add_weighted_fast_exp(seed_LL(i), 1, max_LL, total);
+  double total_LL = fast_finish_streaming_log_sum_exp(max_LL, total);
   assert(total_LL < TOLERANCE);
   return total_LL;
 }
@@ -315,29 +633,306 @@ int HapAligner::calc_seed_base(Alignment& aln){
   return best_seed;
 }
 
+void HapAligner::init_alignment_bands(Alignment& aln, int seed_base){
+  band_ref_start_ = fw_haplotype_->get_first_block()->start();
+  band_read_len_  = (int)aln.get_sequence().size();
+  int32_t ref_end = fw_haplotype_->get_last_block()->end();
+  std::vector<int>& read_index = workspace_->band_read_index;
+  std::vector<int>& widths     = workspace_->band_widths;
+  read_index.resize(ref_end-band_ref_start_);
+
+  // Index of the read base aligned to each reference position, extrapolated beyond the ends of the alignment
+  int32_t pos = aln.get_start(), seed_pos = -1;
+  int cur_base = 0;
+  for (int32_t i = band_ref_start_; i < std::min(pos, ref_end); i++)
+    read_index[i-band_ref_start_] = i - pos;
+  for (auto cigar_iter = aln.get_cigar_list().begin(); cigar_iter != aln.get_cigar_list().end(); cigar_iter++){
+    switch(cigar_iter->get_type()){
+    case '=': case 'X':
+      for (int i = 0; i < cigar_iter->get_num(); ++i, ++pos, ++cur_base){
+	if (cur_base == seed_base)
+	  seed_pos = pos;
+	if (pos >= band_ref_start_ && pos < ref_end)
+	  read_index[pos-band_ref_start_] = cur_base;
+      }
+      break;
+    case 'D':
+      for (int i = 0; i < cigar_iter->get_num(); ++i, ++pos)
+	if (pos >= band_ref_start_ && pos < ref_end)
+	  read_index[pos-band_ref_start_] = cur_base;
+      break;
+    case 'I':
+      cur_base += cigar_iter->get_num();
+      break;
+    default:
+      printErrorAndDie("Unrecognized CIGAR char in init_alignment_bands()");
+      break;
+    }
+  }
+  for (int32_t i = std::max(pos, band_ref_start_); i < ref_end; i++)
+    read_index[i-band_ref_start_] = cur_base + (i - pos);
+  assert(seed_pos != -1);
+
+  // The read's stutter artifacts shift its alignment to the positions on the opposite side of each repeat block from the seed
+  widths.assign(read_index.size(), BAND_MARGIN);
+  for (int block_index = 0; block_index < fw_haplotype_->num_blocks(); block_index++){
+    HapBlock* block = fw_haplotype_->get_block(block_index);
+    RepeatStutterInfo* rep_info = block->get_repeat_info();
+    if (rep_info == NULL)
+      continue;
+    int max_artifact = std::max(rep_info->max_insertion(), -rep_info->max_deletion());
+    if (block->end() <= seed_pos)
+      for (int32_t i = band_ref_start_; i < block->start(); i++)
+	widths[i-band_ref_start_] += max_artifact;
+    else if (block->start() > seed_pos)
+      for (int32_t i = block->end(); i < ref_end; i++)
+	widths[i-band_ref_start_] += max_artifact;
+  }
+}
+
+void HapAligner::get_row_band(bool reversed, int32_t ref_pos, int seq_len, int& band_start, int& band_end){
+  const std::vector<int>& read_index = workspace_->band_read_index;
+  int offset = ref_pos - band_ref_start_;
+  int entry  = std::max(0, std::min((int)read_index.size()-1, offset));
+  int center = read_index[entry] + (offset - entry);
+  if (reversed)
+    center = band_read_len_-1-center; // Columns for the right flank are indexed from the end of the read
+  band_start = std::max(0, center - workspace_->band_widths[entry]);
+  band_end   = std::min(seq_len-1, center + workspace_->band_widths[entry]);
+}
+
 void HapAligner::process_reads(std::vector<Alignment>& alignments, int init_read_index, BaseQuality* base_quality, std::vector<bool>& realign_read,
-			       double* aln_probs, int* seed_positions){
+			       double* aln_probs, int* seed_positions, TaskQueue* task_queue){
   assert(alignments.size() == realign_read.size());
-  AlignmentTrace trace(fw_haplotype_->num_blocks());
-  double* prob_ptr = aln_probs + (init_read_index*fw_haplotype_->num_combs());
-  for (unsigned int i = 0; i < alignments.size(); i++){
+  checkLocusDeadline();
+  int num_reads   = (int)alignments.size();
+  int num_helpers = 0;
+  if (task_queue != NULL && num_reads >= 2*MIN_READS_PER_THREAD)
+    num_helpers = std::min(task_queue->num_idle_workers(), num_reads/MIN_READS_PER_THREAD - 1);
+
+  if (num_helpers == 0){
+    AlignmentTrace trace(fw_haplotype_->num_blocks());
+    process_read_range(alignments, 0, num_reads, init_read_index, base_quality, realign_read, aln_probs, seed_positions, trace);
+    return;
+  }
+
+  // Errors can't abandon only the current locus while the helpers are accessing this thread's data, so they're always fatal
+  LocusErrorScope fatal_errors(false);
+
+  // Each read's LLs are independent of the other reads, so threads repeatedly claim the next chunk of reads to align.
+  // The haplotypes are copied here, as the helpers can't safely read the current haplotype while this thread iterates through it
+  std::vector< std::vector<HapBlock*> > helper_blocks(num_helpers);
+  std::vector<Haplotype*> helper_haplotypes;
+  for (int i = 0; i < num_helpers; i++)
+    helper_haplotypes.push_back(fw_haplotype_->copy(helper_blocks[i]));
+
+  std::mutex helper_mutex;
+  int next_helper = 0;
+  int64_t helper_dp_cells = 0;
+  std::atomic<int> next_read(0);
+  auto align_chunks = [&](HapAligner& aligner){
+    TraceScope chunk_trace("align_read_chunks");
+    AlignmentTrace trace(fw_haplotype_->num_blocks());
+    int start;
+    while ((start = next_read.fetch_add(READ_CHUNK_SIZE)) < num_reads)
+      aligner.process_read_range(alignments, start, std::min(num_reads, start+READ_CHUNK_SIZE), init_read_index,
+				 base_quality, realign_read, aln_probs, seed_positions, trace);
+  };
+
+  std::thread::id owner_id = std::this_thread::get_id();
+  task_queue->run_job(num_helpers, [&](){
+      if (std::this_thread::get_id() == owner_id){
+	align_chunks(*this);
+	return;
+      }
+      if (next_read >= num_reads)
+	return;
+
+      Haplotype* haplotype;
+      {
+	std::lock_guard<std::mutex> lock(helper_mutex);
+	haplotype = helper_haplotypes[next_helper++];
+      }
+      // The aligner must be constructed by the thread that uses it, as it relies on the thread's workspace
+      HapAligner helper_aligner(haplotype, realign_to_hap_, single_precision_, banded_alns_, prune_alns_);
+      helper_aligner.reuse_seeds(known_seeds_);
+      align_chunks(helper_aligner);
+      std::lock_guard<std::mutex> lock(helper_mutex);
+      helper_dp_cells += helper_aligner.num_dp_cells_;
+    });
+  num_dp_cells_ += helper_dp_cells;
+
+  for (int i = 0; i < num_helpers; i++){
+    delete helper_haplotypes[i];
+    for (unsigned int j = 0; j < helper_blocks[i].size(); j++)
+      delete helper_blocks[i][j];
+  }
+}
+
+void HapAligner::process_read_range(std::vector<Alignment>& alignments, int start, int end, int init_read_index, BaseQuality* base_quality,
+				    std::vector<bool>& realign_read, double* aln_probs, int* seed_positions, AlignmentTrace& trace){
+  double* prob_ptr = aln_probs + ((init_read_index+start)*fw_haplotype_->num_combs());
+  std::vector<int> batch_reads;
+  for (int i = start; i < end; i++){
     if (!realign_read[i]){
       prob_ptr += fw_haplotype_->num_combs();
       continue;
     }
+    checkLocusDeadline();
 
-    int seed_base = calc_seed_base(alignments[i]);
-    seed_positions[init_read_index+i] = seed_base;
+    int seed_base;
+    if (known_seeds_ != NULL && (*known_seeds_)[init_read_index+i])
+      seed_base = seed_positions[init_read_index+i];
+    else {
+      seed_base = calc_seed_base(alignments[i]);
+      seed_positions[init_read_index+i] = seed_base;
+    }
     if (seed_base == -1){
       // Assign all haplotypes the same zero LL
       for (unsigned int i = 0; i < fw_haplotype_->num_combs(); ++i, ++prob_ptr)
 	*prob_ptr = 0;
     }
     else {
-      process_read(alignments[i], seed_base, base_quality, false, prob_ptr, trace);
+      if (can_batch_reads())
+	batch_reads.push_back(i);
+      else
+	process_read(alignments[i], seed_base, base_quality, false, prob_ptr, trace);
       prob_ptr += fw_haplotype_->num_combs();
     }
   }
+  if (batch_reads.empty())
+    return;
+
+  // Reads in the same batch are padded to the longest flank in each direction, so reads of the same length with similar seeds
+  // are aligned together. Any remaining reads that don't fill a complete batch are aligned individually
+  std::stable_sort(batch_reads.begin(), batch_reads.end(), [&](int i, int j){
+      int len_i = alignments[i].get_sequence().size(), len_j = alignments[j].get_sequence().size();
+      return (len_i != len_j ? len_i < len_j : seed_positions[init_read_index+i] < seed_positions[init_read_index+j]);
+    });
+  unsigned int num_batched = batch_reads.size() - batch_reads.size()%ALIGN_BATCH_LANES;
+  for (unsigned int i = 0; i < num_batched; i += ALIGN_BATCH_LANES){
+    Alignment* alns[ALIGN_BATCH_LANES];
+    int seed_bases[ALIGN_BATCH_LANES];
+    double* prob_ptrs[ALIGN_BATCH_LANES];
+    for (int lane = 0; lane < ALIGN_BATCH_LANES; lane++){
+      int read_index   = batch_reads[i+lane];
+      alns[lane]       = &alignments[read_index];
+      seed_bases[lane] = seed_positions[init_read_index+read_index];
+      prob_ptrs[lane]  = aln_probs + ((init_read_index+read_index)*fw_haplotype_->num_combs());
+    }
+    align_read_batch(alns, seed_bases, base_quality, prob_ptrs);
+  }
+  for (unsigned int i = num_batched; i < batch_reads.size(); i++){
+    int read_index = batch_reads[i];
+    process_read(alignments[read_index], seed_positions[init_read_index+read_index], base_quality, false,
+		 aln_probs + ((init_read_index+read_index)*fw_haplotype_->num_combs()), trace);
+  }
+}
+
+void HapAligner::align_read_batch(Alignment* const* alns, const int* seed_bases, BaseQuality* base_quality, double* const* prob_ptrs){
+  const int L = ALIGN_BATCH_LANES;
+  int read_lens[L], l_sizes[L], r_sizes[L];
+  int max_read_len = 0, max_l_size = 0, max_r_size = 0;
+  for (int lane = 0; lane < L; lane++){
+    assert(seed_bases[lane] != -1);
+    assert(alns[lane]->get_sequence().size() == alns[lane]->get_base_qualities().size());
+    read_lens[lane] = (int)alns[lane]->get_sequence().size();
+    l_sizes[lane]   = seed_bases[lane];
+    r_sizes[lane]   = read_lens[lane]-seed_bases[lane]-1;
+    max_read_len    = std::max(max_read_len, read_lens[lane]);
+    max_l_size      = std::max(max_l_size,   l_sizes[lane]);
+    max_r_size      = std::max(max_r_size,   r_sizes[lane]);
+  }
+
+  // Extract each read's base quality probabilities and reversed right flank exactly as process_read() does
+  double* base_log_wrong   = grow_buffer(workspace_->batch_base_log_wrong,   L*max_read_len);
+  double* base_log_correct = grow_buffer(workspace_->batch_base_log_correct, L*max_read_len);
+  std::vector<std::string>& rev_rseqs = workspace_->batch_rev_rseqs;
+  rev_rseqs.resize(L);
+  const char* l_seqs[L];
+  const char* r_seqs[L];
+  const double* l_log_wrong[L];
+  const double* l_log_correct[L];
+  const double* r_log_wrong[L];
+  const double* r_log_correct[L];
+  for (int lane = 0; lane < L; lane++){
+    const std::string& seq         = alns[lane]->get_sequence();
+    const std::string& qual_string = alns[lane]->get_base_qualities();
+    double* log_wrong   = base_log_wrong   + lane*max_read_len;
+    double* log_correct = base_log_correct + lane*max_read_len;
+    int seed_base       = seed_bases[lane];
+    rev_rseqs[lane].resize(r_sizes[lane]);
+    if (alns[lane]->has_log_probs()){
+      const double* cached_wrong   = alns[lane]->get_log_prob_errors();
+      const double* cached_correct = alns[lane]->get_log_prob_corrects();
+      std::copy(cached_wrong,   cached_wrong+seed_base+1,   log_wrong);
+      std::copy(cached_correct, cached_correct+seed_base+1, log_correct);
+      for (int j = seed_base+1; j < read_lens[lane]; j++){
+	int index = read_lens[lane]+seed_base-j;
+	log_wrong[index]   = cached_wrong[j];
+	log_correct[index] = cached_correct[j];
+	rev_rseqs[lane][read_lens[lane]-1-j] = seq[j];
+      }
+    }
+    else {
+      for (int j = 0; j < read_lens[lane]; j++){
+	int index = (j <= seed_base ? j : read_lens[lane]+seed_base-j);
+	log_wrong[index]   = base_quality->log_prob_error(qual_string[j]);
+	log_correct[index] = base_quality->log_prob_correct(qual_string[j]);
+	if (j > seed_base)
+	  rev_rseqs[lane][read_lens[lane]-1-j] = seq[j];
+      }
+    }
+    l_seqs[lane]        = seq.c_str();
+    r_seqs[lane]        = rev_rseqs[lane].c_str();
+    l_log_wrong[lane]   = log_wrong;
+    l_log_correct[lane] = log_correct;
+    r_log_wrong[lane]   = log_wrong   + seed_base + 1;
+    r_log_correct[lane] = log_correct + seed_base + 1;
+  }
+
+  // Invalidate the cached stutter block alignments. Each lane has its own entry for every slot
+  stutter_cache_stride_ = max_read_len*max_stutter_artifacts_;
+  grow_buffer(workspace_->stutter_probs,   L*stutter_cache_valid_.size()*stutter_cache_stride_);
+  grow_buffer(workspace_->stutter_art_pos, L*stutter_cache_valid_.size()*stutter_cache_stride_);
+  std::fill(stutter_cache_valid_.begin(), stutter_cache_valid_.end(), false);
+
+  int max_hap_size          = fw_haplotype_->max_size();
+  int num_hap_blocks        = fw_haplotype_->num_blocks();
+  double* l_match_matrix    = grow_buffer(workspace_->batch_l_match,    ((size_t)L)*max_l_size*max_hap_size);
+  double* l_insert_matrix   = grow_buffer(workspace_->batch_l_insert,   ((size_t)L)*max_l_size*max_hap_size);
+  double* l_deletion_matrix = grow_buffer(workspace_->batch_l_deletion, ((size_t)L)*max_l_size*max_hap_size);
+  double* r_match_matrix    = grow_buffer(workspace_->batch_r_match,    ((size_t)L)*max_r_size*max_hap_size);
+  double* r_insert_matrix   = grow_buffer(workspace_->batch_r_insert,   ((size_t)L)*max_r_size*max_hap_size);
+  double* r_deletion_matrix = grow_buffer(workspace_->batch_r_deletion, ((size_t)L)*max_r_size*max_hap_size);
+
+  // Iterate through the haplotypes exactly as align_read() does, reusing the rows for unchanged blocks
+  int fw_first_block = 0, rev_first_block = 0;
+  do {
+    fw_first_block  = std::min(fw_first_block,  fw_haplotype_->last_changed());
+    rev_first_block = std::min(rev_first_block, rev_haplotype_->last_changed());
+    int hap_index   = fw_haplotype_->cur_index();
+    if (!realign_to_hap_[hap_index])
+      continue;
+
+    double l_probs[L], r_probs[L];
+    align_seqs_to_hap_batch(fw_haplotype_, fw_first_block, l_seqs, l_sizes, max_l_size, l_log_wrong, l_log_correct,
+			    l_match_matrix, l_insert_matrix, l_deletion_matrix, l_probs);
+    align_seqs_to_hap_batch(rev_haplotype_, rev_first_block, r_seqs, r_sizes, max_r_size, r_log_wrong, r_log_correct,
+			    r_match_matrix, r_insert_matrix, r_deletion_matrix, r_probs);
+    fw_first_block = rev_first_block = num_hap_blocks;
+
+    for (int lane = 0; lane < L; lane++){
+      int seed_base = seed_bases[lane], max_index;
+      const double* log_wrong   = base_log_wrong   + lane*max_read_len;
+      const double* log_correct = base_log_correct + lane*max_read_len;
+      prob_ptrs[lane][hap_index] = compute_aln_logprob(read_lens[lane], seed_base, l_seqs[lane][seed_base], log_wrong[seed_base], log_correct[seed_base],
+						       l_match_matrix + (l_sizes[lane]-1)*L + lane, max_l_size*L, l_probs[lane],
+						       r_match_matrix + (r_sizes[lane]-1)*L + lane, max_r_size*L, r_probs[lane], max_index);
+    }
+  } while (fw_haplotype_->next() && rev_haplotype_->next());
+  fw_haplotype_->reset();
+  rev_haplotype_->reset();
 }
 
 const double TRACE_LL_TOL = 0.001;
@@ -358,14 +953,18 @@ inline int rev_triple_min_index(double v1, double v2, double v3){
 inline int     pair_min_index(double v1, double v2){ return (v1 > v2+TRACE_LL_TOL ? 0 : 1); }
 inline int rev_pair_min_index(double v1, double v2){ return (v2 > v1+TRACE_LL_TOL ? 1 : 0); }
 
-std::string HapAligner::retrace(Haplotype* haplotype, const char* read_seq, const double* base_log_correct,
-				int seq_len, int block_index, int base_index, int matrix_index,
-				double* match_matrix, double* insert_matrix, double* deletion_matrix, int* best_artifact_size, int* best_artifact_pos,
-				AlignmentTrace& trace){
+template<typename T>
+void HapAligner::retrace(Haplotype* haplotype, const char* read_seq, const double* base_log_correct,
+			 int seq_len, int block_index, int base_index, int matrix_index,
+			 T* match_matrix, T* insert_matrix, T* deletion_matrix, int* best_artifact_size, int* best_artifact_pos,
+			 AlignmentTrace& trace, std::string& aln_ops){
   const int MATCH = 0, DEL = 1, INS = 2, NONE = -1; // Types of matrices
   int seq_index   = seq_len-1;
   int matrix_type = MATCH;
-  std::stringstream aln_ss;
+
+  // The read's bases are traced from SEQ_INDEX downwards, so the bases in each block are a contiguous range of READ_SEQ. Those to the
+  // left of the seed must be reversed to restore their order, while the haplotype and read to the right of the seed are already reversed
+  bool reverse_bases = haplotype->reversed();
 
   int (*pair_index_fn)(double, double);
   int (*triple_index_fn)(double, double, double);
@@ -384,43 +983,33 @@ std::string HapAligner::retrace(Haplotype* haplotype, const char* read_seq, cons
     if (stutter_block){
       int* artifact_size_ptr = best_artifact_size + seq_len*block_index;
       int* artifact_pos_ptr  = best_artifact_pos  + seq_len*block_index;
-      std::stringstream str_ss;
       const std::string& block_seq = haplotype->get_seq(block_index);
       int block_len    = block_seq.size();
       int stutter_size = artifact_size_ptr[seq_index];
       assert(matrix_type == MATCH && base_index+1 == block_len);
 
-      int i = 0;
-      for (; i < std::min(seq_index+1, artifact_pos_ptr[seq_index]); i++){
-	aln_ss      << "M";
-	str_ss      << read_seq[seq_index-i];
-      }
+      // Append the runs of operations for the bases before, within and after the stutter artifact
+      int i = std::max(0, std::min(seq_index+1, artifact_pos_ptr[seq_index]));
+      aln_ops.append(i, 'M');
       if (artifact_size_ptr[seq_index] < 0)
-	aln_ss << std::string(-artifact_size_ptr[seq_index], 'D');
-      else
-	for (; i < std::min(seq_index+1, artifact_pos_ptr[seq_index] + artifact_size_ptr[seq_index]); i++){
-	  aln_ss      << "I";
-	  str_ss      << read_seq[seq_index-i];
-	}
-      for (; i < std::min(block_len + artifact_size_ptr[seq_index], seq_index+1); i++){
-	aln_ss      << "M";
-	str_ss      << read_seq[seq_index-i];
-      }
-      std::string str_seq = str_ss.str();
-
-      // Add STR data to trace instance
-      if (haplotype->reversed()){
-	// Alignment for sequence to right of seed. Block indexes are reversed, but alignment is correct
-	trace.add_str_data(haplotype->num_blocks()-1-block_index, stutter_size, str_seq);
-      }
+	aln_ops.append(-artifact_size_ptr[seq_index], 'D');
       else {
-	// Alignment for sequence to left of seed. Block indexes are correct, but alignment is reversed
-	std::reverse(str_seq.begin(), str_seq.end());
-	trace.add_str_data(block_index, stutter_size, str_seq);
+	int ins_end = std::max(i, std::min(seq_index+1, artifact_pos_ptr[seq_index] + artifact_size_ptr[seq_index]));
+	aln_ops.append(ins_end-i, 'I');
+	i = ins_end;
       }
+      int str_end = std::max(i, std::min(block_len + artifact_size_ptr[seq_index], seq_index+1));
+      aln_ops.append(str_end-i, 'M');
+
+      // Add STR data to trace instance. For the sequence to the right of the seed, block indexes are reversed
+      const char* str_start = read_seq + seq_index - str_end + 1;
+      if (reverse_bases)
+	trace.add_str_data(haplotype->num_blocks()-1-block_index, stutter_size, str_start, str_end, true);
+      else
+	trace.add_str_data(block_index, stutter_size, str_start, str_end, false);
 
       if (block_len + artifact_size_ptr[seq_index] >= seq_index+1)
-	return aln_ss.str(); // Sequence doesn't span stutter block
+	return; // Sequence doesn't span stutter block
       else {
 	matrix_index -= (block_len + artifact_size_ptr[seq_index] + seq_len*block_len);
 	matrix_type   = MATCH;
@@ -430,11 +1019,11 @@ std::string HapAligner::retrace(Haplotype* haplotype, const char* read_seq, cons
     else {
       int homopolymer_len     = haplotype->homopolymer_length(block_index, std::max(0, base_index-1));
       int prev_matrix_type    = NONE;
-      std::string block_seq   = haplotype->get_seq(block_index);
+      const std::string& block_seq = haplotype->get_seq(block_index);
       int32_t pos             = haplotype->get_block(block_index)->start() + (haplotype->reversed() ? -base_index : base_index);
       const int32_t increment = (haplotype->reversed() ? 1 : -1);
       int32_t indel_seq_index, indel_position;
-      std::stringstream flank_ss;
+      int flank_end = seq_index; // Index of the last read base in the block's flanking sequence
 
       // Retrace flanks while tracking any indels that occur
       // Indels are ultimately reported as (position, size) tuples, where position is the left-most
@@ -468,22 +1057,20 @@ std::string HapAligner::retrace(Haplotype* haplotype, const char* read_seq, cons
 	case MATCH:
 	  if (block_seq[base_index] != read_seq[seq_index] &&  base_log_correct[seq_index] > MIN_SNP_LOG_PROB_CORRECT)
 	    trace.add_flank_snp(pos, read_seq[seq_index]);
-	  flank_ss << read_seq[seq_index];
-	  aln_ss << "M";
+	  aln_ops.push_back('M');
 	  seq_index--;
 	  base_index--;
 	  pos += increment;
 	  break;
 	case DEL:
 	  trace.inc_flank_del();
-	  aln_ss << "D";
+	  aln_ops.push_back('D');
 	  base_index--;
 	  pos += increment;
 	  break;
 	case INS:
 	  trace.inc_flank_ins();
-	  flank_ss << read_seq[seq_index];
-	  aln_ss << "I";
+	  aln_ops.push_back('I');
 	  seq_index--;
 	  break;
 	default:
@@ -492,19 +1079,12 @@ std::string HapAligner::retrace(Haplotype* haplotype, const char* read_seq, cons
 	}
 
 	if (seq_index == -1 || (base_index == -1 && block_index == 0)){
-	  while(seq_index != -1){
-	    aln_ss << "S";
-	    seq_index--;
-	  }
-
-	  std::string flank_seq = flank_ss.str();
-	  if (haplotype->reversed())
-	    trace.add_flank_data(haplotype->num_blocks()-1-block_index, flank_seq);
-	  else {
-	    std::reverse(flank_seq.begin(), flank_seq.end());
-	    trace.add_flank_data(block_index, flank_seq);
-	  }
-	  return aln_ss.str();
+	  if (reverse_bases)
+	    trace.add_flank_data(haplotype->num_blocks()-1-block_index, read_seq+seq_index+1, flank_end-seq_index, true);
+	  else
+	    trace.add_flank_data(block_index, read_seq+seq_index+1, flank_end-seq_index, false);
+	  aln_ops.append(seq_index+1, 'S');
+	  return;
 	}
 
 	int best_opt;
@@ -556,158 +1136,450 @@ std::string HapAligner::retrace(Haplotype* haplotype, const char* read_seq, cons
 	}
       }
 
-      std::string flank_seq = flank_ss.str();
-      if (haplotype->reversed())
-	trace.add_flank_data(haplotype->num_blocks()-1-block_index, flank_seq);
-      else {
-	std::reverse(flank_seq.begin(), flank_seq.end());
-	trace.add_flank_data(block_index, flank_seq);
-      }
+      if (reverse_bases)
+	trace.add_flank_data(haplotype->num_blocks()-1-block_index, read_seq+seq_index+1, flank_end-seq_index, true);
+      else
+	trace.add_flank_data(block_index, read_seq+seq_index+1, flank_end-seq_index, false);
     }
     base_index = haplotype->get_seq(--block_index).size()-1;
   }
-  return aln_ss.str();
 }
 
-void HapAligner::process_read(Alignment& aln, int seed_base, BaseQuality* base_quality, bool retrace_aln,
-			      double* prob_ptr, AlignmentTrace& trace){
-  assert(seed_base != -1);
-  assert(aln.get_sequence().size() == aln.get_base_qualities().size());
+void HapAligner::init_fw_order_haplotype(){
+  int num_variable_blocks = 0;
+  for (int i = 0; i < fw_haplotype_->num_blocks(); i++)
+    if (fw_haplotype_->num_options(i) > 1)
+      num_variable_blocks++;
+
+  // If only one block has several options, the regular iteration order already reuses all rows to its left in both directions
+  fw_order_haplotype_ = NULL;
+  fw_order_indices_.clear();
+  if (num_variable_blocks < 2)
+    return;
+  fw_order_haplotype_ = fw_haplotype_->reverse_iteration_order();
+
+  // Map each combination of block options to its index in fw_haplotype_. A sparse haplotype only contains some of the
+  // combinations, so they're keyed by their options rather than by their rank in the Cartesian product
+  if (fw_haplotype_->sparse()){
+    std::map<std::vector<int>, int> comb_indices;
+    fw_haplotype_->reset();
+    do {
+      comb_indices[fw_haplotype_->cur_indices()] = fw_haplotype_->cur_index();
+    } while (fw_haplotype_->next());
+    fw_haplotype_->reset();
+    do {
+      fw_order_indices_.push_back(comb_indices[fw_order_haplotype_->cur_indices()]);
+    } while (fw_order_haplotype_->next());
+    fw_order_haplotype_->reset();
+    return;
+  }
+  std::vector<int> radix(fw_haplotype_->num_blocks(), 1);
+  for (int i = 1; i < fw_haplotype_->num_blocks(); i++)
+    radix[i] = radix[i-1]*fw_haplotype_->num_options(i-1);
+  std::vector<int> option_indices(fw_haplotype_->num_combs());
+  fw_haplotype_->reset();
+  do {
+    int key = 0;
+    for (int i = 0; i < fw_haplotype_->num_blocks(); i++)
+      key += radix[i]*fw_haplotype_->cur_index(i);
+    option_indices[key] = fw_haplotype_->cur_index();
+  } while (fw_haplotype_->next());
+  fw_haplotype_->reset();
 
-  // Extract probabilites related to base quality scores
-  double* base_log_wrong   = new double[aln.get_sequence().size()]; // log10(Prob(error))
-  double* base_log_correct = new double[aln.get_sequence().size()]; // log10(Prob(correct))
-  const std::string& qual_string = aln.get_base_qualities();
-  for (unsigned int j = 0; j < qual_string.size(); j++){
-    base_log_wrong[j]   = base_quality->log_prob_error(qual_string[j]);
-    base_log_correct[j] = base_quality->log_prob_correct(qual_string[j]);
+  do {
+    int key = 0;
+    for (int i = 0; i < fw_order_haplotype_->num_blocks(); i++)
+      key += radix[i]*fw_order_haplotype_->cur_index(i);
+    fw_order_indices_.push_back(option_indices[key]);
+  } while (fw_order_haplotype_->next());
+  fw_order_haplotype_->reset();
+}
+
+void HapAligner::init_stutter_cache(){
+  int num_blocks = fw_haplotype_->num_blocks(), num_slots = 0;
+  max_stutter_artifacts_ = 0;
+  stutter_cache_stride_  = 0;
+  stutter_slots_.assign(2*num_blocks, -1);
+  for (int flank = 0; flank < 2; flank++){
+    Haplotype* haplotype = (flank == 0 ? fw_haplotype_ : rev_haplotype_);
+    for (int block_index = 0; block_index < num_blocks; block_index++){
+      RepeatStutterInfo* rep_info = haplotype->get_block(block_index)->get_repeat_info();
+      if (rep_info == NULL)
+	continue;
+      stutter_slots_[flank*num_blocks + block_index] = num_slots;
+      num_slots             += haplotype->num_options(block_index);
+      max_stutter_artifacts_ = std::max(max_stutter_artifacts_, (rep_info->max_insertion()-rep_info->max_deletion())/rep_info->get_period() + 1);
+    }
+  }
+  stutter_cache_valid_.assign(num_slots, false);
+}
+
+const HapAligner::MatchTransitions* HapAligner::get_match_transitions(Haplotype* haplotype){
+  int slot = (haplotype == fw_haplotype_ ? 0 : (haplotype == rev_haplotype_ ? 1 : 2));
+  std::vector<MatchTransitions>& transitions = match_transitions_[slot*haplotype->num_combs() + haplotype->cur_index()];
+  if (!transitions.empty())
+    return transitions.data();
+
+  // The transitions out of each non-stutter position depend on the longer of the homopolymers containing it and the preceding base
+  transitions.resize(haplotype->cur_size());
+  int haplotype_index = 0;
+  for (int block_index = 0; block_index < haplotype->num_blocks(); block_index++){
+    int block_size = haplotype->get_seq(block_index).size();
+    if (haplotype->get_block(block_index)->get_repeat_info() == NULL){
+      for (int coord_index = 0; coord_index < block_size; coord_index++){
+	int homopolymer_len = std::min(MAX_HOMOP_LEN, std::max(haplotype->homopolymer_length(block_index, coord_index),
+							       haplotype->homopolymer_length(block_index, std::max(0, coord_index-1))));
+	MatchTransitions& entry = transitions[haplotype_index + coord_index];
+	entry.to_match = LOG_MATCH_TO_MATCH[homopolymer_len];
+	entry.to_ins   = LOG_MATCH_TO_INS[homopolymer_len];
+	entry.to_del   = LOG_MATCH_TO_DEL[homopolymer_len];
+      }
+    }
+    haplotype_index += block_size;
+  }
+  return transitions.data();
+}
+
+template<typename T>
+void HapAligner::align_read_bidirectional(Alignment& aln, int seed_base, const std::string& rev_rseq,
+					  double* base_log_wrong, double* base_log_correct, double* prob_ptr){
+  const char* base_seq = aln.get_sequence().c_str();
+  int base_seq_len     = (int)aln.get_sequence().size();
+
+  // Obtain scoring matrices large enough for the maximum haplotype size from the workspace
+  int max_hap_size          = fw_haplotype_->max_size();
+  int num_hap_blocks        = fw_haplotype_->num_blocks();
+  int l_size                = seed_base;
+  int r_size                = base_seq_len-seed_base-1;
+  AlignmentMatrices<T>& mat = workspace_->matrices<T>();
+  T* l_match_matrix         = grow_buffer(mat.l_match,    l_size*max_hap_size);
+  T* l_insert_matrix        = grow_buffer(mat.l_insert,   l_size*max_hap_size);
+  T* l_deletion_matrix      = grow_buffer(mat.l_deletion, l_size*max_hap_size);
+  int* l_best_artifact_size = grow_buffer(workspace_->l_best_artifact_size, l_size*num_hap_blocks);
+  int* l_best_artifact_pos  = grow_buffer(workspace_->l_best_artifact_pos,  l_size*num_hap_blocks);
+  T* r_match_matrix         = grow_buffer(mat.r_match,    r_size*max_hap_size);
+  T* r_insert_matrix        = grow_buffer(mat.r_insert,   r_size*max_hap_size);
+  T* r_deletion_matrix      = grow_buffer(mat.r_deletion, r_size*max_hap_size);
+  int* r_best_artifact_size = grow_buffer(workspace_->r_best_artifact_size, r_size*num_hap_blocks);
+  int* r_best_artifact_pos  = grow_buffer(workspace_->r_best_artifact_pos,  r_size*num_hap_blocks);
+  T* l_columns              = grow_buffer(mat.l_columns, ((size_t)fw_haplotype_->num_combs())*max_hap_size);
+
+  // Align the left flank, iterating through the haplotypes so that the blocks furthest from its start change most frequently.
+  // Only the final column of each haplotype's matrix is required to combine the two flanks
+  double l_prob     = 0;
+  int first_block   = 0;
+  int order_index   = 0;
+  do {
+    first_block   = std::min(first_block, fw_order_haplotype_->last_changed());
+    int hap_index = fw_order_indices_[order_index++];
+    if (!realign_to_hap_[hap_index])
+      continue;
+
+    align_seq_to_hap(fw_order_haplotype_, first_block, base_seq, seed_base, base_log_wrong, base_log_correct,
+		     l_match_matrix, l_insert_matrix, l_deletion_matrix, l_best_artifact_size, l_best_artifact_pos, l_prob);
+    first_block = num_hap_blocks;
+
+    T* l_column = l_columns + ((size_t)hap_index)*max_hap_size;
+    for (int i = 0; i < fw_order_haplotype_->cur_size()-1; i++)
+      l_column[i] = l_match_matrix[l_size*i + l_size-1];
+  } while (fw_order_haplotype_->next());
+  fw_order_haplotype_->reset();
+
+  // Align the right flank using the regular iteration order, which changes the blocks furthest from its start most frequently
+  first_block   = 0;
+  double max_LL = IMPOSSIBLE;
+  do {
+    first_block = std::min(first_block, rev_haplotype_->last_changed());
+    if (!realign_to_hap_[fw_haplotype_->cur_index()]){
+      prob_ptr++;
+      continue;
+    }
+
+    const T* l_column = l_columns + ((size_t)fw_haplotype_->cur_index())*max_hap_size;
+    if (prune_alns_){
+      double bound = flank_LL_bound(l_column, 1, l_prob, base_log_wrong[seed_base], base_log_correct[seed_base]);
+      if (bound < max_LL - PRUNE_LL_MARGIN){
+	*prob_ptr = bound;
+	prob_ptr++;
+	continue;
+      }
+    }
+
+    double r_prob;
+    int max_index;
+    align_seq_to_hap(rev_haplotype_, first_block, rev_rseq.c_str(), rev_rseq.size(), base_log_wrong+seed_base+1, base_log_correct+seed_base+1,
+		     r_match_matrix, r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, r_prob);
+    first_block = num_hap_blocks;
+
+    *prob_ptr = compute_aln_logprob(base_seq_len, seed_base, base_seq[seed_base], base_log_wrong[seed_base], base_log_correct[seed_base],
+				    l_column, 1, l_prob, r_match_matrix+r_size-1, r_size, r_prob, max_index);
+    max_LL = std::max(max_LL, *prob_ptr);
+    prob_ptr++;
+  } while (fw_haplotype_->next() && rev_haplotype_->next());
+  fw_haplotype_->reset();
+  rev_haplotype_->reset();
+}
+
+template<typename T>
+void HapAligner::align_read(Alignment& aln, int seed_base, const std::string& rev_rseq,
+			    double* base_log_wrong, double* base_log_correct, bool retrace_aln,
+			    double* prob_ptr, AlignmentTrace& trace){
+  if (fw_order_haplotype_ != NULL && !retrace_aln){
+    align_read_bidirectional<T>(aln, seed_base, rev_rseq, base_log_wrong, base_log_correct, prob_ptr);
+    return;
   }
 
   const char* base_seq = aln.get_sequence().c_str();
   int base_seq_len     = (int)aln.get_sequence().size();
 
-  // Allocate scoring matrices based on the maximum haplotype size
+  // Obtain scoring matrices large enough for the maximum haplotype size from the workspace
   int max_hap_size          = fw_haplotype_->max_size();
   int num_hap_blocks        = fw_haplotype_->num_blocks();
-  double* l_match_matrix    = new double [seed_base*max_hap_size];
-  double* l_insert_matrix   = new double [seed_base*max_hap_size];
-  double* l_deletion_matrix = new double [seed_base*max_hap_size];
-  int* l_best_artifact_size = new int    [seed_base*num_hap_blocks];
-  int* l_best_artifact_pos  = new int    [seed_base*num_hap_blocks];
-  double* r_match_matrix    = new double [(base_seq_len-seed_base-1)*max_hap_size];
-  double* r_insert_matrix   = new double [(base_seq_len-seed_base-1)*max_hap_size];
-  double* r_deletion_matrix = new double [(base_seq_len-seed_base-1)*max_hap_size];
-  int* r_best_artifact_size = new int    [(base_seq_len-seed_base-1)*num_hap_blocks];
-  int* r_best_artifact_pos  = new int    [(base_seq_len-seed_base-1)*num_hap_blocks];
+  int l_size                = seed_base;
+  int r_size                = base_seq_len-seed_base-1;
+  AlignmentMatrices<T>& mat = workspace_->matrices<T>();
+  T* l_match_matrix         = grow_buffer(mat.l_match,    l_size*max_hap_size);
+  T* l_insert_matrix        = grow_buffer(mat.l_insert,   l_size*max_hap_size);
+  T* l_deletion_matrix      = grow_buffer(mat.l_deletion, l_size*max_hap_size);
+  int* l_best_artifact_size = grow_buffer(workspace_->l_best_artifact_size, l_size*num_hap_blocks);
+  int* l_best_artifact_pos  = grow_buffer(workspace_->l_best_artifact_pos,  l_size*num_hap_blocks);
+  T* r_match_matrix         = grow_buffer(mat.r_match,    r_size*max_hap_size);
+  T* r_insert_matrix        = grow_buffer(mat.r_insert,   r_size*max_hap_size);
+  T* r_deletion_matrix      = grow_buffer(mat.r_deletion, r_size*max_hap_size);
+  int* r_best_artifact_size = grow_buffer(workspace_->r_best_artifact_size, r_size*num_hap_blocks);
+  int* r_best_artifact_pos  = grow_buffer(workspace_->r_best_artifact_pos,  r_size*num_hap_blocks);
   double max_LL             = -100000000;
 
-  // Reverse bases and quality scores for the right flank
-  std::string rev_rseq = aln.get_sequence().substr(seed_base+1);
-  std::reverse(rev_rseq.begin(), rev_rseq.end());
-  std::reverse(base_log_wrong+seed_base+1,   base_log_wrong+base_seq_len);
-  std::reverse(base_log_correct+seed_base+1, base_log_correct+base_seq_len);
+  // Index of the leftmost block in each direction that has changed since the previous alignment. Rows for all
+  // blocks to its left can be reused from the previous alignment to accelerate computations
+  int fw_first_block = 0, rev_first_block = 0;
 
-  // True iff we should reuse alignment information from the previous haplotype to accelerate computations
-  bool reuse_alns = false;
+  // When pruning, the flank that most likely spans the repeats is aligned first, as its LLs vary the most across the haplotypes.
+  // The seed's reference position is approximated by ignoring any indels in the read's original alignment
+  bool prune       = (prune_alns_ && !retrace_aln);
+  bool right_first = (prune && !repeat_starts_.empty() && aln.get_start()+seed_base < repeat_starts_[0]);
 
   do {
+    fw_first_block  = std::min(fw_first_block,  fw_haplotype_->last_changed());
+    rev_first_block = std::min(rev_first_block, rev_haplotype_->last_changed());
     if (!realign_to_hap_[fw_haplotype_->cur_index()]){
       prob_ptr++;
-      reuse_alns = false;
       continue;
     }
 
     // Perform alignment to current haplotype
     double l_prob, r_prob;
     int max_index;
-    align_seq_to_hap(fw_haplotype_, reuse_alns, base_seq, seed_base, base_log_wrong, base_log_correct,
-		     l_match_matrix, l_insert_matrix, l_deletion_matrix, l_best_artifact_size, l_best_artifact_pos, l_prob);
+    auto align_left_flank = [&](){
+      align_seq_to_hap(fw_haplotype_, fw_first_block, base_seq, seed_base, base_log_wrong, base_log_correct,
+		       l_match_matrix, l_insert_matrix, l_deletion_matrix, l_best_artifact_size, l_best_artifact_pos, l_prob);
+      fw_first_block = num_hap_blocks;
+    };
+    auto align_right_flank = [&](){
+      align_seq_to_hap(rev_haplotype_, rev_first_block, rev_rseq.c_str(), rev_rseq.size(), base_log_wrong+seed_base+1, base_log_correct+seed_base+1,
+		       r_match_matrix, r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, r_prob);
+      rev_first_block = num_hap_blocks;
+    };
+
+    if (prune){
+      // Skip the second flank if the haplotype can't come within the margin of the best haplotype. Its rows are
+      // recomputed from the earliest block that has changed since it was last aligned
+      double bound;
+      if (right_first){
+	align_right_flank();
+	bound = flank_LL_bound(r_match_matrix+r_size-1, r_size, r_prob, base_log_wrong[seed_base], base_log_correct[seed_base]);
+      }
+      else {
+	align_left_flank();
+	bound = flank_LL_bound(l_match_matrix+l_size-1, l_size, l_prob, base_log_wrong[seed_base], base_log_correct[seed_base]);
+      }
+      if (bound < max_LL - PRUNE_LL_MARGIN){
+	*prob_ptr = bound;
+	prob_ptr++;
+	continue;
+      }
+      if (right_first)
+	align_left_flank();
+      else
+	align_right_flank();
+    }
+    else {
+      align_left_flank();
+      align_right_flank();
+    }
 
-    align_seq_to_hap(rev_haplotype_, reuse_alns, rev_rseq.c_str(), rev_rseq.size(), base_log_wrong+seed_base+1, base_log_correct+seed_base+1,
-		     r_match_matrix, r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, r_prob);
-    
     double LL = compute_aln_logprob(base_seq_len, seed_base, base_seq[seed_base], base_log_wrong[seed_base], base_log_correct[seed_base],
-				    l_match_matrix, l_insert_matrix, l_deletion_matrix, l_prob, r_match_matrix, r_insert_matrix, r_deletion_matrix, r_prob, max_index);
+				    l_match_matrix+l_size-1, l_size, l_prob, r_match_matrix+r_size-1, r_size, r_prob, max_index);
     *prob_ptr = LL;
     prob_ptr++;
-    reuse_alns = true;
 
     if (LL > max_LL){
       max_LL = LL;
       if (retrace_aln){
-	std::string left_aln, right_aln, read_aln_to_hap;
+	TraceBuffers& buffers = workspace_->trace_buffers;
+	std::string& left_aln = buffers.left_ops, &right_aln = buffers.right_ops;
+	left_aln.clear();
+	right_aln.clear();
 	int fw_seed_block, fw_seed_coord, rev_seed_block, rev_seed_coord;
 
 	// Retrace sequence to left of seed (if appropriate)
 	assert(max_index >= 0 && max_index < fw_haplotype_->cur_size());
 	fw_haplotype_->get_coordinates(max_index, fw_seed_block, fw_seed_coord);
 	if (max_index == 0)
-	  left_aln = std::string(seed_base, 'S'); // Soft clip read to left of seed as it extends beyond haplotype. Don't retrace
+	  left_aln.append(seed_base, 'S'); // Soft clip read to left of seed as it extends beyond haplotype. Don't retrace
 	else {
 	  int l_matrix_index = seed_base*max_index - 1;
 	  if (fw_seed_coord == 0){
 	    int prev_block_size = fw_haplotype_->get_seq(fw_seed_block-1).size();
-	    left_aln = retrace(fw_haplotype_, base_seq, base_log_correct, seed_base, fw_seed_block-1, prev_block_size-1, l_matrix_index, l_match_matrix, l_insert_matrix, l_deletion_matrix,
-			       l_best_artifact_size, l_best_artifact_pos, trace);
+	    retrace(fw_haplotype_, base_seq, base_log_correct, seed_base, fw_seed_block-1, prev_block_size-1, l_matrix_index, l_match_matrix, l_insert_matrix, l_deletion_matrix,
+		    l_best_artifact_size, l_best_artifact_pos, trace, left_aln);
 	  }
 	  else
-	    left_aln = retrace(fw_haplotype_, base_seq, base_log_correct, seed_base, fw_seed_block, fw_seed_coord-1, l_matrix_index, l_match_matrix, l_insert_matrix, l_deletion_matrix,
-			       l_best_artifact_size, l_best_artifact_pos, trace);
+	    retrace(fw_haplotype_, base_seq, base_log_correct, seed_base, fw_seed_block, fw_seed_coord-1, l_matrix_index, l_match_matrix, l_insert_matrix, l_deletion_matrix,
+		    l_best_artifact_size, l_best_artifact_pos, trace, left_aln);
 	}
 	std::reverse(left_aln.begin(), left_aln.end()); // Alignment is backwards for left flank
 	assert(left_aln.size() - std::count(left_aln.begin(), left_aln.end(), 'D') == seed_base);
 
 	// Add the seed base to the appropriate flank's sequence
-	if (fw_haplotype_->get_block(fw_seed_block)->get_repeat_info() == NULL){
-	  std::string seed_base_string(1, base_seq[seed_base]);
-	  trace.add_flank_data(fw_seed_block, seed_base_string);
-	}
+	if (fw_haplotype_->get_block(fw_seed_block)->get_repeat_info() == NULL)
+	  trace.add_flank_data(fw_seed_block, base_seq+seed_base, 1, false);
 
 	// Retrace sequence to right of seed (if appropriate)
 	int rev_max_index = fw_haplotype_->cur_size()-1-max_index;
 	assert(rev_max_index >= 0 && rev_max_index < rev_haplotype_->cur_size());
 	rev_haplotype_->get_coordinates(rev_max_index, rev_seed_block, rev_seed_coord);
 	if (rev_max_index == 0)
-	  right_aln = std::string(base_seq_len-1-seed_base, 'S'); // Soft clip read to right of seed as it extends beyond haplotype. Don't retrace
+	  right_aln.append(base_seq_len-1-seed_base, 'S'); // Soft clip read to right of seed as it extends beyond haplotype. Don't retrace
 	else {
 	  int r_matrix_index = (base_seq_len-1-seed_base)*rev_max_index - 1;
 	  if (rev_seed_coord == 0){
 	    int prev_block_size = rev_haplotype_->get_seq(rev_seed_block-1).size();
-	    right_aln = retrace(rev_haplotype_, rev_rseq.c_str(), base_log_correct+seed_base+1, base_seq_len-1-seed_base, rev_seed_block-1, prev_block_size-1, r_matrix_index, r_match_matrix,
-				r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, trace);
+	    retrace(rev_haplotype_, rev_rseq.c_str(), base_log_correct+seed_base+1, base_seq_len-1-seed_base, rev_seed_block-1, prev_block_size-1, r_matrix_index, r_match_matrix,
+		    r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, trace, right_aln);
 	  }
 	  else
-	    right_aln = retrace(rev_haplotype_, rev_rseq.c_str(), base_log_correct+seed_base+1, base_seq_len-1-seed_base, rev_seed_block, rev_seed_coord-1, r_matrix_index, r_match_matrix,
-				r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, trace);
+	    retrace(rev_haplotype_, rev_rseq.c_str(), base_log_correct+seed_base+1, base_seq_len-1-seed_base, rev_seed_block, rev_seed_coord-1, r_matrix_index, r_match_matrix,
+		    r_insert_matrix, r_deletion_matrix, r_best_artifact_size, r_best_artifact_pos, trace, right_aln);
 	}
 	assert(right_aln.size() - std::count(right_aln.begin(), right_aln.end(), 'D') == base_seq_len-1-seed_base);
 
-	read_aln_to_hap = left_aln + "M" + right_aln;
-	trace.set_hap_aln(read_aln_to_hap);
+	std::string& read_aln_to_hap = trace.hap_aln();
+	read_aln_to_hap.reserve(left_aln.size() + 1 + right_aln.size());
+	read_aln_to_hap.assign(left_aln);
+	read_aln_to_hap.push_back('M');
+	read_aln_to_hap.append(right_aln);
 	stitch_alignment_trace(fw_haplotype_->get_block(0)->start(), fw_haplotype_->get_aln_info(),
-			       read_aln_to_hap, max_index, seed_base, aln, trace.traced_aln());
+			       read_aln_to_hap, max_index, seed_base, aln, trace.traced_aln(), buffers);
       }
     }
   } while (fw_haplotype_->next() && rev_haplotype_->next());
   fw_haplotype_->reset();
   rev_haplotype_->reset();
+}
+
+void HapAligner::process_read(Alignment& aln, int seed_base, BaseQuality* base_quality, bool retrace_aln,
+			      double* prob_ptr, AlignmentTrace& trace){
+  assert(seed_base != -1);
+  assert(aln.get_sequence().size() == aln.get_base_qualities().size());
 
-  // Deallocate arrays and scoring matrices
-  delete [] l_match_matrix;
-  delete [] l_insert_matrix;
-  delete [] l_deletion_matrix;
-  delete [] l_best_artifact_size;
-  delete [] l_best_artifact_pos;
-  delete [] r_match_matrix;
-  delete [] r_insert_matrix;
-  delete [] r_deletion_matrix;
-  delete [] r_best_artifact_size;
-  delete [] r_best_artifact_pos;
-  delete [] base_log_wrong;
-  delete [] base_log_correct;
+  // Extract probabilites related to base quality scores. Bases and quality scores for the right flank are
+  // stored in reverse order, so the arrays are filled directly in their final layout in a single pass
+  const std::string& seq         = aln.get_sequence();
+  const std::string& qual_string = aln.get_base_qualities();
+  int base_seq_len         = (int)seq.size();
+  double* base_log_wrong   = grow_buffer(workspace_->base_log_wrong,   base_seq_len); // log10(Prob(error))
+  double* base_log_correct = grow_buffer(workspace_->base_log_correct, base_seq_len); // log10(Prob(correct))
+  std::string& rev_rseq    = workspace_->rev_rseq;
+  rev_rseq.resize(base_seq_len-seed_base-1);
+  if (aln.has_log_probs()){
+    // Reuse the probabilities cached for the read (or pool) across its alignments to each haplotype
+    const double* log_wrong   = aln.get_log_prob_errors();
+    const double* log_correct = aln.get_log_prob_corrects();
+    std::copy(log_wrong,   log_wrong+seed_base+1,   base_log_wrong);
+    std::copy(log_correct, log_correct+seed_base+1, base_log_correct);
+    for (int j = seed_base+1; j < base_seq_len; j++){
+      int index = base_seq_len+seed_base-j;
+      base_log_wrong[index]   = log_wrong[j];
+      base_log_correct[index] = log_correct[j];
+      rev_rseq[base_seq_len-1-j] = seq[j];
+    }
+  }
+  else {
+    for (int j = 0; j < base_seq_len; j++){
+      int index = (j <= seed_base ? j : base_seq_len+seed_base-j);
+      base_log_wrong[index]   = base_quality->log_prob_error(qual_string[j]);
+      base_log_correct[index] = base_quality->log_prob_correct(qual_string[j]);
+      if (j > seed_base)
+	rev_rseq[base_seq_len-1-j] = seq[j];
+    }
+  }
+
+  // Invalidate the stutter block alignments cached for the previous read
+  stutter_cache_stride_ = base_seq_len*max_stutter_artifacts_;
+  grow_buffer(workspace_->stutter_probs,   stutter_cache_valid_.size()*stutter_cache_stride_);
+  grow_buffer(workspace_->stutter_art_pos, stutter_cache_valid_.size()*stutter_cache_stride_);
+  std::fill(stutter_cache_valid_.begin(), stutter_cache_valid_.end(), false);
+
+  use_bands_ = (banded_alns_ && !retrace_aln);
+  if (use_bands_){
+    init_alignment_bands(aln, seed_base);
+    grow_buffer(workspace_->l_band_cols, 2*fw_haplotype_->max_size());
+    grow_buffer(workspace_->r_band_cols, 2*fw_haplotype_->max_size());
+  }
+  compute_read_LLs(aln, seed_base, rev_rseq, base_log_wrong, base_log_correct, retrace_aln, prob_ptr, trace);
+
+  // Banded alignments underestimate the LLs of haplotypes whose optimal alignment leaves the band. If even the best
+  // haplotype aligns poorly within the band, such an alignment may exist, so realign the read using the full matrices
+  if (use_bands_){
+    use_bands_ = false;
+    double max_LL = IMPOSSIBLE, perfect_LL = 0;
+    bool any_realigned = false;
+    for (unsigned int i = 0; i < fw_haplotype_->num_combs(); i++){
+      if (realign_to_hap_[i]){
+	max_LL        = std::max(max_LL, prob_ptr[i]);
+	any_realigned = true;
+      }
+    }
+    for (int j = 0; j < base_seq_len; j++)
+      perfect_LL += base_log_correct[j];
+    if (any_realigned && max_LL < perfect_LL - BANDED_LL_MARGIN)
+      compute_read_LLs(aln, seed_base, rev_rseq, base_log_wrong, base_log_correct, retrace_aln, prob_ptr, trace);
+  }
+}
+
+void HapAligner::compute_read_LLs(Alignment& aln, int seed_base, const std::string& rev_rseq,
+				  double* base_log_wrong, double* base_log_correct, bool retrace_aln,
+				  double* prob_ptr, AlignmentTrace& trace){
+  // Retracing always requires double precision. Single precision is also restricted to reads aligned to every
+  // haplotype, as otherwise its LLs would be compared against LLs from an earlier alignment
+  if (single_precision_ && !retrace_aln && std::find(realign_to_hap_.begin(), realign_to_hap_.end(), false) == realign_to_hap_.end()){
+    align_read<float>(aln, seed_base, rev_rseq, base_log_wrong, base_log_correct, retrace_aln, prob_ptr, trace);
+
+    // Recompute the LLs in double precision if any two haplotypes are too close to distinguish, as
+    // downstream computations rely on reads whose LLs are exactly tied for uninformative haplotype pairs
+    std::vector<double>& hap_LLs = workspace_->hap_LLs;
+    hap_LLs.clear();
+    for (unsigned int i = 0; i < fw_haplotype_->num_combs(); i++)
+      if (realign_to_hap_[i])
+	hap_LLs.push_back(prob_ptr[i]);
+    std::sort(hap_LLs.begin(), hap_LLs.end());
+    bool ambiguous = false;
+    for (unsigned int i = 1; i < hap_LLs.size(); i++){
+      // Pruned haplotypes are assigned bounds that may be tied, but they're too unlikely to affect any downstream computations
+      if (prune_alns_ && hap_LLs[i] < hap_LLs.back() - PRUNE_LL_MARGIN)
+	continue;
+      ambiguous |= (hap_LLs[i] - hap_LLs[i-1] < SINGLE_PRECISION_LL_MARGIN);
+    }
+    if (ambiguous)
+      align_read<double>(aln, seed_base, rev_rseq, base_log_wrong, base_log_correct, retrace_aln, prob_ptr, trace);
+  }
+  else
+    align_read<double>(aln, seed_base, rev_rseq, base_log_wrong, base_log_correct, retrace_aln, prob_ptr, trace);
 }
 
 AlignmentTrace* HapAligner::trace_optimal_aln(Alignment& orig_aln, int seed_base, int best_haplotype, BaseQuality* base_quality){
+  fw_haplotype_->align_to_ref();
   fw_haplotype_->go_to(best_haplotype);
   fw_haplotype_->fix();
   rev_haplotype_->go_to(best_haplotype);
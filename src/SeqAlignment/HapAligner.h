@@ -7,54 +7,211 @@
 
 #include "AlignmentData.h"
 #include "AlignmentTraceback.h"
+#include "AlignmentWorkspace.h"
 #include "../base_quality.h"
+#include "../task_queue.h"
+#include "../trace_recorder.h"
 #include "Haplotype.h"
 
 class HapAligner {
  private:
   Haplotype* fw_haplotype_;
-  Haplotype* rev_haplotype_;
+  Haplotype* rev_haplotype_; // Owned by the forward haplotype, so that it's shared by all of its aligners
   std::vector<bool> realign_to_hap_;
-  std::vector<HapBlock*> rev_blocks_;
 
   std::vector<int32_t> repeat_starts_;
   std::vector<int32_t> repeat_ends_;
 
+  // Reusable storage for the alignment matrices, shared by all HapAligners in the current thread
+  AlignmentWorkspace* workspace_;
+
+  // If true, alignment matrices are computed in single precision, and a read is realigned in double precision
+  // if the resulting LLs for any pair of unpruned haplotypes are too close to reliably distinguish
+  bool single_precision_;
+
+  // Haplotype with the same blocks as fw_haplotype_ whose rightmost blocks change most frequently during iteration,
+  // along with the fw_haplotype_ index of each of its haplotypes. Only used if multiple blocks have several options
+  Haplotype* fw_order_haplotype_;
+  std::vector<int> fw_order_indices_;
+
+  // The stutter block LLs for a read only depend on the block's option and the flank being aligned, not on the options of
+  // any other blocks. They're therefore cached for each (flank, block, option) slot and reused until the next read is processed.
+  // stutter_slots_[flank*num_blocks + block_index] is the first slot for a stutter block's options or -1 for other blocks
+  std::vector<int> stutter_slots_;
+  std::vector<bool> stutter_cache_valid_;
+  int max_stutter_artifacts_;
+  int stutter_cache_stride_; // Number of cached entries per slot for the current read
+
+  void init_stutter_cache();
+
+  // Log-probabilities of the transitions out of a haplotype position's match state, which depend on the local homopolymer length
+  struct MatchTransitions {
+    double to_match, to_ins, to_del;
+  };
+
+  // The transitions for each position of each haplotype, computed the first time the haplotype is aligned.
+  // match_transitions_[slot*num_combs + haplotype index] stores them for slots 0, 1 and 2 for fw_haplotype_, rev_haplotype_
+  // and fw_order_haplotype_, respectively. Entries for positions in stutter blocks are unused
+  std::vector< std::vector<MatchTransitions> > match_transitions_;
+
+  const MatchTransitions* get_match_transitions(Haplotype* haplotype);
+
+  // The haplotype positions with which a read's seed base can be aligned, which only depend on the sizes and sequences
+  // of the current haplotype's blocks. Computed the first time each haplotype is used and stored in seed_layouts_
+  struct SeedLayout {
+    int num_seeds;                // Number of non-stutter positions, or -1 if the layout hasn't been computed
+    double log_prior;             // Uniform log-prior on the seed's position
+    std::vector<int> hap_indices; // Non-stutter positions other than the haplotype's first and last positions
+    std::string chars;            // Haplotype base at each of these positions
+    SeedLayout() : num_seeds(-1), log_prior(0) {}
+  };
+  std::vector<SeedLayout> seed_layouts_;
+
+  const SeedLayout& get_seed_layout();
+
+  // If true, the non-stutter rows of each flank's alignment matrices are only computed within a diagonal band
+  // around the read's original alignment. Reads that align poorly within the band are realigned using the full matrices
+  bool banded_alns_;
+  bool use_bands_;        // True iff the bands are applied to the read currently being aligned
+  int32_t band_ref_start_; // Reference coordinate of the first entry in the workspace's band arrays
+  int band_read_len_;
+
+  int64_t num_dp_cells_; // Total number of alignment matrix cells computed by this aligner
+
+  // If not NULL, the reads flagged in this vector already have their seed bases in the SEED_POSITIONS provided to process_reads()
+  const std::vector<bool>* known_seeds_;
+
+  // If true, a read's second flank isn't aligned to haplotypes whose LL can't approach the best LL among the haplotypes
+  // aligned so far, and those haplotypes are assigned an upper bound on their LL instead
+  bool prune_alns_;
+
+  /**
+   * Determine the band for each reference position spanned by the haplotype, centered on the read base aligned to it
+   * by the read's CIGAR string and widened by the maximum stutter artifact of each repeat block between it and the seed
+   **/
+  void init_alignment_bands(Alignment& aln, int seed_base);
+
+  /**
+   * Store the range of columns in the band for the matrix row aligned to reference position REF_POS,
+   * clipped to the SEQ_LEN columns of the flank's matrix. The range is empty if BAND_START > BAND_END
+   **/
+  void get_row_band(bool reversed, int32_t ref_pos, int seq_len, int& band_start, int& band_end);
+
   /**
    * Align the sequence contained in SEQ_0 -> SEQ_N using the recursion
    * 0 -> 1 -> 2 ... N
+   * Rows for blocks to the left of FIRST_BLOCK are assumed to be unchanged from the previous alignment and are reused
    **/
-  void align_seq_to_hap(Haplotype* haplotype, bool reuse_alns,
+  template<typename T>
+  void align_seq_to_hap(Haplotype* haplotype, int first_block,
 			const char* seq_0, int seq_len,
 			const double* base_log_wrong, const double* base_log_correct,
-			double* match_matrix, double* insert_matrix, double* deletion_matrix,
+			T* match_matrix, T* insert_matrix, T* deletion_matrix,
 			int* best_artifact_size, int* best_artifact_pos, double& left_prob);
 
   /**
-   * Compute the log-probability of the alignment given the alignment matrices for the left and right segments.
+   * Equivalent to align_seq_to_hap<double>() without bands for ALIGN_BATCH_LANES sequences at once, where the sequence and
+   * base quality arrays for lane l contain SEQ_LENS[l] entries. The matrices are stored in lane-major order with MAX_SEQ_LEN
+   * columns per row, and the entries in the columns beyond a lane's sequence length are meaningless
+   **/
+  void align_seqs_to_hap_batch(Haplotype* haplotype, int first_block, const char* const* seqs, const int* seq_lens, int max_seq_len,
+			       const double* const* base_log_wrong, const double* const* base_log_correct,
+			       double* match_matrix, double* insert_matrix, double* deletion_matrix, double* left_probs);
+
+  /**
+   * Compute the log-probability of the alignment given the final match matrix column for the left and right segments.
+   * Each column is accessed using the provided stride between consecutive haplotype positions.
    * Stores the index of the haplotype position with which the seed base is aligned in the maximum likelihood alignment
    **/
+  /**
+   * Compute an upper bound on the log-probability returned by compute_aln_logprob() using only one flank's final match matrix column,
+   * accessed using the provided stride, and the LL of the flank's bases when they're all outside of the haplotype window
+   **/
+  template<typename T>
+  double flank_LL_bound(const T* match_column, int stride, double flank_prob, double log_seed_wrong, double log_seed_correct);
+
+  template<typename T>
   double compute_aln_logprob(int base_seq_len, int seed_base,
 			     char seed_char, double log_seed_wrong, double log_seed_correct,
-			     double* l_match_matrix, double* l_insert_matrix, double* l_deletion_matrix, double l_prob,
-			     double* r_match_matrix, double* r_insert_matrix, double* r_deletion_matrix, double r_prob,
+			     const T* l_match_column, int l_stride, double l_prob,
+			     const T* r_match_column, int r_stride, double r_prob,
 			     int& max_index);
 
-  std::string retrace(Haplotype* haplotype, const char* read_seq, const double* base_log_correct,
-		      int seq_len, int block_index, int base_index, int matrix_index, double* l_match_matrix,
-		      double* l_insert_matrix, double* l_deletion_matrix, int* best_artifact_size, int* best_artifact_pos,
-		      AlignmentTrace& trace);
+  /**
+   * Retrace the optimal alignment of the read's bases to one side of the seed, appending its operations to ALN_OPS in
+   * traceback order and recording the STR sequences, flanking sequences, flank indels and SNPs in TRACE
+   **/
+  template<typename T>
+  void retrace(Haplotype* haplotype, const char* read_seq, const double* base_log_correct,
+	       int seq_len, int block_index, int base_index, int matrix_index, T* l_match_matrix,
+	       T* l_insert_matrix, T* l_deletion_matrix, int* best_artifact_size, int* best_artifact_pos,
+	       AlignmentTrace& trace, std::string& aln_ops);
+
+  /**
+   * Align the read to each haplotype using alignment matrices of type T and store the LLs using PROB_PTR.
+   * The base quality arrays and REV_RSEQ must already be reversed to the right of the seed base
+   **/
+  template<typename T>
+  void align_read(Alignment& aln, int seed_base, const std::string& rev_rseq,
+		  double* base_log_wrong, double* base_log_correct, bool retrace_aln,
+		  double* prob_ptr, AlignmentTrace& trace);
+
+  /**
+   * Equivalent to align_read() without retracing, but aligns the left flank to every haplotype before aligning the right flank.
+   * Each flank then iterates through the haplotypes in the order that allows it to reuse the most rows from the previous alignment
+   **/
+  template<typename T>
+  void align_read_bidirectional(Alignment& aln, int seed_base, const std::string& rev_rseq,
+				double* base_log_wrong, double* base_log_correct, double* prob_ptr);
+
+  /**
+   * Align the read to each haplotype in single or double precision, as appropriate, and store the LLs using PROB_PTR
+   **/
+  void compute_read_LLs(Alignment& aln, int seed_base, const std::string& rev_rseq,
+			double* base_log_wrong, double* base_log_correct, bool retrace_aln,
+			double* prob_ptr, AlignmentTrace& trace);
+
+  /**
+   * Computes exactly the same LLs as process_read() for ALIGN_BATCH_LANES reads by aligning them to each haplotype in lockstep.
+   * The LLs for lane l are stored using PROB_PTRS[l]. Only valid if can_batch_reads() is true
+   **/
+  void align_read_batch(Alignment* const* alns, const int* seed_bases, BaseQuality* base_quality, double* const* prob_ptrs);
+
+  // Batched alignments are computed in double precision without bands or pruning and require the regular iteration order for both flanks
+  bool can_batch_reads() const { return !single_precision_ && !banded_alns_ && !prune_alns_ && fw_order_haplotype_ == NULL; }
+
+  void init_fw_order_haplotype();
+
+  /**
+   * Align the reads in ALIGNMENTS[START, END) exactly as process_reads() does
+   **/
+  void process_read_range(std::vector<Alignment>& alignments, int start, int end, int init_read_index, BaseQuality* base_quality,
+			  std::vector<bool>& realign_read, double* aln_probs, int* seed_positions, AlignmentTrace& trace);
 
   void calc_best_seed_position(int32_t region_start, int32_t region_end,
 			       int32_t& best_dist, int32_t& best_pos);
 
  public:
-  HapAligner(Haplotype* haplotype, std::vector<bool>& realign_to_haplotype){
+  HapAligner(Haplotype* haplotype, std::vector<bool>& realign_to_haplotype, bool single_precision=false, bool banded_alns=false, bool prune_alns=false){
     assert(realign_to_haplotype.size() == haplotype->num_combs());
-    fw_haplotype_   = haplotype;
-    rev_haplotype_  = haplotype->reverse(rev_blocks_);
-    realign_to_hap_ = realign_to_haplotype;
-
+    fw_haplotype_     = haplotype;
+    rev_haplotype_    = haplotype->get_reverse();
+    rev_haplotype_->unfix();
+    rev_haplotype_->reset();
+    realign_to_hap_   = realign_to_haplotype;
+    single_precision_ = single_precision;
+    banded_alns_      = banded_alns;
+    prune_alns_       = prune_alns;
+    use_bands_        = false;
+    band_ref_start_   = 0;
+    band_read_len_    = 0;
+    num_dp_cells_     = 0;
+    known_seeds_      = NULL;
+    workspace_        = &AlignmentWorkspace::thread_workspace();
+    init_fw_order_haplotype();
+    init_stutter_cache();
+    match_transitions_.resize(3*fw_haplotype_->num_combs());
+    seed_layouts_.resize(fw_haplotype_->num_combs());
 
     for (int i = 0; i < fw_haplotype_->num_blocks(); i++){
       HapBlock* block = fw_haplotype_->get_block(i);
@@ -66,10 +223,8 @@ class HapAligner {
   }
 
   ~HapAligner(){
-    for (unsigned int i = 0; i < rev_blocks_.size(); i++)
-      delete rev_blocks_[i];
-    rev_blocks_.clear();
-    delete rev_haplotype_;
+    if (fw_order_haplotype_ != NULL)
+      delete fw_order_haplotype_;
   }
 
   /** 
@@ -80,14 +235,33 @@ class HapAligner {
   void process_read(Alignment& aln, int seed_base, BaseQuality* base_quality, bool retrace_aln,
 		    double* prob_ptr, AlignmentTrace& traced_aln);
 
+  /**
+   * Align each read to each haplotype and store the LLs in the rows of ALN_PROBS starting at INIT_READ_INDEX.
+   * If TASK_QUEUE is provided and contains idle threads, large sets of reads are split into chunks
+   * that are aligned by this thread and the idle threads, each of which uses its own copy of the haplotype.
+   * Each read's LLs and seed are computed independently of the other reads, so they're bitwise identical regardless of
+   * the number of threads, the chunk boundaries or the batches in which the reads are aligned
+   **/
   void process_reads(std::vector<Alignment>& alignments, int init_read_index, BaseQuality* base_quality, std::vector<bool>& realign_read,
-		     double* aln_probs, int* seed_positions);
+		     double* aln_probs, int* seed_positions, TaskQueue* task_queue=NULL);
+
+  /**
+   * Reuse the seed bases in SEED_POSITIONS for the reads flagged in KNOWN_SEEDS instead of recomputing them in process_reads().
+   * The seeds only depend on the haplotype's flank boundaries and repeat blocks, so they're valid for any haplotype with the same blocks
+   **/
+  void reuse_seeds(const std::vector<bool>* known_seeds){ known_seeds_ = known_seeds; }
 
   /*
     Retraces the Alignment's optimal alignment to the provided haplotype.
     Returns the result as a new Alignment relative to the reference haplotype
    */
   AlignmentTrace* trace_optimal_aln(Alignment& orig_aln, int seed_base, int best_haplotype, BaseQuality* base_quality);
+
+  /**
+   * Number of alignment matrix cells computed so far, including those computed by any threads that helped align the reads.
+   * Rows restricted to a band are counted in their entirety
+   **/
+  int64_t num_dp_cells() const { return num_dp_cells_; }
 };
 
 #endif
@@ -4,23 +4,29 @@
 #include "HapBlock.h"
 #include "../stringops.h"
 
-void HapBlock::calc_homopolymer_lengths(std::string& seq, std::vector<int*>& llen_vec, std::vector<int*>& rlen_vec){
-  int* llens = new int[seq.size()];
-  int* rlens = new int[seq.size()];
+void HapBlock::calc_homopolymer_lengths(const std::string& seq){
+  int size = seq.size();
+  int left = homopolymer_lens_.size(), right = left + size;
+  homopolymer_lens_.resize(right + size);
+  homopolymer_offsets_.push_back(left);
+  homopolymer_offsets_.push_back(right);
+  if (size == 0)
+    return;
+
+  int* llens = homopolymer_lens_.data() + left;
+  int* rlens = homopolymer_lens_.data() + right;
   llens[0]   = 0;
   int count  = 0;
-  for (unsigned int j = 1; j < seq.size(); j++){
+  for (int j = 1; j < size; j++){
     count    = (seq[j-1] == seq[j] ? count + 1 : 0);
     llens[j] = count;
   }
 
-  rlens[seq.size()-1] = 0;
-  for (int j = seq.size()-2; j >= 0; j--){
+  rlens[size-1] = 0;
+  for (int j = size-2; j >= 0; j--){
     count    = (seq[j+1] == seq[j] ? count + 1: 0);
     rlens[j] = count;
   }
-  llen_vec.push_back(llens);
-  rlen_vec.push_back(rlens);
 }
 
 bool compareStringLength(const std::string& s1, const std::string& s2){
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "../error.h"
@@ -19,18 +20,26 @@ class HapBlock {
  protected:
   std::string ref_seq_;
   std::vector<std::string> alt_seqs_;
-  std::set<std::string> seq_set_;
+  std::unordered_map<std::string, int> seq_indices_; // Index of the first option with each sequence
   int32_t start_;  // Start of region (inclusive)
   int32_t end_;    // End   of region (not inclusive)
   int min_size_;
   int max_size_;
 
-  std::vector<int*> l_homopolymer_lens_;
-  std::vector<int*> r_homopolymer_lens_;
-  std::vector<int>  suffix_matches_;
+  // Homopolymer lengths to the left and right of each base of every option, stored contiguously. The lengths for
+  // option i begin at homopolymer_offsets_[2*i] and homopolymer_offsets_[2*i+1], respectively
+  std::vector<int> homopolymer_lens_;
+  std::vector<int> homopolymer_offsets_;
+  std::vector<int> suffix_matches_;
 
-  // Compute the homopolymer lengths and store them in the resulting vectors
-  void calc_homopolymer_lengths(std::string& seq, std::vector<int*>& llen_vec, std::vector<int*>& rlen_vec);
+  // Compute the homopolymer lengths for the sequence of the next option and append them to homopolymer_lens_
+  void calc_homopolymer_lengths(const std::string& seq);
+
+  // Register the sequence of the option that was just added
+  void index_sequence(const std::string& seq){
+    seq_indices_.emplace(seq, (int)alt_seqs_.size());
+    calc_homopolymer_lengths(seq);
+  }
 
  public:
   HapBlock(int32_t start, int32_t end, std::string ref_seq) {
@@ -42,18 +51,10 @@ class HapBlock {
     alt_seqs_ = std::vector<std::string>();
     suffix_matches_ = std::vector<int>();
     suffix_matches_.push_back(0);
-    seq_set_.insert(ref_seq);
-    calc_homopolymer_lengths(ref_seq, l_homopolymer_lens_, r_homopolymer_lens_);
+    index_sequence(ref_seq_);
   }
 
-  virtual ~HapBlock() {
-    for (unsigned int i = 0; i < l_homopolymer_lens_.size(); i++)
-      delete [] l_homopolymer_lens_[i];
-    for (unsigned int i = 0; i < r_homopolymer_lens_.size(); i++)
-      delete [] r_homopolymer_lens_[i];
-    l_homopolymer_lens_.clear();
-    r_homopolymer_lens_.clear();
-  }
+  virtual ~HapBlock() {}
 
   virtual RepeatStutterInfo* get_repeat_info()                    { return NULL; }
   virtual StutterAlignerClass* get_stutter_aligner(int seq_index) { return NULL; }
@@ -63,7 +64,7 @@ class HapBlock {
   int num_options() const { return 1 + alt_seqs_.size(); }
   int min_size()    const { return min_size_; }
   int max_size()    const { return max_size_; }
-  bool contains(const std::string& seq) const { return seq_set_.find(seq) != seq_set_.end(); }
+  bool contains(const std::string& seq) const { return seq_indices_.find(seq) != seq_indices_.end(); }
 
   virtual void add_alternate(std::string& alt) {
     alt_seqs_.push_back(alt);
@@ -73,8 +74,7 @@ class HapBlock {
       suffix_matches_.push_back(length_suffix_match(ref_seq_, alt));
     else
       suffix_matches_.push_back(length_suffix_match(alt_seqs_[alt_seqs_.size()-2], alt));
-    seq_set_.insert(alt);
-    calc_homopolymer_lengths(alt, l_homopolymer_lens_, r_homopolymer_lens_);
+    index_sequence(alt);
   }
 
   void print(std::ostream& out);
@@ -103,13 +103,13 @@ class HapBlock {
   }
 
   inline unsigned int left_homopolymer_len(unsigned int seq_index, int base_index){
-    assert(seq_index < l_homopolymer_lens_.size());
-    return l_homopolymer_lens_[seq_index][base_index];
+    assert(2*seq_index < homopolymer_offsets_.size());
+    return homopolymer_lens_[homopolymer_offsets_[2*seq_index] + base_index];
   }
 
   inline unsigned int right_homopolymer_len(unsigned int seq_index, int base_index){
-    assert(seq_index < r_homopolymer_lens_.size());
-    return r_homopolymer_lens_[seq_index][base_index];
+    assert(2*seq_index+1 < homopolymer_offsets_.size());
+    return homopolymer_lens_[homopolymer_offsets_[2*seq_index+1] + base_index];
   }
   
   virtual HapBlock* reverse(){
@@ -125,13 +125,10 @@ class HapBlock {
   }
 
   int index_of(const std::string& seq){
-    if (seq.compare(ref_seq_) == 0)
-      return 0;
-    for (unsigned int i = 0; i < alt_seqs_.size(); i++)
-      if (seq.compare(alt_seqs_[i]) == 0)
-	return i+1;
-    printErrorAndDie("Sequence not contained in haplotype block");
-    return -1;
+    auto index_iter = seq_indices_.find(seq);
+    if (index_iter == seq_indices_.end())
+      printErrorAndDie("Sequence not contained in haplotype block");
+    return index_iter->second;
   }
 
   virtual HapBlock* remove_alleles(std::vector<int>& allele_indices){
@@ -144,6 +141,10 @@ class HapBlock {
         new_block->add_alternate(alt_seqs_[i]);
     return new_block;
   }
+
+  // Equivalent to remove_alleles(), except that any state that's expensive to construct for the retained alleles
+  // may be moved into the new block. Afterwards, this block can only be deleted
+  virtual HapBlock* extract_alleles(std::vector<int>& allele_indices){ return remove_alleles(allele_indices); }
 };
 
 #endif
@@ -1,43 +1,34 @@
 #include <assert.h>
+#include <algorithm>
 
 #include "../bam_io.h"
 #include "../error.h"
 #include "Haplotype.h"
 #include "NeedlemanWunsch.h"
 
+int Haplotype::block_containing(int32_t pos) const {
+  // Blocks are ordered by their ends, which decrease for reversed haplotypes
+  if (inc_rev_)
+    return std::upper_bound(blocks_.begin(), blocks_.end(), pos, [](int32_t p, const HapBlock* block){ return p > block->end(); }) - blocks_.begin();
+  return std::upper_bound(blocks_.begin(), blocks_.end(), pos, [](int32_t p, const HapBlock* block){ return p < block->end(); }) - blocks_.begin();
+}
+
 bool Haplotype::position_to_haplotype_index(int32_t pos, int& haplotype_index){
-  haplotype_index = 0;
-  if (inc_rev_){
+  if (inc_rev_)
     assert(pos > blocks_.back()->end() && pos <= blocks_.front()->start());
-    for (int i = 0; i < blocks_.size(); i++){
-      if (pos > blocks_[i]->end()){
-	if (counts_[i] != 0)
-	  return false;
-	haplotype_index += blocks_[i]->start()-pos;
-	return true;
-      }
-      else
-	haplotype_index += get_seq(i).size();
-    }
-  }
-  else {
+  else
     assert(pos >= blocks_.front()->start() && pos < blocks_.back()->end());
-    for (int i = 0; i < blocks_.size(); i++){
-      if (pos < blocks_[i]->end()){
-	if (counts_[i] != 0)
-	  return false;
-	haplotype_index += pos-blocks_[i]->start();
-	return true;
-      }
-      else
-	haplotype_index += get_seq(i).size();
-    }
-  }
-  assert(false);
+  int block_index = block_containing(pos);
+  assert(block_index < blocks_.size());
+  haplotype_index = block_offsets_[block_index];
+  if (counts_[block_index] != 0)
+    return false;
+  haplotype_index += (inc_rev_ ? blocks_[block_index]->start()-pos : pos-blocks_[block_index]->start());
+  return true;
 }
 
 void Haplotype::adjust_indels(std::string& ref_hap_al, std::string& alt_hap_al){
-  assert(blocks_.size() == 3);
+  assert(blocks_.size() >= 3);
   int32_t ref_pos = blocks_[0]->start(), str_pos = blocks_[1]->start();
   int aln_index   = 0;
   while (aln_index < alt_hap_al.size()){
@@ -87,13 +78,44 @@ void Haplotype::adjust_indels(std::string& ref_hap_al, std::string& alt_hap_al){
 }
 
 void Haplotype::aln_haps_to_ref(){
+  hap_aln_info_.clear();
+  aligned_to_ref_ = true;
+  if (fw_source_ != NULL){
+    fw_source_->align_to_ref();
+    hap_aln_info_ = fw_source_->hap_aln_info_;
+    for (auto iter = hap_aln_info_.begin(); iter != hap_aln_info_.end(); iter++)
+      std::reverse(iter->begin(), iter->end());
+    return;
+  }
+
+  reset();
   std::string ref_hap_seq = get_seq(), alt_hap_seq;
+  RefAlnCache& cache = *ref_aln_cache_;
+  if (cache.ref_seq != ref_hap_seq || cache.ref_start != blocks_[0]->start() || cache.str_start != blocks_[1]->start()){
+    cache.ref_seq   = ref_hap_seq;
+    cache.ref_start = blocks_[0]->start();
+    cache.str_start = blocks_[1]->start();
+    cache.alns.clear();
+  }
+
   std::string ref_hap_al, alt_hap_al;
   float score;
   std::vector<CigarOp> cigar_list;
-
   do {
     alt_hap_seq = get_seq();
+    auto cache_iter = cache.alns.find(alt_hap_seq);
+    if (cache_iter != cache.alns.end()){
+      hap_aln_info_.push_back(cache_iter->second);
+      continue;
+    }
+
+    // The reference haplotype trivially aligns to itself without any indels
+    if (alt_hap_seq == ref_hap_seq){
+      hap_aln_info_.push_back(std::string(ref_hap_seq.size(), 'M'));
+      cache.alns[alt_hap_seq] = hap_aln_info_.back();
+      continue;
+    }
+
     if (!NeedlemanWunsch::Align(ref_hap_seq, alt_hap_seq, ref_hap_al, alt_hap_al, &score, cigar_list, true))
       printErrorAndDie("Failed to left-align haplotype sequence to reference allele");
     cigar_list.clear();
@@ -111,12 +133,14 @@ void Haplotype::aln_haps_to_ref(){
 	aln_info += 'M';
     }
     hap_aln_info_.push_back(aln_info);
+    cache.alns[alt_hap_seq] = aln_info;
   }
   while (next());
   reset();
 }
 
 void Haplotype::check_indel_clobbering(const std::string& marker, std::vector<bool>& clobbered){
+  align_to_ref();
   assert(clobbered.empty() && hap_aln_info_.size() == num_combs());
   int clobbered_count = 0, not_clobbered_count = 0;
   do {
@@ -155,6 +179,23 @@ void Haplotype::init(){
   ncombs_   = 1;
   cur_size_ = 0;
 
+  if (!combs_.empty()){
+    ncombs_ = combs_.size();
+    for (int i = 0; i < blocks_.size(); i++){
+      dirs_[i]     = 1;
+      factors_[i]  = 1;
+      counts_[i]   = combs_[0][i];
+      nchanges_[i] = 0;
+      cur_size_   += blocks_[i]->size(counts_[i]);
+    }
+    counter_      = 0;
+    last_changed_ = -1;
+    block_offsets_[0] = 0;
+    for (int i = 0; i < blocks_.size(); i++)
+      block_offsets_[i+1] = block_offsets_[i] + blocks_[i]->size(counts_[i]);
+    return;
+  }
+
   if (inc_rev_){
     for (int i = blocks_.size()-1; i >= 0; i--){
       factors_[i]  = ncombs_;
@@ -177,6 +218,10 @@ void Haplotype::init(){
   }
   counter_      = 0;
   last_changed_ = -1;
+
+  block_offsets_[0] = 0;
+  for (int i = 0; i < blocks_.size(); i++)
+    block_offsets_[i+1] = block_offsets_[i] + blocks_[i]->size(0);
 }
 
 void Haplotype::reset(){
@@ -185,12 +230,37 @@ void Haplotype::reset(){
   last_changed_ = -1;
 }
 
+int Haplotype::set_options(const std::vector<int>& comb){
+  int first_changed = -1;
+  for (int i = 0; i < blocks_.size(); i++){
+    if (counts_[i] == comb[i])
+      continue;
+    if (first_changed == -1)
+      first_changed = i;
+    nchanges_[i] += 1;
+    cur_size_    += blocks_[i]->size(comb[i]) - blocks_[i]->size(counts_[i]);
+    counts_[i]    = comb[i];
+  }
+  if (first_changed != -1)
+    for (int i = first_changed; i < blocks_.size(); i++)
+      block_offsets_[i+1] = block_offsets_[i] + blocks_[i]->size(counts_[i]);
+  return first_changed;
+}
+
 bool Haplotype::next(){
   if (fixed_)
     return false;
   if (counter_ == ncombs_-1)
     return false;
 
+  // Combinations are distinct, so at least one block changes
+  if (!combs_.empty()){
+    counter_++;
+    last_changed_ = set_options(combs_[counter_]);
+    assert(last_changed_ != -1);
+    return true;
+  }
+
   int index = -1;
   int t     = counter_+1;
 
@@ -216,9 +286,13 @@ bool Haplotype::next(){
   assert(index != -1);
   last_changed_     = index;
   nchanges_[index] += 1;
-  cur_size_        -= blocks_[index]->size(counts_[index]);
+  int size_change   = -blocks_[index]->size(counts_[index]);
   counts_[index]   += dirs_[index];
-  cur_size_        += blocks_[index]->size(counts_[index]);
+  size_change      += blocks_[index]->size(counts_[index]);
+  cur_size_        += size_change;
+  if (size_change != 0)
+    for (int i = index+1; i <= blocks_.size(); i++)
+      block_offsets_[i] += size_change;
   if (counts_[index] == 0 || counts_[index] == nopts_[index]-1)
     dirs_[index] *= -1;
 
@@ -229,6 +303,12 @@ bool Haplotype::next(){
 void Haplotype::go_to(int hap_index){
   if (hap_index < 0 || hap_index >= ncombs_)
     printErrorAndDie("Invalid haplotype index in go_to()");
+  if (!combs_.empty()){
+    set_options(combs_[hap_index]);
+    counter_      = hap_index;
+    last_changed_ = -1;
+    return;
+  }
   if (hap_index < counter_)
     reset();
   while (counter_ < hap_index)
@@ -236,6 +316,50 @@ void Haplotype::go_to(int hap_index){
   last_changed_ = -1; // Don't want to reuse haplotype info as we're no longer just incrementing
 }
 
+void Haplotype::sort_combinations(bool first_block_major){
+  int num_blocks = blocks_.size();
+  std::sort(combs_.begin(), combs_.end(), [first_block_major, num_blocks](const std::vector<int>& a, const std::vector<int>& b){
+      for (int i = 0; i < num_blocks; i++){
+	int block_index = (first_block_major ? i : num_blocks-1-i);
+	if (a[block_index] != b[block_index])
+	  return a[block_index] < b[block_index];
+      }
+      return false;
+    });
+}
+
+void Haplotype::set_combinations(const std::vector< std::vector<int> >& combs){
+  assert(fw_source_ == NULL);
+  combs_.assign(1, std::vector<int>(blocks_.size(), 0));
+  for (auto comb_iter = combs.begin(); comb_iter != combs.end(); comb_iter++){
+    if (comb_iter->size() != blocks_.size())
+      printErrorAndDie("Haplotype combination doesn't contain an option for each block");
+    for (unsigned int i = 0; i < blocks_.size(); i++)
+      if ((*comb_iter)[i] < 0 || (*comb_iter)[i] >= nopts_[i])
+	printErrorAndDie("Invalid block option in haplotype combination");
+    combs_.push_back(*comb_iter);
+  }
+
+  // Mirror the regular iteration order, in which the last block changes least frequently when incrementing from front to back.
+  // The reference combination has the smallest options, so it remains first
+  sort_combinations(inc_rev_);
+  combs_.erase(std::unique(combs_.begin(), combs_.end()), combs_.end());
+  fixed_          = false;
+  aligned_to_ref_ = false;
+  hap_aln_info_.clear();
+  init();
+
+  // The reversed haplotype must visit the same combinations in the same order
+  if (rev_haplotype_ != NULL){
+    rev_haplotype_->combs_ = combs_;
+    for (auto comb_iter = rev_haplotype_->combs_.begin(); comb_iter != rev_haplotype_->combs_.end(); comb_iter++)
+      std::reverse(comb_iter->begin(), comb_iter->end());
+    rev_haplotype_->aligned_to_ref_ = false;
+    rev_haplotype_->hap_aln_info_.clear();
+    rev_haplotype_->init();
+  }
+}
+
 void Haplotype::print_block_structure(int max_ref_len, int max_other_len, bool indent,
 				      std::ostream& out){
   int max_rows = 0;
@@ -313,20 +437,93 @@ unsigned int Haplotype::homopolymer_length(int block_index, int base_index){
   return llen + rlen + 1;
 }
 
+Haplotype* Haplotype::reverse_iteration_order(){
+  Haplotype* hap = new Haplotype(*this);
+  hap->rev_haplotype_ = NULL;
+  hap->rev_blocks_.clear();
+  hap->inc_rev_  = !inc_rev_;
+  hap->fixed_    = false;
+  if (!combs_.empty())
+    hap->sort_combinations(hap->inc_rev_);
+  hap->init();
+  hap->hap_aln_info_.clear();
+  hap->aligned_to_ref_ = true;
+  hap->fw_source_      = NULL;
+  return hap;
+}
+
+Haplotype* Haplotype::copy(std::vector<HapBlock*>& copied_blocks){
+  assert(copied_blocks.size() == 0);
+  std::vector<int> no_alleles;
+  for (unsigned int i = 0; i < blocks_.size(); i++)
+    copied_blocks.push_back(blocks_[i]->remove_alleles(no_alleles));
+  Haplotype* hap = new Haplotype(*this);
+  hap->rev_haplotype_ = NULL;
+  hap->rev_blocks_.clear();
+  hap->blocks_   = copied_blocks;
+  hap->fixed_    = false;
+  hap->init();
+
+  // The copy may be used by a different thread, so it can't share the alignment cache
+  hap->ref_aln_cache_ = std::make_shared<RefAlnCache>();
+  return hap;
+}
+
 Haplotype* Haplotype::reverse(std::vector<HapBlock*>& rev_blocks){
   assert(rev_blocks.size() == 0);
   for (unsigned int i = 0; i < blocks_.size(); i++)
     rev_blocks.push_back(blocks_[i]->reverse());
   std::reverse(rev_blocks.begin(), rev_blocks.end());
+  return build_reverse(rev_blocks);
+}
+
+Haplotype* Haplotype::build_reverse(std::vector<HapBlock*>& rev_blocks){
   Haplotype* rev_hap = new Haplotype(rev_blocks);
   rev_hap->inc_rev_  = true;
+  rev_hap->combs_    = combs_;
+  for (auto comb_iter = rev_hap->combs_.begin(); comb_iter != rev_hap->combs_.end(); comb_iter++)
+    std::reverse(comb_iter->begin(), comb_iter->end());
   rev_hap->init(); // Need to reinitialize, as the reverse flag wasn't properly set
 
-  // Set the haplotype alignments to the reverse of those in the current haplotype
-  // Can't use the values obtained from the constructor as the reverse
-  // haplotype would have right aligned indels instead of left aligning them
-  rev_hap->hap_aln_info_ = hap_aln_info_;
-  for (auto iter = rev_hap->hap_aln_info_.begin(); iter != rev_hap->hap_aln_info_.end(); iter++)
-    std::reverse(iter->begin(), iter->end());
+  // The haplotype alignments are the reverse of those in the current haplotype, as aligning the
+  // reversed sequences would produce right aligned indels instead of left aligning them
+  rev_hap->fw_source_ = this;
   return rev_hap;
 }
+
+Haplotype* Haplotype::get_reverse(){
+  if (rev_haplotype_ == NULL)
+    rev_haplotype_ = reverse(rev_blocks_);
+  return rev_haplotype_;
+}
+
+void Haplotype::derive_reverse(Haplotype* prev_haplotype, std::vector< std::vector<int> >& alleles_to_remove,
+			       std::vector< std::vector<std::string> >& alleles_to_add){
+  assert(rev_haplotype_ == NULL && alleles_to_remove.size() == blocks_.size() && alleles_to_add.size() == blocks_.size());
+  if (prev_haplotype->rev_haplotype_ == NULL || prev_haplotype->num_blocks() != num_blocks())
+    return;
+  for (int i = num_blocks()-1; i >= 0; i--){
+    HapBlock* rev_block = prev_haplotype->rev_blocks_[num_blocks()-1-i]->extract_alleles(alleles_to_remove[i]);
+    for (unsigned int j = 0; j < alleles_to_add[i].size(); j++){
+      std::string alt = alleles_to_add[i][j];
+      std::reverse(alt.begin(), alt.end());
+      rev_block->add_alternate(alt);
+    }
+    rev_blocks_.push_back(rev_block);
+  }
+  rev_haplotype_ = build_reverse(rev_blocks_);
+}
+
+void Haplotype::set_stutter_model(int block_index, StutterModel* stutter_model){
+  blocks_[block_index]->get_repeat_info()->set_stutter_model(stutter_model);
+  if (rev_haplotype_ != NULL)
+    rev_blocks_[num_blocks()-1-block_index]->get_repeat_info()->set_stutter_model(stutter_model);
+}
+
+void Haplotype::clear_reverse(){
+  delete rev_haplotype_;
+  for (unsigned int i = 0; i < rev_blocks_.size(); i++)
+    delete rev_blocks_[i];
+  rev_blocks_.clear();
+  rev_haplotype_ = NULL;
+}
@@ -2,7 +2,10 @@
 #define HAPLOTYPE_H_
 
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -16,20 +19,61 @@ class Haplotype {
   int ncombs_, cur_size_;
   bool fixed_;
 
+  // Haplotype index of the first base of each block for the current haplotype, followed by cur_size_.
+  // Updated whenever a block changes so that haplotype positions can be mapped to blocks using a binary search
+  std::vector<int> block_offsets_;
+
+  // Block containing reference position POS (see position_to_haplotype_index())
+  int block_containing(int32_t pos) const;
+
   // Variables for graycode-based iterator
   int counter_, last_changed_, max_size_;
   std::vector<int> dirs_, factors_, counts_, nchanges_;
   bool inc_rev_; // Iff true, increment from back to front
 
+  // Combinations of block options, in this haplotype's block order, that are iterated instead of the full Cartesian product
+  // of the options. Empty unless set_combinations() has been invoked. The first combination is always the reference haplotype
+  std::vector< std::vector<int> > combs_;
+
   void init();
+
+  // Sort the combinations so that the first (or last) block changes least frequently, keeping the reference haplotype first
+  void sort_combinations(bool first_block_major);
+
+  // Set the current options to those in COMB, returning the index of the first block that changed
+  int set_options(const std::vector<int>& comb);
   
   unsigned int left_homopolymer_len(char c, int block_index);
   unsigned int right_homopolymer_len(char c, int block_index);
 
+  // Alignment of each haplotype to the reference haplotype, which is only computed once required by align_to_ref()
   std::vector<std::string> hap_aln_info_;
+  bool aligned_to_ref_;
   void aln_haps_to_ref();
   void adjust_indels(std::string& ref_hap_al, std::string& alt_hap_al);
 
+  // Alignments of haplotype sequences to the reference haplotype, keyed by the haplotype sequence. Haplotypes rebuilt after
+  // adding or removing alleles share their predecessor's cache, so that only the newly added haplotype sequences are aligned.
+  // The alignments depend on the reference haplotype and the start of the first two blocks, so the cache is cleared if they change
+  struct RefAlnCache {
+    std::string ref_seq;
+    int32_t ref_start, str_start;
+    std::map<std::string, std::string> alns;
+  };
+  std::shared_ptr<RefAlnCache> ref_aln_cache_;
+
+  // If non-NULL, this is a reversed haplotype whose alignments are the reverse of those of the forward haplotype
+  Haplotype* fw_source_;
+
+  // Reversed haplotype returned by get_reverse() and its blocks, which are owned by this haplotype. NULL until first requested
+  Haplotype* rev_haplotype_;
+  std::vector<HapBlock*> rev_blocks_;
+
+  // Construct the reversed haplotype from REV_BLOCKS, the reverse of each block in reverse order
+  Haplotype* build_reverse(std::vector<HapBlock*>& rev_blocks);
+
+  void clear_reverse();
+
  public:
   Haplotype(std::vector<HapBlock*>& blocks) {
     max_size_ = 0;
@@ -38,17 +82,23 @@ class Haplotype {
       nopts_.push_back(blocks[i]->num_options());
       max_size_ += blocks[i]->max_size();
     }
-    fixed_ = false;
+    fixed_          = false;
+    rev_haplotype_  = NULL;
+    aligned_to_ref_ = false;
+    fw_source_      = NULL;
+    ref_aln_cache_  = std::make_shared<RefAlnCache>();
 
     dirs_.resize(blocks_.size());
     factors_.resize(blocks_.size());
     counts_.resize(blocks_.size());
     nchanges_.resize(blocks_.size());
+    block_offsets_.resize(blocks_.size()+1);
     inc_rev_ = false;
     init();
-    aln_haps_to_ref();
   }
 
+  ~Haplotype(){ clear_reverse(); }
+
   void print_nchanges(std::ostream& out) {
     for (unsigned int i = 0; i < blocks_.size(); i++)
       out << nchanges_[i] << " ";
@@ -62,7 +112,7 @@ class Haplotype {
   }
   
   inline const std::string& get_seq(int block_index)     { return blocks_[block_index]->get_seq(counts_[block_index]); }
-  inline const std::string& get_aln_info()               { return hap_aln_info_[counter_]; }
+  inline const std::string& get_aln_info()               { assert(aligned_to_ref_); return hap_aln_info_[counter_]; }
   inline char get_first_char()                     const { return blocks_[0]->get_seq(counts_[0])[0]; }
   inline char get_last_char()                      const { return blocks_.back()->get_seq(counts_[blocks_.size()-1]).back(); }
   inline HapBlock* get_block(int block_index)            { return blocks_[block_index]; }
@@ -75,20 +125,18 @@ class Haplotype {
   inline int cur_size()                            const { return cur_size_;            }
   inline int cur_index()                           const { return counter_;             }
   inline int cur_index(int block_index)            const { return counts_[block_index]; }
+  inline const std::vector<int>& cur_indices()     const { return counts_;              }
+  inline bool sparse()                             const { return !combs_.empty();      }
   inline bool reversed()                           const { return inc_rev_;             }
   int num_options(int block_index)                 const { return blocks_[block_index]->num_options(); }
 
-  void get_coordinates(int hap_pos, int& block, int& block_pos){
+  // Haplotype index of the first base in the block for the current haplotype
+  inline int block_offset(int block_index)         const { return block_offsets_[block_index]; }
+
+  void get_coordinates(int hap_pos, int& block, int& block_pos) const {
     assert(hap_pos >= 0 && hap_pos < cur_size_);
-    for (int i = 0; i < blocks_.size(); i++){
-      if (hap_pos < blocks_[i]->size(counts_[i])){
-	block     = i;
-	block_pos = hap_pos;
-	return;
-      }
-      hap_pos -= blocks_[i]->size(counts_[i]);
-    }
-    assert(false);
+    block     = std::upper_bound(block_offsets_.begin()+1, block_offsets_.end(), hap_pos) - (block_offsets_.begin()+1);
+    block_pos = hap_pos - block_offsets_[block];
   }
 
   bool position_to_haplotype_index(int32_t pos, int& haplotype_index);
@@ -117,12 +165,46 @@ class Haplotype {
 
   bool next();
 
+  // Align each haplotype to the reference haplotype if they haven't already been aligned, which is required by get_aln_info().
+  // As the haplotypes are iterated to do so, this resets the haplotype and must not be invoked while iterating through it
+  void align_to_ref(){
+    if (!aligned_to_ref_)
+      aln_haps_to_ref();
+  }
+
+  // Reuse the reference alignments that PREV_HAPLOTYPE and its predecessors computed for any of this haplotype's sequences
+  void reuse_ref_alignments(const Haplotype* prev_haplotype){ ref_aln_cache_ = prev_haplotype->ref_aln_cache_; }
+
   void go_to(int hap_index);
 
+  // Only iterate through the given combinations of block options (in addition to the reference haplotype) instead of every
+  // combination. Each combination lists an option index for every block. Resets the haplotype and its reverse, if constructed
+  void set_combinations(const std::vector< std::vector<int> >& combs);
+
   unsigned int homopolymer_length(int block_index, int base_index);
 
   Haplotype* reverse(std::vector<HapBlock*>& rev_blocks);
 
+  // Returns the reverse of this haplotype, which is constructed once and then shared by each caller (e.g. every HapAligner)
+  Haplotype* get_reverse();
+
+  // If PREV_HAPLOTYPE has constructed its reversed haplotype, construct this haplotype's reverse from it. This haplotype's blocks
+  // must have been obtained by removing ALLELES_TO_REMOVE from and adding ALLELES_TO_ADD to the blocks in PREV_HAPLOTYPE.
+  // The previous reversed blocks' stutter aligners are moved into the new blocks, so PREV_HAPLOTYPE can only be deleted afterwards
+  void derive_reverse(Haplotype* prev_haplotype, std::vector< std::vector<int> >& alleles_to_remove,
+		      std::vector< std::vector<std::string> >& alleles_to_add);
+
+  // Replace the stutter model for the block, along with that of the block in the reversed haplotype
+  void set_stutter_model(int block_index, StutterModel* stutter_model);
+
+  // Returns an equivalent haplotype whose blocks are copies of the current blocks, which are stored in COPIED_BLOCKS.
+  // As the blocks cache per-read stutter alignments, the copy can be used by a different thread than the original
+  Haplotype* copy(std::vector<HapBlock*>& copied_blocks);
+
+  // Returns a haplotype with the same blocks whose iterator increments from the opposite end.
+  // Its haplotype indices therefore differ from the current haplotype's and it lacks alignment information
+  Haplotype* reverse_iteration_order();
+
   void check_indel_clobbering(const std::string& marker, std::vector<bool>& clobbered);
 };
 
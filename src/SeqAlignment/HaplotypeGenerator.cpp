@@ -2,7 +2,9 @@
 #include <assert.h>
 #include <climits>
 #include <iostream>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "HaplotypeGenerator.h"
@@ -79,137 +81,139 @@ void HaplotypeGenerator::trim(int ideal_min_length, int32_t& region_start, int32
   region_end   -= right_trim;
 }
 
-bool HaplotypeGenerator::extract_sequence(Alignment& aln, int32_t region_start, int32_t region_end, std::string& seq){
+bool HaplotypeGenerator::extract_sequence(const Alignment& aln, int32_t region_start, int32_t region_end, std::string& seq){
   if (aln.get_start() >= region_start) return false;
   if (aln.get_stop()  <= region_end)   return false;
 
+  // Extract region sequence if fully spanned by alignment. Each CIGAR element is visited once and its bases within
+  // the region are appended directly to SEQ, which callers reuse across reads
+  seq.clear();
+  const std::string& aln_seq = aln.get_alignment();
   int align_index = 0; // Index into alignment string
-  int char_index  = 0; // Index of current base in current CIGAR element
   int32_t pos     = aln.get_start();
-  auto cigar_iter = aln.get_cigar_list().begin();
-  
-  // Extract region sequence if fully spanned by alignment
-  std::stringstream reg_seq;
-  while (cigar_iter != aln.get_cigar_list().end()){
-    if (char_index == cigar_iter->get_num()){
-      cigar_iter++;
-      char_index = 0;
-    }
-    else if (pos > region_end){
-      if (reg_seq.str() == "")
-	seq = "";
-      else
-	seq = uppercase(reg_seq.str());
-      return true;
+  bool complete   = false;
+  for (auto cigar_iter = aln.get_cigar_list().begin(); cigar_iter != aln.get_cigar_list().end(); cigar_iter++){
+    int32_t num_bases = cigar_iter->get_num();
+    if (cigar_iter->get_type() == 'I'){
+      // Insertions at either end of the region are included
+      if (pos >= region_start)
+	seq.append(aln_seq, align_index, num_bases);
+      align_index += num_bases;
+      continue;
     }
-    else if (pos == region_end){
-      if (cigar_iter->get_type() == 'I'){
-	reg_seq << aln.get_alignment().substr(align_index, cigar_iter->get_num());
-	align_index += cigar_iter->get_num();
-	char_index = 0;
-	cigar_iter++;
-      }
-      else {
-	if (reg_seq.str() == "")
-	  seq = "";
-	else
-	  seq = uppercase(reg_seq.str());
-	return true;
-      }
+    if (pos == region_end){
+      complete = true;
+      break;
     }
-    else if (pos >= region_start){
-      int32_t num_bases = std::min(region_end-pos, cigar_iter->get_num()-char_index);
-      switch(cigar_iter->get_type()){	 
-      case 'I':
-	num_bases = cigar_iter->get_num();
-	reg_seq << aln.get_alignment().substr(align_index, num_bases);
-	break;
+
+    int32_t skip = std::min(std::max(0, region_start-pos), num_bases);
+    int32_t used = std::min(region_end-pos-skip, num_bases-skip);
+    if (used > 0){
+      switch(cigar_iter->get_type()){
       case '=': case 'X':
-	reg_seq << aln.get_alignment().substr(align_index, num_bases);
-	pos += num_bases;
+	seq.append(aln_seq, align_index+skip, used);
 	break;
       case 'D':
-	pos += num_bases;
 	break;
       default:
 	printErrorAndDie("Invalid CIGAR char in extractRegionSequences()");
 	break;
       }
-      align_index += num_bases;
-      char_index  += num_bases;
     }
+    pos         += skip + used;
+    align_index += skip + used;
+    if (skip + used < num_bases){
+      complete = true;
+      break;
+    }
+  }
+  if (!complete)
+    printErrorAndDie("Logical error in extract_sequence");
+  for (size_t i = 0; i < seq.size(); i++)
+    seq[i] = toupper(seq[i]);
+  return true;
+}
+
+void CandidateSeqCounts::merge(const CandidateSeqCounts& other){
+  if (other.region_start != region_start || other.region_end != region_end || other.ref_seq.compare(ref_seq) != 0)
+    printErrorAndDie("Unable to merge candidate sequence counts extracted from different windows");
+  total_reads   += other.total_reads;
+  total_samples += other.total_samples;
+  for (auto iter = other.support.begin(); iter != other.support.end(); iter++){
+    auto support_iter = support.find(iter->first);
+    if (support_iter == support.end())
+      support[iter->first] = iter->second;
     else {
-      int32_t num_bases;
-      if (cigar_iter->get_type() == 'I')
-	num_bases = cigar_iter->get_num()-char_index;
-      else {
-	num_bases = std::min(region_start-pos, cigar_iter->get_num()-char_index);
-	pos      += num_bases;
-      }
-      align_index  += num_bases;
-      char_index   += num_bases;
+      support_iter->second.sample_frac    += iter->second.sample_frac;
+      support_iter->second.num_reads      += iter->second.num_reads;
+      support_iter->second.strong_samples += iter->second.strong_samples;
     }
   }
-  printErrorAndDie("Logical error in extract_sequence");
-  return false;
 }
 
-void HaplotypeGenerator::gen_candidate_seqs(std::string& ref_seq, int ideal_min_length,
-					    std::vector< std::vector<Alignment> >& alignments, std::vector<std::string>& vcf_alleles,
-					    int32_t& region_start, int32_t& region_end, std::vector<std::string>& sequences){
-  assert(sequences.empty());
-  std::map<std::string, double> sample_counts;
-  std::map<std::string, int> read_counts, must_inc;
-  int tot_reads = 0, tot_samples = 0;
+void HaplotypeGenerator::count_sequences(std::vector< std::vector<Alignment> >& alignments, CandidateSeqCounts& counts){
+  // Intern each distinct sequence so that the per-sample counts are kept by index rather than in a map keyed by the sequences
+  std::unordered_map<std::string, int> seq_indices;
+  std::vector<std::string> seqs;
+  std::vector<int> sample_counts;
+  std::string subseq;
 
   // Determine the number of reads and number of samples supporting each allele
   for (unsigned int i = 0; i < alignments.size(); i++){
     int samp_reads = 0;
-    std::map<std::string, int> counts;
+    sample_counts.assign(seqs.size(), 0);
     for (unsigned int j = 0; j < alignments[i].size(); j++){
-      std::string subseq;
-      if (extract_sequence(alignments[i][j], region_start, region_end, subseq)){
-	read_counts[subseq] += 1;
-	counts[subseq]      += 1;
-	tot_reads++;
+      if (extract_sequence(alignments[i][j], counts.region_start, counts.region_end, subseq)){
+	auto index_iter = seq_indices.find(subseq);
+	if (index_iter == seq_indices.end()){
+	  index_iter = seq_indices.insert(std::pair<std::string, int>(subseq, seqs.size())).first;
+	  seqs.push_back(subseq);
+	  sample_counts.push_back(0);
+	}
+	sample_counts[index_iter->second] += 1;
+	counts.total_reads++;
 	samp_reads++;
       }
     }
 
-    // Identify alleles strongly supported by sample
-    for (auto iter = counts.begin(); iter != counts.end(); iter++){
-      if (iter->second >= MIN_READS_STRONG_SAMPLE && iter->second >= MIN_FRAC_STRONG_SAMPLE*samp_reads)
-	must_inc[iter->first] += 1;
-      sample_counts[iter->first] += iter->second*1.0/samp_reads;
+    for (unsigned int k = 0; k < sample_counts.size(); k++){
+      if (sample_counts[k] == 0)
+	continue;
+      auto support_iter = counts.support.find(seqs[k]);
+      if (support_iter == counts.support.end())
+	support_iter = counts.support.insert(std::pair<std::string, CandidateSeqSupport>(seqs[k], CandidateSeqSupport{0, 0, 0})).first;
+      CandidateSeqSupport& support = support_iter->second;
+      support.num_reads   += sample_counts[k];
+      support.sample_frac += sample_counts[k]*1.0/samp_reads;
+
+      // Identify alleles strongly supported by sample
+      if (sample_counts[k] >= MIN_READS_STRONG_SAMPLE && sample_counts[k] >= MIN_FRAC_STRONG_SAMPLE*samp_reads)
+	support.strong_samples += 1;
     }
 
     if (samp_reads > 0)
-      tot_samples++;
+      counts.total_samples++;
   }
+}
+
+void HaplotypeGenerator::choose_candidate_seqs(const CandidateSeqCounts& counts, int ideal_min_length, std::vector<std::string>& vcf_alleles,
+					       int32_t& region_start, int32_t& region_end, std::vector<std::string>& sequences){
+  assert(sequences.empty());
+  const std::string& ref_seq = counts.ref_seq;
+  std::set<std::string> selected;
 
-  // Add VCF alleles to list (apart from reference sequence) and remove from other data structures
+  // Add VCF alleles to list (apart from reference sequence)
   int ref_index = -1;
   for (unsigned int i = 0; i < vcf_alleles.size(); i++){
     sequences.push_back(vcf_alleles[i]);
-    auto iter_1 = sample_counts.find(vcf_alleles[i]);
-    if (iter_1 != sample_counts.end()){
-      sample_counts.erase(iter_1);
-      read_counts.erase(vcf_alleles[i]);
-    }
-    auto iter_2 = must_inc.find(vcf_alleles[i]);
-    if (iter_2 != must_inc.end())
-      must_inc.erase(iter_2);
+    selected.insert(vcf_alleles[i]);
     if (vcf_alleles[i].compare(ref_seq) == 0)
       ref_index = i;
   }
-  
+
   // Add alleles with strong support from a subset of samples
-  for (auto iter = must_inc.begin(); iter != must_inc.end(); iter++){
-    if (iter->second >= MIN_STRONG_SAMPLES){
-      auto iter_1 = sample_counts.find(iter->first);
-      auto iter_2 = read_counts.find(iter->first);
-      sample_counts.erase(iter_1);
-      read_counts.erase(iter_2);
+  for (auto iter = counts.support.begin(); iter != counts.support.end(); iter++){
+    if (iter->second.strong_samples >= MIN_STRONG_SAMPLES && selected.insert(iter->first).second){
       sequences.push_back(iter->first);
       if (iter->first.compare(ref_seq) == 0)
 	ref_index = sequences.size()-1;
@@ -217,8 +221,10 @@ void HaplotypeGenerator::gen_candidate_seqs(std::string& ref_seq, int ideal_min_
   }
 
   // Identify additional alleles satisfying thresholds
-  for (auto iter = sample_counts.begin(); iter != sample_counts.end(); iter++){
-    if (iter->second > MIN_FRAC_SAMPLES*tot_samples || read_counts[iter->first] > MIN_FRAC_READS*tot_reads){
+  for (auto iter = counts.support.begin(); iter != counts.support.end(); iter++){
+    if (selected.find(iter->first) != selected.end())
+      continue;
+    if (iter->second.sample_frac > MIN_FRAC_SAMPLES*counts.total_samples || iter->second.num_reads > MIN_FRAC_READS*counts.total_reads){
       sequences.push_back(iter->first);
       if (ref_index == -1 && (iter->first.compare(ref_seq) == 0))
 	ref_index = sequences.size()-1;
@@ -237,9 +243,40 @@ void HaplotypeGenerator::gen_candidate_seqs(std::string& ref_seq, int ideal_min_
   std::sort(sequences.begin()+1, sequences.end(), orderByLengthAndSequence);
 
   // Clip identical regions
+  region_start = counts.region_start;
+  region_end   = counts.region_end;
   trim(ideal_min_length, region_start, region_end, sequences);
 }
 
+void HaplotypeGenerator::gen_candidate_seqs(std::string& ref_seq, int ideal_min_length,
+					    std::vector< std::vector<Alignment> >& alignments, std::vector<std::string>& vcf_alleles,
+					    int32_t& region_start, int32_t& region_end, std::vector<std::string>& sequences){
+  CandidateSeqCounts counts;
+  counts.region_start = region_start;
+  counts.region_end   = region_end;
+  counts.ref_seq      = ref_seq;
+  count_sequences(alignments, counts);
+  choose_candidate_seqs(counts, ideal_min_length, vcf_alleles, region_start, region_end, sequences);
+}
+
+bool HaplotypeGenerator::count_candidate_seqs(const Region& region, const ReferenceSequence& chrom_seq, std::vector< std::vector<Alignment> >& alignments,
+					      CandidateSeqCounts& counts){
+  if (region.start() < REF_FLANK_LEN + LEFT_PAD || region.stop() + REF_FLANK_LEN + RIGHT_PAD > chrom_seq.size())
+    return false;
+  counts = CandidateSeqCounts();
+  counts.region_start = region.start() - LEFT_PAD;
+  counts.region_end   = region.stop()  + RIGHT_PAD;
+  counts.ref_seq      = uppercase(chrom_seq.substr(counts.region_start, counts.region_end-counts.region_start));
+  count_sequences(alignments, counts);
+  return true;
+}
+
+void HaplotypeGenerator::select_candidate_seqs(const CandidateSeqCounts& counts, int period, std::vector<std::string>& sequences,
+					       int32_t& region_start, int32_t& region_end){
+  std::vector<std::string> vcf_alleles;
+  choose_candidate_seqs(counts, 3*period, vcf_alleles, region_start, region_end, sequences);
+}
+
 void HaplotypeGenerator::get_aln_bounds(std::vector< std::vector<Alignment> >& alignments,
 					int32_t& min_aln_start, int32_t& max_aln_stop){
   // Determine the minimum and maximum alignment boundaries
@@ -253,7 +290,7 @@ void HaplotypeGenerator::get_aln_bounds(std::vector< std::vector<Alignment> >& a
   }
 }
 
-bool HaplotypeGenerator::add_vcf_haplotype_block(int32_t pos, std::string& chrom_seq,
+bool HaplotypeGenerator::add_vcf_haplotype_block(int32_t pos, const ReferenceSequence& chrom_seq,
 						 std::vector<std::string>& vcf_alleles, StutterModel* stutter_model){
   if (!failure_msg_.empty())
     printErrorAndDie("Unable to add a VCF haplotype block, as a previous addition failed");
@@ -291,7 +328,7 @@ bool HaplotypeGenerator::add_vcf_haplotype_block(int32_t pos, std::string& chrom
   return true;
 }
 
-bool HaplotypeGenerator::add_haplotype_block(const Region& region, std::string& chrom_seq, std::vector< std::vector<Alignment> >& alignments,
+bool HaplotypeGenerator::add_haplotype_block(const Region& region, const ReferenceSequence& chrom_seq, std::vector< std::vector<Alignment> >& alignments,
 					     std::vector<std::string>& vcf_alleles, StutterModel* stutter_model){
   if (!failure_msg_.empty())
     printErrorAndDie("Unable to add a haplotype block, as a previous addition failed");
@@ -352,7 +389,7 @@ bool HaplotypeGenerator::add_haplotype_block(const Region& region, std::string&
   return true;
 }
 
-bool HaplotypeGenerator::fuse_haplotype_blocks(std::string& chrom_seq){
+bool HaplotypeGenerator::fuse_haplotype_blocks(const ReferenceSequence& chrom_seq){
   if (!failure_msg_.empty())
     printErrorAndDie("Unable to fuse haplotype blocks, as previous additions failed");
   if (hap_blocks_.empty())
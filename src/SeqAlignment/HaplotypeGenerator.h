@@ -2,16 +2,47 @@
 #define HAPLOTYPE_GENERATOR_H_
 
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "AlignmentData.h"
 #include "../error.h"
+#include "../reference_sequence.h"
 #include "../region.h"
 #include "../stutter_model.h"
 #include "Haplotype.h"
 #include "HapBlock.h"
 
+// Support for a candidate allele sequence. Each count is a sum over the samples
+struct CandidateSeqSupport {
+  double  sample_frac;    // Sum across samples of the fraction of the sample's reads with the sequence
+  int32_t num_reads;      // Number of reads with the sequence
+  int32_t strong_samples; // Number of samples that strongly support the sequence
+};
+
+/*
+ * Reads and samples supporting each sequence observed in the padded window around a region. As all of the counts are
+ * sums over the samples, the counts for disjoint sets of samples can be merged to select the candidate alleles for all
+ * of the samples exactly as if their reads had been analyzed together
+ */
+class CandidateSeqCounts {
+ public:
+  int32_t region_start, region_end;  // Padded window from which the sequences were extracted
+  std::string ref_seq;               // Reference sequence for the window
+  int32_t total_reads, total_samples;
+  std::map<std::string, CandidateSeqSupport> support;
+
+  CandidateSeqCounts(){
+    region_start  = region_end = -1;
+    total_reads   = 0;
+    total_samples = 0;
+  }
+
+  // Add the counts for another set of samples, which must have been extracted from the same window
+  void merge(const CandidateSeqCounts& other);
+};
+
 class HaplotypeGenerator {
  private:
   // Criteria used to determine whether a candidate sequence should be identified as an allele
@@ -36,12 +67,17 @@ class HaplotypeGenerator {
   void trim(int ideal_min_length,
 	    int32_t& region_start, int32_t& region_end, std::vector<std::string>& sequences);
 
-  bool extract_sequence(Alignment& aln, int32_t start, int32_t end, std::string& seq);
+  bool extract_sequence(const Alignment& aln, int32_t start, int32_t end, std::string& seq);
 
   void gen_candidate_seqs(std::string& ref_seq, int ideal_min_length,
 			  std::vector< std::vector<Alignment> >& alignments, std::vector<std::string>& vcf_alleles,
 			  int32_t& region_start, int32_t& region_end, std::vector<std::string>& sequences);
 
+  void count_sequences(std::vector< std::vector<Alignment> >& alignments, CandidateSeqCounts& counts);
+
+  void choose_candidate_seqs(const CandidateSeqCounts& counts, int ideal_min_length, std::vector<std::string>& vcf_alleles,
+			     int32_t& region_start, int32_t& region_end, std::vector<std::string>& sequences);
+
   void get_aln_bounds(std::vector< std::vector<Alignment> >& alignments,
 		      int32_t& min_aln_start, int32_t& max_aln_stop);
 
@@ -62,13 +98,23 @@ class HaplotypeGenerator {
     max_aln_stop_            = max_aln_stop;
   }
 
-  bool add_vcf_haplotype_block(int32_t pos, std::string& chrom_seq,
+  bool add_vcf_haplotype_block(int32_t pos, const ReferenceSequence& chrom_seq,
 			       std::vector<std::string>& vcf_alleles, StutterModel* stutter_model);
 
-  bool add_haplotype_block(const Region& region, std::string& chrom_seq, std::vector< std::vector<Alignment> >& alignments,
+  bool add_haplotype_block(const Region& region, const ReferenceSequence& chrom_seq, std::vector< std::vector<Alignment> >& alignments,
 			   std::vector<std::string>& vcf_alleles, StutterModel* stutter_model);
 
-  bool fuse_haplotype_blocks(std::string& chrom_seq);
+  bool fuse_haplotype_blocks(const ReferenceSequence& chrom_seq);
+
+  // Count the support for each sequence in the window that add_haplotype_block() would extract the region's candidate alleles from,
+  // without adding a block. Returns false if the region is too near the chromosome ends
+  bool count_candidate_seqs(const Region& region, const ReferenceSequence& chrom_seq, std::vector< std::vector<Alignment> >& alignments,
+			    CandidateSeqCounts& counts);
+
+  // Select and trim the candidate alleles for a region with the provided counts as add_haplotype_block() would, where the first of the
+  // sequences is the reference allele. REGION_START and REGION_END are set to the coordinates of the trimmed sequences
+  void select_candidate_seqs(const CandidateSeqCounts& counts, int period, std::vector<std::string>& sequences,
+			     int32_t& region_start, int32_t& region_end);
 
   const std::string& failure_msg(){ return failure_msg_; }
 
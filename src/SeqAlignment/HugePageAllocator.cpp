@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+
+#include "HugePageAllocator.h"
+#include "../error.h"
+
+bool HugePages::enabled_ = false;
+
+namespace {
+// Stored in the cache line preceding each allocation
+struct AllocationHeader {
+  void*  region;       // Start of the mapped or malloc'd region
+  size_t region_bytes;
+  int    kind;
+  bool   mapped;       // False for regions allocated using posix_memalign, which are freed rather than unmapped
+};
+
+std::atomic<int64_t> used_bytes[HugePages::NUM_PAGE_KINDS];
+std::atomic<int64_t> max_bytes[HugePages::NUM_PAGE_KINDS];
+
+void record_bytes(int kind, int64_t num_bytes){
+  int64_t total = (used_bytes[kind] += num_bytes);
+  int64_t peak  = max_bytes[kind].load();
+  while (total > peak && !max_bytes[kind].compare_exchange_weak(peak, total)){}
+}
+
+// Map NUM_BYTES bytes aligned to a huge page, returning NULL if the mapping failed
+void* map_aligned_region(size_t num_bytes){
+  const size_t PAGE = HugePages::HUGE_PAGE_SIZE;
+  void* region = mmap(NULL, num_bytes + PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return NULL;
+
+  // Unmap the unaligned head and the remainder of the tail
+  uintptr_t start   = (uintptr_t)region;
+  uintptr_t aligned = (start + PAGE - 1) & ~((uintptr_t)PAGE - 1);
+  if (aligned != start)
+    munmap(region, aligned - start);
+  munmap((void*)(aligned + num_bytes), start + PAGE - aligned);
+  return (void*)aligned;
+}
+
+size_t padded_bytes(size_t num_bytes){
+  return HugePages::ALIGNMENT + ((num_bytes + HugePages::ALIGNMENT - 1) & ~(HugePages::ALIGNMENT - 1));
+}
+}
+
+void* HugePages::allocate(size_t num_bytes){
+  size_t total_bytes = padded_bytes(num_bytes);
+  void* region       = NULL;
+  int kind           = REGULAR_PAGES;
+
+  if (enabled_ && total_bytes >= HUGE_PAGE_SIZE){
+    size_t mapped_bytes = (total_bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    // Explicit huge pages are always aligned, and the mapping fails immediately if too few have been reserved
+    region = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region == MAP_FAILED)
+      region = NULL;
+    else
+      kind = EXPLICIT_PAGES;
+#endif
+    if (region == NULL && (region = map_aligned_region(mapped_bytes)) != NULL){
+#ifdef MADV_HUGEPAGE
+      if (madvise(region, mapped_bytes, MADV_HUGEPAGE) == 0)
+	kind = TRANSPARENT_PAGES;
+#endif
+    }
+    if (region != NULL)
+      total_bytes = mapped_bytes;
+  }
+
+  bool mapped = (region != NULL);
+  if (!mapped && posix_memalign(&region, ALIGNMENT, total_bytes) != 0)
+    printErrorAndDie("Failed to allocate memory for the alignment matrices");
+
+  AllocationHeader* header = (AllocationHeader*) region;
+  header->region       = region;
+  header->region_bytes = total_bytes;
+  header->kind         = kind;
+  header->mapped       = mapped;
+  record_bytes(kind, total_bytes);
+  return (char*)region + ALIGNMENT;
+}
+
+void HugePages::deallocate(void* ptr){
+  if (ptr == NULL)
+    return;
+  AllocationHeader header = *(AllocationHeader*)((char*)ptr - ALIGNMENT);
+  record_bytes(header.kind, -(int64_t)header.region_bytes);
+  if (header.mapped)
+    munmap(header.region, header.region_bytes);
+  else
+    free(header.region);
+}
+
+int64_t HugePages::peak_bytes(PageKind kind){
+  return max_bytes[kind].load();
+}
+
+std::string HugePages::usage_summary(){
+  const double MB = 1024.0*1024.0;
+  std::stringstream summary;
+  summary << "Peak alignment matrix memory: " << std::fixed << std::setprecision(1)
+	  << peak_bytes(EXPLICIT_PAGES)/MB    << " MB on explicit huge pages, "
+	  << peak_bytes(TRANSPARENT_PAGES)/MB << " MB advised for transparent huge pages and "
+	  << peak_bytes(REGULAR_PAGES)/MB     << " MB on regular pages";
+  return summary.str();
+}
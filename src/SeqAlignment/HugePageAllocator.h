@@ -0,0 +1,60 @@
+#ifndef HUGE_PAGE_ALLOCATOR_H_
+#define HUGE_PAGE_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Allocates the large DP matrices in the alignment workspaces. Every allocation is aligned to a cache line and padded to
+ * a whole number of cache lines, so that vector loads never straddle lines. Once enabled, allocations of at least one huge
+ * page are instead mapped on explicit huge pages (MAP_HUGETLB) if the system has reserved any, and otherwise on 2MB-aligned
+ * regions advised for transparent huge pages (MADV_HUGEPAGE), which greatly reduces the TLB misses incurred by the
+ * scattered accesses of long alignments. Each allocation records how it was made, so the policy can be changed at any time
+ */
+class HugePages {
+ public:
+  enum PageKind { REGULAR_PAGES, TRANSPARENT_PAGES, EXPLICIT_PAGES, NUM_PAGE_KINDS };
+
+  static const size_t HUGE_PAGE_SIZE = 2097152;
+  static const size_t ALIGNMENT      = 64;
+
+  static void enable()  { enabled_ = true; }
+  static bool enabled() { return enabled_; }
+
+  static void* allocate(size_t num_bytes);
+  static void deallocate(void* ptr);
+
+  // Largest number of bytes simultaneously allocated on each kind of page
+  static int64_t peak_bytes(PageKind kind);
+
+  // Summary of the peak memory allocated on each kind of page
+  static std::string usage_summary();
+
+ private:
+  static bool enabled_;
+};
+
+template<typename T>
+struct HugePageAllocator {
+  typedef T value_type;
+
+  HugePageAllocator(){}
+  template<typename U> HugePageAllocator(const HugePageAllocator<U>& other){}
+
+  T* allocate(size_t n)          { return (T*) HugePages::allocate(n*sizeof(T)); }
+  void deallocate(T* ptr, size_t){ HugePages::deallocate(ptr); }
+};
+
+template<typename T, typename U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&){ return true;  }
+template<typename T, typename U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&){ return false; }
+
+// Vector whose storage is obtained from HugePages
+template<typename T>
+using DPVector = std::vector<T, HugePageAllocator<T> >;
+
+#endif
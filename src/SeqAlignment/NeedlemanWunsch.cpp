@@ -1,9 +1,14 @@
 #include <algorithm>
 #include <sstream>
 #include <string>
+#include <string.h>
 #include <vector>
 #include <iostream>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "../error.h"		    
 #include "NeedlemanWunsch.h"
 
@@ -143,16 +148,17 @@ namespace NeedlemanWunsch {
     }
   }
 
-  void findOptimalStop(int& L1, int& L2, 
-		       std::vector<float>& M, 
-		       std::vector<float>& Iref, 
-		       std::vector<float>& Iread, 
+  // Each of the matrix arguments points to the entries for the last row of the corresponding matrix
+  void findOptimalStop(int L1,
+		       const float* M,
+		       const float* Iref,
+		       const float* Iread,
 		       float& best_val, int& best_col, int& best_type){
     best_val   = -LARGE;
     best_col   = -1;
     best_type  = -1;
     int column = 0;
-    for (int i = L2*(L1+1); i < (L2+1)*(L1+1); i++){
+    for (int i = 0; i < L1+1; i++){
       if (M[i] >= best_val){
 	best_val  = M[i];
 	best_col  = column;
@@ -174,12 +180,12 @@ namespace NeedlemanWunsch {
     }
   }
 
-  void findOptimalStopEndPenalty(int& L1, int& L2,
-				 std::vector<float>& M,
-				 std::vector<float>& Iref,
-				 std::vector<float>& Iread,
+  void findOptimalStopEndPenalty(int L1,
+				 const float* M,
+				 const float* Iref,
+				 const float* Iread,
 				 float& best_val, int& best_col, int& best_type){
-    int i      = (L2+1)*(L1+1) - 1;
+    int i      = L1;
     best_col   = L1;
     best_val   = M[i];
     best_type  = 0;
@@ -248,15 +254,18 @@ namespace NeedlemanWunsch {
     }
   }
 
-  void traceAlignment(int best_col, 
-		      int best_type, 
+  /*
+   * Constructs the alignment strings and CIGAR string by tracing back from the provided end position. NEXT_TYPE(type, index)
+   * must return the matrix that precedes the entry at INDEX in the matrix of type TYPE in the optimal alignment
+   */
+  template<typename TraceFn>
+  void traceAlignment(int best_col,
+		      int best_type,
 		      int L1, int L2,
-		      std::vector<int>& traceM, 
-		      std::vector<int>& traceIref, 
-		      std::vector<int>& traceIread,
-		      const std::string& refseq, 
+		      TraceFn next_type,
+		      const std::string& refseq,
 		      const std::string& readseq,
-		      std::string& ref_seq_al, 
+		      std::string& ref_seq_al,
 		      std::string& read_seq_al,
 		      std::vector<CigarOp>& cigar_list){
     cigar_list.clear();
@@ -284,7 +293,7 @@ namespace NeedlemanWunsch {
 	else
 	  cigar_ss << "X";
 
-	best_type   = traceM[index];
+	best_type   = next_type(0, index);
 	best_row--;
 	best_col--;
       } 
@@ -293,7 +302,7 @@ namespace NeedlemanWunsch {
 	refseq_ss  << refseq.at(best_col-1);
 	readseq_ss << "-";
 	cigar_ss   << "D";
-	best_type   = traceIref[index];
+	best_type   = next_type(1, index);
 	best_col--;
       } 
       else if (best_type == 2){
@@ -301,7 +310,7 @@ namespace NeedlemanWunsch {
 	refseq_ss  << "-";
 	readseq_ss << readseq.at(best_row-1);
 	cigar_ss   << "I";
-	best_type   = traceIread[index];
+	best_type   = next_type(2, index);
 	best_row--;
       } 
       else
@@ -339,6 +348,96 @@ namespace NeedlemanWunsch {
     cigar_list.push_back(CigarOp(cigar_char, num));
   }
 
+  void traceAlignment(int best_col,
+		      int best_type,
+		      int L1, int L2,
+		      std::vector<int>& traceM,
+		      std::vector<int>& traceIref,
+		      std::vector<int>& traceIread,
+		      const std::string& refseq,
+		      const std::string& readseq,
+		      std::string& ref_seq_al,
+		      std::string& read_seq_al,
+		      std::vector<CigarOp>& cigar_list){
+    auto next_type = [&](int type, int index){
+      return (type == 0 ? traceM[index] : (type == 1 ? traceIref[index] : traceIread[index]));
+    };
+    traceAlignment(best_col, best_type, L1, L2, next_type, refseq, readseq, ref_seq_al, read_seq_al, cigar_list);
+  }
+
+  // The traceback pointers for an entry in each of the 3 matrices are packed into a single byte, with 2 bits per matrix
+  // in the order M, Iref and Iread. Pointers to impossible configurations (-1) are stored as NO_TRACE
+  const uint8_t NO_TRACE = 3;
+
+  inline uint8_t packTrace(int trace_M, int trace_Iref, int trace_Iread){
+    return (trace_M & 3) | ((trace_Iref & 3) << 2) | ((trace_Iread & 3) << 4);
+  }
+
+  inline int unpackTrace(uint8_t packed, int type){
+    int trace = (packed >> (2*type)) & 3;
+    return (trace == NO_TRACE ? -1 : trace);
+  }
+
+#ifdef __SSE2__
+  // Vectorized version of bestIndex() that selects the same value and traceback pointer for each of the 4 entries
+  inline __m128 bestIndex(__m128 s1, __m128 s2, __m128 s3, __m128i& trace){
+    __m128 gt_21 = _mm_cmpgt_ps(s2, s1);
+    __m128 gt_23 = _mm_cmpgt_ps(s2, s3);
+    __m128 gt_31 = _mm_cmpgt_ps(s3, s1);
+    __m128 val_a = _mm_or_ps(_mm_and_ps(gt_23, s2), _mm_andnot_ps(gt_23, s3));
+    __m128 val_b = _mm_or_ps(_mm_and_ps(gt_31, s3), _mm_andnot_ps(gt_31, s1));
+    __m128i trace_a = _mm_add_epi32(_mm_set1_epi32(2), _mm_castps_si128(gt_23));     // 1 if s2 > s3, otherwise 2
+    __m128i trace_b = _mm_and_si128(_mm_castps_si128(gt_31), _mm_set1_epi32(2));     // 2 if s3 > s1, otherwise 0
+    __m128i mask    = _mm_castps_si128(gt_21);
+    trace = _mm_or_si128(_mm_and_si128(mask, trace_a), _mm_andnot_si128(mask, trace_b));
+    return _mm_or_ps(_mm_and_ps(gt_21, val_a), _mm_andnot_ps(gt_21, val_b));
+  }
+#endif
+
+  /*
+   * Computes row I of the 3 matrices from the previous row. The M and Iread entries only depend on the previous row,
+   * so they're computed for 4 columns at a time when SSE2 is available, followed by a serial scan for the Iref entries.
+   * The same comparisons and float operations are performed as in nw_helper(), so the scores and traceback pointers are identical
+   */
+  void nw_row(int i, int L1, const float* profile,
+	      const float* prev_M, const float* prev_Iref, const float* prev_Iread,
+	      float* M, float* Iref, float* Iread, uint8_t* trace){
+    M[0]     = -LARGE;
+    Iref[0]  = -LARGE;
+    Iread[0] = -GAPOPEN-(i-1)*GAPEXTEND;
+    trace[0] = packTrace(-1, -1, 2);
+
+    int j = 1, c_M, c_Iread;
+#ifdef __SSE2__
+    const __m128 gap_open = _mm_set1_ps(GAPOPEN), gap_extend = _mm_set1_ps(GAPEXTEND);
+    for (; j+4 <= L1+1; j += 4){
+      __m128i trace_M, trace_Iread;
+      __m128 best_M = bestIndex(_mm_loadu_ps(prev_M+j-1), _mm_loadu_ps(prev_Iref+j-1), _mm_loadu_ps(prev_Iread+j-1), trace_M);
+      _mm_storeu_ps(M+j, _mm_add_ps(best_M, _mm_loadu_ps(profile+j)));
+      __m128 up_M = _mm_loadu_ps(prev_M+j), up_Iref = _mm_loadu_ps(prev_Iref+j), up_Iread = _mm_loadu_ps(prev_Iread+j);
+      _mm_storeu_ps(Iread+j, bestIndex(_mm_sub_ps(up_M, gap_open), _mm_sub_ps(up_Iref, gap_open), _mm_sub_ps(up_Iread, gap_extend), trace_Iread));
+
+      // Pack the 32-bit traceback pointers into bytes
+      __m128i packed = _mm_or_si128(trace_M, _mm_slli_epi32(trace_Iread, 4));
+      packed = _mm_packs_epi32(packed, packed);
+      packed = _mm_packus_epi16(packed, packed);
+      int32_t bytes = _mm_cvtsi128_si32(packed);
+      memcpy(trace+j, &bytes, sizeof(bytes));
+    }
+#endif
+    for (; j <= L1; j++){
+      M[j]     = bestIndex(prev_M[j-1], prev_Iref[j-1], prev_Iread[j-1], &c_M) + profile[j];
+      Iread[j] = bestIndex(prev_M[j]-GAPOPEN, prev_Iref[j]-GAPOPEN, prev_Iread[j]-GAPEXTEND, &c_Iread);
+      trace[j] = packTrace(c_M, 0, c_Iread);
+    }
+
+    int c_Iref;
+    for (j = 1; j <= L1; j++){
+      Iref[j]   = bestIndex(M[j-1]-GAPOPEN, Iref[j-1]-GAPEXTEND, Iread[j-1]-GAPOPEN, &c_Iref);
+      trace[j] |= (c_Iref << 2);
+    }
+  }
+
   void initMatrices(std::vector<float>& M,    std::vector<float>& Iref,    std::vector<float>& Iread,
 		    std::vector<int>& traceM, std::vector<int>& traceIref, std::vector<int>& traceIread,
 		    int L1, int L2, bool use_ref_end_penalty){
@@ -383,37 +482,61 @@ namespace NeedlemanWunsch {
   bool Align(const std::string& ref_seq, const std::string& read_seq,
 	     std::string& ref_seq_al, std::string& read_seq_al,
 	     float* score, std::vector<CigarOp>& cigar_list, bool use_ref_end_penalty){
-    int L1       = ref_seq.length();
-    int L2       = read_seq.length();
-    int mat_size = (L1+1)*(L2+1);
+    int L1 = ref_seq.length();
+    int L2 = read_seq.length();
+
+    // Score of aligning each type of read base to each reference column, with the column index offset by 1 to match the matrices
+    std::vector<float> profiles(5*(L1+1), 0.0);
+    for (int j = 1; j <= L1; j++){
+      int ref_base = base_to_int(ref_seq[j-1]);
+      for (int read_base = 0; read_base < 5; read_base++)
+	profiles[read_base*(L1+1) + j] = s[ref_base][read_base];
+    }
 
-    // Scoring matrices:
+    // Only the previous row of each scoring matrix is required to compute the next row:
     //  M:     Ref and read bases aligned
     //  Iref:  Ref base aligned with gap
     //  Iread: Read base aligned with gap
-    std::vector<float> M(mat_size), Iref(mat_size), Iread(mat_size);
-
-    // Traceback matrices
-    std::vector<int> traceM(mat_size), traceIref(mat_size), traceIread(mat_size);
-
-    // Initialize matrices
-    initMatrices(M, Iref, Iread, traceM, traceIref, traceIread, L1, L2, use_ref_end_penalty);
+    std::vector<float> rows(6*(L1+1));
+    float *prev_M = &rows[0],        *prev_Iref = &rows[L1+1],   *prev_Iread = &rows[2*(L1+1)];
+    float *M      = &rows[3*(L1+1)], *Iref      = &rows[4*(L1+1)], *Iread    = &rows[5*(L1+1)];
+
+    // Packed traceback pointers for every entry
+    std::vector<uint8_t> trace((L1+1)*(L2+1));
+
+    // Initialize row 0 as in initMatrices()
+    prev_M[0] = 0.0;
+    prev_Iref[0] = prev_Iread[0] = -LARGE;
+    trace[0]  = 0;
+    for (int j = 1; j <= L1; j++){
+      prev_Iref[j]  = (!use_ref_end_penalty ? 0.0 : -GAPOPEN-(j-1)*GAPEXTEND);
+      prev_Iread[j] = -LARGE;
+      prev_M[j]     = -LARGE;
+      trace[j]      = packTrace(-1, 1, -1);
+    }
 
-    // Fill out scoring and traceback matrices using variant of NW algorithm
-    nw_helper(M, Iref, Iread, traceM, traceIref, traceIread, ref_seq, read_seq);
+    // Fill out the matrices using variant of NW algorithm
+    for (int i = 1; i <= L2; i++){
+      const float* profile = &profiles[base_to_int(read_seq[i-1])*(L1+1)];
+      nw_row(i, L1, profile, prev_M, prev_Iref, prev_Iread, M, Iref, Iread, &trace[i*(L1+1)]);
+      std::swap(prev_M, M);
+      std::swap(prev_Iref, Iref);
+      std::swap(prev_Iread, Iread);
+    }
 
     // Find the best ending point for the alignment
     float best_val;
     int best_col, best_type;
     if (use_ref_end_penalty)
-      findOptimalStopEndPenalty(L1, L2, M, Iref, Iread, best_val, best_col, best_type);
+      findOptimalStopEndPenalty(L1, prev_M, prev_Iref, prev_Iread, best_val, best_col, best_type);
     else
-      findOptimalStop(L1, L2, M, Iref, Iread, best_val, best_col, best_type);
+      findOptimalStop(L1, prev_M, prev_Iref, prev_Iread, best_val, best_col, best_type);
     *score = best_val;
 
     // Construct the alignment strings and CIGAR string using the traceback 
-    // matrices and the optimal end position
-    traceAlignment(best_col, best_type, L1, L2, traceM, traceIref, traceIread,
+    // pointers and the optimal end position
+    auto next_type = [&](int type, int index){ return unpackTrace(trace[index], type); };
+    traceAlignment(best_col, best_type, L1, L2, next_type,
 		   ref_seq, read_seq, ref_seq_al, read_seq_al, cigar_list);
 
     // Don't proceed if the read sequence extends past the reference boundaries
@@ -602,9 +725,9 @@ namespace NeedlemanWunsch {
     float best_val;
     int best_col, best_type;
     if (use_ref_end_penalty)
-      findOptimalStopEndPenalty(L1, L2, M, Iref, Iread, best_val, best_col, best_type);
+      findOptimalStopEndPenalty(L1, &M[L2*(L1+1)], &Iref[L2*(L1+1)], &Iread[L2*(L1+1)], best_val, best_col, best_type);
     else
-      findOptimalStop(L1, L2, M, Iref, Iread, best_val, best_col, best_type);
+      findOptimalStop(L1, &M[L2*(L1+1)], &Iref[L2*(L1+1)], &Iread[L2*(L1+1)], best_val, best_col, best_type);
     *score = best_val;
 
     // Construct the alignment strings and CIGAR string using the traceback 
@@ -18,6 +18,14 @@ class RepeatBlock : public HapBlock {
     std::vector<StutterAlignerClass*> stutter_aligners_;
     bool reversed_;
 
+    // Construct a block whose reference allele uses the provided stutter aligner
+    RepeatBlock(int32_t start, int32_t end, std::string ref_seq, int period, StutterModel* stutter_model, bool reversed,
+		StutterAlignerClass* ref_aligner): HapBlock(start, end, ref_seq){
+      repeat_info_ = new RepeatStutterInfo(period, ref_seq, stutter_model);
+      reversed_    = reversed;
+      stutter_aligners_.push_back(ref_aligner);
+    }
+
  public:
  RepeatBlock(int32_t start, int32_t end, std::string ref_seq, int period, StutterModel* stutter_model, const bool reversed=false): HapBlock(start, end, ref_seq){
       repeat_info_ = new RepeatStutterInfo(period, ref_seq, stutter_model);
@@ -63,6 +71,25 @@ class RepeatBlock : public HapBlock {
 	  new_block->add_alternate(alt_seqs_[i]);
       return new_block;
     }
+
+    // Moves the retained alleles' stutter aligners into the new block instead of rebuilding them
+    RepeatBlock* extract_alleles(std::vector<int>& allele_indices){
+      std::set<int> bad_alleles(allele_indices.begin(), allele_indices.end());
+      assert(bad_alleles.find(0) == bad_alleles.end());
+
+      RepeatBlock* new_block = new RepeatBlock(start_, end_, ref_seq_, repeat_info_->get_period(), repeat_info_->get_stutter_model(),
+					       reversed_, stutter_aligners_[0]);
+      stutter_aligners_[0] = NULL;
+      for (unsigned int i = 0; i < alt_seqs_.size(); i++){
+	if (bad_alleles.find(i+1) == bad_alleles.end()){
+	  new_block->HapBlock::add_alternate(alt_seqs_[i]);
+	  new_block->repeat_info_->add_alternate_allele(alt_seqs_[i]);
+	  new_block->stutter_aligners_.push_back(stutter_aligners_[i+1]);
+	  stutter_aligners_[i+1] = NULL;
+	}
+      }
+      return new_block;
+    }
 };
 
 
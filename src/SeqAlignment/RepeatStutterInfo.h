@@ -1,8 +1,11 @@
 #ifndef REPEAT_STUTTER_INFO_H_
 #define REPEAT_STUTTER_INFO_H_
 
+#include <assert.h>
+
 #include <algorithm>
 #include <string>
+#include <vector>
 
 #include "../error.h"
 #include "../stutter_model.h"
@@ -19,10 +22,30 @@ class RepeatStutterInfo {
   StutterModel* stutter_model_;
   std::vector<int> allele_sizes_;
 
+  // Log-probabilities of each PCR artifact for each allele, where the artifacts for an allele are
+  // contiguous and ordered from the largest deletion (max_del_) to the largest insertion (max_ins_) in steps of period_
+  int num_artifacts_;
+  std::vector<double> artifact_log_probs_;
+
+  void add_artifact_log_probs(int allele_size){
+    for (int artifact_size = max_del_; artifact_size <= max_ins_; artifact_size += period_){
+      int read_size = allele_size + artifact_size;
+      artifact_log_probs_.push_back(read_size < 0 ? LARGE_NEGATIVE : stutter_model_->log_stutter_pmf(allele_size, read_size));
+    }
+  }
+
+  void compute_artifact_log_probs(){
+    artifact_log_probs_.clear();
+    artifact_log_probs_.reserve(allele_sizes_.size()*num_artifacts_);
+    for (auto size_iter = allele_sizes_.begin(); size_iter != allele_sizes_.end(); size_iter++)
+      add_artifact_log_probs(*size_iter);
+  }
+
   RepeatStutterInfo(){
     period_        = -1;
     max_ins_       = -1;
     max_del_       = 1;
+    num_artifacts_ = 0;
     stutter_model_ = NULL;
   }
 
@@ -31,8 +54,10 @@ class RepeatStutterInfo {
     period_        = period;
     max_ins_       = MAX_STUTTER_REPEAT_INS*period_;
     max_del_       = MAX_STUTTER_REPEAT_DEL*period_;
+    num_artifacts_ = MAX_STUTTER_REPEAT_INS - MAX_STUTTER_REPEAT_DEL + 1;
     stutter_model_ = stutter_model->copy();
     allele_sizes_.push_back(ref_allele.size());
+    add_artifact_log_probs(ref_allele.size());
   }
 
   ~RepeatStutterInfo(){
@@ -44,6 +69,7 @@ class RepeatStutterInfo {
     if (stutter_model_ != NULL)
       delete stutter_model_;
     stutter_model_ = model->copy();
+    compute_artifact_log_probs();
   }
 
   inline StutterModel* get_stutter_model()     const  { return stutter_model_;  }
@@ -53,16 +79,25 @@ class RepeatStutterInfo {
 
   void add_alternate_allele(std::string& alt_allele){
     allele_sizes_.push_back((int)alt_allele.size());
+    add_artifact_log_probs(alt_allele.size());
+  }
+
+  inline int num_artifacts() const { return num_artifacts_; }
+
+  /*
+   * Returns the table of artifact log-probabilities for the allele, indexed by (artifact_size - max_deletion())/period.
+   * The table is invalidated by set_stutter_model() and add_alternate_allele()
+   */
+  inline const double* artifact_log_probs(int seq_index) const {
+    assert(seq_index >= 0 && seq_index < (int)allele_sizes_.size());
+    return artifact_log_probs_.data() + seq_index*num_artifacts_;
   }
 
   inline double log_prob_pcr_artifact(int seq_index, int artifact_size) const {
-    int read_size = allele_sizes_.at(seq_index)+artifact_size;
-    if (artifact_size == 0)
-      return stutter_model_->log_stutter_pmf(allele_sizes_[seq_index], read_size);
-    else if (artifact_size > 0)
-      return (artifact_size > max_ins_ ? LARGE_NEGATIVE : stutter_model_->log_stutter_pmf(allele_sizes_[seq_index], read_size));
-    else
-      return (artifact_size < max_del_ || read_size < 0 ? LARGE_NEGATIVE : stutter_model_->log_stutter_pmf(allele_sizes_[seq_index], read_size));
+    if (artifact_size > max_ins_ || artifact_size < max_del_)
+      return LARGE_NEGATIVE;
+    assert(artifact_size % period_ == 0);
+    return artifact_log_probs(seq_index)[(artifact_size - max_del_)/period_];
   }
 };
 #endif
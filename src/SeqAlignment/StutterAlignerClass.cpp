@@ -7,42 +7,75 @@
 
 #include "../error.h"
 #include "../mathops.h"
+#include "../perf_counters.h"
 #include "StutterAlignerClass.h"
 
-void StutterAlignerClass::load_read(const int base_seq_len,       const char* base_seq,
-				    const double* base_log_wrong, const double* base_log_correct,
-				    int max_deletion,             int max_insertion){
-  delete [] ins_probs_;
-  delete [] del_probs_;
-  delete [] match_probs_;
-  ins_probs_   = new double[base_seq_len*num_artifacts_];
-  del_probs_   = new double[base_seq_len*num_artifacts_];
-  match_probs_ = new double[base_seq_len];
+template<int PERIOD> void StutterAlignerClass::load_read_kernel(const int base_seq_len,       const char* base_seq,
+								const double* base_log_wrong, const double* base_log_correct,
+								int max_deletion,             int max_insertion){
+  const int period = (PERIOD > 0 ? PERIOD : period_);
+  // Only reallocate the arrays when the read is longer than any previous read
+  if (base_seq_len > read_capacity_){
+    delete [] ins_probs_;
+    delete [] del_probs_;
+    delete [] match_probs_;
+    ins_probs_     = new double[base_seq_len*num_artifacts_];
+    del_probs_     = new double[base_seq_len*num_artifacts_];
+    match_probs_   = new double[base_seq_len];
+    read_capacity_ = base_seq_len;
+  }
+  assert(max_insertion == num_artifacts_*period && max_deletion == -max_insertion);
+
+  // If the block's last MAX_INSERTION bases are periodic, an insertion's bases are compared to the same block bases as a deletion's,
+  // so the insertion LLs are the same partial sums recorded for the deletions and the read is only scanned once per offset
   int ins_index = 0, del_index = 0, match_index = 0;
   for (int i = 0; i < base_seq_len; i++){
     int j;
     double log_prob = 0.0;
     for (j = 0; j < std::min(base_seq_len-i, -max_deletion); j++){
       log_prob += (base_seq[-i-j] == block_seq_[-j] ? base_log_correct[-i-j] : base_log_wrong[-i-j]);
-      if ((j+1) % period_ == 0)
+      if ((j+1) % period == 0){
 	del_probs_[del_index++] = log_prob;
+	if (periodic_tail_)
+	  ins_probs_[ins_index++] = log_prob;
+      }
     }
-    for (; j < -max_deletion; j++)
-      if ((j+1) % period_ == 0)
+    for (int k = j; k < -max_deletion; k++){
+      if ((k+1) % period == 0){
 	del_index++;
+	if (periodic_tail_)
+	  ins_probs_[ins_index++] = log_prob;
+      }
+    }
+    if (!periodic_tail_){
+      double log_ins_prob = 0.0;
+      int k;
+      for (k = 0; k < std::min(max_insertion, base_seq_len-i); k++){
+	log_ins_prob += (base_seq[-i-k] == block_seq_[-(k%period)] ? base_log_correct[-i-k] : base_log_wrong[-i-k]);
+	if ((k+1) % period == 0)
+	  ins_probs_[ins_index++] = log_ins_prob;
+      }
+      for (; k < max_insertion; k++)
+	if ((k+1) % period == 0)
+	  ins_probs_[ins_index++] = log_ins_prob;
+    }
     for (; j < std::min(base_seq_len-i, block_len_); j++)
       log_prob += (base_seq[-i-j] == block_seq_[-j] ? base_log_correct[-i-j] : base_log_wrong[-i-j]);
     match_probs_[match_index++] = log_prob;
+  }
+}
 
-    double log_ins_prob = 0.0;
-    for (j = 0; j < std::min(max_insertion, base_seq_len-i); j++){
-      log_ins_prob += (base_seq[-i-j] == block_seq_[-(j%period_)] ? base_log_correct[-i-j] : base_log_wrong[-i-j]);
-      if ((j+1) % period_ == 0)
-	ins_probs_[ins_index++] = log_ins_prob;
-    }
-    for (; j < max_insertion; j++)
-      if ((j+1) % period_ == 0)
-        ins_probs_[ins_index++] = log_ins_prob;
+void StutterAlignerClass::load_read(const int base_seq_len,       const char* base_seq,
+				    const double* base_log_wrong, const double* base_log_correct,
+				    int max_deletion,             int max_insertion){
+  switch(period_){
+  case 1:  load_read_kernel<1>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
+  case 2:  load_read_kernel<2>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
+  case 3:  load_read_kernel<3>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
+  case 4:  load_read_kernel<4>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
+  case 5:  load_read_kernel<5>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
+  case 6:  load_read_kernel<6>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
+  default: load_read_kernel<0>(base_seq_len, base_seq, base_log_wrong, base_log_correct, max_deletion, max_insertion); break;
   }
 }
 
@@ -51,16 +84,17 @@ double StutterAlignerClass::align_no_artifact_reverse(const int base_seq_len,
   return match_probs_[offset];
 }
 
-double StutterAlignerClass::align_pcr_insertion_reverse(const int base_seq_len,       const char*   base_seq, const int offset,
-							const double* base_log_wrong, const double* base_log_correct, const int D,
-							int& best_ins_pos){
-  assert(D > 0 && base_seq_len <= block_len_+D && D%period_ == 0);
+template<int PERIOD> double StutterAlignerClass::align_pcr_insertion_kernel(const int base_seq_len,       const char*   base_seq, const int offset,
+									   const double* base_log_wrong, const double* base_log_correct, const int D,
+									   int& best_ins_pos){
+  const int period = (PERIOD > 0 ? PERIOD : period_);
+  assert(D > 0 && base_seq_len <= block_len_+D && D%period == 0);
   log_probs_.clear();
   double log_prior = -int_log(block_len_+1);
   int* upstream_matches = upstream_match_lengths_[0] + block_len_ - 1;
 
   // Compute probability for i = 0
-  double log_prob = log_prior + ins_probs_[num_artifacts_*offset + D/period_ - 1] + (base_seq_len > D ? match_probs_[offset+D] : 0);
+  double log_prob = log_prior + ins_probs_[num_artifacts_*offset + D/period - 1] + (base_seq_len > D ? match_probs_[offset+D] : 0);
   best_ins_pos    = 0;
   double best_LL  = log_prob;
   log_probs_.push_back(log_prob);
@@ -68,11 +102,11 @@ double StutterAlignerClass::align_pcr_insertion_reverse(const int base_seq_len,
   // Compute for all other i's, reusing previous result to accelerate computation
   int i = 0;
   for (; i > -std::min(std::max(0, base_seq_len-D), block_len_); i--){
-    if (-i+period_ < block_len_) {
+    if (-i+period < block_len_) {
       if (upstream_matches[i] == 0){
-        for (int index = i-period_; index >= i-D; index -= period_){
+        for (int index = i-period; index >= i-D; index -= period){
           log_prob -= (base_seq[index] == block_seq_[i]         ? base_log_correct[index] : base_log_wrong[index]);
-          log_prob += (base_seq[index] == block_seq_[i-period_] ? base_log_correct[index] : base_log_wrong[index]);
+          log_prob += (base_seq[index] == block_seq_[i-period] ? base_log_correct[index] : base_log_wrong[index]);
         }
 	log_probs_.push_back(log_prob);
       }
@@ -98,6 +132,20 @@ double StutterAlignerClass::align_pcr_insertion_reverse(const int base_seq_len,
   return fast_log_sum_exp(log_probs_);
 }
 
+double StutterAlignerClass::align_pcr_insertion_reverse(const int base_seq_len,       const char*   base_seq, const int offset,
+							const double* base_log_wrong, const double* base_log_correct, const int D,
+							int& best_ins_pos){
+  switch(period_){
+  case 1:  return align_pcr_insertion_kernel<1>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  case 2:  return align_pcr_insertion_kernel<2>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  case 3:  return align_pcr_insertion_kernel<3>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  case 4:  return align_pcr_insertion_kernel<4>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  case 5:  return align_pcr_insertion_kernel<5>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  case 6:  return align_pcr_insertion_kernel<6>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  default: return align_pcr_insertion_kernel<0>(base_seq_len, base_seq, offset, base_log_wrong, base_log_correct, D, best_ins_pos);
+  }
+}
+
 double StutterAlignerClass::align_pcr_deletion_reverse(const int base_seq_len,       const char*   base_seq, const int offset,
 						       const double* base_log_wrong, const double* base_log_correct, const int D,
 						       int& best_del_pos){
@@ -147,6 +195,7 @@ double StutterAlignerClass::align_pcr_deletion_reverse(const int base_seq_len,
 double StutterAlignerClass::align_stutter_region_reverse(const int base_seq_len,       const char*   base_seq, const int offset,
 							 const double* base_log_wrong, const double* base_log_correct, const int D,
 							 int& best_pos){
+  PerfScope perf_scope(PERF_STUTTER_ALIGNMENT);
   best_pos = -1;
   if (D == 0)
     return align_no_artifact_reverse(base_seq_len, base_seq,   offset, base_log_wrong, base_log_correct);
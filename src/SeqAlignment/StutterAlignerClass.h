@@ -16,10 +16,25 @@ class StutterAlignerClass {
   std::vector<int*> upstream_match_lengths_;
 
   int num_artifacts_;
+  bool periodic_tail_; // True iff the block's last num_artifacts_*period_ bases consist of copies of its last period_ bases
+  int read_capacity_; // Maximum read length the arrays below can accommodate
   double* ins_probs_;
   double* del_probs_;
   double* match_probs_;
  
+  /*
+   * Kernels templated on the motif period so that the modulo operations and strided loops over each
+   * artifact's bases are resolved at compile time. A PERIOD of 0 denotes the generic kernel, which instead
+   * uses the runtime period and is used for any periods without a specialization
+   */
+  template<int PERIOD> void load_read_kernel(const int base_seq_len,       const char* base_seq,
+					     const double* base_log_wrong, const double* base_log_correct,
+					     int max_deletion,             int max_insertion);
+
+  template<int PERIOD> double align_pcr_insertion_kernel(const int base_seq_len,       const char*   base_seq, const int offset,
+							 const double* base_log_wrong, const double* base_log_correct, const int D,
+							 int& best_ins_pos);
+
   double align_no_artifact_reverse(const int base_seq_len,       const char*   base_seq, const int offset,
 				   const double* base_log_wrong, const double* base_log_correct);
   
@@ -58,6 +73,10 @@ class StutterAlignerClass {
     assert(stutter_info->max_insertion() == -1*stutter_info->max_deletion());
     assert(stutter_info->max_insertion()%period_ == 0 && block_len_+stutter_info->max_deletion() >= 0);
     num_artifacts_ = stutter_info->max_insertion()/period_;
+    periodic_tail_ = true;
+    for (int j = period_; j < stutter_info->max_insertion(); j++)
+      periodic_tail_ &= (block_seq_[-j] == block_seq_[-(j%period_)]);
+    read_capacity_ = 0;
     ins_probs_     = NULL;
     del_probs_     = NULL;
     match_probs_   = NULL;
@@ -0,0 +1,101 @@
+#ifndef ALIGNMENT_BATCH_H_
+#define ALIGNMENT_BATCH_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "bam_io.h"
+
+/*
+ * Reads alignments in batches and stores columnar copies of the fixed-width fields used by the cheapest read filters.
+ * These filters run as a single branch-free pass over the columns of each batch, which the compiler can vectorize, so
+ * reads that are unmapped or can't contribute to the region are discarded without examining any sequences, qualities or tags
+ */
+class AlignmentBatch {
+ private:
+  int32_t region_start_, region_stop_;
+  std::vector<BamAlignment> alns_;
+  std::vector<int32_t> pos_, end_pos_, mate_pos_, length_, num_cigar_ops_;
+  std::vector<uint16_t> flags_;
+  std::vector<uint8_t> keep_;
+  int32_t size_, next_index_;
+  int64_t num_distant_, num_unusable_;
+  int64_t num_fetched_, num_bytes_;
+
+  template<typename Reader>
+  bool fill(Reader& reader){
+    next_index_ = 0;
+    size_       = reader.GetNextAlignments(alns_);
+    num_fetched_ += size_;
+    for (int32_t i = 0; i < size_; i++){
+      const BamAlignment& aln = alns_[i];
+      num_bytes_       += BAM_RECORD_OVERHEAD + aln.b_->l_data;
+      pos_[i]           = aln.Position();
+      end_pos_[i]       = aln.GetEndPosition();
+      mate_pos_[i]      = aln.MatePosition();
+      length_[i]        = aln.Length();
+      num_cigar_ops_[i] = aln.CigarView().size();
+      flags_[i]         = aln.b_->core.flag;
+    }
+    return size_ > 0;
+  }
+
+  // Keep the alignments that either overlap the region or whose mate pair may overlap it,
+  // and that are also mapped and have a non-zero position, length and number of CIGAR operations
+  void filter(){
+    int32_t distant = 0, unusable = 0;
+    for (int32_t i = 0; i < size_; i++){
+      int32_t overlaps  = (pos_[i] <= region_stop_) & (end_pos_[i] >= region_start_);
+      int32_t mate_near = ((flags_[i] & BAM_FPAIRED) != 0) & (mate_pos_[i] != pos_[i]) & (mate_pos_[i] <= region_stop_)
+	& (mate_pos_[i] + length_[i] + 100 >= region_start_);
+      int32_t nearby    = overlaps | mate_near;
+      int32_t usable    = ((flags_[i] & BAM_FUNMAP) == 0) & (pos_[i] != 0) & (num_cigar_ops_[i] != 0) & (length_[i] != 0);
+      keep_[i]  = (uint8_t)(nearby & usable);
+      distant  += 1 - nearby;
+      unusable += nearby & (1 - usable);
+    }
+    num_distant_  += distant;
+    num_unusable_ += unusable;
+  }
+
+ public:
+  static const int32_t DEFAULT_CAPACITY = 256;
+  static const int32_t BAM_RECORD_OVERHEAD = 36; // Bytes of each BAM record's block size and fixed-length fields
+
+  AlignmentBatch(int32_t region_start, int32_t region_stop, int32_t capacity = DEFAULT_CAPACITY)
+    : region_start_(region_start), region_stop_(region_stop), alns_(capacity), pos_(capacity), end_pos_(capacity),
+      mate_pos_(capacity), length_(capacity), num_cigar_ops_(capacity), flags_(capacity), keep_(capacity){
+    size_ = next_index_ = 0;
+    num_distant_ = num_unusable_ = 0;
+    num_fetched_ = num_bytes_    = 0;
+  }
+
+  /*
+   * Returns the next alignment from the reader that passes the filters, or NULL if none remain. The alignment
+   * may be modified or moved from, but is only valid until the next call
+   */
+  template<typename Reader>
+  BamAlignment* next_alignment(Reader& reader){
+    while (true){
+      while (next_index_ < size_){
+	int32_t index = next_index_++;
+	if (keep_[index])
+	  return &alns_[index];
+      }
+      if (!fill(reader))
+	return NULL;
+      filter();
+    }
+  }
+
+  // Numbers of reads that neither overlapped the region nor had a mate pair that could,
+  // and of the remaining reads that were unmapped or lacked bases or CIGAR operations
+  int64_t num_distant()  const { return num_distant_;  }
+  int64_t num_unusable() const { return num_unusable_; }
+
+  // Number of reads fetched from the reader and the total size of their uncompressed BAM records
+  int64_t num_fetched()  const { return num_fetched_;  }
+  int64_t num_bytes()    const { return num_bytes_;    }
+};
+
+#endif
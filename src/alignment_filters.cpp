@@ -1,3 +1,5 @@
+#include <ctype.h>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -9,18 +11,23 @@
 using namespace std;
 
 namespace AlignmentFilters {
-  template<typename CigarIterator> int GetDistToIndel(CigarIterator iter, CigarIterator end){
+  /* Distance from the first (or last if FROM_END is true) aligned base to the first indel, or -1 if no such indel exists */
+  int GetDistToIndel(const CigarSpan& cigar, bool from_end){
+    int index = (from_end ? cigar.size()-1 : 0);
+    int step  = (from_end ? -1 : 1);
+    int end   = (from_end ? -1 : cigar.size());
+
     // Process leading clipping ops
-    if (iter != end && iter->Type == 'H')
-      iter++;
-    if (iter != end && iter->Type == 'S')
-      iter++;
+    if (index != end && cigar.type(index) == 'H')
+      index += step;
+    if (index != end && cigar.type(index) == 'S')
+      index += step;
     
     int dist = 0;
-    while (iter != end){
-      char type = iter->Type;
+    while (index != end){
+      char type = cigar.type(index);
       if (type == 'M')
-	dist += iter->Length;
+	dist += cigar.length(index);
       else if (type == 'I' || type == 'D')
 	return dist;
       else if (type == 'S' || type == 'H')
@@ -30,7 +37,7 @@ namespace AlignmentFilters {
 	msg += type;
 	printErrorAndDie(msg);
       }
-      iter++;
+      index += step;
     }
     return -1;
   }
@@ -43,9 +50,9 @@ namespace AlignmentFilters {
   }
   
   pair<int,int> GetEndDistToIndel(BamAlignment& aln){
-    vector<int> vals;
-    int head_dist = GetDistToIndel(aln.CigarData().begin(),  aln.CigarData().end());
-    int tail_dist = GetDistToIndel(aln.CigarData().rbegin(), aln.CigarData().rend());
+    CigarSpan cigar = aln.CigarView();
+    int head_dist   = GetDistToIndel(cigar, false);
+    int tail_dist   = GetDistToIndel(cigar, true);
     return pair<int,int>(head_dist, tail_dist);
   }
   
@@ -55,28 +62,30 @@ namespace AlignmentFilters {
     
     unsigned int read_index = 0;
     unsigned int ref_index  = aln.Position()-ref_seq_start;
-    auto cigar_iter = aln.CigarData().begin();
+    CigarSpan cigar         = aln.CigarView();
+    SequenceView bases      = aln.QueryBasesView();
+    int cigar_index         = 0;
     bool beginning = true;
     int match_run  = 0;
     int head_match = 0;
 
     // Process leading clip CIGAR types
-    if (cigar_iter != aln.CigarData().end() && cigar_iter->Type == 'H')
-      cigar_iter++;
-    if (cigar_iter != aln.CigarData().end() && cigar_iter->Type == 'S'){
-      read_index += cigar_iter->Length;
-      cigar_iter++;
+    if (cigar_index != cigar.size() && cigar.type(cigar_index) == 'H')
+      cigar_index++;
+    if (cigar_index != cigar.size() && cigar.type(cigar_index) == 'S'){
+      read_index += cigar.length(cigar_index);
+      cigar_index++;
     }
     
     // Process CIGAR items as long as read region lies within reference sequence bounds
-    while (cigar_iter != aln.CigarData().end() && ref_index < ref_seq.size() && read_index < aln.QueryBases().size()){
-      if (cigar_iter->Type == 'M'){
-	if (ref_index + cigar_iter->Length > ref_seq.size()) 
+    while (cigar_index != cigar.size() && ref_index < ref_seq.size() && read_index < bases.size()){
+      if (cigar.type(cigar_index) == 'M'){
+	if (ref_index + cigar.length(cigar_index) > ref_seq.size()) 
 	  return pair<int,int>(-1, -1);
-	if (read_index + cigar_iter->Length > aln.Length())
+	if (read_index + cigar.length(cigar_index) > aln.Length())
 	  printErrorAndDie("Nucleotides for aligned read don't correspond to the CIGAR string");
-	for (unsigned int len = cigar_iter->Length; len > 0; len--){
-	  if ((char)tolower(ref_seq[ref_index]) == (char)tolower(aln.QueryBases()[read_index]))
+	for (unsigned int len = cigar.length(cigar_index); len > 0; len--){
+	  if ((char)tolower(ref_seq[ref_index]) == (char)tolower(bases[read_index]))
 	    match_run++;
 	  else {
 	    if (beginning) head_match = match_run;
@@ -87,38 +96,38 @@ namespace AlignmentFilters {
 	  ref_index++;
 	}
       }
-      else if (cigar_iter->Type == 'I'){
+      else if (cigar.type(cigar_index) == 'I'){
 	if (beginning) head_match = match_run;
 	beginning   = false;
 	match_run   = 0;
-	read_index += cigar_iter->Length;
+	read_index += cigar.length(cigar_index);
       }
-      else if (cigar_iter->Type == 'D'){
+      else if (cigar.type(cigar_index) == 'D'){
 	if (beginning) head_match = match_run;
 	beginning  = false;
 	match_run  = 0;
-	ref_index += cigar_iter->Length;
+	ref_index += cigar.length(cigar_index);
       }
-      else if (cigar_iter->Type == 'S' || cigar_iter->Type == 'H')
+      else if (cigar.type(cigar_index) == 'S' || cigar.type(cigar_index) == 'H')
 	break;
       else {
 	string msg = "Invalid CIGAR char";
-	msg += cigar_iter->Type;
+	msg += cigar.type(cigar_index);
 	printErrorAndDie(msg);
       }
-      cigar_iter++;
+      cigar_index++;
     }
 
     // Process trailing clip CIGAR types
-    if (cigar_iter != aln.CigarData().end() && cigar_iter->Type == 'S'){
-      read_index += cigar_iter->Length;
-      cigar_iter++;
+    if (cigar_index != cigar.size() && cigar.type(cigar_index) == 'S'){
+      read_index += cigar.length(cigar_index);
+      cigar_index++;
     }
-    if (cigar_iter != aln.CigarData().end() && cigar_iter->Type == 'H')
-      cigar_iter++;
+    if (cigar_index != cigar.size() && cigar.type(cigar_index) == 'H')
+      cigar_index++;
     
     // Ensure that we processed all CIGAR options
-    if (cigar_iter != aln.CigarData().end()){
+    if (cigar_index != cigar.size()){
       if (ref_index >= ref_seq.size())
 	return pair<int,int>(-1,-1);
       else
@@ -126,7 +135,7 @@ namespace AlignmentFilters {
     }
     
     // Ensure that CIGAR string corresponded to aligned bases
-    if (read_index != aln.QueryBases().size()){
+    if (read_index != bases.size()){
       if (ref_index >= ref_seq.size())
 	return pair<int,int>(-1,-1);
       else
@@ -140,51 +149,142 @@ namespace AlignmentFilters {
   } 
 
 
-  /* 
-     Stores the sequence, start and end position of the read after removing clipped bases
-     using the provided references
+  /*
+   * Bit-parallel scan for HasLargestEndMatches(), which avoids extracting the read's bases and computing the Z-array for every read.
+   * Each bit of a 64-bit word tracks whether one of the candidate alignment positions still matches the read. The word is ANDed with
+   * a mask of the reference positions whose base equals the next read base, obtained by shifting one of the per-base bitmasks of the
+   * reference window, so the candidates are all extended by one base using a few word operations. The scan stops as soon as the
+   * outcome is known, which is usually after a few bases. Bases are compared case-insensitively, exactly as in ZAlgorithm
    */
-  void GetUnclippedInfo(BamAlignment& aln, string& bases, int32_t& unclipped_start, int32_t& unclipped_end){
+  class EndMatchScanner {
+  private:
+    // Codes for A, C, G, T, N and the blank characters to which BAM records decode other bases
+    static const int NUM_CODES  = 6;
+    static const int NO_CODE    = -1;
+    int char_codes_[256];
+    int packed_codes_[16];
+
+    std::vector<uint64_t> base_masks_; // Bitmask of the window positions containing each base code, NUM_WORDS_ words per code
+    int num_words_;
+
+    std::vector<int> read_codes_;
+
+    // Returns the 64 bits of the base's bitmask beginning at window position OFFSET
+    uint64_t mask_at(int code, int offset) const {
+      const uint64_t* words = base_masks_.data() + code*num_words_;
+      int word = offset >> 6, shift = offset & 63;
+      uint64_t bits = words[word] >> shift;
+      if (shift != 0)
+	bits |= words[word+1] << (64-shift);
+      return bits;
+    }
+
+  public:
+    EndMatchScanner(){
+      for (int i = 0; i < 256; i++)
+	char_codes_[i] = NO_CODE;
+      const char bases[] = "acgtn";
+      for (int i = 0; i < 5; i++){
+	char_codes_[(unsigned char)bases[i]]          = i;
+	char_codes_[(unsigned char)toupper(bases[i])] = i;
+      }
+      char_codes_[(unsigned char)' '] = 5;
+      for (int i = 0; i < 16; i++)
+	packed_codes_[i] = char_codes_[(unsigned char)HTSLIB_INT_TO_BASE[i]];
+      num_words_ = 0;
+    }
+
+    /*
+     * Stores the codes of the NUM_BASES read bases beginning at START_INDEX. Returns false if a base lacks a code, in which case the
+     * scanner can't be used. If REVERSE is true, the codes are stored from the last base to the first
+     */
+    bool load_read(const SequenceView& bases, int start_index, int num_bases, bool reverse){
+      read_codes_.resize(num_bases);
+      const uint8_t* packed = bases.packed();
+      for (int i = 0; i < num_bases; i++){
+	int index = start_index + (reverse ? num_bases-1-i : i);
+	int code  = (packed != NULL ? packed_codes_[bam_seqi(packed, index)] : char_codes_[(unsigned char)bases[index]]);
+	if (code == NO_CODE)
+	  return false;
+	read_codes_[i] = code;
+      }
+      return true;
+    }
+
+    /*
+     * Returns true iff the candidate at ALIGN_INDEX among the NUM_CANDIDATES <= 64 candidates has a strictly longer match than every other
+     * candidate. Candidate j is compared to the reference bases beginning at WINDOW_START+j (or ending there, if REVERSE is true), and
+     * comparisons that extend beyond the reference sequence fail
+     */
+    bool has_unique_longest_match(const std::string& ref_seq, int window_start, int num_candidates, int align_index, bool reverse){
+      int num_bases = read_codes_.size();
+
+      // Window position p corresponds to reference position FIRST_POS+p. Candidate j is compared to window positions j+k
+      // (prefix) or j+NUM_BASES-1-k (suffix) at step k
+      int window_size = num_candidates + num_bases;
+      int first_pos   = (reverse ? window_start - (num_bases-1) : window_start);
+      num_words_      = window_size/64 + 2;
+      base_masks_.assign(NUM_CODES*num_words_, 0);
+      int begin = std::max(0, -first_pos), end = std::min(window_size, (int)ref_seq.size() - first_pos);
+      for (int p = begin; p < end; p++){
+	int code = char_codes_[(unsigned char)ref_seq[first_pos+p]];
+	if (code != NO_CODE)
+	  base_masks_[code*num_words_ + (p >> 6)] |= (1ULL << (p & 63));
+      }
+
+      uint64_t candidates = (num_candidates == 64 ? ~0ULL : (1ULL << num_candidates) - 1);
+      uint64_t align_bit  = 1ULL << align_index, others = candidates & ~align_bit;
+      for (int k = 0; k < num_bases; k++){
+	// Once the candidate falls behind, any other candidate still matching at this step has at least as long a match
+	uint64_t next = candidates & mask_at(read_codes_[k], (reverse ? num_bases-1-k : k));
+	if ((next & align_bit) == 0)
+	  return (candidates & others) == 0;
+	if ((next & others) == 0)
+	  return true;
+	candidates = next;
+      }
+      return (candidates & others) == 0;
+    }
+  };
+
+  /* Sets the index of the first unclipped base, the number of unclipped bases and the reference coordinates spanned by the read */
+  void GetUnclippedSpan(BamAlignment& aln, int& start_index, int& num_bases, int32_t& unclipped_start, int32_t& unclipped_end){
     unclipped_start = aln.Position();
     unclipped_end   = aln.Position()-1;
     bool begin      = true;
-    int start_index = 0, num_bases = 0;
-    for (auto cigar_iter = aln.CigarData().begin(); cigar_iter != aln.CigarData().end(); cigar_iter++){
-      switch(cigar_iter->Type){
+    start_index     = 0;
+    num_bases       = 0;
+    CigarSpan cigar = aln.CigarView();
+    for (int cigar_index = 0; cigar_index < cigar.size(); cigar_index++){
+      switch(cigar.type(cigar_index)){
       case 'D':
-	unclipped_end += cigar_iter->Length;
+	unclipped_end += cigar.length(cigar_index);
 	begin          = false;
 	break;
       case 'H':
 	break;
       case 'S':
-	if (begin) start_index += cigar_iter->Length;
+	if (begin) start_index += cigar.length(cigar_index);
 	break;
       case 'M':
-	unclipped_end += cigar_iter->Length;
-	num_bases     += cigar_iter->Length;
+	unclipped_end += cigar.length(cigar_index);
+	num_bases     += cigar.length(cigar_index);
 	begin          = false;
 	break;
       case 'I':
-	num_bases += cigar_iter->Length;
+	num_bases += cigar.length(cigar_index);
 	begin      = false;
 	break;
       default:
 	string msg = "Invalid CIGAR char ";
-	msg += cigar_iter->Type;
+	msg += cigar.type(cigar_index);
 	printErrorAndDie(msg);
 	break;
       }
     }
-    bases = aln.QueryBases().substr(start_index, num_bases);
   }
 
-  bool HasLargestEndMatches(BamAlignment& aln, const string& ref_seq, int ref_seq_start, int max_external, int max_internal){
-    // Extract sequence, start and end coordinates of read after clipping
-    string bases;
-    int start, end;
-    GetUnclippedInfo(aln, bases, start, end);
-
+  bool HasLargestEndMatchesZ(const string& bases, int start, int end, const string& ref_seq, int ref_seq_start, int max_external, int max_internal){
     // Check that the prefix match is the longest
     if (start >= ref_seq_start && start < ref_seq_start + static_cast<int>(ref_seq.size())){
       int start_index = start - ref_seq_start;
@@ -223,16 +323,53 @@ namespace AlignmentFilters {
     return true;
   }
 
+  bool HasLargestEndMatches(BamAlignment& aln, const string& ref_seq, int ref_seq_start, int max_external, int max_internal){
+    // Extract the span of the read after clipping
+    int read_start, num_bases;
+    int32_t start, end;
+    GetUnclippedSpan(aln, read_start, num_bases, start, end);
+    SequenceView bases = aln.QueryBasesView();
+
+    // The scanner tracks the candidates using a 64-bit word, so larger windows and reads with unusual bases use the Z-algorithm instead
+    static thread_local EndMatchScanner scanner;
+    if (num_bases == 0 || max_external + max_internal + 1 > 64)
+      return HasLargestEndMatchesZ(bases.substr(read_start, num_bases), start, end, ref_seq, ref_seq_start, max_external, max_internal);
+
+    // Check that the prefix match is the longest
+    if (start >= ref_seq_start && start < ref_seq_start + static_cast<int>(ref_seq.size())){
+      int start_index = start - ref_seq_start;
+      int win_start   = max(0, start_index - max_external);
+      int win_stop    = min(static_cast<int>((ref_seq.size()-1)), start_index + max_internal);
+      if (!scanner.load_read(bases, read_start, num_bases, false))
+	return HasLargestEndMatchesZ(bases.substr(read_start, num_bases), start, end, ref_seq, ref_seq_start, max_external, max_internal);
+      if (!scanner.has_unique_longest_match(ref_seq, win_start, win_stop-win_start+1, start_index-win_start, false))
+	return false;
+    }
+
+    // Check that the suffix match is the longest
+    if (end >= ref_seq_start && end < ref_seq_start + static_cast<int>(ref_seq.size())){
+      int end_index = end - ref_seq_start;
+      int win_start = max(0, end_index - max_internal);
+      int win_stop  = min(static_cast<int>(ref_seq.size()-1), end_index + max_external);
+      if (!scanner.load_read(bases, read_start, num_bases, true))
+	return HasLargestEndMatchesZ(bases.substr(read_start, num_bases), start, end, ref_seq, ref_seq_start, max_external, max_internal);
+      if (!scanner.has_unique_longest_match(ref_seq, win_start, win_stop-win_start+1, end_index-win_start, true))
+	return false;
+    }
+    return true;
+  }
+
   void GetNumClippedBases(BamAlignment& aln, int& num_hard_clips, int& num_soft_clips){
     num_hard_clips = 0;
     num_soft_clips = 0;
-    for (auto cigar_iter = aln.CigarData().begin(); cigar_iter != aln.CigarData().end(); cigar_iter++){
-      switch(cigar_iter->Type){
+    CigarSpan cigar = aln.CigarView();
+    for (int cigar_index = 0; cigar_index < cigar.size(); cigar_index++){
+      switch(cigar.type(cigar_index)){
       case 'H':
-	num_hard_clips += cigar_iter->Length;
+	num_hard_clips += cigar.length(cigar_index);
 	break;
       case 'S':
-	num_soft_clips += cigar_iter->Length;
+	num_soft_clips += cigar.length(cigar_index);
 	break;
       default:
 	break;
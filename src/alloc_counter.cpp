@@ -0,0 +1,75 @@
+#include "alloc_counter.h"
+
+#ifdef HIPSTR_ALLOC_STATS
+
+#include <errno.h>
+
+#ifdef __GLIBC__
+
+// glibc exports its allocator under these names, so the public entry points can be replaced with counting wrappers.
+// The operator new provided by libstdc++ calls malloc, so the C++ allocations are counted as well
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t num, size_t size);
+  void* __libc_realloc(void* ptr, size_t size);
+  void* __libc_memalign(size_t alignment, size_t size);
+
+  void* malloc(size_t size){
+    AllocCounter::record(size);
+    return __libc_malloc(size);
+  }
+
+  void* calloc(size_t num, size_t size){
+    // An overflowing size isn't recorded, as __libc_calloc() rejects it without allocating anything
+    if (size == 0 || num <= SIZE_MAX/size)
+      AllocCounter::record(num*size);
+    return __libc_calloc(num, size);
+  }
+
+  void* realloc(void* ptr, size_t size){
+    AllocCounter::record(size);
+    return __libc_realloc(ptr, size);
+  }
+
+  void* memalign(size_t alignment, size_t size){
+    AllocCounter::record(size);
+    return __libc_memalign(alignment, size);
+  }
+
+  void* aligned_alloc(size_t alignment, size_t size){
+    AllocCounter::record(size);
+    return __libc_memalign(alignment, size);
+  }
+
+  int posix_memalign(void** ptr, size_t alignment, size_t size){
+    void* mem = __libc_memalign(alignment, size);
+    if (mem == NULL)
+      return ENOMEM;
+    AllocCounter::record(size);
+    *ptr = mem;
+    return 0;
+  }
+}
+
+#else
+
+#include <stdlib.h>
+
+#include <new>
+
+// Without glibc's internal entry points, only the C++ allocations made through the global operator new are counted
+void* operator new(size_t size){
+  AllocCounter::record(size);
+  void* mem = malloc(size == 0 ? 1 : size);
+  if (mem == NULL)
+    throw std::bad_alloc();
+  return mem;
+}
+
+void* operator new[](size_t size){ return operator new(size); }
+void operator delete(void* ptr) noexcept   { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+
+#endif
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct AllocCounts {
+  uint64_t count; // Number of heap allocations
+  uint64_t bytes; // Total bytes requested by these allocations
+};
+
+/*
+ * Counts the heap allocations made by each thread when HipSTR is built with ALLOC_STATS=1, in which case alloc_counter.cpp
+ * interposes malloc and its relatives (or the global operator new where malloc can't be interposed). ScopedTimer reads the
+ * calling thread's counts when its scope opens and closes to attribute the allocations to its phase. Frees aren't counted,
+ * and allocations made by idle threads that help align a locus' reads aren't attributed to any phase
+ */
+class AllocCounter {
+ public:
+#ifdef HIPSTR_ALLOC_STATS
+  static const bool ENABLED = true;
+#else
+  static const bool ENABLED = false;
+#endif
+
+  static AllocCounts& thread_counts(){
+    static thread_local AllocCounts counts = {0, 0};
+    return counts;
+  }
+
+  static void record(size_t bytes){
+    AllocCounts& counts = thread_counts();
+    counts.count++;
+    counts.bytes += bytes;
+  }
+};
+
+#endif
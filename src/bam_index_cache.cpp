@@ -0,0 +1,404 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "bam_index_cache.h"
+#include "error.h"
+#include "range_prefetch.h"
+
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+
+namespace {
+const char MAGIC[]     = "HSTRBAIC";
+const size_t MAGIC_LEN = 8;
+const uint32_t VERSION = 1;
+
+// BAIs always use 6 levels of bins with a 16kb minimum bin size
+const int MIN_SHIFT = 14;
+const int NUM_LVLS  = 5;
+const int NUM_BINS  = ((1 << ((NUM_LVLS+1)*3)) - 1)/7;
+const uint32_t META_BIN = NUM_BINS + 1; // Pseudo-bin that holds the chromosome's offsets and read counts
+
+template<typename T>
+void append_value(std::string& output, T value){
+  output.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+T read_value(const char*& ptr){
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return value;
+}
+
+bool is_little_endian(){
+  uint16_t value = 1;
+  return *reinterpret_cast<uint8_t*>(&value) == 1;
+}
+
+bool file_exists(const std::string& path){
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// Index file with extension EXT that htslib would load for the file at PATH (see hts_idx_getfn()), or an empty string if there isn't one
+std::string index_path(const std::string& path, const std::string& ext){
+  if (file_exists(path + ext))
+    return path + ext;
+  size_t dot = path.find_last_of('.');
+  if (dot != std::string::npos && dot > 0 && file_exists(path.substr(0, dot) + ext))
+    return path.substr(0, dot) + ext;
+  return "";
+}
+
+uint64_t fnv1a_hash(const std::string& value){
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < value.size(); i++){
+    hash ^= (uint8_t)value[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Identical to htslib's iterator record reader for BAM files, which isn't visible outside of sam.c
+int bam_readrec(BGZF* fp, void* ignored, void* bv, int* tid, int* beg, int* end){
+  bam1_t* b = (bam1_t*) bv;
+  int ret;
+  if ((ret = bam_read1(fp, b)) >= 0){
+    *tid = b->core.tid;
+    *beg = b->core.pos;
+    *end = bam_endpos(b);
+  }
+  return ret;
+}
+
+// Identical to the reg2bins() function used by htslib's iterators
+void reg2bins(int64_t beg, int64_t end, std::vector<int>& bins){
+  int l, t, s = MIN_SHIFT + (NUM_LVLS<<1) + NUM_LVLS;
+  if (beg >= end)
+    return;
+  if (end >= 1LL<<s)
+    end = 1LL<<s;
+  for (--end, l = 0, t = 0; l <= NUM_LVLS; s -= 3, t += 1<<((l<<1)+l), ++l){
+    int b = t + (beg>>s), e = t + (end>>s);
+    for (int i = b; i <= e; ++i)
+      bins.push_back(i);
+  }
+}
+}
+
+MappedBamIndex::~MappedBamIndex(){
+  munmap(const_cast<char*>(data_), size_);
+}
+
+MappedBamIndex* MappedBamIndex::open(const std::string& bam_path, const std::string& cache_dir){
+  // htslib prefers a CSI index to a BAI, and remote indexes are downloaded rather than read in place
+  if (!is_little_endian() || is_url_path(bam_path) || !index_path(bam_path, ".csi").empty())
+    return NULL;
+  std::string bai_path = index_path(bam_path, ".bai");
+  struct stat bai_stat;
+  if (bai_path.empty() || stat(bai_path.c_str(), &bai_stat) != 0)
+    return NULL;
+
+  char resolved_path[PATH_MAX];
+  if (realpath(bai_path.c_str(), resolved_path) != NULL)
+    bai_path = std::string(resolved_path);
+  std::stringstream cache_path;
+  cache_path << cache_dir << "/" << std::hex << fnv1a_hash(bai_path) << ".baic";
+
+  MappedBamIndex* index = new MappedBamIndex();
+  if (index->map(cache_path.str(), bai_path, bai_stat.st_size, bai_stat.st_mtime))
+    return index;
+  if (!write(bai_path, bai_stat.st_size, bai_stat.st_mtime, cache_path.str()) || !index->map(cache_path.str(), bai_path, bai_stat.st_size, bai_stat.st_mtime)){
+    delete index;
+    return NULL;
+  }
+  return index;
+}
+
+bool MappedBamIndex::map(const std::string& path, const std::string& bai_path, uint64_t bai_size, int64_t bai_mtime){
+  data_ = NULL;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) != 0 || st_buf.st_size < (off_t)(MAGIC_LEN + 2*sizeof(uint32_t))){
+    close(fd);
+    return false;
+  }
+  size_ = st_buf.st_size;
+  void* mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  data_ = static_cast<const char*>(mapping);
+
+  // Entries are naturally aligned, as the header is padded to a multiple of 8 bytes
+  const char* ptr = data_;
+  bool valid = (memcmp(ptr, MAGIC, MAGIC_LEN) == 0);
+  ptr += MAGIC_LEN;
+  valid &= (read_value<uint32_t>(ptr) == VERSION);
+  uint32_t path_len = read_value<uint32_t>(ptr);
+  size_t header_len = MAGIC_LEN + 2*sizeof(uint32_t) + path_len + 2*sizeof(uint64_t) + sizeof(uint32_t) + 2*sizeof(uint64_t);
+  header_len        = (header_len + 7) & ~((size_t)7);
+  if (valid && header_len <= size_){
+    valid &= (std::string(ptr, path_len) == bai_path);
+    ptr += path_len;
+    valid &= (read_value<uint64_t>(ptr) == bai_size);
+    valid &= (read_value<int64_t>(ptr)  == bai_mtime);
+    num_chroms_ = read_value<uint32_t>(ptr);
+    uint64_t num_bins   = read_value<uint64_t>(ptr);
+    uint64_t num_chunks = read_value<uint64_t>(ptr);
+    valid &= (header_len + num_chroms_*sizeof(ChromEntry) + num_bins*sizeof(BinEntry) + num_chunks*sizeof(hts_pair64_t) == size_);
+    chroms_ = reinterpret_cast<const ChromEntry*>(data_ + header_len);
+    bins_   = reinterpret_cast<const BinEntry*>(chroms_ + num_chroms_);
+    chunks_ = reinterpret_cast<const hts_pair64_t*>(bins_ + num_bins);
+  }
+  else
+    valid = false;
+
+  if (!valid){
+    munmap(mapping, size_);
+    data_ = NULL;
+  }
+  return valid;
+}
+
+bool MappedBamIndex::write(const std::string& bai_path, uint64_t bai_size, int64_t bai_mtime, const std::string& path){
+  BGZF* input = bgzf_open(bai_path.c_str(), "r");
+  if (input == NULL)
+    return false;
+
+  // Mirrors htslib's BAI loader (see hts_idx_load_core() and update_loff())
+  std::string chroms, bins, chunks;
+  uint64_t num_bins = 0, num_chunks = 0;
+  char magic[4];
+  uint32_t num_chroms = 0;
+  bool valid = (bgzf_read(input, magic, 4) == 4 && memcmp(magic, "BAI\1", 4) == 0 && bgzf_read(input, &num_chroms, 4) == 4);
+  for (uint32_t i = 0; valid && i < num_chroms; i++){
+    int32_t chrom_bins;
+    if (bgzf_read(input, &chrom_bins, 4) != 4 || chrom_bins < 0){
+      valid = false;
+      break;
+    }
+    std::vector<BinEntry> entries;
+    std::vector<hts_pair64_t> chrom_chunks;
+    for (int32_t j = 0; valid && j < chrom_bins; j++){
+      BinEntry entry;
+      int32_t bin_chunks;
+      valid = (bgzf_read(input, &entry.bin, 4) == 4 && bgzf_read(input, &bin_chunks, 4) == 4 && bin_chunks >= 0);
+      if (!valid)
+	break;
+      entry.num_chunks  = bin_chunks;
+      entry.first_chunk = num_chunks + chrom_chunks.size();
+      chrom_chunks.resize(chrom_chunks.size() + bin_chunks);
+      valid = (bgzf_read(input, chrom_chunks.data() + entry.first_chunk - num_chunks, 16*bin_chunks) == 16*bin_chunks);
+      entries.push_back(entry);
+    }
+    int32_t num_intervals;
+    valid = valid && (bgzf_read(input, &num_intervals, 4) == 4 && num_intervals >= 0);
+    std::vector<uint64_t> offsets(valid ? num_intervals : 0);
+    valid = valid && (bgzf_read(input, offsets.data(), 8*offsets.size()) == (ssize_t)(8*offsets.size()));
+    if (!valid)
+      break;
+
+    ChromEntry chrom;
+    chrom.first_bin  = num_bins;
+    chrom.num_bins   = entries.size();
+    chrom.has_counts = 0;
+    chrom.mapped     = chrom.unmapped = 0;
+    uint64_t offset0 = 0;
+    for (auto entry_iter = entries.begin(); entry_iter != entries.end(); entry_iter++){
+      if (entry_iter->bin == META_BIN && entry_iter->num_chunks != 0){
+	const hts_pair64_t* meta_chunks = chrom_chunks.data() + entry_iter->first_chunk - num_chunks;
+	offset0 = meta_chunks[0].u;
+	if (entry_iter->num_chunks > 1){
+	  chrom.has_counts = 1;
+	  chrom.mapped     = meta_chunks[1].u;
+	  chrom.unmapped   = meta_chunks[1].v;
+	}
+      }
+    }
+
+    // Fill the missing linear index offsets and determine each bin's offset
+    for (size_t j = 1; j < offsets.size(); j++)
+      if (offsets[j] == 0)
+	offsets[j] = offsets[j-1];
+    size_t l = 0;
+    for (; l < offsets.size() && offsets[l] == (uint64_t)-1; l++)
+      offsets[l] = offset0;
+    for (; l < offsets.size(); l++)
+      if (offsets[l] == (uint64_t)-1)
+	offsets[l] = offsets[l-1];
+    for (auto entry_iter = entries.begin(); entry_iter != entries.end(); entry_iter++){
+      entry_iter->loff = 0;
+      if (entry_iter->bin < (uint32_t)NUM_BINS){
+	size_t bot_bin = hts_bin_bot(entry_iter->bin, NUM_LVLS);
+	entry_iter->loff = (bot_bin < offsets.size() ? offsets[bot_bin] : 0);
+      }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const BinEntry& a, const BinEntry& b){ return a.bin < b.bin; });
+    for (size_t j = 1; j < entries.size(); j++)
+      if (entries[j].bin == entries[j-1].bin)
+	valid = false; // Duplicate bin number
+    chroms.append(reinterpret_cast<const char*>(&chrom), sizeof(ChromEntry));
+    bins.append(reinterpret_cast<const char*>(entries.data()), entries.size()*sizeof(BinEntry));
+    chunks.append(reinterpret_cast<const char*>(chrom_chunks.data()), chrom_chunks.size()*sizeof(hts_pair64_t));
+    num_bins   += entries.size();
+    num_chunks += chrom_chunks.size();
+  }
+  if (bgzf_close(input) != 0 || !valid)
+    return false;
+
+  std::string header(MAGIC, MAGIC_LEN);
+  append_value<uint32_t>(header, VERSION);
+  append_value<uint32_t>(header, bai_path.size());
+  header.append(bai_path);
+  append_value<uint64_t>(header, bai_size);
+  append_value<int64_t>(header,  bai_mtime);
+  append_value<uint32_t>(header, num_chroms);
+  append_value<uint64_t>(header, num_bins);
+  append_value<uint64_t>(header, num_chunks);
+  header.resize((header.size() + 7) & ~((size_t)7), '\0');
+
+  std::stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid();
+  FILE* output = fopen(tmp_path.str().c_str(), "wb");
+  if (output == NULL)
+    printErrorAndDie("Failed to open " + tmp_path.str() + " to write the cached BAM index");
+  bool success = (fwrite(header.data(), 1, header.size(), output) == header.size());
+  success &=     (fwrite(chroms.data(), 1, chroms.size(), output) == chroms.size());
+  success &=     (fwrite(bins.data(),   1, bins.size(),   output) == bins.size());
+  success &=     (fwrite(chunks.data(), 1, chunks.size(), output) == chunks.size());
+  success &=     (fclose(output) == 0);
+  if (!success){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to write the cached BAM index to " + tmp_path.str());
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to rename the cached BAM index file " + tmp_path.str() + " to " + path);
+  return true;
+}
+
+const MappedBamIndex::BinEntry* MappedBamIndex::find_bin(int tid, uint32_t bin) const {
+  const BinEntry* first = bins_ + chroms_[tid].first_bin;
+  const BinEntry* last  = first + chroms_[tid].num_bins;
+  const BinEntry* entry = std::lower_bound(first, last, bin, [](const BinEntry& a, uint32_t b){ return a.bin < b; });
+  return (entry != last && entry->bin == bin ? entry : NULL);
+}
+
+int MappedBamIndex::get_stat(int tid, uint64_t* mapped, uint64_t* unmapped) const {
+  if (tid < 0 || (uint32_t)tid >= num_chroms_ || !chroms_[tid].has_counts){
+    *mapped = *unmapped = 0;
+    return -1;
+  }
+  *mapped   = chroms_[tid].mapped;
+  *unmapped = chroms_[tid].unmapped;
+  return 0;
+}
+
+hts_itr_t* MappedBamIndex::query(int tid, int beg, int end) const {
+  // Mirrors hts_itr_query() for regions on a single chromosome
+  if (beg < 0)
+    beg = 0;
+  if (end < beg || tid < 0 || (uint32_t)tid >= num_chroms_)
+    return NULL;
+
+  hts_itr_t* iter = (hts_itr_t*) calloc(1, sizeof(hts_itr_t));
+  iter->tid = tid, iter->beg = beg, iter->end = end, iter->i = -1;
+  iter->readrec = bam_readrec;
+
+  // Determine the minimum offset using the linear index offset of the nearest bin to the left of the region
+  int bin = hts_bin_first(NUM_LVLS) + (beg >> MIN_SHIFT);
+  const BinEntry* entry = NULL;
+  do {
+    if ((entry = find_bin(tid, bin)) != NULL)
+      break;
+    int first = (hts_bin_parent(bin) << 3) + 1;
+    if (bin > first)
+      --bin;
+    else
+      bin = hts_bin_parent(bin);
+  } while (bin);
+  if (bin == 0)
+    entry = find_bin(tid, bin);
+  uint64_t min_off = (entry != NULL ? entry->loff : 0);
+
+  // Determine the maximum offset using the first chunk of the nearest non-empty bin to the right of the region
+  uint64_t max_off;
+  bin = hts_bin_first(NUM_LVLS) + ((end-1) >> MIN_SHIFT) + 1;
+  if (bin >= NUM_BINS)
+    bin = 0;
+  while (true){
+    while (bin % 8 == 1)
+      bin = hts_bin_parent(bin);
+    if (bin == 0){
+      max_off = (uint64_t)-1;
+      break;
+    }
+    entry = find_bin(tid, bin);
+    if (entry != NULL && entry->num_chunks > 0){
+      max_off = chunks_[entry->first_chunk].u;
+      break;
+    }
+    bin++;
+  }
+
+  std::vector<int> bins;
+  reg2bins(beg, end, bins);
+  std::vector<hts_pair64_t> off;
+  for (auto bin_iter = bins.begin(); bin_iter != bins.end(); bin_iter++){
+    if ((entry = find_bin(tid, *bin_iter)) != NULL){
+      for (uint32_t j = 0; j < entry->num_chunks; j++){
+	const hts_pair64_t& chunk = chunks_[entry->first_chunk + j];
+	if (chunk.v > min_off && chunk.u < max_off)
+	  off.push_back(chunk);
+      }
+    }
+  }
+  if (off.empty()){
+    iter->finished = 1;
+    return iter;
+  }
+
+  std::sort(off.begin(), off.end(), [](const hts_pair64_t& a, const hts_pair64_t& b){ return a.u < b.u; });
+  int n_off = off.size(), l = 0;
+
+  // Resolve completely contained adjacent blocks
+  for (int i = 1; i < n_off; ++i)
+    if (off[l].v < off[i].v)
+      off[++l] = off[i];
+  n_off = l + 1;
+
+  // Resolve overlaps between adjacent blocks
+  for (int i = 1; i < n_off; ++i)
+    if (off[i-1].v >= off[i].u)
+      off[i-1].v = off[i].u;
+
+  // Merge adjacent blocks
+  l = 0;
+  for (int i = 1; i < n_off; ++i){
+    if (off[l].v>>16 == off[i].u>>16)
+      off[l].v = off[i].v;
+    else
+      off[++l] = off[i];
+  }
+  n_off = l + 1;
+
+  // The offsets are released by hts_itr_destroy()
+  iter->n_off = n_off;
+  iter->off   = (hts_pair64_t*) malloc(n_off*sizeof(hts_pair64_t));
+  memcpy(iter->off, off.data(), n_off*sizeof(hts_pair64_t));
+  return iter;
+}
@@ -0,0 +1,78 @@
+#ifndef BAM_INDEX_CACHE_H_
+#define BAM_INDEX_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "htslib/hts.h"
+
+/*
+ * Read-only, memory-mapped copy of a BAM file's .bai index. sam_index_load() decodes the entire index into each process'
+ * private memory, which for runs with many processes on the same node and thousands of files duplicates gigabytes of indexes.
+ * Instead, each .bai is converted once into this format in a cache directory shared by the processes, which then share a single
+ * page cache copy of each index. The bins' linear index offsets are resolved during the conversion, so queries only require a
+ * binary search over each chromosome's bins
+ *
+ * Cache files are named by a hash of the .bai's path, and are only used if the .bai's size and modification time match those
+ * recorded when it was converted. Otherwise, the cache file is regenerated
+ *
+ * File layout (all integers little-endian):
+ *   header:  magic "HSTRBAIC", uint32 version, uint32 path length, path of the .bai, uint64 .bai size, int64 .bai mtime,
+ *            uint32 number of chromosomes, uint64 number of bins, uint64 number of chunks
+ *   chroms:  for each chromosome, uint64 index of its first bin, uint32 number of bins, uint32 1 iff the counts are available,
+ *            uint64 mapped reads, uint64 unmapped reads
+ *   bins:    sorted by bin number within each chromosome, uint32 bin number, uint32 number of chunks, uint64 index of the first
+ *            chunk and uint64 linear index offset
+ *   chunks:  uint64 start and end virtual offsets
+ */
+class MappedBamIndex {
+ private:
+  struct ChromEntry {
+    uint64_t first_bin;
+    uint32_t num_bins;
+    uint32_t has_counts;
+    uint64_t mapped, unmapped;
+  };
+
+  struct BinEntry {
+    uint32_t bin;
+    uint32_t num_chunks;
+    uint64_t first_chunk;
+    uint64_t loff;
+  };
+
+  const char* data_;
+  size_t size_;
+  uint32_t num_chroms_;
+  const ChromEntry* chroms_;
+  const BinEntry* bins_;
+  const hts_pair64_t* chunks_;
+
+  MappedBamIndex(){}
+
+  // Returns the entry for bin BIN of chromosome TID, or NULL if the chromosome doesn't have it
+  const BinEntry* find_bin(int tid, uint32_t bin) const;
+
+  // Map the cache file at PATH, returning false if it's invalid or wasn't converted from the .bai with the provided properties
+  bool map(const std::string& path, const std::string& bai_path, uint64_t bai_size, int64_t bai_mtime);
+
+  // Convert the .bai at BAI_PATH and write it to PATH, using a temporary file that's renamed once it's complete. Returns false if it isn't a valid .bai
+  static bool write(const std::string& bai_path, uint64_t bai_size, int64_t bai_mtime, const std::string& path);
+
+ public:
+  ~MappedBamIndex();
+
+  /*
+   * Returns the cached copy of the .bai for the BAM at BAM_PATH in CACHE_DIR, converting the .bai if the cache lacks an up-to-date copy.
+   * Returns NULL if the BAM doesn't have a local .bai file (e.g. for CRAMs, CSI indexes and URLs), in which case sam_index_load() should be used
+   */
+  static MappedBamIndex* open(const std::string& bam_path, const std::string& cache_dir);
+
+  // Equivalent to sam_itr_queryi() for the original index, returning an iterator that's used with sam_itr_next() and hts_itr_destroy()
+  hts_itr_t* query(int tid, int beg, int end) const;
+
+  // Equivalent to hts_idx_get_stat() for the original index
+  int get_stat(int tid, uint64_t* mapped, uint64_t* unmapped) const;
+};
+
+#endif
@@ -1,3 +1,9 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <mutex>
 #include <sstream>
 
 #include "bam_io.h"
@@ -32,6 +38,61 @@ void BamAlignment::ExtractSequenceFields(){
   built_ = true;
 }
 
+// Number of bytes in the value of an auxiliary field of the given type, or -1 if it's malformed or extends beyond END
+static int64_t aux_value_size(char type, const uint8_t* value, const uint8_t* end){
+  switch (type){
+  case 'A': case 'c': case 'C':
+    return 1;
+  case 's': case 'S':
+    return 2;
+  case 'i': case 'I': case 'f':
+    return 4;
+  case 'd':
+    return 8;
+  case 'Z': case 'H': {
+    const uint8_t* ptr = value;
+    while (ptr < end && *ptr != '\0')
+      ptr++;
+    return (ptr < end ? ptr - value + 1 : -1);
+  }
+  case 'B': {
+    if (end - value < 5)
+      return -1;
+    int64_t elem_size = aux_value_size(value[0], value, end);
+    if (value[0] == 'Z' || value[0] == 'H' || value[0] == 'B' || elem_size == -1)
+      return -1;
+    uint32_t count;
+    memcpy(&count, value+1, sizeof(uint32_t));
+    return 5 + elem_size*count;
+  }
+  default:
+    return -1;
+  }
+}
+
+void BamAlignment::ExtractTagFields() const {
+  rg_offset_     = -1;
+  has_haplotype_ = false;
+  haplotype_     = -1;
+
+  const uint8_t* ptr = bam_get_aux(b_);
+  const uint8_t* end = b_->data + b_->l_data;
+  while (end - ptr >= 3){
+    const uint8_t* type = ptr + 2;
+    int64_t size = aux_value_size(*type, type+1, end);
+    if (size == -1 || size > end - (type+1))
+      break;
+    if (ptr[0] == 'R' && ptr[1] == 'G' && *type == 'Z')
+      rg_offset_ = (type+1) - b_->data;
+    else if (ptr[0] == 'H' && ptr[1] == 'P'){
+      has_haplotype_ = true;
+      haplotype_     = bam_aux2i(const_cast<uint8_t*>(type));
+    }
+    ptr = type + 1 + size;
+  }
+  tags_extracted_ = true;
+}
+
 
 void BamHeader::parse_read_groups(){
   assert(read_groups_.empty());
@@ -56,24 +117,192 @@ void BamHeader::parse_read_groups(){
   }
 }
 
+int32_t BamCramReader::GetChromID(const std::string& chrom){
+  int32_t tid = bam_name2id(hdr_, chrom.c_str());
+  if (tid < 0 && chrom.size() > 3 && chrom.substr(0, 3).compare("chr") == 0)
+    tid = bam_name2id(hdr_, chrom.substr(3).c_str());
+  return tid;
+}
+
+bool BamCramReader::ChromHasAlignments(int32_t tid){
+  if (chrom_has_alns_[tid] == -1){
+    uint64_t mapped, unmapped;
+    if (in_->is_cram)
+      chrom_has_alns_[tid] = 1; // The CRAI lacks per-chromosome counts, but iterators for chromosomes absent from it are immediately finished
+    else if ((mapped_idx_ != NULL ? mapped_idx_->get_stat(tid, &mapped, &unmapped) : hts_idx_get_stat(idx_, tid, &mapped, &unmapped)) == 0)
+      chrom_has_alns_[tid] = (mapped + unmapped > 0 ? 1 : 0);
+    else {
+      // The index only lacks the counts for chromosomes without any bins, in which case no chunks overlap the chromosome
+      hts_itr_t* iter = QueryIndex(tid, 0, INT32_MAX);
+      chrom_has_alns_[tid] = (iter != NULL && iter->finished ? 0 : 1);
+      if (iter != NULL)
+	hts_itr_destroy(iter);
+    }
+  }
+  return chrom_has_alns_[tid] == 1;
+}
+
+bool BamCramReader::SetStreamingRegion(const std::string& chrom, int32_t start, int32_t end){
+  int32_t tid = GetChromID(chrom);
+  if (tid < 0){
+    if (!from_stdin_)
+      stream_tid_ = -1;
+    window_.clear();
+    return false;
+  }
+
+  // Restart the scan if the region isn't downstream of the previous one or if it's so far downstream
+  // that seeking with the index is more efficient than reading through the intervening alignments.
+  // Alignments read from stdin can't be revisited, so their scan only ever moves downstream
+  bool restart = (tid != stream_tid_ || start < region_start_ || (stream_done_ ? false : start > stream_pos_ + max_stream_gap_));
+  if (from_stdin_){
+    if (tid < stream_tid_ || (tid == stream_tid_ && start < region_start_))
+      printErrorAndDie("Regions must be requested in the order of the chromosomes in the header of the alignments read from stdin, sorted by position");
+    restart = (tid != stream_tid_);
+  }
+  if (restart){
+    if (stream_iter_ != NULL)
+      hts_itr_destroy(stream_iter_);
+    stream_iter_ = NULL;
+    window_.clear();
+    stream_tid_  = tid;
+    stream_pos_  = (from_stdin_ ? -1 : start);
+    stream_done_ = true;
+
+    // Chromosomes without any alignments don't need to be scanned
+    if (from_stdin_)
+      stream_done_ = (input_done_ && !has_pending_);
+    else if (ChromHasAlignments(tid)){
+      stream_iter_ = QueryIndex(tid, start, INT32_MAX);
+      if (stream_iter_ == NULL){
+	stream_tid_ = -1;
+	return false;
+      }
+      stream_done_ = false;
+    }
+  }
+  else {
+    // Discard buffered alignments that can't overlap this or any subsequent region
+    while (!window_.empty() && window_.front().GetEndPosition() <= start)
+      window_.pop_front();
+  }
+
+  // Buffer alignments until we encounter one that starts past the end of the region. Those that end before the region starts
+  // are only encountered when reading from stdin, as the scan then starts at the beginning of the chromosome
+  while (!stream_done_ && (window_.empty() || window_.back().Position() < end)){
+    window_.push_back(BamAlignment());
+    if (!NextStreamAlignment(window_.back())){
+      window_.pop_back();
+      if (stream_iter_ != NULL)
+	hts_itr_destroy(stream_iter_);
+      stream_iter_ = NULL;
+      stream_done_ = true;
+    }
+    else {
+      InitAlignment(window_.back());
+      stream_pos_ = window_.back().Position();
+      if (window_.back().GetEndPosition() <= start)
+	window_.pop_back();
+    }
+  }
+
+  region_start_ = start;
+  region_end_   = end;
+  window_index_ = 0;
+  return true;
+}
+
+bool BamCramReader::NextStreamAlignment(BamAlignment& aln){
+  if (!from_stdin_)
+    return sam_itr_next(in_, stream_iter_, aln.b_) >= 0;
+
+  while (true){
+    if (has_pending_){
+      int32_t pending_tid = pending_aln_.b_->core.tid;
+      if (pending_tid > stream_tid_)
+	return false;
+      has_pending_ = false;
+      if (pending_tid == stream_tid_){
+	aln = std::move(pending_aln_);
+	return true;
+      }
+    }
+    if (input_done_ || sam_read1(in_, hdr_, aln.b_) < 0){
+      input_done_ = true;
+      return false;
+    }
+
+    // Unmapped reads without a mapped mate are placed after every chromosome, so the scan is finished
+    int32_t tid = aln.b_->core.tid;
+    if (tid < 0){
+      input_done_ = true;
+      return false;
+    }
+    if (tid == stream_tid_){
+      if (aln.b_->core.pos < stream_pos_)
+	printErrorAndDie("The alignments read from stdin must be sorted by coordinate");
+      return true;
+    }
+
+    // Alignments on chromosomes without any regions are skipped, while the first one past the scanned chromosome is held
+    if (tid > stream_tid_){
+      pending_aln_ = std::move(aln);
+      has_pending_ = true;
+    }
+  }
+}
+
+bool BamCramReader::GetNextStreamingAlignment(BamAlignment& aln){
+  // Alignments are sorted by position, so we can stop once one starts after the end of the region
+  while (window_index_ < window_.size()){
+    BamAlignment& next_aln = window_[window_index_++];
+    if (next_aln.Position() >= region_end_){
+      window_index_ = window_.size();
+      return false;
+    }
+    if (next_aln.GetEndPosition() > region_start_){
+      aln = next_aln;
+      return true;
+    }
+  }
+  return false;
+}
+
 bool BamCramReader::SetRegion(const std::string& chrom, int32_t start, int32_t end){
+  if (streaming_)
+    return SetStreamingRegion(chrom, start, end);
+
   bool reuse_offset = (min_offset_ != 0 && chrom.compare(chrom_) == 0 && start >= start_);
   if (reuse_offset && first_aln_.GetEndPosition() > start && first_aln_.Position() < end)
     reuse_offset = false;
 
-  std::stringstream region;
-  region << chrom << ":" << start+1 << "-" << end;
-  std::string region_str = region.str();
-  iter_ = sam_itr_querys(idx_, hdr_, region_str.c_str());
-
-  if (iter_ == NULL && region_str.size() > 3 && region_str.substr(0, 3).compare("chr") == 0)
-    iter_ = sam_itr_querys(idx_, hdr_, region_str.substr(3).c_str());
-
+  // Discard the iterator for the previous region if it wasn't exhausted
   if (iter_ != NULL){
+    hts_itr_destroy(iter_);
+    iter_ = NULL;
+  }
+
+  int32_t tid = GetChromID(chrom);
+  if (tid >= 0){
     chrom_ = chrom;
     start_ = start;
 
-    if (reuse_offset)
+    // Use the index to determine if any alignments can overlap the region, in which case no iterator is required.
+    // Iterators for regions that don't overlap any index chunks (or CRAM slices) are already finished
+    if (ChromHasAlignments(tid))
+      iter_ = QueryIndex(tid, start, end);
+    else {
+      min_offset_ = 0;
+      return true;
+    }
+  }
+
+  if (iter_ != NULL){
+    if (iter_->finished){
+      hts_itr_destroy(iter_);
+      iter_ = NULL;
+    }
+    else if (reuse_offset)
       if (iter_->n_off == 1 && min_offset_ >= iter_->off[0].u && min_offset_ <= iter_->off[0].v)
 	iter_->off[0].u = min_offset_;
 
@@ -88,7 +317,75 @@ bool BamCramReader::SetRegion(const std::string& chrom, int32_t start, int32_t e
   }
 }
 
+void BamCramReader::PlanByteRanges(const std::string& chrom, const std::vector< std::pair<int32_t, int32_t> >& regions, std::vector<ByteRange>& ranges){
+  // Upper bound on the size of a CRAM container's header, which precedes the landmark offsets of its slices
+  const int64_t MAX_CONTAINER_HEADER = 65536;
+  int32_t tid = GetChromID(chrom);
+  if (tid < 0 || !ChromHasAlignments(tid))
+    return;
+
+  for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++){
+    if (in_->is_cram){
+      cram_fd* fd = in_->fp.cram;
+      if (tid+1 >= fd->index_sz)
+	continue;
+      cram_index* entry = cram_index_query(fd, tid, region_iter->first+1, NULL);
+      if (entry == NULL)
+	continue;
+      cram_index* last_entry = fd->index[tid+1].e + fd->index[tid+1].nslice;
+      for (; entry < last_entry && entry->start <= region_iter->second; entry++)
+	ranges.push_back(ByteRange(entry->offset, entry->offset + MAX_CONTAINER_HEADER + entry->slice + entry->len));
+    }
+    else {
+      hts_itr_t* iter = QueryIndex(tid, region_iter->first, region_iter->second);
+      if (iter == NULL)
+	continue;
+      for (int i = 0; i < iter->n_off; i++)
+	ranges.push_back(ByteRange(iter->off[i].u >> 16, (iter->off[i].v >> 16) + BGZF_MAX_BLOCK_SIZE));
+      hts_itr_destroy(iter);
+    }
+  }
+}
+
+namespace {
+// htslib doesn't synchronize the reference counts of shared CRAM reference sequences, which are updated as files are opened and closed
+std::mutex cram_refs_mutex;
+}
+
+void retain_cram_refs(refs_t* refs){
+  std::lock_guard<std::mutex> lock(cram_refs_mutex);
+  refs->count++;
+}
+
+void release_cram_refs(refs_t* refs){
+  std::lock_guard<std::mutex> lock(cram_refs_mutex);
+  refs_free(refs);
+}
+
+void BamCramReader::ShareCramReference(refs_t* refs){
+  std::lock_guard<std::mutex> lock(cram_refs_mutex);
+  if (hts_set_opt(in_, CRAM_OPT_SHARED_REF, refs) != 0)
+    printErrorAndDie("Failed to share the reference sequences for CRAM file " + path_);
+}
+
+bool BamCramReader::SetRequiredFields(int fields, bool decode_md){
+  if (!in_->is_cram)
+    return true;
+  return (hts_set_opt(in_, CRAM_OPT_REQUIRED_FIELDS, fields) == 0 && hts_set_opt(in_, CRAM_OPT_DECODE_MD, (decode_md ? 1 : 0)) == 0);
+}
+
+void BamCramReader::CloseFile(){
+  if (in_->is_cram){
+    std::lock_guard<std::mutex> lock(cram_refs_mutex);
+    sam_close(in_);
+  }
+  else
+    sam_close(in_);
+}
+
 bool BamCramReader::GetNextAlignment(BamAlignment& aln){
+  if (streaming_)
+    return GetNextStreamingAlignment(aln);
   if (iter_ == NULL) return false;
 
   if (sam_itr_next(in_, iter_, aln.b_) < 0){
@@ -103,56 +400,655 @@ bool BamCramReader::GetNextAlignment(BamAlignment& aln){
   }
 
   // Set up alignment instance variables
-  aln.built_   = false;
-  aln.file_    = path_;
-  aln.length_  = aln.b_->core.l_qseq;
-  aln.pos_     = aln.b_->core.pos;
-  aln.end_pos_ = bam_endpos(aln.b_);
+  InitAlignment(aln);
   return true;
 }
 
 
 
-bool BamCramMultiReader::SetRegion(const std::string& chrom, int32_t start, int32_t end){
-  aln_heap_.clear();
-  for (int32_t reader_index = 0; reader_index < bam_readers_.size(); reader_index++){
-    if (!bam_readers_[reader_index]->SetRegion(chrom, start, end))
+namespace {
+// Checksum of the names and lengths of the reference sequences in a header. Headers with identical checksums pass compare_bam_headers()
+std::string reference_checksum(const BamHeader* header){
+  uint64_t hash = 14695981039346656037ULL;
+  for (int32_t i = 0; i < header->num_seqs(); i++){
+    std::string key = header->ref_name(i) + '\0' + std::to_string(header->ref_length(i)) + '\0';
+    for (size_t j = 0; j < key.size(); j++)
+      hash = (hash ^ (unsigned char)key[j]) * 1099511628211ULL;
+  }
+  std::stringstream ss;
+  ss << std::hex << hash;
+  return ss.str();
+}
+
+BamHeader* read_file_header(const std::string& path){
+  samFile* in = sam_open(path.c_str(), "r");
+  if (in == NULL)
+    printErrorAndDie("Failed to open file " + path);
+  bam_hdr_t* hdr = sam_hdr_read(in);
+  if (hdr == NULL)
+    printErrorAndDie("Failed to read the header for file " + path);
+  BamHeader* header = new BamHeader(hdr);
+  bam_hdr_destroy(hdr);
+  sam_close(in);
+  return header;
+}
+
+struct CachedHeader {
+  int64_t size, mtime;
+  std::string checksum;
+  std::vector<ReadGroup> read_groups;
+};
+}
+
+BamCramMultiReader::BamCramMultiReader(std::vector<std::string>& paths, std::string fasta_path, int merge_type,
+				       int max_open_files, std::string header_cache, std::string index_cache_dir, int open_threads){
+  if (paths.empty())
+    printErrorAndDie("Must provide at least one file to BamCramMultiReader constructor");
+  paths_           = paths;
+  fasta_path_      = fasta_path;
+  index_cache_dir_ = index_cache_dir;
+  max_open_files_  = std::max(0, max_open_files);
+  Init(merge_type);
+  if (lazy())
+    LoadLazyHeaders(header_cache);
+  else
+    OpenAllFiles(open_threads);
+}
+
+void BamCramMultiReader::OpenAllFiles(int num_threads){
+  // The first file is opened before the others, so that they can share the CRAM reference sequences it loads
+  bam_readers_[0] = NewReader(0);
+  num_threads     = std::max(1, std::min(num_threads, (int)paths_.size()-1));
+  if (num_threads == 1){
+    for (size_t i = 1; i < paths_.size(); i++)
+      bam_readers_[i] = NewReader(i);
+  }
+  else {
+    std::mutex index_mutex, refs_mutex;
+    size_t next_file = 1;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++)
+      threads.push_back(std::thread([&](){
+	    while (true){
+	      size_t file_index;
+	      {
+		std::lock_guard<std::mutex> lock(index_mutex);
+		if (next_file >= paths_.size())
+		  return;
+		file_index = next_file++;
+	      }
+	      bam_readers_[file_index] = NewReader(file_index, &refs_mutex);
+	    }
+	  }));
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+  }
+
+  // Only the sequence dictionaries are compared, which is much faster than opening the files
+  for (size_t i = 1; i < paths_.size(); i++)
+    compare_bam_headers(bam_readers_[0]->bam_header(), bam_readers_[i]->bam_header(), paths_[0], paths_[i]);
+}
+
+BamCramMultiReader::BamCramMultiReader(BamCramMultiReader& reader, int max_open_files){
+  paths_           = reader.paths_;
+  fasta_path_      = reader.fasta_path_;
+  index_cache_dir_ = reader.index_cache_dir_;
+  max_open_files_  = (reader.lazy() ? std::max(1, max_open_files) : 0);
+  Init(reader.merge_type_);
+  required_fields_ = reader.required_fields_;
+  decode_md_       = reader.decode_md_;
+  if (reader.shared_cram_refs_ != NULL){
+    shared_cram_refs_ = reader.shared_cram_refs_;
+    retain_cram_refs(shared_cram_refs_);
+  }
+  if (lazy()){
+    ref_header_  = reader.ref_header_;
+    read_groups_ = reader.read_groups_;
+  }
+  else {
+    // The headers were already validated by the provided reader
+    for (size_t i = 0; i < paths_.size(); i++)
+      bam_readers_[i] = NewReader(i);
+  }
+}
+
+void BamCramMultiReader::Init(int merge_type){
+  if (merge_type != ORDER_ALNS_BY_POSITION && merge_type != ORDER_ALNS_BY_FILE)
+    printErrorAndDie("Invalid merge type provided to BamCramMultiReader constructor");
+  if (lazy() && merge_type != ORDER_ALNS_BY_FILE)
+    printErrorAndDie("Lazily opened files can only be merged in file order");
+  merge_type_        = merge_type;
+  bam_readers_.assign(paths_.size(), NULL);
+  cached_alns_.resize(paths_.size());
+  open_file_iters_.assign(paths_.size(), open_files_.end());
+  closed_chrom_flags_.assign(paths_.size(), std::vector<int8_t>());
+  streaming_         = false;
+  max_stream_gap_    = 0;
+  thread_pool_.pool  = NULL;
+  thread_pool_.qsize = 0;
+  owns_thread_pool_  = false;
+  required_fields_   = 0;
+  decode_md_         = true;
+  region_tid_        = -1;
+  region_start_      = region_end_ = -1;
+  next_file_         = 0;
+  active_file_       = -1;
+  shared_cram_refs_  = NULL;
+  prefetch_regions_  = 0;
+  max_range_gap_     = 0;
+  plan_index_        = 0;
+  next_prefetch_     = 0;
+  time_seeks_        = false;
+}
+
+void BamCramMultiReader::LoadLazyHeaders(const std::string& header_cache){
+  std::map<std::string, CachedHeader> cache;
+  if (!header_cache.empty()){
+    std::ifstream input(header_cache.c_str());
+    std::string line, key;
+    CachedHeader* entry = NULL;
+    while (input.is_open() && std::getline(input, line)){
+      std::vector<std::string> tokens;
+      split_by_delim(line, '\t', tokens);
+      if (tokens.size() == 5 && tokens[0].compare("FILE") == 0){
+	entry           = &cache[tokens[1]];
+	entry->size     = std::stoll(tokens[2]);
+	entry->mtime    = std::stoll(tokens[3]);
+	entry->checksum = tokens[4];
+      }
+      else if (tokens.size() >= 2 && tokens[0].compare("RG") == 0 && entry != NULL){
+	tokens.resize(4);
+	entry->read_groups.push_back(ReadGroup(tokens[1], tokens[2], tokens[3]));
+      }
+      else
+	printErrorAndDie("Improperly formatted line in the BAM header cache file " + header_cache + ": " + line);
+    }
+  }
+
+  ref_header_.reset(read_file_header(paths_[0]));
+  std::string checksum = reference_checksum(ref_header_.get());
+  read_groups_ = std::make_shared< std::vector< std::vector<ReadGroup> > >(paths_.size());
+  bool modified = false;
+  for (size_t i = 0; i < paths_.size(); i++){
+    struct stat st_buf;
+    if (stat(paths_[i].c_str(), &st_buf) != 0)
+      printErrorAndDie("File " + paths_[i] + " doest not exist");
+
+    auto cache_iter = cache.find(paths_[i]);
+    if (cache_iter != cache.end() && cache_iter->second.size == st_buf.st_size && cache_iter->second.mtime == st_buf.st_mtime
+	&& cache_iter->second.checksum.compare(checksum) == 0){
+      (*read_groups_)[i] = cache_iter->second.read_groups;
+      continue;
+    }
+
+    std::unique_ptr<BamHeader> header(i == 0 ? NULL : read_file_header(paths_[i]));
+    const BamHeader* file_header = (i == 0 ? ref_header_.get() : header.get());
+    compare_bam_headers(ref_header_.get(), file_header, paths_[0], paths_[i]);
+    CachedHeader& entry = cache[paths_[i]];
+    entry.size          = st_buf.st_size;
+    entry.mtime         = st_buf.st_mtime;
+    entry.checksum      = checksum;
+    entry.read_groups   = file_header->read_groups();
+    (*read_groups_)[i]  = entry.read_groups;
+    modified = true;
+  }
+
+  if (!header_cache.empty() && modified){
+    std::string tmp_path = header_cache + ".tmp";
+    std::ofstream output(tmp_path.c_str());
+    if (!output.is_open())
+      printErrorAndDie("Failed to open the BAM header cache file " + tmp_path);
+    for (auto cache_iter = cache.begin(); cache_iter != cache.end(); cache_iter++){
+      const CachedHeader& entry = cache_iter->second;
+      output << "FILE\t" << cache_iter->first << "\t" << entry.size << "\t" << entry.mtime << "\t" << entry.checksum << "\n";
+      for (auto rg_iter = entry.read_groups.begin(); rg_iter != entry.read_groups.end(); rg_iter++)
+	output << "RG\t" << rg_iter->GetID() << "\t" << rg_iter->GetSample() << "\t" << rg_iter->GetLibrary() << "\n";
+    }
+    output.close();
+    if (output.fail() || rename(tmp_path.c_str(), header_cache.c_str()) != 0)
+      printErrorAndDie("Failed to write the BAM header cache file " + header_cache);
+  }
+}
+
+BamCramReader* BamCramMultiReader::NewReader(int32_t file_index, std::mutex* refs_mutex){
+  refs_t* shared_refs;
+  {
+    std::unique_lock<std::mutex> lock = (refs_mutex != NULL ? std::unique_lock<std::mutex>(*refs_mutex) : std::unique_lock<std::mutex>());
+    shared_refs = shared_cram_refs_;
+  }
+
+  BamCramReader* reader = new BamCramReader(paths_[file_index], fasta_path_, (range_prefetch() ? range_caches_[file_index] : nullptr), shared_refs,
+					    index_cache_dir_);
+  reader->SetFileIndex(file_index);
+  if (required_fields_ != 0 && !reader->SetRequiredFields(required_fields_, decode_md_))
+    printErrorAndDie("Failed to set the required CRAM fields for file " + paths_[file_index]);
+  std::unique_lock<std::mutex> lock = (refs_mutex != NULL ? std::unique_lock<std::mutex>(*refs_mutex) : std::unique_lock<std::mutex>());
+  if (shared_cram_refs_ == NULL && reader->cram_refs() != NULL){
+    shared_cram_refs_ = reader->cram_refs();
+    retain_cram_refs(shared_cram_refs_);
+  }
+  return reader;
+}
+
+void BamCramMultiReader::SetRequiredFields(int fields, bool decode_md){
+  required_fields_ = fields;
+  decode_md_       = decode_md;
+  for (size_t i = 0; i < bam_readers_.size(); i++)
+    if (bam_readers_[i] != NULL && !bam_readers_[i]->SetRequiredFields(fields, decode_md))
+      printErrorAndDie("Failed to set the required CRAM fields for file " + paths_[i]);
+}
+
+BamCramReader* BamCramMultiReader::OpenFile(int32_t file_index){
+  if (bam_readers_[file_index] != NULL){
+    open_files_.splice(open_files_.begin(), open_files_, open_file_iters_[file_index]);
+    return bam_readers_[file_index];
+  }
+
+  if ((int)open_files_.size() >= max_open_files_){
+    int32_t lru_index = open_files_.back();
+    open_files_.pop_back();
+    closed_chrom_flags_[lru_index] = bam_readers_[lru_index]->chrom_alignment_flags();
+    delete bam_readers_[lru_index];
+    bam_readers_[lru_index]     = NULL;
+    open_file_iters_[lru_index] = open_files_.end();
+  }
+
+  BamCramReader* reader = NewReader(file_index);
+  if (streaming_)
+    reader->EnableStreaming(max_stream_gap_);
+  if (thread_pool_.pool != NULL && !reader->SetThreadPool(&thread_pool_))
+    printErrorAndDie("Failed to attach the decompression thread pool to file " + paths_[file_index]);
+  bam_readers_[file_index] = reader;
+  open_files_.push_front(file_index);
+  open_file_iters_[file_index] = open_files_.begin();
+  return reader;
+}
+
+bool BamCramMultiReader::SetLazyRegion(const std::string& chrom, int32_t start, int32_t end){
+  // All of the files share the first file's reference sequences, so the files only need to be opened once they're read
+  int32_t tid = ref_header_->ref_id(chrom);
+  if (tid == -1 && chrom.size() > 3 && chrom.substr(0, 3).compare("chr") == 0)
+    tid = ref_header_->ref_id(chrom.substr(3));
+  if (tid == -1)
+    return false;
+  region_chrom_ = chrom;
+  region_tid_   = tid;
+  region_start_ = start;
+  region_end_   = end;
+  next_file_    = 0;
+  active_file_  = -1;
+  return true;
+}
+
+bool BamCramMultiReader::GetNextLazyAlignment(BamAlignment& aln){
+  while (true){
+    if (active_file_ != -1){
+      if (bam_readers_[active_file_]->GetNextAlignment(aln))
+	return true;
+      active_file_ = -1;
+    }
+    if (next_file_ >= (int32_t)paths_.size())
       return false;
-    if (bam_readers_[reader_index]->GetNextAlignment(cached_alns_[reader_index])){
-      if (merge_type_ == ORDER_ALNS_BY_POSITION)
-	aln_heap_.push_back(std::pair<int32_t, int32_t>(-cached_alns_[reader_index].Position(), reader_index));
-      else if (merge_type_ == ORDER_ALNS_BY_FILE)
-	aln_heap_.push_back(std::pair<int32_t, int32_t>(-reader_index, reader_index));
+
+    // Avoid reopening closed files whose indexes showed that they lack alignments for the chromosome
+    const std::vector<int8_t>& flags = closed_chrom_flags_[next_file_];
+    if (bam_readers_[next_file_] == NULL && region_tid_ < (int32_t)flags.size() && flags[region_tid_] == 0){
+      next_file_++;
+      continue;
+    }
+    if (!OpenFile(next_file_)->SetRegion(region_chrom_, region_start_, region_end_))
+      printErrorAndDie("Failed to set the region " + region_chrom_ + ":" + std::to_string(region_start_+1) + "-" + std::to_string(region_end_) + " in file " + paths_[next_file_]);
+    active_file_ = next_file_++;
+  }
+}
+
+void BamCramMultiReader::EnableRangePrefetch(int num_regions, int num_threads, int64_t cache_mb, int64_t max_gap, bool use_io_uring){
+  if (num_regions < 1)
+    printErrorAndDie("The number of regions whose byte ranges are prefetched must be greater than 0");
+  if (cache_mb < 1)
+    printErrorAndDie("The size of each file's prefetch cache must be at least 1 MB");
+  if (range_prefetch())
+    printErrorAndDie("Range prefetching has already been enabled for the BamCramMultiReader");
+  if (concurrent_readers_)
+    printErrorAndDie("Range prefetching can't be combined with concurrent reads");
+  range_prefetcher_.reset(new RangePrefetcher(num_threads, use_io_uring));
+  prefetch_regions_ = num_regions;
+  max_range_gap_    = max_gap;
+  for (size_t i = 0; i < paths_.size(); i++)
+    range_caches_.push_back(std::make_shared<RangeCache>(cache_mb*1048576));
+
+  for (size_t i = 0; i < bam_readers_.size(); i++){
+    if (bam_readers_[i] == NULL)
+      continue;
+    delete bam_readers_[i];
+    bam_readers_[i] = NewReader(i);
+    if (streaming_)
+      bam_readers_[i]->EnableStreaming(max_stream_gap_);
+    if (thread_pool_.pool != NULL && !bam_readers_[i]->SetThreadPool(&thread_pool_))
+      printErrorAndDie("Failed to attach the decompression thread pool to file " + paths_[i]);
+  }
+}
+
+void BamCramMultiReader::EnableConcurrentReads(int num_threads, int32_t buffer_alns){
+  if (lazy())
+    printErrorAndDie("Concurrent reads can't be combined with lazily opened files");
+  if (range_prefetch())
+    printErrorAndDie("Concurrent reads can't be combined with range prefetching");
+  if (concurrent_readers_)
+    printErrorAndDie("Concurrent reads have already been enabled for the BamCramMultiReader");
+  concurrent_readers_.reset(new ConcurrentFileReaders(bam_readers_, num_threads, buffer_alns));
+}
+
+void BamCramMultiReader::SetRegionPlan(const std::vector<std::string>& chroms, const std::vector< std::pair<int32_t, int32_t> >& regions){
+  assert(chroms.size() == regions.size());
+  plan_chroms_   = chroms;
+  plan_regions_  = regions;
+  plan_index_    = 0;
+  next_prefetch_ = 0;
+}
+
+void BamCramMultiReader::AdvanceRegionPlan(const std::string& chrom, int32_t start, int32_t end){
+  size_t index = plan_index_;
+  while (index < plan_regions_.size() && (plan_regions_[index].first != start || plan_regions_[index].second != end || plan_chroms_[index] != chrom))
+    index++;
+  if (index == plan_regions_.size())
+    return;
+  plan_index_ = index;
+
+  // Top up the prefetched regions once fewer than half of them remain, so that the ranges are fetched using fewer, larger requests
+  next_prefetch_ = std::max(next_prefetch_, index);
+  if (next_prefetch_ > index + prefetch_regions_/2)
+    return;
+  size_t last_prefetch = std::min(plan_regions_.size(), index + prefetch_regions_ + 1);
+  if (next_prefetch_ >= last_prefetch)
+    return;
+
+  // Files that are currently closed in lazy mode are read on demand
+  for (size_t file_index = 0; file_index < bam_readers_.size(); file_index++){
+    if (bam_readers_[file_index] == NULL)
+      continue;
+    std::vector<ByteRange> ranges;
+    size_t plan_start = next_prefetch_;
+    while (plan_start < last_prefetch){
+      size_t plan_end = plan_start;
+      std::vector< std::pair<int32_t, int32_t> > chrom_regions;
+      while (plan_end < last_prefetch && plan_chroms_[plan_end] == plan_chroms_[plan_start])
+	chrom_regions.push_back(plan_regions_[plan_end++]);
+      bam_readers_[file_index]->PlanByteRanges(plan_chroms_[plan_start], chrom_regions, ranges);
+      plan_start = plan_end;
+    }
+    merge_byte_ranges(ranges, max_range_gap_);
+    for (auto range_iter = ranges.begin(); range_iter != ranges.end(); range_iter++)
+      range_prefetcher_->prefetch(paths_[file_index], range_caches_[file_index], *range_iter);
+  }
+  next_prefetch_ = last_prefetch;
+}
+
+ConcurrentFileReaders::ConcurrentFileReaders(std::vector<BamCramReader*>& readers, int num_threads, int32_t buffer_alns){
+  if (num_threads < 1)
+    printErrorAndDie("The number of threads used to read the BAM/CRAM files must be greater than 0");
+  if (buffer_alns < 1)
+    printErrorAndDie("Each file's buffer must hold at least one alignment");
+  buffer_alns_ = buffer_alns;
+  region_id_   = 0;
+  num_threads  = std::min<int>(num_threads, readers.size());
+  for (int i = 0; i < num_threads; i++){
+    ReaderGroup* group = new ReaderGroup();
+    group->start     = group->end      = 0;
+    group->region_id = group->ready_id = 0;
+    group->region_ok = true;
+    group->closing   = false;
+    groups_.push_back(group);
+  }
+  for (size_t i = 0; i < readers.size(); i++){
+    ReaderGroup* group = groups_[i % num_threads];
+    group->readers.push_back(readers[i]);
+    group->slots.push_back(std::vector<BamAlignment>(buffer_alns));
+    group->heads.push_back(0);
+    group->tails.push_back(0);
+    group->done.push_back(1);
+  }
+  for (size_t i = 0; i < groups_.size(); i++)
+    groups_[i]->thread = std::thread(&ConcurrentFileReaders::read_files, this, groups_[i]);
+}
+
+ConcurrentFileReaders::~ConcurrentFileReaders(){
+  for (size_t i = 0; i < groups_.size(); i++){
+    {
+      std::lock_guard<std::mutex> lock(groups_[i]->mutex);
+      groups_[i]->closing = true;
+    }
+    groups_[i]->region_set.notify_all();
+    groups_[i]->space_freed.notify_all();
+  }
+  for (size_t i = 0; i < groups_.size(); i++){
+    groups_[i]->thread.join();
+    delete groups_[i];
+  }
+}
+
+void ConcurrentFileReaders::read_files(ReaderGroup* group){
+  std::unique_lock<std::mutex> lock(group->mutex);
+  int64_t region_id = 0;
+  while (true){
+    group->region_set.wait(lock, [&](){ return group->closing || group->region_id != region_id; });
+    if (group->closing)
+      return;
+    region_id = group->region_id;
+    std::string chrom = group->chrom;
+    int32_t start = group->start, end = group->end;
+    lock.unlock();
+
+    // The merge doesn't read the group's buffers until the region has been set in all of its files
+    bool region_ok = true;
+    for (size_t i = 0; i < group->readers.size() && region_ok; i++)
+      region_ok = group->readers[i]->SetRegion(chrom, start, end);
+    lock.lock();
+    if (group->region_id != region_id)
+      continue;
+    for (size_t i = 0; i < group->readers.size(); i++){
+      group->heads[i] = group->tails[i] = 0;
+      group->done[i]  = !region_ok;
+    }
+    group->region_ok = region_ok;
+    group->ready_id  = region_id;
+    group->alns_read.notify_all();
+    if (region_ok)
+      buffer_region(group, region_id, lock);
+  }
+}
+
+void ConcurrentFileReaders::buffer_region(ReaderGroup* group, int64_t region_id, std::unique_lock<std::mutex>& lock){
+  while (!group->closing && group->region_id == region_id){
+    // Top up the unfinished file with the fewest buffered alignments, as it's likely to be needed first
+    int32_t file = -1;
+    int64_t min_buffered = buffer_alns_;
+    bool unfinished = false;
+    for (size_t i = 0; i < group->readers.size(); i++){
+      if (group->done[i])
+	continue;
+      unfinished = true;
+      if (group->tails[i] - group->heads[i] < min_buffered){
+	file         = i;
+	min_buffered = group->tails[i] - group->heads[i];
+      }
+    }
+    if (!unfinished)
+      return;
+    if (file == -1){
+      group->space_freed.wait(lock);
+      continue;
+    }
+
+    // The slots after the tail aren't accessed by the merge, so they're filled without holding the lock
+    int64_t tail     = group->tails[file];
+    int32_t num_alns = std::min<int64_t>(READ_BATCH, buffer_alns_ - min_buffered), num_read = 0;
+    std::vector<BamAlignment>& slots = group->slots[file];
+    lock.unlock();
+    bool exhausted = false;
+    while (num_read < num_alns && !exhausted){
+      if (group->readers[file]->GetNextAlignment(slots[(tail+num_read) % buffer_alns_]))
+	num_read++;
       else
-	printErrorAndDie("Invalid merge order in SetRegion()");
+	exhausted = true;
+    }
+    lock.lock();
+    if (group->closing || group->region_id != region_id)
+      return;
+    group->tails[file] += num_read;
+    group->done[file]   = exhausted;
+    group->alns_read.notify_all();
+  }
+}
+
+bool ConcurrentFileReaders::SetRegion(const std::string& chrom, int32_t start, int32_t end){
+  int64_t region_id = ++region_id_;
+  for (size_t i = 0; i < groups_.size(); i++){
+    {
+      std::lock_guard<std::mutex> lock(groups_[i]->mutex);
+      groups_[i]->chrom     = chrom;
+      groups_[i]->start     = start;
+      groups_[i]->end       = end;
+      groups_[i]->region_id = region_id;
     }
+    groups_[i]->region_set.notify_one();
+    groups_[i]->space_freed.notify_one();
+  }
+
+  bool success = true;
+  for (size_t i = 0; i < groups_.size(); i++){
+    std::unique_lock<std::mutex> lock(groups_[i]->mutex);
+    groups_[i]->alns_read.wait(lock, [&](){ return groups_[i]->ready_id == region_id; });
+    success &= groups_[i]->region_ok;
+  }
+  return success;
+}
+
+bool ConcurrentFileReaders::GetNextAlignment(int32_t file_index, BamAlignment& aln){
+  ReaderGroup* group = groups_[file_index % groups_.size()];
+  int32_t index      = file_index / groups_.size();
+  std::unique_lock<std::mutex> lock(group->mutex);
+  group->alns_read.wait(lock, [&](){ return group->heads[index] != group->tails[index] || group->done[index]; });
+  if (group->heads[index] == group->tails[index])
+    return false;
+
+  // Moving swaps the records, so the slot's record is reused for a subsequent alignment
+  bool was_full = (group->tails[index] - group->heads[index] == buffer_alns_);
+  aln = std::move(group->slots[index][group->heads[index] % buffer_alns_]);
+  group->heads[index]++;
+  if (was_full)
+    group->space_freed.notify_one();
+  return true;
+}
+
+void BamCramMultiReader::AdvanceMergeReader(int32_t reader_index){
+  if (!ReadFileAlignment(reader_index, cached_alns_[reader_index]))
+    merge_keys_[reader_index] = EXHAUSTED_KEY;
+  else if (merge_type_ == ORDER_ALNS_BY_POSITION)
+    merge_keys_[reader_index] = cached_alns_[reader_index].Position();
+  else
+    merge_keys_[reader_index] = reader_index;
+}
+
+void BamCramMultiReader::BuildMergeTree(){
+  // Determine the winner of each subtree bottom-up, retaining the loser of each comparison in the tree
+  int32_t num_readers = bam_readers_.size();
+  std::vector<int32_t> winners(2*num_readers);
+  for (int32_t reader_index = 0; reader_index < num_readers; reader_index++)
+    winners[num_readers+reader_index] = reader_index;
+  merge_tree_.assign(num_readers, -1);
+  for (int32_t node = num_readers-1; node >= 1; node--){
+    int32_t left = winners[2*node], right = winners[2*node+1];
+    bool left_wins  = MergePrecedes(left, right);
+    winners[node]     = (left_wins ? left  : right);
+    merge_tree_[node] = (left_wins ? right : left);
+  }
+  merge_tree_[0] = (num_readers == 1 ? 0 : winners[1]);
+}
+
+void BamCramMultiReader::ReplayMergeTree(){
+  int32_t num_readers = bam_readers_.size();
+  int32_t winner      = merge_tree_[0];
+  for (int32_t node = (num_readers+winner)/2; node >= 1; node /= 2)
+    if (MergePrecedes(merge_tree_[node], winner))
+      std::swap(merge_tree_[node], winner);
+  merge_tree_[0] = winner;
+}
+
+bool BamCramMultiReader::SetRegion(const std::string& chrom, int32_t start, int32_t end){
+  if (range_prefetch())
+    AdvanceRegionPlan(chrom, start, end);
+  if (time_seeks_)
+    seek_times_.assign(paths_.size(), -1.0);
+  if (lazy())
+    return SetLazyRegion(chrom, start, end);
+  merge_keys_.assign(bam_readers_.size(), (int32_t)EXHAUSTED_KEY);
+  bool region_set = true;
+  if (concurrent_readers_)
+    region_set = concurrent_readers_->SetRegion(chrom, start, end);
+  else {
+    for (int32_t reader_index = 0; reader_index < bam_readers_.size() && region_set; reader_index++){
+      auto seek_start = std::chrono::steady_clock::now();
+      region_set      = bam_readers_[reader_index]->SetRegion(chrom, start, end);
+      if (time_seeks_)
+	seek_times_[reader_index] = std::chrono::duration<double>(std::chrono::steady_clock::now() - seek_start).count();
+    }
+  }
+  if (!region_set){
+    merge_tree_.clear();
+    return false;
+  }
+  // The files' iterators only seek to the region once its first alignment is read, which is therefore also timed
+  bool time_reads = (time_seeks_ && !concurrent_readers_);
+  for (int32_t reader_index = 0; reader_index < bam_readers_.size(); reader_index++){
+    auto read_start = std::chrono::steady_clock::now();
+    AdvanceMergeReader(reader_index);
+    if (time_reads)
+      seek_times_[reader_index] += std::chrono::duration<double>(std::chrono::steady_clock::now() - read_start).count();
   }
-  std::make_heap(aln_heap_.begin(), aln_heap_.end());
+  BuildMergeTree();
   return true;
 }
 
 bool BamCramMultiReader::GetNextAlignment(BamAlignment& aln){
-  if (aln_heap_.empty())
+  if (lazy())
+    return GetNextLazyAlignment(aln);
+  if (merge_tree_.empty() || merge_keys_[merge_tree_[0]] == EXHAUSTED_KEY)
     return false;
-  std::pop_heap(aln_heap_.begin(), aln_heap_.end());
-  int32_t reader_index = aln_heap_.back().second;
-  aln_heap_.pop_back();
+  int32_t reader_index = merge_tree_[0];
 
-  // Assign optimal alignment to provided reference
-  aln = cached_alns_[reader_index];
+  // Assign optimal alignment to provided reference. Moving swaps the records, so the cache
+  // entry's record is immediately overwritten below
+  aln = std::move(cached_alns_[reader_index]);
 
   // Add reader's next alignment to the cache
-  if (bam_readers_[reader_index]->GetNextAlignment(cached_alns_[reader_index])){
-    if (merge_type_ == ORDER_ALNS_BY_POSITION)
-      aln_heap_.push_back(std::pair<int32_t, int32_t>(-cached_alns_[reader_index].Position(), reader_index));
-    else if (merge_type_ == ORDER_ALNS_BY_FILE)
-      aln_heap_.push_back(std::pair<int32_t, int32_t>(-reader_index, reader_index));
-    else
-      printErrorAndDie("Invalid merge order in GetNextAlignment()");
+  AdvanceMergeReader(reader_index);
+  ReplayMergeTree();
+  return true;
+}
 
-    std::push_heap(aln_heap_.begin(), aln_heap_.end());
+int32_t BamCramMultiReader::GetNextAlignments(std::vector<BamAlignment>& alns){
+  int32_t num_alns = 0, max_alns = alns.size();
+  if (lazy() || merge_type_ == ORDER_ALNS_BY_POSITION){
+    while (num_alns < max_alns && GetNextAlignment(alns[num_alns]))
+      num_alns++;
+    return num_alns;
   }
-  return true;
+
+  // In file order, the winning file's alignments all precede those of the other files, so they're read directly
+  // from the file until it's exhausted, after which the tree is replayed to select the next file
+  while (num_alns < max_alns && !merge_tree_.empty() && merge_keys_[merge_tree_[0]] != EXHAUSTED_KEY){
+    int32_t reader_index = merge_tree_[0];
+    alns[num_alns++] = std::move(cached_alns_[reader_index]);
+    while (num_alns < max_alns && ReadFileAlignment(reader_index, alns[num_alns]))
+      num_alns++;
+    if (num_alns < max_alns)
+      merge_keys_[reader_index] = EXHAUSTED_KEY;
+    else
+      AdvanceMergeReader(reader_index);
+    ReplayMergeTree();
+  }
+  return num_alns;
 }
 
 
@@ -276,3 +1172,221 @@ void BamAlignment::TrimAlignment(int32_t min_read_start, int32_t max_read_stop,
 void BamAlignment::TrimLowQualityEnds(char min_base_qual){
   return TrimAlignment(end_pos_+1, pos_-1, min_base_qual);
 }
+
+namespace {
+template<typename T> void append_value(std::string& buffer, T value){
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T> bool read_value(const char*& ptr, const char* end, T& value){
+  if (ptr + sizeof(T) > end)
+    return false;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return true;
+}
+
+void append_string(std::string& buffer, const std::string& value){
+  append_value<uint32_t>(buffer, value.size());
+  buffer.append(value);
+}
+
+bool read_string(const char*& ptr, const char* end, std::string& value){
+  uint32_t size;
+  if (!read_value(ptr, end, size) || ptr + size > end)
+    return false;
+  value.assign(ptr, size);
+  ptr += size;
+  return true;
+}
+}
+
+void BamAlignment::Serialize(std::string& buffer) const {
+  append_value(buffer, b_->core);
+  append_value<int32_t>(buffer, b_->l_data);
+  buffer.append(reinterpret_cast<const char*>(b_->data), b_->l_data);
+  append_string(buffer, file_);
+  append_value<int32_t>(buffer, length_);
+  append_value<int32_t>(buffer, pos_);
+  append_value<int32_t>(buffer, end_pos_);
+  append_value<uint8_t>(buffer, built_ ? 1 : 0);
+  if (built_){
+    append_string(buffer, bases_);
+    append_string(buffer, qualities_);
+    append_value<uint32_t>(buffer, cigar_ops_.size());
+    for (auto cigar_iter = cigar_ops_.begin(); cigar_iter != cigar_ops_.end(); cigar_iter++){
+      append_value<char>(buffer, cigar_iter->Type);
+      append_value<int32_t>(buffer, cigar_iter->Length);
+    }
+  }
+}
+
+bool BamAlignment::Deserialize(const char*& ptr, const char* end){
+  int32_t l_data;
+  if (!read_value(ptr, end, b_->core) || !read_value(ptr, end, l_data) || l_data < 0 || ptr + l_data > end)
+    return false;
+  if (b_->m_data < (uint32_t)l_data){
+    uint8_t* data = (uint8_t*)realloc(b_->data, l_data);
+    if (data == NULL)
+      printErrorAndDie("Failed to allocate memory for a BAM record");
+    b_->data   = data;
+    b_->m_data = l_data;
+  }
+  memcpy(b_->data, ptr, l_data);
+  b_->l_data = l_data;
+  ptr       += l_data;
+
+  uint8_t built;
+  if (!read_string(ptr, end, file_) || !read_value(ptr, end, length_) || !read_value(ptr, end, pos_)
+      || !read_value(ptr, end, end_pos_) || !read_value(ptr, end, built))
+    return false;
+  built_ = (built != 0);
+  cigar_ops_.clear();
+  if (!built_){
+    bases_.clear();
+    qualities_.clear();
+    return true;
+  }
+
+  uint32_t num_cigar_ops;
+  if (!read_string(ptr, end, bases_) || !read_string(ptr, end, qualities_) || !read_value(ptr, end, num_cigar_ops))
+    return false;
+  for (uint32_t i = 0; i < num_cigar_ops; i++){
+    char type;
+    int32_t length;
+    if (!read_value(ptr, end, type) || !read_value(ptr, end, length))
+      return false;
+    cigar_ops_.push_back(CigarOp(type, length));
+  }
+  return true;
+}
+
+bool BamAlignment::Build(const std::string& name, int32_t pos, bool reverse_strand, const std::vector<CigarOp>& cigar_ops,
+			 const std::string& bases, const std::string& qualities){
+  int32_t query_length = 0, ref_length = 0;
+  std::vector<uint32_t> cigar;
+  for (auto op_iter = cigar_ops.begin(); op_iter != cigar_ops.end(); op_iter++){
+    const char* op = strchr(BAM_CIGAR_STR, op_iter->Type);
+    if (op == NULL || op_iter->Type == '\0' || op_iter->Length < 0)
+      return false;
+    cigar.push_back(bam_cigar_gen(op_iter->Length, op - BAM_CIGAR_STR));
+    if (bam_cigar_type(bam_cigar_op(cigar.back())) & 1) query_length += op_iter->Length;
+    if (bam_cigar_type(bam_cigar_op(cigar.back())) & 2) ref_length   += op_iter->Length;
+  }
+  if (query_length != (int32_t)bases.size() || qualities.size() != bases.size())
+    return false;
+
+  // Variable-length data: the NUL-terminated name padded to a multiple of 4 bytes, the CIGAR operations,
+  // the 4-bit encoded bases and the raw quality scores
+  int32_t l_qname    = name.size() + 1;
+  int32_t l_extranul = (4 - l_qname%4)%4;
+  int32_t l_data     = l_qname + l_extranul + 4*cigar.size() + (bases.size()+1)/2 + bases.size();
+  if (b_->m_data < (uint32_t)l_data){
+    uint8_t* data = (uint8_t*)realloc(b_->data, l_data);
+    if (data == NULL)
+      printErrorAndDie("Failed to allocate memory for a BAM record");
+    b_->data   = data;
+    b_->m_data = l_data;
+  }
+  memset(b_->data, 0, l_data);
+  b_->l_data = l_data;
+
+  memset(&b_->core, 0, sizeof(b_->core));
+  b_->core.tid        = 0;
+  b_->core.pos        = pos;
+  b_->core.qual       = 255;
+  b_->core.flag       = (reverse_strand ? BAM_FREVERSE : 0);
+  b_->core.mtid       = -1;
+  b_->core.mpos       = -1;
+  b_->core.l_qname    = l_qname + l_extranul;
+  b_->core.l_extranul = l_extranul;
+  b_->core.n_cigar    = cigar.size();
+  b_->core.l_qseq     = bases.size();
+  b_->core.bin        = hts_reg2bin(pos, pos + std::max(ref_length, 1), 14, 5);
+
+  memcpy(b_->data, name.c_str(), name.size());
+  if (!cigar.empty())
+    memcpy(bam_get_cigar(b_), cigar.data(), 4*cigar.size());
+  uint8_t* seq = bam_get_seq(b_);
+  for (unsigned int i = 0; i < bases.size(); i++)
+    seq[i/2] |= seq_nt16_table[(unsigned char)bases[i]] << (i%2 == 0 ? 4 : 0);
+  uint8_t* quals = bam_get_qual(b_);
+  for (unsigned int i = 0; i < qualities.size(); i++)
+    quals[i] = qualities[i] - 33;
+
+  file_    = "";
+  file_index_ = -1;
+  built_   = false;
+  tags_extracted_ = false;
+  length_  = bases.size();
+  pos_     = pos;
+  end_pos_ = pos + ref_length;
+  bases_.clear();
+  qualities_.clear();
+  cigar_ops_.clear();
+  return true;
+}
+
+bool BamWriter::WriteAlignment(BamAlignment& aln, const std::string& rg_tag){
+  if (!rg_tag.empty() && !aln.HasTag("RG")){
+    std::string tag(rg_tag);
+    if (!aln.AddStringTag("RG", tag))
+      return false;
+  }
+  return (bam_write1(output_, aln.b_) != -1);
+}
+
+void BamWriter::EnableAsyncWrites(size_t max_queued){
+  if (async_)
+    printErrorAndDie("Asynchronous writes have already been enabled for the BAM output file");
+  async_         = true;
+  max_queued_    = std::max((size_t)1, max_queued);
+  writer_thread_ = std::thread(&BamWriter::ProcessQueue, this);
+}
+
+void BamWriter::ProcessQueue(){
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true){
+    queue_not_empty_.wait(lock, [this]{ return !queue_.empty() || closing_; });
+    if (queue_.empty())
+      return;
+    std::pair<BamAlignment, std::string> entry(std::move(queue_.front()));
+    queue_.pop_front();
+    queue_not_full_.notify_one();
+
+    // Add the tag and compress the alignment without blocking the threads adding alignments to the queue
+    lock.unlock();
+    if (!WriteAlignment(entry.first, entry.second))
+      printErrorAndDie("Failed to save alignment to the BAM output file");
+    lock.lock();
+  }
+}
+
+bool BamWriter::QueueAlignment(BamAlignment& aln, const std::string& rg_tag){
+  if (output_ == NULL)
+    return false;
+  if (!async_)
+    return WriteAlignment(aln, rg_tag);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_not_full_.wait(lock, [this]{ return queue_.size() < max_queued_; });
+  queue_.push_back(std::pair<BamAlignment, std::string>(std::move(aln), rg_tag));
+  lock.unlock();
+  queue_not_empty_.notify_one();
+  return true;
+}
+
+void BamWriter::Close(){
+  if (async_){
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    queue_not_empty_.notify_one();
+    writer_thread_.join();
+    async_ = false;
+  }
+  if (bgzf_close(output_) != 0)
+    printErrorAndDie("Failed to close BAM output file");
+  output_ = NULL;
+}
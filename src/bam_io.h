@@ -4,18 +4,30 @@
 #include <algorithm>
 #include <iostream>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <sys/stat.h>
 
 #include "htslib/bgzf.h"
 #include "htslib/cram/cram.h"
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 
+#include "bam_index_cache.h"
 #include "error.h"
+#include "range_prefetch.h"
 
 // htslib encodes each base using a 4 bit integer
 // This array converts each integer to its corresponding base
@@ -35,9 +47,115 @@ public:
   }
 };
 
+/*
+ * Read-only views of an alignment's bases, quality scores and CIGAR operations. Unless the alignment's sequence fields
+ * have already been materialized (e.g. by trimming), they read directly from its bam1_t record and avoid the allocations
+ * performed by QueryBases(), Qualities() and CigarData(). A view is invalidated by any modification of its alignment
+ */
+class SequenceView {
+ private:
+  const uint8_t* packed_;
+  const char* chars_;
+  int32_t size_;
+
+ public:
+  SequenceView(const uint8_t* packed, int32_t size): packed_(packed), chars_(NULL), size_(size){}
+  explicit SequenceView(const std::string& bases): packed_(NULL), chars_(bases.c_str()), size_(bases.size()){}
+
+  int32_t size() const { return size_; }
+
+  // The 4-bit encoded bases of a BAM record, or NULL if the view is backed by a string of bases
+  const uint8_t* packed() const { return packed_; }
+
+  char operator[](int32_t i) const { return (chars_ != NULL ? chars_[i] : HTSLIB_INT_TO_BASE[bam_seqi(packed_, i)]); }
+
+  bool contains(char base) const {
+    for (int32_t i = 0; i < size_; ++i)
+      if ((*this)[i] == base)
+	return true;
+    return false;
+  }
+
+  std::string substr(int32_t start, int32_t length) const {
+    std::string seq(length, ' ');
+    for (int32_t i = 0; i < length; ++i)
+      seq[i] = (*this)[start+i];
+    return seq;
+  }
+};
+
+class QualityView {
+ private:
+  const uint8_t* packed_;
+  const char* chars_;
+  int32_t size_;
+
+ public:
+  QualityView(const uint8_t* packed, int32_t size): packed_(packed), chars_(NULL), size_(size){}
+  explicit QualityView(const std::string& qualities): packed_(NULL), chars_(qualities.c_str()), size_(qualities.size()){}
+
+  int32_t size() const { return size_; }
+
+  // Returns the Phred+33 encoded quality score, matching the characters in BamAlignment::Qualities()
+  char operator[](int32_t i) const { return (chars_ != NULL ? chars_[i] : (char)(packed_[i] + 33)); }
+};
+
+class CigarSpan {
+ private:
+  const uint32_t* packed_;
+  const CigarOp* ops_;
+  int32_t size_;
+
+ public:
+  CigarSpan(const uint32_t* packed, int32_t size): packed_(packed), ops_(NULL), size_(size){}
+  explicit CigarSpan(const std::vector<CigarOp>& ops): packed_(NULL), ops_(ops.data()), size_(ops.size()){}
+
+  int32_t size() const { return size_;      }
+  bool empty()   const { return size_ == 0; }
+
+  char    type(int32_t i)   const { return (ops_ != NULL ? ops_[i].Type   : bam_cigar_opchr(packed_[i])); }
+  int32_t length(int32_t i) const { return (ops_ != NULL ? ops_[i].Length : bam_cigar_oplen(packed_[i])); }
+};
+
 
 
 
+/*
+ * Recycles the bam1_t records (and their data buffers) of destroyed BamAlignments so that new alignments
+ * can reuse them instead of allocating their own. Each thread has its own pool, so no locking is required
+ */
+class BamRecordPool {
+ private:
+  static const size_t MAX_POOL_SIZE = 4096;
+  std::vector<bam1_t*> records_;
+
+ public:
+  ~BamRecordPool(){
+    for (size_t i = 0; i < records_.size(); i++)
+      bam_destroy1(records_[i]);
+  }
+
+  bam1_t* acquire(){
+    if (records_.empty())
+      return bam_init1();
+    bam1_t* b = records_.back();
+    records_.pop_back();
+    return b;
+  }
+
+  void release(bam1_t* b){
+    if (records_.size() < MAX_POOL_SIZE)
+      records_.push_back(b);
+    else
+      bam_destroy1(b);
+  }
+
+  static BamRecordPool& thread_pool(){
+    static thread_local BamRecordPool pool;
+    return pool;
+  }
+};
+
 class BamAlignment {
 private:
   std::string bases_;
@@ -46,25 +164,42 @@ private:
 
   void ExtractSequenceFields();
 
+  // Records the RG and HP tags in a single pass over the auxiliary data
+  void ExtractTagFields() const;
+
 public:
   bam1_t *b_;
   std::string file_;
+  int32_t file_index_;            // Index of the file in the BamCramMultiReader from which the alignment was read (or -1)
   bool built_;
   int32_t length_;
   int32_t pos_, end_pos_;
 
+  // Tag fields, which are extracted on first use and must be invalidated whenever the auxiliary data changes.
+  // The RG tag is stored as an offset into the record's data, so it remains valid when the record is copied
+  mutable bool tags_extracted_;
+  mutable int32_t rg_offset_;     // -1 iff the read doesn't have an RG tag
+  mutable bool has_haplotype_;
+  mutable int64_t haplotype_;
+
   BamAlignment(){
-    b_       = bam_init1();
+    b_       = BamRecordPool::thread_pool().acquire();
+    file_index_ = -1;
     built_   = false;
     length_  = -1;
     pos_     = 0;
     end_pos_ = -1;
+    tags_extracted_ = false;
+    rg_offset_      = -1;
+    has_haplotype_  = false;
+    haplotype_      = -1;
   }
 
   BamAlignment(const BamAlignment &aln){
-    b_ = bam_init1();
+    b_ = BamRecordPool::thread_pool().acquire();
     bam_copy1(b_, aln.b_);
     file_      = aln.file_;
+    file_index_ = aln.file_index_;
     built_     = aln.built_;
     length_    = aln.length_;
     pos_       = aln.pos_;
@@ -72,11 +207,31 @@ public:
     bases_     = aln.bases_;
     qualities_ = aln.qualities_;
     cigar_ops_ = aln.cigar_ops_;
+    CopyTagFields(aln);
+  }
+
+  // The moved-from alignment receives an empty record from the pool, so it can still be reused (e.g. by GetNextAlignment())
+  BamAlignment(BamAlignment&& aln) noexcept {
+    b_         = aln.b_;
+    aln.b_     = BamRecordPool::thread_pool().acquire();
+    file_      = std::move(aln.file_);
+    file_index_ = aln.file_index_;
+    built_     = aln.built_;
+    length_    = aln.length_;
+    pos_       = aln.pos_;
+    end_pos_   = aln.end_pos_;
+    bases_     = std::move(aln.bases_);
+    qualities_ = std::move(aln.qualities_);
+    cigar_ops_ = std::move(aln.cigar_ops_);
+    CopyTagFields(aln);
+    aln.built_ = false;
+    aln.tags_extracted_ = false;
   }
 
   BamAlignment& operator=(const BamAlignment& aln){
     bam_copy1(b_, aln.b_);
     file_      = aln.file_;
+    file_index_ = aln.file_index_;
     built_     = aln.built_;
     length_    = aln.length_;
     pos_       = aln.pos_;
@@ -84,11 +239,37 @@ public:
     bases_     = aln.bases_;
     qualities_ = aln.qualities_;
     cigar_ops_ = aln.cigar_ops_;
+    CopyTagFields(aln);
     return *this;
   }
 
+  // Swaps records with the moved-from alignment, which is left holding this alignment's previous record
+  BamAlignment& operator=(BamAlignment&& aln) noexcept {
+    std::swap(b_, aln.b_);
+    file_      = std::move(aln.file_);
+    file_index_ = aln.file_index_;
+    built_     = aln.built_;
+    length_    = aln.length_;
+    pos_       = aln.pos_;
+    end_pos_   = aln.end_pos_;
+    bases_     = std::move(aln.bases_);
+    qualities_ = std::move(aln.qualities_);
+    cigar_ops_ = std::move(aln.cigar_ops_);
+    CopyTagFields(aln);
+    aln.built_ = false;
+    aln.tags_extracted_ = false;
+    return *this;
+  }
+
+  void CopyTagFields(const BamAlignment& aln){
+    tags_extracted_ = aln.tags_extracted_;
+    rg_offset_      = aln.rg_offset_;
+    has_haplotype_  = aln.has_haplotype_;
+    haplotype_      = aln.haplotype_;
+  }
+
   ~BamAlignment(){
-    bam_destroy1(b_);
+    BamRecordPool::thread_pool().release(b_);
   }
 
   /* Number of bases */
@@ -103,6 +284,9 @@ public:
   /* Name of the read */
   std::string Name()            const { return std::string(bam_get_qname(b_)); }
 
+  /* Null-terminated name of the read, without copying it into a string */
+  const char* NameChars()       const { return bam_get_qname(b_); }
+
   /* ID number for reference sequence */
   int32_t RefID()               const { return b_->core.tid;      }
 
@@ -117,6 +301,9 @@ public:
 
   /* Name of file from which the alignment was read */
   const std::string& Filename() const { return file_;             }
+
+  /* Index of the file from which the alignment was read in its BamCramMultiReader, or -1 if it wasn't read by one */
+  int32_t FileIndex()           const { return file_index_;       }
   
   /* Sequenced bases */
   const std::string& QueryBases(){
@@ -135,10 +322,37 @@ public:
     return cigar_ops_;
   }
 
+  /* Allocation-free views of the sequenced bases, quality scores and CIGAR operations */
+  SequenceView QueryBasesView() const {
+    return (built_ ? SequenceView(bases_) : SequenceView(bam_get_seq(b_), b_->core.l_qseq));
+  }
+
+  QualityView QualitiesView() const {
+    return (built_ ? QualityView(qualities_) : QualityView(bam_get_qual(b_), b_->core.l_qseq));
+  }
+
+  CigarSpan CigarView() const {
+    return (built_ ? CigarSpan(cigar_ops_) : CigarSpan(bam_get_cigar(b_), b_->core.n_cigar));
+  }
+
+  /* Null-terminated value of the RG tag, or NULL if the read doesn't have one */
+  const char* ReadGroupTag() const {
+    if (!tags_extracted_) ExtractTagFields();
+    return (rg_offset_ == -1 ? NULL : (const char*)(b_->data + rg_offset_));
+  }
+
+  /* Stores the value of the HP tag and returns true iff the read has one */
+  bool HaplotypeTag(int64_t& value) const {
+    if (!tags_extracted_) ExtractTagFields();
+    value = haplotype_;
+    return has_haplotype_;
+  }
+
   bool RemoveTag(const char tag[2]) const {
     uint8_t* tag_data = bam_aux_get(b_, tag);
     if (tag_data == NULL)
       return false;
+    tags_extracted_ = false;
     return (bam_aux_del(b_, tag_data) == 0);
   }
 
@@ -167,6 +381,7 @@ public:
   bool AddStringTag(const char tag[2], std::string& value){
     if (HasTag(tag))
       return false;
+    tags_extracted_ = false;
     return (bam_aux_append(b_, tag, 'Z', value.size()+1, (uint8_t*)value.c_str()) == 0);
   }
 
@@ -214,38 +429,30 @@ public:
   bool IsFirstMate()         const { return (b_->core.flag & BAM_FREAD1)       != 0;}
   bool IsSecondMate()        const { return (b_->core.flag & BAM_FREAD2)       != 0;}
 
-  bool StartsWithSoftClip(){
-    if (!built_) ExtractSequenceFields();
-    if (cigar_ops_.empty())
-      return false;
-    return cigar_ops_.front().Type == 'S';
+  bool StartsWithSoftClip() const {
+    CigarSpan cigar = CigarView();
+    return !cigar.empty() && cigar.type(0) == 'S';
   }
 
-  bool EndsWithSoftClip(){
-    if (!built_) ExtractSequenceFields();
-    if (cigar_ops_.empty())
-      return false;
-    return cigar_ops_.back().Type == 'S';
+  bool EndsWithSoftClip() const {
+    CigarSpan cigar = CigarView();
+    return !cigar.empty() && cigar.type(cigar.size()-1) == 'S';
   }
 
-  bool StartsWithHardClip(){
-    if (!built_) ExtractSequenceFields();
-    if (cigar_ops_.empty())
-      return false;
-    return cigar_ops_.front().Type == 'H';
+  bool StartsWithHardClip() const {
+    CigarSpan cigar = CigarView();
+    return !cigar.empty() && cigar.type(0) == 'H';
   }
 
-  bool EndsWithHardClip(){
-    if (!built_) ExtractSequenceFields();
-    if (cigar_ops_.empty())
-      return false;
-    return cigar_ops_.back().Type == 'H';
+  bool EndsWithHardClip() const {
+    CigarSpan cigar = CigarView();
+    return !cigar.empty() && cigar.type(cigar.size()-1) == 'H';
   }
 
-  bool MatchesReference(){
-    if (!built_) ExtractSequenceFields();
-    for (auto cigar_iter = cigar_ops_.begin(); cigar_iter != cigar_ops_.end(); cigar_iter++)
-      if (cigar_iter->Type != 'M' && cigar_iter->Type != '=')
+  bool MatchesReference() const {
+    CigarSpan cigar = CigarView();
+    for (int32_t i = 0; i < cigar.size(); i++)
+      if (cigar.type(i) != 'M' && cigar.type(i) != '=')
 	return false;
     return true;
   }
@@ -309,6 +516,22 @@ public:
   void TrimAlignment(int32_t min_read_start, int32_t max_read_stop, char min_base_qual='~');
 
   void TrimLowQualityEnds(char min_base_qual);
+
+  /*
+   *  Append a binary representation of the alignment to BUFFER, including any trimming applied to its bases, qualities and CIGAR operations
+   *  Deserialize() restores the alignment from the representation starting at PTR and advances PTR past it.
+   *  Returns false if the representation extends beyond END
+   */
+  void Serialize(std::string& buffer) const;
+
+  bool Deserialize(const char*& ptr, const char* end);
+
+  /*
+   *  Replaces the alignment with an unpaired, mapped read named NAME whose first aligned base is at the 0-based position POS.
+   *  QUALITIES are Phred+33 encoded. Returns false if the CIGAR operations don't consume exactly the provided bases
+   */
+  bool Build(const std::string& name, int32_t pos, bool reverse_strand, const std::vector<CigarOp>& cigar_ops,
+	     const std::string& bases, const std::string& qualities);
 };
 
 
@@ -417,7 +640,9 @@ private:
   samFile   *in_;
   bam_hdr_t *hdr_;
   hts_idx_t *idx_;
+  MappedBamIndex* mapped_idx_; // Memory-mapped copy of the index used instead of IDX_ (or NULL)
   std::string path_;
+  int32_t file_index_;     // Index of the file in its BamCramMultiReader (or -1)
   BamHeader*  header_;
 
   // Instance variables for the most recently set region
@@ -427,22 +652,103 @@ private:
   uint64_t    min_offset_; // Offset after first alignment
   BamAlignment first_aln_; // First alignment
 
+  // Whether each chromosome has any alignments according to the index (-1 if not yet determined), so that
+  // regions on chromosomes without any alignments can be skipped without constructing an iterator
+  std::vector<int8_t> chrom_has_alns_;
+
+  // Instance variables for streaming mode, in which each chromosome is scanned once in sorted order
+  // and the alignments for consecutive regions are extracted from a sliding window buffer
+  bool streaming_;
+  int32_t max_stream_gap_;               // Restart the scan using the index if the next region starts more than this many bp downstream
+  hts_itr_t* stream_iter_;               // Iterator from the start of the scan to the end of the chromosome
+  int32_t stream_tid_;                   // Chromosome being scanned
+  int32_t stream_pos_;                   // Position of the most recent alignment added to the window
+  bool stream_done_;                     // True iff the scan has reached the end of the chromosome
+  std::deque<BamAlignment> window_;      // Buffered alignments, sorted by position
+  size_t window_index_;                  // Index of the next alignment in the window to examine for the current region
+  int32_t region_start_, region_end_;
+
+  // Instance variables for alignments read sequentially from stdin, which can't be indexed. The scan never restarts, so the regions
+  // must be requested in the order of the header's chromosomes. The first alignment read past the scanned chromosome is held until
+  // the scan reaches its chromosome
+  bool from_stdin_;
+  BamAlignment pending_aln_;
+  bool has_pending_;
+  bool input_done_;                      // True iff the end of the input has been reached
+
+  // Cache of prefetched byte ranges through which the file is read (or NULL if its ranges aren't prefetched)
+  std::shared_ptr<RangeCache> range_cache_;
+
   bool file_exists(std::string path){
     return (access(path.c_str(), F_OK) != -1);
   }
 
+  // Set the alignment instance variables that are derived from the underlying BAM record
+  void InitAlignment(BamAlignment& aln){
+    aln.built_   = false;
+    aln.tags_extracted_ = false;
+    aln.file_    = path_;
+    aln.file_index_ = file_index_;
+    aln.length_  = aln.b_->core.l_qseq;
+    aln.pos_     = aln.b_->core.pos;
+    aln.end_pos_ = bam_endpos(aln.b_);
+  }
+
+  int32_t GetChromID(const std::string& chrom);
+
+  // Equivalent to sam_itr_queryi(), using the memory-mapped index if available
+  hts_itr_t* QueryIndex(int32_t tid, int32_t start, int32_t end){
+    return (mapped_idx_ != NULL ? mapped_idx_->query(tid, start, end) : sam_itr_queryi(idx_, tid, start, end));
+  }
+
+  bool ChromHasAlignments(int32_t tid);
+
+  bool SetStreamingRegion(const std::string& chrom, int32_t start, int32_t end);
+
+  // Reads the next alignment on the scanned chromosome into ALN, returning false once the scan reaches the end of the chromosome
+  bool NextStreamAlignment(BamAlignment& aln);
+
+  bool GetNextStreamingAlignment(BamAlignment& aln);
+
+  // Decode the CRAM's reads using the provided reference sequences, which are loaded in their entirety and freed once unused
+  void ShareCramReference(refs_t* refs);
+
+  // Close the file, releasing its CRAM reference sequences (if any)
+  void CloseFile();
+
 public:
-  BamCramReader(std::string& path, std::string fasta_path = ""){
-    path_ = path;
+  /*
+   * If RANGE_CACHE is provided, the file is read using the byte ranges prefetched into the cache whenever possible.
+   * If SHARED_REFS is provided, a CRAM file decodes its reads using these reference sequences (see cram_refs())
+   * rather than loading its own copy of the FASTA reference. If INDEX_CACHE_DIR is provided, a BAM's .bai index is memory-mapped from
+   * its cached copy in the directory (see MappedBamIndex). If PATH is -, the coordinate-sorted alignments are read from stdin
+   * without an index, and the reader is always in streaming mode
+   */
+  BamCramReader(std::string& path, std::string fasta_path = "", std::shared_ptr<RangeCache> range_cache = nullptr, refs_t* shared_refs = NULL,
+		const std::string& index_cache_dir = ""){
+    path_        = path;
+    file_index_  = -1;
+    range_cache_ = range_cache;
+    from_stdin_  = (path.compare("-") == 0);
+    if (from_stdin_ && range_cache_)
+      printErrorAndDie("Byte ranges can't be prefetched for alignments read from stdin");
 
     // Open the file itself
-    if (!file_exists(path))
+    if (!from_stdin_ && !is_url_path(path) && !file_exists(path))
       printErrorAndDie("File " + path + " doest not exist");
-    in_ = sam_open(path.c_str(), "r");
+    if (range_cache_){
+      hFILE* cached_file = open_cached_hfile(path, range_cache_);
+      in_ = (cached_file == NULL ? NULL : hts_hopen(cached_file, path.c_str(), "r"));
+      if (in_ == NULL && cached_file != NULL && hclose(cached_file) != 0){}
+    }
+    else
+      in_ = sam_open(path.c_str(), "r");
     if (in_ == NULL)
       printErrorAndDie("Failed to open file " + path);
 
-    if (in_->is_cram){
+    if (in_->is_cram && shared_refs != NULL)
+      ShareCramReference(shared_refs);
+    else if (in_->is_cram){
       if (fasta_path.empty())
 	printErrorAndDie("Must specify a FASTA reference file path for CRAM file " + path);
       
@@ -454,6 +760,9 @@ public:
       if (cram_load_reference(in_->fp.cram, fasta) < 0)
 	printErrorAndDie("Failed to open FASTA reference file for CRAM file");
       delete [] fasta;
+
+      // Load entire reference sequences so that other files can share them
+      ShareCramReference(cram_get_refs(in_));
     }
 
     // Read the header
@@ -461,38 +770,166 @@ public:
       printErrorAndDie("Failed to read the header for file " + path);
     header_ = new BamHeader(hdr_);
 
-    // Open the index
-    idx_ = sam_index_load(in_, path.c_str());
-    if (idx_ == NULL) 
+    // Open the index, preferring its memory-mapped copy. Alignments read from stdin aren't indexed
+    idx_        = NULL;
+    mapped_idx_ = NULL;
+    if (!index_cache_dir.empty() && !in_->is_cram && !from_stdin_)
+      mapped_idx_ = MappedBamIndex::open(path, index_cache_dir);
+    if (mapped_idx_ == NULL && !from_stdin_ && (idx_ = sam_index_load(in_, path.c_str())) == NULL)
       printErrorAndDie("Failed to load the index for file " + path);
 
     iter_  = NULL;
     chrom_ = "";
     start_ = -1;
     min_offset_ = 0;
+    chrom_has_alns_.assign(hdr_->n_targets, -1);
+
+    streaming_      = from_stdin_;
+    max_stream_gap_ = 0;
+    stream_iter_    = NULL;
+    stream_tid_     = -1;
+    stream_pos_     = -1;
+    stream_done_    = true;
+    window_index_   = 0;
+    region_start_   = region_end_ = -1;
+    has_pending_    = false;
+    input_done_     = false;
   }
 
   const BamHeader* bam_header() const { return header_; }
   const std::string& path()     const { return path_;   }
+  bool from_stdin()             const { return from_stdin_; }
+
+  // Alignments subsequently read from this file are labeled with FILE_INDEX (see BamAlignment::FileIndex())
+  void SetFileIndex(int32_t file_index){ file_index_ = file_index; }
+
+  // Reference sequences used to decode the reads of a CRAM file (or NULL for a BAM), which can be shared with other CRAMs that
+  // have the same header. Their reference count must be managed using retain_cram_refs() and release_cram_refs()
+  refs_t* cram_refs(){ return (in_->is_cram ? cram_get_refs(in_) : NULL); }
+
+  // Per-chromosome alignment flags determined so far (see ChromHasAlignments), which remain valid after the file is closed
+  const std::vector<int8_t>& chrom_alignment_flags() const { return chrom_has_alns_; }
   
   ~BamCramReader(){
     bam_hdr_destroy(hdr_);
     delete header_;
-    sam_close(in_);
+    if (idx_ != NULL)
+      hts_idx_destroy(idx_);
+    delete mapped_idx_;
+    CloseFile();
 
     if (iter_ != NULL)
       hts_itr_destroy(iter_);
+    if (stream_iter_ != NULL)
+      hts_itr_destroy(stream_iter_);
+  }
+
+  /*
+   * Instead of seeking to each region using the index, scan each chromosome once and buffer the alignments
+   * so that they can be reused by overlapping or nearby regions. Regions must be requested in sorted order
+   * for this to be efficient, but a region upstream of the previous one or more than MAX_GAP bp past the
+   * end of the buffered alignments simply restarts the scan using the index
+   */
+  void EnableStreaming(int32_t max_gap){
+    streaming_      = true;
+    max_stream_gap_ = max_gap;
+  }
+
+  // Decompress BGZF blocks or decode CRAM containers using the threads in the provided pool
+  bool SetThreadPool(htsThreadPool* pool){
+    return hts_set_thread_pool(in_, pool) == 0;
   }
 
+  /*
+   * Only decode the CRAM data series required by the provided mask of sam_fields (see CRAM_OPT_REQUIRED_FIELDS). Unless DECODE_MD is true,
+   * the MD and NM tags are also no longer regenerated for records that don't store them. Has no effect on BAM files
+   */
+  bool SetRequiredFields(int fields, bool decode_md);
+
   bool GetNextAlignment(BamAlignment& aln);
+
+  // Read the next alignment in the file, irrespective of any region that has been set
+  bool GetNextFileAlignment(BamAlignment& aln){
+    if (sam_read1(in_, hdr_, aln.b_) < 0)
+      return false;
+    InitAlignment(aln);
+    return true;
+  }
   
   bool SetRegion(const std::string& chrom, int32_t start, int32_t end);
+
+  /*
+   * Append the compressed byte ranges of the file that contain the alignments overlapping each of the provided regions on CHROM,
+   * as determined by the index. Each BAM chunk is extended to include its last BGZF block, while each CRAM slice is extended
+   * to include its container's header
+   */
+  void PlanByteRanges(const std::string& chrom, const std::vector< std::pair<int32_t, int32_t> >& regions, std::vector<ByteRange>& ranges);
 };
 
 
+// Add or remove a reference to a set of CRAM reference sequences shared by multiple files, which is freed once it has no references
+void retain_cram_refs(refs_t* refs);
+void release_cram_refs(refs_t* refs);
+
 void compare_bam_headers(const BamHeader* hdr_a, const BamHeader* hdr_b, const std::string& file_a, const std::string& file_b);
 
 
+/*
+ * Background threads that each read a group of files, buffering up to BUFFER_ALNS decoded alignments per file for the current region
+ * so that a file on slow or remote storage doesn't stall the merge. Setting a region is fanned out to all of the threads at once.
+ * Each file's buffer is a ring of reusable records: the thread fills the slots after the tail while the merge swaps records out
+ * of the slots before it, so the two only synchronize to publish newly read alignments or to free space
+ */
+class ConcurrentFileReaders {
+ private:
+  struct ReaderGroup {
+    std::mutex mutex;
+    std::condition_variable region_set, alns_read, space_freed;
+    std::thread thread;
+    std::vector<BamCramReader*> readers;
+    std::vector< std::vector<BamAlignment> > slots;  // Ring buffer of each file in the group
+    std::vector<int64_t> heads, tails;               // Numbers of alignments consumed and buffered for each file
+    std::vector<int8_t> done;                        // True once all of the file's alignments for the region have been buffered
+    std::string chrom;
+    int32_t start, end;
+    int64_t region_id;  // Most recently requested region
+    int64_t ready_id;   // Most recent region whose SetRegion() calls have completed
+    bool region_ok;
+    bool closing;
+  };
+
+  std::vector<ReaderGroup*> groups_;
+  int32_t buffer_alns_;
+  int64_t region_id_;
+
+  void read_files(ReaderGroup* group);
+
+  // Buffers the alignments of a group's files for the region until they're exhausted or another region is requested
+  void buffer_region(ReaderGroup* group, int64_t region_id, std::unique_lock<std::mutex>& lock);
+
+ public:
+  const static int32_t DEFAULT_BUFFER_ALNS = 256;
+  const static int32_t READ_BATCH          = 16;  // Alignments read between each publication to the merge
+
+  // File i is read by thread i % NUM_THREADS. The readers must outlive this object
+  ConcurrentFileReaders(std::vector<BamCramReader*>& readers, int num_threads, int32_t buffer_alns = DEFAULT_BUFFER_ALNS);
+
+  ~ConcurrentFileReaders();
+
+  // Sets the region in all of the files concurrently, returning false if it couldn't be set for one or more of them
+  bool SetRegion(const std::string& chrom, int32_t start, int32_t end);
+
+  // Swaps the file's next buffered alignment into ALN, waiting for it to be read if necessary
+  bool GetNextAlignment(int32_t file_index, BamAlignment& aln);
+
+  int num_threads() const { return groups_.size(); }
+  int32_t buffer_alns() const { return buffer_alns_; }
+
+  ConcurrentFileReaders(const ConcurrentFileReaders&)            = delete;
+  ConcurrentFileReaders& operator=(const ConcurrentFileReaders&) = delete;
+};
+
+
 
 
 
@@ -501,46 +938,253 @@ class BamCramMultiReader {
  private:
   std::vector<BamCramReader*> bam_readers_;
   std::vector<BamAlignment> cached_alns_;
-  std::vector<std::pair<int32_t, int32_t> > aln_heap_;
+
+  // Loser tree that merges the readers' cached alignments. Node 0 holds the reader whose cached alignment is next and internal
+  // node i (1 <= i < N) holds the reader that lost the comparison at that node, where reader j is the leaf at node N+j.
+  // Replacing the winner's alignment therefore only replays the log2(N) comparisons on the path from its leaf to the root
+  std::vector<int32_t> merge_tree_;
+  std::vector<int32_t> merge_keys_; // Key of each reader's cached alignment, or EXHAUSTED_KEY if the reader has none
+  std::unique_ptr<ConcurrentFileReaders> concurrent_readers_; // Background readers of the files, if enabled
+  std::vector<std::string> paths_;
+  std::string fasta_path_;
+  std::string index_cache_dir_; // Directory of memory-mapped BAM indexes (or empty)
   int merge_type_;
+  bool streaming_;
+  int32_t max_stream_gap_;
+  htsThreadPool thread_pool_;
+  bool owns_thread_pool_;
+  int required_fields_; // Mask of the sam_fields decoded from CRAM files, or 0 if all fields are decoded
+  bool decode_md_;      // Whether missing MD and NM tags are regenerated when decoding CRAM files
+
+  // Reference sequences loaded by the first CRAM file that was opened, which are shared by all of the CRAM files
+  // so that each contig is only loaded and stored once, irrespective of the number of files
+  refs_t* shared_cram_refs_;
+
+  // Instance variables for lazy mode, in which each file is only opened (and its index loaded) once a region requires its
+  // alignments. At most MAX_OPEN_FILES_ files are open at once, and the least recently used file is closed to open another.
+  // Each file's header is validated against that of the first file at construction, which can be avoided using a header cache
+  int max_open_files_;                                              // 0 unless lazy mode is enabled
+  std::shared_ptr<BamHeader> ref_header_;                           // Header of the first file, shared by all of the files
+  std::shared_ptr< std::vector< std::vector<ReadGroup> > > read_groups_; // Read groups for each file
+  std::list<int32_t> open_files_;                                   // Indices of the open files, from most to least recently used
+  std::vector<std::list<int32_t>::iterator> open_file_iters_;
+  std::vector< std::vector<int8_t> > closed_chrom_flags_;           // Per-chromosome alignment flags of each closed file, so it isn't reopened for chromosomes without alignments
+  std::string region_chrom_;
+  int32_t region_tid_;
+  int32_t region_start_, region_end_;
+  int32_t next_file_;   // Index of the next file to read for the current region
+  int32_t active_file_; // Index of the file currently being read, or -1 if none
+
+  // Instance variables for range prefetching, in which the compressed byte ranges required by the next PREFETCH_REGIONS_ planned
+  // regions are determined using each file's index, coalesced and fetched concurrently into the file's cache before they're read
+  std::unique_ptr<RangePrefetcher> range_prefetcher_;
+  std::vector< std::shared_ptr<RangeCache> > range_caches_;
+  int prefetch_regions_;
+  int64_t max_range_gap_;  // Ranges separated by at most this many bytes are fetched using a single request
+  std::vector<std::string> plan_chroms_;
+  std::vector< std::pair<int32_t, int32_t> > plan_regions_;
+  size_t plan_index_;     // Index of the planned region that was most recently set
+  size_t next_prefetch_;  // Index of the first planned region whose ranges haven't been prefetched
+
+  bool time_seeks_;
+  std::vector<double> seek_times_; // Seconds each file required to seek to the most recently set region, or -1 if it wasn't timed
+
+  void Init(int merge_type);
+
+  static const int32_t EXHAUSTED_KEY = INT32_MAX;
+
+  // Returns true iff reader A's cached alignment precedes reader B's. Ties are broken in favor of the later reader
+  bool MergePrecedes(int32_t reader_a, int32_t reader_b) const {
+    return merge_keys_[reader_a] < merge_keys_[reader_b] || (merge_keys_[reader_a] == merge_keys_[reader_b] && reader_a > reader_b);
+  }
+
+  // Reads the file's next alignment from its background reader's buffer, if enabled, or otherwise directly from the file
+  bool ReadFileAlignment(int32_t reader_index, BamAlignment& aln){
+    return (concurrent_readers_ ? concurrent_readers_->GetNextAlignment(reader_index, aln) : bam_readers_[reader_index]->GetNextAlignment(aln));
+  }
+
+  // Reads the reader's next alignment into its cache and updates its merge key
+  void AdvanceMergeReader(int32_t reader_index);
+
+  void BuildMergeTree();
+
+  // Restores the loser tree after the key of the current winner has changed
+  void ReplayMergeTree();
+
+  // Validate the header of each file and extract its read groups, reusing the entries in the cache file (if any)
+  // for files whose sizes and modification times are unchanged. Updates the cache file if any entries were added
+  void LoadLazyHeaders(const std::string& header_cache);
+
+  // Opens the file with the provided index, sharing the CRAM reference sequences loaded by previously opened files.
+  // If REFS_MUTEX is provided, it guards the shared reference sequences, as other threads are concurrently opening files
+  BamCramReader* NewReader(int32_t file_index, std::mutex* refs_mutex = NULL);
+
+  // Opens all of the files and validates their headers, using up to NUM_THREADS threads to open the files and load their indexes
+  void OpenAllFiles(int num_threads);
+
+  // Returns the reader for the file with the provided index, opening it if necessary
+  BamCramReader* OpenFile(int32_t file_index);
+
+  bool SetLazyRegion(const std::string& chrom, int32_t start, int32_t end);
+
+  bool GetNextLazyAlignment(BamAlignment& aln);
+
+  // Prefetch the byte ranges for the planned regions that follow the provided region, if it's planned and few of them remain
+  void AdvanceRegionPlan(const std::string& chrom, int32_t start, int32_t end);
 
  public:
   const static int ORDER_ALNS_BY_POSITION = 0;
   const static int ORDER_ALNS_BY_FILE     = 1;
+  const static int32_t DEFAULT_MAX_STREAM_GAP = 10000;
 
-  BamCramMultiReader(std::vector<std::string>& paths, std::string fasta_path = "", int merge_type = ORDER_ALNS_BY_POSITION){
-    if (paths.empty())
-      printErrorAndDie("Must provide at least one file to BamCramMultiReader constructor");
-    if (merge_type != ORDER_ALNS_BY_POSITION && merge_type != ORDER_ALNS_BY_FILE)
-      printErrorAndDie("Invalid merge type provided to BamCramMultiReader constructor");
-    for (size_t i = 0; i < paths.size(); i++){
-      cached_alns_.push_back(BamAlignment());
-      bam_readers_.push_back(new BamCramReader(paths[i], fasta_path));
-      compare_bam_headers(bam_readers_[0]->bam_header(), bam_readers_[i]->bam_header(), paths[0], paths[i]);
-    }
-    merge_type_ = merge_type;
-  }
+  /*
+   * If MAX_OPEN_FILES > 0, the files are opened lazily and at most MAX_OPEN_FILES are kept open at once (see the instance variables
+   * above). As each file is then read in its entirety before the next file is opened, lazy mode requires the ORDER_ALNS_BY_FILE
+   * merge type. HEADER_CACHE optionally provides the path of a file in which the validated headers are cached across runs.
+   * Otherwise, all of the files are opened using up to OPEN_THREADS threads, which hides the latency of loading many indexes
+   */
+  BamCramMultiReader(std::vector<std::string>& paths, std::string fasta_path = "", int merge_type = ORDER_ALNS_BY_POSITION,
+		     int max_open_files = 0, std::string header_cache = "", std::string index_cache_dir = "", int open_threads = 1);
+
+  // Construct a reader for the same files as the provided reader, e.g. for use by another thread. In lazy mode, the new
+  // reader shares the validated headers and keeps at most MAX_OPEN_FILES files open
+  BamCramMultiReader(BamCramMultiReader& reader, int max_open_files);
 
   ~BamCramMultiReader(){
+    // The background readers must stop using the files before they're closed
+    concurrent_readers_.reset();
     for (size_t i = 0; i < bam_readers_.size(); i++)
       delete bam_readers_[i];
+    if (shared_cram_refs_ != NULL)
+      release_cram_refs(shared_cram_refs_);
+
+    // The pool can only be destroyed once none of the files are using it
+    if (owns_thread_pool_)
+      hts_tpool_destroy(thread_pool_.pool);
   }
 
   int get_merge_type(){ return merge_type_; }
 
+  std::vector<std::string>& paths(){ return paths_;          }
+  std::string& fasta_path()        { return fasta_path_;     }
+  bool streaming()                 { return streaming_;      }
+  htsThreadPool* thread_pool()     { return (thread_pool_.pool == NULL ? NULL : &thread_pool_); }
+  int32_t max_stream_gap()         { return max_stream_gap_; }
+  bool lazy()                const { return max_open_files_ > 0; }
+  int max_open_files()       const { return max_open_files_; }
+
+  // Returns true iff one of the files is a BAM/CRAM streamed from stdin
+  bool reads_stdin() const {
+    return std::find(paths_.begin(), paths_.end(), "-") != paths_.end();
+  }
+
+  // Scan each chromosome once in sorted order instead of seeking to each region (see BamCramReader::EnableStreaming)
+  void EnableStreaming(int32_t max_gap = DEFAULT_MAX_STREAM_GAP){
+    streaming_      = true;
+    max_stream_gap_ = max_gap;
+    for (size_t i = 0; i < bam_readers_.size(); i++)
+      if (bam_readers_[i] != NULL)
+	bam_readers_[i]->EnableStreaming(max_gap);
+  }
+
   const BamHeader* bam_header() const {
-    return bam_readers_[0]->bam_header();
+    return (lazy() ? ref_header_.get() : bam_readers_[0]->bam_header());
   }
 
+  // Headers aren't retained for each file in lazy mode, so only the read groups are available through read_groups()
   const BamHeader* bam_header(int file_index) const {
+    if (lazy())
+      printErrorAndDie("The headers of individual files are unavailable when files are opened lazily");
     if (file_index >= 0 && file_index < bam_readers_.size())
       return bam_readers_[file_index]->bam_header(); 
     printErrorAndDie("Invalid file index provided to bam_header() function");
   }
 
+  const std::vector<ReadGroup>& read_groups(int file_index) const {
+    if (file_index < 0 || file_index >= paths_.size())
+      printErrorAndDie("Invalid file index provided to read_groups() function");
+    return (lazy() ? (*read_groups_)[file_index] : bam_readers_[file_index]->bam_header()->read_groups());
+  }
+
+  // Create a pool of NUM_THREADS threads that is shared by all of the files for BGZF decompression and CRAM decoding.
+  // Once a region has been set, the pool also reads ahead and decompresses the subsequent blocks in each file
+  void CreateThreadPool(int num_threads){
+    if (thread_pool_.pool != NULL)
+      printErrorAndDie("Cannot create multiple thread pools for a BamCramMultiReader");
+    thread_pool_.pool = hts_tpool_init(num_threads);
+    if (thread_pool_.pool == NULL)
+      printErrorAndDie("Failed to create the thread pool for BAM/CRAM decompression");
+    owns_thread_pool_ = true;
+    AttachThreadPool();
+  }
+
+  // Only decode the provided fields from CRAM files, both those that are open and those opened later (see BamCramReader::SetRequiredFields)
+  void SetRequiredFields(int fields, bool decode_md);
+
+  int required_fields() const { return required_fields_; }
+
+  // Share an existing thread pool, which must outlive this reader, across all of the files
+  void SetThreadPool(htsThreadPool* pool){
+    if (thread_pool_.pool != NULL)
+      printErrorAndDie("Cannot set multiple thread pools for a BamCramMultiReader");
+    thread_pool_ = *pool;
+    AttachThreadPool();
+  }
+
+  /*
+   * Read each file through an in-memory cache of CACHE_MB megabytes, into which NUM_THREADS threads prefetch the byte ranges for
+   * the next NUM_REGIONS regions of the plan provided to SetRegionPlan(). Intended for files accessed through URLs, for which each
+   * small read that misses the cache is a high-latency request. Files that are already open are reopened through their caches.
+   * If USE_IO_URING is true, the ranges of local files are instead read in batches through io_uring by a single thread, which
+   * keeps many reads in flight for fast local drives such as NVMe SSDs
+   */
+  void EnableRangePrefetch(int num_regions, int num_threads = DEFAULT_PREFETCH_THREADS, int64_t cache_mb = DEFAULT_PREFETCH_CACHE_MB,
+			   int64_t max_gap = DEFAULT_MAX_RANGE_GAP, bool use_io_uring = false);
+
+  bool range_prefetch() const { return range_prefetcher_ != nullptr; }
+
+  /*
+   * Read the files using NUM_THREADS background threads, each of which buffers up to BUFFER_ALNS alignments per file for the current
+   * region (see ConcurrentFileReaders). Hides the latency of files spread across slow or remote storage. Must be enabled after the
+   * files' other options have been set and can't be combined with lazy mode or range prefetching
+   */
+  void EnableConcurrentReads(int num_threads, int32_t buffer_alns = ConcurrentFileReaders::DEFAULT_BUFFER_ALNS);
+
+  int concurrent_read_threads() const { return (concurrent_readers_ ? concurrent_readers_->num_threads() : 0); }
+  int32_t concurrent_read_buffer() const { return (concurrent_readers_ ? concurrent_readers_->buffer_alns() : 0); }
+
+  /*
+   * Time the seek each file performs when a region is set, including the read of its first alignment, available through SeekTimes().
+   * Only seeks that SetRegion() performs directly are timed, so those of concurrent readers and lazily opened files aren't
+   */
+  void EnableSeekTiming(){ time_seeks_ = true; }
+  bool seek_timing() const { return time_seeks_; }
+  const std::vector<double>& SeekTimes() const { return seek_times_; }
+
+  // Provide the sorted regions that will subsequently be passed to SetRegion(), whose byte ranges are prefetched in advance
+  void SetRegionPlan(const std::vector<std::string>& chroms, const std::vector< std::pair<int32_t, int32_t> >& regions);
+
+  const static int     DEFAULT_PREFETCH_THREADS  = 8;
+  const static int64_t DEFAULT_PREFETCH_CACHE_MB = 64;
+  const static int64_t DEFAULT_MAX_RANGE_GAP     = 262144;
+
   bool SetRegion(const std::string& chrom, int32_t start, int32_t end);
 
   bool GetNextAlignment(BamAlignment& aln);
+
+  /*
+   * Fills ALNS with up to ALNS.size() of the next alignments, returning the number of alignments provided. Alignments are swapped
+   * with the cache, so the vector's records are recycled. When merging in file order, consecutive alignments are read directly
+   * from the file that's being merged without consulting the loser tree
+   */
+  int32_t GetNextAlignments(std::vector<BamAlignment>& alns);
+
+ private:
+  void AttachThreadPool(){
+    for (size_t i = 0; i < bam_readers_.size(); i++)
+      if (bam_readers_[i] != NULL && !bam_readers_[i]->SetThreadPool(&thread_pool_))
+	printErrorAndDie("Failed to attach the decompression thread pool to file " + paths_[i]);
+  }
 };
 
 
@@ -554,32 +1198,76 @@ class BamWriter {
  private:
   BGZF* output_;
 
+  // Instance variables for asynchronous mode, in which a dedicated thread adds the queued read group tags and writes the alignments
+  bool async_;
+  bool closing_;
+  size_t max_queued_;
+  std::deque< std::pair<BamAlignment, std::string> > queue_;
+  std::mutex mutex_;
+  std::condition_variable queue_not_empty_, queue_not_full_;
+  std::thread writer_thread_;
+
+  bool WriteAlignment(BamAlignment& aln, const std::string& rg_tag);
+
+  void ProcessQueue();
+
  public:
-  BamWriter(std::string& path, const BamHeader* bam_header){
+  /*
+   * Opens a BAM file using the provided zlib compression level (0-9), or the default level if it's negative.
+   * If BAM_HEADER is NULL, no header is written and the file is a fragment of BGZF blocks that's appended to another BAM
+   */
+  BamWriter(std::string& path, const BamHeader* bam_header, int compression_level = -1){
     std::string mode = "w";
+    if (compression_level >= 0)
+      mode += std::to_string(std::min(compression_level, 9));
     output_ = bgzf_open(path.c_str(), mode.c_str());
     if (output_ == NULL)
       printErrorAndDie("Failed to open BAM output file");
-    if (bam_hdr_write(output_, bam_header->header_) == -1)
+    if (bam_header != NULL && bam_hdr_write(output_, bam_header->header_) == -1)
       printErrorAndDie("Failed to write the BAM header to the output file");
+    async_      = false;
+    closing_    = false;
+    max_queued_ = 0;
   }
 
-  void Close(){
-    if (bgzf_close(output_) != 0)
-      printErrorAndDie("Failed to close BAM output file");
-    output_ = NULL;
+  // Compress BGZF blocks using the threads in the provided pool
+  bool SetThreadPool(htsThreadPool* pool){
+    return bgzf_thread_pool(output_, pool->pool, pool->qsize) == 0;
   }
 
+  // Compress BGZF blocks using NUM_THREADS threads owned by the output file
+  bool SetNumThreads(int num_threads){
+    return bgzf_mt(output_, num_threads, 256) == 0;
+  }
+
+  /*
+   * Return from SaveAlignment() and QueueAlignment() as soon as the alignment has been added to a queue of at most MAX_QUEUED
+   * alignments, which a dedicated thread writes in order. Must be called before any alignments are saved
+   */
+  void EnableAsyncWrites(size_t max_queued);
+
+  void Close();
+
   bool SaveAlignment(BamAlignment& aln){
-    if (output_ == NULL)
-      return false;
-    return (bam_write1(output_, aln.b_) != -1);
+    if (!async_)
+      return (output_ != NULL && bam_write1(output_, aln.b_) != -1);
+    BamAlignment copy(aln);
+    return QueueAlignment(copy, "");
   }
 
+  /*
+   * Takes ownership of the alignment's record and writes it after adding the provided RG tag (unless it's empty
+   * or the alignment already has one). In asynchronous mode, the tag is added by the writer thread
+   */
+  bool QueueAlignment(BamAlignment& aln, const std::string& rg_tag);
+
   ~BamWriter(){
     if (output_ != NULL)
-      bgzf_close(output_);
+      Close();
   }
+
+  BamWriter(const BamWriter&)            = delete;
+  BamWriter& operator=(const BamWriter&) = delete;
 };
 
 #endif
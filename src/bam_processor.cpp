@@ -1,15 +1,26 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <locale>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdlib.h>
+#include <thread>
 #include <time.h>
 
 #include "bam_processor.h"
+#include "alignment_batch.h"
 #include "alignment_filters.h"
 #include "error.h"
 #include "fasta_reader.h"
+#include "locus_cost.h"
+#include "numa_topology.h"
 #include "pcr_duplicates.h"
+#include "region_catalog.h"
 #include "stringops.h"
 #include "SeqAlignment/AlignmentOps.h"
 
@@ -42,7 +53,7 @@ void BamProcessor::add_filtered_alignment(BamAlignment& alignment, std::string f
 void BamProcessor::extract_mappings(BamAlignment& aln, const BamHeader* bam_header,
 				    std::vector< std::pair<std::string, int32_t> >& chrom_pos_pairs){
   assert(chrom_pos_pairs.size() == 0);
-  if (aln.RefID() == -1 || aln.CigarData().size() == 0)
+  if (aln.RefID() == -1 || aln.CigarView().empty())
     return;
   assert(aln.RefID() < bam_header->num_seqs());
   chrom_pos_pairs.push_back(std::pair<std::string, int32_t>(bam_header->ref_name(aln.RefID()), aln.Position()));
@@ -118,34 +129,13 @@ void BamProcessor::get_valid_pairings(BamAlignment& aln_1, BamAlignment& aln_2,
   }
 }
 
-std::string BamProcessor::get_read_group(BamAlignment& aln, std::map<std::string, std::string>& read_group_mapping){
-  std::string rg;
-  if (!aln.GetStringTag("RG", rg))
-    printErrorAndDie("Failed to retrieve BAM alignment's RG tag");
-  auto iter = read_group_mapping.find(aln.Filename() + rg);
-  if (iter == read_group_mapping.end())
-    printErrorAndDie("No sample found for read group " + rg + " in BAM file headers");
-  return iter->second;
-}
-
-std::string BamProcessor::trim_alignment_name(BamAlignment& aln){
-  std::string aln_name = aln.Name();
-  if (aln_name.size() > 2){
-    if (aln_name[aln_name.size()-2] == '/')
-      aln_name.resize(aln_name.size()-2);
-  }
-  return aln_name;
-}
-
-void BamProcessor::modify_and_write_alns(BamAlnList& alignments, std::map<std::string, std::string>& rg_to_sample,
-					 BamWriter* writer){
+void BamProcessor::modify_and_write_alns(BamAlnList& alignments, const ReadGroupIndex& read_groups, BamWriter* writer){
   for (auto read_iter = alignments.begin(); read_iter != alignments.end(); read_iter++){
-    // Add RG to BAM record based on file
-    if (!use_bam_rgs_){
-      std::string rg_tag = "HipSTR;" + rg_to_sample[read_iter->Filename()] + ";" + rg_to_sample[read_iter->Filename()];
-      read_iter->AddStringTag("RG", rg_tag);
-    }
-    if (!writer->SaveAlignment(*read_iter))
+    // Add RG to BAM record based on file. The writer adds the tag, so that it can do so on its own thread
+    std::string rg_tag;
+    if (!use_bam_rgs_)
+      rg_tag = "HipSTR;" + read_groups.file_sample(read_iter->FileIndex()) + ";" + read_groups.file_sample(read_iter->FileIndex());
+    if (!writer->QueueAlignment(*read_iter, rg_tag))
       printErrorAndDie("Failed to save alignment for STR-spanning read");
   }
 }
@@ -166,45 +156,79 @@ bool BamProcessor::spans_a_region(const std::vector<Region>& regions, BamAlignme
   return false;
 }
 
-void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, std::string& chrom_seq, RegionGroup& region_group,
-					 std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library, std::vector<std::string>& rg_names,
+ReadFilterCache::ReadFilter BamProcessor::apply_read_filters(BamAlignment& alignment){
+  // Ignore chimeric alignments
+  if (alignment.HasTag("SA"))
+    return ReadFilterCache::HAS_SA_TAG;
+  // Ignore reads with N bases
+  if (alignment.QueryBasesView().contains('N'))
+    return ReadFilterCache::HAS_N_BASES;
+  // Ignore reads with a very low overall base quality score
+  // Want to avoid situations in which it's more advantageous to have misalignments b/c the scores are so low
+  if (base_quality_.sum_log_prob_correct(alignment.QualitiesView()) < MIN_SUM_QUAL_LOG_PROB)
+    return ReadFilterCache::LOW_BASE_QUALS;
+  return ReadFilterCache::PASSES_READ_FILTERS;
+}
+
+bool BamProcessor::passes_end_filters(BamAlignment& alignment, const ReferenceSequence& chrom_seq){
+  // Ignore read if there is another location within MAXIMAL_END_MATCH_WINDOW bp for which it has a longer end match
+  if (MAXIMAL_END_MATCH_WINDOW > 0)
+    if (!AlignmentFilters::HasLargestEndMatches(alignment, chrom_seq.window(), chrom_seq.window_start(), MAXIMAL_END_MATCH_WINDOW, MAXIMAL_END_MATCH_WINDOW))
+      return false;
+  // Ignore read if it doesn't match perfectly for at least MIN_READ_END_MATCH bases on each end
+  if (MIN_READ_END_MATCH > 0){
+    std::pair<int,int> match_lens = AlignmentFilters::GetNumEndMatches(alignment, chrom_seq.window(), chrom_seq.window_start());
+    if (match_lens.first < MIN_READ_END_MATCH || match_lens.second < MIN_READ_END_MATCH)
+      return false;
+  }
+  // Ignore read if there is an indel within the first MIN_BP_BEFORE_INDEL bps from each end
+  if (MIN_BP_BEFORE_INDEL > 0){
+    std::pair<int, int> num_bps = AlignmentFilters::GetEndDistToIndel(alignment);
+    if ((num_bps.first != -1 && num_bps.first < MIN_BP_BEFORE_INDEL) || (num_bps.second != -1 && num_bps.second < MIN_BP_BEFORE_INDEL))
+      return false;
+  }
+  return true;
+}
+
+void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, const ReferenceSequence& chrom_seq, RegionGroup& region_group,
+					 const ReadGroupIndex& read_groups, std::vector<std::string>& rg_names,
 					 std::vector<BamAlnList>& paired_strs_by_rg, std::vector<BamAlnList>& mate_pairs_by_rg, std::vector<BamAlnList>& unpaired_strs_by_rg,
 					 BamWriter* pass_writer, BamWriter* filt_writer){
-  locus_read_filter_time_ = clock();
+  TraceScope filter_trace("read_and_filter_reads");
+  ScopedTimer filter_timer(locus_timer_, PHASE_READ_FILTER);
   assert(reader.get_merge_type() == BamCramMultiReader::ORDER_ALNS_BY_FILE);
 
   bool pass_to_bam     = (pass_writer != NULL);
   bool filtered_to_bam = (filt_writer != NULL);
   BamAlnList region_alignments, filtered_alignments;
   int32_t read_count = 0, not_spanning = 0, unique_mapping = 0, read_has_N = 0, hard_clip = 0, split_alignment = 0, low_qual_score = 0, num_filt_unpaired_reads = 0;
-  BamAlignment alignment;
   const BamHeader* bam_header = reader.bam_header();
   BamAlnList paired_str_alns, mate_alns, unpaired_str_alns;
-  std::map<std::string, BamAlignment> potential_strs, potential_mates;
+  ReadPairTable potential_strs, potential_mates;
   TOO_MANY_READS = false;
 
   const std::vector<Region>& regions = region_group.regions();
   std::string prev_file = "";
-  while (reader.GetNextAlignment(alignment)){
-    // Discard reads that don't overlap the STR region and whose mate pair has no chance of overlapping the region
-    if (alignment.Position() > region_group.stop() || alignment.GetEndPosition() < region_group.start()){
-      if (!alignment.IsPaired() || alignment.MatePosition() == alignment.Position())
-	continue;
-      if (alignment.MatePosition() > region_group.stop())
-	continue;
-      if (alignment.MatePosition()+alignment.Length()+100 < region_group.start())
-	continue;
-    }
+  int64_t prev_cache_hits = 0;
+  if (read_filter_cache_){
+    read_filter_cache_->advance(region_group.chrom(), region_group.start() < MAX_MATE_DIST ? 0 : region_group.start()-MAX_MATE_DIST);
+    prev_cache_hits = read_filter_cache_->num_hits();
+  }
 
+  // Reads that don't overlap the STR region and whose mate pair has no chance of overlapping the region are discarded
+  // in batches, as are unmapped reads and reads without bases or CIGAR operations
+  AlignmentBatch batch(region_group.start(), region_group.stop());
+  BamAlignment* next_alignment;
+  while ((next_alignment = batch.next_alignment(reader)) != NULL){
     // Stop parsing reads if we've already exceeded the maximum number for downstream analyses
-    if (paired_str_alns.size() > MAX_TOTAL_READS){
+    // When downsampling, the limit is instead applied once each sample's reads have been downsampled
+    if (MAX_SAMPLE_DEPTH <= 0 && paired_str_alns.size() > MAX_TOTAL_READS){
       TOO_MANY_READS = true;
       break;
     }
 
-    if (!alignment.IsMapped() || alignment.Position() == 0 || alignment.CigarData().size() == 0 || alignment.Length() == 0)
-	continue;
-    assert(alignment.CigarData().size() > 0 && alignment.RefID() != -1);
+    BamAlignment& alignment = *next_alignment;
+    assert(!alignment.CigarView().empty() && alignment.RefID() != -1);
 
     // If requested, trim any reads that potentially overlap the STR regions
     if (alignment.Position() < region_group.stop() && alignment.GetEndPosition() >= region_group.start()){
@@ -239,19 +263,20 @@ void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, std::string
       std::string filter = "";
       read_count++;
 
-      // Ignore chimeric alignments
-      if (alignment.HasTag("SA")){
+      ReadFilterCache::Entry* cache_entry = (read_filter_cache_ ? read_filter_cache_->find(alignment) : NULL);
+      if (read_filter_cache_ && cache_entry == NULL)
+	cache_entry = read_filter_cache_->insert(alignment, apply_read_filters(alignment));
+      ReadFilterCache::ReadFilter read_filter = (cache_entry != NULL ? cache_entry->read_filter : apply_read_filters(alignment));
+
+      if (read_filter == ReadFilterCache::HAS_SA_TAG){
 	split_alignment++;
 	filter.append("HAS_SA_TAG");
       }
-      // Ignore reads with N bases
-      else if (alignment.QueryBases().find('N') != std::string::npos){
+      else if (read_filter == ReadFilterCache::HAS_N_BASES){
 	read_has_N++;
 	filter.append("HAS_N_BASES");
       }
-      // Ignore reads with a very low overall base quality score
-      // Want to avoid situations in which it's more advantageous to have misalignments b/c the scores are so low
-      else if (base_quality_.sum_log_prob_correct(alignment.Qualities()) < MIN_SUM_QUAL_LOG_PROB){
+      else if (read_filter == ReadFilterCache::LOW_BASE_QUALS){
 	low_qual_score++;
 	filter.append("LOW_BASE_QUALS");
       }
@@ -269,54 +294,42 @@ void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, std::string
 	  if ((MIN_FLANK > 0) && (alignment.Position() > (region_iter->start()-MIN_FLANK) || alignment.GetEndPosition() < (region_iter->stop()+MIN_FLANK)))
 	    continue;
 
-	  // Ignore read if there is another location within MAXIMAL_END_MATCH_WINDOW bp for which it has a longer end match
-	  if (MAXIMAL_END_MATCH_WINDOW > 0){
-	    bool maximum_end_matches = AlignmentFilters::HasLargestEndMatches(alignment, chrom_seq, 0, MAXIMAL_END_MATCH_WINDOW, MAXIMAL_END_MATCH_WINDOW);
-	    if (!maximum_end_matches){
-	      pass_two = std::string(regions.size(), '0');
-	      break;
-	    }
-	  }
-	  // Ignore read if it doesn't match perfectly for at least MIN_READ_END_MATCH bases on each end
-	  if (MIN_READ_END_MATCH > 0){
-	    std::pair<int,int> match_lens = AlignmentFilters::GetNumEndMatches(alignment, chrom_seq, 0);
-	    if (match_lens.first < MIN_READ_END_MATCH || match_lens.second < MIN_READ_END_MATCH){
-	      pass_two = std::string(regions.size(), '0');
-	      break;
-	    }
+	  bool end_filters_pass;
+	  if (cache_entry != NULL && cache_entry->end_filters != -1)
+	    end_filters_pass = (cache_entry->end_filters == 1);
+	  else {
+	    end_filters_pass = passes_end_filters(alignment, chrom_seq);
+	    if (cache_entry != NULL)
+	      cache_entry->end_filters = (end_filters_pass ? 1 : 0);
 	  }
-	  // Ignore read if there is an indel within the first MIN_BP_BEFORE_INDEL bps from each end
-	  if (MIN_BP_BEFORE_INDEL > 0){
-	    std::pair<int, int> num_bps = AlignmentFilters::GetEndDistToIndel(alignment);
-	    if ((num_bps.first != -1 && num_bps.first < MIN_BP_BEFORE_INDEL) || (num_bps.second != -1 && num_bps.second < MIN_BP_BEFORE_INDEL)){
-	      pass_two = std::string(regions.size(), '0');
-	      break;
-	    }
+	  if (!end_filters_pass){
+	    pass_two = std::string(regions.size(), '0');
+	    break;
 	  }
 	  pass_two[region_index] = '1';
 	}
       }
 
-      std::string aln_key = trim_alignment_name(alignment);
       if (pass_one){
 	add_passes_filters_tag(alignment, pass_two);
-	auto aln_iter = potential_mates.find(aln_key);
-	if (aln_iter != potential_mates.end()){
-	  if (alignment.IsFirstMate() == aln_iter->second.IsFirstMate()){
-	    potential_mates.erase(aln_iter);
-	    potential_strs.insert(std::pair<std::string, BamAlignment>(aln_key, alignment));
+	int32_t mate_index = potential_mates.find(alignment);
+	if (mate_index != -1){
+	  BamAlignment& mate = potential_mates.get(mate_index);
+	  if (alignment.IsFirstMate() == mate.IsFirstMate()){
+	    potential_mates.erase(mate_index);
+	    potential_strs.insert(std::move(alignment));
 	    continue;
 	  }
 
 	  std::vector< std::pair<std::string, int32_t> > p_1, p_2;
-	  get_valid_pairings(alignment, aln_iter->second, bam_header, p_1, p_2);
+	  get_valid_pairings(alignment, mate, bam_header, p_1, p_2);
 	  if (p_1.size() == 1 && p_1[0].second == alignment.Position()){
-	    paired_str_alns.push_back(alignment);
-	    mate_alns.push_back(aln_iter->second);
 	    if (pass_to_bam){
 	      region_alignments.push_back(alignment);
-	      region_alignments.push_back(aln_iter->second);
+	      region_alignments.push_back(mate);
 	    }
+	    paired_str_alns.push_back(std::move(alignment));
+	    mate_alns.push_back(std::move(mate));
 	  }
 	  else {
 	    unique_mapping++;
@@ -324,90 +337,98 @@ void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, std::string
 	    if (filtered_to_bam)
 	      add_filtered_alignment(alignment, filter, filtered_alignments);
 	  }
-	  potential_mates.erase(aln_iter);
+	  potential_mates.erase(mate_index);
 	}
 	else {
 	  // Check if read's mate pair also overlaps the STR
-	  auto str_iter = potential_strs.find(aln_key);
-	  if (str_iter != potential_strs.end()){
-	    if (alignment.IsFirstMate() == str_iter->second.IsFirstMate()){
+	  int32_t str_index = potential_strs.find(alignment);
+	  if (str_index != -1){
+	    BamAlignment& str_mate = potential_strs.get(str_index);
+	    if (alignment.IsFirstMate() == str_mate.IsFirstMate()){
 	      read_count--;
 	      continue;
 	    }
 
 	    std::vector< std::pair<std::string, int32_t> > p_1, p_2;
-	    get_valid_pairings(alignment, str_iter->second, bam_header, p_1, p_2);
+	    get_valid_pairings(alignment, str_mate, bam_header, p_1, p_2);
 	    if (p_1.size() == 1 && p_1[0].second == alignment.Position()){
 	      paired_str_alns.push_back(alignment);
-	      mate_alns.push_back(str_iter->second);
-	      if (pass_to_bam) region_alignments.push_back(alignment);
+	      mate_alns.push_back(str_mate);
+	      if (pass_to_bam){
+		region_alignments.push_back(alignment);
+		region_alignments.push_back(str_mate);
+	      }
 
-	      paired_str_alns.push_back(str_iter->second);
-	      mate_alns.push_back(alignment);
-	      if (pass_to_bam) region_alignments.push_back(str_iter->second);
+	      // Both records are no longer needed, so their final copies can be moved
+	      paired_str_alns.push_back(std::move(str_mate));
+	      mate_alns.push_back(std::move(alignment));
 	    }
 	    else {
 	      unique_mapping += 2;
 	      std::string filter = "NO_UNIQUE_MAPPING";
 	      if (filtered_to_bam){
 		add_filtered_alignment(alignment, filter, filtered_alignments);
-		add_filtered_alignment(str_iter->second, filter, filtered_alignments);
+		add_filtered_alignment(str_mate, filter, filtered_alignments);
 	      }
 	    }
-	    potential_strs.erase(str_iter);
+	    potential_strs.erase(str_index);
 	  }
 	  else
-	    potential_strs.insert(std::pair<std::string, BamAlignment>(aln_key, alignment));
+	    potential_strs.insert(std::move(alignment));
 	}
       }
       else {
 	assert(!filter.empty());
 	if (filtered_to_bam)
 	  add_filtered_alignment(alignment, filter, filtered_alignments);
-	potential_mates.insert(std::pair<std::string, BamAlignment>(aln_key, alignment));
+	potential_mates.insert(std::move(alignment));
       }
     }
     else {
-      std::string aln_key = trim_alignment_name(alignment);
-      auto aln_iter = potential_strs.find(aln_key);
-      if (aln_iter != potential_strs.end()){
-	if (alignment.IsFirstMate() == aln_iter->second.IsFirstMate())
+      int32_t str_index = potential_strs.find(alignment);
+      if (str_index != -1){
+	BamAlignment& str_aln = potential_strs.get(str_index);
+	if (alignment.IsFirstMate() == str_aln.IsFirstMate())
 	  continue;
 
 	std::vector< std::pair<std::string, int32_t> > p_1, p_2;
-	get_valid_pairings(aln_iter->second, alignment, bam_header, p_1, p_2);
-	if (p_1.size() == 1 && p_1[0].second == aln_iter->second.Position()){
-	  paired_str_alns.push_back(aln_iter->second);
-	  mate_alns.push_back(alignment);
+	get_valid_pairings(str_aln, alignment, bam_header, p_1, p_2);
+	if (p_1.size() == 1 && p_1[0].second == str_aln.Position()){
 	  if (pass_to_bam){
-	    region_alignments.push_back(aln_iter->second);
+	    region_alignments.push_back(str_aln);
 	    region_alignments.push_back(alignment);
 	  }
+	  paired_str_alns.push_back(std::move(str_aln));
+	  mate_alns.push_back(std::move(alignment));
 	}
 	else {
 	  unique_mapping++;
 	  std::string filter = "NO_UNIQUE_MAPPING";
 	  if (filtered_to_bam)
-	    add_filtered_alignment(aln_iter->second, filter, filtered_alignments);
+	    add_filtered_alignment(str_aln, filter, filtered_alignments);
 	}
-	potential_strs.erase(aln_iter);
+	potential_strs.erase(str_index);
       }
       else {
-	auto other_iter = potential_mates.find(aln_key);
-	if (other_iter != potential_mates.end()){
-	  if (alignment.IsFirstMate() == other_iter->second.IsFirstMate())
+	int32_t other_index = potential_mates.find(alignment);
+	if (other_index != -1){
+	  if (alignment.IsFirstMate() == potential_mates.get(other_index).IsFirstMate())
 	    continue;
-	  potential_mates.erase(other_iter);
+	  potential_mates.erase(other_index);
 	}
 	else
-	  potential_mates.insert(std::pair<std::string, BamAlignment>(aln_key, alignment));
+	  potential_mates.insert(std::move(alignment));
       }
     }
   }
 
-  for (auto aln_iter = potential_strs.begin(); aln_iter != potential_strs.end(); ++aln_iter){
+  // Process the unpaired STR reads in order of their names
+  std::vector<int32_t> unpaired_indices;
+  potential_strs.sorted_indices(unpaired_indices);
+  for (auto index_iter = unpaired_indices.begin(); index_iter != unpaired_indices.end(); ++index_iter){
+    BamAlignment& str_aln = potential_strs.get(*index_iter);
     std::string filter = "";
-    if (aln_iter->second.HasTag(ALT_MAP_TAG.c_str())){
+    if (str_aln.HasTag(ALT_MAP_TAG.c_str())){
       unique_mapping++;
       filter = "NO_UNIQUE_MAPPING";
     }
@@ -417,16 +438,22 @@ void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, std::string
     }
 
     if (filter.empty()){
-      unpaired_str_alns.push_back(aln_iter->second);
-      if (pass_to_bam) region_alignments.push_back(aln_iter->second);
+      if (pass_to_bam) region_alignments.push_back(str_aln);
+      unpaired_str_alns.push_back(std::move(str_aln));
     }
     else {
       if (filtered_to_bam)
-	add_filtered_alignment(aln_iter->second, filter, filtered_alignments);
+	add_filtered_alignment(str_aln, filter, filtered_alignments);
     }
   }
   potential_strs.clear(); potential_mates.clear();
-  
+  if (io_only_){
+    io_stats_.num_fetched += batch.num_fetched();
+    io_stats_.num_bytes   += batch.num_bytes();
+  }
+
+  logger() << "Discarded " << batch.num_distant() << " reads that couldn't overlap the region and " << batch.num_unusable()
+	   << " unmapped or empty reads" << "\n";
   logger() << read_count << " reads overlapped region, of which "
 	   << "\n\t" << hard_clip        << " were hard clipped"
 	   << "\n\t" << split_alignment  << " had an SA (split alignment) BAM tag"
@@ -436,136 +463,919 @@ void BamProcessor::read_and_filter_reads(BamCramMultiReader& reader, std::string
 	   << "\n\t" << unique_mapping   << " did not have a unique mapping";
   if (REQUIRE_PAIRED_READS)
     logger() << "\n\t" << num_filt_unpaired_reads << " did not have a mate pair";
+  if (read_filter_cache_)
+    logger() << "\n\t" << (read_filter_cache_->num_hits() - prev_cache_hits) << " reused the filter results from a nearby region";
   logger() << "\n\t" << (paired_str_alns.size()+unpaired_str_alns.size()) << " PASSED ALL FILTERS" << "\n"
 	   << "Found " << paired_str_alns.size() << " fully paired reads and " << unpaired_str_alns.size() << " unpaired reads for downstream analyses" << std::endl;
     
   // Output the reads passing all filters to a BAM file (if requested)
   if (pass_writer != NULL)
-    modify_and_write_alns(region_alignments, rg_to_sample, pass_writer);
+    modify_and_write_alns(region_alignments, read_groups, pass_writer);
 
   // Output reads that overlapped the STR but were filtered to a BAM file (if requested)
   if (filt_writer != NULL)
-    modify_and_write_alns(filtered_alignments, rg_to_sample, filt_writer);
+    modify_and_write_alns(filtered_alignments, read_groups, filt_writer);
 
-  // Separate the reads based on their associated read groups
-  std::map<std::string, int> rg_indices;
+  // Separate the reads based on their associated samples, which are indexed in the order they're first encountered
+  std::vector<int> rg_indices(read_groups.num_samples(), -1);
   for (unsigned int type = 0; type < 2; ++type){
     BamAlnList& aln_src  = (type == 0 ? paired_str_alns : unpaired_str_alns);
     for (unsigned int i = 0; i < aln_src.size(); ++i){
-      std::string rg = use_bam_rgs_ ? get_read_group(aln_src[i], rg_to_sample): rg_to_sample[aln_src[i].Filename()];
-      int rg_index;
-      auto index_iter = rg_indices.find(rg);
-      if (index_iter == rg_indices.end()){
-	rg_index = rg_indices.size();
-	rg_indices[rg] = rg_index;
-	rg_names.push_back(rg);
+      int32_t sample_id = read_groups.sample_id(aln_src[i]);
+      int rg_index      = rg_indices[sample_id];
+      if (rg_index == -1){
+	rg_index = rg_indices[sample_id] = rg_names.size();
+	rg_names.push_back(read_groups.sample_name(sample_id));
 	paired_strs_by_rg.push_back(BamAlnList());
 	unpaired_strs_by_rg.push_back(BamAlnList());
 	mate_pairs_by_rg.push_back(BamAlnList());
       }
-      else
-	rg_index = index_iter->second;
 
-      // Record STR read and its mate pair
+      // Record STR read and its mate pair. The source lists are discarded afterwards, so the reads can be moved
       if (type == 0){
-	paired_strs_by_rg[rg_index].push_back(aln_src[i]);
-	mate_pairs_by_rg[rg_index].push_back(mate_alns[i]);
+	paired_strs_by_rg[rg_index].push_back(std::move(aln_src[i]));
+	mate_pairs_by_rg[rg_index].push_back(std::move(mate_alns[i]));
       }
       // Record unpaired STR read
       else
-	unpaired_strs_by_rg[rg_index].push_back(aln_src[i]);
+	unpaired_strs_by_rg[rg_index].push_back(std::move(aln_src[i]));
+    }
+  }
+}
+
+void BamProcessor::downsample_reads(std::vector<BamAlnList>& paired_strs_by_rg, std::vector<BamAlnList>& mate_pairs_by_rg,
+				    std::vector<BamAlnList>& unpaired_strs_by_rg, std::vector<std::string>& rg_names){
+  int64_t total_removed = 0;
+  for (unsigned int i = 0; i < rg_names.size(); i++){
+    BamAlnList& paired_strs = paired_strs_by_rg[i];
+    BamAlnList& mate_pairs  = mate_pairs_by_rg[i];
+    BamAlnList& unpaired    = unpaired_strs_by_rg[i];
+    size_t num_reads = paired_strs.size() + unpaired.size();
+    if (num_reads <= (size_t)MAX_SAMPLE_DEPTH)
+      continue;
+
+    // Order the reads by the hash of their names, so that both STR reads of a pair are retained or discarded together
+    // and the selected reads don't depend on the order in which the reads were parsed
+    std::vector< std::pair<uint64_t, std::string> > keys(num_reads);
+    std::vector<size_t> order(num_reads);
+    for (size_t j = 0; j < num_reads; j++){
+      const char* name = (j < paired_strs.size() ? paired_strs[j] : unpaired[j-paired_strs.size()]).NameChars();
+      size_t len       = ReadPairTable::key_length(name);
+      keys[j]          = std::pair<uint64_t, std::string>(ReadPairTable::hash_key(name, len), std::string(name, len));
+      order[j]         = j;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){ return keys[a] < keys[b]; });
+
+    std::vector<bool> keep(num_reads, false);
+    size_t num_kept = 0;
+    for (size_t j = 0; j < num_reads && num_kept < (size_t)MAX_SAMPLE_DEPTH; ){
+      size_t k = j;
+      while (k < num_reads && keys[order[k]] == keys[order[j]]){
+	keep[order[k]] = true;
+	k++;
+      }
+      num_kept += k-j;
+      j = k;
     }
+
+    // Compact the retained reads, preserving their original order
+    size_t ins_index = 0;
+    for (size_t j = 0; j < paired_strs.size(); j++){
+      if (!keep[j])
+	continue;
+      if (j != ins_index){
+	paired_strs[ins_index] = std::move(paired_strs[j]);
+	mate_pairs[ins_index]  = std::move(mate_pairs[j]);
+      }
+      ins_index++;
+    }
+    size_t num_paired = paired_strs.size();
+    paired_strs.resize(ins_index);
+    mate_pairs.resize(ins_index);
+    ins_index = 0;
+    for (size_t j = 0; j < unpaired.size(); j++){
+      if (!keep[num_paired+j])
+	continue;
+      if (j != ins_index)
+	unpaired[ins_index] = std::move(unpaired[j]);
+      ins_index++;
+    }
+    unpaired.resize(ins_index);
+    total_removed += num_reads - num_kept;
   }
 
-  locus_read_filter_time_  = (clock() - locus_read_filter_time_)/CLOCKS_PER_SEC;
-  total_read_filter_time_ += locus_read_filter_time_;
+  if (total_removed > 0)
+    logger() << "Downsampled samples to a maximum depth of " << MAX_SAMPLE_DEPTH << " reads by removing " << total_removed << " reads" << std::endl;
 }
 
-void BamProcessor::process_regions(BamCramMultiReader& reader, std::string& region_file, std::string& fasta_dir,
-				   std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library,
-				   BamWriter* pass_writer, BamWriter* filt_writer,
-				   std::ostream& out, int32_t max_regions, std::string chrom){
-  std::vector<Region> regions;
-  readRegions(region_file, regions, max_regions, chrom, logger());
-  orderRegions(regions);
+void BamProcessor::init_worker(const BamProcessor& parent){
+  use_bam_rgs_             = parent.use_bam_rgs_;
+  rem_pcr_dups_            = parent.rem_pcr_dups_;
+  bams_from_10x_           = parent.bams_from_10x_;
+  sample_set_              = parent.sample_set_;
+  read_store_in_           = parent.read_store_in_;
+  if (parent.read_filter_cache_)
+    reuse_read_filters();
+  read_store_out_          = parent.read_store_out_;
+  MAX_MATE_DIST            = parent.MAX_MATE_DIST;
+  MIN_BP_BEFORE_INDEL      = parent.MIN_BP_BEFORE_INDEL;
+  MIN_FLANK                = parent.MIN_FLANK;
+  MIN_READ_END_MATCH       = parent.MIN_READ_END_MATCH;
+  MAXIMAL_END_MATCH_WINDOW = parent.MAXIMAL_END_MATCH_WINDOW;
+  MAX_STR_LENGTH           = parent.MAX_STR_LENGTH;
+  REQUIRE_SPANNING         = parent.REQUIRE_SPANNING;
+  REQUIRE_PAIRED_READS     = parent.REQUIRE_PAIRED_READS;
+  MIN_SUM_QUAL_LOG_PROB    = parent.MIN_SUM_QUAL_LOG_PROB;
+  MAX_TOTAL_READS          = parent.MAX_TOTAL_READS;
+  MAX_SAMPLE_DEPTH         = parent.MAX_SAMPLE_DEPTH;
+  BASE_QUAL_TRIM           = parent.BASE_QUAL_TRIM;
+  skip_failed_loci_        = parent.skip_failed_loci_;
+  locus_timeout_           = parent.locus_timeout_;
+  io_only_                 = parent.io_only_;
+  debug_sampler_           = parent.debug_sampler_;
+  num_threads_             = 1;
+  log_to_buffer_           = true;
+  log_level_               = parent.log_level_;
+  metrics_                 = parent.metrics_;
+}
 
-  FastaReader fasta_reader(fasta_dir);
-  std::string ref_seq;
-  const BamHeader* bam_header = reader.bam_header();
-  int cur_chrom_id = -1; std::string chrom_seq;
-  for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++){
-    logger() << "\n\n" << "Processing region " << region_iter->chrom() << " " << region_iter->start() << " " << region_iter->stop() << std::endl;
-    int chrom_id = bam_header->ref_id(region_iter->chrom());
-    if (chrom_id == -1 && region_iter->chrom().size() > 3 && region_iter->chrom().substr(0, 3).compare("chr") == 0)
-      chrom_id = bam_header->ref_id(region_iter->chrom().substr(3));
-
-    if (chrom_id == -1){
-      logger() << "\n" << "WARNING: No reference sequence for chromosome " << region_iter->chrom() << " found in BAMs"  << "\n"
-	       << "\t" << "Please ensure that the names of reference sequences in your BED file match those in you BAMs" << "\n"
-	       << "\t" << "Skipping region " << region_iter->chrom() << " " << region_iter->start() << " " << region_iter->stop() << "\n" << std::endl;
-      continue;
+bool BamProcessor::reference_loaded(const Region& region, int chrom_id, int cur_chrom_id, const ReferenceSequence& chrom_seq){
+  if (cur_chrom_id != chrom_id)
+    return false;
+  if (!ref_windows_)
+    return true;
+  int32_t pad = MAX_MATE_DIST + REF_WINDOW_FLANK;
+  return chrom_seq.contains(std::max(0, region.start()-pad), std::min(chrom_seq.size(), region.stop()+pad));
+}
+
+void BamProcessor::load_reference(FastaReader& fasta_reader, const Region& region, int chrom_id, int& cur_chrom_id, ReferenceSequence& chrom_seq){
+  if (reference_loaded(region, chrom_id, cur_chrom_id, chrom_seq))
+    return;
+  std::string chrom = region.chrom();
+  if (!ref_windows_){
+    fasta_reader.get_sequence(chrom, chrom_seq);
+    assert(chrom_seq.size() != 0);
+    cur_chrom_id = chrom_id;
+    return;
+  }
+
+  int32_t pad = MAX_MATE_DIST + REF_WINDOW_FLANK;
+  fasta_reader.get_window(chrom, region.start()-pad, region.stop()+pad+REF_WINDOW_REUSE, chrom_seq);
+  assert(chrom_seq.size() != 0);
+  cur_chrom_id = chrom_id;
+}
+
+std::unique_ptr<ReferencePrefetcher> BamProcessor::open_ref_prefetcher(const std::string& fasta_dir){
+  if (!prefetch_chroms_ || ref_windows_)
+    return std::unique_ptr<ReferencePrefetcher>();
+  return std::unique_ptr<ReferencePrefetcher>(new ReferencePrefetcher(fasta_dir, packed_ref_path_));
+}
+
+void BamProcessor::prefetch_next_chrom(ReferencePrefetcher& prefetcher, const std::vector<RegionGroup>& region_groups, size_t group_index){
+  const std::string& chrom = region_groups[group_index].chrom();
+  for (size_t next_index = group_index+1; next_index < region_groups.size(); next_index++){
+    if (region_groups[next_index].chrom().compare(chrom) != 0){
+      prefetcher.prefetch(region_groups[next_index].chrom());
+      return;
     }
+  }
+}
+
+bool BamProcessor::check_region(const RegionGroup& region_group, const BamHeader* bam_header, int& chrom_id){
+  Region region = region_group.span();
+  logger() << "\n\n" << "Processing region " << region.chrom() << " " << region.start() << " " << region.stop() << std::endl;
+  chrom_id = bam_header->ref_id(region.chrom());
+  if (chrom_id == -1 && region.chrom().size() > 3 && region.chrom().substr(0, 3).compare("chr") == 0)
+    chrom_id = bam_header->ref_id(region.chrom().substr(3));
 
+  if (chrom_id == -1){
+    logger() << "\n" << "WARNING: No reference sequence for chromosome " << region.chrom() << " found in BAMs"  << "\n"
+	     << "\t" << "Please ensure that the names of reference sequences in your BED file match those in you BAMs" << "\n"
+	     << "\t" << "Skipping region " << region.chrom() << " " << region.start() << " " << region.stop() << "\n" << std::endl;
+    return false;
+  }
+
+  // The length threshold applies to each STR in the group rather than to the span of the group
+  for (auto region_iter = region_group.regions().begin(); region_iter != region_group.regions().end(); region_iter++){
     if (region_iter->stop() - region_iter->start() > MAX_STR_LENGTH){
       logger() << "Skipping region as the reference allele length exceeds the threshold (" << region_iter->stop()-region_iter->start() << " vs " << MAX_STR_LENGTH << ")" << "\n"
 	       << "You can increase this threshold using the --max-str-length option" << std::endl;
-      continue;
-    }
-    
-    // Read FASTA sequence for chromosome 
-    if (cur_chrom_id != chrom_id){
-      cur_chrom_id      = chrom_id;
-      std::string chrom = region_iter->chrom();
-      fasta_reader.get_sequence(chrom, chrom_seq);
-      assert(chrom_seq.size() != 0);
+      return false;
     }
+  }
+  return true;
+}
 
-    if (region_iter->start() < 50 || region_iter->stop()+50 >= chrom_seq.size()){
-      logger() << "Skipping region within 50bp of the end of the contig" << std::endl;
-      continue;
+void BamProcessor::restrict_to_sample_set(std::vector<std::string>& rg_names, std::vector<BamAlnList>& paired_strs_by_rg,
+					  std::vector<BamAlnList>& mate_pairs_by_rg, std::vector<BamAlnList>& unpaired_strs_by_rg){
+  if (sample_set_.empty())
+    return;
+  logger() << "Restricting reads to the " << sample_set_.size() << " samples in the specified sample list" << std::endl;
+  unsigned int ins_index = 0;
+  for (unsigned int i = 0; i < rg_names.size(); i++){
+    if (sample_set_.find(rg_names[i]) != sample_set_.end()){
+      if (i != ins_index){
+	rg_names[ins_index]            = std::move(rg_names[i]);
+	paired_strs_by_rg[ins_index]   = std::move(paired_strs_by_rg[i]);
+	mate_pairs_by_rg[ins_index]    = std::move(mate_pairs_by_rg[i]);
+	unpaired_strs_by_rg[ins_index] = std::move(unpaired_strs_by_rg[i]);
+      }
+      ins_index++;
     }
+  }
+  if (ins_index != rg_names.size()){
+    rg_names.resize(ins_index);
+    paired_strs_by_rg.resize(ins_index);
+    mate_pairs_by_rg.resize(ins_index);
+    unpaired_strs_by_rg.resize(ins_index);
+  }
+}
+
+int64_t BamProcessor::count_reads(const std::vector<BamAlnList>& paired_strs_by_rg, const std::vector<BamAlnList>& mate_pairs_by_rg,
+				  const std::vector<BamAlnList>& unpaired_strs_by_rg){
+  int64_t num_reads = 0;
+  for (unsigned int i = 0; i < paired_strs_by_rg.size(); i++)
+    num_reads += paired_strs_by_rg[i].size() + mate_pairs_by_rg[i].size() + unpaired_strs_by_rg[i].size();
+  return num_reads;
+}
+
+void BamProcessor::record_reads(const std::vector<BamAlnList>& paired_strs_by_rg, const std::vector<BamAlnList>& mate_pairs_by_rg,
+				const std::vector<BamAlnList>& unpaired_strs_by_rg){
+  if (progress_ == NULL && metrics_ == NULL)
+    return;
+  int64_t num_reads = count_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+  if (progress_ != NULL)
+    progress_->add_reads(num_reads);
+  if (metrics_ != NULL)
+    metrics_->add_reads(num_reads);
+}
+
+bool BamProcessor::near_contig_end(const Region& region, const ReferenceSequence& chrom_seq){
+  if (region.start() < 50 || region.stop()+50 >= chrom_seq.size()){
+    logger() << "Skipping region within 50bp of the end of the contig" << std::endl;
+    return true;
+  }
+  return false;
+}
+
+void BamProcessor::prepare_reads(BamCramMultiReader& reader, RegionGroup& region_group, int chrom_id, const ReferenceSequence& chrom_seq,
+				 const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, PreparedLocus& locus){
+  // The reads for all of the group's regions are extracted, filtered and stored using the region spanning the group
+  Region region = region_group.span();
+  locus_timer_.clear();
+  debug_locus_ = debug_sampler_.select(region_group.chrom(), region_group.start(), region_group.stop());
+  std::vector<std::string>& rg_names = locus.rg_names;
+  std::vector<BamAlnList>& paired_strs_by_rg   = locus.paired_strs_by_rg;
+  std::vector<BamAlnList>& mate_pairs_by_rg    = locus.mate_pairs_by_rg;
+  std::vector<BamAlnList>& unpaired_strs_by_rg = locus.unpaired_strs_by_rg;
+
+  // Reads from a previous run were already filtered and deduplicated, so we can proceed directly to analyzing them
+  if (read_store_in_ && read_store_in_->read_locus(region, TOO_MANY_READS, rg_names, paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg)){
+    logger() << "Loaded the reads for " << rg_names.size() << " samples from the STR read store" << std::endl;
+    restrict_to_sample_set(rg_names, paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+    record_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+    locus.debug_locus    = debug_locus_;
+    locus.too_many_reads = TOO_MANY_READS;
+    locus.timer          = locus_timer_;
+    return;
+  }
+
+  const BamHeader* bam_header = reader.bam_header();
+  if (io_only_ && !reader.seek_timing())
+    reader.EnableSeekTiming();
+  ScopedTimer seek_timer(locus_timer_, PHASE_BAM_SEEK);
+  TraceScope seek_trace("bam_seek");
+  if (!reader.SetRegion(bam_header->ref_name(chrom_id), (region.start() < MAX_MATE_DIST ? 0: region.start()-MAX_MATE_DIST),
+			region.stop() + MAX_MATE_DIST))
+    printErrorAndDie("One or more BAM files failed to set the region properly");
+
+  seek_timer.stop();
+  seek_trace.stop();
+  if (io_only_)
+    io_stats_.add_seeks(reader.paths(), reader.SeekTimes(), region.str());
+
+  read_and_filter_reads(reader, chrom_seq, region_group, read_groups, rg_names,
+			paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg,
+			(debug_locus_ ? pass_writer : NULL), (debug_locus_ ? filt_writer : NULL));
+  restrict_to_sample_set(rg_names, paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+
+  if (MAX_SAMPLE_DEPTH > 0){
+    TraceScope downsample_trace("downsample_reads");
+    downsample_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg, rg_names);
+    size_t num_paired = 0;
+    for (unsigned int i = 0; i < paired_strs_by_rg.size(); i++)
+      num_paired += paired_strs_by_rg[i].size();
+    TOO_MANY_READS = (num_paired > MAX_TOTAL_READS);
+  }
+
+  record_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+
+  if (rem_pcr_dups_){
+    TraceScope rmdup_trace("remove_pcr_duplicates");
+    double dedup_start = (io_only_ ? ProcessTimer::wall_clock() : 0);
+    if (io_only_)
+      io_stats_.num_dedup += count_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+    remove_pcr_duplicates(base_quality_, read_groups, paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg, logger());
+    if (io_only_)
+      io_stats_.dedup_time += ProcessTimer::wall_clock() - dedup_start;
+  }
+
+  if (read_store_out_)
+    read_store_out_->write_locus(region, TOO_MANY_READS, rg_names, paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg);
+
+  locus.debug_locus    = debug_locus_;
+  locus.too_many_reads = TOO_MANY_READS;
+  locus.timer          = locus_timer_;
+}
+
+void BamProcessor::analyze_prepared_reads(PreparedLocus& locus, RegionGroup& region_group, const ReferenceSequence& chrom_seq, std::ostream& out){
+  // The reads may have been prepared by another processor, so we adopt its state for the locus
+  locus_timer_   = locus.timer;
+  debug_locus_   = locus.debug_locus;
+  TOO_MANY_READS = locus.too_many_reads;
+  if (io_only_)
+    io_stats_.num_loci += region_group.num_regions();
+  process_reads(locus.paired_strs_by_rg, locus.mate_pairs_by_rg, locus.unpaired_strs_by_rg, locus.rg_names, region_group, chrom_seq, out);
+  total_timer_.add_times(locus_timer_);
+}
+
+void BamProcessor::process_region(BamCramMultiReader& reader, RegionGroup& region_group, int chrom_id, const ReferenceSequence& chrom_seq,
+				  const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, std::ostream& out){
+  Region region = region_group.span();
+  if (near_contig_end(region, chrom_seq))
+    return;
+
+  TraceScope locus_trace("locus", TraceRecorder::instance().enabled() ?
+			 "\"region\":\"" + region.chrom() + ":" + std::to_string(region.start()) + "-" + std::to_string(region.stop()) + "\"" : "");
+  ProfileLocusScope profile_locus(SamplingProfiler::enabled() ?
+				  region.chrom() + ":" + std::to_string(region.start()) + "-" + std::to_string(region.stop()) : "");
+  PreparedLocus locus;
+  prepare_reads(reader, region_group, chrom_id, chrom_seq, read_groups, pass_writer, filt_writer, locus);
+  analyze_prepared_reads(locus, region_group, chrom_seq, out);
+}
+
+void BamProcessor::process_region_or_skip(BamCramMultiReader& reader, RegionGroup& region_group, int chrom_id, const ReferenceSequence& chrom_seq,
+					  const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, std::ostream& out){
+  if (!skip_failed_loci_ && locus_timeout_ <= 0){
+    process_region(reader, region_group, chrom_id, chrom_seq, read_groups, pass_writer, filt_writer, out);
+    return;
+  }
+
+  try {
+    LocusDeadline deadline(locus_timeout_);
+    LocusErrorScope error_scope;
+    process_region(reader, region_group, chrom_id, chrom_seq, read_groups, pass_writer, filt_writer, out);
+  }
+  catch (const LocusTimeout& timeout){
+    abandon_region_group(region_group, timeout.what(), true);
+  }
+  catch (const LocusError& error){
+    // Errors are only trapped to enforce the time limit unless failed loci are being skipped
+    if (!skip_failed_loci_)
+      printErrorAndDie(error.what());
+    abandon_region_group(region_group, error.what(), false);
+  }
+}
+
+void BamProcessor::abandon_region_group(const RegionGroup& region_group, const std::string& error, bool timed_out){
+  discard_locus_output();
+  if (timed_out){
+    num_timed_out_loci_++;
+    record_timed_out_locus(region_group);
+    logger(LOG_SUMMARY) << "WARNING: Analysis exceeded the time limit of " << locus_timeout_ << " seconds" << "\n"
+	     << "Skipping region group " << region_group.span().str() << std::endl;
+  }
+  else {
+    num_failed_loci_++;
+    if (metrics_ != NULL)
+      metrics_->record_locus("ERROR", locus_timer_);
+    logger(LOG_SUMMARY) << "ERROR: " << error << "\n"
+	     << "Skipping region group " << region_group.span().str() << std::endl;
+  }
+}
+
+void BamProcessor::queue_locus_output(LocusOutputQueue& output_queue, size_t group_index, const RegionGroup& region_group){
+  LocusOutput* output = new LocusOutput();
+  extract_locus_output(*output);
+  output_queue.add(group_index, output);
+  if (progress_ != NULL)
+    for (int i = 0; i < region_group.num_regions(); i++)
+      progress_->finish_locus(region_group.chrom());
+  if (metrics_ != NULL){
+    metrics_->finish_loci(region_group.num_regions());
+    metrics_->add_queue_depth(MetricsExporter::QUEUE_REGIONS, -1);
+    metrics_->add_queue_depth(MetricsExporter::QUEUE_OUTPUT, 1);
+  }
+}
+
+void BamProcessor::process_regions_parallel(BamCramMultiReader& reader, std::vector<RegionGroup>& region_groups, std::string& fasta_dir,
+					    const ReadGroupIndex& read_groups, LocusOutputQueue& output_queue, std::ostream& out){
+  logger() << "Processing " << region_groups.size() << " region groups using " << num_threads_ << " worker threads" << std::endl;
+  size_t next_group = 0;
+  std::mutex region_mutex;
+
+  // Workers share the sequence for the current chromosome, as storing multiple copies of a large chromosome is expensive.
+  // When the workers are bound to NUMA nodes, each node instead shares a copy loaded by one of its own workers
+  NumaTopology numa_topology;
+  int num_nodes = (numa_workers_ ? std::min(numa_topology.num_nodes(), num_threads_) : 1);
+  if (numa_workers_)
+    logger() << "Dividing the worker threads among " << num_nodes << " NUMA nodes" << std::endl;
+  std::unique_ptr<FastaReader> fasta_owner;
+  FastaReader& fasta_reader = open_fasta(fasta_dir, fasta_owner);
+  std::mutex fasta_mutex;
+  std::unique_ptr<ReferencePrefetcher> ref_prefetcher = open_ref_prefetcher(fasta_dir);
+  std::vector<int> shared_chrom_ids(num_nodes, -1);
+  std::vector< std::shared_ptr<ReferenceSequence> > shared_chrom_seqs(num_nodes);
+
+  // Threads that run out of regions help the remaining threads align the reads for their loci
+  TaskQueue task_queue(num_threads_);
+  std::vector<BamProcessor*> workers;
+  for (int i = 0; i < num_threads_; i++){
+    workers.push_back(create_worker());
+    workers.back()->task_queue_ = &task_queue;
+    workers.back()->progress_   = progress_;
+  }
 
-    locus_bam_seek_time_ = clock();
-    if (!reader.SetRegion(bam_header->ref_name(chrom_id), (region_iter->start() < MAX_MATE_DIST ? 0: region_iter->start()-MAX_MATE_DIST),
-			  region_iter->stop() + MAX_MATE_DIST))
-      printErrorAndDie("One or more BAM files failed to set the region properly");
-
-    locus_bam_seek_time_  =  (clock() - locus_bam_seek_time_)/CLOCKS_PER_SEC;
-    total_bam_seek_time_ += locus_bam_seek_time_;
-
-    std::vector<std::string> rg_names;
-    std::vector<BamAlnList> paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg;
-    RegionGroup region_group(*region_iter); // TO DO: Extend region groups to have multiple regions
-    read_and_filter_reads(reader, chrom_seq, region_group, rg_to_sample, rg_to_library, rg_names,
-			  paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg, pass_writer, filt_writer);
-
-    // The user specified a list of samples to which we need to restrict the analyses
-    // Discard reads for any samples not in this set
-    if (!sample_set_.empty()){
-      logger() << "Restricting reads to the " << sample_set_.size() << " samples in the specified sample list" << std::endl;
-      unsigned int ins_index = 0;
-      for (unsigned int i = 0; i < rg_names.size(); i++){
-	if (sample_set_.find(rg_names[i]) != sample_set_.end()){
-	  if (i != ins_index){
-	    rg_names[ins_index]            = rg_names[i];
-	    paired_strs_by_rg[ins_index]   = paired_strs_by_rg[i];
-	    mate_pairs_by_rg[ins_index]    = mate_pairs_by_rg[i];
-	    unpaired_strs_by_rg[ins_index] = unpaired_strs_by_rg[i];
+  auto run_worker = [&](BamProcessor* worker, int node){
+    if (numa_workers_ && !numa_topology.bind_thread(node))
+      worker->logger() << "WARNING: Failed to bind a worker thread to the CPUs of NUMA node " << node << std::endl;
+
+    // Lazily opened files are divided evenly among the workers, so that the total number of open files remains bounded
+    BamCramMultiReader worker_reader(reader, reader.max_open_files()/num_threads_);
+    if (reader.streaming())
+      worker_reader.EnableStreaming(reader.max_stream_gap());
+    if (reader.thread_pool() != NULL)
+      worker_reader.SetThreadPool(reader.thread_pool());
+    if (reader.concurrent_read_threads() > 0)
+      worker_reader.EnableConcurrentReads(reader.concurrent_read_threads(), reader.concurrent_read_buffer());
+    const BamHeader* bam_header = worker_reader.bam_header();
+    std::shared_ptr<ReferenceSequence> chrom_seq;
+    int cur_chrom_id = -1;
+
+    while (true){
+      size_t group_index;
+      {
+	std::lock_guard<std::mutex> lock(region_mutex);
+	if (next_group >= region_groups.size())
+	  break;
+	group_index = next_group++;
+      }
+      output_queue.wait_for_slot(group_index);
+
+      int chrom_id;
+      RegionGroup& region_group = region_groups[group_index];
+      Region region = region_group.span();
+      if (worker->check_region(region_group, bam_header, chrom_id)){
+	if (ref_windows_){
+	  // Each worker loads its own windows, as they're much smaller than the chromosomes
+	  std::lock_guard<std::mutex> lock(fasta_mutex);
+	  if (!chrom_seq)
+	    chrom_seq = std::make_shared<ReferenceSequence>();
+	  load_reference(fasta_reader, region, chrom_id, cur_chrom_id, *chrom_seq);
+	}
+	else if (cur_chrom_id != chrom_id){
+	  std::lock_guard<std::mutex> lock(fasta_mutex);
+	  if (shared_chrom_ids[node] != chrom_id){
+	    shared_chrom_seqs[node] = std::make_shared<ReferenceSequence>();
+	    if (ref_prefetcher){
+	      if (ref_prefetcher->take(region.chrom(), *shared_chrom_seqs[node]))
+		shared_chrom_ids[node] = chrom_id;
+	      prefetch_next_chrom(*ref_prefetcher, region_groups, group_index);
+	    }
+	    load_reference(fasta_reader, region, chrom_id, shared_chrom_ids[node], *shared_chrom_seqs[node]);
 	  }
-	  ins_index++;
+	  chrom_seq    = shared_chrom_seqs[node];
+	  cur_chrom_id = chrom_id;
 	}
+	worker->process_region_or_skip(worker_reader, region_group, chrom_id, *chrom_seq, read_groups, NULL, NULL, out);
       }
-      if (ins_index != rg_names.size()){
-	rg_names.resize(ins_index);
-	paired_strs_by_rg.resize(ins_index);
-	mate_pairs_by_rg.resize(ins_index);
-	unpaired_strs_by_rg.resize(ins_index);
+
+      worker->queue_locus_output(output_queue, group_index, region_group);
+    }
+    task_queue.work_until_finished();
+  };
+
+  // Consecutive workers are placed on the same node
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads_; i++)
+    threads.push_back(std::thread(run_worker, workers[i], (int)(((long)i*num_nodes)/num_threads_)));
+  for (unsigned int i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  output_queue.finish(region_groups.size());
+  for (unsigned int i = 0; i < workers.size(); i++){
+    merge_worker_stats(workers[i]);
+    delete workers[i];
+  }
+}
+
+void BamProcessor::select_byte_shard(const std::vector<std::string>& bam_files, std::vector<Region>& regions){
+  // Each region's cost is the number of BAM bytes overlapping it, plus a constant that accounts for the per-locus overhead and
+  // balances the number of regions when the bytes can't be estimated (e.g. for CRAMs)
+  const double REGION_OVERHEAD_BYTES = 1024;
+  std::vector<double> costs;
+  std::vector<size_t> order;
+  double total_bytes = 0;
+  {
+    ReadCountEstimator estimator(bam_files);
+    for (size_t i = 0; i < regions.size(); i++){
+      double num_bytes = estimator.estimate_bytes(regions[i]);
+      total_bytes += num_bytes;
+      costs.push_back(num_bytes + REGION_OVERHEAD_BYTES);
+      order.push_back(i);
+    }
+  }
+  std::vector<int> shards;
+  partition_loci(costs, order, num_byte_shards_, true, shards);
+
+  size_t num_kept = 0;
+  double shard_bytes = 0;
+  for (size_t i = 0; i < regions.size(); i++){
+    if (shards[i] == byte_shard_){
+      shard_bytes         += costs[i] - REGION_OVERHEAD_BYTES;
+      regions[num_kept++]  = regions[i];
+    }
+  }
+  size_t num_regions = regions.size();
+  regions.erase(regions.begin() + num_kept, regions.end());
+
+  std::stringstream fraction;
+  fraction.precision(1);
+  fraction << std::fixed << (total_bytes > 0 ? 100.0*shard_bytes/total_bytes : 0.0);
+  logger() << "Analyzing " << num_kept << " of " << num_regions << " regions in byte-balanced shard " << byte_shard_+1 << "/" << num_byte_shards_
+	   << ", which spans " << fraction.str() << "% of the " << (uint64_t)total_bytes << " estimated BAM bytes" << std::endl;
+  if (regions.empty())
+    printErrorAndDie("The byte-balanced shard doesn't contain any regions. Please reduce the number of shards");
+}
+
+void BamProcessor::process_regions(BamCramMultiReader& reader, std::string& region_file, std::string& fasta_dir,
+				   std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library,
+				   BamWriter* pass_writer, BamWriter* filt_writer,
+				   std::ostream& out, int32_t max_regions, std::string chrom){
+  std::vector<Region> regions;
+  load_regions(region_file, max_regions, chrom, regions);
+  if (num_byte_shards_ > 0)
+    select_byte_shard(reader.paths(), regions);
+
+  // Alignments streamed from stdin can't be revisited, so the regions must be visited in the same chromosome order as the
+  // input. Regions on chromosomes absent from the header are moved to the end, where they're skipped
+  if (reader.reads_stdin()){
+    const BamHeader* bam_header = reader.bam_header();
+    auto chrom_rank = [&](const Region& region){
+      int chrom_id = bam_header->ref_id(region.chrom());
+      if (chrom_id == -1 && region.chrom().size() > 3 && region.chrom().substr(0, 3).compare("chr") == 0)
+	chrom_id = bam_header->ref_id(region.chrom().substr(3));
+      return (chrom_id == -1 ? std::numeric_limits<int>::max() : chrom_id);
+    };
+    std::stable_sort(regions.begin(), regions.end(), [&](const Region& a, const Region& b){ return chrom_rank(a) < chrom_rank(b); });
+  }
+
+  // Skip the regions whose output was written before the run was interrupted
+  size_t num_regions = regions.size(), num_skipped = 0;
+  if (resuming_){
+    if (resume_checkpoint_.num_regions != num_regions)
+      printErrorAndDie("The checkpoint was generated for a run with " + std::to_string(resume_checkpoint_.num_regions)
+		       + " regions, but " + std::to_string(num_regions) + " regions are being analyzed. The regions for the resumed run must be identical");
+    num_skipped = resume_checkpoint_.num_completed;
+    regions.erase(regions.begin(), regions.begin() + num_skipped);
+    logger() << "Resuming from the checkpoint after " << num_skipped << " completed regions" << std::endl;
+  }
+  if (checkpoint_interval_ > 0)
+    write_checkpoint(num_skipped, num_regions);
+
+  // Intern the samples and libraries once, so that each read is mapped to them without any string lookups.
+  // The index is read-only, so it's shared by all of the worker processors
+  ReadGroupIndex read_groups(reader, use_bam_rgs_, rg_to_sample, rg_to_library);
+
+  if (!work_dir_.empty()){
+    if (pass_writer != NULL || filt_writer != NULL)
+      printErrorAndDie("BAM output of passing or filtered reads is not supported when using a work queue");
+    process_work_queue(reader, regions, fasta_dir, read_groups, out);
+    return;
+  }
+  process_region_list(reader, regions, num_skipped, num_regions, fasta_dir, read_groups, pass_writer, filt_writer, out);
+}
+
+void BamProcessor::load_regions(std::string& region_file, int32_t max_regions, std::string chrom, std::vector<Region>& regions){
+  loadSortedRegions(region_file, region_catalog_path_, max_regions, chrom, chrom_list_, first_region_, last_region_, regions, logger());
+  if (!locus_chrom_.empty()){
+    regions.erase(std::remove_if(regions.begin(), regions.end(), [&](const Region& region){
+	  return region.chrom().compare(locus_chrom_) != 0 || region.stop() <= locus_start_ || region.start() >= locus_end_; }), regions.end());
+    if (regions.empty())
+      printErrorAndDie("None of the regions overlap the locus provided to --locus");
+    logger() << "Analyzing the " << regions.size() << " region(s) that overlap the requested locus" << std::endl;
+  }
+  if (skip_list_){
+    size_t num_regions = regions.size();
+    regions.erase(std::remove_if(regions.begin(), regions.end(), [&](const Region& region){ return skip_list_->contains(region); }), regions.end());
+    num_skip_listed_ = num_regions - regions.size();
+    logger() << "Skipping " << num_skip_listed_ << " regions that overlap the " << skip_list_->num_loci() << " loci in the skip list" << std::endl;
+  }
+}
+
+void BamProcessor::process_loaded_regions(BamCramMultiReader& reader, std::vector<Region>& regions, std::string& fasta_dir,
+					  std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library, std::ostream& out){
+  ReadGroupIndex read_groups(reader, use_bam_rgs_, rg_to_sample, rg_to_library);
+  process_region_list(reader, regions, 0, regions.size(), fasta_dir, read_groups, NULL, NULL, out);
+}
+
+FastaReader& BamProcessor::open_fasta(std::string& fasta_dir, std::unique_ptr<FastaReader>& owner){
+  if (resident_fasta_)
+    return *resident_fasta_;
+  owner.reset(new FastaReader(fasta_dir));
+  if (!packed_ref_path_.empty())
+    owner->use_packed_reference(packed_ref_path_);
+  return *owner;
+}
+
+void BamProcessor::preload_reference(std::string& fasta_dir, const std::vector<Region>& regions){
+  ref_windows_ = true;
+  resident_fasta_.reset(new FastaReader(fasta_dir));
+  if (!packed_ref_path_.empty())
+    resident_fasta_->use_packed_reference(packed_ref_path_);
+
+  // Each region's window (see load_reference()) is merged with any overlapping windows of the preceding regions
+  int32_t pad = MAX_MATE_DIST + REF_WINDOW_FLANK;
+  int64_t num_windows = 0, num_bases = 0;
+  size_t i = 0;
+  while (i < regions.size()){
+    std::string chrom = regions[i].chrom();
+    int32_t start = regions[i].start()-pad, end = regions[i].stop()+pad+REF_WINDOW_REUSE;
+    for (i++; i < regions.size() && regions[i].chrom().compare(chrom) == 0 && regions[i].start()-pad <= end+1; i++)
+      end = std::max(end, regions[i].stop()+pad+REF_WINDOW_REUSE);
+    resident_fasta_->preload_window(chrom, start, end);
+    num_windows++;
+    num_bases += end - std::max(0, start) + 1;
+  }
+  logger() << "Loaded " << num_windows << " reference windows spanning up to " << num_bases << " bp into memory" << std::endl;
+}
+
+void BamProcessor::process_work_queue(BamCramMultiReader& reader, std::vector<Region>& regions, std::string& fasta_dir,
+				      const ReadGroupIndex& read_groups, std::ostream& out){
+  WorkQueue work_queue(work_dir_, regions.size(), work_batch_seconds_);
+  WorkBatch batch;
+  while (work_queue.claim_batch(batch)){
+    logger() << "Claimed batch " << batch.index << " containing regions " << batch.start+1 << "-" << batch.end << " of " << regions.size() << std::endl;
+    double batch_start = ProcessTimer::wall_clock();
+    std::vector<Region> batch_regions(regions.begin()+batch.start, regions.begin()+batch.end);
+    open_batch_output(work_queue.output_path(batch, ""));
+    process_region_list(reader, batch_regions, batch.start, regions.size(), fasta_dir, read_groups, NULL, NULL, out);
+    close_batch_output();
+    work_queue.complete_batch(batch, ProcessTimer::wall_clock() - batch_start);
+  }
+  if (!work_coordinator_)
+    return;
+
+  logger() << "All regions have been claimed. Waiting for the remaining batches to complete" << std::endl;
+  std::vector<WorkBatch> batches;
+  work_queue.wait_for_batches(batches, logger());
+  std::vector<std::string> prefixes;
+  for (auto batch_iter = batches.begin(); batch_iter != batches.end(); batch_iter++)
+    prefixes.push_back(work_queue.output_path(*batch_iter, ""));
+  logger() << "Combining the output for " << batches.size() << " batches" << std::endl;
+  merge_batch_outputs(prefixes);
+}
+
+void BamProcessor::process_region_list(BamCramMultiReader& reader, std::vector<Region>& regions, size_t num_skipped, size_t num_regions,
+				       std::string& fasta_dir, const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, std::ostream& out){
+  // Nearby regions are grouped so that their reads are extracted, filtered and phased once and they're genotyped jointly.
+  // The haplotype blocks extend 5bp beyond each region and must be at least 10bp apart, so regions must be separated by >= 20bp
+  const int32_t MIN_GROUP_GAP = 20;
+  std::vector<RegionGroup> region_groups;
+  groupRegions(regions, MAX_GROUP_DIST, MAX_GROUP_REGIONS, MIN_GROUP_GAP, region_groups);
+  if (region_groups.size() != regions.size())
+    logger() << "Grouped the " << regions.size() << " regions into " << region_groups.size() << " groups of nearby regions" << std::endl;
+
+  // Plan the regions that prepare_reads() will request, so that the reader can prefetch their byte ranges in advance
+  if (reader.range_prefetch()){
+    std::vector<std::string> plan_chroms;
+    std::vector< std::pair<int32_t, int32_t> > plan_regions;
+    for (auto group_iter = region_groups.begin(); group_iter != region_groups.end(); group_iter++){
+      Region region = group_iter->span();
+      plan_chroms.push_back(region.chrom());
+      plan_regions.push_back(std::pair<int32_t, int32_t>((region.start() < MAX_MATE_DIST ? 0: region.start()-MAX_MATE_DIST), region.stop() + MAX_MATE_DIST));
+    }
+    reader.SetRegionPlan(plan_chroms, plan_regions);
+  }
+
+  // The output for each group is written in order by a dedicated thread, so that compressing the output
+  // doesn't delay the analysis of subsequent loci. Workers can get at most MAX_PENDING_LOCI ahead of the writer
+  // The checkpoints are also written by this thread, as they must only include loci whose output has been written
+  const size_t MAX_PENDING_LOCI = 16*num_threads_;
+  size_t num_written       = num_skipped;
+  size_t next_written      = 0;
+  double prev_checkpoint   = ProcessTimer::wall_clock();
+  if (metrics_ != NULL)
+    metrics_->set_queue_depth(MetricsExporter::QUEUE_REGIONS, region_groups.size());
+  LocusOutputQueue output_queue([&](LocusOutput& output){
+      write_locus_output(output);
+      if (metrics_ != NULL)
+	metrics_->add_queue_depth(MetricsExporter::QUEUE_OUTPUT, -1);
+      num_written += region_groups[next_written++].num_regions();
+      if (checkpoint_interval_ > 0 && ProcessTimer::wall_clock() - prev_checkpoint >= checkpoint_interval_){
+	write_checkpoint(num_written, num_regions);
+	prev_checkpoint = ProcessTimer::wall_clock();
       }
+    }, MAX_PENDING_LOCI);
+
+  // Loci are counted once they've been analyzed, even though their output may not have been written yet
+  std::unique_ptr<ProgressReporter> progress_reporter;
+  if (progress_interval_ > 0)
+    progress_reporter.reset(new ProgressReporter(regions.size(), progress_interval_, progress_file_));
+  progress_ = progress_reporter.get();
+
+  if (num_threads_ > 1){
+    if (pass_writer != NULL || filt_writer != NULL)
+      printErrorAndDie("BAM output of passing or filtered reads is not supported when using multiple threads");
+    process_regions_parallel(reader, region_groups, fasta_dir, read_groups, output_queue, out);
+    if (checkpoint_interval_ > 0)
+      write_checkpoint(num_regions, num_regions);
+    progress_ = NULL;
+    return;
+  }
+
+  // Buffer the log messages for each group, so that they're written by the output thread along with the group's output
+  log_to_buffer_ = true;
+  if (prefetch_loci_ > 0){
+    process_prefetched_regions(reader, region_groups, fasta_dir, read_groups, pass_writer, filt_writer, output_queue, out);
+    log_to_buffer_ = false;
+    if (checkpoint_interval_ > 0)
+      write_checkpoint(num_regions, num_regions);
+    progress_ = NULL;
+    return;
+  }
+
+  std::unique_ptr<FastaReader> fasta_owner;
+  FastaReader& fasta_reader = open_fasta(fasta_dir, fasta_owner);
+  std::unique_ptr<ReferencePrefetcher> ref_prefetcher = open_ref_prefetcher(fasta_dir);
+  const BamHeader* bam_header = reader.bam_header();
+  int cur_chrom_id = -1; ReferenceSequence chrom_seq;
+  for (size_t group_index = 0; group_index < region_groups.size(); group_index++){
+    output_queue.wait_for_slot(group_index);
+    int chrom_id;
+    Region region = region_groups[group_index].span();
+    if (check_region(region_groups[group_index], bam_header, chrom_id)){
+      // Use the prefetched sequence for a new chromosome, if available, and start prefetching the one that follows it
+      if (ref_prefetcher && cur_chrom_id != chrom_id){
+	if (ref_prefetcher->take(region.chrom(), chrom_seq))
+	  cur_chrom_id = chrom_id;
+	prefetch_next_chrom(*ref_prefetcher, region_groups, group_index);
+      }
+
+      // Read FASTA sequence for chromosome (or the window surrounding the region)
+      load_reference(fasta_reader, region, chrom_id, cur_chrom_id, chrom_seq);
+      process_region_or_skip(reader, region_groups[group_index], chrom_id, chrom_seq, read_groups, pass_writer, filt_writer, out);
     }
 
-    if (rem_pcr_dups_)
-      remove_pcr_duplicates(base_quality_, use_bam_rgs_, rg_to_library, paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg, logger());
+    queue_locus_output(output_queue, group_index, region_groups[group_index]);
+  }
+  output_queue.finish(region_groups.size());
+  log_to_buffer_ = false;
+  if (ref_prefetcher)
+    logger() << ref_prefetcher->num_hits() << " out of " << ref_prefetcher->num_hits()+ref_prefetcher->num_misses()
+	     << " chromosome sequences were prefetched in the background" << std::endl;
+  if (checkpoint_interval_ > 0)
+    write_checkpoint(num_regions, num_regions);
+  progress_ = NULL;
+}
+
+void BamProcessor::process_prefetched_regions(BamCramMultiReader& reader, std::vector<RegionGroup>& region_groups, std::string& fasta_dir,
+					      const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer,
+					      LocusOutputQueue& output_queue, std::ostream& out){
+  logger(LOG_SUMMARY) << "Preparing the reads for up to " << prefetch_loci_ << " upcoming region groups on a separate thread" << std::endl;
+
+  // The reads are prepared by a processor with identical settings, whose log messages are buffered for each group
+  // and written before the group is analyzed. It exclusively uses the reader and BAM writers until it's finished
+  BamProcessor preparer(use_bam_rgs_, rem_pcr_dups_);
+  preparer.init_worker(*this);
+  preparer.ref_windows_ = ref_windows_;
+  preparer.progress_    = progress_;
 
-    process_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg, rg_names, region_group, chrom_seq, out);
+  std::mutex queue_mutex;
+  std::condition_variable queue_changed;
+  std::deque< std::unique_ptr<PreparedLocus> > prepared_loci;
+
+  std::thread prepare_thread([&](){
+      std::unique_ptr<FastaReader> fasta_owner;
+      FastaReader& fasta_reader = open_fasta(fasta_dir, fasta_owner);
+      const BamHeader* bam_header = reader.bam_header();
+      std::shared_ptr<ReferenceSequence> chrom_seq;
+      int cur_chrom_id = -1;
+      for (size_t group_index = 0; group_index < region_groups.size(); group_index++){
+	std::unique_ptr<PreparedLocus> locus(new PreparedLocus());
+	locus->group_index = group_index;
+	RegionGroup& region_group = region_groups[group_index];
+	Region region = region_group.span();
+	if (preparer.check_region(region_group, bam_header, locus->chrom_id)){
+	  // Queued groups may still require the current sequence, so a new sequence is loaded rather than overwriting it
+	  if (!chrom_seq || !preparer.reference_loaded(region, locus->chrom_id, cur_chrom_id, *chrom_seq)){
+	    chrom_seq    = std::make_shared<ReferenceSequence>();
+	    cur_chrom_id = -1;
+	    preparer.load_reference(fasta_reader, region, locus->chrom_id, cur_chrom_id, *chrom_seq);
+	  }
+	  locus->chrom_seq = chrom_seq;
+	  if (!preparer.near_contig_end(region, *chrom_seq)){
+	    locus->analyze = true;
+	    if (!skip_failed_loci_)
+	      preparer.prepare_reads(reader, region_group, locus->chrom_id, *chrom_seq, read_groups, pass_writer, filt_writer, *locus);
+	    else {
+	      try {
+		LocusErrorScope error_scope;
+		preparer.prepare_reads(reader, region_group, locus->chrom_id, *chrom_seq, read_groups, pass_writer, filt_writer, *locus);
+	      }
+	      catch (const LocusError& error){
+		locus->error = error.what();
+	      }
+	    }
+	  }
+	}
+	LocusOutput log_output;
+	preparer.extract_locus_output(log_output);
+	locus->log = log_output.log;
+
+	std::unique_lock<std::mutex> lock(queue_mutex);
+	queue_changed.wait(lock, [&]{ return prepared_loci.size() < (size_t)prefetch_loci_; });
+	prepared_loci.push_back(std::move(locus));
+	if (metrics_ != NULL)
+	  metrics_->set_queue_depth(MetricsExporter::QUEUE_PREPARED, prepared_loci.size());
+	queue_changed.notify_all();
+      }
+    });
+
+  for (size_t group_index = 0; group_index < region_groups.size(); group_index++){
+    std::unique_ptr<PreparedLocus> locus;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      queue_changed.wait(lock, [&]{ return !prepared_loci.empty(); });
+      locus = std::move(prepared_loci.front());
+      prepared_loci.pop_front();
+      if (metrics_ != NULL)
+	metrics_->set_queue_depth(MetricsExporter::QUEUE_PREPARED, prepared_loci.size());
+      queue_changed.notify_all();
+    }
+    assert(locus->group_index == group_index);
+    output_queue.wait_for_slot(group_index);
+    logger(LOG_SUMMARY) << locus->log;
+
+    RegionGroup& region_group = region_groups[group_index];
+    Region region = region_group.span();
+    std::string error = locus->error;
+    bool timed_out    = false;
+    if (error.empty() && locus->analyze){
+      TraceScope locus_trace("locus", TraceRecorder::instance().enabled() ?
+			     "\"region\":\"" + region.chrom() + ":" + std::to_string(region.start()) + "-" + std::to_string(region.stop()) + "\"" : "");
+      ProfileLocusScope profile_locus(SamplingProfiler::enabled() ?
+				      region.chrom() + ":" + std::to_string(region.start()) + "-" + std::to_string(region.stop()) : "");
+      if (!skip_failed_loci_ && locus_timeout_ <= 0)
+	analyze_prepared_reads(*locus, region_group, *locus->chrom_seq, out);
+      else {
+	try {
+	  LocusDeadline deadline(locus_timeout_);
+	  LocusErrorScope error_scope;
+	  analyze_prepared_reads(*locus, region_group, *locus->chrom_seq, out);
+	}
+	catch (const LocusTimeout& timeout){
+	  error     = timeout.what();
+	  timed_out = true;
+	}
+	catch (const LocusError& locus_error){
+	  if (!skip_failed_loci_)
+	    printErrorAndDie(locus_error.what());
+	  error = locus_error.what();
+	}
+      }
+    }
+    if (!error.empty())
+      abandon_region_group(region_group, error, timed_out);
+
+    queue_locus_output(output_queue, group_index, region_group);
   }
+  prepare_thread.join();
+  output_queue.finish(region_groups.size());
+}
+
+void BamProcessor::write_checkpoint(size_t num_completed, size_t num_regions){
+  RunCheckpoint checkpoint;
+  checkpoint.num_completed = num_completed;
+  checkpoint.num_regions   = num_regions;
+  flush_output_files(checkpoint.files);
+  checkpoint.write(checkpoint_file_);
+}
+
+void BamProcessor::resume_from_checkpoint(std::string checkpoint_file){
+  if (!resume_checkpoint_.read(checkpoint_file))
+    printErrorAndDie("Unable to resume the run as the checkpoint file " + checkpoint_file + " does not exist");
+  resuming_ = true;
+}
+
+bool BamProcessor::append_to_output(const std::string& path){
+  if (!resuming_)
+    return false;
+  for (auto file_iter = resume_checkpoint_.files.begin(); file_iter != resume_checkpoint_.files.end(); file_iter++)
+    if (file_iter->first.compare(path) == 0){
+      RunCheckpoint::truncate_file(path, file_iter->second);
+      return true;
+    }
+  printErrorAndDie("Unable to resume the run as output file " + path + " isn't recorded in the checkpoint. The outputs for the resumed run must be identical");
+  return false;
 }
@@ -4,30 +4,66 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "bam_io.h"
 #include "base_quality.h"
 #include "error.h"
+#include "fasta_reader.h"
+#include "io_throughput_stats.h"
+#include "locus_output_queue.h"
+#include "locus_sampler.h"
+#include "locus_skip_list.h"
+#include "metrics_exporter.h"
+#include "process_timer.h"
+#include "progress_reporter.h"
+#include "read_filter_cache.h"
+#include "read_group_index.h"
+#include "reference_prefetcher.h"
+#include "read_pair_table.h"
+#include "reference_sequence.h"
 #include "region.h"
+#include "run_checkpoint.h"
+#include "sampling_profiler.h"
+#include "str_read_store.h"
 #include "stringops.h"
+#include "task_queue.h"
+#include "trace_recorder.h"
+#include "work_queue.h"
 
 class BamProcessor {
+ public:
+  // Verbosity of the messages logged while processing each locus. Messages written outside of a locus, such as the
+  // run's settings and summary, and errors that abandon a locus are always logged
+  enum LogLevel { LOG_SUMMARY = 0, LOG_LOCUS = 1, LOG_DEBUG = 2 };
+
  protected:
   typedef std::vector<BamAlignment> BamAlnList;
 
+  // Filtered reads for a group of regions, along with the state required to analyze them on another processor
+  struct PreparedLocus {
+    size_t group_index;
+    bool analyze;                                // False iff the group was skipped before its reads were prepared
+    int chrom_id;
+    std::shared_ptr<const ReferenceSequence> chrom_seq;
+    std::string log;                             // Log messages written while preparing the reads
+    std::string error;                           // If non-empty, the error that abandoned the group while preparing its reads
+    bool debug_locus, too_many_reads;
+    ProcessTimer timer;
+    std::vector<std::string> rg_names;
+    std::vector<BamAlnList> paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg;
+
+    PreparedLocus() : group_index(0), analyze(false), chrom_id(-1), debug_locus(true), too_many_reads(false){}
+  };
+
  private:
   bool use_bam_rgs_;
   bool rem_pcr_dups_;
 
-  // Timing statistics (in seconds)
-  double total_bam_seek_time_;
-  double locus_bam_seek_time_;
-  double total_read_filter_time_;
-  double locus_read_filter_time_;
-
   void add_filtered_alignment(BamAlignment& alignment, std::string filter, BamAlnList& filtered_alignments);
 
   void extract_mappings(BamAlignment& aln, const BamHeader* bam_header,
@@ -36,51 +72,333 @@ class BamProcessor {
   void get_valid_pairings(BamAlignment& aln_1, BamAlignment& aln_2, const BamHeader* bam_header,
 			  std::vector< std::pair<std::string, int32_t> >& p1, std::vector< std::pair<std::string, int32_t> >& p2);
 
-  void read_and_filter_reads(BamCramMultiReader& reader, std::string& chrom_seq, RegionGroup& region,
-			     std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library, std::vector<std::string>& rg_names,
+  // Returns the first region-independent filter (e.g. HAS_N_BASES) that the read overlapping a region fails, if any
+ ReadFilterCache::ReadFilter apply_read_filters(BamAlignment& alignment);
+
+ // Returns true iff the read passes the end match and indel position filters, which determine if it's used to generate haplotypes
+ bool passes_end_filters(BamAlignment& alignment, const ReferenceSequence& chrom_seq);
+
+ // If non-NULL, the results of the above filters are reused for reads fetched again for subsequent nearby regions
+ std::unique_ptr<ReadFilterCache> read_filter_cache_;
+
+ void read_and_filter_reads(BamCramMultiReader& reader, const ReferenceSequence& chrom_seq, RegionGroup& region,
+			     const ReadGroupIndex& read_groups, std::vector<std::string>& rg_names,
 			     std::vector<BamAlnList>& paired_strs_by_rg, std::vector<BamAlnList>& mate_pairs_by_rg, std::vector<BamAlnList>& unpaired_strs_by_rg,
 			     BamWriter* pass_writer, BamWriter* filt_writer);
 
- std::string get_read_group(BamAlignment& aln, std::map<std::string, std::string>& read_group_mapping);
+ // Deterministically reduce the number of STR reads for each sample to at most MAX_SAMPLE_DEPTH (rounded up to retain both
+ // reads of a pair), selecting the reads with the smallest name hashes so that results are identical across runs and thread counts
+ void downsample_reads(std::vector<BamAlnList>& paired_strs_by_rg, std::vector<BamAlnList>& mate_pairs_by_rg,
+		       std::vector<BamAlnList>& unpaired_strs_by_rg, std::vector<std::string>& rg_names);
+
+ // Discard the reads for any samples that aren't in the user-specified sample list, if one was provided
+ void restrict_to_sample_set(std::vector<std::string>& rg_names, std::vector<BamAlnList>& paired_strs_by_rg,
+			     std::vector<BamAlnList>& mate_pairs_by_rg, std::vector<BamAlnList>& unpaired_strs_by_rg);
+
+ int64_t count_reads(const std::vector<BamAlnList>& paired_strs_by_rg, const std::vector<BamAlnList>& mate_pairs_by_rg,
+		     const std::vector<BamAlnList>& unpaired_strs_by_rg);
 
- std::string trim_alignment_name(BamAlignment& aln);
+ // Add the locus' reads to the progress report and metrics, if either is enabled
+ void record_reads(const std::vector<BamAlnList>& paired_strs_by_rg, const std::vector<BamAlnList>& mate_pairs_by_rg,
+		   const std::vector<BamAlnList>& unpaired_strs_by_rg);
 
- void modify_and_write_alns(BamAlnList& alignments, std::map<std::string, std::string>& rg_to_sample,
-			    BamWriter* writer);
+ // Writes the alignments to the BAM file, which takes ownership of their records
+ void modify_and_write_alns(BamAlnList& alignments, const ReadGroupIndex& read_groups, BamWriter* writer);
 
  bool spans_a_region(const std::vector<Region>& regions, BamAlignment& alignment);
 
+ // Returns true iff the region passes the sanity checks that don't require the reference sequence
+ // Stores the BAM reference ID for the region's chromosome in CHROM_ID
+ bool check_region(const RegionGroup& region_group, const BamHeader* bam_header, int& chrom_id);
+
+ // Load the reference sequence required to analyze the region into CHROM_SEQ, unless it's already present.
+ // CUR_CHROM_ID is the BAM reference ID for the chromosome currently stored in CHROM_SEQ (or -1) and is updated accordingly
+ void load_reference(FastaReader& fasta_reader, const Region& region, int chrom_id, int& cur_chrom_id, ReferenceSequence& chrom_seq);
+
+ // Returns true iff CHROM_SEQ, which contains the chromosome with BAM reference ID CUR_CHROM_ID, can be used to analyze the region
+ bool reference_loaded(const Region& region, int chrom_id, int cur_chrom_id, const ReferenceSequence& chrom_seq);
+
+ // Returns true (and logs a message) iff the region is too close to an end of the contig to be analyzed
+ bool near_contig_end(const Region& region, const ReferenceSequence& chrom_seq);
+
+ // Extract, filter and deduplicate the reads for a group of nearby regions and store them in LOCUS
+ void prepare_reads(BamCramMultiReader& reader, RegionGroup& region_group, int chrom_id, const ReferenceSequence& chrom_seq,
+		    const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, PreparedLocus& locus);
+
+ // Analyze the reads prepared for a group of regions, which may have been prepared by another processor
+ void analyze_prepared_reads(PreparedLocus& locus, RegionGroup& region_group, const ReferenceSequence& chrom_seq, std::ostream& out);
+
+ // Extract, filter and analyze the reads for a group of nearby regions, which are genotyped jointly
+ void process_region(BamCramMultiReader& reader, RegionGroup& region_group, int chrom_id, const ReferenceSequence& chrom_seq,
+		     const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, std::ostream& out);
+
+ // Equivalent to process_region(), except that if SKIP_FAILED_LOCI_ is true, an error encountered while analyzing the group
+ // only abandons the group rather than exiting, and that the group is abandoned if it exceeds the LOCUS_TIMEOUT_ time limit.
+ // The group's output is then discarded, apart from its log messages
+ void process_region_or_skip(BamCramMultiReader& reader, RegionGroup& region_group, int chrom_id, const ReferenceSequence& chrom_seq,
+			     const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, std::ostream& out);
+ bool skip_failed_loci_;
+ double locus_timeout_; // Seconds allowed for the analysis of each region group, or 0 if there's no limit
+
+ // Discard the output of a region group whose analysis encountered ERROR or exceeded the time limit, apart from its log messages
+ void abandon_region_group(const RegionGroup& region_group, const std::string& error, bool timed_out);
+
+ // Pass the output buffered for a region group to the queue and record the group's loci as completed
+ void queue_locus_output(LocusOutputQueue& output_queue, size_t group_index, const RegionGroup& region_group);
+
+ // Distribute the region groups across NUM_THREADS_ worker processors, which pass their output for each group to the queue
+ void process_regions_parallel(BamCramMultiReader& reader, std::vector<RegionGroup>& region_groups, std::string& fasta_dir,
+			       const ReadGroupIndex& read_groups, LocusOutputQueue& output_queue, std::ostream& out);
+
+ int num_threads_;
+
+ // If true, the worker threads are divided among the NUMA nodes and bound to their node's CPUs. The workers on each
+ // node share their own copy of the current chromosome's sequence, so that it and their DP matrices are node-local
+ bool numa_workers_;
+
+ // If > 0 and a single thread is used, a separate thread prepares the reads for up to this many upcoming region groups
+ // while the current group is genotyped, so that reading the BAMs overlaps with the analysis
+ int prefetch_loci_;
+
+ // Analyze the region groups on this thread while a separate thread prepares their reads, passing the output for each group to the queue
+ void process_prefetched_regions(BamCramMultiReader& reader, std::vector<RegionGroup>& region_groups, std::string& fasta_dir,
+				 const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer,
+				 LocusOutputQueue& output_queue, std::ostream& out);
+
+ // Stores from which the filtered reads for each locus are loaded and to which they're saved, shared by all worker processors.
+ // Loci absent from the input store are extracted from the BAMs as usual
+ std::shared_ptr<StrReadStoreReader> read_store_in_;
+ std::shared_ptr<StrReadStoreWriter> read_store_out_;
+
+ // If CHECKPOINT_INTERVAL_ > 0, the output files are flushed and the number of regions whose output has been written is recorded
+ // in the checkpoint file whenever at least this many seconds have elapsed since the previous checkpoint
+ std::string checkpoint_file_;
+ int checkpoint_interval_;
+
+ // Checkpoint from which an interrupted run is resumed. Only valid if RESUMING_ is true
+ bool resuming_;
+ RunCheckpoint resume_checkpoint_;
+
+ // Flush the output files and record that the output for NUM_COMPLETED of the NUM_REGIONS regions has been written
+ void write_checkpoint(size_t num_completed, size_t num_regions);
+
+ // Analyze the regions and write their output in order. NUM_SKIPPED of the NUM_REGIONS regions preceding them were analyzed by a
+ // previous run, which only matters for checkpointing
+ void process_region_list(BamCramMultiReader& reader, std::vector<Region>& regions, size_t num_skipped, size_t num_regions,
+			  std::string& fasta_dir, const ReadGroupIndex& read_groups, BamWriter* pass_writer, BamWriter* filt_writer, std::ostream& out);
+
+ // If non-empty, batches of the regions are claimed from the work queue in this shared directory (see WorkQueue), each of which is
+ // written to its own output files. If WORK_COORDINATOR_ is true, the outputs for every batch are then combined in order
+ std::string work_dir_;
+ double work_batch_seconds_;
+ bool work_coordinator_;
+
+ // Analyze batches of regions claimed from the work queue until none remain
+ void process_work_queue(BamCramMultiReader& reader, std::vector<Region>& regions, std::string& fasta_dir,
+			 const ReadGroupIndex& read_groups, std::ostream& out);
+
+ // If non-empty, reference sequences are retrieved from the packed reference at this path rather than the FASTA files
+ std::string packed_ref_path_;
+
+ // If non-empty, the regions are loaded from the region catalog at this path rather than parsed from the BED file.
+ // If FIRST_REGION_ > 0, only the sorted regions FIRST_REGION_-LAST_REGION_ (1-based, inclusive) are analyzed
+ std::string region_catalog_path_;
+ int64_t first_region_, last_region_;
+
+ // If non-empty, only the regions on these chromosomes are analyzed
+ std::set<std::string> chrom_list_;
+
+ // If non-empty, only the regions that overlap this 0-based, half-open interval are analyzed (see set_locus())
+ std::string locus_chrom_;
+ int32_t locus_start_, locus_end_;
+
+ // If NUM_BYTE_SHARDS_ > 0, the selected regions are split into this many contiguous shards with approximately equal numbers
+ // of BAM bytes, estimated from the index offsets of the input files, and only the regions in shard BYTE_SHARD_ (0-based) are analyzed
+ int byte_shard_, num_byte_shards_;
+ void select_byte_shard(const std::vector<std::string>& bam_files, std::vector<Region>& regions);
+
+ // If non-NULL, the regions that overlap a locus in this list are skipped before any of their reads are extracted
+ std::shared_ptr<LocusSkipList> skip_list_;
+
+ // If true, only a window surrounding each region is loaded from the reference rather than the entire chromosome.
+ // Each window extends MAX_MATE_DIST + REF_WINDOW_FLANK bp beyond the region, which covers the reads, their mates
+ // and the haplotype flanks. Windows are extended by an additional REF_WINDOW_REUSE bp downstream so that they
+ // can be reused by nearby regions
+ bool ref_windows_;
+ static const int32_t REF_WINDOW_FLANK = 1000;
+ static const int32_t REF_WINDOW_REUSE = 100000;
+
+ // If true and entire chromosomes are loaded, the next chromosome in the region list is loaded in the background while the
+ // current chromosome's regions are analyzed
+ bool prefetch_chroms_;
+ std::unique_ptr<ReferencePrefetcher> open_ref_prefetcher(const std::string& fasta_dir);
+
+ // Start prefetching the chromosome of the first region group after GROUP_INDEX that isn't on the same chromosome, if there is one
+ void prefetch_next_chrom(ReferencePrefetcher& prefetcher, const std::vector<RegionGroup>& region_groups, size_t group_index);
+
+ // Reference whose windows were loaded into memory by preload_reference() and that's used instead of opening the FASTA files (or NULL)
+ std::shared_ptr<FastaReader> resident_fasta_;
+
+ // Returns the resident reference, if it's been loaded, or otherwise opens the FASTA files in FASTA_DIR and stores the reader in OWNER
+ FastaReader& open_fasta(std::string& fasta_dir, std::unique_ptr<FastaReader>& owner);
+
+ // True iff the log messages for the current locus are buffered until it's complete, which is always the case for workers.
+ // The buffered messages are then written in locus order by the output thread, which is the only thread that writes to the log
+ bool log_to_buffer_;
+ std::stringstream log_buffer_;
+
+ // Per-locus messages above this level are written to NULL_LOG_, a stream without a buffer that discards them before they're formatted
+ LogLevel log_level_;
+ std::ostream null_log_;
+
  protected:
  BaseQuality base_quality_;
 
  bool bams_from_10x_; // True iff BAMs were generated from 10X GEMCODE platform
 
+ // Selects the loci for which the debugging outputs (--viz-out, --pass-bam and --filt-bam) are written. DEBUG_LOCUS_
+ // is true iff the locus being analyzed was selected
+ LocusSampler debug_sampler_;
+ bool debug_locus_;
+
+ // Queue shared by the threads that process regions concurrently, through which a thread can split the work
+ // for a large locus with the threads that have run out of regions. NULL unless this processor is a worker
+ TaskQueue* task_queue_;
+
+ // Receives the number of loci and reads processed during process_regions(), if progress reporting is enabled
+ ProgressReporter* progress_;
+ int progress_interval_;      // Seconds between progress reports, or 0 if they're disabled
+ std::string progress_file_;  // Progress status file. Reports are written to standard error if it's empty
+
+ // Receives each locus' outcome and phase times, the reads processed and the pipeline's queue depths, if metrics are exported.
+ // Workers share the exporter owned by the processor that enabled it
+ MetricsExporter* metrics_;
+ std::unique_ptr<MetricsExporter> metrics_exporter_;
+
+ int num_failed_loci_;    // Number of region groups abandoned due to an error
+ int num_timed_out_loci_; // Number of region groups abandoned as they exceeded the time limit
+ int64_t num_skip_listed_; // Number of regions skipped because they overlapped a locus in the skip list
+
+ // Time spent in each phase for the current locus and for all loci analyzed by this processor
+ ProcessTimer locus_timer_;
+ ProcessTimer total_timer_;
+
+ // If true, the reads for each region are only prepared, and not genotyped, to measure the throughput of the I/O phases
+ bool io_only_;
+ double io_start_time_;
+ IOThroughputStats io_stats_;
+
  bool log_to_file_;
  std::ofstream log_;
 
  std::set<std::string> sample_set_;
 
+ // Copy the settings of the parent processor into this worker processor
+ void init_worker(const BamProcessor& parent);
+
+ // Buffer the log messages until they're retrieved by extract_locus_output()
+ void buffer_log(){ log_to_buffer_ = true; }
+
+ // Construct an independent processor with identical settings that can analyze regions on a separate thread
+ virtual BamProcessor* create_worker(){
+   printErrorAndDie("Multithreaded processing is not supported by this type of analysis");
+   return NULL;
+ }
+
+ // Add the summary statistics accumulated by a worker processor to those of this processor
+ virtual void merge_worker_stats(BamProcessor* worker){
+   total_timer_.add_times(worker->total_timer_);
+   num_failed_loci_    += worker->num_failed_loci_;
+   num_timed_out_loci_ += worker->num_timed_out_loci_;
+   io_stats_.add(worker->io_stats_);
+ }
+
+ // Record a region group abandoned as it exceeded the time limit, after its other output has been discarded
+ virtual void record_timed_out_locus(const RegionGroup& region_group){}
+
+ // Move the output buffered for the current locus into the provided structure
+ virtual void extract_locus_output(LocusOutput& output){
+   if (log_to_buffer_){
+     output.log = log_buffer_.str();
+     log_buffer_.str("");
+     log_buffer_.clear();
+   }
+ }
+
+ // Discard the output buffered for the current locus, apart from its log messages
+ virtual void discard_locus_output(){}
+
+ // Flush each output file so that it only contains complete records (and BGZF blocks) and add its path and size to FILES
+ virtual void flush_output_files(std::vector< std::pair<std::string, int64_t> >& files){}
+
+ // Returns true iff the output file at PATH should be appended to rather than overwritten, as the run is resuming from a checkpoint.
+ // In that case, the file is first truncated to its checkpointed size
+ bool append_to_output(const std::string& path);
+
+ // Redirect the output for subsequent loci to the files for a batch of regions from the work queue, with the provided path prefix
+ virtual void open_batch_output(const std::string& prefix){}
+ virtual void close_batch_output(){}
+
+ // Combine the outputs for each batch of regions, with the provided path prefixes, into the run's output files
+ virtual void merge_batch_outputs(const std::vector<std::string>& prefixes){}
+
+ // Write the buffered output for a locus to the relevant output streams
+ virtual void write_locus_output(LocusOutput& output){
+   if (!output.log.empty())
+     log_sink() << output.log << std::flush;
+ }
+
+ // The stream to which unbuffered log messages are written
+ inline std::ostream& log_sink(){ return (log_to_file_ ? log_ : std::cerr); }
+
   public:
- BamProcessor(bool use_bam_rgs, bool remove_pcr_dups){
+ BamProcessor(bool use_bam_rgs, bool remove_pcr_dups) : null_log_(NULL){
    use_bam_rgs_             = use_bam_rgs;
    rem_pcr_dups_            = remove_pcr_dups;
    MAX_MATE_DIST            = 1000;
+   MAX_GROUP_DIST           = 0;
+   MAX_GROUP_REGIONS        = 3;
    MIN_BP_BEFORE_INDEL      = 7;
    MIN_FLANK                = 5;
    MIN_READ_END_MATCH       = 10;
    MAXIMAL_END_MATCH_WINDOW = 15;
    REQUIRE_SPANNING         = true;
    REQUIRE_PAIRED_READS     = 1;
-   total_bam_seek_time_     = 0;
-   locus_bam_seek_time_     = -1;
-   total_read_filter_time_  = 0;
-   locus_read_filter_time_  = -1;
    MAX_STR_LENGTH           = 100;
    MIN_SUM_QUAL_LOG_PROB    = -10;
    log_to_file_             = false;
    MAX_TOTAL_READS          = 1000000;
+   MAX_SAMPLE_DEPTH         = 0;
    BASE_QUAL_TRIM           = '5';
    bams_from_10x_           = false;
+   num_threads_             = 1;
+   prefetch_loci_           = 0;
+   numa_workers_            = false;
+   ref_windows_             = false;
+   prefetch_chroms_         = false;
+   log_to_buffer_           = false;
+   log_level_               = LOG_LOCUS;
+   task_queue_              = NULL;
+   progress_                = NULL;
+   metrics_                 = NULL;
+   progress_interval_       = 0;
+   checkpoint_interval_     = 0;
+   work_batch_seconds_      = 0;
+   work_coordinator_        = false;
+   first_region_            = 0;
+   locus_start_             = locus_end_ = 0;
+   last_region_             = 0;
+   byte_shard_              = 0;
+   num_byte_shards_         = 0;
+   num_skip_listed_         = 0;
+   resuming_                = false;
+   skip_failed_loci_        = false;
+   num_failed_loci_         = 0;
+   locus_timeout_           = 0;
+   num_timed_out_loci_      = 0;
+   debug_locus_             = true;
+   io_only_                 = false;
+   io_start_time_           = 0;
  }
 
  ~BamProcessor(){
@@ -88,23 +406,126 @@ class BamProcessor {
      log_.close();
  }
 
- double total_bam_seek_time()    { return total_bam_seek_time_;    }
- double locus_bam_seek_time()    { return locus_bam_seek_time_;    }
- double total_read_filter_time() { return total_read_filter_time_; }
- double locus_read_filter_time() { return locus_read_filter_time_; }
+ const ProcessTimer& total_timer() { return total_timer_;           }
  void use_custom_read_groups()   { use_bam_rgs_ = false;           }
  void allow_pcr_dups()           { rem_pcr_dups_ = false;          }
+ void use_reference_windows()    { ref_windows_  = true;           }
+ void prefetch_chromosomes()     { prefetch_chroms_ = true;        }
+ void io_only()                  { io_only_ = true; io_start_time_ = ProcessTimer::wall_clock(); }
+ void skip_failed_loci()         { skip_failed_loci_ = true;       }
+ void use_numa_workers()         { numa_workers_ = true;           }
+ int  num_threads()              { return num_threads_;            }
+
+ void set_locus_timeout(double seconds){
+   if (seconds <= 0)
+     printErrorAndDie("The per-locus time limit must be greater than 0 seconds");
+   locus_timeout_ = seconds;
+ }
+
+ void set_num_threads(int num_threads){
+   if (num_threads < 1)
+     printErrorAndDie("The number of threads must be greater than 0");
+   num_threads_ = num_threads;
+ }
+
+ void set_prefetch_loci(int num_loci){
+   if (num_loci < 1)
+     printErrorAndDie("The number of loci to prefetch must be greater than 0");
+   prefetch_loci_ = num_loci;
+ }
+
+ void set_debug_sample_rate(double rate)       { debug_sampler_.set_rate(rate);         }
+ void set_debug_max_loci(int64_t max_loci)     { debug_sampler_.set_max_loci(max_loci); }
+ const LocusSampler& debug_sampler() const     { return debug_sampler_;                 }
+
+ void set_packed_reference(std::string path){ packed_ref_path_ = path; }
+ void set_region_catalog(std::string path)  { region_catalog_path_ = path; }
+ const std::string& region_catalog_path() const { return region_catalog_path_; }
+ void set_region_range(int64_t first_region, int64_t last_region){
+   if (first_region < 1 || last_region < first_region)
+     printErrorAndDie("Invalid range of regions. The range must be of the form START-END, where 1 <= START <= END");
+   first_region_ = first_region;
+   last_region_  = last_region;
+ }
+ // Only analyze the regions that overlap the 0-based, half-open interval START-END on CHROM
+ void set_locus(const std::string& chrom, int32_t start, int32_t end){
+   locus_chrom_ = chrom;
+   locus_start_ = start;
+   locus_end_   = end;
+ }
+ bool single_locus() const { return !locus_chrom_.empty(); }
+ void add_chrom_to_list(const std::string& chrom){ chrom_list_.insert(chrom); }
+ const std::set<std::string>& chrom_list() const { return chrom_list_; }
+ void set_skip_list(const std::string& path){ skip_list_ = std::make_shared<LocusSkipList>(path); }
+ void set_byte_shard(int shard, int num_shards){
+   if (num_shards < 1 || shard < 1 || shard > num_shards)
+     printErrorAndDie("Invalid byte-balanced shard. The shard must be of the form SHARD/NUM_SHARDS, where 1 <= SHARD <= NUM_SHARDS");
+   byte_shard_      = shard-1;
+   num_byte_shards_ = num_shards;
+ }
+
+ void reuse_read_filters(){ read_filter_cache_.reset(new ReadFilterCache()); }
+ void set_read_store_input(std::string path) { read_store_in_  = std::make_shared<StrReadStoreReader>(path); }
+ void set_read_store_output(std::string path){ read_store_out_ = std::make_shared<StrReadStoreWriter>(path); }
+
+ void set_checkpointing(std::string checkpoint_file, int interval){
+   if (interval <= 0)
+     printErrorAndDie("The checkpoint interval must be greater than 0 seconds");
+   checkpoint_file_     = checkpoint_file;
+   checkpoint_interval_ = interval;
+ }
+
+ // Claim batches of regions from the work queue in the shared directory, each of which should take roughly BATCH_SECONDS to analyze.
+ // The coordinator combines every batch's output once they're all complete
+ void set_work_queue(std::string work_dir, double batch_seconds, bool coordinator){
+   if (batch_seconds <= 0)
+     printErrorAndDie("The target duration of each work queue batch must be greater than 0 seconds");
+   work_dir_           = work_dir;
+   work_batch_seconds_ = batch_seconds;
+   work_coordinator_   = coordinator;
+ }
+
+ bool using_work_queue() const { return !work_dir_.empty(); }
+
+ // Resume an interrupted run from the checkpoint in the provided file. Must be invoked before any of the output files are opened
+ void resume_from_checkpoint(std::string checkpoint_file);
+
+ void set_progress_reporting(int interval, std::string status_file){
+   if (interval <= 0)
+     printErrorAndDie("The progress reporting interval must be greater than 0 seconds");
+   progress_interval_ = interval;
+   progress_file_     = status_file;
+ }
+
+ // Periodically write the run's metrics to METRICS_FILE in the Prometheus text format, every INTERVAL seconds
+ void set_metrics_file(const std::string& metrics_file, int interval){
+   metrics_exporter_.reset(new MetricsExporter(metrics_file, interval));
+   metrics_ = metrics_exporter_.get();
+ }
 
  void process_regions(BamCramMultiReader& reader,
 		      std::string& region_file, std::string& fasta_dir,
 		      std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library,
 		      BamWriter* pass_writer, BamWriter* filt_writer,
 		      std::ostream& out, int32_t max_regions, std::string chrom);
+
+ // Loads the sorted regions that process_regions() would analyze, omitting those in the skip list
+ void load_regions(std::string& region_file, int32_t max_regions, std::string chrom, std::vector<Region>& regions);
+
+ // Analyzes the provided sorted regions, e.g. a subset of those returned by load_regions(), without any checkpointing or sharding
+ void process_loaded_regions(BamCramMultiReader& reader, std::vector<Region>& regions, std::string& fasta_dir,
+			     std::map<std::string, std::string>& rg_to_sample, std::map<std::string, std::string>& rg_to_library, std::ostream& out);
+
+ /*
+  * Loads the reference windows required to analyze the regions into memory, where they're retained by this processor and any
+  * processors later copied from it (e.g. in forked processes). Enables reference windows, as each region's window is then resident
+  */
+ void preload_reference(std::string& fasta_dir, const std::vector<Region>& regions);
   
  virtual void process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
 			    std::vector<BamAlnList>& mate_pairs_by_rg,
 			    std::vector<BamAlnList>& unpaired_strs_by_rg,
-			    std::vector<std::string>& rg_names, RegionGroup& region_group, std::string& chrom_seq,
+			    std::vector<std::string>& rg_names, RegionGroup& region_group, const ReferenceSequence& chrom_seq,
 			    std::ostream& out){
    log("Doing nothing with reads");
  }
@@ -114,20 +535,24 @@ class BamProcessor {
    if (log_to_file_)
      printErrorAndDie("Cannot reset the log file multiple times");
    log_to_file_ = true;
-   log_.open(log_file, std::ofstream::out);
+   log_.open(log_file, resuming_ ? std::ofstream::app : std::ofstream::out);
    if (!log_.is_open())
      printErrorAndDie("Failed to open the log file: " + log_file);
  }
 
+ void set_log_level(LogLevel level){ log_level_ = level; }
+ inline bool log_enabled(LogLevel level) const { return level <= log_level_; }
+
  inline void log(std::string msg){
-   if (log_to_file_)
-     log_ << msg << std::endl;
-   else
-     std::cerr << msg << std::endl;
+   logger() << msg << std::endl;
  }
 
- inline std::ostream& logger(){
-   return (log_to_file_ ? log_ : std::cerr);
+ // Returns the stream for a message of the provided level. Buffered messages are only flushed to a string,
+ // so the log file is never flushed while a locus is being processed
+ inline std::ostream& logger(LogLevel level = LOG_LOCUS){
+   if (log_to_buffer_)
+     return (level <= log_level_ ? log_buffer_ : null_log_);
+   return log_sink();
  }
 
  void set_sample_set(std::string sample_names){
@@ -145,6 +570,8 @@ class BamProcessor {
  static void passes_filters(BamAlignment& aln, std::vector<bool>& region_passes);
 
  int32_t MAX_MATE_DIST;
+ int32_t MAX_GROUP_DIST;        // If > 0, consecutive regions within this many bp of one another are grouped and analyzed jointly
+ int     MAX_GROUP_REGIONS;     // Maximum number of regions in each group
  int32_t MIN_BP_BEFORE_INDEL;
  int32_t MIN_FLANK;
  int32_t MIN_READ_END_MATCH;
@@ -154,6 +581,7 @@ class BamProcessor {
  int     REQUIRE_PAIRED_READS;  // Only utilize paired STR reads to genotype individuals
  double  MIN_SUM_QUAL_LOG_PROB;
  int32_t MAX_TOTAL_READS;       // Skip loci where the number of STR reads passing all filters exceeds this limit
+ int32_t MAX_SAMPLE_DEPTH;      // If > 0, downsample each sample's STR reads to this depth before removing PCR duplicates
  char    BASE_QUAL_TRIM;        // Trim boths ends of the read until encountering a base with quality greater than this threshold
  bool    TOO_MANY_READS;        // Flag set if the current locus being processed as too many reads
 };
@@ -2,27 +2,77 @@
 #include <assert.h>
 #include <map>
 #include <sstream>
+#include <string.h>
 
 #include "base_quality.h"
 #include "error.h"
 #include "mathops.h"
 #include "stringops.h"
 
-std::string BaseQuality::median_base_qualities(const std::vector<const std::string*>& qualities){
-  assert(qualities.size() > 0);
-
-  // Check that all base quality strings are of the same length
-  for (unsigned int i = 0; i < qualities.size(); i++)
-    if (qualities[i]->size() != qualities[0]->size())
-      printErrorAndDie("All base quality strings must be of the same length when averaging probabilities");
-
-  std::string median_qualities(qualities[0]->size(), 'N');
-  for (unsigned int i = 0; i < qualities[0]->size(); i++){
-    std::vector<char> quals;
-    for (unsigned int j = 0; j < qualities.size(); j++)
-      quals.push_back(qualities[j]->at(i));
-    std::sort(quals.begin(), quals.end());
-    median_qualities[i] = quals[quals.size()/2];
+std::string BaseQuality::median_base_qualities(const std::string& qualities, int num_strings){
+  assert(num_strings > 0 && qualities.size() % num_strings == 0);
+  if (num_strings == 1)
+    return qualities;
+
+  // Pools of amplicon reads frequently have identical quality strings, whose median is any one of the strings
+  size_t length = qualities.size()/num_strings;
+  const char* first = qualities.data();
+  int num_identical = 1;
+  while (num_identical < num_strings && memcmp(first, first + num_identical*length, length) == 0)
+    num_identical++;
+  if (num_identical == num_strings)
+    return qualities.substr(0, length);
+
+  // The median is the element at index NUM_STRINGS/2 of the sorted qualities
+  std::string median_qualities(length, 'N');
+  if (num_strings < MIN_BLOCKED_MEDIAN_STRINGS){
+    int counts[256] = {0};
+    for (size_t i = 0; i < length; i++){
+      unsigned char min_qual = 255, max_qual = 0;
+      for (size_t index = i; index < qualities.size(); index += length){
+	unsigned char qual = qualities[index];
+	counts[qual]++;
+	min_qual = std::min(min_qual, qual);
+	max_qual = std::max(max_qual, qual);
+      }
+
+      int num_below = 0;
+      for (int qual = min_qual; qual <= max_qual; qual++){
+	if (num_below <= num_strings/2 && num_below + counts[qual] > num_strings/2)
+	  median_qualities[i] = (char)qual;
+	num_below  += counts[qual];
+	counts[qual] = 0;
+      }
+    }
+    return median_qualities;
+  }
+
+  // For large pools, striding through the strings one position at a time misses the cache for every quality. Instead, the histograms
+  // for a block of positions are filled by reading each string's segment for the block sequentially
+  const unsigned char* quals = (const unsigned char*)qualities.data();
+  int counts[MEDIAN_BLOCK_SIZE][256];
+  memset(counts, 0, sizeof(counts));
+  for (size_t block_start = 0; block_start < length; block_start += MEDIAN_BLOCK_SIZE){
+    size_t block_size = std::min<size_t>(MEDIAN_BLOCK_SIZE, length - block_start);
+    for (int n = 0; n < num_strings; n++){
+      const unsigned char* segment = quals + n*length + block_start;
+      for (size_t j = 0; j < block_size; j++)
+	counts[j][segment[j]]++;
+    }
+
+    for (size_t j = 0; j < block_size; j++){
+      int num_below = 0, qual = 0;
+      while (num_below + counts[j][qual] <= num_strings/2)
+	num_below += counts[j][qual++];
+      median_qualities[block_start+j] = (char)qual;
+    }
+
+    // Only the counts for the qualities in the block are non-zero, so they're reset rather than clearing every histogram
+    for (int n = 0; n < num_strings; n++){
+      const unsigned char* segment = quals + n*length + block_start;
+      for (size_t j = 0; j < block_size; j++)
+	counts[j][segment[j]] = 0;
+    }
   }
   return median_qualities;
 }
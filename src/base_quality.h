@@ -2,6 +2,7 @@
 #define BASE_QUALITY_H_
 
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -21,19 +22,24 @@ class BaseQuality {
  private:
   const static int MAX_QUAL_INDEX = MAX_BASE_QUALITY - MIN_BASE_QUALITY;
 
-  // Log likelihoods for quality scores
+  // Log likelihoods for quality scores, indexed by the unsigned value of each quality character. Scores outside
+  // of the expected range are clamped when the tables are filled, so that lookups don't require any branches
   double log_correct_[256];
   double log_error_[256];
 
  public:
   BaseQuality(){
     // Precalculate log likelihoods
-    log_correct_[0] = -100000;
-    log_error_[0]   = -LOG_3;
-
-    for (int i = 1; i <= MAX_QUAL_INDEX; ++i){
-      log_correct_[i] = log(1.0 - pow(10.0, i/(-10.0)));
-      log_error_[i]   = log(pow(10.0, i/(-10.0))/3.0);
+    for (int i = 0; i < 256; ++i){
+      int qual_index = std::min(std::max((char)i - MIN_BASE_QUALITY, 0), (int)MAX_QUAL_INDEX);
+      if (qual_index == 0){
+	log_correct_[i] = -100000;
+	log_error_[i]   = -LOG_3;
+      }
+      else {
+	log_correct_[i] = log(1.0 - pow(10.0, qual_index/(-10.0)));
+	log_error_[i]   = log(pow(10.0, qual_index/(-10.0))/3.0);
+      }
     }
   }
 
@@ -41,47 +47,35 @@ class BaseQuality {
    * Returns the log likelihood that the base with the
    * provided quality score should match a different base
    */
-  double log_prob_error(char quality) {
-    int qual_index = quality - MIN_BASE_QUALITY;
-    if (quality < MIN_BASE_QUALITY){
-      //std::cerr << "WARNING: Base quality " << quality << " outside of expected range. Proceeding using minimum expected score " << std::endl; 
-      return log_error_[0];
-    }
-    else if (quality > MAX_BASE_QUALITY) {
-      //std::cerr << "WARNING: Base quality " << quality << " outside of expected range. Proceeding using maximum expected score " << std::endl;
-      return log_error_[MAX_QUAL_INDEX];
-    }
-    else
-      return log_error_[qual_index];
+  inline double log_prob_error(char quality) const {
+    return log_error_[(unsigned char)quality];
   }
 
-
   /*
    * Returns the log likelihood that the base with the
    * provided quality score was observed without error
    */  
-  double log_prob_correct(char quality){
-    int qual_index = quality - MIN_BASE_QUALITY;
-    if (quality < MIN_BASE_QUALITY){
-      ///std::cerr << "WARNING: Base quality " << quality << " outside of expected range. Proceeding using minimum expected score " << std::endl; 
-      return log_correct_[0];
-    }
-    else if (quality > MAX_BASE_QUALITY) {
-      //std::cerr << "WARNING: Base quality " << quality << " outside of expected range. Proceeding using maximum expected score " << std::endl;
-      return log_correct_[MAX_QUAL_INDEX];
-    }
-    else
-      return log_correct_[qual_index];
+  inline double log_prob_correct(char quality) const {
+    return log_correct_[(unsigned char)quality];
   }
 
-  double sum_log_prob_correct(const std::string& qualities){
+  // QUALITIES can be a std::string or any other Phred+33 encoded sequence supporting size() and operator[], such as a QualityView
+  template<typename QualitySeq>
+  double sum_log_prob_correct(const QualitySeq& qualities){
     double sum = 0.0;
     for (unsigned int i = 0; i < qualities.size(); i++)
       sum += log_prob_correct(qualities[i]);
     return sum;
   }
 
-  std::string median_base_qualities(const std::vector<const std::string*>& qualities);
+  /*
+   * Returns the median quality at each position across NUM_STRINGS equal-length quality strings, which are
+   * stored consecutively in QUALITIES. Medians are extracted from a per-position histogram rather than by sorting.
+   * Pools with at least MIN_BLOCKED_MEDIAN_STRINGS strings fill the histograms for MEDIAN_BLOCK_SIZE positions at a time
+   */
+  const static int MIN_BLOCKED_MEDIAN_STRINGS = 16;
+  const static int MEDIAN_BLOCK_SIZE          = 32;
+  std::string median_base_qualities(const std::string& qualities, int num_strings);
 };
 
 #endif
@@ -0,0 +1,253 @@
+#include <getopt.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "htslib/htslib/tbx.h"
+
+#include "batch_summary.h"
+#include "bgzf_streams.h"
+#include "em_stutter_genotyper.h"
+#include "error.h"
+#include "mathops.h"
+#include "stringops.h"
+#include "stutter_model.h"
+#include "SeqAlignment/HaplotypeGenerator.h"
+
+bool file_exists(std::string path){
+  return (access(path.c_str(), F_OK) != -1);
+}
+
+void print_usage(int def_min_reads){
+  std::cerr << "Usage: BatchMerger --summaries <list_of_summaries> --ref-vcf-out <candidates.vcf.gz> --stutter-out <stutter_models.txt> [OPTIONS]" << "\n"
+	    << "\t" << "--summaries     <list_of_summaries>   " << "\t" << "Comma separated list of files produced by HipSTR's --batch-summary-out option,"  << "\n"
+	    << "\t" << "                                      " << "\t" << " one for each batch of samples. Either --summaries or --summary-files is required" << "\n"
+	    << "\t" << "--summary-files <summary_files.txt>   " << "\t" << "File containing the batch summaries to merge, one per line"                      << "\n"
+	    << "\t" << "--ref-vcf-out   <candidates.vcf.gz>   " << "\t" << "Output a VCF of each locus' candidate alleles, discovered using the reads from"   << "\n"
+	    << "\t" << "                                      " << "\t" << " every batch, for genotyping each batch with HipSTR's --ref-vcf option"          << "\n"
+	    << "\t" << "--stutter-out   <stutter_models.txt>  " << "\t" << "Output the stutter models learned using the reads from every batch, for"         << "\n"
+	    << "\t" << "                                      " << "\t" << " genotyping each batch with HipSTR's --stutter-in option"                        << "\n"
+	    << "\t" << "--min-reads     <num_reads>           " << "\t" << "Minimum total reads required to learn a locus' stutter model (Default = " << def_min_reads << ")" << "\n"
+	    << "\t" << "--haploid-chrs  <list_of_chroms>      " << "\t" << "Comma separated list of chromosomes to treat as haploid (Default = all diploid)"  << "\n"
+	    << "\n";
+}
+
+void parse_command_line_args(int argc, char** argv, std::string& summary_list, std::string& summary_file_list, std::string& ref_vcf_file,
+			     std::string& stutter_file, std::string& haploid_chr_string, int& min_reads){
+  if (argc == 1 || (argc == 2 && std::string("-h").compare(std::string(argv[1])) == 0)){
+    print_usage(min_reads);
+    exit(0);
+  }
+
+  static struct option long_options[] = {
+    {"haploid-chrs",  required_argument, 0, 't'},
+    {"min-reads",     required_argument, 0, 'i'},
+    {"ref-vcf-out",   required_argument, 0, 'o'},
+    {"stutter-out",   required_argument, 0, 's'},
+    {"summaries",     required_argument, 0, 'b'},
+    {"summary-files", required_argument, 0, 'B'},
+    {"help",          no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  while (true){
+    int option_index = 0;
+    c = getopt_long(argc, argv, "b:B:hi:o:s:t:", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch(c){
+    case 0:
+      break;
+    case 'b':
+      summary_list = std::string(optarg);
+      break;
+    case 'B':
+      summary_file_list = std::string(optarg);
+      break;
+    case 'h':
+      print_usage(min_reads);
+      exit(0);
+    case 'i':
+      min_reads = atoi(optarg);
+      break;
+    case 'o':
+      ref_vcf_file = std::string(optarg);
+      if (!string_ends_with(ref_vcf_file, ".gz"))
+	printErrorAndDie("Path for the reference VCF must end in .gz as it will be bgzipped");
+      break;
+    case 's':
+      stutter_file = std::string(optarg);
+      break;
+    case 't':
+      haploid_chr_string = std::string(optarg);
+      break;
+    case '?':
+      printErrorAndDie("Unrecognized command line option");
+      break;
+    default:
+      abort();
+      break;
+    }
+  }
+}
+
+// Learns the locus' stutter model from the reads of every batch, with the read cap and thresholds of GenotyperBamProcessor::learn_stutter_model()
+StutterModel* learn_stutter_model(LocusBatchSummary& summary, bool haploid, int min_reads){
+  const int MAX_INF_READS = 10000, MAX_EM_ITER = 100;
+  const double ABS_LL_CONVERGE = 0.01, FRAC_LL_CONVERGE = 0.001;
+
+  std::vector<std::string> samples;
+  std::vector< std::vector<int> > bp_diffs;
+  std::vector< std::vector<double> > log_p1s, log_p2s;
+  int inf_reads = 0;
+  for (unsigned int i = 0; i < summary.samples.size(); i++){
+    samples.push_back(summary.samples[i]);
+    bp_diffs.push_back(summary.bp_diffs[i]);
+    log_p1s.push_back(summary.log_p1s[i]);
+    log_p2s.push_back(summary.log_p2s[i]);
+    inf_reads += summary.bp_diffs[i].size();
+    if (inf_reads > MAX_INF_READS)
+      break;
+  }
+  if (inf_reads < min_reads)
+    return NULL;
+
+  EMStutterGenotyper length_genotyper(haploid, summary.period, bp_diffs, log_p1s, log_p2s, samples, 0);
+  std::stringstream train_log;
+  if (!length_genotyper.train(MAX_EM_ITER, ABS_LL_CONVERGE, FRAC_LL_CONVERGE, false, train_log))
+    return NULL;
+  return length_genotyper.get_stutter_model()->copy();
+}
+
+int main(int argc, char** argv){
+  precompute_integer_logs(); // Calculate and cache log of integers from 1 -> 999
+  std::string summary_list = "", summary_file_list = "", ref_vcf_file = "", stutter_file = "", haploid_chr_string = "";
+  int min_reads = 100;
+  parse_command_line_args(argc, argv, summary_list, summary_file_list, ref_vcf_file, stutter_file, haploid_chr_string, min_reads);
+
+  if (summary_list.empty() == summary_file_list.empty())
+    printErrorAndDie("You must specify exactly one of the --summaries or --summary-files options");
+  if (ref_vcf_file.empty() && stutter_file.empty())
+    printErrorAndDie("At least one of the --ref-vcf-out or --stutter-out options must be specified");
+
+  std::vector<std::string> summary_files;
+  if (!summary_list.empty())
+    split_by_delim(summary_list, ',', summary_files);
+  else {
+    std::ifstream input(summary_file_list.c_str());
+    if (!input.is_open())
+      printErrorAndDie("Failed to open the file containing the batch summaries: " + summary_file_list);
+    std::string line;
+    while (std::getline(input, line))
+      if (!line.empty())
+	summary_files.push_back(line);
+    input.close();
+  }
+
+  std::set<std::string> haploid_chroms;
+  if (!haploid_chr_string.empty()){
+    std::vector<std::string> chroms;
+    split_by_delim(haploid_chr_string, ',', chroms);
+    haploid_chroms.insert(chroms.begin(), chroms.end());
+  }
+
+  // Merge the summaries of each locus, retaining the order in which the chromosomes were encountered so that the VCF is sorted
+  std::vector<std::string> chroms;
+  std::map<std::string, std::map<std::pair<int32_t, int32_t>, LocusBatchSummary> > loci;
+  for (auto file_iter = summary_files.begin(); file_iter != summary_files.end(); file_iter++){
+    if (!file_exists(*file_iter))
+      printErrorAndDie("Batch summary file " + *file_iter + " does not exist");
+    std::cerr << "Merging batch summary " << *file_iter << std::endl;
+    bgzfistream input(file_iter->c_str());
+    std::string line;
+    while (std::getline(input, line)){
+      if (line.empty() || line[0] == '#')
+	continue;
+      LocusBatchSummary summary;
+      if (!summary.parse(line))
+	printErrorAndDie("Improperly formatted line in batch summary file " + *file_iter + ":\n" + line);
+      if (loci.find(summary.chrom) == loci.end())
+	chroms.push_back(summary.chrom);
+      std::map<std::pair<int32_t, int32_t>, LocusBatchSummary>& chrom_loci = loci[summary.chrom];
+      std::pair<int32_t, int32_t> key(summary.start, summary.stop);
+      auto locus_iter = chrom_loci.find(key);
+      if (locus_iter == chrom_loci.end())
+	chrom_loci.emplace(key, summary);
+      else
+	locus_iter->second.merge(summary);
+    }
+    input.close();
+  }
+
+  std::ofstream stutter_out;
+  if (!stutter_file.empty()){
+    stutter_out.open(stutter_file.c_str());
+    if (!stutter_out.is_open())
+      printErrorAndDie("Failed to open output file for stutter models");
+  }
+  bgzfostream vcf_out;
+  if (!ref_vcf_file.empty()){
+    vcf_out.open(ref_vcf_file.c_str());
+    vcf_out << "##fileformat=VCFv4.1" << "\n"
+	    << "##INFO=<ID=" << "START"  << ",Number=1,Type=Integer,Description=\"" << "Inclusive start coodinate for the repetitive portion of the reference allele" << "\">\n"
+	    << "##INFO=<ID=" << "END"    << ",Number=1,Type=Integer,Description=\"" << "Inclusive end coordinate for the repetitive portion of the reference allele"  << "\">\n"
+	    << "##INFO=<ID=" << "PERIOD" << ",Number=1,Type=Integer,Description=\"" << "Length of STR motif"                                                          << "\">\n";
+    for (auto chrom_iter = chroms.begin(); chrom_iter != chroms.end(); chrom_iter++)
+      vcf_out << "##contig=<ID=" << *chrom_iter << ">" << "\n";
+    vcf_out << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO" << "\n";
+  }
+
+  int num_loci = 0, num_models = 0, num_candidates = 0;
+  HaplotypeGenerator hap_generator(0, 0);
+  for (auto chrom_iter = chroms.begin(); chrom_iter != chroms.end(); chrom_iter++){
+    bool haploid = (haploid_chroms.find(*chrom_iter) != haploid_chroms.end());
+    std::map<std::pair<int32_t, int32_t>, LocusBatchSummary>& chrom_loci = loci[*chrom_iter];
+    for (auto locus_iter = chrom_loci.begin(); locus_iter != chrom_loci.end(); locus_iter++){
+      LocusBatchSummary& summary = locus_iter->second;
+      num_loci++;
+      if (!stutter_file.empty()){
+	StutterModel* stutter_model = learn_stutter_model(summary, haploid, min_reads);
+	if (stutter_model != NULL){
+	  stutter_model->write_model(summary.chrom, summary.start, summary.stop, stutter_out);
+	  num_models++;
+	  delete stutter_model;
+	}
+      }
+      if (!ref_vcf_file.empty() && summary.has_candidates){
+	std::vector<std::string> sequences;
+	int32_t region_start, region_end;
+	hap_generator.select_candidate_seqs(summary.candidates, summary.period, sequences, region_start, region_end);
+	if (sequences.empty())
+	  continue;
+	vcf_out << summary.chrom << "\t" << region_start+1 << "\t" << "." << "\t" << sequences[0] << "\t";
+	if (sequences.size() == 1)
+	  vcf_out << ".";
+	for (unsigned int i = 1; i < sequences.size(); i++)
+	  vcf_out << (i == 1 ? "" : ",") << sequences[i];
+	vcf_out << "\t" << "." << "\t" << "." << "\t"
+		<< "START=" << summary.start+1 << ";END=" << summary.stop << ";PERIOD=" << summary.period << "\n";
+	num_candidates++;
+      }
+    }
+  }
+
+  if (!stutter_file.empty())
+    stutter_out.close();
+  if (!ref_vcf_file.empty()){
+    vcf_out.close();
+    if (tbx_index_build(ref_vcf_file.c_str(), 0, &tbx_conf_vcf) != 0)
+      printErrorAndDie("Failed to build the tabix index for the reference VCF " + ref_vcf_file);
+  }
+  std::cerr << "Merged the summaries of " << num_loci << " loci from " << summary_files.size() << " batches. Learned "
+	    << num_models << " stutter models and identified the candidate alleles for " << num_candidates << " loci" << std::endl;
+  return 0;
+}
@@ -0,0 +1,171 @@
+#include "batch_summary.h"
+
+#include <stdlib.h>
+
+#include <set>
+#include <sstream>
+
+#include "error.h"
+#include "stringops.h"
+
+namespace {
+bool parse_int(const std::string& token, int32_t& value){
+  char* end;
+  long val = strtol(token.c_str(), &end, 10);
+  if (token.empty() || *end != '\0')
+    return false;
+  value = (int32_t)val;
+  return true;
+}
+
+bool parse_double(const std::string& token, double& value){
+  char* end;
+  value = strtod(token.c_str(), &end);
+  return !token.empty() && *end == '\0';
+}
+
+void write_read(std::ostream& out, int bp_diff, double log_p1, double log_p2, int count){
+  out << bp_diff;
+  if (log_p1 != 0 || log_p2 != 0)
+    out << ":" << log_p1 << ":" << log_p2;
+  if (count > 1)
+    out << "x" << count;
+}
+
+bool parse_reads(const std::string& token, std::vector<int>& bp_diffs, std::vector<double>& log_p1s, std::vector<double>& log_p2s){
+  std::vector<std::string> reads;
+  split_by_delim(token, ',', reads);
+  for (auto read_iter = reads.begin(); read_iter != reads.end(); read_iter++){
+    std::string read = *read_iter;
+    int32_t count = 1;
+    size_t count_pos = read.find('x');
+    if (count_pos != std::string::npos){
+      if (!parse_int(read.substr(count_pos+1), count) || count < 1)
+	return false;
+      read = read.substr(0, count_pos);
+    }
+
+    std::vector<std::string> fields;
+    split_by_delim(read, ':', fields);
+    int32_t bp_diff;
+    double log_p1 = 0, log_p2 = 0;
+    if (fields.size() != 1 && fields.size() != 3)
+      return false;
+    if (!parse_int(fields[0], bp_diff))
+      return false;
+    if (fields.size() == 3 && (!parse_double(fields[1], log_p1) || !parse_double(fields[2], log_p2)))
+      return false;
+    bp_diffs.insert(bp_diffs.end(), count, bp_diff);
+    log_p1s.insert(log_p1s.end(),   count, log_p1);
+    log_p2s.insert(log_p2s.end(),   count, log_p2);
+  }
+  return true;
+}
+}
+
+void LocusBatchSummary::write(std::ostream& out) const {
+  // Print the sample fractions and phasing likelihoods with enough precision to be parsed without loss
+  std::ostringstream line;
+  line.precision(17);
+  line << chrom << "\t" << start+1 << "\t" << stop << "\t" << period << "\t";
+  for (unsigned int i = 0; i < samples.size(); i++){
+    if (i != 0)
+      line << ";";
+    line << samples[i] << "=";
+    unsigned int j = 0, num_written = 0;
+    while (j < bp_diffs[i].size()){
+      unsigned int k = j+1;
+      while (k < bp_diffs[i].size() && bp_diffs[i][k] == bp_diffs[i][j] && log_p1s[i][k] == log_p1s[i][j] && log_p2s[i][k] == log_p2s[i][j])
+	k++;
+      if (num_written++ != 0)
+	line << ",";
+      write_read(line, bp_diffs[i][j], log_p1s[i][j], log_p2s[i][j], k-j);
+      j = k;
+    }
+  }
+
+  line << "\t";
+  if (has_candidates){
+    line << candidates.region_start << "," << candidates.region_end << "," << candidates.ref_seq << ","
+	 << candidates.total_samples << "," << candidates.total_reads;
+    for (auto iter = candidates.support.begin(); iter != candidates.support.end(); iter++)
+      line << ";" << iter->first << "," << iter->second.sample_frac << "," << iter->second.num_reads << "," << iter->second.strong_samples;
+  }
+  else
+    line << ".";
+  out << line.str() << "\n";
+}
+
+bool LocusBatchSummary::parse(const std::string& line){
+  std::vector<std::string> fields;
+  split_by_delim(line, '\t', fields);
+  if (fields.size() != 6)
+    return false;
+
+  chrom = fields[0];
+  if (!parse_int(fields[1], start) || !parse_int(fields[2], stop) || !parse_int(fields[3], period))
+    return false;
+  start -= 1;
+
+  samples.clear(); bp_diffs.clear(); log_p1s.clear(); log_p2s.clear();
+  std::vector<std::string> sample_tokens;
+  split_by_delim(fields[4], ';', sample_tokens);
+  for (auto token_iter = sample_tokens.begin(); token_iter != sample_tokens.end(); token_iter++){
+    size_t eq_pos = token_iter->rfind('=');
+    if (eq_pos == std::string::npos)
+      return false;
+    samples.push_back(token_iter->substr(0, eq_pos));
+    bp_diffs.push_back(std::vector<int>());
+    log_p1s.push_back(std::vector<double>());
+    log_p2s.push_back(std::vector<double>());
+    if (!parse_reads(token_iter->substr(eq_pos+1), bp_diffs.back(), log_p1s.back(), log_p2s.back()))
+      return false;
+  }
+
+  candidates     = CandidateSeqCounts();
+  has_candidates = (fields[5].compare(".") != 0);
+  if (has_candidates){
+    std::vector<std::string> seq_tokens, values;
+    split_by_delim(fields[5], ';', seq_tokens);
+    if (seq_tokens.empty())
+      return false;
+    split_by_delim(seq_tokens[0], ',', values);
+    if (values.size() != 5 || !parse_int(values[0], candidates.region_start) || !parse_int(values[1], candidates.region_end)
+	|| !parse_int(values[3], candidates.total_samples) || !parse_int(values[4], candidates.total_reads))
+      return false;
+    candidates.ref_seq = values[2];
+    for (unsigned int i = 1; i < seq_tokens.size(); i++){
+      values.clear();
+      split_by_delim(seq_tokens[i], ',', values);
+      CandidateSeqSupport support;
+      if (values.size() != 4 || !parse_double(values[1], support.sample_frac) || !parse_int(values[2], support.num_reads)
+	  || !parse_int(values[3], support.strong_samples))
+	return false;
+      candidates.support[values[0]] = support;
+    }
+  }
+  return true;
+}
+
+void LocusBatchSummary::merge(const LocusBatchSummary& other){
+  if (other.chrom.compare(chrom) != 0 || other.start != start || other.stop != stop)
+    printErrorAndDie("Unable to merge the batch summaries of different loci");
+
+  std::set<std::string> sample_set(samples.begin(), samples.end());
+  for (unsigned int i = 0; i < other.samples.size(); i++){
+    if (sample_set.find(other.samples[i]) != sample_set.end())
+      printErrorAndDie("Sample " + other.samples[i] + " is present in more than one batch summary for the locus at " + chrom + ":" + std::to_string(start+1));
+    samples.push_back(other.samples[i]);
+    bp_diffs.push_back(other.bp_diffs[i]);
+    log_p1s.push_back(other.log_p1s[i]);
+    log_p2s.push_back(other.log_p2s[i]);
+  }
+
+  if (other.has_candidates){
+    if (has_candidates)
+      candidates.merge(other.candidates);
+    else
+      candidates = other.candidates;
+    has_candidates = true;
+  }
+}
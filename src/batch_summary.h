@@ -0,0 +1,54 @@
+#ifndef BATCH_SUMMARY_H_
+#define BATCH_SUMMARY_H_
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "SeqAlignment/HaplotypeGenerator.h"
+
+/*
+ * Summary of a locus for a batch of samples. Allele discovery and stutter training are joint across samples, but both only
+ * depend on quantities that can be combined across batches. Merging the summaries of every batch therefore determines the
+ * candidate alleles and stutter model that a single run with all of the samples would have used (see BatchMerger):
+ *  - The bp difference and phasing log-likelihoods of each read informative for stutter training, for each sample with reads
+ *  - The support for each candidate allele sequence (see CandidateSeqCounts), unless the locus is too near the chromosome ends
+ *
+ * Each region is summarized on a single tab-delimited line:
+ *   CHROM  START  END  PERIOD  STUTTER_READS  CANDIDATES
+ * START is 1-based. STUTTER_READS contains a SAMPLE=READS entry for each sample, separated by semicolons, where READS lists the
+ * bp difference of each read separated by commas. Reads with nonzero phasing log-likelihoods are written as BP_DIFF:LOG_P1:LOG_P2,
+ * and a run of N identical reads is abbreviated as READxN. CANDIDATES is either "." or WINDOW_START,WINDOW_END,REF_SEQ,TOTAL_SAMPLES,
+ * TOTAL_READS followed by ;SEQ,SAMPLE_FRAC,READS,STRONG_SAMPLES for each sequence, where the window coordinates are 0-based
+ */
+class LocusBatchSummary {
+ public:
+  std::string chrom;
+  int32_t start, stop;
+  int period;
+
+  std::vector<std::string> samples;
+  std::vector< std::vector<int> > bp_diffs;
+  std::vector< std::vector<double> > log_p1s, log_p2s;
+
+  bool has_candidates;
+  CandidateSeqCounts candidates;
+
+  LocusBatchSummary(){
+    start  = stop = -1;
+    period = 0;
+    has_candidates = false;
+  }
+
+  void write(std::ostream& out) const;
+
+  /* Parse the summary from a line written by write(). Returns false if the line is improperly formatted */
+  bool parse(const std::string& line);
+
+  /* Add the summary of the same locus for another batch, whose samples must differ from those of this batch */
+  void merge(const LocusBatchSummary& other);
+};
+
+#endif
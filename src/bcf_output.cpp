@@ -0,0 +1,86 @@
+#include "bcf_output.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+
+#include "error.h"
+
+#include "htslib/htslib/kstring.h"
+
+namespace {
+void append_uint32(uint32_t value, std::string& bytes){
+  for (int i = 0; i < 4; i++)
+    bytes.push_back((char)((value >> (8*i)) & 0xFF));
+}
+}
+
+bcf_hdr_t* create_bcf_header(const std::string& vcf_header, const std::vector<std::string>& chroms){
+  // Insert a contig line for each chromosome before the #CHROM line, as BCF records identify their chromosome by its index
+  size_t chrom_line = vcf_header.rfind("\n#CHROM");
+  if (chrom_line == std::string::npos)
+    printErrorAndDie("The VCF header doesn't contain a #CHROM line");
+  std::string text = vcf_header.substr(0, chrom_line+1);
+  std::set<std::string> added;
+  for (auto chrom_iter = chroms.begin(); chrom_iter != chroms.end(); chrom_iter++)
+    if (added.insert(*chrom_iter).second)
+      text += "##contig=<ID=" + *chrom_iter + ">\n";
+  text += vcf_header.substr(chrom_line+1);
+
+  bcf_hdr_t* header = bcf_hdr_init("r");
+  if (header == NULL || bcf_hdr_parse(header, (char*)text.c_str()) != 0)
+    printErrorAndDie("Failed to construct the BCF header");
+  return header;
+}
+
+void write_bcf_header(bcf_hdr_t* header, std::ostream& out){
+  kstring_t text = {0, 0, NULL};
+  if (bcf_hdr_format(header, 1, &text) != 0)
+    printErrorAndDie("Failed to format the BCF header");
+
+  // The header's length includes its terminating NUL character
+  std::string bytes("BCF\2\2", 5);
+  append_uint32(text.l+1, bytes);
+  bytes.append(text.s, text.l+1);
+  free(text.s);
+  out.write(bytes.data(), bytes.size());
+}
+
+void update_format_strings(const bcf_hdr_t* header, bcf1_t* record, const char* key, const std::vector<std::string>& values){
+  // Each sample's string is padded with NUL characters to the length of the longest string
+  size_t width = 1;
+  for (auto value_iter = values.begin(); value_iter != values.end(); value_iter++)
+    width = std::max(width, value_iter->size());
+  std::vector<char> buffer(width*values.size(), '\0');
+  for (unsigned int i = 0; i < values.size(); i++)
+    memcpy(buffer.data() + i*width, values[i].data(), values[i].size());
+  if (bcf_update_format_char(header, record, key, buffer.data(), buffer.size()) != 0)
+    printErrorAndDie("Failed to add the " + std::string(key) + " FORMAT field to the BCF record");
+}
+
+void write_bcf_record(const bcf_hdr_t* header, bcf1_t* record, std::ostream& out){
+  if (record->n_sample != bcf_hdr_nsamples(header))
+    printErrorAndDie("The number of samples in the BCF record doesn't match its header");
+
+  // Copying the record packs its fields into the shared and individual data blocks that make up its binary encoding
+  bcf1_t* packed = bcf_dup(record);
+  bcf_destroy(packed);
+
+  std::string bytes;
+  append_uint32(record->shared.l + 24, bytes);
+  append_uint32(record->indiv.l, bytes);
+  append_uint32((uint32_t)record->rid, bytes);
+  append_uint32((uint32_t)record->pos, bytes);
+  append_uint32((uint32_t)record->rlen, bytes);
+  uint32_t qual;
+  memcpy(&qual, &record->qual, 4);
+  append_uint32(qual, bytes);
+  append_uint32((uint32_t)record->n_allele << 16 | record->n_info, bytes);
+  append_uint32((uint32_t)record->n_fmt << 24 | record->n_sample, bytes);
+  bytes.append(record->shared.s, record->shared.l);
+  bytes.append(record->indiv.s, record->indiv.l);
+  out.write(bytes.data(), bytes.size());
+}
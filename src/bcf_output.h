@@ -0,0 +1,36 @@
+#ifndef BCF_OUTPUT_H_
+#define BCF_OUTPUT_H_
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "htslib/htslib/vcf.h"
+}
+
+/*
+ * Functions for writing BCF files through a BGZF output stream. Records are encoded into memory so that each locus' output can
+ * be buffered and written in order, in the same manner as VCF text
+ */
+
+// Create the BCF header for the VCF header text, adding a contig entry for each of the provided chromosomes.
+// The caller is responsible for destroying the header using bcf_hdr_destroy()
+bcf_hdr_t* create_bcf_header(const std::string& vcf_header, const std::vector<std::string>& chroms);
+
+// Write the binary encoding of the header, which must precede all of the records
+void write_bcf_header(bcf_hdr_t* header, std::ostream& out);
+
+// Write the binary encoding of the record, whose fields must all be described by the provided header
+void write_bcf_record(const bcf_hdr_t* header, bcf1_t* record, std::ostream& out);
+
+// Set the string FORMAT field KEY to the provided value for each sample
+void update_format_strings(const bcf_hdr_t* header, bcf1_t* record, const char* key, const std::vector<std::string>& values);
+
+// Round the value to the 2 decimal places written for floats in text VCFs, so that both formats contain identical values
+inline float round_vcf_float(double value){
+  return (float)(std::round(value*100)/100);
+}
+
+#endif
@@ -28,8 +28,19 @@ TODO:
 #include <err.h>
 #include <ostream>
 #include <stdexcept>
+#include <string>
 
 #include "htslib/htslib/bgzf.h"
+#include "htslib/htslib/hfile.h"
+
+// Returns the htslib mode that writes (MODE = "w") or appends to (MODE = "a") a BGZF file compressed at
+// LEVEL (0-9, where 1 is fastest), or at htslib's default level if LEVEL is negative
+inline std::string bgzf_write_mode(const char* mode, int level){
+  std::string full_mode(mode);
+  if (level >= 0)
+    full_mode += std::to_string(level);
+  return full_mode;
+}
 
 class bgzf_streambuf : public std::streambuf {
  private:
@@ -46,7 +57,8 @@ class bgzf_streambuf : public std::streambuf {
     close();
   }
   
-  void open(const char *_filename, const char *mode){
+  // If NUM_THREADS > 1, the written BGZF blocks are compressed using this many threads (see set_threads())
+  void open(const char *_filename, const char *mode, int num_threads = 0){
     if (_fp != NULL)
       throw std::invalid_argument("bgzf_streambuf: open: called on an open stream");
     
@@ -54,6 +66,8 @@ class bgzf_streambuf : public std::streambuf {
     if (_fp == NULL)
       err(1,"bgzf_open(%s,%s) failed", _filename, mode);
     filename = _filename;
+    if (num_threads > 1)
+      set_threads(num_threads);
   }
   
   void close(){
@@ -67,6 +81,23 @@ class bgzf_streambuf : public std::streambuf {
     _fp = NULL;
     filename = "";
   }
+
+  // Compress the output's BGZF blocks using the provided number of threads
+  void set_threads(int num_threads){
+    if (_fp == NULL)
+      return;
+    if (bgzf_mt(_fp, num_threads, 256) != 0)
+      err(1,"bgzf_mt(%s) failed", filename.c_str());
+  }
+
+  // Compress any buffered data into a complete BGZF block and write every completed block to the file,
+  // so that the file's contents form a valid BGZF stream (without the EOF marker written by close())
+  void flush_blocks(){
+    if (_fp == NULL)
+      return;
+    if (bgzf_flush(_fp) != 0 || hflush(_fp->fp) != 0)
+      err(1,"bgzf_flush(%s) failed", filename.c_str());
+  }
   
   virtual int uflow(){
     if (cur_val != -999){
@@ -146,21 +177,30 @@ class bgzfostream : public std::ostream {
   bgzf_streambuf buf;
  public:
   
- bgzfostream(const char* filename, const char *mode="w") : std::ostream(0) {
-    buf.open(filename, mode);
+ bgzfostream(const char* filename, const char *mode="w", int num_threads=0) : std::ostream(0) {
+    buf.open(filename, mode, num_threads);
     rdbuf(&buf);
   }
   
  bgzfostream() : std::ostream(0) {}
   
-  void open(const char* filename, const char *mode="w") {
-    buf.open(filename, mode);
+  void open(const char* filename, const char *mode="w", int num_threads=0) {
+    buf.open(filename, mode, num_threads);
     rdbuf(&buf);
   }
 
   void close(){
     buf.close();
   }
+
+  void set_threads(int num_threads){
+    buf.set_threads(num_threads);
+  }
+
+  void flush_blocks(){
+    flush();
+    buf.flush_blocks();
+  }
 };
 
 #endif
@@ -0,0 +1,206 @@
+#include "columnar_output.h"
+
+#include <string.h>
+
+#include "error.h"
+
+#include "htslib/htslib/bgzf.h"
+
+namespace {
+const uint32_t COLUMNS_VERSION = 1;
+
+void put_int32(int32_t value, std::ostream& out){
+  out.write((const char*)&value, sizeof(value));
+}
+
+void put_string(const std::string& value, std::ostream& out){
+  put_int32(value.size(), out);
+  out.write(value.data(), value.size());
+}
+
+template<typename T> void put_vector(const std::vector<T>& values, std::ostream& out){
+  put_int32(values.size(), out);
+  out.write((const char*)values.data(), values.size()*sizeof(T));
+}
+
+void get_bytes(const std::string& buffer, size_t& pos, void* dest, size_t num_bytes){
+  if (pos + num_bytes > buffer.size())
+    printErrorAndDie("Truncated locus in the buffered columnar output");
+  memcpy(dest, buffer.data() + pos, num_bytes);
+  pos += num_bytes;
+}
+
+int32_t get_int32(const std::string& buffer, size_t& pos){
+  int32_t value;
+  get_bytes(buffer, pos, &value, sizeof(value));
+  return value;
+}
+
+void get_string(const std::string& buffer, size_t& pos, std::string& value){
+  value.resize(get_int32(buffer, pos));
+  get_bytes(buffer, pos, &value[0], value.size());
+}
+
+template<typename T> void get_vector(const std::string& buffer, size_t& pos, std::vector<T>& values){
+  values.resize(get_int32(buffer, pos));
+  get_bytes(buffer, pos, values.data(), values.size()*sizeof(T));
+}
+
+void append_uint32(uint32_t value, std::string& bytes){
+  for (int i = 0; i < 4; i++)
+    bytes.push_back((char)((value >> (8*i)) & 0xFF));
+}
+
+void append_uint64(uint64_t value, std::string& bytes){
+  for (int i = 0; i < 8; i++)
+    bytes.push_back((char)((value >> (8*i)) & 0xFF));
+}
+
+void append_float(float value, std::string& bytes){
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  append_uint32(bits, bytes);
+}
+
+// Encoded values of a single column
+class Column {
+ public:
+  std::string name;
+  char type;
+  uint64_t num_values;
+  std::string data;
+
+  Column(const std::string& column_name, char column_type){
+    name       = column_name;
+    type       = column_type;
+    num_values = 0;
+  }
+
+  void add(int32_t value)           { append_uint32((uint32_t)value, data); num_values++; }
+  void add(float value)             { append_float(value, data);            num_values++; }
+  void add(const std::string& value){ data.append(value.c_str(), value.size()+1); num_values++; }
+};
+
+void write_bytes(BGZF* output, const std::string& bytes, const std::string& path){
+  if (bgzf_write(output, bytes.data(), bytes.size()) != (ssize_t)bytes.size())
+    printErrorAndDie("Failed to write to the columnar output file " + path);
+}
+}
+
+void LocusColumns::write(std::ostream& out) const {
+  put_string(chrom, out);
+  put_string(name, out);
+  put_int32(pos, out);
+  put_int32(start, out);
+  put_int32(end, out);
+  put_int32(period, out);
+  put_int32(alleles.size(), out);
+  for (auto allele_iter = alleles.begin(); allele_iter != alleles.end(); allele_iter++)
+    put_string(*allele_iter, out);
+  put_vector(bp_diffs, out);
+  put_vector(gt_a, out);
+  put_vector(gt_b, out);
+  put_vector(dp, out);
+  put_vector(dosage, out);
+  put_vector(q, out);
+}
+
+void LocusColumns::read(const std::string& buffer, size_t& pos){
+  get_string(buffer, pos, chrom);
+  get_string(buffer, pos, name);
+  this->pos = get_int32(buffer, pos);
+  start     = get_int32(buffer, pos);
+  end       = get_int32(buffer, pos);
+  period    = get_int32(buffer, pos);
+  alleles.resize(get_int32(buffer, pos));
+  for (unsigned int i = 0; i < alleles.size(); i++)
+    get_string(buffer, pos, alleles[i]);
+  get_vector(buffer, pos, bp_diffs);
+  get_vector(buffer, pos, gt_a);
+  get_vector(buffer, pos, gt_b);
+  get_vector(buffer, pos, dp);
+  get_vector(buffer, pos, dosage);
+  get_vector(buffer, pos, q);
+}
+
+void ColumnarWriter::add_loci(const std::string& buffer){
+  size_t pos = 0;
+  while (pos < buffer.size()){
+    loci_.push_back(LocusColumns());
+    loci_.back().read(buffer, pos);
+    if (loci_.back().gt_a.size() != samples_.size())
+      printErrorAndDie("The number of samples for a locus in the columnar output doesn't match the number of output samples");
+    if ((int)loci_.size() >= loci_per_chunk_)
+      write_chunk();
+  }
+}
+
+void ColumnarWriter::close(){
+  if (!loci_.empty())
+    write_chunk();
+}
+
+void ColumnarWriter::write_chunk(){
+  Column chrom("chrom", 's'), pos("pos", 'i'), start("start", 'i'), end("end", 'i'), period("period", 'i'), name("name", 's');
+  Column first_allele("first_allele", 'i'), num_alleles("num_alleles", 'i'), allele("allele", 's'), bp_diff("bp_diff", 'i');
+  Column gt_a("gt_a", 'i'), gt_b("gt_b", 'i'), dosage("dosage", 'f'), q("q", 'f'), dp("dp", 'i');
+  for (auto locus_iter = loci_.begin(); locus_iter != loci_.end(); locus_iter++){
+    chrom.add(locus_iter->chrom);
+    pos.add(locus_iter->pos);
+    start.add(locus_iter->start);
+    end.add(locus_iter->end);
+    period.add(locus_iter->period);
+    name.add(locus_iter->name);
+    first_allele.add((int32_t)allele.num_values);
+    num_alleles.add((int32_t)locus_iter->alleles.size());
+    for (unsigned int i = 0; i < locus_iter->alleles.size(); i++){
+      allele.add(locus_iter->alleles[i]);
+      bp_diff.add(locus_iter->bp_diffs[i]);
+    }
+  }
+
+  // Transpose the genotypes so that each sample's values are contiguous
+  for (unsigned int sample_index = 0; sample_index < samples_.size(); sample_index++){
+    for (auto locus_iter = loci_.begin(); locus_iter != loci_.end(); locus_iter++){
+      gt_a.add(locus_iter->gt_a[sample_index]);
+      gt_b.add(locus_iter->gt_b[sample_index]);
+      dosage.add(locus_iter->dosage[sample_index]);
+      q.add(locus_iter->q[sample_index]);
+      dp.add(locus_iter->dp[sample_index]);
+    }
+  }
+  std::vector<Column*> columns = {&chrom, &pos, &start, &end, &period, &name, &first_allele, &num_alleles,
+				  &allele, &bp_diff, &gt_a, &gt_b, &dosage, &q, &dp};
+
+  std::string path = prefix_ + "." + std::to_string(num_chunks_) + ".cols.bgz";
+  BGZF* output = bgzf_open(path.c_str(), "w");
+  if (output == NULL)
+    printErrorAndDie("Failed to open the columnar output file " + path);
+
+  std::string header("HSTRCOLS");
+  append_uint32(COLUMNS_VERSION, header);
+  append_uint32(loci_.size(), header);
+  append_uint32(samples_.size(), header);
+  append_uint32(allele.num_values, header);
+  append_uint32(columns.size(), header);
+  for (auto sample_iter = samples_.begin(); sample_iter != samples_.end(); sample_iter++)
+    header.append(sample_iter->c_str(), sample_iter->size()+1);
+  write_bytes(output, header, path);
+
+  for (auto column_iter = columns.begin(); column_iter != columns.end(); column_iter++){
+    // Start each column in a new block, so that readers only need to decompress the columns they require
+    if (bgzf_flush(output) != 0)
+      printErrorAndDie("Failed to write to the columnar output file " + path);
+    std::string column_header((*column_iter)->name.c_str(), (*column_iter)->name.size()+1);
+    column_header.push_back((*column_iter)->type);
+    append_uint64((*column_iter)->num_values,  column_header);
+    append_uint64((*column_iter)->data.size(), column_header);
+    write_bytes(output, column_header, path);
+    write_bytes(output, (*column_iter)->data, path);
+  }
+  if (bgzf_close(output) != 0)
+    printErrorAndDie("Failed to close the columnar output file " + path);
+
+  loci_.clear();
+  num_chunks_++;
+}
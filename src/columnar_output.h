@@ -0,0 +1,78 @@
+#ifndef COLUMNAR_OUTPUT_H_
+#define COLUMNAR_OUTPUT_H_
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * Columnar output of the STR genotypes, for loading into analytics stores without parsing VCF text.
+ * The loci are split into chunks, each of which is written to the bgzipped file <prefix>.<chunk index>.cols.bgz containing
+ *   magic "HSTRCOLS", followed by uint32 values for the format version, #loci, #samples, #alleles and #columns
+ *   the sample names, each terminated by a NUL character
+ *   the columns, each of which starts in a new BGZF block so that it's compressed independently. A column consists of its
+ *    NUL-terminated name, a type character ('i' = int32, 'f' = float, 's' = NUL-terminated strings), the uint64 number of values
+ *    and the uint64 number of bytes of value data, followed by the values themselves. All integers are little-endian
+ *
+ * Locus columns (1 value per locus):     chrom, pos, start, end, period, name, first_allele, num_alleles
+ * Allele columns (1 value per allele):   allele, bp_diff, where the alleles of locus i are at [first_allele[i], first_allele[i]+num_alleles[i])
+ *                                        and are ordered as in the VCF, with the reference allele first
+ * Genotype columns (1 value per sample
+ *  and locus, in sample-major order):    gt_a, gt_b, dosage, q, dp
+ *
+ * GT_A and GT_B are the genotype's allele indices within the locus, DOSAGE is the sum of their base pair differences from the reference,
+ * Q is the unphased posterior and DP is the number of reads used for genotyping. Missing genotypes have allele indices of -1, NaN dosages
+ * and posteriors and a DP of -1. Haploid genotypes have a GT_B of -1
+ */
+
+// Genotypes for a single locus, in the order of the output samples
+class LocusColumns {
+ public:
+  std::string chrom, name;
+  int32_t pos, start, end, period;
+  std::vector<std::string> alleles;
+  std::vector<int32_t> bp_diffs;
+  std::vector<int32_t> gt_a, gt_b, dp;
+  std::vector<float> dosage, q;
+
+  // Append the locus to OUT, which buffers the output for a locus until it is passed to ColumnarWriter::add_loci()
+  void write(std::ostream& out) const;
+
+  // Decode the locus at POS in the buffer and advance POS beyond it
+  void read(const std::string& buffer, size_t& pos);
+};
+
+class ColumnarWriter {
+ private:
+  std::string prefix_;
+  std::vector<std::string> samples_;
+  int loci_per_chunk_;
+  int num_chunks_;
+  std::vector<LocusColumns> loci_;
+
+  void write_chunk();
+
+ public:
+  ColumnarWriter(const std::string& prefix, const std::vector<std::string>& samples, int loci_per_chunk){
+    prefix_         = prefix;
+    samples_        = samples;
+    loci_per_chunk_ = loci_per_chunk;
+    num_chunks_     = 0;
+  }
+
+  ~ColumnarWriter(){
+    close();
+  }
+
+  // Add each of the loci encoded in the buffer, writing a chunk whenever enough loci have accumulated
+  void add_loci(const std::string& buffer);
+
+  // Write any remaining loci as the final chunk
+  void close();
+
+  int num_chunks() const { return num_chunks_; }
+};
+
+#endif
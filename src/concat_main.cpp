@@ -0,0 +1,101 @@
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include "error.h"
+#include "stringops.h"
+#include "vcf_concat.h"
+
+void print_usage(){
+  std::cerr << "Usage: VcfConcat --vcfs <list_of_vcfs> --out <output.vcf.gz> [--index]" << "\n"
+	    << "\t" << "--vcfs          <list_of_vcfs>        " << "\t" << "Comma separated list of bgzipped VCFs to concatenate, in output order."       << "\n"
+	    << "\t" << "                                      " << "\t" << " Each VCF must have an identical header, apart from its ##command line"        << "\n"
+	    << "\t" << "--vcf-files     <vcf_files.txt>       " << "\t" << "File containing bgzipped VCFs to concatenate, one per line"                   << "\n"
+	    << "\t" << "--out           <output.vcf.gz>       " << "\t" << "Write the concatenated bgzipped VCF to this file"                              << "\n"
+	    << "\t" << "--index                               " << "\t" << "Build a tabix index for the output VCF"                                       << "\n"
+	    << "\n";
+}
+
+void parse_command_line_args(int argc, char** argv, std::string& vcflist_string, std::string& vcffile_string, std::string& output_file, int& build_index){
+  if (argc == 1 || (argc == 2 && std::string("-h").compare(std::string(argv[1])) == 0)){
+    print_usage();
+    exit(0);
+  }
+
+  static struct option long_options[] = {
+    {"out",       required_argument, 0, 'o'},
+    {"vcfs",      required_argument, 0, 'v'},
+    {"vcf-files", required_argument, 0, 'V'},
+    {"index",     no_argument, &build_index, 1},
+    {"help",      no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  while (true){
+    int option_index = 0;
+    c = getopt_long(argc, argv, "ho:v:V:", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch(c){
+    case 0:
+      break;
+    case 'h':
+      print_usage();
+      exit(0);
+    case 'o':
+      output_file = std::string(optarg);
+      break;
+    case 'v':
+      vcflist_string = std::string(optarg);
+      break;
+    case 'V':
+      vcffile_string = std::string(optarg);
+      break;
+    case '?':
+      printErrorAndDie("Unrecognized command line option");
+      break;
+    default:
+      abort();
+      break;
+    }
+  }
+}
+
+int main(int argc, char** argv){
+  std::string vcflist_string = "", vcffile_string = "", output_file = "";
+  int build_index = 0;
+  parse_command_line_args(argc, argv, vcflist_string, vcffile_string, output_file, build_index);
+
+  if (output_file.empty())
+    printErrorAndDie("--out option required");
+  if (!string_ends_with(output_file, ".gz"))
+    printErrorAndDie("Path for the output VCF must end with .gz, as it will be bgzipped");
+  if (vcflist_string.empty() == vcffile_string.empty())
+    printErrorAndDie("You must specify exactly one of the --vcfs or --vcf-files options");
+
+  std::vector<std::string> vcf_files;
+  if (!vcflist_string.empty())
+    split_by_delim(vcflist_string, ',', vcf_files);
+  else {
+    std::ifstream input(vcffile_string.c_str());
+    if (!input.is_open())
+      printErrorAndDie("Failed to open VCF file list " + vcffile_string);
+    std::string line;
+    while (std::getline(input, line))
+      if (!line.empty())
+	vcf_files.push_back(line);
+    input.close();
+  }
+  for (auto vcf_iter = vcf_files.begin(); vcf_iter != vcf_files.end(); vcf_iter++)
+    if (vcf_iter->compare(output_file) == 0)
+      printErrorAndDie("The output VCF " + output_file + " can't also be one of the input VCFs");
+
+  std::cerr << "Concatenating " << vcf_files.size() << " VCFs into " << output_file << std::endl;
+  concatenate_bgzipped_vcfs(vcf_files, output_file, build_index != 0);
+  return 0;
+}
@@ -4,28 +4,93 @@
 #include <algorithm>
 #include <set>
 #include <sstream>
+#include <vector>
 
-bool path_comparator(DebruijnPath* p1, DebruijnPath* p2){
-  return p1->get_min_weight() < p2->get_min_weight();
-}
+#include "error.h"
 
 bool DebruijnGraph::is_source_ok(){
-  Node* source = get_node(source_kmer_);
+  Node* source = get_kmer_node(source_kmer_);
   return (source->num_departing_edges() > 0) && (source->num_incident_edges() == 0);
 }
 
 bool DebruijnGraph::is_sink_ok(){
-  Node* sink = get_node(sink_kmer_);
+  Node* sink = get_kmer_node(sink_kmer_);
   return (sink->num_incident_edges() > 0) && (sink->num_departing_edges() == 0);
 }
 
 bool DebruijnGraph::calc_kmer_length(std::string& ref_seq, int min_kmer, int max_kmer, int& kmer){
-  for (kmer = min_kmer; kmer <= max_kmer; kmer++){
-    DebruijnGraph graph(kmer, ref_seq);
-    if (!graph.has_cycles())
-      return true;
+  // The reference path only has a cycle if one of its k-mers occurs more than once, which also implies that every shorter k-mer
+  // length has a cycle. A single pass over the 2-bit packed sequence therefore inserts each k-mer into its length's open-addressing
+  // table, and a repeated k-mer of length k rules out all lengths <= k. Other bases or long k-mers fall back to building each graph
+  bool packable = (min_kmer > 0 && max_kmer <= MAX_PACKED_KMER);
+  for (unsigned int i = 0; packable && i < ref_seq.size(); i++)
+    packable = (KmerIterator::base_code(ref_seq[i]) != -1);
+  if (!packable){
+    for (kmer = min_kmer; kmer <= max_kmer; kmer++){
+      DebruijnGraph graph(kmer, ref_seq);
+      if (!graph.has_cycles())
+	return true;
+    }
+    return false;
+  }
+
+  if (min_kmer > max_kmer){
+    kmer = min_kmer;
+    return false;
+  }
+
+  const uint64_t EMPTY = ~0ULL;
+  int num_bits = 1;
+  while ((1 << num_bits) < 2*(int)ref_seq.size())
+    num_bits++;
+  const uint64_t table_mask = (1ULL << num_bits) - 1;
+  std::vector<uint64_t> tables((max_kmer-min_kmer+1) << num_bits, EMPTY);
+
+  kmer = min_kmer; // Shortest length without a repeated k-mer so far
+  uint64_t packed = 0;
+  for (int end = 0; end < (int)ref_seq.size(); end++){
+    packed = (packed << 2) | KmerIterator::base_code(ref_seq[end]);
+    for (int k = kmer; k <= std::min(max_kmer, end+1); k++){
+      uint64_t key    = packed & ((1ULL << (2*k)) - 1);
+      uint64_t* table = tables.data() + ((uint64_t)(k-min_kmer) << num_bits);
+      uint64_t slot   = (key*0x9E3779B97F4A7C15ULL) >> (64-num_bits);
+      while (table[slot] != EMPTY && table[slot] != key)
+	slot = (slot+1) & table_mask;
+      if (table[slot] == key)
+	kmer = k+1;
+      else
+	table[slot] = key;
+    }
+    if (kmer > max_kmer)
+      return false;
   }
-  return false;
+  return true;
+}
+
+int DebruijnGraph::get_kmer_node_id(const KmerIterator& kmer_iter, const std::string& seq){
+  if (!kmer_iter.is_packed()){
+    std::string kmer = seq.substr(kmer_iter.position(), k_);
+    return get_node(kmer)->get_id();
+  }
+  int32_t node_id = kmer_nodes_.find(kmer_iter.packed());
+  if (node_id == -1){
+    node_id = nodes_.size();
+    add_node(seq.substr(kmer_iter.position(), k_));
+    kmer_nodes_.insert(kmer_iter.packed(), node_id);
+  }
+  return node_id;
+}
+
+bool DebruijnGraph::has_kmer_node(std::string& kmer){
+  uint64_t packed;
+  if (KmerIterator::pack(kmer, packed))
+    return kmer_nodes_.find(packed) != -1;
+  return has_node(kmer);
+}
+
+Node* DebruijnGraph::get_kmer_node(std::string& kmer){
+  KmerIterator kmer_iter(kmer, k_);
+  return nodes_[get_kmer_node_id(kmer_iter, kmer)];
 }
 
 void DebruijnGraph::add_string(std::string& seq, int weight){
@@ -33,11 +98,12 @@ void DebruijnGraph::add_string(std::string& seq, int weight){
     return;
 
   num_strings_++;
-  std::string prev_kmer = seq.substr(0, k_);
-  for (int i = 1; i < seq.size()+1-k_; i++){
-    std::string next_kmer = seq.substr(i, k_);
-    increment_edge(prev_kmer, next_kmer, weight);
-    prev_kmer = next_kmer;
+  KmerIterator kmer_iter(seq, k_);
+  int prev_id = get_kmer_node_id(kmer_iter, seq);
+  for (kmer_iter.next(); !kmer_iter.done(); kmer_iter.next()){
+    int next_id = get_kmer_node_id(kmer_iter, seq);
+    increment_edge(prev_id, next_id, weight);
+    prev_id = next_id;
   }
 
   // Assume any new edges are not from the reference sequence
@@ -63,8 +129,8 @@ void DebruijnGraph::prune_edges(std::vector<bool>& remove_edges){
   assert(remove_edges.size() == edges_.size());
   int ins_index = 0;
   std::vector<bool> keep_node(nodes_.size(), false);
-  keep_node[get_node(source_kmer_)->get_id()] = true;
-  keep_node[get_node(sink_kmer_)->get_id()]   = true;
+  keep_node[get_kmer_node(source_kmer_)->get_id()] = true;
+  keep_node[get_kmer_node(sink_kmer_)->get_id()]   = true;
 
   // Filter all requested edges
   for (unsigned int i = 0; i < edges_.size(); i++){
@@ -95,6 +161,7 @@ void DebruijnGraph::prune_edges(std::vector<bool>& remove_edges){
   std::vector<int> node_indices(nodes_.size(), -1);
   int num_nodes = 0;
   node_map_.clear();
+  kmer_nodes_.clear();
   for (unsigned int i = 0; i < nodes_.size(); i++){
     if (keep_node[i]){
       nodes_[i]->set_id(num_nodes);
@@ -103,7 +170,11 @@ void DebruijnGraph::prune_edges(std::vector<bool>& remove_edges){
 	nodes_[num_nodes]       = nodes_[i];
 	node_labels_[num_nodes] = node_labels_[i];
       }
-      node_map_[node_labels_[num_nodes]] = num_nodes;
+      uint64_t packed;
+      if (KmerIterator::pack(node_labels_[num_nodes], packed))
+	kmer_nodes_.insert(packed, num_nodes);
+      else
+	node_map_[node_labels_[num_nodes]] = num_nodes;
       num_nodes++;
     }
     else
@@ -117,6 +188,7 @@ void DebruijnGraph::prune_edges(std::vector<bool>& remove_edges){
     edges_[i]->set_source(node_indices[edges_[i]->get_source()]);
     edges_[i]->set_destination(node_indices[edges_[i]->get_destination()]);
   }
+  index_edges();
 }
 
 /*
@@ -132,8 +204,8 @@ void DebruijnGraph::get_alt_kmer_nodes(std::string& kmer, bool source, bool sink
     for (unsigned int j = 0; j < 4; ++j){
       if (bases[j] != orig){
 	kmer[i] = bases[j];
-	if (has_node(kmer)){
-	  Node* node = get_node(kmer);
+	if (has_kmer_node(kmer)){
+	  Node* node = get_kmer_node(kmer);
 	  if (source && node->num_incident_edges() > 0)
 	    continue;
 	  if (sink && node->num_departing_edges() > 0)
@@ -146,23 +218,30 @@ void DebruijnGraph::get_alt_kmer_nodes(std::string& kmer, bool source, bool sink
   }
 }
 
-void DebruijnGraph::enumerate_paths(int min_weight, int max_paths, std::vector<std::pair<std::string, int> >& paths){
+bool DebruijnGraph::enumerate_paths(int min_weight, int max_paths, std::vector<std::pair<std::string, int> >& paths){
   assert(paths.empty());
 
+  // Every path is stored in the pool, while the heap contains the pool indices of the paths that haven't been extended.
+  // The heap is ordered so that the path with the largest minimum edge weight is always extended next
+  std::vector<DebruijnPath> path_pool;
+  std::vector<int> heap;
+  auto path_comparator = [&path_pool](int p1, int p2){
+    return path_pool[p1].get_min_weight() < path_pool[p2].get_min_weight();
+  };
+
   // Create a heap containing the source node
-  Node* source = get_node(source_kmer_);
-  Node* sink   = get_node(sink_kmer_);
+  Node* source = get_kmer_node(source_kmer_);
+  Node* sink   = get_kmer_node(sink_kmer_);
   int sink_id  = sink->get_id();
-  std::vector<DebruijnPath*> all_paths(1, new DebruijnPath(source->get_id()));
-  std::vector<DebruijnPath*> heap(1, all_paths.back());
-  std::make_heap(heap.begin(), heap.end(), path_comparator);
+  path_pool.push_back(DebruijnPath(source->get_id()));
+  heap.push_back(0);
 
   // Add all kmers that differ by a 1 bp mismatch from the source kmer to the heap
   std::vector<Node*> alt_source_nodes;
   get_alt_kmer_nodes(source_kmer_, true, false, alt_source_nodes);
   for (unsigned int i = 0; i < alt_source_nodes.size(); i++){
-    all_paths.push_back(new DebruijnPath(alt_source_nodes[i]->get_id()));
-    heap.push_back(all_paths.back());
+    path_pool.push_back(DebruijnPath(alt_source_nodes[i]->get_id()));
+    heap.push_back(path_pool.size()-1);
     std::push_heap(heap.begin(), heap.end(), path_comparator);
   }
 
@@ -173,44 +252,45 @@ void DebruijnGraph::enumerate_paths(int min_weight, int max_paths, std::vector<s
   for (unsigned int i = 0; i < alt_sink_nodes.size(); i++)
     sink_ids.insert(alt_sink_nodes[i]->get_id());
 
+  int num_extensions = 0;
   while (!heap.empty()){
     if (paths.size() == max_paths)
       break;
+    if (num_extensions++ == MAX_PATH_EXTENSIONS)
+      return false;
+    if ((num_extensions & 1023) == 0)
+      checkLocusDeadline();
 
     std::pop_heap(heap.begin(), heap.end(), path_comparator);
-    DebruijnPath* best = heap.back(); heap.pop_back();
+    int best = heap.back(); heap.pop_back();
 
     // If we reached a sink, record the weight and sequence of the path
-    if (sink_ids.find(best->get_node_id()) != sink_ids.end())
-      paths.push_back(std::pair<std::string, int>(best->get_sequence(this), best->get_min_weight()));
+    if (sink_ids.find(path_pool[best].get_node_id()) != sink_ids.end())
+      paths.push_back(std::pair<std::string, int>(get_path_sequence(path_pool, best), path_pool[best].get_min_weight()));
 
-    std::vector<Edge*>& edges = nodes_[best->get_node_id()]->get_departing_edges();
+    std::vector<Edge*>& edges = nodes_[path_pool[best].get_node_id()]->get_departing_edges();
     for (unsigned int i = 0; i < edges.size(); i++){
       if (edges[i]->get_weight() < min_weight)
 	continue;
-      all_paths.push_back(best->add_edge(edges[i]));
-      heap.push_back(all_paths.back());
+      path_pool.push_back(DebruijnPath(path_pool[best], best, edges[i]));
+      heap.push_back(path_pool.size()-1);
       std::push_heap(heap.begin(), heap.end(), path_comparator);
     }
   }
-
-  for (unsigned int i = 0; i < all_paths.size(); i++)
-    delete all_paths[i];
+  return true;
 }
 
+std::string DebruijnGraph::get_path_sequence(const std::vector<DebruijnPath>& path_pool, int path_index){
+  std::string result;
+  const std::string& kmer = get_node_label(path_pool[path_index].get_node_id());
+  result.reserve(kmer.size() + path_pool[path_index].get_depth());
+  result.append(kmer.rbegin(), kmer.rend());
 
-std::string DebruijnPath::get_sequence(DebruijnGraph* graph){
-  std::stringstream ss;
-  const std::string& kmer = graph->get_node_label(node_id_);
-  for (auto base_iter = kmer.rbegin(); base_iter != kmer.rend(); base_iter++)
-    ss << *base_iter;
-
-  DebruijnPath* parent = parent_;
-  while (parent != NULL){
-    ss << graph->get_node_label(parent->node_id_).front();
-    parent = parent->parent_;
+  int parent = path_pool[path_index].get_parent();
+  while (parent != -1){
+    result.push_back(get_node_label(path_pool[parent].get_node_id()).front());
+    parent = path_pool[parent].get_parent();
   }
-  std::string result = ss.str();
   std::reverse(result.begin(), result.end());
   return result;
 }
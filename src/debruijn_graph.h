@@ -7,11 +7,79 @@
 #include <vector>
 
 #include "directed_graph.h"
+#include "flat_hash_map.h"
 
 class DebruijnPath;
 
+/*
+ * Iterates over the k-mers in a sequence, updating the 2-bit packed encoding of each k-mer from that of its predecessor.
+ * K-mers containing bases other than A, C, G and T can't be packed and must be identified using their sequence
+ */
+class KmerIterator {
+ private:
+  const std::string& seq_;
+  int k_;
+  int pos_;          // Start of the current k-mer
+  int last_invalid_; // Index of the most recent non-ACGT base at or before the end of the current k-mer, or -1
+  uint64_t mask_;
+  uint64_t packed_;
+
+  void add_base(int index){
+    int code = base_code(seq_[index]);
+    if (code == -1)
+      last_invalid_ = index;
+    packed_ = ((packed_ << 2) | (code & 3)) & mask_;
+  }
+
+ public:
+  KmerIterator(const std::string& seq, int k) : seq_(seq){
+    assert(k > 0 && k <= 32);
+    k_            = k;
+    pos_          = 0;
+    last_invalid_ = -1;
+    mask_         = (k == 32 ? ~0ULL : (1ULL << (2*k)) - 1);
+    packed_       = 0;
+    for (int i = 0; i < std::min(k, (int)seq.size()); i++)
+      add_base(i);
+  }
+
+  static inline int base_code(char base){
+    switch(base){
+    case 'A': return 0;
+    case 'C': return 1;
+    case 'G': return 2;
+    case 'T': return 3;
+    default:  return -1;
+    }
+  }
+
+  /* Stores the 2-bit packed encoding of KMER in PACKED and returns true iff it only contains A, C, G and T */
+  static bool pack(const std::string& kmer, uint64_t& packed){
+    packed = 0;
+    for (unsigned int i = 0; i < kmer.size(); i++){
+      int code = base_code(kmer[i]);
+      if (code == -1)
+	return false;
+      packed = (packed << 2) | code;
+    }
+    return true;
+  }
+
+  bool done()       const { return pos_ + k_ > (int)seq_.size(); }
+  int position()    const { return pos_;                         }
+  bool is_packed()  const { return last_invalid_ < pos_;         }
+  uint64_t packed() const { return packed_;                      }
+
+  void next(){
+    pos_++;
+    if (!done())
+      add_base(pos_+k_-1);
+  }
+};
+
 class DebruijnGraph : public DirectedGraph {
  protected:
+  static const int MAX_PACKED_KMER = 31; // Longest k-mer whose packed encoding never equals calc_kmer_length()'s empty table slots
   int k_;
   std::string ref_seq_;
   std::string source_kmer_;
@@ -19,10 +87,23 @@ class DebruijnGraph : public DirectedGraph {
   int32_t num_strings_;
   std::vector<bool> ref_edge_; // True iff the edge at the corresponding index is from the reference sequence
 
+  // Index of the node for each k-mer that only contains A, C, G and T, keyed by its 2-bit packed encoding.
+  // The nodes for all other k-mers are indexed by their sequence in node_map_
+  FlatHashMap kmer_nodes_;
+
+  int get_kmer_node_id(const KmerIterator& kmer_iter, const std::string& seq);
+
+  bool has_kmer_node(std::string& kmer);
+
+  Node* get_kmer_node(std::string& kmer);
+
   void get_alt_kmer_nodes(std::string& kmer, bool source, bool sink, std::vector<Node*>& nodes);
 
   void prune_edges(std::vector<bool>& remove_edges);
 
+  // Sequence spelled by the path at index PATH_INDEX in the pool of enumerated paths
+  std::string get_path_sequence(const std::vector<DebruijnPath>& path_pool, int path_index);
+
  public:
   DebruijnGraph(int k, std::string& ref_seq){
     assert(ref_seq.size() > k);
@@ -40,8 +121,20 @@ class DebruijnGraph : public DirectedGraph {
 
   void add_string(std::string& seq, int weight=1);
 
-  void enumerate_paths(int min_weight, int max_paths, std::vector<std::pair<std::string, int> >& paths);
+  // Maximum number of partial paths extended by enumerate_paths(), which bounds its runtime on highly repetitive graphs
+  static const int MAX_PATH_EXTENSIONS = 100000;
+
+  /*
+   * Identify up to MAX_PATHS source-to-sink paths whose edges all have a weight of at least MIN_WEIGHT, in decreasing order
+   * of their minimum edge weight. Stores each path's sequence and minimum edge weight in PATHS. Returns false iff the search
+   * was stopped by MAX_PATH_EXTENSIONS, in which case PATHS contains the best paths identified before the search was stopped
+   */
+  bool enumerate_paths(int min_weight, int max_paths, std::vector<std::pair<std::string, int> >& paths);
 
+  /*
+   * Determines the shortest k-mer length in [MIN_KMER, MAX_KMER] for which the reference sequence's graph is acyclic, i.e. none of its
+   * k-mers occur more than once. Stores it in KMER and returns true iff such a length exists
+   */
   static bool calc_kmer_length(std::string& ref_seq, int min_kmer, int max_kmer, int& kmer);
 
   bool is_source_ok();
@@ -51,40 +144,39 @@ class DebruijnGraph : public DirectedGraph {
   void prune_edges(double min_edge_freq, int min_weight);
 };
 
+/*
+ * Path through a DebruijnGraph that extends its parent path by one edge. Paths are stored in a pool during enumeration,
+ * so each one refers to its parent using its index in the pool
+ */
 class DebruijnPath {
  private:
-  DebruijnPath* parent_;
+  int parent_; // Index of the parent path in the pool or -1 for a path containing a single node
   int node_id_;
   int min_weight_, max_weight_;
   int depth_;
 
  public:
-  DebruijnPath(int node_id){
-    parent_     = NULL;
+  explicit DebruijnPath(int node_id){
+    parent_     = -1;
     min_weight_ = 1000000;
     max_weight_ = 0;
     node_id_    = node_id;
     depth_      = 0;
   }
 
-  int get_min_weight()       { return min_weight_; }
-  int get_max_weight()       { return max_weight_; }
-  int get_node_id()          { return node_id_;    }
-  int get_depth()            { return depth_;      }
-  DebruijnPath* get_parent() { return parent_;     }
-
-  DebruijnPath* add_edge(Edge* edge){
-    DebruijnPath* new_path = new DebruijnPath(edge->get_destination());
-    new_path->parent_      = this;
-    new_path->min_weight_  = std::min(min_weight_, edge->get_weight());
-    new_path->max_weight_  = std::max(max_weight_, edge->get_weight());
-    new_path->depth_       = depth_ + 1;
-    return new_path;
+  DebruijnPath(const DebruijnPath& parent, int parent_index, Edge* edge){
+    parent_     = parent_index;
+    node_id_    = edge->get_destination();
+    min_weight_ = std::min(parent.min_weight_, edge->get_weight());
+    max_weight_ = std::max(parent.max_weight_, edge->get_weight());
+    depth_      = parent.depth_ + 1;
   }
-  
-  std::string get_sequence(DebruijnGraph* graph);
-};
 
-bool path_comparator(DebruijnPath* p1, DebruijnPath* p2);
+  int get_min_weight() const { return min_weight_; }
+  int get_max_weight() const { return max_weight_; }
+  int get_node_id()    const { return node_id_;    }
+  int get_depth()      const { return depth_;      }
+  int get_parent()     const { return parent_;     }
+};
 
 #endif
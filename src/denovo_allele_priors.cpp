@@ -4,23 +4,38 @@
 
 #include "denovo_allele_priors.h"
 
-void PopulationGenotypePrior::compute_allele_freqs(VCF::Variant& variant, std::vector<NuclearFamily>& families){
-  allele_freqs_ = std::vector<double>(num_alleles_, 1.0); // Use a one sample pseudocount
+void DiploidGenotypePrior::compute_genotype_priors(){
+  log_unphased_priors_.resize(num_alleles_*num_alleles_);
+  log_phased_priors_.resize(num_alleles_*num_alleles_);
+  for (int gt_a = 0; gt_a < num_alleles_; gt_a++){
+    for (int gt_b = 0; gt_b < num_alleles_; gt_b++){
+      double log_prior = log_allele_freqs_[gt_a] + log_allele_freqs_[gt_b];
+      log_phased_priors_[gt_a*num_alleles_ + gt_b]   = log_prior;
+      log_unphased_priors_[gt_a*num_alleles_ + gt_b] = (gt_a == gt_b ? log_prior : log_prior + LOG_2);
+    }
+  }
+}
 
-  // Iterate over all founders in the families to compute allele counts
-  double total_count = num_alleles_;
-  int gt_a, gt_b;
+void PopulationGenotypePrior::count_founders(const VCF::VCFReader& vcf, std::vector<NuclearFamily>& families, std::vector<int>& founder_counts){
+  founder_counts.clear();
   for (auto family_iter = families.begin(); family_iter != families.end(); family_iter++){
     for (int i = 0; i < 2; i++){
-      std::string sample = (i == 0 ? family_iter->get_mother() : family_iter->get_father());
-      if (variant.sample_call_missing(sample))
+      int sample_index = vcf.get_sample_index(i == 0 ? family_iter->get_mother() : family_iter->get_father());
+      if (sample_index == -1)
 	continue;
-      variant.get_genotype(sample, gt_a, gt_b);
-      allele_freqs_[gt_a]++;
-      allele_freqs_[gt_b]++;
-      total_count += 2;
+      if (sample_index >= (int)founder_counts.size())
+	founder_counts.resize(sample_index+1, 0);
+      founder_counts[sample_index]++;
     }
   }
+}
+
+void PopulationGenotypePrior::compute_allele_freqs(VCF::Variant& variant, const std::vector<int>& founder_counts){
+  allele_freqs_ = std::vector<double>(num_alleles_, 1.0); // Use a one sample pseudocount
+
+  // Compute the allele counts of all founders in the families in a single pass over the genotypes
+  double total_count = num_alleles_;
+  total_count += variant.count_alleles(founder_counts, allele_freqs_);
 
   // Normalize the allele counts to obtain frequencies
   for (int i = 0; i < allele_freqs_.size(); i++)
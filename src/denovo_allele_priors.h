@@ -15,14 +15,18 @@ class DiploidGenotypePrior {
  protected:
   int num_alleles_;
   std::vector<double> allele_freqs_, log_allele_freqs_;
+  std::vector<double> log_unphased_priors_, log_phased_priors_; // NUM_ALLELES x NUM_ALLELES tables of the genotype priors
   double LOG_2;
 
-  DiploidGenotypePrior(VCF::Variant& str_variant, std::vector<NuclearFamily>& families){
+  DiploidGenotypePrior(VCF::Variant& str_variant){
     num_alleles_ = str_variant.num_alleles();
     assert(num_alleles_ > 0);
     LOG_2 = log10(2);
   }
 
+  // Tabulate the log10 genotype priors using the log allele frequencies
+  void compute_genotype_priors();
+
  public:
   /* Returns the log10 prior for the given unphased genotype, assuming Hardy-Weinberg equilibrium */
   double log_unphased_genotype_prior(int gt_a, int gt_b, const std::string& sample){
@@ -30,10 +34,7 @@ class DiploidGenotypePrior {
       printErrorAndDie("Invalid genotype index for log genotype prior");
     if (gt_b < 0 || gt_b >= num_alleles_)
       printErrorAndDie("Invalid genotype index for log genotype prior");
-    if (gt_a == gt_b)
-      return log_allele_freqs_[gt_a] + log_allele_freqs_[gt_b];
-    else
-      return log_allele_freqs_[gt_a] + log_allele_freqs_[gt_b] + LOG_2;
+    return log_unphased_priors_[gt_a*num_alleles_ + gt_b];
   }
 
   /* Returns the log10 prior for the given phased genotype, assuming Hardy-Weinberg equilibrium */
@@ -42,8 +43,15 @@ class DiploidGenotypePrior {
       printErrorAndDie("Invalid genotype index for log genotype prior");
     if (gt_b < 0 || gt_b >= num_alleles_)
       printErrorAndDie("Invalid genotype index for log genotype prior");
-    return log_allele_freqs_[gt_a] + log_allele_freqs_[gt_b];
+    return log_phased_priors_[gt_a*num_alleles_ + gt_b];
   }
+
+  /*
+   * Unchecked tables of the log10 priors for the unphased and phased genotypes, in which the prior for genotype GT_A|GT_B is
+   * stored at index GT_A*NUM_ALLELES + GT_B. Intended for the inner loops over all genotypes, as the priors don't depend on the sample
+   */
+  const double* log_unphased_priors() const { return log_unphased_priors_.data(); }
+  const double* log_phased_priors()   const { return log_phased_priors_.data();   }
 };
 
 
@@ -53,13 +61,21 @@ class DiploidGenotypePrior {
  */
 class PopulationGenotypePrior : public DiploidGenotypePrior {
  protected:
-  void compute_allele_freqs(VCF::Variant& variant, std::vector<NuclearFamily>& families);
+  void compute_allele_freqs(VCF::Variant& variant, const std::vector<int>& founder_counts);
 
  public:
- PopulationGenotypePrior(VCF::Variant& str_variant, std::vector<NuclearFamily>& families)
-   : DiploidGenotypePrior(str_variant, families){
-    compute_allele_freqs(str_variant, families);
+  /*
+   * FOUNDER_COUNTS contains the number of families in which each of the VCF's samples is a parent, as computed by count_founders().
+   * Each parent's genotype contributes to the allele frequencies once per family
+   */
+  PopulationGenotypePrior(VCF::Variant& str_variant, const std::vector<int>& founder_counts)
+    : DiploidGenotypePrior(str_variant){
+    compute_allele_freqs(str_variant, founder_counts);
+    compute_genotype_priors();
   }
+
+  // Count the number of families in which each of the VCF's samples is a parent, so that the counts can be reused for every locus
+  static void count_founders(const VCF::VCFReader& vcf, std::vector<NuclearFamily>& families, std::vector<int>& founder_counts);
 };
 
 /*
@@ -73,8 +89,9 @@ class UniformGenotypePrior : public DiploidGenotypePrior {
 
  public:
   UniformGenotypePrior(VCF::Variant& str_variant, std::vector<NuclearFamily>& families)
-    : DiploidGenotypePrior(str_variant, families){
+    : DiploidGenotypePrior(str_variant){
     compute_allele_freqs(str_variant, families);
+    compute_genotype_priors();
   }
 };
 
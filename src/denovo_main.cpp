@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <cfloat>
+
 #include <fstream>
 #include <iostream>
 #include <set>
@@ -49,14 +51,23 @@ void print_usage(){
 	    << "\t" << "--help                             "  << "\t" << "Print this help message and exit"                                                     << "\n"
 	    << "\t" << "--chrom         <chrom>            "  << "\t" << "Only consider STRs on this chromosome"                                                << "\n"
 	    << "\t" << "--haploid-chrs  <list_of_chroms>   "  << "\t" << "Comma separated list of chromosomes to treat as haploid (Default = all diploid)"      << "\n"
+	    << "\t" << "--threads       <num_threads>      "  << "\t" << "Number of threads used to analyze the STRs (Default = 1). When jointly testing the"   << "\n"
+	    << "\t" << "                                   "  << "\t" << " children using SNP haplotypes, each thread analyzes separate 10 Mb chunks"           << "\n"
 	    << "\t" << "--skip-snps     <snp_list.txt>     "  << "\t" << "File containing SNPs to omit from the analysis. Each line should contain a "          << "\n"
 	    << "\t" << "                                   "  << "\t" << " position in the format CHROMOSOME:START"                                             << "\n"
+	    << "\t" << "--min-mutation-lr <log_lr>        "  << "\t" << "When individually testing each child, only report the DENOVO and OTHER likelihoods"  << "\n"
+	    << "\t" << "                                   "  << "\t" << " if DENOVO exceeds the NOMUT likelihood by LOG_LR. These children are rejected"     << "\n"
+	    << "\t" << "                                   "  << "\t" << " before evaluating OTHER, and both fields are reported as missing"                  << "\n"
+	    << "\t" << "                                   "  << "\t" << " (Default = compute the likelihoods for all children)"                              << "\n"
+	    << "\t" << "--vcf-threads   <num_threads>      "  << "\t" << "Number of threads used to decompress each VCF that's read (Default = 0). If > 0,"      << "\n"
+	    << "\t" << "                                   "  << "\t" << " each VCF's records are also read and parsed ahead of the analysis on another thread" << "\n"
 	    << "\t" << "--version                          "  << "\t" << "Print DenovoFinder version and exit"                                                  << "\n"
 	    << "\n";
 }
   
 void parse_command_line_args(int argc, char** argv, std::string& fam_file, std::string& snp_vcf_file, std::string& str_vcf_file, std::string& denovo_vcf_file,
-			     std::string& chrom, std::string& log_file, std::string& haploid_chr_string, std::string& snp_skip_file, int& uniform_prior){
+			     std::string& chrom, std::string& log_file, std::string& haploid_chr_string, std::string& snp_skip_file, int& uniform_prior,
+			     int& num_threads, int& vcf_threads, double& min_mutation_lr){
   if (argc == 1 || (argc == 2 && std::string("-h").compare(std::string(argv[1])) == 0)){
     print_usage();
     exit(0);
@@ -77,7 +88,10 @@ void parse_command_line_args(int argc, char** argv, std::string& fam_file, std::
     {"skip-snps",       required_argument, 0, 'm'},
     {"str-vcf",         required_argument, 0, 'o'},
     {"haploid-chrs",    required_argument, 0, 't'},
+    {"min-mutation-lr", required_argument, 0, 'r'},
+    {"threads",         required_argument, 0, 'T'},
     {"snp-vcf",         required_argument, 0, 'v'},
+    {"vcf-threads",     required_argument, 0, 'V'},
     {0, 0, 0, 0}
   };
 
@@ -85,7 +99,7 @@ void parse_command_line_args(int argc, char** argv, std::string& fam_file, std::
   int c;
   while (true){
     int option_index = 0;
-    c = getopt_long(argc, argv, "c:d:f:l:m:o:t:v:", long_options, &option_index);
+    c = getopt_long(argc, argv, "c:d:f:l:m:o:r:t:T:v:V:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -110,12 +124,25 @@ void parse_command_line_args(int argc, char** argv, std::string& fam_file, std::
     case 'o':
       str_vcf_file = std::string(optarg);
       break;
+    case 'r':
+      min_mutation_lr = atof(optarg);
+      break;
     case 't':
       haploid_chr_string = std::string(optarg);
       break;
+    case 'T':
+      num_threads = atoi(optarg);
+      if (num_threads < 1)
+	printErrorAndDie("--threads must be greater than 0");
+      break;
     case 'v':
       snp_vcf_file = std::string(optarg);
       break;
+    case 'V':
+      vcf_threads = atoi(optarg);
+      if (vcf_threads < 0)
+	printErrorAndDie("--vcf-threads must be greater than or equal to 0");
+      break;
     case '?':
       printErrorAndDie("Unrecognized command line option");
       break;
@@ -155,7 +182,8 @@ void read_site_skip_list(std::string input_file, std::set<std::string>& sites_to
 
 int main(int argc, char** argv){
   double total_time = clock();
-  int uniform_prior = 0;
+  int uniform_prior = 0, num_threads = 1, vcf_threads = 0;
+  double min_mutation_lr = -DBL_MAX;
 
   std::stringstream full_command_ss;
   full_command_ss << "DenovoFinder-" << VERSION;
@@ -166,7 +194,7 @@ int main(int argc, char** argv){
   std::string fam_file = "", snp_vcf_file = "", str_vcf_file = "", denovo_vcf_file = "";
   std::string chrom = "", log_file = "", haploid_chr_string  = "", snp_skip_file = "";
   parse_command_line_args(argc, argv, fam_file, snp_vcf_file, str_vcf_file, denovo_vcf_file,
-			  chrom, log_file, haploid_chr_string, snp_skip_file, uniform_prior);
+			  chrom, log_file, haploid_chr_string, snp_skip_file, uniform_prior, num_threads, vcf_threads, min_mutation_lr);
 
   bool use_pop_priors = (uniform_prior == 0); // If true, we compute parental genotype priors from population frequencies
                                               // Otherwise, we use a uniform prior for each allele
@@ -177,6 +205,8 @@ int main(int argc, char** argv){
     printErrorAndDie("--denovo-vcf option required");
   else if (str_vcf_file.empty())
     printErrorAndDie("--str-vcf option required");
+  else if (!snp_vcf_file.empty() && min_mutation_lr > -DBL_MAX)
+    printErrorAndDie("--min-mutation-lr only applies when individually testing each child and can't be combined with --snp-vcf");
 
   // Check that the FAM file exists
   if (!file_exists(fam_file))
@@ -217,16 +247,9 @@ int main(int argc, char** argv){
       printErrorAndDie("No .tbi index found for the SNP VCF file. Please index using tabix and rerun DenovoFinder");
     VCF::VCFReader snp_vcf(snp_vcf_file);
 
-    // Determine which samples have both SNP and STR data
-    std::set<std::string> samples_with_data;
-    std::set<std::string> str_samples(str_vcf.get_samples().begin(), str_vcf.get_samples().end());
-    for (auto sample_iter = snp_vcf.get_samples().begin(); sample_iter != snp_vcf.get_samples().end(); sample_iter++)
-      if (str_samples.find(*sample_iter) != str_samples.end())
-	samples_with_data.insert(*sample_iter);
-
-    // Extract the nuclear families with both types of data
+    // Extract the nuclear families with both SNP and STR data
     std::vector<NuclearFamily> families;
-    extract_pedigree_nuclear_families(fam_file, samples_with_data, families, logger);
+    extract_pedigree_nuclear_families(fam_file, {&snp_vcf, &str_vcf}, families, logger);
     logger << "\tOnly the nuclear families will undergo de novo analysis\n";
 
     // Read a list of sites to skip
@@ -238,20 +261,30 @@ int main(int argc, char** argv){
     logger << "\tJointly testing all children in each family for de novo mutations" << "\n"
 	   << "\tPlease ensure that phased genotype likelihoods (FORMAT = PHASEDGL) are availale in the VCF\n" << std::endl;
     DenovoScanner denovo_scanner(families, denovo_vcf_file, full_command, use_pop_priors);
-    denovo_scanner.scan(snp_vcf_file, str_vcf, sites_to_skip, logger);
+    denovo_scanner.set_num_threads(num_threads);
+    denovo_scanner.set_vcf_threads(vcf_threads);
+    denovo_scanner.scan(snp_vcf_file, str_vcf_file, chrom, sites_to_skip, logger);
     denovo_scanner.finish();
   }
   else {
     // Extract the nuclear families with STR data
-    std::set<std::string> str_samples(str_vcf.get_samples().begin(), str_vcf.get_samples().end());
     std::vector<NuclearFamily> families;
-    extract_pedigree_nuclear_families(fam_file, str_samples, families, logger);
+    extract_pedigree_nuclear_families(fam_file, {&str_vcf}, families, logger);
     logger << "\tOnly the nuclear families will undergo de novo analysis\n";
 
     // Scan for de novos using the trio approach
     logger << "\tIndividually testing each child in each family for de novo mutations" << "\n"
 	   << "\tPlease ensure that genotype likelihoods (FORMAT = GL) are availale in the VCF\n" << std::endl;
+    std::set<std::string> family_samples;
+    get_family_samples(families, family_samples);
+    str_vcf.restrict_samples(family_samples);
+    if (vcf_threads > 0){
+      str_vcf.set_threads(vcf_threads);
+      str_vcf.enable_prefetch();
+    }
     TrioDenovoScanner denovo_scanner(families, denovo_vcf_file, full_command, use_pop_priors);
+    denovo_scanner.set_num_threads(num_threads);
+    denovo_scanner.set_min_mutation_lr(min_mutation_lr);
     denovo_scanner.scan(str_vcf, logger);
     denovo_scanner.finish();
   }
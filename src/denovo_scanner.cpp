@@ -1,6 +1,12 @@
 #include <stdlib.h>
 
+#include <atomic>
 #include <cfloat>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "denovo_scanner.h"
@@ -42,17 +48,17 @@ void DenovoScanner::write_vcf_header(std::string& full_command){
 }
 
 
-void DenovoScanner::initialize_vcf_record(VCF::Variant& str_variant){
+void DenovoScanner::initialize_vcf_record(VCF::Variant& str_variant, std::ostream& out){
   // VCF line format = CHROM POS ID REF ALT QUAL FILTER INFO FORMAT SAMPLE_1 SAMPLE_2 ... SAMPLE_N
-  denovo_vcf_ << str_variant.get_chromosome() << "\t" << str_variant.get_position() << "\t" << str_variant.get_id() << "\t" << str_variant.get_allele(0) << "\t";
+  out << str_variant.get_chromosome() << "\t" << str_variant.get_position() << "\t" << str_variant.get_id() << "\t" << str_variant.get_allele(0) << "\t";
   if (str_variant.num_alleles() > 1){
-    denovo_vcf_ << str_variant.get_allele(1);
+    out << str_variant.get_allele(1);
     for (int i = 2; i < str_variant.num_alleles(); i++)
-      denovo_vcf_ << "," << str_variant.get_allele(i);
+      out << "," << str_variant.get_allele(i);
   }
   else
-    denovo_vcf_ << ".";
-  denovo_vcf_ << "\t" << "." << "\t" << "." << "\t";
+    out << ".";
+  out << "\t" << "." << "\t" << "." << "\t";
 
   // INFO field
   int32_t start;  str_variant.get_INFO_value_single_int(START_KEY, start);
@@ -61,50 +67,155 @@ void DenovoScanner::initialize_vcf_record(VCF::Variant& str_variant){
   std::vector<int32_t> bp_diffs; str_variant.get_INFO_value_multiple_ints(BPDIFFS_KEY, bp_diffs);
   assert(bp_diffs.size()+1 == str_variant.num_alleles());
 
-  denovo_vcf_ << "BPDIFFS=" << bp_diffs[0];
+  out << "BPDIFFS=" << bp_diffs[0];
   for (int i = 2; i < str_variant.num_alleles(); i++)
-    denovo_vcf_ << "," <<  bp_diffs[i-1];
-  denovo_vcf_ << ";START="  << start
-	      << ";END="    << end
-	      << ";PERIOD=" << period;
+    out << "," <<  bp_diffs[i-1];
+  out << ";START="  << start
+      << ";END="    << end
+      << ";PERIOD=" << period;
 
   // FORMAT field
-  denovo_vcf_ << "\t" << "CHILDREN:NOMUT:ANYMUT:DENOVO:OTHER";
+  out << "\t" << "CHILDREN:NOMUT:ANYMUT:DENOVO:OTHER";
 }
 
-void DenovoScanner::add_family_to_record(NuclearFamily& family, double total_ll_no_mutation, std::vector<double>& total_lls_one_denovo, std::vector<double>& total_lls_one_other){
+void DenovoScanner::add_family_to_record(NuclearFamily& family, double total_ll_no_mutation, std::vector<double>& total_lls_one_denovo, std::vector<double>& total_lls_one_other,
+				       std::ostream& out){
   assert(total_lls_one_denovo.size() == total_lls_one_other.size() && total_lls_one_denovo.size() == family.get_children().size());
   const std::vector<std::string>& children = family.get_children();
 
   // Names of children
-  denovo_vcf_ << "\t" << children.at(0);
+  out << "\t" << children.at(0);
   for (int i = 1; i < children.size(); i++)
-    denovo_vcf_ << "," << children[i];
+    out << "," << children[i];
 
   // LL no mutation
-  denovo_vcf_ << ":" << total_ll_no_mutation;
+  out << ":" << total_ll_no_mutation;
 
   // LL a mutation
-  denovo_vcf_ << ":" << fast_log_sum_exp(fast_log_sum_exp(total_lls_one_denovo), fast_log_sum_exp(total_lls_one_other));
+  out << ":" << fast_log_sum_exp(fast_log_sum_exp(total_lls_one_denovo), fast_log_sum_exp(total_lls_one_other));
 
   // LL one denovo, for each child
-  denovo_vcf_ << ":" << total_lls_one_denovo.at(0);
+  out << ":" << total_lls_one_denovo.at(0);
   for (int i = 1; i < total_lls_one_denovo.size(); i++)
-    denovo_vcf_ << "," << total_lls_one_denovo[i];
+    out << "," << total_lls_one_denovo[i];
 
   // LL one other mutation, for each child
-  denovo_vcf_ << ":" << total_lls_one_other.at(0);
+  out << ":" << total_lls_one_other.at(0);
   for (int i = 1; i < total_lls_one_other.size(); i++)
-    denovo_vcf_ << "," << total_lls_one_other[i];
+    out << "," << total_lls_one_other[i];
 }
 
-void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std::set<std::string>& sites_to_skip,
+void DenovoScanner::configure_vcf_reader(VCF::VCFReader& vcf){
+  if (vcf_threads_ == 0)
+    return;
+  vcf.set_threads(vcf_threads_);
+  vcf.enable_prefetch();
+}
+
+void DenovoScanner::restrict_to_family_samples(VCF::VCFReader& str_vcf){
+  std::set<std::string> family_samples;
+  get_family_samples(families_, family_samples);
+  str_vcf.restrict_samples(family_samples);
+}
+
+void DenovoScanner::scan(std::string& snp_vcf_file, std::string& str_vcf_file, const std::string& chrom, std::set<std::string>& sites_to_skip,
 			 std::ostream& logger){
+  if (num_threads_ > 1){
+    scan_chunks(snp_vcf_file, str_vcf_file, chrom, sites_to_skip, logger);
+    return;
+  }
+
+  VCF::VCFReader str_vcf(str_vcf_file);
+  restrict_to_family_samples(str_vcf);
+  configure_vcf_reader(str_vcf);
+  if (!chrom.empty() && !str_vcf.set_region(chrom, 0))
+    printErrorAndDie("Failed to set the region to chromosome " + chrom + " in the STR VCF. Please check the STR VCF and rerun the analysis");
   HaplotypeTracker haplotype_tracker(families_, snp_vcf_file, window_size_);
+  configure_vcf_reader(haplotype_tracker.snp_vcf());
+  scan_region(str_vcf, haplotype_tracker, 0, INT32_MAX, sites_to_skip, denovo_vcf_, logger);
+}
+
+void DenovoScanner::scan_chunks(std::string& snp_vcf_file, std::string& str_vcf_file, const std::string& chrom, std::set<std::string>& sites_to_skip,
+				std::ostream& logger){
+  struct ScanChunk {
+    std::string chrom;
+    int32_t start, end;     // 1-based inclusive bounds on the STR positions
+    std::ostringstream out, log;
+    bool done;
+  };
+
+  // Split each chromosome into chunks, in the order in which a single reader would visit them. Chromosomes
+  // whose lengths aren't in the VCF header form a single chunk
+  std::vector< std::unique_ptr<ScanChunk> > chunks;
+  VCF::VCFReader str_vcf(str_vcf_file);
+  restrict_to_family_samples(str_vcf);
+  const int32_t chunk_size = CHUNK_WINDOWS*window_size_;
+  for (auto chrom_iter = str_vcf.get_chromosomes().begin(); chrom_iter != str_vcf.get_chromosomes().end(); chrom_iter++){
+    if (!chrom.empty() && chrom.compare(*chrom_iter) != 0)
+      continue;
+    int64_t length = str_vcf.get_chromosome_length(*chrom_iter);
+    for (int64_t start = 1; start == 1 || start <= length; start += chunk_size){
+      ScanChunk* chunk = new ScanChunk();
+      chunk->chrom = *chrom_iter;
+      chunk->start = start;
+      chunk->end   = (start+chunk_size > length ? INT32_MAX : start+chunk_size-1);
+      chunk->done  = false;
+      chunk->out.precision(3);
+      chunk->out.setf(std::ios::fixed, std::ios::floatfield);
+      chunks.emplace_back(chunk);
+    }
+  }
+
+  // Each worker analyzes the chunks it claims in increasing order, so that its tracker only advances along the genome
+  std::mutex mutex;
+  std::condition_variable chunk_done;
+  std::atomic<size_t> next_chunk(0);
+  auto run_worker = [&](){
+    VCF::VCFReader chunk_vcf(str_vcf_file);
+    restrict_to_family_samples(chunk_vcf);
+    configure_vcf_reader(chunk_vcf);
+    HaplotypeTracker haplotype_tracker(families_, snp_vcf_file, window_size_);
+    configure_vcf_reader(haplotype_tracker.snp_vcf());
+    size_t index;
+    while ((index = next_chunk++) < chunks.size()){
+      ScanChunk* chunk = chunks[index].get();
+      if (chunk_vcf.set_region(chunk->chrom, chunk->start, (chunk->end == INT32_MAX ? 0 : chunk->end)))
+	scan_region(chunk_vcf, haplotype_tracker, chunk->start, chunk->end, sites_to_skip, chunk->out, chunk->log);
+      std::lock_guard<std::mutex> lock(mutex);
+      chunk->done = true;
+      chunk_done.notify_all();
+    }
+  };
+
+  int num_workers = (int)std::min((size_t)num_threads_, chunks.size());
+  std::vector<std::thread> workers;
+  for (int i = 0; i < num_workers; i++)
+    workers.push_back(std::thread(run_worker));
+
+  // Write each chunk's records and log messages once it and all preceding chunks have been analyzed
+  for (auto chunk_iter = chunks.begin(); chunk_iter != chunks.end(); chunk_iter++){
+    ScanChunk* chunk = chunk_iter->get();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      chunk_done.wait(lock, [chunk](){ return chunk->done; });
+    }
+    denovo_vcf_ << chunk->out.str();
+    logger      << chunk->log.str();
+    chunk_iter->reset();
+  }
+  for (auto thread_iter = workers.begin(); thread_iter != workers.end(); thread_iter++)
+    thread_iter->join();
+}
+
+void DenovoScanner::scan_region(VCF::VCFReader& str_vcf, HaplotypeTracker& haplotype_tracker, int32_t min_pos, int32_t max_pos,
+				std::set<std::string>& sites_to_skip, std::ostream& out, std::ostream& logger){
   VCF::Variant str_variant;
-  int32_t num_strs  = 0;
+  std::vector<int> founder_counts;
+  PopulationGenotypePrior::count_founders(str_vcf, families_, founder_counts);
   while (str_vcf.get_next_variant(str_variant)){
-    num_strs++;
+    // Records that start before the region but overlap it belong to the preceding region
+    if (str_variant.get_position() < min_pos || str_variant.get_position() > max_pos)
+      continue;
     int num_alleles = str_variant.num_alleles();
     if (num_alleles <= 1)
       continue;
@@ -120,10 +231,10 @@ void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std
     MutationModel mut_model(str_variant);
     DiploidGenotypePrior* dip_gt_priors;
     if (use_pop_priors_)
-      dip_gt_priors = new PopulationGenotypePrior(str_variant, families_);
+      dip_gt_priors = new PopulationGenotypePrior(str_variant, founder_counts);
     else
       dip_gt_priors = new UniformGenotypePrior(str_variant, families_);
-    initialize_vcf_record(str_variant);
+    initialize_vcf_record(str_variant, out);
 
     logger << "\t" << "Computing log-likelihoods for mutation scenarios" << "\n";
     for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++){
@@ -141,7 +252,7 @@ void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std
 	  scan_for_denovo &= phased_gls.has_sample(*child_iter);
 
       if (!scan_for_denovo)
-	denovo_vcf_ << "\t" << ".";
+	out << "\t" << ".";
       else {
 	// To accelerate computations, we will ignore configurations that make a neglible contribution (< 0.01%) to the total LL
 	// For mutational scenarios, we aggregate A^5*2*NUM_CHILDREN values. Therefore, to ignore a configuration with LL=X:
@@ -161,14 +272,15 @@ void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std
 	  children_gl_index.push_back(phased_gls.get_sample_index(*child_iter));
 
 	// Iterate over all maternal genotypes
+	const double* log_gt_priors = dip_gt_priors->log_phased_priors();
 	for (int mat_i = 0; mat_i < num_alleles; mat_i++){
 	  for (int mat_j = 0; mat_j < num_alleles; mat_j++){
-	    double mat_ll = dip_gt_priors->log_phased_genotype_prior(mat_i, mat_j, family_iter->get_mother()) + phased_gls.get_gl(mother_gl_index, mat_i, mat_j);
+	    double mat_ll = log_gt_priors[mat_i*num_alleles + mat_j] + phased_gls.get_gl(mother_gl_index, mat_i, mat_j);
 
 	    // Iterate over all paternal genotypes
 	    for (int pat_i = 0; pat_i < num_alleles; pat_i++){
 	      for (int pat_j = 0; pat_j < num_alleles; pat_j++){
-		double pat_ll = dip_gt_priors->log_phased_genotype_prior(pat_i, pat_j, family_iter->get_father()) + phased_gls.get_gl(father_gl_index, pat_i, pat_j);
+		double pat_ll = log_gt_priors[pat_i*num_alleles + pat_j] + phased_gls.get_gl(father_gl_index, pat_i, pat_j);
 
 		double no_mutation_config_ll = mat_ll + pat_ll;
 
@@ -211,10 +323,11 @@ void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std
 		  // All putative mutations on haplotype #1 (if they can contribute to the total LL)
 		  double max_ll_hap_one = config_ll + phased_gls.get_max_gl_allele_two_fixed(children_gl_index[child_index], child_j) + mut_model.max_log_prior_mutation(child_i);
 		  if (max_ll_hap_one > std::min(ll_one_denovo_max[child_index], ll_one_other_max[child_index])-MIN_CONTRIBUTION){
+		    const double* log_mut_priors = mut_model.log_priors_mutation(child_i);
 		    for (int mut_allele = 0; mut_allele < num_alleles; mut_allele++){
 		      if (mut_allele == child_i)
 			continue;
-		      double prob = config_ll + phased_gls.get_gl(children_gl_index[child_index], mut_allele, child_j) + mut_model.log_prior_mutation(child_i, mut_allele);
+		      double prob = config_ll + phased_gls.get_gl(children_gl_index[child_index], mut_allele, child_j) + log_mut_priors[mut_allele];
 		      if (mut_allele != mat_i && mut_allele != mat_j && mut_allele != pat_i && mut_allele != pat_j)
 			update_streaming_log_sum_exp(prob, ll_one_denovo_max[child_index], ll_one_denovo_total[child_index]);
 		      else
@@ -225,10 +338,11 @@ void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std
 		  // All putative mutations on haplotype #2 (if they can contribute to the total LL)
 		  double max_ll_hap_two = config_ll + phased_gls.get_max_gl_allele_one_fixed(children_gl_index[child_index], child_i) + mut_model.max_log_prior_mutation(child_j);
 		  if (max_ll_hap_two > std::min(ll_one_denovo_max[child_index], ll_one_other_max[child_index])-MIN_CONTRIBUTION){
+		    const double* log_mut_priors = mut_model.log_priors_mutation(child_j);
 		    for (int mut_allele = 0; mut_allele < num_alleles; mut_allele++){
 		      if (mut_allele == child_j)
 			continue;
-		      double prob = config_ll + phased_gls.get_gl(children_gl_index[child_index], child_i, mut_allele) + mut_model.log_prior_mutation(child_j, mut_allele);
+		      double prob = config_ll + phased_gls.get_gl(children_gl_index[child_index], child_i, mut_allele) + log_mut_priors[mut_allele];
 		      if (mut_allele != mat_i && mut_allele != mat_j && mut_allele != pat_i && mut_allele != pat_j)
 			update_streaming_log_sum_exp(prob, ll_one_denovo_max[child_index], ll_one_denovo_total[child_index]);
 		      else
@@ -252,12 +366,12 @@ void DenovoScanner::scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std
 	}
 
 	// Add family's mutation likelihoods to the VCF record
-	add_family_to_record(*family_iter, total_ll_no_mutation, total_lls_one_denovo, total_lls_one_other);
+	add_family_to_record(*family_iter, total_ll_no_mutation, total_lls_one_denovo, total_lls_one_other, out);
       }
     }
 
     // End of VCF record line
-    denovo_vcf_ << "\n";
+    out << "\n";
     delete dip_gt_priors;
   }
 }
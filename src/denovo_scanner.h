@@ -10,6 +10,8 @@
 #include <string>
 
 #include "bgzf_streams.h"
+#include "error.h"
+#include "haplotype_tracker.h"
 #include "pedigree.h"
 #include "vcf_reader.h"
 
@@ -18,20 +20,48 @@ class DenovoScanner {
   const static int MIN_SECOND_BEST_SCORE = 100;
   const static int MAX_BEST_SCORE        = 10;
   static std::string BPDIFFS_KEY, START_KEY, END_KEY, PERIOD_KEY;
+
+  // When using multiple threads, each chromosome is split into chunks spanning this many haplotype windows.
+  // Each chunk's tracker must read a full window of SNPs before its first STR, so larger chunks amortize this overhead
+  const static int CHUNK_WINDOWS = 20;
+
   bool use_pop_priors_;
+  int num_threads_;
+  int vcf_threads_; // Number of threads used to decompress each VCF, which also enables record prefetching if > 0
 
   int32_t window_size_;
   std::vector<NuclearFamily> families_;
   bgzfostream denovo_vcf_;
 
   void write_vcf_header(std::string& full_command);
-  void initialize_vcf_record(VCF::Variant& str_variant);
-  void add_family_to_record(NuclearFamily& family, double total_ll_no_denovo, std::vector<double>& total_lls_one_denovo, std::vector<double>& total_lls_one_other);
+  void initialize_vcf_record(VCF::Variant& str_variant, std::ostream& out);
+  void add_family_to_record(NuclearFamily& family, double total_ll_no_denovo, std::vector<double>& total_lls_one_denovo, std::vector<double>& total_lls_one_other,
+			    std::ostream& out);
+
+  /* Applies the decompression threads and record prefetching requested using set_vcf_threads() to the reader */
+  void configure_vcf_reader(VCF::VCFReader& vcf);
+
+  /* Restricts the samples decoded from the STR VCF to the family members */
+  void restrict_to_family_samples(VCF::VCFReader& str_vcf);
+
+  /*
+   * Analyzes each STR read from STR_VCF whose position lies within [MIN_POS, MAX_POS], writing its record to OUT.
+   * The tracker's state at each STR only depends on the SNPs within window_size_ of the STR, so regions can be
+   * analyzed independently by separate trackers and their outputs concatenated
+   */
+  void scan_region(VCF::VCFReader& str_vcf, HaplotypeTracker& haplotype_tracker, int32_t min_pos, int32_t max_pos,
+		   std::set<std::string>& sites_to_skip, std::ostream& out, std::ostream& logger);
+
+  /* Analyzes consecutive chunks of each chromosome using NUM_THREADS_ threads and writes their records in order */
+  void scan_chunks(std::string& snp_vcf_file, std::string& str_vcf_file, const std::string& chrom, std::set<std::string>& sites_to_skip,
+		   std::ostream& logger);
 
  public:
   DenovoScanner(std::vector<NuclearFamily>& families, std::string& output_file, std::string& full_command, bool use_pop_priors){
     families_       = families;
     use_pop_priors_ = use_pop_priors;
+    num_threads_    = 1;
+    vcf_threads_    = 0;
     window_size_    = 500000;
     denovo_vcf_.open(output_file.c_str());
     denovo_vcf_.precision(3);
@@ -39,7 +69,20 @@ class DenovoScanner {
     write_vcf_header(full_command);
   }
 
-  void scan(std::string& snp_vcf_file, VCF::VCFReader& str_vcf, std::set<std::string>& sites_to_skip,
+  void set_num_threads(int num_threads){
+    if (num_threads < 1)
+      printErrorAndDie("The number of threads must be greater than 0");
+    num_threads_ = num_threads;
+  }
+
+  void set_vcf_threads(int vcf_threads){
+    if (vcf_threads < 0)
+      printErrorAndDie("The number of VCF decompression threads must be non-negative");
+    vcf_threads_ = vcf_threads;
+  }
+
+  /* Scans each STR in the VCF, or only those on CHROM if it's non-empty */
+  void scan(std::string& snp_vcf_file, std::string& str_vcf_file, const std::string& chrom, std::set<std::string>& sites_to_skip,
 	    std::ostream& logger);
 
   void finish(){ denovo_vcf_.close(); }
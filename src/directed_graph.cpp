@@ -2,37 +2,38 @@
 #include "directed_graph.h"
 
 void DirectedGraph::increment_edge(std::string& val_1, std::string& val_2, int delta){
-  Node* source  = get_node(val_1);
-  Node* dest    = get_node(val_2);
-  int source_id = source->get_id();
+  int source_id = get_node(val_1)->get_id();
+  int dest_id   = get_node(val_2)->get_id();
+  increment_edge(source_id, dest_id, delta);
+}
 
-  std::vector<Edge*>& edges = dest->get_incident_edges();
-  for (unsigned int i = 0; i < edges.size(); i++){
-    if (edges[i]->get_source() == source_id){
-      edges[i]->inc_weight(delta);
-      return;
-    }
+void DirectedGraph::increment_edge(int source_id, int dest_id, int delta){
+  int32_t edge_index = edge_map_.find(edge_key(source_id, dest_id));
+  if (edge_index != -1){
+    edges_[edge_index]->inc_weight(delta);
+    return;
   }
 
-  Edge* new_edge = new Edge(edges_.size(), source_id, dest->get_id(), delta);
-  if (source_id == dest->get_id())
-    source->add_edge(new_edge);
-  else {
-    source->add_edge(new_edge);
-    dest->add_edge(new_edge);
-  }
+  Edge* new_edge = new Edge(edges_.size(), source_id, dest_id, delta);
+  nodes_[source_id]->add_edge(new_edge);
+  if (source_id != dest_id)
+    nodes_[dest_id]->add_edge(new_edge);
+  edge_map_.insert(edge_key(source_id, dest_id), edges_.size());
   edges_.push_back(new_edge);
 }
 
 bool DirectedGraph::can_sort_topologically(){
-  std::map<int, int> parent_counts;
+  std::vector<int> parent_counts(nodes_.size(), 0);
   std::vector<int> sources;
+  int num_unsorted = 0;
   for (unsigned int i = 0; i < nodes_.size(); i++){
     int count = nodes_[i]->num_incident_edges();
     if (count == 0)
       sources.push_back(i);
-    else
+    else {
       parent_counts[i] = count;
+      num_unsorted++;
+    }
   }
 
   std::vector<int> ordered_nodes;
@@ -44,20 +45,19 @@ bool DirectedGraph::can_sort_topologically(){
     sources.pop_back();
 
     for (auto child_iter = children.begin(); child_iter != children.end(); child_iter++){
-      auto count_iter = parent_counts.find(*child_iter);
-      if (count_iter == parent_counts.end())
+      int& count = parent_counts[*child_iter];
+      if (count == 0)
  	printErrorAndDie("Logical error in topological_sort()");
-      else if (count_iter->second == 1){
+      else if (count == 1){
 	sources.push_back(*child_iter);
-	parent_counts.erase(count_iter);
+	num_unsorted--;
       }
-      else
-	count_iter->second -= 1;
+      count -= 1;
     }
     children.clear();
   }
  
-  if (parent_counts.size() == 0)
+  if (num_unsorted == 0)
     return true;
   else
     return false; // Only a DAG if no unprocessed individuals are left
@@ -4,8 +4,11 @@
 #include <assert.h>
 #include <iostream>
 #include <map>
+#include <string>
 #include <vector>
 
+#include "flat_hash_map.h"
+
 class Node;
 
 class Edge {
@@ -100,7 +103,26 @@ protected:
   std::vector<Edge*> edges_;
   std::vector<std::string> node_labels_;
   std::map<std::string, int> node_map_;
-  
+  FlatHashMap edge_map_; // Index of each edge, keyed by its source and destination node indices
+
+  static uint64_t edge_key(int source_id, int dest_id){
+    return (((uint64_t)source_id) << 32) | (uint32_t)dest_id;
+  }
+
+  // Add a node with the provided label without registering the label in node_map_
+  Node* add_node(const std::string& label){
+    node_labels_.push_back(label);
+    nodes_.push_back(new Node(nodes_.size()));
+    return nodes_.back();
+  }
+
+  // Rebuild the edge index after edges have been removed or renumbered
+  void index_edges(){
+    edge_map_.clear();
+    for (unsigned int i = 0; i < edges_.size(); i++)
+      edge_map_.insert(edge_key(edges_[i]->get_source(), edges_[i]->get_destination()), i);
+  }
+
 public:
   DirectedGraph(){}
 
@@ -126,10 +148,8 @@ public:
     if (node_iter != node_map_.end())
       return nodes_[node_iter->second];
 
-    node_labels_.push_back(value);
     node_map_[value] = nodes_.size();
-    nodes_.push_back(new Node(nodes_.size()));
-    return nodes_.back();
+    return add_node(value);
   }
 
   const std::string& get_node_label(int node_id){
@@ -137,6 +157,8 @@ public:
   }
 
   void increment_edge(std::string& val_1, std::string& val_2, int delta=1);
+
+  void increment_edge(int source_id, int dest_id, int delta=1);
   void print(std::ostream& out);
 };
 
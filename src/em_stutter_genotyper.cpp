@@ -2,15 +2,71 @@
 #include <cfloat>
 #include <cstring>
 #include <sstream>
+#include <tuple>
 
 #include "em_stutter_genotyper.h"
 #include "error.h"
 #include "mathops.h"
 
+namespace {
+// Log-values summed to estimate the stutter model's parameters
+enum StutterStat { IN_UP, IN_DOWN, IN_EQ, IN_DIFFS, OUT_UP, OUT_DOWN, OUT_DIFFS, NUM_STUTTER_STATS };
+
+// Weighted log-sum-exp of the log-values for each stutter statistic, which are generated twice rather than stored. The values are
+// first added to find each sum's maximum and then added again in the same order once SUMMING is true. Equivalent to fast_log_sum_exp()
+// applied to a list in which each value is repeated WEIGHT times, so reads collapsed by compress_reads() contribute exactly as before
+class StutterLogSums {
+ public:
+  double max_vals[NUM_STUTTER_STATS], totals[NUM_STUTTER_STATS];
+  bool summing;
+
+  StutterLogSums(){
+    std::fill_n(max_vals, NUM_STUTTER_STATS, -DBL_MAX);
+    std::fill_n(totals,   NUM_STUTTER_STATS, 0.0);
+    summing = false;
+  }
+
+  void add(int stat, double log_val, int weight){
+    if (summing)
+      add_weighted_fast_exp(log_val, weight, max_vals[stat], totals[stat]);
+    else
+      max_vals[stat] = std::max(max_vals[stat], log_val);
+  }
+
+  double log_sum(int stat) const { return fast_finish_streaming_log_sum_exp(max_vals[stat], totals[stat]); }
+};
+
+// Minimum number of operations for a chunk of the E or M step to be worth handing to an idle thread
+const int64_t MIN_CHUNK_WORK = 1 << 18;
+}
+
+void EMStutterGenotyper::compress_reads(){
+  std::map<std::pair<int, int>, int> record_indices;
+  int num_records = 0, prev_sample = -1;
+  for (int read_index = 0; read_index < num_reads_; ++read_index){
+    if (sample_label_[read_index] != prev_sample){
+      record_indices.clear();
+      prev_sample = sample_label_[read_index];
+    }
+    auto insert_iter = record_indices.insert(std::make_pair(std::make_pair(allele_index_[read_index], phase_class_[read_index]), num_records));
+    if (insert_iter.second){
+      allele_index_[num_records]  = allele_index_[read_index];
+      phase_class_[num_records]   = phase_class_[read_index];
+      sample_label_[num_records]  = sample_label_[read_index];
+      read_weights_[num_records]  = read_weights_[read_index];
+      num_records++;
+    }
+    else
+      read_weights_[insert_iter.first->second] += read_weights_[read_index];
+  }
+  num_reads_ = num_records;
+  read_weights_.resize(num_records);
+}
+
 void EMStutterGenotyper::init_log_gt_priors(){
   std::fill(log_gt_priors_, log_gt_priors_+num_alleles_, 1); // Use 1 sample pseudocount                                                                                  
   for (int i = 0; i < num_reads_; i++)
-    log_gt_priors_[allele_index_[i]] += 1.0/reads_per_sample_[sample_label_[i]];
+    log_gt_priors_[allele_index_[i]] += read_weights_[i]*1.0/reads_per_sample_[sample_label_[i]];
   double log_total = log(sum(log_gt_priors_, log_gt_priors_+num_alleles_));
   for (int i = 0; i < num_alleles_; i++){
     log_gt_priors_[i] = log(log_gt_priors_[i]) - log_total;
@@ -19,34 +75,37 @@ void EMStutterGenotyper::init_log_gt_priors(){
 }
 
 void EMStutterGenotyper::recalc_log_gt_priors(){
-  double* max_log_count   = new double[num_alleles_];
-  double* total_log_count = new double[num_alleles_];
-  std::fill_n(max_log_count,   num_alleles_, -DBL_MAX/2);
-  std::fill_n(total_log_count, num_alleles_, 0.0);
-
-  // Compute the contribution of the first allele in each diplotype
-  double* LL_ptr = log_sample_posteriors_;
-  for (int sample_index = 0; sample_index < num_samples_; ++sample_index){
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
-      update_streaming_log_sum_exp(log_sum_exp(LL_ptr, LL_ptr+num_alleles_), max_log_count[index_1], total_log_count[index_1]);
-      LL_ptr += num_alleles_;
-    }
-  }
-
-  // Compute the contribution of the second allele in each diplotype
-  LL_ptr = log_sample_posteriors_;
-  for (int sample_index = 0; sample_index < num_samples_; ++sample_index)
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1)
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++LL_ptr)
-	update_streaming_log_sum_exp(*LL_ptr, max_log_count[index_2], total_log_count[index_2]);
+  // Each allele's count only depends on the sample posteriors, so chunks of the alleles may be counted concurrently
+  int num_chunks = (int)std::max((int64_t)1, std::min((int64_t)num_alleles_, 2*((int64_t)num_samples_)*num_sample_gts()/MIN_CHUNK_WORK));
+  run_chunks(num_chunks, [&](int chunk){
+      std::vector<double> column(haploid_ ? num_samples_ : num_samples_*num_alleles_);
+      for (int index = chunk*num_alleles_/num_chunks; index < (chunk+1)*num_alleles_/num_chunks; ++index){
+	double max_log_count = -DBL_MAX/2, total_log_count = 0.0;
+	if (haploid_){
+	  // Each sample's homozygous genotype contributes two copies of its allele, so each allele's posteriors are counted twice
+	  double* LL_ptr = log_sample_posteriors_ + index;
+	  for (int sample_index = 0; sample_index < num_samples_; ++sample_index, LL_ptr += num_alleles_)
+	    column[sample_index] = *LL_ptr;
+	  update_streaming_log_sum_exp(column.data(), num_samples_, max_log_count, total_log_count);
+	  update_streaming_log_sum_exp(column.data(), num_samples_, max_log_count, total_log_count);
+	}
+	else {
+	  // Compute the contribution of the allele as the first in each diplotype, whose posteriors are contiguous for each sample
+	  double* LL_ptr = log_sample_posteriors_ + index*num_alleles_;
+	  for (int sample_index = 0; sample_index < num_samples_; ++sample_index, LL_ptr += num_alleles_*num_alleles_)
+	    update_streaming_log_sum_exp(LL_ptr, num_alleles_, max_log_count, total_log_count);
 
-  // Finalize the streaming calculations
-  for (int index_1 = 0; index_1 < num_alleles_; ++index_1)
-    log_gt_priors_[index_1] = finish_streaming_log_sum_exp(max_log_count[index_1], total_log_count[index_1]);
+	  // Compute its contribution as the second allele in each diplotype, gathering its strided posteriors so that they can be batched
+	  int num_rows = num_samples_*num_alleles_;
+	  LL_ptr = log_sample_posteriors_ + index;
+	  for (int row = 0; row < num_rows; ++row, LL_ptr += num_alleles_)
+	    column[row] = *LL_ptr;
+	  update_streaming_log_sum_exp(column.data(), num_rows, max_log_count, total_log_count);
+	}
+	log_gt_priors_[index] = finish_streaming_log_sum_exp(max_log_count, total_log_count);
+      }
+    });
 
-  delete [] max_log_count;
-  delete [] total_log_count;
-	
   // Normalize log counts to log probabilities
   double log_total = log_sum_exp(log_gt_priors_, log_gt_priors_+num_alleles_);
   for (int i = 0; i < num_alleles_; i++){
@@ -57,62 +116,90 @@ void EMStutterGenotyper::recalc_log_gt_priors(){
 
 void EMStutterGenotyper::init_stutter_model(){
   delete stutter_model_;
-  stutter_model_ = new StutterModel(0.9, 0.1, 0.1, 0.8, 0.01, 0.01, motif_len_);
+  if (init_stutter_model_ != NULL)
+    stutter_model_ = init_stutter_model_->copy();
+  else
+    stutter_model_ = new StutterModel(0.9, 0.1, 0.1, 0.8, 0.01, 0.01, motif_len_);
 }
   
 void EMStutterGenotyper::recalc_stutter_model(){
-  std::vector<double> in_log_up,  in_log_down,  in_log_eq, in_log_diffs; // In-frame values
-  std::vector<double> out_log_up, out_log_down, out_log_diffs;           // Out-of-frame values
-  
-  // Add various pseudocounts such that p_geom < 1 for both in-frame and out-of-frame stutter models
-  in_log_up.push_back(0.0);  in_log_down.push_back(0.0);  in_log_diffs.push_back(0.0);  in_log_diffs.push_back(log(1.1));
-  out_log_up.push_back(0.0); out_log_down.push_back(0.0); out_log_diffs.push_back(0.0); out_log_diffs.push_back(log(1.1));
-  in_log_eq.push_back(0.0);
+  // Rather than storing each read's phase posteriors for every diplotype (reads x alleles^2 x 2 values), they're recomputed from the
+  // E-step's read LLs in each of the two passes over the reads. The reads are split into fixed chunks that may be processed concurrently.
+  // The first pass finds the maximum of each chunk's sums and the second accumulates each chunk's totals, which are then combined by a
+  // pairwise tree reduction. The estimates therefore don't depend on the number of threads
+  const int CHUNK_READS    = 512;
+  const int num_diplotypes = num_sample_gts();
+  int num_chunks = std::max(1, (int)((num_reads_ + CHUNK_READS - 1)/CHUNK_READS));
+  std::vector<StutterLogSums> chunk_sums(num_chunks);
+  const double LOG_TWO_PHASES = fast_log_sum_exp(0.0, 0.0); // Log-sum-exp of two equal phase LLs, relative to their value
+  auto add_chunk_values = [&](int chunk){
+    StutterLogSums& sums = chunk_sums[chunk];
+    if (chunk == 0){
+      // Add various pseudocounts such that p_geom < 1 for both in-frame and out-of-frame stutter models
+      sums.add(IN_UP,  0.0, 1); sums.add(IN_DOWN,  0.0, 1); sums.add(IN_DIFFS,  0.0, 1); sums.add(IN_DIFFS,  log(1.1), 1);
+      sums.add(OUT_UP, 0.0, 1); sums.add(OUT_DOWN, 0.0, 1); sums.add(OUT_DIFFS, 0.0, 1); sums.add(OUT_DIFFS, log(1.1), 1);
+      sums.add(IN_EQ,  0.0, 1);
+    }
 
-  const int num_diplotypes = num_alleles_*num_alleles_;
-  double* log_phase_ptr    = log_read_phase_posteriors_;
-  for (int read_index = 0; read_index < num_reads_; ++read_index){
-    double* log_gt_posterior = log_sample_posteriors_ + sample_label_[read_index]*num_diplotypes;
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++log_gt_posterior){
-	for (int phase = 0; phase < 2; ++phase, ++log_phase_ptr){
-	  int gt_index  = (phase == 0 ? index_1 : index_2);
-	  int bp_diff   = bps_per_allele_[allele_index_[read_index]] - bps_per_allele_[gt_index];
-	  double factor = *log_gt_posterior + *log_phase_ptr;
-
-	  if (bp_diff == 0)
-	    in_log_eq.push_back(factor);
-	  else {
-	    if (bp_diff % motif_len_ != 0){
-	      int eff_diff = bp_diff - bp_diff/motif_len_; // Effective stutter bp difference (excludes unit changes)
-	      out_log_diffs.push_back(factor + int_log(abs(eff_diff)));
-	      if (bp_diff > 0)
-		out_log_up.push_back(factor);
-	      else
-		out_log_down.push_back(factor);
- 	    }
+    int end_read        = std::min((int)num_reads_, (chunk+1)*CHUNK_READS);
+    double* read_LL_ptr = log_aln_probs_ + ((int64_t)chunk)*CHUNK_READS*num_alleles_;
+    for (int read_index = chunk*CHUNK_READS; read_index < end_read; ++read_index, read_LL_ptr += num_alleles_){
+      double* log_gt_posterior = log_sample_posteriors_ + sample_label_[read_index]*num_diplotypes;
+      int weight               = read_weights_[read_index];
+      const double log_p1      = read_log_p1(read_index), log_p2 = read_log_p2(read_index);
+      const bool phased        = read_phased(read_index);
+      for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
+	double log_phase_one = LOG_ONE_HALF + log_p1 + read_LL_ptr[index_1];
+	for (int index_2 = (haploid_ ? index_1 : 0); index_2 < (haploid_ ? index_1+1 : num_alleles_); ++index_2, ++log_gt_posterior){
+	  double log_phase_two   = LOG_ONE_HALF + log_p2 + read_LL_ptr[index_2];
+	  double log_phase_total = ((!phased && index_1 == index_2) ? log_phase_one + LOG_TWO_PHASES : fast_log_sum_exp(log_phase_one, log_phase_two));
+	  for (int phase = 0; phase < 2; ++phase){
+	    int gt_index  = (phase == 0 ? index_1 : index_2);
+	    int bp_diff   = bps_per_allele_[allele_index_[read_index]] - bps_per_allele_[gt_index];
+	    double factor = *log_gt_posterior + ((phase == 0 ? log_phase_one : log_phase_two) - log_phase_total);
+
+	    if (bp_diff == 0)
+	      sums.add(IN_EQ, factor, weight);
 	    else {
-	      int eff_diff = bp_diff/motif_len_; // Effective stutter repeat difference
-	      in_log_diffs.push_back(factor + int_log(abs(eff_diff)));
-	      if (bp_diff > 0)
-		in_log_up.push_back(factor);
-	      else
-		in_log_down.push_back(factor);
+	      if (bp_diff % motif_len_ != 0){
+		int eff_diff = bp_diff - bp_diff/motif_len_; // Effective stutter bp difference (excludes unit changes)
+		sums.add(OUT_DIFFS, factor + int_log(abs(eff_diff)), weight);
+		sums.add(bp_diff > 0 ? OUT_UP : OUT_DOWN, factor, weight);
+	      }
+	      else {
+		int eff_diff = bp_diff/motif_len_; // Effective stutter repeat difference
+		sums.add(IN_DIFFS, factor + int_log(abs(eff_diff)), weight);
+		sums.add(bp_diff > 0 ? IN_UP : IN_DOWN, factor, weight);
+	      }
 	    }
 	  }
 	}
       }
     }
-  }
+  };
+
+  run_chunks(num_chunks, add_chunk_values);
+  StutterLogSums sums;
+  for (int chunk = 0; chunk < num_chunks; ++chunk)
+    for (int stat = 0; stat < NUM_STUTTER_STATS; ++stat)
+      sums.max_vals[stat] = std::max(sums.max_vals[stat], chunk_sums[chunk].max_vals[stat]);
+  sums.summing = true;
+  std::fill(chunk_sums.begin(), chunk_sums.end(), sums);
+  run_chunks(num_chunks, add_chunk_values);
+  for (int step = 1; step < num_chunks; step *= 2)
+    for (int chunk = 0; chunk+step < num_chunks; chunk += 2*step)
+      for (int stat = 0; stat < NUM_STUTTER_STATS; ++stat)
+	chunk_sums[chunk].totals[stat] += chunk_sums[chunk+step].totals[stat];
+  sums = chunk_sums[0];
 
   // Compute new parameter estimates
-  double in_log_total_up     = fast_log_sum_exp(in_log_up);
-  double in_log_total_down   = fast_log_sum_exp(in_log_down);
-  double in_log_total_eq     = fast_log_sum_exp(in_log_eq);
-  double in_log_total_diffs  = fast_log_sum_exp(in_log_diffs);
-  double out_log_total_up    = fast_log_sum_exp(out_log_up);
-  double out_log_total_down  = fast_log_sum_exp(out_log_down);
-  double out_log_total_diffs = fast_log_sum_exp(out_log_diffs);
+  double in_log_total_up     = sums.log_sum(IN_UP);
+  double in_log_total_down   = sums.log_sum(IN_DOWN);
+  double in_log_total_eq     = sums.log_sum(IN_EQ);
+  double in_log_total_diffs  = sums.log_sum(IN_DIFFS);
+  double out_log_total_up    = sums.log_sum(OUT_UP);
+  double out_log_total_down  = sums.log_sum(OUT_DOWN);
+  double out_log_total_diffs = sums.log_sum(OUT_DIFFS);
   double out_log_total       = fast_log_sum_exp(out_log_total_up, out_log_total_down);
   double in_pgeom_hat        = std::min(0.999, exp(log_sum_exp(in_log_total_up, in_log_total_down) - in_log_total_diffs));
   double out_pgeom_hat       = std::min(0.999, exp(out_log_total - out_log_total_diffs));
@@ -135,54 +222,50 @@ void EMStutterGenotyper::init_log_sample_priors(double* log_sample_ptr){
   if (use_pop_freqs_){
     double* LL_ptr = log_sample_ptr;
     for (int sample_index = 0; sample_index < num_samples_; ++sample_index)
-      for (int index_1 = 0; index_1 < num_alleles_; ++index_1)
-	for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++LL_ptr)
-	  if (!haploid_)
-	    *LL_ptr = log_gt_priors_[index_1]+log_gt_priors_[index_2];             // Initialize LL's with log genotype priors
-	  else
-	    *LL_ptr = (index_1 == index_2 ? log_gt_priors_[index_1] : -DBL_MAX/2); // Homoz prior is the allele frequency while hetz genotypes are disallowed
+      for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
+	if (haploid_)
+	  *(LL_ptr++) = log_gt_priors_[index_1]; // Homoz prior is the allele frequency, while only homozygous genotypes are stored
+	else
+	  for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++LL_ptr)
+	    *LL_ptr = log_gt_priors_[index_1]+log_gt_priors_[index_2]; // Initialize LL's with log genotype priors
+      }
   }
 }
 
 void EMStutterGenotyper::calc_hap_aln_probs(double* log_aln_probs){
-  for (int read_index = 0; read_index < num_reads_; ++read_index)
-    for (int allele_id = 0; allele_id < num_alleles_; ++allele_id, ++log_aln_probs)
-      *log_aln_probs = stutter_model_->log_stutter_pmf(bps_per_allele_[allele_id], bps_per_allele_[allele_index_[read_index]]);
-}
-
-void EMStutterGenotyper::recalc_log_read_phase_posteriors(){
-  double* log_phase_ptr = log_read_phase_posteriors_;
-  for (int read_index = 0; read_index < num_reads_; ++read_index){
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
-      int len_1 = bps_per_allele_[index_1];
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2){
-	int len_2 = bps_per_allele_[index_2];
-	double log_phase_one   = LOG_ONE_HALF + log_p1_[read_index] + stutter_model_->log_stutter_pmf(len_1, bps_per_allele_[allele_index_[read_index]]);
-	double log_phase_two   = LOG_ONE_HALF + log_p2_[read_index] + stutter_model_->log_stutter_pmf(len_2, bps_per_allele_[allele_index_[read_index]]);
-	double log_phase_total = fast_log_sum_exp(log_phase_one, log_phase_two);
-	log_phase_ptr[0] = log_phase_one-log_phase_total;
-	log_phase_ptr[1] = log_phase_two-log_phase_total;
-	log_phase_ptr   += 2;
-      }
-    }
-  }
+  // Each read's LLs are independent, so chunks of the reads may be processed concurrently
+  int num_chunks = (int)std::max((int64_t)1, std::min((int64_t)num_reads_, ((int64_t)num_reads_)*num_alleles_/MIN_CHUNK_WORK));
+  run_chunks(num_chunks, [&](int chunk){
+      int end_read      = (int)(((int64_t)chunk+1)*num_reads_/num_chunks);
+      int read_index    = (int)(((int64_t)chunk)*num_reads_/num_chunks);
+      double* log_aln_ptr = log_aln_probs + ((int64_t)read_index)*num_alleles_;
+      for (; read_index < end_read; ++read_index)
+	for (int allele_id = 0; allele_id < num_alleles_; ++allele_id, ++log_aln_ptr)
+	  *log_aln_ptr = stutter_model_->log_stutter_pmf(bps_per_allele_[allele_id], bps_per_allele_[allele_index_[read_index]]);
+    });
 }
 
 bool EMStutterGenotyper::train(int max_iter, double min_LL_abs_change, double min_LL_frac_change, bool disp_stats, std::ostream& logger){
   // Initialization
   init_log_gt_priors();
   init_stutter_model();
+  num_extrapolations_ = 0;
+  if (accelerate_em_)
+    return train_accelerated(max_iter, min_LL_abs_change, min_LL_frac_change, disp_stats, logger);
 
   int num_iter   = 1;
   bool converged = false;
   double LL      = -DBL_MAX;
   use_pop_freqs_ = true;
+  num_em_iter_   = 0;
 
   while (num_iter <= max_iter && !converged){
+    checkLocusDeadline();
+    num_em_iter_ = num_iter;
+
     // E-step
     calc_hap_aln_probs(log_aln_probs_);
     double new_LL = calc_log_sample_posteriors();
-    recalc_log_read_phase_posteriors();
     if (disp_stats){
       logger << "Iteration " << num_iter << ": LL = " << new_LL << "\n" << *stutter_model_;
       logger << "Pop freqs: ";
@@ -216,3 +299,176 @@ bool EMStutterGenotyper::train(int max_iter, double min_LL_abs_change, double mi
   }
   return false;
 }
+
+void EMStutterGenotyper::refine(EMStutterGenotyper& trained, int num_iter, bool disp_stats, std::ostream& logger){
+  init_log_gt_priors();
+  std::map<int, int> trained_indices;
+  for (int i = 0; i < trained.num_alleles_; i++)
+    trained_indices[trained.bps_per_allele_[i]] = i;
+  for (int i = 0; i < num_alleles_; i++){
+    auto index_iter = trained_indices.find(bps_per_allele_[i]);
+    if (index_iter != trained_indices.end())
+      log_gt_priors_[i] = trained.log_gt_priors_[index_iter->second];
+  }
+  double log_total = log_sum_exp(log_gt_priors_, log_gt_priors_+num_alleles_);
+  for (int i = 0; i < num_alleles_; i++)
+    log_gt_priors_[i] = std::min(0.0, log_gt_priors_[i] - log_total);
+
+  delete stutter_model_;
+  stutter_model_ = trained.get_stutter_model()->copy();
+  stutter_model_->set_period(motif_len_);
+  use_pop_freqs_      = true;
+  num_em_iter_        = 0;
+  num_extrapolations_ = 0;
+  while (num_em_iter_ < num_iter){
+    checkLocusDeadline();
+    num_em_iter_++;
+    run_em_iteration(disp_stats, logger);
+  }
+}
+
+double EMStutterGenotyper::run_em_iteration(bool disp_stats, std::ostream& logger){
+  // E-step
+  calc_hap_aln_probs(log_aln_probs_);
+  double LL = calc_log_sample_posteriors();
+  if (disp_stats){
+    logger << "Iteration " << num_em_iter_ << ": LL = " << LL << "\n" << *stutter_model_;
+    logger << "Pop freqs: ";
+    for (unsigned int i = 0; i < num_alleles_; i++)
+      logger << exp(log_gt_priors_[i]) << " ";
+    logger << std::endl;
+  }
+
+  // M-step
+  recalc_log_gt_priors();
+  recalc_stutter_model();
+  return LL;
+}
+
+void EMStutterGenotyper::get_em_params(std::vector<double>& params){
+  // Genotype priors are represented by their logs and stutter probabilities by their logs or logits
+  params.assign(log_gt_priors_, log_gt_priors_+num_alleles_);
+  for (int in_frame = 1; in_frame >= 0; in_frame--){
+    double geom = stutter_model_->get_parameter(in_frame, 'P');
+    params.push_back(log(geom) - log(1-geom));
+    params.push_back(log(stutter_model_->get_parameter(in_frame, 'U')));
+    params.push_back(log(stutter_model_->get_parameter(in_frame, 'D')));
+  }
+}
+
+bool EMStutterGenotyper::set_em_params(const std::vector<double>& params){
+  assert(params.size() == num_alleles_+6);
+  for (unsigned int i = 0; i < params.size(); i++)
+    if (!std::isfinite(params[i]))
+      return false;
+
+  double stutter_params[6];
+  for (int i = 0; i < 6; i += 3){
+    stutter_params[i]   = 1.0/(1.0 + exp(-params[num_alleles_+i]));
+    stutter_params[i+1] = exp(params[num_alleles_+i+1]);
+    stutter_params[i+2] = exp(params[num_alleles_+i+2]);
+  }
+
+  // Reject extrapolations that the stutter model can't represent
+  if (stutter_params[0] <= 0.0 || stutter_params[0] >= 1.0 || stutter_params[3] <= 0.0 || stutter_params[3] >= 1.0)
+    return false;
+  if (stutter_params[1] <= 0.0 || stutter_params[2] <= 0.0 || stutter_params[4] <= 0.0 || stutter_params[5] <= 0.0)
+    return false;
+  if (stutter_params[1] + stutter_params[2] + stutter_params[4] + stutter_params[5] >= 1.0)
+    return false;
+
+  std::copy(params.begin(), params.begin()+num_alleles_, log_gt_priors_);
+  double log_total = log_sum_exp(log_gt_priors_, log_gt_priors_+num_alleles_);
+  for (int i = 0; i < num_alleles_; i++)
+    log_gt_priors_[i] = std::min(0.0, log_gt_priors_[i] - log_total);
+  delete stutter_model_;
+  stutter_model_ = new StutterModel(stutter_params[0], stutter_params[1], stutter_params[2],
+				    stutter_params[3], stutter_params[4], stutter_params[5], motif_len_);
+  return true;
+}
+
+/*
+ * EM training accelerated using the SQUAREM scheme of Varadhan and Roland (2008). Each cycle performs two EM iterations
+ * from the current parameters and then extrapolates along the resulting steps. The extrapolated parameters are only
+ * accepted if their LL is at least as large as the LL of the parameters from the first of these iterations, so the
+ * sequence of accepted LLs never decreases. Otherwise, the step length is reduced and, if that also fails, the
+ * parameters obtained from the two plain EM iterations are used. Convergence is assessed exactly as in plain EM
+ */
+bool EMStutterGenotyper::train_accelerated(int max_iter, double min_LL_abs_change, double min_LL_frac_change, bool disp_stats, std::ostream& logger){
+  const int MAX_STEP_REDUCTIONS = 3;
+  use_pop_freqs_ = true;
+  num_em_iter_   = 0;
+  double LL      = -DBL_MAX;
+
+  // Returns true iff training has converged after an LL update
+  auto converged = [&](double new_LL){
+    assert(new_LL <= TOLERANCE);
+    if (new_LL < LL+TOLERANCE)
+      return true; // LL isn't always monotonically increasing b/c of the pseudocounts in recalc_stutter_model()
+    double abs_change  = new_LL - LL;
+    double frac_change = -(new_LL - LL)/LL;
+    LL = new_LL;
+    return (abs_change < min_LL_abs_change && frac_change < min_LL_frac_change);
+  };
+
+  std::vector<double> params_0, params_1, params_2, r(num_alleles_+6), v(num_alleles_+6), extrap_params(num_alleles_+6);
+  while (num_em_iter_ < max_iter){
+    checkLocusDeadline();
+
+    // Two plain EM iterations
+    get_em_params(params_0);
+    num_em_iter_++;
+    if (converged(run_em_iteration(disp_stats, logger)))
+      return true;
+    if (num_em_iter_ == max_iter)
+      break;
+    get_em_params(params_1);
+    num_em_iter_++;
+    if (converged(run_em_iteration(disp_stats, logger)))
+      return true;
+    get_em_params(params_2);
+    std::vector<double> log_gt_priors_2(log_gt_priors_, log_gt_priors_+num_alleles_);
+    StutterModel* stutter_model_2 = stutter_model_->copy();
+
+    // Compute the extrapolation's step length
+    double r_norm = 0.0, v_norm = 0.0;
+    for (unsigned int i = 0; i < params_0.size(); i++){
+      r[i]    = params_1[i] - params_0[i];
+      v[i]    = params_2[i] - 2*params_1[i] + params_0[i];
+      r_norm += r[i]*r[i];
+      v_norm += v[i]*v[i];
+    }
+    if (v_norm == 0.0 || num_em_iter_ == max_iter){
+      delete stutter_model_2;
+      continue;
+    }
+    double alpha = std::min(-1.0, -sqrt(r_norm/v_norm));
+
+    // Evaluate the extrapolated parameters, reducing the step length whenever they're invalid or decrease the LL
+    bool accepted = false;
+    for (int attempt = 0; attempt <= MAX_STEP_REDUCTIONS && !accepted && num_em_iter_ < max_iter; attempt++, alpha = (alpha-1)/2){
+      for (unsigned int i = 0; i < params_0.size(); i++)
+	extrap_params[i] = params_0[i] - 2*alpha*r[i] + alpha*alpha*v[i];
+      if (!set_em_params(extrap_params))
+	continue;
+      num_em_iter_++;
+      double extrap_LL = run_em_iteration(disp_stats, logger);
+      if (extrap_LL >= LL){
+	accepted = true;
+	num_extrapolations_++;
+	if (converged(extrap_LL)){
+	  delete stutter_model_2;
+	  return true;
+	}
+      }
+    }
+
+    // Revert to the parameters from the plain EM iterations if every extrapolation was rejected
+    if (!accepted){
+      std::copy(log_gt_priors_2.begin(), log_gt_priors_2.end(), log_gt_priors_);
+      std::swap(stutter_model_, stutter_model_2);
+    }
+    delete stutter_model_2;
+  }
+  return false;
+}
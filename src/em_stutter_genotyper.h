@@ -18,17 +18,24 @@ class EMStutterGenotyper: public Genotyper {
   int motif_len_;                     // # bp in STR motif
   int* allele_index_;                 // Index of each read's STR size
   StutterModel* stutter_model_;
+  StutterModel* init_stutter_model_;  // If not NULL, the EM algorithm is initialized with this model instead of the default parameters
   std::vector<int> bps_per_allele_;   // Size of each STR allele in bps
-  std::vector<int> reads_per_sample_; // Number of reads for each sample
+  std::vector<int> reads_per_sample_; // Number of reads for each sample (prior to any read compression)
   double* log_gt_priors_;
 
   bool use_pop_freqs_;
 
-  // Iterates through reads and then allele_1, allele_2, and phase 1 or 2 by their indices
-  double* log_read_phase_posteriors_; 
+  // If true, train() accelerates the EM algorithm using SQUAREM extrapolation steps
+  bool accelerate_em_;
+  int num_em_iter_;       // Number of EM iterations performed by the last call to train()
+  int num_extrapolations_; // Number of SQUAREM extrapolations accepted by the last call to train()
 
   void calc_hap_aln_probs(double* log_aln_probs);
 
+  // Reads from the same sample with the same allele and phasing likelihoods contribute identically to each E and M step.
+  // Collapse each such set into a single record whose read weight is the number of reads it represents
+  void compress_reads();
+
   void init_log_sample_priors(double* log_sample_ptr);
   
   // Initialization functions for the EM algorithm
@@ -38,9 +45,15 @@ class EMStutterGenotyper: public Genotyper {
   // Functions for the M step of the EM algorithm
   void recalc_log_gt_priors();
   void recalc_stutter_model();
-  
-  // Functions for the E step of the EM algorithm
-  void recalc_log_read_phase_posteriors();
+
+  // Performs an E-step and an M-step for the current parameters and returns their LL
+  double run_em_iteration(bool disp_stats, std::ostream& logger);
+
+  // Functions to represent the stutter model and genotype priors as an unconstrained parameter vector for SQUAREM
+  void get_em_params(std::vector<double>& params);
+  bool set_em_params(const std::vector<double>& params);
+
+  bool train_accelerated(int max_iter, double min_LL_abs_change, double min_LL_frac_change, bool disp_stats, std::ostream& logger);
 
  public:
  EMStutterGenotyper(bool haploid, int motif_length,
@@ -49,8 +62,11 @@ class EMStutterGenotyper: public Genotyper {
 		    std::vector< std::vector<double> >& log_p2,
 		    std::vector<std::string>& sample_names, int ref_allele): Genotyper(haploid, sample_names, log_p1, log_p2){
     assert(num_bps.size() == log_p1.size() && num_bps.size() == log_p2.size() && num_bps.size() == sample_names.size());
-    motif_len_     = motif_length;
-    use_pop_freqs_ = false;
+    motif_len_          = motif_length;
+    use_pop_freqs_      = false;
+    accelerate_em_      = false;
+    num_em_iter_        = 0;
+    num_extrapolations_ = 0;
 
     // Compute the set of allele sizes
     std::set<int> allele_sizes;
@@ -76,14 +92,8 @@ class EMStutterGenotyper: public Genotyper {
     for (unsigned int i = 0; i < bps_per_allele_.size(); i++)
       allele_indices[bps_per_allele_[i]] = i;
 
-    // Allocate the relevant data structures
-    allele_index_              = new int[num_reads_];
-    log_gt_priors_             = new double[num_alleles_]; 
-    log_sample_posteriors_     = new double[num_samples_*num_alleles_*num_alleles_];
-    log_read_phase_posteriors_ = new double[num_reads_*num_alleles_*num_alleles_*2];
-    log_aln_probs_             = new double[num_reads_*num_alleles_];
-
     // Iterate through all reads and store the relevant information
+    allele_index_ = new int[num_reads_];
     unsigned int read_index = 0;
     for (unsigned int i = 0; i < num_bps.size(); i++){
       reads_per_sample_.push_back(num_bps[i].size());
@@ -93,18 +103,46 @@ class EMStutterGenotyper: public Genotyper {
       }
     }
     assert(read_index == num_reads_);
-    stutter_model_     = NULL;
+    compress_reads();
+
+    // Allocate the relevant data structures
+    log_gt_priors_             = new double[num_alleles_];
+    log_sample_posteriors_     = new double[num_samples_*num_sample_gts()];
+    log_aln_probs_             = new double[num_reads_*num_alleles_];
+    stutter_model_             = NULL;
+    init_stutter_model_        = NULL;
   }
 
   ~EMStutterGenotyper(){
     delete [] allele_index_;
     delete [] log_gt_priors_;
-    delete [] log_read_phase_posteriors_;
     delete stutter_model_;
+    delete init_stutter_model_;
   }  
   
   bool train(int max_iter, double min_LL_abs_change, double min_LL_frac_change, bool disp_stats, std::ostream& logger);
 
+  // Perform NUM_ITER EM iterations starting from the stutter model and allele frequencies learned by TRAINED, regardless of convergence.
+  // Used to refine a model trained on a subsample of the reads using all of them. Alleles that TRAINED didn't observe start from their read frequencies
+  void refine(EMStutterGenotyper& trained, int num_iter, bool disp_stats, std::ostream& logger);
+
+  // Number of bytes required by a genotyper with the provided dimensions, dominated by the read LLs (reads x alleles) and sample posteriors (samples x alleles^2)
+  static int64_t estimate_bytes(int64_t num_reads, int64_t num_samples, int64_t num_alleles, bool haploid = false){
+    return posterior_bytes(num_reads, num_samples, num_alleles, haploid) + num_reads*sizeof(int) + num_alleles*sizeof(double);
+  }
+
+  void accelerate_em(){ accelerate_em_ = true; }
+
+  // Warm-start subsequent calls to train() from a copy of the provided model (e.g. one previously learned for the locus)
+  void set_initial_stutter_model(StutterModel* model){
+    delete init_stutter_model_;
+    init_stutter_model_ = model->copy();
+    init_stutter_model_->set_period(motif_len_);
+  }
+
+  int num_em_iterations() const { return num_em_iter_;        }
+  int num_extrapolations() const { return num_extrapolations_; }
+
   StutterModel* get_stutter_model(){
     if (stutter_model_ == NULL)
       printErrorAndDie("No stutter model has been specified or learned");
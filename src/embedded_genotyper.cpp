@@ -0,0 +1,92 @@
+#include <ctype.h>
+#include <stdlib.h>
+
+#include "embedded_genotyper.h"
+#include "error.h"
+#include "locus_output_queue.h"
+#include "reference_sequence.h"
+
+bool parse_cigar_string(const std::string& cigar, std::vector<CigarOp>& cigar_ops){
+  cigar_ops.clear();
+  size_t i = 0;
+  while (i < cigar.size()){
+    size_t j = i;
+    while (j < cigar.size() && isdigit(cigar[j]))
+      j++;
+    if (j == i || j == cigar.size())
+      return false;
+    cigar_ops.push_back(CigarOp(cigar[j], atoi(cigar.substr(i, j-i).c_str())));
+    i = j+1;
+  }
+  return true;
+}
+
+EmbeddedGenotyper::EmbeddedGenotyper() : GenotyperBamProcessor(false, false){
+  buffer_log();
+}
+
+void EmbeddedGenotyper::build_alignments(const std::vector<SampleReads>& samples, int num_regions, std::vector<BamAlnList>& alignments,
+					 std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s,
+					 std::vector<std::string>& rg_names){
+  // Every read is used to analyze each region in the group
+  std::string passes(num_regions, '1');
+  std::vector<CigarOp> cigar_ops;
+  for (auto sample_iter = samples.begin(); sample_iter != samples.end(); sample_iter++){
+    rg_names.push_back(sample_iter->sample);
+    alignments.push_back(BamAlnList(sample_iter->reads.size()));
+    log_p1s.push_back(std::vector<double>());
+    log_p2s.push_back(std::vector<double>());
+    for (unsigned int i = 0; i < sample_iter->reads.size(); i++){
+      const ReadSpan& read = sample_iter->reads[i];
+      if (!parse_cigar_string(read.cigar, cigar_ops))
+	printErrorAndDie("Invalid CIGAR string " + read.cigar + " for read " + read.name);
+      BamAlignment& aln = alignments.back()[i];
+      if (!aln.Build(read.name, read.pos, read.reverse_strand, cigar_ops, read.sequence, read.qualities))
+	printErrorAndDie("The CIGAR string, bases and qualities of read " + read.name + " have inconsistent lengths");
+      add_passes_filters_tag(aln, passes);
+      log_p1s.back().push_back(read.log_p1);
+      log_p2s.back().push_back(read.log_p2);
+    }
+  }
+}
+
+void EmbeddedGenotyper::genotype(const RegionGroup& region_group, int32_t ref_start, int32_t chrom_length, const std::string& ref_bases,
+				 const std::vector<SampleReads>& samples, LocusGenotypes& result){
+  LocusErrorScope locus_errors;
+  discard_locus_output();
+  locus_timer_.clear();
+  result.genotyped = false;
+  result.loci.clear();
+  result.log.clear();
+
+  std::set<std::string> sample_names;
+  for (auto sample_iter = samples.begin(); sample_iter != samples.end(); sample_iter++)
+    if (!sample_names.insert(sample_iter->sample).second)
+      printErrorAndDie("Reads for sample " + sample_iter->sample + " were provided more than once");
+  buffer_str_columns(sample_names);
+
+  std::vector<BamAlnList> alignments;
+  std::vector< std::vector<double> > log_p1s, log_p2s;
+  std::vector<std::string> rg_names;
+  build_alignments(samples, region_group.num_regions(), alignments, log_p1s, log_p2s, rg_names);
+
+  if (ref_start < 0 || ref_start + (int64_t)ref_bases.size() > chrom_length)
+    printErrorAndDie("The reference window extends beyond the end of the chromosome");
+  ReferenceSequence chrom_seq;
+  std::string bases(ref_bases);
+  chrom_seq.assign(ref_start, chrom_length, bases);
+
+  RegionGroup group(region_group);
+  TOO_MANY_READS = false;
+  analyze_reads_and_phasing(alignments, log_p1s, log_p2s, rg_names, group, chrom_seq);
+
+  LocusOutput output;
+  extract_locus_output(output);
+  size_t pos = 0;
+  while (pos < output.str_columns.size()){
+    result.loci.push_back(LocusColumns());
+    result.loci.back().read(output.str_columns, pos);
+  }
+  result.genotyped = !result.loci.empty();
+  result.log       = output.log;
+}
@@ -0,0 +1,64 @@
+#ifndef EMBEDDED_GENOTYPER_H_
+#define EMBEDDED_GENOTYPER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "columnar_output.h"
+#include "genotyper_bam_processor.h"
+#include "region.h"
+
+/*
+ * Interface for programs that link against libhipstr.a and genotype one locus at a time using reads they've already
+ * obtained, rather than having HipSTR read them from BAMs. No files are opened: the caller provides the reference window
+ * and each sample's reads, and receives the genotypes in the layout used by --str-columns along with the locus' log.
+ *
+ * Options are configured using the GenotyperBamProcessor setters (e.g. set_default_stutter_model(), add_haploid_chrom(),
+ * use_single_precision_alns()) and the MIN_TOTAL_READS threshold. Stutter models are learned for each locus unless a default
+ * model has been set. Errors encountered while analyzing a locus are thrown as LocusErrors rather than terminating the process
+ */
+
+struct ReadSpan {
+  std::string name;
+  int32_t pos;            // 0-based position of the read's first aligned base
+  std::string cigar;      // CIGAR string, e.g. 10S30M2I68M
+  std::string sequence;   // Sequenced bases, in the orientation of the reference
+  std::string qualities;  // Phred+33 encoded base qualities
+  bool reverse_strand;
+  double log_p1, log_p2;  // Log-likelihoods that the read was derived from each haplotype. Both are 0 for unphased reads
+};
+
+struct SampleReads {
+  std::string sample;
+  std::vector<ReadSpan> reads;
+};
+
+struct LocusGenotypes {
+  bool genotyped;                  // False if the locus was skipped (e.g. too few reads) or genotyping failed
+  std::vector<LocusColumns> loci;  // For each genotyped region, the genotypes of the samples, which are sorted by name
+  std::string log;
+};
+
+class EmbeddedGenotyper : public GenotyperBamProcessor {
+ private:
+  void build_alignments(const std::vector<SampleReads>& samples, int num_regions, std::vector<BamAlnList>& alignments,
+			std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s,
+			std::vector<std::string>& rg_names);
+
+ public:
+  EmbeddedGenotyper();
+
+  /*
+   * Genotypes the group of regions using the samples' reads, which must overlap the regions. REF_BASES contains the reference
+   * sequence starting at the 0-based position REF_START of a chromosome of length CHROM_LENGTH. The window must extend
+   * beyond the ends of every read and at least the haplotype flanks beyond the regions
+   */
+  void genotype(const RegionGroup& region_group, int32_t ref_start, int32_t chrom_length, const std::string& ref_bases,
+		const std::vector<SampleReads>& samples, LocusGenotypes& result);
+};
+
+/* Parses a CIGAR string (e.g. 5S40M2D55M) into its operations. Returns false if it's not properly formatted */
+bool parse_cigar_string(const std::string& cigar, std::vector<CigarOp>& cigar_ops);
+
+#endif
@@ -1,10 +1,45 @@
 #include <stdlib.h>
+#include <chrono>
 #include <iostream>
 
 #include "error.h"
 
+namespace {
+thread_local bool locus_errors_enabled = false;
+thread_local double locus_deadline      = 0; // Seconds since the steady clock's epoch, or 0 if there's no deadline
+
+double steady_seconds(){
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}
+
 void printErrorAndDie(std::string message){
+  if (locus_errors_enabled)
+    throw LocusError(message);
   std::cerr << "ERROR: "    << message    << "\n" 
 	    << "Exiting..." << std::endl;
   exit(1);
 }
+
+LocusErrorScope::LocusErrorScope(bool enabled){
+  prev_enabled_        = locus_errors_enabled;
+  locus_errors_enabled = enabled;
+}
+
+LocusErrorScope::~LocusErrorScope(){
+  locus_errors_enabled = prev_enabled_;
+}
+
+LocusDeadline::LocusDeadline(double seconds){
+  prev_deadline_ = locus_deadline;
+  locus_deadline = (seconds > 0 ? steady_seconds() + seconds : 0);
+}
+
+LocusDeadline::~LocusDeadline(){
+  locus_deadline = prev_deadline_;
+}
+
+void checkLocusDeadline(){
+  if (locus_deadline != 0 && locus_errors_enabled && steady_seconds() > locus_deadline)
+    throw LocusTimeout("Exceeded the time limit for the locus");
+}
@@ -1,8 +1,57 @@
 #ifndef ERROR_H_
 #define ERROR_H_
 
+#include <stdexcept>
 #include <string>
 
+// Prints the error message and exits, unless the current thread is within an enabled LocusErrorScope, in which case a LocusError is thrown
 void printErrorAndDie(std::string message) __attribute__ ((noreturn));
 
+// Error encountered while analyzing a locus, which only requires the locus to be abandoned
+class LocusError : public std::runtime_error {
+ public:
+  explicit LocusError(const std::string& message) : std::runtime_error(message){}
+};
+
+/*
+ * While an enabled scope is the innermost scope on a thread, printErrorAndDie() calls made by the thread throw a LocusError rather than
+ * exiting. Code whose shared state can't be safely unwound, like alignments split across several threads, uses a disabled scope
+ */
+class LocusErrorScope {
+ private:
+  bool prev_enabled_;
+
+ public:
+  explicit LocusErrorScope(bool enabled=true);
+  ~LocusErrorScope();
+
+  LocusErrorScope(const LocusErrorScope&)            = delete;
+  LocusErrorScope& operator=(const LocusErrorScope&) = delete;
+};
+
+// Thrown by checkLocusDeadline() once the analysis of a locus has exceeded its time limit
+class LocusTimeout : public LocusError {
+ public:
+  explicit LocusTimeout(const std::string& message) : LocusError(message){}
+};
+
+/*
+ * While a deadline is the innermost one on a thread, checkLocusDeadline() calls made by the thread throw a LocusTimeout once SECONDS
+ * have elapsed since its construction. A deadline with SECONDS <= 0 never expires. The checks are cooperative cancellation points
+ * in the long-running loops, and are ignored within a disabled LocusErrorScope, where the locus can't be safely abandoned
+ */
+class LocusDeadline {
+ private:
+  double prev_deadline_;
+
+ public:
+  explicit LocusDeadline(double seconds);
+  ~LocusDeadline();
+
+  LocusDeadline(const LocusDeadline&)            = delete;
+  LocusDeadline& operator=(const LocusDeadline&) = delete;
+};
+
+void checkLocusDeadline();
+
 #endif
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <iostream>
 #include <sstream>
 
 #include "error.h"
@@ -62,3 +63,22 @@ void FastaReader::init(std::string& path){
   }
 }
 
+
+void FastaReader::use_packed_reference(const std::string& path){
+  assert(packed_ref_ == NULL);
+  std::vector<std::string> chroms;
+  for (auto index_iter = chrom_to_index_.begin(); index_iter != chrom_to_index_.end(); index_iter++)
+    chroms.push_back(index_iter->first);
+
+  if (!file_exists(path)){
+    std::cerr << "Generating packed reference file " << path << " from the FASTA file(s)" << std::endl;
+    PackedReference::write(path, chroms, [&](size_t i, std::string& seq){ get_sequence(chroms[i], seq); });
+  }
+  packed_ref_ = new PackedReference(path);
+
+  // Ensure that the packed reference was generated from the same FASTA files
+  for (auto chrom_iter = chroms.begin(); chrom_iter != chroms.end(); chrom_iter++)
+    if (packed_ref_->sequence_length(*chrom_iter) != faidx_seq_len(chrom_to_index_[*chrom_iter], chrom_iter->c_str()))
+      printErrorAndDie("Packed reference file " + path + " doesn't match the provided FASTA file(s) for chromosome " + *chrom_iter
+		       + ". Please delete it and rerun the analysis to regenerate it");
+}
@@ -2,6 +2,7 @@
 #define FASTA_READER_H_
 
 #include <assert.h>
+#include <algorithm>
 #include <map>
 #include <stdlib.h>
 #include <string>
@@ -10,6 +11,8 @@
 #include <vector>
 
 #include "error.h"
+#include "packed_reference.h"
+#include "reference_sequence.h"
 #include "stringops.h"
 
 extern "C" {
@@ -26,6 +29,10 @@ class FastaReader {
  private:
   std::map<std::string, faidx_t*> chrom_to_index_;
   std::vector<faidx_t*> fasta_indices_;
+  PackedReference* packed_ref_;
+
+  // Windows of each chromosome held in memory by preload_window(), keyed by their start positions
+  std::map<std::string, std::map<int32_t, std::string> > resident_windows_;
 
   bool file_exists(std::string path){
     return (access(path.c_str(), F_OK) != -1);
@@ -40,6 +47,22 @@ class FastaReader {
   void add_index(std::string& path);
   void init(std::string& path);
 
+  // Returns the index for the chromosome and stores its name in the FASTA files in CHROM_KEY,
+  // which may lack the chr prefix present in CHROM
+  faidx_t* find_index(std::string& chrom, std::string& chrom_key){
+    chrom_key = chrom;
+    auto index_iter = chrom_to_index_.find(chrom);
+    if (index_iter == chrom_to_index_.end()){
+      if (chrom.size() > 3 && string_starts_with(chrom, "chr")){
+	chrom_key  = chrom.substr(3);
+	index_iter = chrom_to_index_.find(chrom_key);
+      }
+      if (index_iter == chrom_to_index_.end())
+	printErrorAndDie("No entry for chromosome " + chrom + " found in FASTA files");
+    }
+    return index_iter->second;
+  }
+
  public:
   /*
    * PATH is either (i)  a single indexed FASTA file, containing one or more chromosomes
@@ -47,31 +70,35 @@ class FastaReader {
    * Sequences from all chromosomes in the relevant FASTA file(s) will be available for queries
    */
   FastaReader(std::string path){
+    packed_ref_ = NULL;
     init(path);
   }
 
   ~FastaReader(){
+    delete packed_ref_;
     for (unsigned int i = 0; i < fasta_indices_.size(); i++)
       fai_destroy(fasta_indices_[i]);
   }
 
+  /*
+   * Memory-map the packed reference at PATH and use it to retrieve sequences instead of the FASTA files.
+   * If the file doesn't exist, it's first generated from the FASTA files
+   */
+  void use_packed_reference(const std::string& path);
+
   /*
    * Retrieves the sequence with name CHROM from the relevant FASTA file and stores it in SEQ
    */
   void get_sequence(std::string& chrom, std::string& seq){
-    std::string chrom_key = chrom;
-    auto index_iter = chrom_to_index_.find(chrom);
-    if (index_iter == chrom_to_index_.end()){
-      if (chrom.size() > 3 && string_starts_with(chrom, "chr")){
-	chrom_key  = chrom.substr(3);
-	index_iter = chrom_to_index_.find(chrom_key);
-      }
-      if (index_iter == chrom_to_index_.end())
-	printErrorAndDie("No entry for chromosome " + chrom + " found in FASTA files"); 
+    std::string chrom_key;
+    faidx_t* index = find_index(chrom, chrom_key);
+    if (packed_ref_ != NULL){
+      packed_ref_->get_sequence(chrom_key, seq);
+      return;
     }
 
     int length;
-    char* result = fai_fetch(index_iter->second, chrom_key.c_str(), &length);
+    char* result = fai_fetch(index, chrom_key.c_str(), &length);
     assert(result != NULL);
     seq.assign(result, length);
     free((void *)result);
@@ -82,23 +109,82 @@ class FastaReader {
    * and stores the 0-index based substring from START -> END (inclusive) in SEQ
    */
   void get_sequence(std::string& chrom, int32_t start, int32_t end, std::string& seq){
-    std::string chrom_key = chrom;
-    auto index_iter = chrom_to_index_.find(chrom);
-    if (index_iter == chrom_to_index_.end()){
-      if (chrom.size() > 3 && string_starts_with(chrom, "chr")){
-	chrom_key  = chrom.substr(3);
-	index_iter = chrom_to_index_.find(chrom_key);
-      }
-      if (index_iter == chrom_to_index_.end())
-      printErrorAndDie("No entry for chromosome " + chrom + " found in FASTA files");
+    std::string chrom_key;
+    faidx_t* index = find_index(chrom, chrom_key);
+    if (packed_ref_ != NULL){
+      packed_ref_->get_sequence(chrom_key, start, end, seq);
+      return;
     }
-      
+
     int length;
-    char* result = faidx_fetch_seq(index_iter->second, chrom_key.c_str(), start, end, &length);
+    char* result = faidx_fetch_seq(index, chrom_key.c_str(), start, end, &length);
     assert(result != NULL);
     seq.assign(result, length);
     free((void *)result);
   }
+
+  /*
+   * Length of the sequence with name CHROM in the relevant FASTA file
+   */
+  int32_t get_sequence_length(std::string& chrom){
+    std::string chrom_key;
+    faidx_t* index = find_index(chrom, chrom_key);
+    return faidx_seq_len(index, chrom_key.c_str());
+  }
+
+  /*
+   * Retrieves the entire sequence with name CHROM and stores it in REF
+   */
+  void get_sequence(std::string& chrom, ReferenceSequence& ref){
+    std::string seq;
+    get_sequence(chrom, seq);
+    ref.assign(0, seq.size(), seq);
+  }
+
+  /*
+   * Retrieves only the 0-index based window from START -> END (inclusive) of the sequence with name CHROM,
+   * clipped to the sequence boundaries, and stores it in REF
+   */
+  void get_window(std::string& chrom, int32_t start, int32_t end, ReferenceSequence& ref){
+    int32_t length = get_sequence_length(chrom);
+    start = std::max(0, start);
+    end   = std::min(length-1, end);
+    std::string seq;
+    if (!get_resident_sequence(chrom, start, end, seq))
+      get_sequence(chrom, start, end, seq);
+    ref.assign(start, length, seq);
+  }
+
+  /*
+   * Loads the 0-index based window from START -> END (inclusive) of chromosome CHROM into memory, so that get_window() requests
+   * contained within it are served without reading the FASTA files. Windows on the same chromosome must not overlap
+   */
+  void preload_window(std::string& chrom, int32_t start, int32_t end){
+    int32_t length = get_sequence_length(chrom);
+    start = std::max(0, start);
+    end   = std::min(length-1, end);
+    std::string seq;
+    get_sequence(chrom, start, end, seq);
+    resident_windows_[chrom][start].swap(seq);
+  }
+
+  /*
+   * Stores the 0-index based substring from START -> END (inclusive) of CHROM in SEQ if it's contained in a preloaded window.
+   * Returns false if it isn't
+   */
+  bool get_resident_sequence(const std::string& chrom, int32_t start, int32_t end, std::string& seq) const {
+    auto chrom_iter = resident_windows_.find(chrom);
+    if (chrom_iter == resident_windows_.end())
+      return false;
+    auto window_iter = chrom_iter->second.upper_bound(start);
+    if (window_iter == chrom_iter->second.begin())
+      return false;
+    --window_iter;
+    if (end >= window_iter->first + (int64_t)window_iter->second.size())
+      return false;
+    seq = window_iter->second.substr(start-window_iter->first, end-start+1);
+    return true;
+  }
 };
 
 #endif
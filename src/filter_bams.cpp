@@ -1,4 +1,11 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <deque>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "error.h"
@@ -21,7 +28,7 @@ std::string trim_alignment_name(BamAlignment& aln){
 void filter_bam_paired_mode(BamCramReader& reader,
 			    std::vector< std::vector<Region> >& regions,
 			    std::map<std::string, int>& chrom_order,
-			    std::string& output_filename){
+			    std::string& output_filename, htsThreadPool* pool){
   // Construct interval trees for each chromosome's regions indexed by the reference id in the BAM file + 1
   std::vector< IntervalTree<bool> > interval_trees;
   interval_trees.push_back(IntervalTree<bool>()); // Empty interval tree for RefID=-1 (unmapped)
@@ -40,11 +47,13 @@ void filter_bam_paired_mode(BamCramReader& reader,
   }
 
   BamWriter writer(output_filename, reader.bam_header());
+  if (pool != NULL && !writer.SetThreadPool(pool))
+    printErrorAndDie("Failed to attach the compression thread pool to the BAM output file");
   BamAlignment alignments[2];
    
   int64_t read_count = 0;
   int aln_count      = 0;
-  while (reader.GetNextAlignment(alignments[aln_count])){
+  while (reader.GetNextFileAlignment(alignments[aln_count])){
     read_count++;
 
     if (aln_count == 0)
@@ -84,102 +93,331 @@ void filter_bam_paired_mode(BamCramReader& reader,
 }
 
 
-void filter_bam(BamCramReader& reader,
-                std::vector< std::vector<Region> >&regions,
-                std::map<std::string, int>& chrom_order,
-                std::string& output_filename){
-  const BamHeader* bam_header = reader.bam_header();
-  BamWriter writer(output_filename, reader.bam_header());
-  BamAlignment alignment;
+// Merge the overlapping and adjacent regions, which are sorted by their start coordinates, into a sorted list of disjoint intervals
+void merge_regions(const std::vector<Region>& regions, std::vector< std::pair<int32_t, int32_t> >& intervals){
+  intervals.clear();
+  for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++){
+    if (!intervals.empty() && region_iter->start() <= intervals.back().second+1)
+      intervals.back().second = std::max(intervals.back().second, region_iter->stop());
+    else
+      intervals.push_back(std::pair<int32_t, int32_t>(region_iter->start(), region_iter->stop()));
+  }
+}
 
-  int chrom_id = -2, chrom_idx = -1, region_idx = -1;  // Use -2 for chrom_id b/c *, the reference for unmapped reads, has a RefID of -1 
-  int64_t read_count = 0;
-  int32_t prev_pos   = -1, max_regions = 0;
-  std::set<int> proc_chroms;
-  std::map<std::string, int32_t> aligned_mate_pairs;
-  std::map<std::string, BamAlignment> unaligned_mate_pairs;
+/*
+  Determines whether reads visited in ascending order of their positions overlap a chromosome's regions, using a cursor
+  over the regions' merged intervals that only moves forward. Each test therefore takes amortized constant time and
+  doesn't require the tree traversal of an IntervalTree, which is only needed when the reads aren't sorted
+ */
+class SortedIntervalCursor {
+ private:
+  std::vector< std::pair<int32_t, int32_t> > intervals_;
+  size_t index_;
 
-  while (reader.GetNextAlignment(alignment)){
-    read_count++;
+ public:
+  SortedIntervalCursor(){
+    index_ = 0;
+  }
 
-    if (read_count % 1000000 == 0){
-      std::cerr << "\tProcessing read # " << read_count << std::endl;
-           
+  // Use the provided regions, or none if REGIONS is NULL, and rewind the cursor
+  void reset(const std::vector<Region>* regions){
+    if (regions == NULL)
+      intervals_.clear();
+    else
+      merge_regions(*regions, intervals_);
+    index_ = 0;
+  }
+
+  // Returns true iff [START, END] overlaps an interval. START must be at least that of the previous query
+  bool overlaps(int32_t start, int32_t end){
+    while (index_ < intervals_.size() && intervals_[index_].second < start)
+      index_++;
+    return (index_ < intervals_.size() && intervals_[index_].first <= end);
+  }
+};
+
+/*
+  Filters the reads of a single chromosome in a sorted BAM, writing each read that overlaps one of the chromosome's regions
+  along with its mate pair (if the mate is also on the chromosome). The unaligned mate pairs that were seen more than 100 kb
+  upstream are discarded after every 1,000,000 reads on the chromosome, so that the output doesn't depend on how many reads
+  preceded the chromosome and each chromosome can be filtered independently of the others
+ */
+class SortedChromFilter {
+ private:
+  SortedIntervalCursor intervals_;
+  int32_t prev_pos_;
+  int64_t read_count_;
+  std::map<std::string, int32_t> aligned_mate_pairs_;
+  std::map<std::string, BamAlignment> unaligned_mate_pairs_;
+
+ public:
+  SortedChromFilter(){
+    reset(NULL, -1);
+  }
+
+  // Start filtering a chromosome whose first read is at FIRST_POS, where REGIONS is NULL if the chromosome has no regions
+  void reset(const std::vector<Region>* regions, int32_t first_pos){
+    intervals_.reset(regions);
+    prev_pos_    = first_pos;
+    read_count_  = 0;
+    aligned_mate_pairs_.clear();
+    unaligned_mate_pairs_.clear();
+  }
+
+  void process(BamAlignment& alignment, BamWriter& writer){
+    read_count_++;
+    if (read_count_ % 1000000 == 0){
       // Clear unaligned reads without identified mate pairs and likely don't have any mapped mates
-      auto unaln_iter = unaligned_mate_pairs.begin();
-      while (unaln_iter != unaligned_mate_pairs.end()){
-	if (prev_pos - unaln_iter->second.Position() > 100000)
-	  unaligned_mate_pairs.erase(unaln_iter++);
+      auto unaln_iter = unaligned_mate_pairs_.begin();
+      while (unaln_iter != unaligned_mate_pairs_.end()){
+	if (prev_pos_ - unaln_iter->second.Position() > 100000)
+	  unaligned_mate_pairs_.erase(unaln_iter++);
 	else
 	  unaln_iter++;
       }
     }
 
-    if (alignment.RefID() != chrom_id){
-      proc_chroms.insert(chrom_id);
-      if (proc_chroms.find(alignment.RefID()) != proc_chroms.end())
-	printErrorAndDie("Chromosomes in BAM file must be in sorted order. Out of order at read " + alignment.Name());
-      chrom_id = alignment.RefID();
-      if (alignment.RefID() == -1 || chrom_order.find(bam_header->ref_name(alignment.RefID())) == chrom_order.end()) {
-	chrom_idx   = -1;
-	max_regions = 0;
-      }
-      else {
-	chrom_idx  = chrom_order[bam_header->ref_name(alignment.RefID())];
-	max_regions = regions[chrom_idx].size();
-      }
-
-      region_idx = 0;
-      prev_pos   = alignment.Position();
-      aligned_mate_pairs.clear();
-      unaligned_mate_pairs.clear();
-    }
-
-    if (alignment.Position() < prev_pos)
+    if (alignment.Position() < prev_pos_)
       printErrorAndDie("BAM files must be sorted. Out of order at read " + alignment.Name());
     else
-      prev_pos = alignment.Position();
-    
-    // Check if it overlaps a region
-    while (region_idx < max_regions && regions[chrom_idx][region_idx].stop() < alignment.Position())
-      region_idx++;
+      prev_pos_ = alignment.Position();
 
     std::string aln_key = trim_alignment_name(alignment);
 
-    if (region_idx < max_regions && regions[chrom_idx][region_idx].start() <= alignment.GetEndPosition()){
+    // Check if it overlaps a region
+    if (intervals_.overlaps(alignment.Position(), alignment.GetEndPosition())){
       // Process region overlap
       if (!writer.SaveAlignment(alignment))  printErrorAndDie("Failed to save alignment for STR-containing read");
 
-      auto iter = unaligned_mate_pairs.find(aln_key);
-      if (iter != unaligned_mate_pairs.end()){
+      auto iter = unaligned_mate_pairs_.find(aln_key);
+      if (iter != unaligned_mate_pairs_.end()){
 	if (!writer.SaveAlignment(iter->second))
 	  printErrorAndDie("Failed to save alignment for mate pair read");
-	unaligned_mate_pairs.erase(iter);
+	unaligned_mate_pairs_.erase(iter);
       }
       else {
-	auto iter = aligned_mate_pairs.find(aln_key);
-	if (iter != aligned_mate_pairs.end())
-	  aligned_mate_pairs.erase(iter);
+	auto iter = aligned_mate_pairs_.find(aln_key);
+	if (iter != aligned_mate_pairs_.end())
+	  aligned_mate_pairs_.erase(iter);
 	else
-	  aligned_mate_pairs.insert(std::pair<std::string, int32_t>(aln_key, alignment.Position()));
+	  aligned_mate_pairs_.insert(std::pair<std::string, int32_t>(aln_key, alignment.Position()));
       }
     }
     else {
       // No region overlap but examine any relevant mate pair information
-      auto iter = aligned_mate_pairs.find(aln_key);
-      if (iter != aligned_mate_pairs.end()){
-	aligned_mate_pairs.erase(iter);
+      auto iter = aligned_mate_pairs_.find(aln_key);
+      if (iter != aligned_mate_pairs_.end()){
+	aligned_mate_pairs_.erase(iter);
 	if (!writer.SaveAlignment(alignment))
           printErrorAndDie("Failed to save alignment for mate pair read");
       }
       else {
-	auto iter = unaligned_mate_pairs.find(aln_key);
-	if (iter != unaligned_mate_pairs.end())
-	  unaligned_mate_pairs.erase(iter);
-	else 
-	  unaligned_mate_pairs.insert(std::pair<std::string, BamAlignment>(aln_key, alignment));
+	auto iter = unaligned_mate_pairs_.find(aln_key);
+	if (iter != unaligned_mate_pairs_.end())
+	  unaligned_mate_pairs_.erase(iter);
+	else
+	  unaligned_mate_pairs_.insert(std::pair<std::string, BamAlignment>(aln_key, alignment));
+      }
+    }
+  }
+};
+
+void filter_bam(BamCramReader& reader,
+                std::vector< std::vector<Region> >&regions,
+                std::map<std::string, int>& chrom_order,
+                std::string& output_filename, htsThreadPool* pool){
+  const BamHeader* bam_header = reader.bam_header();
+  BamWriter writer(output_filename, reader.bam_header());
+  if (pool != NULL && !writer.SetThreadPool(pool))
+    printErrorAndDie("Failed to attach the compression thread pool to the BAM output file");
+  BamAlignment alignment;
+  SortedChromFilter chrom_filter;
+
+  int chrom_id = -2;  // Use -2 for chrom_id b/c *, the reference for unmapped reads, has a RefID of -1
+  int64_t read_count = 0;
+  std::set<int> proc_chroms;
+
+  while (reader.GetNextFileAlignment(alignment)){
+    read_count++;
+    if (read_count % 1000000 == 0)
+      std::cerr << "\tProcessing read # " << read_count << std::endl;
+
+    if (alignment.RefID() != chrom_id){
+      proc_chroms.insert(chrom_id);
+      if (proc_chroms.find(alignment.RefID()) != proc_chroms.end())
+	printErrorAndDie("Chromosomes in BAM file must be in sorted order. Out of order at read " + alignment.Name());
+      chrom_id = alignment.RefID();
+      if (alignment.RefID() == -1 || chrom_order.find(bam_header->ref_name(alignment.RefID())) == chrom_order.end())
+	chrom_filter.reset(NULL, alignment.Position());
+      else
+	chrom_filter.reset(&regions[chrom_order[bam_header->ref_name(alignment.RefID())]], alignment.Position());
+    }
+    chrom_filter.process(alignment, writer);
+  }
+  writer.Close();
+}
+
+// Append the BGZF blocks in the file at PATH to OUTPUT, excluding the file's trailing empty EOF block
+void append_bgzf_fragment(const std::string& path, BGZF* output){
+  static const char BGZF_EOF[29] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+  const size_t EOF_LEN = 28;
+  std::ifstream input(path.c_str(), std::ios::binary);
+  if (!input.is_open())
+    printErrorAndDie("Failed to open BAM fragment " + path);
+  std::string data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+  if (data.size() < EOF_LEN || data.compare(data.size()-EOF_LEN, EOF_LEN, BGZF_EOF, EOF_LEN) != 0)
+    printErrorAndDie("BAM fragment " + path + " is missing its BGZF EOF block");
+  if (data.size() > EOF_LEN && bgzf_raw_write(output, data.data(), data.size()-EOF_LEN) < 0)
+    printErrorAndDie("Failed to append BAM fragment " + path + " to the output file");
+}
+
+void filter_bam_parallel(BamCramReader& reader, std::string& input_file,
+			 std::vector< std::vector<Region> >&regions,
+			 std::map<std::string, int>& chrom_order,
+			 std::string& output_filename, int num_workers, htsThreadPool* pool){
+  // Only the reads on chromosomes with regions can be written, so the remaining chromosomes and the unmapped reads are skipped
+  const BamHeader* bam_header = reader.bam_header();
+  std::vector<int32_t> tids;
+  std::vector<std::string> fragments;
+  for (int32_t tid = 0; tid < bam_header->num_seqs(); tid++){
+    if (chrom_order.find(bam_header->ref_name(tid)) == chrom_order.end())
+      continue;
+    tids.push_back(tid);
+    fragments.push_back(output_filename + ".chrom" + std::to_string(tid) + ".tmp.bam");
+  }
+
+  std::atomic<size_t> next_chrom(0);
+  std::atomic<int64_t> total_reads(0);
+  auto filter_chroms = [&](){
+    BamCramReader chrom_reader(input_file);
+    if (pool != NULL && !chrom_reader.SetThreadPool(pool))
+      printErrorAndDie("Failed to attach the decompression thread pool to file " + input_file);
+    BamAlignment alignment;
+    SortedChromFilter chrom_filter;
+    size_t index;
+    while ((index = next_chrom++) < tids.size()){
+      const std::string& chrom = bam_header->ref_name(tids[index]);
+      BamWriter writer(fragments[index], NULL);
+      if (pool != NULL && !writer.SetThreadPool(pool))
+	printErrorAndDie("Failed to attach the compression thread pool to BAM fragment " + fragments[index]);
+      if (!chrom_reader.SetRegion(chrom, 0, INT32_MAX))
+	printErrorAndDie("Failed to set the BAM region for chromosome " + chrom);
+
+      int64_t read_count = 0;
+      bool first = true;
+      while (chrom_reader.GetNextAlignment(alignment)){
+	if (first){
+	  chrom_filter.reset(&regions[chrom_order[chrom]], alignment.Position());
+	  first = false;
+	}
+	chrom_filter.process(alignment, writer);
+	read_count++;
+      }
+      writer.Close();
+      total_reads += read_count;
+      std::cerr << ("\tFiltered " + std::to_string(read_count) + " reads on chromosome " + chrom + "\n") << std::flush;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::min((size_t)num_workers, tids.size()); i++)
+    workers.push_back(std::thread(filter_chroms));
+  for (auto worker_iter = workers.begin(); worker_iter != workers.end(); worker_iter++)
+    worker_iter->join();
+  std::cerr << "\tFiltered " << total_reads << " reads on " << tids.size() << " chromosomes" << std::endl;
+
+  // Concatenate the fragments in header order after the output's header, whose blocks must be flushed first
+  BGZF* output = bgzf_open(output_filename.c_str(), "w");
+  if (output == NULL)
+    printErrorAndDie("Failed to open BAM output file");
+  if (bam_hdr_write(output, bam_header->header_) == -1 || bgzf_flush(output) != 0)
+    printErrorAndDie("Failed to write the BAM header to the output file");
+  for (unsigned int i = 0; i < fragments.size(); i++){
+    append_bgzf_fragment(fragments[i], output);
+    std::remove(fragments[i].c_str());
+  }
+  if (bgzf_close(output) != 0)
+    printErrorAndDie("Failed to close the BAM output file");
+}
+
+void filter_bam_indexed(BamCramReader& reader,
+			std::vector< std::vector<Region> >&regions,
+			std::map<std::string, int>& chrom_order,
+			std::string& output_filename, htsThreadPool* pool){
+  const BamHeader* bam_header = reader.bam_header();
+  BamWriter writer(output_filename, reader.bam_header());
+  if (pool != NULL && !writer.SetThreadPool(pool))
+    printErrorAndDie("Failed to attach the compression thread pool to the BAM output file");
+  BamAlignment alignment;
+
+  // Mate pairs of the STR reads that haven't been written, keyed by the read name
+  std::unordered_map<std::string, std::pair<int32_t, int32_t> > missing_mates;
+  int64_t read_count = 0, mate_count = 0;
+
+  // Visit the chromosomes in the order of the BAM header so that the reads are written in sorted order
+  for (int32_t tid = 0; tid < bam_header->num_seqs(); tid++){
+    auto chrom_iter = chrom_order.find(bam_header->ref_name(tid));
+    if (chrom_iter == chrom_order.end())
+      continue;
+
+    // Merge overlapping regions so that each read is only extracted once per set of overlapping regions
+    std::vector< std::pair<int32_t, int32_t> > intervals;
+    merge_regions(regions[chrom_iter->second], intervals);
+
+    for (unsigned int i = 0; i < intervals.size(); i++){
+      if (!reader.SetRegion(bam_header->ref_name(tid), std::max(0, intervals[i].first-1), intervals[i].second+1))
+	printErrorAndDie("Failed to set the BAM region for chromosome " + bam_header->ref_name(tid));
+      while (reader.GetNextAlignment(alignment)){
+	// Use the same overlap criterion as filter_bam, and skip reads that were extracted for the previous interval
+	if (intervals[i].first > alignment.GetEndPosition() || intervals[i].second < alignment.Position())
+	  continue;
+	if (i > 0 && intervals[i-1].first <= alignment.GetEndPosition() && intervals[i-1].second >= alignment.Position())
+	  continue;
+
+	if (!writer.SaveAlignment(alignment))
+	  printErrorAndDie("Failed to save alignment for STR-containing read");
+	read_count++;
+
+	std::string aln_key = trim_alignment_name(alignment);
+	auto mate_iter = missing_mates.find(aln_key);
+	if (mate_iter != missing_mates.end())
+	  missing_mates.erase(mate_iter);
+	else if (alignment.IsPaired() && alignment.MateRefID() >= 0)
+	  missing_mates.insert(std::make_pair(aln_key, std::pair<int32_t, int32_t>(alignment.MateRefID(), alignment.MatePosition())));
       }
-    } 
+    }
+  }
+  std::cerr << "\tExtracted " << read_count << " STR-containing reads" << std::endl;
+
+  // Extract the missing mate pairs in sorted order, using one index query for each cluster of nearby mate positions
+  const int32_t MAX_MATE_GAP = 1000;
+  std::vector< std::pair<int32_t, int32_t> > mate_positions;
+  for (auto mate_iter = missing_mates.begin(); mate_iter != missing_mates.end(); mate_iter++)
+    mate_positions.push_back(mate_iter->second);
+  std::sort(mate_positions.begin(), mate_positions.end());
+  size_t cluster_start = 0;
+  while (cluster_start < mate_positions.size()){
+    int32_t tid = mate_positions[cluster_start].first;
+    size_t cluster_end = cluster_start+1;
+    while (cluster_end < mate_positions.size() && mate_positions[cluster_end].first == tid
+	   && mate_positions[cluster_end].second - mate_positions[cluster_end-1].second <= MAX_MATE_GAP)
+      cluster_end++;
+    int32_t min_pos = mate_positions[cluster_start].second, max_pos = mate_positions[cluster_end-1].second;
+    cluster_start   = cluster_end;
+
+    if (!reader.SetRegion(bam_header->ref_name(tid), min_pos, max_pos+1))
+      continue;
+    while (reader.GetNextAlignment(alignment)){
+      if (alignment.Position() < min_pos)
+	continue;
+      auto mate_iter = missing_mates.find(trim_alignment_name(alignment));
+      if (mate_iter == missing_mates.end() || mate_iter->second.first != tid || mate_iter->second.second != alignment.Position())
+	continue;
+      if (!writer.SaveAlignment(alignment))
+	printErrorAndDie("Failed to save alignment for mate pair read");
+      missing_mates.erase(mate_iter);
+      mate_count++;
+    }
   }
+  std::cerr << "\tExtracted " << mate_count << " mate pair reads" << std::endl;
   writer.Close();
 }
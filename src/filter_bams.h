@@ -8,13 +8,34 @@
 #include "bam_io.h"
 #include "region.h"
 
+// Each function writes its output using the provided thread pool for BGZF compression, unless it's NULL
+
 void filter_bam_paired_mode(BamCramReader& reader,
                             std::vector< std::vector<Region> >& regions,
                             std::map<std::string, int>& chrom_order,
-                            std::string& output_filename);
+                            std::string& output_filename, htsThreadPool* pool);
 
 void filter_bam(BamCramReader& reader,
                 std::vector< std::vector<Region> >&regions,
                 std::map<std::string, int>& chrom_order,
-                std::string& output_filename);
+                std::string& output_filename, htsThreadPool* pool);
+
+/*
+  Filter a sorted and indexed BAM using NUM_WORKERS threads that each filter one chromosome at a time. Each thread reads its
+  chromosome through its own reader of INPUT_FILE and writes the chromosome's reads to a BGZF fragment, and the fragments are concatenated
+  in the order of the BAM header. The output is identical to that of filter_bam()
+ */
+void filter_bam_parallel(BamCramReader& reader, std::string& input_file,
+			 std::vector< std::vector<Region> >&regions,
+			 std::map<std::string, int>& chrom_order,
+			 std::string& output_filename, int num_workers, htsThreadPool* pool);
+
+/*
+  Filter a sorted and indexed BAM by using its index to extract only the reads that overlap each region, followed by
+  a second pass that extracts their mate pairs. The STR reads and the mate pairs are each written in sorted order
+ */
+void filter_bam_indexed(BamCramReader& reader,
+			std::vector< std::vector<Region> >&regions,
+			std::map<std::string, int>& chrom_order,
+			std::string& output_filename, htsThreadPool* pool);
 #endif
@@ -15,15 +15,23 @@
 #include "region.h"
 
 void parse_command_line_args(int argc, char** argv,    std::string& input_file, std::string& output_file, 
-			     std::string& region_file, int& paired_mode, int& region_pad){
+			     std::string& region_file, int& paired_mode, int& region_pad, int& use_index, int& num_threads,
+			     int& parallel_chroms){
    if (argc == 1){
-    std::cerr << "Usage: BamSieve --in <in.bam> --out <out.bam> --regions <region_file.bed> [--insert-stats <stat_file.txt>]]"                            << "\n"
+    std::cerr << "Usage: BamSieve --in <in.bam> --out <out.bam> --regions <region_file.bed> [--use-index] [--threads <num_threads>] [--parallel-chroms <n>]"    << "\n"
 	      << "\t" << "--in            <in.bam>         " << "\t"  << "Input BAM file to filter"                                                       << "\n"
 	      << "\t" << "--out           <out.bam>        " << "\t"  << "Output BAM file containing filtered reads and their mate pairs"                 << "\n"
 	      << "\t" << "--regions       <region_file.bed>" << "\t"  << "BED file containing coordinates for regions to filter "                         << "\n"
 	      << "\t" << "--paired                         " << "\t"  << "Paired end reads are adjacent in the BAM file. By default, it is assumed that"  << "\n"
 	      << "\t" << "                                 " << "\t"  << "this is not the case and that the BAM is sorted by position"                    << "\n"
 	      << "\t" << "--pad           <bp_pad>         " << "\t"  << "Extend each region by BP_PAD base pairs. By default, each region is unmodified" << "\n"
+	      << "\t" << "--use-index                      " << "\t"  << "Use the BAM's index to only read the alignments overlapping each region and"   << "\n"
+	      << "\t" << "                                 " << "\t"  << "their mate pairs, instead of scanning the entire file. The STR reads and the"   << "\n"
+	      << "\t" << "                                 " << "\t"  << "mate pairs are each sorted, so the output must be sorted before indexing"      << "\n"
+	      << "\t" << "--threads       <num_threads>    " << "\t"  << "Number of threads used to decompress the input and compress the output (Default = 1)" << "\n"
+	      << "\t" << "--parallel-chroms <n>            " << "\t"  << "Filter N chromosomes of a sorted and indexed BAM concurrently, writing each to a"  << "\n"
+	      << "\t" << "                                 " << "\t"  << "temporary fragment alongside the output that's merged into it in header order."  << "\n"
+	      << "\t" << "                                 " << "\t"  << "The output is identical to that of the default mode (Default = 1)"            << "\n"
 	      << "\n";
     exit(0);
   }
@@ -33,20 +41,26 @@ void parse_command_line_args(int argc, char** argv,    std::string& input_file,
     {"out",          required_argument, 0, 'o'},
     {"pad",          required_argument, 0, 'p'},
     {"regions",      required_argument, 0, 'r'},
+    {"threads",      required_argument, 0, 't'},
+    {"parallel-chroms", required_argument, 0, 'c'},
     {"paired",       no_argument,  &paired_mode, 1},
+    {"use-index",    no_argument,  &use_index,   1},
     {0, 0, 0, 0}
   };
 
   int c;
   while (true){
     int option_index = 0;
-    c = getopt_long(argc, argv, "i:o:p:r:", long_options, &option_index);
+    c = getopt_long(argc, argv, "c:i:o:p:r:t:", long_options, &option_index);
     if (c == -1)
       break;
 
     switch(c){
     case 0:
       break;
+    case 'c':
+      parallel_chroms = atoi(optarg);
+      break;
     case 'i':
       if (std::string(optarg).compare("-") == 0)
 	input_file = "stdin";
@@ -62,6 +76,9 @@ void parse_command_line_args(int argc, char** argv,    std::string& input_file,
     case 'r':
       region_file = std::string(optarg);
       break;
+    case 't':
+      num_threads = atoi(optarg);
+      break;
     case '?':
       printErrorAndDie("Unrecognized command line option");
       break;
@@ -74,8 +91,8 @@ void parse_command_line_args(int argc, char** argv,    std::string& input_file,
 
 int main(int argc, char** argv){
   std::string input_file="", output_file="", region_file="";
-  int paired_mode = 0, region_pad = 0;
-  parse_command_line_args(argc, argv, input_file, output_file, region_file, paired_mode, region_pad);
+  int paired_mode = 0, region_pad = 0, use_index = 0, num_threads = 1, parallel_chroms = 1;
+  parse_command_line_args(argc, argv, input_file, output_file, region_file, paired_mode, region_pad, use_index, num_threads, parallel_chroms);
  
   if (input_file.empty())
     printErrorAndDie("--in option required");
@@ -83,16 +100,38 @@ int main(int argc, char** argv){
     printErrorAndDie("--out option required");
   else if (region_file.empty())
     printErrorAndDie("--region option required");
+  else if (num_threads < 1)
+    printErrorAndDie("--threads must be greater than 0");
+  else if (use_index && paired_mode)
+    printErrorAndDie("--use-index requires a sorted BAM and can't be combined with --paired");
+  else if (parallel_chroms < 1)
+    printErrorAndDie("--parallel-chroms must be greater than 0");
+  else if (parallel_chroms > 1 && (use_index || paired_mode))
+    printErrorAndDie("--parallel-chroms requires a sorted BAM and can't be combined with --paired or --use-index");
+  else if (parallel_chroms > 1 && input_file.compare("stdin") == 0)
+    printErrorAndDie("--parallel-chroms requires an indexed BAM file and can't read from stdin");
 
   std::cerr << "--in      " << input_file  << "\n"
 	    << "--out     " << output_file << "\n"
 	    << "--regions " << region_file << "\n";
   if (region_pad != 0)
     std::cerr << "--pad     " << region_pad << "\n";
+  if (num_threads > 1)
+    std::cerr << "--threads " << num_threads << "\n";
+  if (parallel_chroms > 1)
+    std::cerr << "--parallel-chroms " << parallel_chroms << "\n";
   std::cerr << std::endl;
-  
+
+  // Share a single pool of threads between BGZF decompression of the input and compression of the output
+  htsThreadPool thread_pool = {NULL, 0};
+  if (num_threads > 1 && (thread_pool.pool = hts_tpool_init(num_threads)) == NULL)
+    printErrorAndDie("Failed to create the thread pool for BAM compression");
+  htsThreadPool* pool = (thread_pool.pool == NULL ? NULL : &thread_pool);
+
   // Open the BAM file
-  BamCramReader reader(input_file);
+  BamCramReader* reader = new BamCramReader(input_file);
+  if (pool != NULL && !reader->SetThreadPool(pool))
+    printErrorAndDie("Failed to attach the decompression thread pool to file " + input_file);
 
   // Read and arrange regions
   std::vector<Region> regions;
@@ -114,10 +153,18 @@ int main(int argc, char** argv){
   // Filter BAM
   std::cerr << "Filtering BAM" << std::endl;
 
-  if (paired_mode == 0)
-    filter_bam(reader, ordered_regions, chrom_order, output_file);
+  if (parallel_chroms > 1)
+    filter_bam_parallel(*reader, input_file, ordered_regions, chrom_order, output_file, parallel_chroms, pool);
+  else if (use_index)
+    filter_bam_indexed(*reader, ordered_regions, chrom_order, output_file, pool);
+  else if (paired_mode == 0)
+    filter_bam(*reader, ordered_regions, chrom_order, output_file, pool);
   else
-    filter_bam_paired_mode(reader, ordered_regions, chrom_order, output_file);
- 
+    filter_bam_paired_mode(*reader, ordered_regions, chrom_order, output_file, pool);
+
+  // The reader must be closed before its threads are destroyed
+  delete reader;
+  if (pool != NULL)
+    hts_tpool_destroy(pool->pool);
   return 0;  
 }
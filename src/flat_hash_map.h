@@ -0,0 +1,77 @@
+#ifndef FLAT_HASH_MAP_H_
+#define FLAT_HASH_MAP_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+/*
+ * Open-addressing hash table that maps 64-bit keys (e.g. 2-bit packed k-mers or pairs of node indices) to non-negative
+ * 32-bit values. Entries are stored in a single array and probed linearly, so lookups don't allocate or chase pointers
+ */
+class FlatHashMap {
+ private:
+  struct Slot {
+    uint64_t key;
+    int32_t value; // -1 iff the slot is empty
+  };
+
+  std::vector<Slot> slots_;
+  size_t size_;
+
+  static uint64_t hash_key(uint64_t key){
+    // Finalizer from MurmurHash3, which mixes every bit of the key into the low-order bits
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  size_t probe(uint64_t key) const {
+    size_t mask = slots_.size()-1, pos = hash_key(key) & mask;
+    while (slots_[pos].value != -1 && slots_[pos].key != key)
+      pos = (pos+1) & mask;
+    return pos;
+  }
+
+  void grow(){
+    std::vector<Slot> old_slots(2*slots_.size(), Slot{0, -1});
+    slots_.swap(old_slots);
+    for (auto iter = old_slots.begin(); iter != old_slots.end(); iter++)
+      if (iter->value != -1)
+	slots_[probe(iter->key)] = *iter;
+  }
+
+ public:
+  FlatHashMap() : slots_(64, Slot{0, -1}), size_(0) {}
+
+  size_t size() const { return size_; }
+
+  /* Returns the value associated with KEY, or -1 if it isn't present */
+  int32_t find(uint64_t key) const {
+    return slots_[probe(key)].value;
+  }
+
+  /* Returns the value associated with KEY, first associating it with VALUE if it isn't present */
+  int32_t insert(uint64_t key, int32_t value){
+    size_t pos = probe(key);
+    if (slots_[pos].value != -1)
+      return slots_[pos].value;
+    slots_[pos] = Slot{key, value};
+    size_++;
+
+    // Keep the load factor below 1/2 so that probe sequences remain short
+    if (2*size_ > slots_.size())
+      grow();
+    return value;
+  }
+
+  void clear(){
+    std::fill(slots_.begin(), slots_.end(), Slot{0, -1});
+    size_ = 0;
+  }
+};
+
+#endif
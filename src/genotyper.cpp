@@ -4,11 +4,15 @@
 #include <time.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cfloat>
 #include <cmath>
 
+#include "error.h"
 #include "genotyper.h"
 #include "mathops.h"
+#include "perf_counters.h"
+#include "task_queue.h"
 
 // Each genotype has an equal total prior, but heterozygotes have two possible phasings. Therefore,
 // i)   Phased heterozygotes have a prior of 1/(n(n+1))
@@ -30,68 +34,247 @@ double Genotyper::log_heterozygous_prior(){
 }
 
 void Genotyper::init_log_sample_priors(double* log_sample_ptr){
+  double* LL_ptr = log_sample_ptr;
+  if (haploid_){
+    // Only the homozygous genotypes are stored
+    const double log_homoz_prior = log_homozygous_prior();
+    for (unsigned int i = 0; i < num_samples_; ++i)
+      for (unsigned int j = 0; j < num_alleles_; ++j, ++LL_ptr)
+	*LL_ptr = (log_allele_priors_.empty() ? log_homoz_prior : log_allele_priors_[j]);
+    return;
+  }
+
+  if (!log_allele_priors_.empty()){
+    assert(log_allele_priors_.size() == num_alleles_);
+    for (unsigned int i = 0; i < num_samples_; ++i)
+      for (unsigned int j = 0; j < num_alleles_; ++j)
+	for (unsigned int k = 0; k < num_alleles_; ++k, ++LL_ptr)
+	  *LL_ptr = log_allele_priors_[j] + log_allele_priors_[k];
+    return;
+  }
+
   const double log_homoz_prior = log_homozygous_prior();
   const double log_hetz_prior  = log_heterozygous_prior();
-  double* LL_ptr = log_sample_ptr;
   for (unsigned int i = 0; i < num_samples_; ++i)
     for (unsigned int j = 0; j < num_alleles_; ++j)
       for (unsigned int k = 0; k < num_alleles_; ++k, ++LL_ptr)
 	  *LL_ptr = (j == k ? log_homoz_prior : log_hetz_prior);
 }
 
+void Genotyper::run_chunks(int num_chunks, const std::function<void(int)>& func){
+  int num_helpers = 0;
+  if (task_queue_ != NULL && num_chunks > 1)
+    num_helpers = std::min(task_queue_->num_idle_workers(), num_chunks-1);
+  if (num_helpers == 0){
+    for (int chunk = 0; chunk < num_chunks; ++chunk)
+      func(chunk);
+    return;
+  }
+
+  // Errors can't abandon only the current locus while the helpers are accessing this thread's data, so they're always fatal
+  LocusErrorScope fatal_errors(false);
+  std::atomic<int> next_chunk(0);
+  task_queue_->run_job(num_helpers, [&](){
+      int chunk;
+      while ((chunk = next_chunk.fetch_add(1)) < num_chunks)
+	func(chunk);
+    });
+}
+
 double Genotyper::calc_log_sample_posteriors(std::vector<int>& read_weights){
-  double posterior_time = clock();
+  PerfScope perf_scope(PERF_POSTERIORS);
+  ScopedTimer posterior_timer(timer_, PHASE_POSTERIORS);
   assert(read_weights.size() == num_reads_);
   init_log_sample_priors(log_sample_posteriors_);
+  best_haplotypes_.assign(num_samples_, std::pair<int,int>(-1,-1));
+
+  // Each sample's posteriors only depend on its own reads, so consecutive samples are grouped into chunks with enough
+  // reads to be worth handing to an idle thread. The results are therefore identical for any number of threads
+  const int64_t MIN_CHUNK_WORK = 1 << 18;
+  const int64_t num_diplotypes = num_sample_gts();
+  std::vector<int> chunk_samples(1, 0), chunk_reads(1, 0);
+  int64_t chunk_work = 0;
+  unsigned int read_index = 0;
+  for (int sample_index = 0; sample_index < num_samples_; ++sample_index){
+    assert(read_index == num_reads_ || sample_label_[read_index] >= sample_index);
+    while (read_index < num_reads_ && sample_label_[read_index] == sample_index){
+      read_index++;
+      chunk_work += num_diplotypes;
+    }
+    if (chunk_work >= MIN_CHUNK_WORK || sample_index+1 == num_samples_){
+      chunk_samples.push_back(sample_index+1);
+      chunk_reads.push_back(read_index);
+      chunk_work = 0;
+    }
+  }
+  assert(read_index == num_reads_);
+
+  std::vector<char> chunk_pruned(chunk_samples.size()-1, 0);
+  run_chunks(chunk_samples.size()-1, [&](int chunk){
+      if (haploid_)
+	chunk_pruned[chunk] = calc_ploidy_log_sample_posteriors<1>(read_weights, chunk_samples[chunk], chunk_samples[chunk+1], chunk_reads[chunk], chunk_reads[chunk+1]);
+      else
+	chunk_pruned[chunk] = calc_ploidy_log_sample_posteriors<2>(read_weights, chunk_samples[chunk], chunk_samples[chunk+1], chunk_reads[chunk], chunk_reads[chunk+1]);
+    });
+  posteriors_pruned_ = (std::find(chunk_pruned.begin(), chunk_pruned.end(), 1) != chunk_pruned.end());
+
+  // Compute the total log-likelihood given the current parameters
+  double total_LL = sum(sample_total_LLs_, sample_total_LLs_ + num_samples_);
+  return total_LL;
+}
+
+void Genotyper::calc_unpruned_log_sample_posteriors(){
+  if (!posteriors_pruned_)
+    return;
+  double prune_LL     = diplotype_prune_LL_;
+  diplotype_prune_LL_ = 0;
+  calc_log_sample_posteriors();
+  diplotype_prune_LL_ = prune_LL;
+}
+
+// Haploid samples only have the NUM_ALLELES homozygous diplotypes (i, i), while diploid samples have all
+// NUM_ALLELES^2 diplotypes (i / NUM_ALLELES, i % NUM_ALLELES), so the loops below only visit diplotypes that are possible
+template<int PLOIDY> bool Genotyper::calc_ploidy_log_sample_posteriors(std::vector<int>& read_weights, int first_sample, int end_sample,
+								    int first_read, int end_read){
+  const int num_diplotypes = (PLOIDY == 1 ? num_alleles_ : num_alleles_*num_alleles_);
+  const bool prune         = diplotype_prune_LL_ > 0;
+  std::vector<double> log_phase_one(num_alleles_), log_phase_two(num_alleles_);
+  std::vector<double> log_v1(num_diplotypes), log_v2(num_diplotypes), read_LLs(num_diplotypes);
+  std::vector<int> active_diplotypes; // Indices of the current sample's unpruned diplotypes
+  int prev_sample = -1, num_sample_reads = 0;
+  bool any_pruned = false;
+
+  // For an unphased read, both phases of a homozygous diplotype have the same LL X, and their log-sum-exp is exactly X + LOG_TWO_PHASES
+  const double LOG_TWO_PHASES = fast_log_sum_exp(0.0, 0.0);
 
-  const int num_diplotypes = num_alleles_*num_alleles_;
-  double* read_LL_ptr      = log_aln_probs_;
-  for (int read_index = 0; read_index < num_reads_; ++read_index){
+  double* read_LL_ptr = log_aln_probs_ + (int64_t)first_read*num_alleles_;
+  for (int read_index = first_read; read_index <= end_read; ++read_index, read_LL_ptr += num_alleles_){
+    if (read_index == end_read || sample_label_[read_index] != prev_sample){
+      // A pruned diplotype's LL is only an upper bound, as it ignores the sample's subsequent reads.
+      // Ensure it remains at least the pruning threshold below the sample's best diplotype
+      if (prune && prev_sample != -1 && active_diplotypes.size() < num_diplotypes){
+	any_pruned = true;
+	double* prev_LL_ptr = log_sample_posteriors_ + num_diplotypes*prev_sample;
+	double max_LL       = -DBL_MAX;
+	std::vector<bool> pruned(num_diplotypes, true);
+	for (int i = 0; i < active_diplotypes.size(); ++i){
+	  max_LL = std::max(max_LL, prev_LL_ptr[active_diplotypes[i]]);
+	  pruned[active_diplotypes[i]] = false;
+	}
+	for (int i = 0; i < num_diplotypes; ++i)
+	  if (pruned[i])
+	    prev_LL_ptr[i] = std::min(prev_LL_ptr[i], max_LL - diplotype_prune_LL_);
+      }
+      if (read_index == end_read)
+	break;
+      prev_sample      = sample_label_[read_index];
+      num_sample_reads = 0;
+      active_diplotypes.clear();
+      for (int i = 0; i < num_diplotypes; ++i)
+	active_diplotypes.push_back(i);
+    }
     double* sample_LL_ptr = log_sample_posteriors_ + num_diplotypes*sample_label_[read_index];
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++sample_LL_ptr){
-        *sample_LL_ptr += read_weights[read_index]*fast_log_sum_exp(LOG_ONE_HALF + log_p1_[read_index] + read_LL_ptr[index_1],
-								    LOG_ONE_HALF + log_p2_[read_index] + read_LL_ptr[index_2]);
-        assert(*sample_LL_ptr <= TOLERANCE);
+    if (read_weights[read_index] == 0)
+      continue;
+
+    const double log_p1 = read_log_p1(read_index), log_p2 = read_log_p2(read_index);
+    const bool phased   = read_phased(read_index);
+    for (int index = 0; index < num_alleles_; ++index){
+      log_phase_one[index] = LOG_ONE_HALF + log_p1 + read_LL_ptr[index];
+      log_phase_two[index] = LOG_ONE_HALF + log_p2 + read_LL_ptr[index];
+    }
+
+    int num_active = active_diplotypes.size();
+    double best_LL = -DBL_MAX;
+    if (PLOIDY == 1 && !phased){
+      // Haploid samples only have homozygous diplotypes, so an unphased read's LLs don't require any log-sum-exps
+      for (int i = 0; i < num_active; ++i){
+	double& sample_LL = sample_LL_ptr[active_diplotypes[i]];
+	sample_LL        += read_weights[read_index]*(log_phase_one[active_diplotypes[i]] + LOG_TWO_PHASES);
+	best_LL           = std::max(best_LL, sample_LL);
+	assert(sample_LL <= TOLERANCE);
+      }
+    }
+    else if (PLOIDY == 2 && !phased && num_active == num_diplotypes){
+      // Without phasing information, the read's LL is identical for diplotypes (a, b) and (b, a),
+      // so we only evaluate the diplotypes with a < b and apply each LL to both orderings
+      int num_pairs = 0;
+      for (int index_1 = 0; index_1 < num_alleles_; ++index_1)
+	for (int index_2 = index_1+1; index_2 < num_alleles_; ++index_2, ++num_pairs){
+	  log_v1[num_pairs] = log_phase_one[index_1];
+	  log_v2[num_pairs] = log_phase_two[index_2];
+	}
+      fast_log_sum_exp(log_v1.data(), log_v2.data(), num_pairs, read_LLs.data());
+
+      int pair_index = 0;
+      for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
+	double& hom_sample_LL = sample_LL_ptr[index_1*num_alleles_ + index_1];
+	hom_sample_LL        += read_weights[read_index]*(log_phase_one[index_1] + LOG_TWO_PHASES);
+	best_LL               = std::max(best_LL, hom_sample_LL);
+	assert(hom_sample_LL <= TOLERANCE);
+
+	for (int index_2 = index_1+1; index_2 < num_alleles_; ++index_2, ++pair_index){
+	  double read_LL        = read_weights[read_index]*read_LLs[pair_index];
+	  double& sample_LL     = sample_LL_ptr[index_1*num_alleles_ + index_2];
+	  double& alt_sample_LL = sample_LL_ptr[index_2*num_alleles_ + index_1];
+	  sample_LL            += read_LL;
+	  alt_sample_LL        += read_LL;
+	  best_LL               = std::max(best_LL, std::max(sample_LL, alt_sample_LL));
+	  assert(sample_LL <= TOLERANCE && alt_sample_LL <= TOLERANCE);
+	}
+      }
+    }
+    else {
+      // Gather the phase LLs for each diplotype we need to update and evaluate them in bulk
+      for (int i = 0; i < num_active; ++i){
+	log_v1[i] = log_phase_one[PLOIDY == 1 ? active_diplotypes[i] : active_diplotypes[i] / num_alleles_];
+	log_v2[i] = log_phase_two[PLOIDY == 1 ? active_diplotypes[i] : active_diplotypes[i] % num_alleles_];
+      }
+      fast_log_sum_exp(log_v1.data(), log_v2.data(), num_active, read_LLs.data());
+
+      for (int i = 0; i < num_active; ++i){
+	double& sample_LL = sample_LL_ptr[active_diplotypes[i]];
+	sample_LL        += read_weights[read_index]*read_LLs[i];
+	best_LL           = std::max(best_LL, sample_LL);
+	assert(sample_LL <= TOLERANCE);
       }
     }
-    read_LL_ptr += num_alleles_;
+
+    // Stop updating diplotypes that are now too unlikely to matter, unless too few reads have been seen
+    // for a single discordant read not to prune the sample's true diplotype
+    if (prune && ++num_sample_reads >= MIN_PRUNE_READS){
+      int num_kept = 0;
+      for (int i = 0; i < num_active; ++i)
+	if (sample_LL_ptr[active_diplotypes[i]] >= best_LL - diplotype_prune_LL_)
+	  active_diplotypes[num_kept++] = active_diplotypes[i];
+      active_diplotypes.resize(num_kept);
+    }
   }
 
-  // Compute each sample's total LL and normalize each genotype LL to generate valid log posteriors
-  double* sample_LL_ptr = log_sample_posteriors_;
-  for (int sample_index = 0; sample_index < num_samples_; ++sample_index){
+  // Compute each sample's total LL and normalize each genotype LL to generate valid log posteriors,
+  // recording each sample's most likely diplotype in the same pass
+  double* sample_LL_ptr = log_sample_posteriors_ + (int64_t)num_diplotypes*first_sample;
+  for (int sample_index = first_sample; sample_index < end_sample; ++sample_index){
     const double sample_total_LL = log_sum_exp(sample_LL_ptr, sample_LL_ptr+num_diplotypes);
     sample_total_LLs_[sample_index] = sample_total_LL;
     assert(sample_total_LL <= TOLERANCE);
+    double best_posterior = -DBL_MAX;
     for (int index_1 = 0; index_1 < num_alleles_; ++index_1)
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++sample_LL_ptr)
+      for (int index_2 = (PLOIDY == 1 ? index_1 : 0); index_2 < (PLOIDY == 1 ? index_1+1 : num_alleles_); ++index_2, ++sample_LL_ptr){
 	*sample_LL_ptr -= sample_total_LL;
+	if (*sample_LL_ptr > best_posterior){
+	  best_posterior = *sample_LL_ptr;
+	  best_haplotypes_[sample_index] = std::pair<int,int>(index_1, index_2);
+	}
+      }
   }
-
-  // Compute the total log-likelihood given the current parameters
-  double total_LL = sum(sample_total_LLs_, sample_total_LLs_ + num_samples_);
-
-  posterior_time         = (clock() - posterior_time)/CLOCKS_PER_SEC;
-  total_posterior_time_ += posterior_time;
-  return total_LL;
+  return any_pruned;
 }
 
 void Genotyper::get_optimal_haplotypes(std::vector< std::pair<int, int> >& gts){
   assert(gts.size() == 0);
-  gts = std::vector< std::pair<int,int> > (num_samples_, std::pair<int,int>(-1,-1));
-  double* log_posterior_ptr = log_sample_posteriors_;
-  std::vector<double> log_phased_posteriors(num_samples_, -DBL_MAX);
-  for (unsigned int sample_index = 0; sample_index < num_samples_; ++sample_index){
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++log_posterior_ptr){
-        if (*log_posterior_ptr > log_phased_posteriors[sample_index]){
-          log_phased_posteriors[sample_index] = *log_posterior_ptr;
-          gts[sample_index] = std::pair<int,int>(index_1, index_2);
-        }
-      }
-    }
-  }
+  assert(best_haplotypes_.size() == num_samples_);
+  gts = best_haplotypes_;
 }
 
 void Genotyper::calc_PLs(const std::vector<double>& gls, std::vector<int>& pls){
@@ -124,6 +307,27 @@ double Genotyper::calc_gl_diff(const std::vector<double>& gls, int gt_a, int gt_
   return ((std::abs(max_gl-gls[gl_index]) < TOLERANCE) ? (max_gl-second_gl) : gls[gl_index]-max_gl);
 }
 
+template<int PLOIDY> void Genotyper::marginalize_log_sample_posteriors(int num_variants, std::vector<int>& hap_to_allele, std::vector<double>& log_phased_posteriors){
+  // A haploid sample's heterozygous genotypes are impossible and their posteriors are left as -inf
+  const int num_gts = num_variants*num_variants;
+  std::vector<double> max_log_phased_posteriors(num_samples_*num_gts, -DBL_MAX/2);
+  log_phased_posteriors.assign(num_samples_*num_gts, 0.0);
+  double* log_posterior_ptr = log_sample_posteriors_;
+  for (unsigned int sample_index = 0; sample_index < num_samples_; ++sample_index){
+    double* max_ptr   = max_log_phased_posteriors.data() + sample_index*num_gts;
+    double* total_ptr = log_phased_posteriors.data()     + sample_index*num_gts;
+    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
+      const int row_index = num_variants*hap_to_allele[index_1];
+      for (int index_2 = (PLOIDY == 1 ? index_1 : 0); index_2 < (PLOIDY == 1 ? index_1+1 : num_alleles_); ++index_2, ++log_posterior_ptr){
+	int gt_index = row_index + hap_to_allele[index_2];
+	update_streaming_log_sum_exp(*log_posterior_ptr, max_ptr[gt_index], total_ptr[gt_index]);
+      }
+    }
+  }
+  for (unsigned int i = 0; i < log_phased_posteriors.size(); ++i)
+    log_phased_posteriors[i] = finish_streaming_log_sum_exp(max_log_phased_posteriors[i], log_phased_posteriors[i]);
+}
+
 void Genotyper::extract_genotypes_and_likelihoods(int num_variants, std::vector<int>& hap_to_allele,
 						  std::vector< std::pair<int,int>  >& best_haplotypes,
 						  std::vector< std::pair<int,int>  >& best_gts,
@@ -141,36 +345,24 @@ void Genotyper::extract_genotypes_and_likelihoods(int num_variants, std::vector<
   for (int sample_index = 0; sample_index < num_samples_; sample_index++)
     best_gts.push_back(std::pair<int,int>(hap_to_allele[best_haplotypes[sample_index].first], hap_to_allele[best_haplotypes[sample_index].second]));
 
-  // Marginalize over all haplotypes to compute the genotype posteriors and use streaming log-sum-exp to aggregate values
-  std::vector< std::vector<double>  > max_log_phased_posteriors   (num_samples_, std::vector<double>(num_variants*num_variants, -DBL_MAX/2));
-  std::vector< std::vector<double>  > total_log_phased_posteriors (num_samples_, std::vector<double>(num_variants*num_variants, 0.0));
-  double* log_posterior_ptr = log_sample_posteriors_;
-  for (unsigned int sample_index = 0; sample_index < num_samples_; ++sample_index)
-    for (int index_1 = 0; index_1 < num_alleles_; ++index_1){
-      for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++log_posterior_ptr){
-	int gt_index = num_variants*hap_to_allele[index_1] + hap_to_allele[index_2];
-	update_streaming_log_sum_exp(*log_posterior_ptr, max_log_phased_posteriors[sample_index][gt_index], total_log_phased_posteriors[sample_index][gt_index]);
-    }
-  }
-  int gt_index = 0;
-  for (int index_1 = 0; index_1 < num_variants; ++index_1){
-    for (int index_2 = 0; index_2 < num_variants; ++index_2, ++gt_index){
-      for (unsigned int sample_index = 0; sample_index < num_samples_; ++sample_index){
-	double total = finish_streaming_log_sum_exp(max_log_phased_posteriors[sample_index][gt_index], total_log_phased_posteriors[sample_index][gt_index]);
-	total_log_phased_posteriors[sample_index][gt_index] = total;
-      }
-    }
-  }
+  // Marginalize over all haplotypes to compute the genotype posteriors in a single pass, using streaming log-sum-exp to aggregate values.
+  // The posteriors for each sample's NUM_VARIANTS^2 genotypes are stored contiguously
+  const int num_gts = num_variants*num_variants;
+  std::vector<double> total_log_phased_posteriors;
+  if (haploid_)
+    marginalize_log_sample_posteriors<1>(num_variants, hap_to_allele, total_log_phased_posteriors);
+  else
+    marginalize_log_sample_posteriors<2>(num_variants, hap_to_allele, total_log_phased_posteriors);
 
   // Store the aggregated posterior values in the provided vectors
   for (int sample_index = 0; sample_index < num_samples_; sample_index++){
     int gt_a = best_gts[sample_index].first, gt_b = best_gts[sample_index].second;
-    double log_phased_prob = total_log_phased_posteriors[sample_index][num_variants*gt_a + gt_b];
+    double log_phased_prob = total_log_phased_posteriors[sample_index*num_gts + num_variants*gt_a + gt_b];
     log_phased_posteriors.push_back(log_phased_prob);
     if (gt_a == gt_b)
       log_unphased_posteriors.push_back(log_phased_prob);
     else {
-      double alt_log_phased_prob =  total_log_phased_posteriors[sample_index][num_variants*gt_b + gt_a];
+      double alt_log_phased_prob =  total_log_phased_posteriors[sample_index*num_gts + num_variants*gt_b + gt_a];
       log_unphased_posteriors.push_back(log_sum_exp(log_phased_prob, alt_log_phased_prob));
     }
   }
@@ -187,23 +379,38 @@ void Genotyper::extract_genotypes_and_likelihoods(int num_variants, std::vector<
     double hom_ll_correction  = log_homozygous_prior();
     double het_ll_correction  = (haploid_ ? 0 : log_heterozygous_prior());                    // If haploid, don't correct hetz genotypes as they're impossible
     double nconfig_correction = int_log(2) + 2*(int_log(num_alleles_)-int_log(num_variants)); // Need to correct for the number of haplotypes whose GL's we're averaging
+
+    // With Hardy-Weinberg priors, each variant's prior is the total prior of the haplotypes containing it
+    std::vector<double> log_variant_priors;
+    if (!log_allele_priors_.empty()){
+      std::vector<double> max_log_priors(num_variants, -DBL_MAX/2), total_log_priors(num_variants, 0.0);
+      for (int index = 0; index < num_alleles_; ++index)
+	update_streaming_log_sum_exp(log_allele_priors_[index], max_log_priors[hap_to_allele[index]], total_log_priors[hap_to_allele[index]]);
+      for (int index = 0; index < num_variants; ++index)
+	log_variant_priors.push_back(finish_streaming_log_sum_exp(max_log_priors[index], total_log_priors[index]));
+    }
+
     int gt_index = 0;
     for (int index_1 = 0; index_1 < num_variants; ++index_1){
       for (int index_2 = 0; index_2 < num_variants; ++index_2, ++gt_index){
 	int alt_gt_index              = index_2*num_variants + index_1;
 	double gl_ll_correction       = (index_1 == index_2 ? hom_ll_correction : het_ll_correction) + nconfig_correction;
 	double phasedgl_ll_correction = (index_1 == index_2 ? hom_ll_correction : het_ll_correction);
+	if (!log_variant_priors.empty()){
+	  phasedgl_ll_correction = log_variant_priors[index_1] + (haploid_ ? 0 : log_variant_priors[index_2]);
+	  gl_ll_correction       = phasedgl_ll_correction + int_log(2);
+	}
 	for (int sample_index = 0; sample_index < num_samples_; sample_index++){
 	  if (index_2 <= index_1){
 	    if (!haploid_ || (index_1 == index_2)){
-	      double gl_base_e = sample_total_LLs_[sample_index] - gl_ll_correction + fast_log_sum_exp(total_log_phased_posteriors[sample_index][gt_index],
-												       total_log_phased_posteriors[sample_index][alt_gt_index]);
+	      double gl_base_e = sample_total_LLs_[sample_index] - gl_ll_correction + fast_log_sum_exp(total_log_phased_posteriors[sample_index*num_gts + gt_index],
+												       total_log_phased_posteriors[sample_index*num_gts + alt_gt_index]);
 	      gls[sample_index].push_back(gl_base_e*LOG_E_BASE_10); // Convert from ln to log10
 	    }
 	  }
 	  if (calc_phased_gls)
 	    if (!haploid_ || (index_1 == index_2))
-	      phased_gls[sample_index].push_back((total_log_phased_posteriors[sample_index][gt_index] + sample_total_LLs_[sample_index] - phasedgl_ll_correction)*LOG_E_BASE_10);
+	      phased_gls[sample_index].push_back((total_log_phased_posteriors[sample_index*num_gts + gt_index] + sample_total_LLs_[sample_index] - phasedgl_ll_correction)*LOG_E_BASE_10);
 	}
       }
     }
@@ -224,7 +431,8 @@ void Genotyper::extract_genotypes_and_likelihoods(int num_variants, std::vector<
   }
 }
 
-void Genotyper::write_vcf_header(std::string& full_command, std::vector<std::string>& sample_names, bool output_gls, bool output_pls, bool output_phased_gls, std::ostream& out){
+void Genotyper::write_vcf_header(std::string& full_command, std::vector<std::string>& sample_names, bool output_gls, bool output_pls, bool output_phased_gls,
+				 bool flag_novel_alleles, std::ostream& out){
   out << "##fileformat=VCFv4.1" << "\n"
       << "##command=" << full_command << "\n";
 
@@ -248,6 +456,8 @@ void Genotyper::write_vcf_header(std::string& full_command, std::vector<std::str
       << "##INFO=<ID=" << "DSNP"           << ",Number=1,Type=Integer,Description=\"" << "Total number of reads with SNP phasing information"                           << "\">\n"
       << "##INFO=<ID=" << "DSTUTTER"       << ",Number=1,Type=Integer,Description=\"" << "Total number of reads with a stutter indel in the STR region"                 << "\">\n"
       << "##INFO=<ID=" << "DFLANKINDEL"    << ",Number=1,Type=Integer,Description=\"" << "Total number of reads with an indel in the regions flanking the STR"          << "\">\n";
+  if (flag_novel_alleles)
+    out << "##INFO=<ID=" << "NOVELBPDIFFS" << ",Number=.,Type=Integer,Description=\"" << "Base pair differences strongly supported by a sample's reads that aren't among the alleles" << "\">\n";
 
   // Format field descriptors
   out << "##FORMAT=<ID=" << "GT"          << ",Number=1,Type=String,Description=\""  << "Genotype" << "\">" << "\n"
@@ -3,27 +3,45 @@
 
 #include <assert.h>
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "line_formatter.h"
 #include "mathops.h"
+#include "process_timer.h"
+
+class TaskQueue;
 
 class Genotyper {
  protected:
   unsigned int num_reads_;    // Total number of reads across all samples
   int num_samples_;           // Total number of samples
   int num_alleles_;           // Number of valid alleles
-  double* log_p1_, *log_p2_;  // Log of SNP phasing likelihoods for each read
+  int* phase_class_;          // Index of each read's SNP phasing likelihoods in the tables below
   int* sample_label_;         // Sample index for each read
+
+  // Distinct pairs of log SNP phasing likelihoods across all reads. Class 0 is reserved for reads without phasing information,
+  // which comprise most reads and whose likelihoods are both 0. Reads whose two likelihoods are equal are unphased, so the
+  // LL of each homozygous diplotype is a single term instead of a two-term log-sum-exp
+  std::vector<double> class_log_p1_, class_log_p2_;
+
+  double read_log_p1(int read_index) const { return class_log_p1_[phase_class_[read_index]]; }
+  double read_log_p2(int read_index) const { return class_log_p2_[phase_class_[read_index]]; }
+  bool   read_phased(int read_index) const {
+    int phase_class = phase_class_[read_index];
+    return phase_class != 0 && class_log_p1_[phase_class] != class_log_p2_[phase_class];
+  }
   bool haploid_;              // True iff the underlying marker is haploid
 
   std::vector<std::string> sample_names_;      // List of sample names
   std::map<std::string, int> sample_indices_;  // Mapping from sample name to index
 
-  // Iterates through samples and then through allele_1 and allele_2
+  // Iterates through samples and then through allele_1 and allele_2. Haploid samples can only be homozygous,
+  // so only their num_alleles_ homozygous genotypes are stored (see num_sample_gts())
   double* log_sample_posteriors_; 
 
   // Iterates through reads and then alleles by their indices
@@ -32,32 +50,44 @@ class Genotyper {
   // Total log-likelihoods for each sample
   double* sample_total_LLs_;
 
-  // Total time spent computing posteriors (seconds)
-  double total_posterior_time_;
+  // Each sample's most likely diplotype, as determined by the last call to calc_log_sample_posteriors
+  std::vector< std::pair<int, int> > best_haplotypes_;
+
+  // Time spent in each genotyping phase
+  ProcessTimer timer_;
+
+  // Idle threads in this queue, if provided, help with the computations for large loci
+  TaskQueue* task_queue_;
 
   // Read weights used to calculate posteriors (See calc_log_sample_posteriors function)
   // Used to account for special cases in which both reads in a pair overlap the STR by setting
   // the weight for the second read to zero. Elsewhere, the alignments probabilities for the two reads are summed
   std::vector<int> read_weights_;
 
+  // If positive, each sample's diplotypes are no longer updated once their running LL falls more than this many log-units
+  // below the sample's best diplotype, after at least MIN_PRUNE_READS of its reads. As their LLs ignore the sample's remaining
+  // reads, they're then capped at this many log-units below the best diplotype. See calc_unpruned_log_sample_posteriors()
+  double diplotype_prune_LL_;
+  static const int MIN_PRUNE_READS = 10;
+
+  // True iff any of the samples' diplotypes were pruned when the posteriors were last computed
+  bool posteriors_pruned_;
+
+  // If not empty, the log prior of each allele, which replace the uniform genotype priors with Hardy-Weinberg priors
+  std::vector<double> log_allele_priors_;
+
   // Convert a list of integers into a string with key|count pairs separated by semicolons
   // e.g. -1,0,-1,2,2,1 will be converted into -1|2;0|1;1|1;2|2
-  std::string condense_read_counts(std::vector<int>& read_diffs){
-    if (read_diffs.size() == 0)
-      return ".";
-    std::map<int, int> diff_counts;
-    for (unsigned int i = 0; i < read_diffs.size(); i++)
-      diff_counts[read_diffs[i]]++;
-    std::stringstream res;
-    for (auto iter = diff_counts.begin(); iter != diff_counts.end(); iter++){
-      if (iter != diff_counts.begin())
-	res << ";";
-      res << iter->first << "|" << iter->second;
-    }
-    return res.str();
+  std::string condense_read_counts(const ReadCountHistogram& read_counts){
+    LineFormatter formatter(64);
+    formatter.append_read_counts(read_counts);
+    return std::string(formatter.data(), formatter.size());
   }
 
 
+  // Number of genotype posteriors stored for each sample in log_sample_posteriors_
+  int num_sample_gts() const { return (haploid_ ? num_alleles_ : num_alleles_*num_alleles_); }
+
   double log_homozygous_prior();
 
   double log_heterozygous_prior();
@@ -67,11 +97,28 @@ class Genotyper {
   /* Compute the posteriors for each sample using the haplotype probabilites, stutter model and read weights */
   double calc_log_sample_posteriors(std::vector<int>& read_weights);
 
+  // Implementation of calc_log_sample_posteriors() specialized for haploid (PLOIDY = 1) or diploid (PLOIDY = 2) samples.
+  // Computes the posteriors for samples [FIRST_SAMPLE, END_SAMPLE), whose reads are [FIRST_READ, END_READ)
+  // Returns true iff any of the diplotypes were pruned
+  template<int PLOIDY> bool calc_ploidy_log_sample_posteriors(std::vector<int>& read_weights, int first_sample, int end_sample,
+							      int first_read, int end_read);
+
+  // Invokes FUNC for each chunk index in [0, NUM_CHUNKS), using any idle threads in the task queue. As the chunks may be
+  // processed concurrently and in any order, FUNC must only modify state that's specific to its chunk
+  void run_chunks(int num_chunks, const std::function<void(int)>& func);
+
+  // Aggregates each sample's haplotype posteriors into the log posteriors of its NUM_VARIANTS^2 phased genotypes
+  template<int PLOIDY> void marginalize_log_sample_posteriors(int num_variants, std::vector<int>& hap_to_allele, std::vector<double>& log_phased_posteriors);
+
   double calc_log_sample_posteriors(){
     return calc_log_sample_posteriors(read_weights_);
   }
 
-  // Determine the genotype associated with each sample based on the current genotype posteriors
+  // Pruned diplotypes' LLs are only bounds, so if any were pruned, recomputes the posteriors without pruning. Must be invoked
+  // before the posteriors are used to report genotypes, qualities and likelihoods
+  void calc_unpruned_log_sample_posteriors();
+
+  // Determine the genotype associated with each sample based on the current genotype posteriors, which is identified when they're calculated
   void get_optimal_haplotypes(std::vector< std::pair<int, int> >& gts);
 
  public:
@@ -89,18 +136,27 @@ class Genotyper {
     for (unsigned int i = 0; i < sample_names.size(); i++)
       sample_indices_.insert(std::pair<std::string,int>(sample_names[i], i));
 
-    total_posterior_time_  = 0;
-    log_p1_                = new double[num_reads_];
-    log_p2_                = new double[num_reads_];
+    diplotype_prune_LL_    = 0;
+    posteriors_pruned_     = false;
+    task_queue_            = NULL;
+    phase_class_           = new int[num_reads_];
     sample_label_          = new int[num_reads_];
     sample_total_LLs_      = new double[num_samples_];
     read_weights_          = std::vector<int>(num_reads_, 1);
+    std::map<std::pair<double, double>, int> class_indices;
+    class_indices[std::pair<double, double>(0.0, 0.0)] = 0;
+    class_log_p1_.push_back(0.0);
+    class_log_p2_.push_back(0.0);
     unsigned int read_index = 0;
     for (unsigned int i = 0; i < log_p1.size(); ++i){
       for (unsigned int j = 0; j < log_p1[i].size(); ++j, ++read_index){
 	assert(log_p1[i][j] <= 0.0 && log_p2[i][j] <= 0.0);
-	log_p1_[read_index]       = log_p1[i][j];
-	log_p2_[read_index]       = log_p2[i][j];
+	auto insert_iter = class_indices.insert(std::make_pair(std::pair<double, double>(log_p1[i][j], log_p2[i][j]), (int)class_log_p1_.size()));
+	if (insert_iter.second){
+	  class_log_p1_.push_back(log_p1[i][j]);
+	  class_log_p2_.push_back(log_p2[i][j]);
+	}
+	phase_class_[read_index]  = insert_iter.first->second;
 	sample_label_[read_index] = i;
       }
     }
@@ -112,8 +168,7 @@ class Genotyper {
   }
 
   ~Genotyper(){
-    delete [] log_p1_;
-    delete [] log_p2_;
+    delete [] phase_class_;
     delete [] sample_label_;
     delete [] sample_total_LLs_;
     
@@ -123,9 +178,22 @@ class Genotyper {
       delete [] log_aln_probs_;
   }
 
-  double posterior_time() { return total_posterior_time_;  }
+  const ProcessTimer& timer() { return timer_; }
+
+  // Number of bytes used by the per-read and per-sample arrays of a genotyper with the provided dimensions,
+  // dominated by the read alignment probabilities (reads x alleles) and the sample posteriors (samples x alleles^2, or samples x alleles if haploid).
+  // Assumes that every read has its own phasing class, as they're only known once the reads have been added
+  static int64_t posterior_bytes(int64_t num_reads, int64_t num_samples, int64_t num_alleles, bool haploid = false){
+    return num_reads*(2*sizeof(double) + 2*sizeof(int) + num_alleles*sizeof(double)) + num_samples*(1 + (haploid ? num_alleles : num_alleles*num_alleles))*sizeof(double);
+  }
+
+  void set_diplotype_pruning(double prune_LL){ diplotype_prune_LL_ = prune_LL; }
+
+  // Loci with many reads are aligned and genotyped using the idle threads in this queue, if provided
+  void set_task_queue(TaskQueue* task_queue){ task_queue_ = task_queue; }
 
-  static void write_vcf_header(std::string& full_command, std::vector<std::string>& sample_names, bool output_gls, bool output_pls, bool output_phased_gls, std::ostream& out);
+  static void write_vcf_header(std::string& full_command, std::vector<std::string>& sample_names, bool output_gls, bool output_pls, bool output_phased_gls,
+			       bool flag_novel_alleles, std::ostream& out);
 
   void calc_PLs(const std::vector<double>& gls, std::vector<int>& pls);
 
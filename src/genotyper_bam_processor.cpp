@@ -1,12 +1,15 @@
+#include <climits>
 #include <iomanip>
 #include <iostream>
 #include <time.h>
+#include <unordered_map>
 
 //#include "sys/sysinfo.h"
 //#include "sys/types.h"
 
 #include "extract_indels.h"
 #include "genotyper_bam_processor.h"
+#include "vcf_concat.h"
 
 int parseLine(char* line){
   int i = strlen(line);
@@ -31,17 +34,214 @@ int getUsedPhysicalMemoryKB(){
   return result;
 }
 
+void GenotyperBamProcessor::init_worker(const GenotyperBamProcessor& parent){
+  SNPBamProcessor::init_worker(parent);
+  read_stutter_models_   = parent.read_stutter_models_;
+  stutter_models_        = parent.stutter_models_;
+  stutter_db_              = parent.stutter_db_;
+  reuse_stutter_min_reads_ = parent.reuse_stutter_min_reads_;
+  if (parent.def_stutter_model_ != NULL)
+    def_stutter_model_   = parent.def_stutter_model_->copy();
+  if (parent.ref_vcf_ != NULL){
+    std::string ref_vcf_file = parent.ref_vcf_file_;
+    set_ref_vcf(ref_vcf_file);
+  }
+  ref_allele_index_        = parent.ref_allele_index_;
+
+  // Workers buffer their output for each locus, so the output streams are never opened
+  output_stutter_models_ = parent.output_stutter_models_;
+  output_stutter_table_  = parent.output_stutter_table_;
+  output_str_gts_        = parent.output_str_gts_;
+  output_str_columns_    = parent.output_str_columns_;
+  output_viz_            = parent.output_viz_;
+  output_locus_stats_    = parent.output_locus_stats_;
+  output_skip_list_      = parent.output_skip_list_;
+  skip_list_min_time_    = parent.skip_list_min_time_;
+  output_batch_summary_  = parent.output_batch_summary_;
+  samples_to_genotype_   = parent.samples_to_genotype_;
+  if (parent.str_bcf_header_ != NULL)
+    str_bcf_header_      = bcf_hdr_dup(parent.str_bcf_header_);
+
+  output_gls_            = parent.output_gls_;
+  output_pls_            = parent.output_pls_;
+  output_phased_gls_     = parent.output_phased_gls_;
+  output_all_reads_      = parent.output_all_reads_;
+  output_mall_reads_     = parent.output_mall_reads_;
+  max_flank_indel_frac_  = parent.max_flank_indel_frac_;
+  haploid_chroms_        = parent.haploid_chroms_;
+  recalc_stutter_model_  = parent.recalc_stutter_model_;
+  viz_left_alns_         = parent.viz_left_alns_;
+  single_prec_alns_      = parent.single_prec_alns_;
+  banded_alns_           = parent.banded_alns_;
+  prune_alns_            = parent.prune_alns_;
+  aln_backend_           = parent.aln_backend_;
+  prescreen_alleles_     = parent.prescreen_alleles_;
+  sparse_haps_           = parent.sparse_haps_;
+  length_fast_path_      = parent.length_fast_path_;
+  min_flank_var_frac_    = parent.min_flank_var_frac_;
+  pool_window_           = parent.pool_window_;
+  bin_pool_quals_        = parent.bin_pool_quals_;
+  out_level_             = parent.out_level_;
+  out_threads_           = parent.out_threads_;
+  accelerate_em_         = parent.accelerate_em_;
+  stutter_train_reads_   = parent.stutter_train_reads_;
+  diplotype_prune_LL_    = parent.diplotype_prune_LL_;
+  incremental_           = parent.incremental_;
+  MAX_EM_ITER            = parent.MAX_EM_ITER;
+  ABS_LL_CONVERGE        = parent.ABS_LL_CONVERGE;
+  FRAC_LL_CONVERGE       = parent.FRAC_LL_CONVERGE;
+  MIN_TOTAL_READS        = parent.MIN_TOTAL_READS;
+  MAX_LOCUS_BYTES        = parent.MAX_LOCUS_BYTES;
+}
+
+void GenotyperBamProcessor::flush_output_files(std::vector< std::pair<std::string, int64_t> >& files){
+  SNPBamProcessor::flush_output_files(files);
+  if (output_str_gts_){
+    str_vcf_.flush_blocks();
+    files.push_back(std::pair<std::string, int64_t>(str_vcf_file_, RunCheckpoint::file_size(str_vcf_file_)));
+  }
+  if (output_viz_){
+    viz_out_.flush_blocks();
+    files.push_back(std::pair<std::string, int64_t>(viz_file_, RunCheckpoint::file_size(viz_file_)));
+  }
+  if (output_stutter_models_){
+    stutter_model_out_.flush();
+    files.push_back(std::pair<std::string, int64_t>(stutter_model_file_, RunCheckpoint::file_size(stutter_model_file_)));
+  }
+  if (output_locus_stats_){
+    locus_stats_out_.flush_blocks();
+    files.push_back(std::pair<std::string, int64_t>(locus_stats_file_, RunCheckpoint::file_size(locus_stats_file_)));
+  }
+  if (output_skip_list_){
+    skip_list_out_.flush();
+    files.push_back(std::pair<std::string, int64_t>(skip_list_file_, RunCheckpoint::file_size(skip_list_file_)));
+  }
+  if (output_batch_summary_){
+    batch_summary_out_.flush_blocks();
+    files.push_back(std::pair<std::string, int64_t>(batch_summary_file_, RunCheckpoint::file_size(batch_summary_file_)));
+  }
+}
+
+void GenotyperBamProcessor::merge_batch_outputs(const std::vector<std::string>& prefixes){
+  if (!output_str_gts_)
+    return;
+  if (str_vcf_file_.empty())
+    printErrorAndDie("The coordinator of a work queue requires the --str-vcf option");
+  std::vector<std::string> vcf_files;
+  for (auto prefix_iter = prefixes.begin(); prefix_iter != prefixes.end(); prefix_iter++)
+    vcf_files.push_back(*prefix_iter + ".vcf.gz");
+  concatenate_bgzipped_vcfs(vcf_files, str_vcf_file_, false);
+}
+
+void GenotyperBamProcessor::merge_worker_stats(BamProcessor* worker){
+  SNPBamProcessor::merge_worker_stats(worker);
+  GenotyperBamProcessor* gt_worker = static_cast<GenotyperBamProcessor*>(worker);
+  too_few_reads_        += gt_worker->too_few_reads_;
+  too_many_reads_       += gt_worker->too_many_reads_;
+  over_mem_budget_      += gt_worker->over_mem_budget_;
+  num_em_converge_      += gt_worker->num_em_converge_;
+  num_em_fail_          += gt_worker->num_em_fail_;
+  num_em_iter_           += gt_worker->num_em_iter_;
+  num_em_extrapolations_ += gt_worker->num_em_extrapolations_;
+  num_subsampled_stutter_loci_ += gt_worker->num_subsampled_stutter_loci_;
+  num_missing_models_   += gt_worker->num_missing_models_;
+  num_stutter_db_reused_      += gt_worker->num_stutter_db_reused_;
+  num_stutter_db_warm_starts_ += gt_worker->num_stutter_db_warm_starts_;
+  num_genotype_success_ += gt_worker->num_genotype_success_;
+  num_genotype_fail_    += gt_worker->num_genotype_fail_;
+  num_novel_allele_loci_ += gt_worker->num_novel_allele_loci_;
+  num_length_only_loci_  += gt_worker->num_length_only_loci_;
+  num_assembly_skipped_loci_ += gt_worker->num_assembly_skipped_loci_;
+}
+
+void GenotyperBamProcessor::write_skip_list_locus(const RegionGroup& region_group, const std::string& status){
+  // Seeking and filtering precede the analysis, which the genotyping phase encompasses along with its subphases
+  const TimedPhase phases[] = {PHASE_BAM_SEEK, PHASE_READ_FILTER, PHASE_SNP_INFO, PHASE_STUTTER_ESTIMATION, PHASE_GENOTYPING};
+  double total_time = 0;
+  for (unsigned int i = 0; i < sizeof(phases)/sizeof(phases[0]); i++)
+    total_time += locus_timer_.wall_time(phases[i]);
+
+  bool genotyped = (status.compare("GENOTYPED") == 0 || status.compare("SUMMARIZED") == 0);
+  if (total_time >= skip_list_min_time_)
+    LocusSkipList::write_locus(region_group.chrom(), region_group.start(), region_group.stop(), (genotyped ? "SLOW" : status), total_time, locus_skip_list_);
+  else if (!genotyped && status.compare("TOO_FEW_READS") != 0 && (total_time >= SKIP_LIST_FAILED_FRACTION*skip_list_min_time_ || status.compare("TIMEOUT") == 0))
+    LocusSkipList::write_locus(region_group.chrom(), region_group.start(), region_group.stop(), status, total_time, locus_skip_list_);
+}
+
+void GenotyperBamProcessor::write_locus_stats(const RegionGroup& region_group, const std::string& status, int32_t total_reads,
+					      int64_t num_em_iter, SeqStutterGenotyper* seq_genotyper){
+  if (metrics_ != NULL)
+    metrics_->record_locus(status, locus_timer_);
+  if (output_skip_list_)
+    write_skip_list_locus(region_group, status);
+  if (!output_locus_stats_)
+    return;
+  locus_stats_ << region_group.chrom() << "\t" << region_group.start()+1 << "\t" << region_group.stop() << "\t" << status << "\t" << total_reads;
+  if (seq_genotyper != NULL)
+    locus_stats_ << "\t" << seq_genotyper->num_pooled_reads() << "\t" << seq_genotyper->num_candidate_alleles()
+		 << "\t" << seq_genotyper->num_hap_blocks()   << "\t" << seq_genotyper->num_haplotypes()
+		 << "\t" << seq_genotyper->num_dp_cells();
+  else
+    locus_stats_ << "\t0\t0\t0\t0\t0";
+  locus_stats_ << "\t" << num_em_iter << "\t" << (seq_genotyper != NULL ? seq_genotyper->num_stutter_rounds() : 0)
+	       << "\t" << (seq_genotyper != NULL ? seq_genotyper->peak_bytes() : 0);
+
+  const TimedPhase phases[] = {PHASE_BAM_SEEK, PHASE_READ_FILTER, PHASE_SNP_INFO, PHASE_STUTTER_ESTIMATION, PHASE_LEFT_ALIGNMENT,
+			       PHASE_HAP_GENERATION, PHASE_HAP_ALIGNMENT, PHASE_POSTERIORS, PHASE_ALN_TRACEBACK, PHASE_FLANK_ASSEMBLY, PHASE_GENOTYPING};
+  for (unsigned int i = 0; i < sizeof(phases)/sizeof(phases[0]); i++)
+    locus_stats_ << "\t" << locus_timer_.wall_time(phases[i]);
+  if (AllocCounter::ENABLED){
+    // The bytes are summed over the top-level phases, as the genotyping phase's allocations include those of its subphases
+    uint64_t alloc_bytes = 0;
+    for (unsigned int i = 0; i < sizeof(phases)/sizeof(phases[0]); i++){
+      locus_stats_ << "\t" << locus_timer_.allocs(phases[i]).count;
+      if (phases[i] == PHASE_BAM_SEEK || phases[i] == PHASE_READ_FILTER || phases[i] == PHASE_SNP_INFO
+	  || phases[i] == PHASE_STUTTER_ESTIMATION || phases[i] == PHASE_GENOTYPING)
+	alloc_bytes += locus_timer_.allocs(phases[i]).bytes;
+    }
+    locus_stats_ << "\t" << alloc_bytes;
+  }
+  locus_stats_ << "\n";
+}
+
+/*
+  Builds a key that uniquely identifies an alignment's sequence, start position and CIGAR string.
+  The sequence is packed into 4 bits per base, matching the encoding used by BAM records
+ */
+static void alignment_cache_key(BamAlignment& aln, std::string& key){
+  const std::string& bases = aln.QueryBases();
+  const std::vector<CigarOp>& cigar_ops = aln.CigarData();
+  int32_t pos = aln.Position(), num_bases = bases.size();
+  key.clear();
+  key.reserve(sizeof(int32_t)*(2 + 2*cigar_ops.size()) + (num_bases+1)/2);
+  key.append(reinterpret_cast<const char*>(&pos), sizeof(pos));
+  key.append(reinterpret_cast<const char*>(&num_bases), sizeof(num_bases));
+  for (int32_t i = 0; i < num_bases; i += 2){
+    uint8_t packed = seq_nt16_table[(unsigned char)bases[i]] << 4;
+    if (i+1 < num_bases)
+      packed |= seq_nt16_table[(unsigned char)bases[i+1]];
+    key.push_back((char)packed);
+  }
+  for (auto op_iter = cigar_ops.begin(); op_iter != cigar_ops.end(); op_iter++){
+    int32_t type = op_iter->Type;
+    key.append(reinterpret_cast<const char*>(&type), sizeof(type));
+    key.append(reinterpret_cast<const char*>(&op_iter->Length), sizeof(op_iter->Length));
+  }
+}
+
 /*
   Left align BamAlignments in the provided vector and store those that successfully realign in the provided vector.
   Also extracts other information for successfully realigned reads into provided vectors.
  */
-void GenotyperBamProcessor::left_align_reads(RegionGroup& region_group, std::string& chrom_seq, std::vector<BamAlnList>& alignments,
+void GenotyperBamProcessor::left_align_reads(RegionGroup& region_group, const ReferenceSequence& chrom_seq, std::vector<BamAlnList>& alignments,
 					     std::vector< std::vector<double> >& log_p1,       std::vector< std::vector<double> >& log_p2,
 					     std::vector< std::vector<double> >& filt_log_p1,  std::vector< std::vector<double> >& filt_log_p2,
 					     std::vector<Alignment>& left_alns){
-  locus_left_aln_time_ = clock();
+  TraceScope trace("left_align_reads");
+  ScopedTimer left_aln_timer(locus_timer_, PHASE_LEFT_ALIGNMENT);
   logger() << "Left aligning reads" << std::endl;
-  std::map<std::string, int> seq_to_alns;
+  std::unordered_map<std::string, int> aln_cache;
+  std::string cache_key;
   int32_t align_fail_count = 0, total_reads = 0;
   int bp_diff;
   left_alns.clear(); filt_log_p1.clear(); filt_log_p2.clear();
@@ -57,12 +257,10 @@ void GenotyperBamProcessor::left_align_reads(RegionGroup& region_group, std::str
       if (alignments[i][j].Length() == 0)
         continue;
 
-      auto iter      = seq_to_alns.find(alignments[i][j].QueryBases());
-      bool have_prev = (iter != seq_to_alns.end());
-      if (have_prev)
-        have_prev &= left_alns[iter->second].get_sequence().size() == alignments[i][j].QueryBases().size();
-
-      if (!have_prev){
+      // Reads with the same sequence, start and CIGAR from any sample have identical alignments, so we only compute each one once
+      alignment_cache_key(alignments[i][j], cache_key);
+      auto iter = aln_cache.find(cache_key);
+      if (iter == aln_cache.end()){
         left_alns.push_back(Alignment(alignments[i][j].Name()));
         if (alignments[i][j].MatchesReference())
           convertAlignment(alignments[i][j], chrom_seq, left_alns.back());
@@ -72,16 +270,14 @@ void GenotyperBamProcessor::left_align_reads(RegionGroup& region_group, std::str
           left_alns.pop_back();
           continue;
 	}
-	seq_to_alns[alignments[i][j].QueryBases()] = left_alns.size()-1;
+	aln_cache.emplace(cache_key, left_alns.size()-1);
       }
       else {
-        // Reuse alignments if the sequence has already been observed and didn't lead to a soft-clipped alignment
-        // Soft-clipping is problematic because it complicates base quality extration (but not really that much)
-        Alignment& prev_aln = left_alns[iter->second];
-        assert(prev_aln.get_sequence().size() == alignments[i][j].QueryBases().size());
-	std::string bases = uppercase(alignments[i][j].QueryBases());
-        Alignment new_aln(prev_aln.get_start(), prev_aln.get_stop(), alignments[i][j].Name(), alignments[i][j].Qualities(), bases, prev_aln.get_alignment());
-        new_aln.set_cigar_list(prev_aln.get_cigar_list());
+        // Share the previous read's alignment string and CIGAR instead of copying them
+        const Alignment& prev_aln = left_alns[iter->second];
+        Alignment new_aln(prev_aln.get_start(), prev_aln.get_stop(), alignments[i][j].Name(), alignments[i][j].Qualities(),
+			  uppercase(alignments[i][j].QueryBases()), "");
+        new_aln.share_path(prev_aln);
         left_alns.push_back(new_aln);
       }
 
@@ -95,20 +291,19 @@ void GenotyperBamProcessor::left_align_reads(RegionGroup& region_group, std::str
     }
   }
 
-  locus_left_aln_time_  = (clock() - locus_left_aln_time_)/CLOCKS_PER_SEC;
-  total_left_aln_time_ += locus_left_aln_time_;
+  left_aln_timer.stop();
   if (align_fail_count != 0)
     logger() << "Failed to left align " << align_fail_count << " out of " << total_reads << " reads" << std::endl;
 }
 
-StutterModel* GenotyperBamProcessor::learn_stutter_model(std::vector<BamAlnList>& alignments,
-							 std::vector< std::vector<double> >& log_p1s,
-							 std::vector< std::vector<double> >& log_p2s,
-							 bool haploid, std::vector<std::string>& rg_names, const Region& region){
-  std::vector< std::vector<int> > str_bp_lengths(alignments.size());
-  std::vector< std::vector<double> > str_log_p1s(alignments.size()), str_log_p2s(alignments.size());
+int GenotyperBamProcessor::extract_stutter_reads(std::vector<BamAlnList>& alignments, std::vector< std::vector<double> >& log_p1s,
+						std::vector< std::vector<double> >& log_p2s, const Region& region, int max_inf_reads,
+						std::vector< std::vector<int> >& str_bp_lengths,
+						std::vector< std::vector<double> >& str_log_p1s, std::vector< std::vector<double> >& str_log_p2s){
+  str_bp_lengths.assign(alignments.size(), std::vector<int>());
+  str_log_p1s.assign(alignments.size(), std::vector<double>());
+  str_log_p2s.assign(alignments.size(), std::vector<double>());
   int inf_reads = 0;
-  const int MAX_INF_READS = 10000;
 
   // Extract bp differences and phasing probabilities for each read if we need to train a stutter model
   for (unsigned int i = 0; i < alignments.size(); ++i){
@@ -128,30 +323,203 @@ StutterModel* GenotyperBamProcessor::learn_stutter_model(std::vector<BamAlnList>
 	}
       }
     }
-    if (inf_reads > MAX_INF_READS)
+    if (max_inf_reads >= 0 && inf_reads > max_inf_reads)
       break;
   }
+  return inf_reads;
+}
+
+void GenotyperBamProcessor::write_batch_summary(std::vector<BamAlnList>& alignments, std::vector< std::vector<double> >& log_p1s,
+						std::vector< std::vector<double> >& log_p2s, std::vector<std::string>& rg_names,
+						RegionGroup& region_group, const ReferenceSequence& chrom_seq){
+  TraceScope trace("write_batch_summary");
+  const std::vector<Region>& regions = region_group.regions();
+  std::vector<LocusBatchSummary> summaries(regions.size());
+  for (unsigned int region_index = 0; region_index < regions.size(); region_index++){
+    LocusBatchSummary& summary = summaries[region_index];
+    summary.chrom   = regions[region_index].chrom();
+    summary.start   = regions[region_index].start();
+    summary.stop    = regions[region_index].stop();
+    summary.period  = regions[region_index].period();
+    summary.samples = rg_names;
+    extract_stutter_reads(alignments, log_p1s, log_p2s, regions[region_index], -1, summary.bp_diffs, summary.log_p1s, summary.log_p2s);
+  }
+
+  // Count the support for each candidate allele using the left-aligned reads that would be used to generate the haplotypes
+  std::vector<Alignment> left_alignments;
+  std::vector< std::vector<double> > filt_log_p1s, filt_log_p2s;
+  left_align_reads(region_group, chrom_seq, alignments, log_p1s, log_p2s, filt_log_p1s, filt_log_p2s, left_alignments);
+  int32_t min_aln_start = INT_MAX, max_aln_stop = INT_MIN;
+  for (auto aln_iter = left_alignments.begin(); aln_iter != left_alignments.end(); aln_iter++){
+    min_aln_start = std::min(min_aln_start, aln_iter->get_start());
+    max_aln_stop  = std::max(max_aln_stop,  aln_iter->get_stop());
+  }
+  HaplotypeGenerator hap_generator(min_aln_start, max_aln_stop);
+  for (unsigned int region_index = 0; region_index < regions.size(); region_index++){
+    std::vector< std::vector<Alignment> > gen_hap_alns(filt_log_p1s.size());
+    unsigned int read_index = 0;
+    for (unsigned int i = 0; i < filt_log_p1s.size(); i++)
+      for (unsigned int j = 0; j < filt_log_p1s[i].size(); j++, read_index++)
+	if (left_alignments[read_index].use_for_hap_generation(region_index))
+	  gen_hap_alns[i].push_back(left_alignments[read_index]);
+    summaries[region_index].has_candidates = hap_generator.count_candidate_seqs(regions[region_index], chrom_seq, gen_hap_alns,
+										  summaries[region_index].candidates);
+  }
+
+  for (auto summary_iter = summaries.begin(); summary_iter != summaries.end(); summary_iter++)
+    summary_iter->write(locus_batch_summary_);
+}
+
+void GenotyperBamProcessor::write_stutter_model(const Region& region, StutterModel& stutter_model){
+  if (output_stutter_models_)
+    stutter_model.write_model(region.chrom(), region.start(), region.stop(), locus_stutter_out_);
+  if (output_stutter_table_)
+    stutter_model.write_model(region.chrom(), region.start(), region.stop(), locus_stutter_table_);
+}
+
+// Select at most MAX_READS of the informative reads for stutter training and return the number selected. Each sample receives an equal
+// share of the reads, and the unused shares of samples with fewer reads are divided among the others. Each sample's reads are ordered
+// by their sizes and selected at evenly spaced ranks, so the subsample retains the sample's size distribution and is deterministic
+static int subsample_stutter_reads(const std::vector< std::vector<int> >& bp_lengths, const std::vector< std::vector<double> >& log_p1s,
+				   const std::vector< std::vector<double> >& log_p2s, int max_reads, std::vector< std::vector<int> >& sub_bp_lengths,
+				   std::vector< std::vector<double> >& sub_log_p1s, std::vector< std::vector<double> >& sub_log_p2s){
+  const int num_samples = bp_lengths.size();
+  std::vector<int> sample_order(num_samples);
+  for (int i = 0; i < num_samples; i++)
+    sample_order[i] = i;
+  std::stable_sort(sample_order.begin(), sample_order.end(), [&](int a, int b){ return bp_lengths[a].size() < bp_lengths[b].size(); });
+  std::vector<int> quotas(num_samples, 0);
+  int remaining = max_reads;
+  for (int i = 0; i < num_samples; i++){
+    int sample_index      = sample_order[i];
+    quotas[sample_index]  = std::min((int)bp_lengths[sample_index].size(), remaining/(num_samples-i));
+    remaining            -= quotas[sample_index];
+  }
+
+  sub_bp_lengths.assign(num_samples, std::vector<int>());
+  sub_log_p1s.assign(num_samples, std::vector<double>());
+  sub_log_p2s.assign(num_samples, std::vector<double>());
+  int num_selected = 0;
+  for (int sample_index = 0; sample_index < num_samples; sample_index++){
+    const std::vector<int>& sizes = bp_lengths[sample_index];
+    std::vector<int> size_order(sizes.size());
+    for (unsigned int i = 0; i < sizes.size(); i++)
+      size_order[i] = i;
+    std::stable_sort(size_order.begin(), size_order.end(), [&](int a, int b){ return sizes[a] < sizes[b]; });
+
+    // Select the read at the midpoint of each of the QUOTA equally sized strata of the ordered reads
+    int64_t quota = quotas[sample_index];
+    for (int64_t k = 0; k < quota; k++){
+      int read_index = size_order[((2*k+1)*(int64_t)sizes.size())/(2*quota)];
+      sub_bp_lengths[sample_index].push_back(sizes[read_index]);
+      sub_log_p1s[sample_index].push_back(log_p1s[sample_index][read_index]);
+      sub_log_p2s[sample_index].push_back(log_p2s[sample_index][read_index]);
+    }
+    num_selected += quota;
+  }
+  return num_selected;
+}
+
+StutterModel* GenotyperBamProcessor::learn_stutter_model(std::vector<BamAlnList>& alignments,
+							 std::vector< std::vector<double> >& log_p1s,
+							 std::vector< std::vector<double> >& log_p2s,
+							 bool haploid, std::vector<std::string>& rg_names, const Region& region,
+							 const ReferenceSequence& chrom_seq){
+  TraceScope trace("learn_stutter_model");
+
+  // Reuse the locus' model from the database if it was trained with enough reads, avoiding both read extraction and training
+  const StutterModelDatabase::Entry* db_entry = NULL;
+  std::string motif;
+  if (stutter_db_){
+    motif    = uppercase(chrom_seq.substr(region.start(), region.period()));
+    db_entry = stutter_db_->lookup(region, motif);
+    if (db_entry != NULL && reuse_stutter_min_reads_ > 0 && db_entry->num_reads >= reuse_stutter_min_reads_){
+      StutterModel* stutter_model = db_entry->model->copy();
+      stutter_model->set_period(region.period());
+      write_stutter_model(region, *stutter_model);
+      num_stutter_db_reused_++;
+      logger() << "Reusing stutter model from the database trained with " << db_entry->num_reads << " reads " << *stutter_model;
+      return stutter_model;
+    }
+  }
+
+  std::vector< std::vector<int> > str_bp_lengths;
+  std::vector< std::vector<double> > str_log_p1s, str_log_p2s;
+  const int MAX_INF_READS = 10000;
+  int inf_reads = extract_stutter_reads(alignments, log_p1s, log_p2s, region, (stutter_train_reads_ > 0 ? -1 : MAX_INF_READS),
+					str_bp_lengths, str_log_p1s, str_log_p2s);
 
   if (inf_reads < MIN_TOTAL_READS){
     logger() << "Skipping locus with too few informative reads for stutter training: TOTAL=" << inf_reads << ", MIN=" << MIN_TOTAL_READS << std::endl;
     too_few_reads_++;
+    if (metrics_ != NULL)
+      metrics_->add_stutter_result(MetricsExporter::STUTTER_TOO_FEW_READS);
     return NULL;
   }
 
+  // Skip training if the sample posteriors, whose size is quadratic in the number of allele sizes, would exceed the memory budget
+  if (MAX_LOCUS_BYTES > 0){
+    std::set<int> allele_sizes{0};
+    for (unsigned int i = 0; i < str_bp_lengths.size(); i++)
+      allele_sizes.insert(str_bp_lengths[i].begin(), str_bp_lengths[i].end());
+    int64_t num_bytes = EMStutterGenotyper::estimate_bytes(inf_reads, str_bp_lengths.size(), allele_sizes.size(), haploid);
+    if (num_bytes > MAX_LOCUS_BYTES){
+      logger() << "Skipping stutter model training as its " << allele_sizes.size() << " allele sizes would require ~" << num_bytes/(1024.0*1024.0)
+	       << " MB, which exceeds the memory budget of " << MAX_LOCUS_BYTES/(1024.0*1024.0) << " MB" << std::endl;
+      over_mem_budget_++;
+      if (metrics_ != NULL)
+	metrics_->add_stutter_result(MetricsExporter::STUTTER_MEMORY_BUDGET);
+      return NULL;
+    }
+  }
+
+  // For deep loci, train the model on a subsample of the reads and then refine it using all of them
+  std::vector< std::vector<int> > sub_bp_lengths;
+  std::vector< std::vector<double> > sub_log_p1s, sub_log_p2s;
+  bool subsampled = (stutter_train_reads_ > 0 && inf_reads > stutter_train_reads_);
+  if (subsampled){
+    int num_train_reads = subsample_stutter_reads(str_bp_lengths, str_log_p1s, str_log_p2s, stutter_train_reads_, sub_bp_lengths, sub_log_p1s, sub_log_p2s);
+    logger() << "Training the stutter model using " << num_train_reads << " out of " << inf_reads << " informative reads" << std::endl;
+    num_subsampled_stutter_loci_++;
+  }
+
   log("Building EM stutter genotyper");
-  EMStutterGenotyper length_genotyper(haploid, region.period(), str_bp_lengths, str_log_p1s, str_log_p2s, rg_names, 0);
+  EMStutterGenotyper length_genotyper(haploid, region.period(), (subsampled ? sub_bp_lengths : str_bp_lengths), (subsampled ? sub_log_p1s : str_log_p1s),
+				      (subsampled ? sub_log_p2s : str_log_p2s), rg_names, 0);
+  length_genotyper.set_task_queue(task_queue_);
   log("Training EM stutter genotyper");
-  bool trained = length_genotyper.train(MAX_EM_ITER, ABS_LL_CONVERGE, FRAC_LL_CONVERGE, false, logger());
+  if (accelerate_em_)
+    length_genotyper.accelerate_em();
+  if (db_entry != NULL){
+    length_genotyper.set_initial_stutter_model(db_entry->model);
+    num_stutter_db_warm_starts_++;
+  }
+  bool trained = length_genotyper.train(MAX_EM_ITER, ABS_LL_CONVERGE, FRAC_LL_CONVERGE, log_enabled(LOG_DEBUG), logger(LOG_DEBUG));
+  num_em_iter_           += length_genotyper.num_em_iterations();
+  num_em_extrapolations_ += length_genotyper.num_extrapolations();
   if (trained){
-    if (output_stutter_models_)
-      length_genotyper.get_stutter_model()->write_model(region.chrom(), region.start(), region.stop(), stutter_model_out_);
-    num_em_converge_++;
     StutterModel* stutter_model = length_genotyper.get_stutter_model()->copy();
+    if (subsampled){
+      EMStutterGenotyper full_genotyper(haploid, region.period(), str_bp_lengths, str_log_p1s, str_log_p2s, rg_names, 0);
+      full_genotyper.set_task_queue(task_queue_);
+      full_genotyper.refine(length_genotyper, 1, log_enabled(LOG_DEBUG), logger(LOG_DEBUG));
+      num_em_iter_ += full_genotyper.num_em_iterations();
+      delete stutter_model;
+      stutter_model = full_genotyper.get_stutter_model()->copy();
+    }
+    write_stutter_model(region, *stutter_model);
+    num_em_converge_++;
+    if (metrics_ != NULL)
+      metrics_->add_stutter_result(MetricsExporter::STUTTER_EM_CONVERGED);
+    if (stutter_db_)
+      stutter_db_->update(region, motif, stutter_model, inf_reads);
     logger() << "Learned stutter model " << *stutter_model;
     return stutter_model;
   }
   else {
     num_em_fail_++;
+    if (metrics_ != NULL)
+      metrics_->add_stutter_result(MetricsExporter::STUTTER_EM_FAILED);
     logger() << "Stutter model training failed for locus " << region.chrom() << ":" << region.start() << "-" << region.stop()
 	     << " with " << inf_reads << " informative reads" << std::endl;
     return NULL;
@@ -161,13 +529,24 @@ StutterModel* GenotyperBamProcessor::learn_stutter_model(std::vector<BamAlnList>
 void GenotyperBamProcessor::analyze_reads_and_phasing(std::vector<BamAlnList>& alignments,
 						      std::vector< std::vector<double> >& log_p1s,
 						      std::vector< std::vector<double> >& log_p2s,
-						      std::vector<std::string>& rg_names, RegionGroup& region_group, std::string& chrom_seq){
+						      std::vector<std::string>& rg_names, RegionGroup& region_group, const ReferenceSequence& chrom_seq){
   int32_t total_reads = 0;
   for (unsigned int i = 0; i < alignments.size(); i++)
     total_reads += alignments[i].size();
+  if (io_only_){
+    logger() << "Skipping the genotyping of the locus' " << total_reads << " reads, as only the I/O phases are being run" << std::endl;
+    return;
+  }
+  // Loci are only summarized for this batch of samples, as the minimum read count applies to the reads from all batches
+  if (output_batch_summary_ && !TOO_MANY_READS){
+    write_batch_summary(alignments, log_p1s, log_p2s, rg_names, region_group, chrom_seq);
+    write_locus_stats(region_group, "SUMMARIZED", total_reads, 0, NULL);
+    return;
+  }
   if (total_reads < MIN_TOTAL_READS){
     logger() << "Skipping locus with too few reads: TOTAL=" << total_reads << ", MIN=" << MIN_TOTAL_READS << std::endl;
     too_few_reads_++;
+    write_locus_stats(region_group, "TOO_FEW_READS", total_reads, 0, NULL);
     return;
   }
   // Can't simply check the total number of reads because the bam processor may have stopped reading at the threshold and then removed PCR duplicates
@@ -175,6 +554,7 @@ void GenotyperBamProcessor::analyze_reads_and_phasing(std::vector<BamAlnList>& a
   if (TOO_MANY_READS){
     logger() << "Skipping locus with too many reads: TOTAL=" << total_reads << ", MAX=" << MAX_TOTAL_READS << std::endl;
     too_many_reads_++;
+    write_locus_stats(region_group, "TOO_MANY_READS", total_reads, 0, NULL);
     return;
   }
 
@@ -187,7 +567,21 @@ void GenotyperBamProcessor::analyze_reads_and_phasing(std::vector<BamAlnList>& a
 
   // Learn the stutter model for each region
   std::vector<StutterModel*> stutter_models;
-  locus_stutter_time_  = clock();
+  SeqStutterGenotyper* seq_genotyper = NULL;
+
+  // Frees the locus's models and genotyper on return, or when the locus is abandoned due to an error or timeout
+  struct LocusCleanup {
+    std::vector<StutterModel*>& models;
+    SeqStutterGenotyper*& genotyper;
+    ~LocusCleanup(){
+      delete genotyper;
+      for (unsigned int i = 0; i < models.size(); i++)
+	delete models[i];
+    }
+  } cleanup = {stutter_models, seq_genotyper};
+
+  ScopedTimer stutter_timer(locus_timer_, PHASE_STUTTER_ESTIMATION);
+  int64_t init_em_iter = num_em_iter_;
   bool stutter_success = true;
   for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++){
     StutterModel* stutter_model = NULL;
@@ -197,37 +591,65 @@ void GenotyperBamProcessor::analyze_reads_and_phasing(std::vector<BamAlnList>& a
       stutter_model->set_period(region_iter->period());
     }
     else if (read_stutter_models_){
-      // Attempt to extact model from dictionary
-      auto model_iter = stutter_models_.find(*region_iter);
-      if (model_iter != stutter_models_.end())
-	stutter_model = model_iter->second->copy();
-      else {
+      // Attempt to extact model from the table
+      stutter_model = stutter_models_->lookup(*region_iter);
+      if (stutter_model == NULL){
 	logger() << "WARNING: No stutter model found for " << region_iter->chrom() << ":" << region_iter->start() << "-" << region_iter->stop() << std::endl;
 	num_missing_models_++;
+	if (metrics_ != NULL)
+	  metrics_->add_stutter_result(MetricsExporter::STUTTER_MISSING_MODEL);
       }
     }
     else {
       // Learn stutter model using length-based EM algorithm
-      stutter_model = learn_stutter_model(alignments, log_p1s, log_p2s, haploid, rg_names, *region_iter);
+      stutter_model = learn_stutter_model(alignments, log_p1s, log_p2s, haploid, rg_names, *region_iter, chrom_seq);
     }
     stutter_models.push_back(stutter_model);
     stutter_success &= (stutter_model != NULL);
   }
-  locus_stutter_time_  = (clock() - locus_stutter_time_)/CLOCKS_PER_SEC;
-  total_stutter_time_ += locus_stutter_time_;
+  stutter_timer.stop();
 
   // Genotype the regions, if requested
-  locus_genotype_time_ = clock();
-  SeqStutterGenotyper* seq_genotyper = NULL;
-  if (output_str_gts_ && stutter_success) {
+  ScopedTimer genotype_timer(locus_timer_, PHASE_GENOTYPING);
+  std::string status = (stutter_success ? "NOT_GENOTYPED" : "NO_STUTTER_MODEL");
+  if ((output_str_gts_ || output_str_columns_) && stutter_success) {
     std::vector<Alignment> left_alignments;
     std::vector< std::vector<double> > filt_log_p1s, filt_log_p2s;
     left_align_reads(region_group, chrom_seq, alignments, log_p1s, log_p2s, filt_log_p1s,
 		     filt_log_p2s, left_alignments);
 
+    // The genotyper only uses the left-aligned reads, so the BAM records and their decoded fields are released beforehand
+    for (unsigned int i = 0; i < alignments.size(); i++)
+      BamAlnList().swap(alignments[i]);
+
     bool run_assembly = !REQUIRE_SPANNING;
-    seq_genotyper = new SeqStutterGenotyper(region_group, haploid, run_assembly, left_alignments, filt_log_p1s, filt_log_p2s, rg_names, chrom_seq,
-					    stutter_models, ref_vcf_, logger());
+    seq_genotyper = new SeqStutterGenotyper(region_group, haploid, run_assembly, single_prec_alns_, left_alignments, filt_log_p1s, filt_log_p2s, rg_names, chrom_seq,
+					    stutter_models, ref_vcf_, MAX_LOCUS_BYTES, logger());
+    seq_genotyper->set_diplotype_pruning(diplotype_prune_LL_);
+    if (ref_allele_index_)
+      seq_genotyper->set_ref_allele_index(ref_allele_index_.get());
+    if (banded_alns_)
+      seq_genotyper->use_banded_alns();
+    if (prune_alns_)
+      seq_genotyper->use_pruned_alns();
+    if (prescreen_alleles_)
+      seq_genotyper->use_allele_prescreen();
+    if (sparse_haps_)
+      seq_genotyper->use_sparse_haplotypes();
+    if (length_fast_path_)
+      seq_genotyper->use_length_fast_path();
+    if (min_flank_var_frac_ > 0)
+      seq_genotyper->set_min_flank_var_frac(min_flank_var_frac_);
+    if (pool_window_ >= 0)
+      seq_genotyper->set_pool_window(pool_window_);
+    if (bin_pool_quals_)
+      seq_genotyper->use_binned_pool_qualities();
+    seq_genotyper->set_task_queue(task_queue_);
+    seq_genotyper->set_alignment_backend(aln_backend_);
+    if (output_str_columns_)
+      seq_genotyper->set_columns_output(&locus_columns_);
+    if (incremental_)
+      seq_genotyper->use_incremental_genotyping();
 
     if (seq_genotyper->genotype(chrom_seq, logger())) {
       bool pass = true;
@@ -239,50 +661,46 @@ void GenotyperBamProcessor::analyze_reads_and_phasing(std::vector<BamAlnList>& a
 
       if (pass){
 	num_genotype_success_++;
+	status = "GENOTYPED";
+
+	// The alignments are only traced and rendered for the loci selected for debugging output
+	bool output_viz = output_viz_ && debug_locus_;
 	seq_genotyper->write_vcf_record(samples_to_genotype_, chrom_seq, output_gls_, output_pls_, output_phased_gls_,
-					output_all_reads_, output_mall_reads_, output_viz_, max_flank_indel_frac_,
-					viz_left_alns_, viz_out_, str_vcf_, logger());
+					output_all_reads_, output_mall_reads_, output_viz, max_flank_indel_frac_,
+					viz_left_alns_, str_bcf_header_, locus_viz_, locus_vcf_, logger());
       }
-      else
+      else {
 	num_genotype_fail_++;
+	status = "GENOTYPING_FAILED";
+      }
+    }
+    else if (seq_genotyper->exceeded_mem_budget()){
+      over_mem_budget_++;
+      status = "MEMORY_BUDGET";
     }
-    else
+    else {
       num_genotype_fail_++;
-  }
-  locus_genotype_time_  = (clock() - locus_genotype_time_)/CLOCKS_PER_SEC;
-  total_genotype_time_ += locus_genotype_time_;
-
-  logger() << "Locus timing:"                                          << "\n"
-	   << " BAM seek time       = " << locus_bam_seek_time()       << " seconds\n"
-	   << " Read filtering      = " << locus_read_filter_time()    << " seconds\n"
-	   << " SNP info extraction = " << locus_snp_phase_info_time() << " seconds\n"
-	   << " Stutter estimation  = " << locus_stutter_time()        << " seconds\n";
-  if (stutter_success && output_str_gts_){
-    logger() << " Genotyping          = " << locus_genotype_time()       << " seconds\n";
-    if (output_str_gts_){
-      assert(seq_genotyper != NULL);
-      logger() << "\t" << " Left alignment        = "  << locus_left_aln_time_             << " seconds\n"
-	       << "\t" << " Haplotype generation  = "  << seq_genotyper->hap_build_time()  << " seconds\n"
-	       << "\t" << " Haplotype alignment   = "  << seq_genotyper->hap_aln_time()    << " seconds\n"
-	       << "\t" << " Flank assembly        = "  << seq_genotyper->assembly_time()   << " seconds\n"
-	       << "\t" << " Posterior computation = "  << seq_genotyper->posterior_time()  << " seconds\n"
-	       << "\t" << " Alignment traceback   = "  << seq_genotyper->aln_trace_time()  << " seconds\n";
-
-      process_timer_.add_time("Left alignment",        locus_left_aln_time_);
-      process_timer_.add_time("Haplotype generation",  seq_genotyper->hap_build_time());
-      process_timer_.add_time("Haplotype alignment",   seq_genotyper->hap_aln_time());
-      process_timer_.add_time("Flank assembly",        seq_genotyper->assembly_time());
-      process_timer_.add_time("Posterior computation", seq_genotyper->posterior_time());
-      process_timer_.add_time("Alignment traceback",   seq_genotyper->aln_trace_time());
+      status = "GENOTYPING_FAILED";
     }
   }
+  genotype_timer.stop();
+  if (seq_genotyper != NULL){
+    locus_timer_.add_times(seq_genotyper->timer());
+    num_novel_allele_loci_ += seq_genotyper->num_novel_allele_loci();
+    if (seq_genotyper->genotyped_from_lengths())
+      num_length_only_loci_++;
+    if (seq_genotyper->skipped_flank_assembly())
+      num_assembly_skipped_loci_++;
+  }
+
+  logger() << "Locus timing:" << "\n";
+  locus_timer_.print(logger());
+  if (seq_genotyper != NULL)
+    logger() << "Approximate peak memory for locus = " << seq_genotyper->peak_bytes()/(1024.0*1024.0) << " MB" << "\n";
+  write_locus_stats(region_group, status, total_reads, num_em_iter_-init_em_iter, seq_genotyper);
 
   /*
   logger() << "Total memory in use = " << getUsedPhysicalMemoryKB() << " KB"
 	   << std::endl;
   */
-
-  delete seq_genotyper;
-  for (int i = 0; i < stutter_models.size(); i++)
-    delete stutter_models[i];
 }
@@ -1,25 +1,37 @@
 #ifndef GENOTYPER_BAM_PROCESSOR_H_
 #define GENOTYPER_BAM_PROCESSOR_H_
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "bam_io.h"
+#include "batch_summary.h"
+#include "bcf_output.h"
 #include "bgzf_streams.h"
+#include "columnar_output.h"
 #include "em_stutter_genotyper.h"
+#include "perf_counters.h"
 #include "process_timer.h"
+#include "locus_skip_list.h"
+#include "ref_allele_index.h"
 #include "region.h"
 #include "seq_stutter_genotyper.h"
 #include "snp_bam_processor.h"
+#include "stringops.h"
 #include "stutter_model.h"
+#include "stutter_model_db.h"
+#include "stutter_model_table.h"
 #include "vcf_reader.h"
 #include "SeqAlignment/AlignmentData.h"
 #include "SeqAlignment/AlignmentOps.h"
 #include "SeqAlignment/HTMLCreator.h"
+#include "SeqAlignment/HugePageAllocator.h"
 
 
 class GenotyperBamProcessor : public SNPBamProcessor {
@@ -27,31 +39,129 @@ private:
   // Counter for when too few/many reads are available for stutter training/genotyping
   int too_few_reads_, too_many_reads_;
 
+  // Counter for loci whose stutter training or genotyping was skipped because it would exceed MAX_LOCUS_BYTES
+  int over_mem_budget_;
+
   // Counters for EM convergence
   int num_em_converge_, num_em_fail_;
 
-  // Parameters for stutter models read from file
+  // If true, stutter training uses SQUAREM-accelerated EM. Counts the EM iterations and accepted extrapolations across all loci
+  bool accelerate_em_;
+  int64_t num_em_iter_, num_em_extrapolations_;
+
+  // If > 0, stutter models are trained on a stratified subsample of at most this many informative reads and then refined using
+  // an EM iteration over all of them. Counts the loci whose training was subsampled
+  int stutter_train_reads_;
+  int num_subsampled_stutter_loci_;
+
+  // Parameters for stutter models read from file, which are shared by all worker processors
   bool read_stutter_models_;
-  std::map<Region, StutterModel*> stutter_models_;
+  std::shared_ptr<StutterModelTable> stutter_models_;
   int num_missing_models_;
 
+  // Database of stutter models learned by previous runs, shared by all worker processors. If a locus' entry was trained
+  // with at least REUSE_STUTTER_MIN_READS_ reads (and the threshold is > 0) the model is reused, otherwise it warm-starts the EM algorithm
+  std::shared_ptr<StutterModelDatabase> stutter_db_;
+  int reuse_stutter_min_reads_;
+  int64_t num_stutter_db_reused_, num_stutter_db_warm_starts_;
+
   // Output file for stutter models
   bool output_stutter_models_;
   std::ofstream stutter_model_out_;
+  std::string stutter_model_file_;
+
+  // Binary stutter model table, which is written once all of the loci have been analyzed. Each locus' models are
+  // buffered as full-precision text lines and accumulated by the output thread
+  bool output_stutter_table_;
+  std::string stutter_table_file_;
+  StutterModelTable::Builder stutter_table_builder_;
 
   // Output file for STR genotypes
   bool output_str_gts_;
   bgzfostream str_vcf_;
+  std::string str_vcf_file_, str_vcf_command_;
   std::vector<std::string> samples_to_genotype_;
 
+  // If the STR genotypes are written in BCF format rather than VCF text, the header describing their records. Otherwise, NULL
+  bcf_hdr_t* str_bcf_header_;
+
+  // Open the STR VCF at the provided path and write its header, which is kept in separate BGZF blocks
+  // from the records so that the VCF can be concatenated with others without recompression (see vcf_concat.h).
+  // A VCF written to stdout ("-"), which the genotyping service streams to its clients, is left uncompressed
+  void open_str_vcf(const std::string& vcf_file){
+    bool to_stdout = (vcf_file.compare("-") == 0);
+    if (to_stdout)
+      str_vcf_.open(vcf_file.c_str(), "wu");
+    else
+      str_vcf_.open(vcf_file.c_str(), out_mode("w").c_str(), out_threads(num_threads()));
+    if (str_bcf_header_ != NULL)
+      write_bcf_header(str_bcf_header_, str_vcf_);
+    else
+      Genotyper::write_vcf_header(str_vcf_command_, samples_to_genotype_, output_gls_, output_pls_, output_phased_gls_, incremental_, str_vcf_);
+    str_vcf_.flush_blocks();
+  }
+
+  // Columnar output of the STR genotypes, written alongside or instead of the VCF. Only the parent processor owns the writer
+  bool output_str_columns_;
+  ColumnarWriter* str_columns_;
+
+  // Select the samples whose genotypes are output, which are sorted by name
+  void select_output_samples(const std::set<std::string>& samples_to_output){
+    samples_to_genotype_.clear();
+    for (auto sample_iter = samples_to_output.begin(); sample_iter != samples_to_output.end(); sample_iter++)
+      if (sample_set_.empty() || sample_set_.find(*sample_iter) != sample_set_.end())
+	samples_to_genotype_.push_back(*sample_iter);
+    std::sort(samples_to_genotype_.begin(), samples_to_genotype_.end());
+  }
+
   // Counters for genotyping success;
   int num_genotype_success_, num_genotype_fail_;
 
+  // If true, new samples are genotyped against the alleles, allele frequencies and stutter models from a prior call set.
+  // Counts the loci at which the new samples' reads support alleles that aren't in the prior call set
+  bool incremental_;
+  int num_novel_allele_loci_;
+
   // VCF containing STR genotypes for a reference panel
   VCF::VCFReader* ref_vcf_;
+  std::string ref_vcf_file_;
+
+  // Memory-mapped index of the reference VCF's alleles, shared by all worker processors. If NULL, the alleles are read from the VCF
+  std::shared_ptr<RefAlleleIndex> ref_allele_index_;
+  std::string ref_allele_index_file_;
 
   bool output_viz_;
   bgzfostream viz_out_;
+  std::string viz_file_;
+
+  // Output file for the per-locus read counts, workload and timing statistics
+  bool output_locus_stats_;
+  bgzfostream locus_stats_out_;
+  std::string locus_stats_file_;
+
+  // Output file for the loci that future runs should skip using --skip-list. A locus is listed if its analysis took at least
+  // SKIP_LIST_MIN_TIME_ seconds, or if it wasn't genotyped after at least SKIP_LIST_FAILED_FRACTION*SKIP_LIST_MIN_TIME_ seconds
+  bool output_skip_list_;
+  std::ofstream skip_list_out_;
+  std::string skip_list_file_;
+  double skip_list_min_time_;
+  static constexpr double SKIP_LIST_FAILED_FRACTION = 0.1;
+  int64_t num_skip_list_loci_;
+  void write_skip_list_locus(const RegionGroup& region_group, const std::string& status);
+
+  // Output file for the per-locus summaries of this batch of samples, in lieu of genotyping them (see LocusBatchSummary)
+  bool output_batch_summary_;
+  bgzfostream batch_summary_out_;
+  std::string batch_summary_file_;
+
+  // Compression level (0-9, or -1 for htslib's default) and number of compression threads (0 for each output's default)
+  // used for the BGZF-compressed STR VCF, visualization, locus statistics and batch summary outputs
+  int out_level_, out_threads_;
+  std::string out_mode(const char* mode) const { return bgzf_write_mode(mode, out_level_); }
+  int out_threads(int default_threads) const   { return (out_threads_ > 0 ? out_threads_ : default_threads); }
+
+  // Buffers for the VCF, columnar, visualization, stutter model, statistics, skip list and batch summary output of the current locus
+  std::stringstream locus_vcf_, locus_columns_, locus_viz_, locus_stutter_out_, locus_stutter_table_, locus_stats_, locus_skip_list_, locus_batch_summary_;
 
   bool output_gls_;             // Output the GL FORMAT field to the VCF
   bool output_pls_;             // Output the PL FORMAT field to the VCF
@@ -63,11 +173,6 @@ private:
 
   std::set<std::string> haploid_chroms_;
 
-  // Timing statistics (in seconds)
-  double total_stutter_time_,  locus_stutter_time_;
-  double total_left_aln_time_, locus_left_aln_time_;
-  double total_genotype_time_, locus_genotype_time_;
-
   // True iff we should recalculate the stutter model after performing haplotype alignments
   // The idea is that the haplotype-based alignments should be far more accurate, and reperforming
   // the stutter analysis will result in a better stutter model
@@ -76,84 +181,289 @@ private:
   // If this flag is set, HTML alignments are written for both the haplotype alignments and Needleman-Wunsch left alignments
   bool viz_left_alns_;
 
-  // Simple object to track total times consumed by various processes
-  ProcessTimer process_timer_;
+  // If true, compute haplotype alignment likelihoods in single precision when possible
+  bool single_prec_alns_;
+
+  // If true, restrict haplotype alignments to a band around each read's original alignment when possible
+  bool banded_alns_;
+
+  // If true, stop aligning each read to haplotypes that can't approach the LL of its best haplotype
+  bool prune_alns_;
+
+  // If true, remove candidate STR alleles with implausible lengths for every sample before aligning the reads
+  bool prescreen_alleles_;
+
+  // If true, haplotypes only contain the combinations of block options observed in the reads instead of every combination
+  bool sparse_haps_;
+
+  // If true, loci whose flanks don't vary are genotyped from the lengths of the reads' repeats instead of their haplotype alignments
+  bool length_fast_path_;
+
+  // If positive, only reassemble the flanks of samples with a recurrent flank variant in at least this fraction of their reads
+  float min_flank_var_frac_;
+  int num_length_only_loci_;
+  int num_assembly_skipped_loci_;
+
+  // If >= 0, reads spanning the repeats and this many flanking bp are pooled by their bases within this window. Narrower windows
+  // would leave too little flanking sequence to seed the pools' alignments outside of the repeats
+  int32_t pool_window_;
+  const static int32_t MIN_POOL_WINDOW = 10;
+
+  // If true, the reads' base qualities are binned using the Illumina 8-level scheme before they're pooled
+  bool bin_pool_quals_;
+
+  // If false, finish() doesn't log the execution summary and timing breakdown, e.g. for single-locus queries
+  bool log_run_summary_;
+
+  // Backend used to compute the haplotype alignment likelihoods of the pooled reads
+  AlignmentBackend* aln_backend_;
+
+  // If positive, the LL difference beyond which a sample's diplotypes are pruned during genotyping
+  double diplotype_prune_LL_;
 
   // If it is not null, this stutter model will be used for each locus
   StutterModel* def_stutter_model_;
 
-  void left_align_reads(RegionGroup& region_group, std::string& chrom_seq, std::vector<BamAlnList>& alignments,
+  void left_align_reads(RegionGroup& region_group, const ReferenceSequence& chrom_seq, std::vector<BamAlnList>& alignments,
 			std::vector< std::vector<double> >& log_p1,       std::vector< std::vector<double> >& log_p2,
 			std::vector< std::vector<double> >& filt_log_p1,  std::vector< std::vector<double> >& filt_log_p2,
 			std::vector< Alignment>& left_alns);
 
+  // Extract the bp difference and phasing log-likelihoods of each read that is informative for stutter training. Stops after the
+  // first sample at which more than MAX_INF_READS reads have been extracted, unless it's negative. Returns the number of reads extracted
+  int extract_stutter_reads(std::vector<BamAlnList>& alignments, std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s,
+			    const Region& region, int max_inf_reads, std::vector< std::vector<int> >& str_bp_lengths,
+			    std::vector< std::vector<double> >& str_log_p1s, std::vector< std::vector<double> >& str_log_p2s);
+
+  // Buffer the summary of each region in the group for the current batch of samples
+  void write_batch_summary(std::vector<BamAlnList>& alignments, std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s,
+			   std::vector<std::string>& rg_names, RegionGroup& region_group, const ReferenceSequence& chrom_seq);
+
+  // Buffer a learned stutter model for the --stutter-out file and the binary stutter model table, if they're requested
+  void write_stutter_model(const Region& region, StutterModel& stutter_model);
+
   StutterModel* learn_stutter_model(std::vector<BamAlnList>& alignments,
 				    std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s,
-				    bool haploid, std::vector<std::string>& rg_names, const Region& region);
+				    bool haploid, std::vector<std::string>& rg_names, const Region& region, const ReferenceSequence& chrom_seq);
+
+  // Buffer the statistics for the current locus, where SEQ_GENOTYPER is NULL if the locus wasn't genotyped
+  void write_locus_stats(const RegionGroup& region_group, const std::string& status, int32_t total_reads,
+			 int64_t num_em_iter, SeqStutterGenotyper* seq_genotyper);
+
+ protected:
+  void init_worker(const GenotyperBamProcessor& parent);
+
+  BamProcessor* create_worker(){
+    GenotyperBamProcessor* worker = new GenotyperBamProcessor(true, true);
+    worker->init_worker(*this);
+    return worker;
+  }
+
+  void merge_worker_stats(BamProcessor* worker);
+
+  // Timed out loci are reported in the locus statistics and skip list, so that later runs can exclude them
+  void record_timed_out_locus(const RegionGroup& region_group){
+    write_locus_stats(region_group, "TIMEOUT", 0, 0, NULL);
+  }
+
+  void extract_locus_output(LocusOutput& output){
+    SNPBamProcessor::extract_locus_output(output);
+    output.str_vcf        = locus_vcf_.str();
+    output.str_columns    = locus_columns_.str();
+    output.viz            = locus_viz_.str();
+    output.stutter_models = locus_stutter_out_.str();
+    output.stutter_table  = locus_stutter_table_.str();
+    output.locus_stats    = locus_stats_.str();
+    output.skip_list      = locus_skip_list_.str();
+    output.batch_summary  = locus_batch_summary_.str();
+    discard_locus_output();
+  }
+
+  void discard_locus_output(){
+    SNPBamProcessor::discard_locus_output();
+    locus_vcf_.str("");           locus_vcf_.clear();
+    locus_columns_.str("");       locus_columns_.clear();
+    locus_viz_.str("");           locus_viz_.clear();
+    locus_stutter_out_.str("");   locus_stutter_out_.clear();
+    locus_stutter_table_.str(""); locus_stutter_table_.clear();
+    locus_stats_.str("");         locus_stats_.clear();
+    locus_skip_list_.str("");     locus_skip_list_.clear();
+    locus_batch_summary_.str(""); locus_batch_summary_.clear();
+  }
+
+  void write_locus_output(LocusOutput& output){
+    SNPBamProcessor::write_locus_output(output);
+    if (output_str_gts_)
+      str_vcf_ << output.str_vcf;
+    if (output_str_columns_)
+      str_columns_->add_loci(output.str_columns);
+    if (output_viz_)
+      viz_out_ << output.viz;
+    if (output_stutter_models_)
+      stutter_model_out_ << output.stutter_models;
+    if (output_stutter_table_){
+      std::istringstream models(output.stutter_table);
+      stutter_table_builder_.add_text_models(models);
+    }
+    if (output_locus_stats_)
+      locus_stats_out_ << output.locus_stats;
+    if (output_skip_list_){
+      skip_list_out_ << output.skip_list;
+      num_skip_list_loci_ += std::count(output.skip_list.begin(), output.skip_list.end(), '\n');
+    }
+    if (output_batch_summary_)
+      batch_summary_out_ << output.batch_summary;
+  }
+
+  void flush_output_files(std::vector< std::pair<std::string, int64_t> >& files);
+
+  // Buffer each locus' genotypes for the samples in the columnar layout, for processors that retrieve them using
+  // extract_locus_output() instead of writing them to files
+  void buffer_str_columns(const std::set<std::string>& samples_to_output){
+    output_str_columns_ = true;
+    select_output_samples(samples_to_output);
+  }
 
 public:
  GenotyperBamProcessor(bool use_bam_rgs, bool remove_pcr_dups):SNPBamProcessor(use_bam_rgs, remove_pcr_dups){
     output_stutter_models_ = false;
+    output_stutter_table_  = false;
     output_str_gts_        = false;
+    output_str_columns_    = false;
+    str_columns_           = NULL;
     output_viz_            = false;
+    output_locus_stats_    = false;
+    output_skip_list_      = false;
+    skip_list_min_time_    = 60;
+    num_skip_list_loci_    = 0;
+    output_batch_summary_  = false;
     read_stutter_models_   = false;
+    reuse_stutter_min_reads_    = 0;
+    num_stutter_db_reused_      = 0;
+    num_stutter_db_warm_starts_ = 0;
     viz_left_alns_         = false;
+    single_prec_alns_      = false;
+    banded_alns_           = false;
+    prune_alns_            = false;
+    aln_backend_           = AlignmentBackend::cpu();
+    prescreen_alleles_     = false;
+    sparse_haps_           = false;
+    length_fast_path_      = false;
+    min_flank_var_frac_    = 0;
+    pool_window_           = -1;
+    bin_pool_quals_        = false;
+    out_level_             = -1;
+    out_threads_           = 0;
+    log_run_summary_       = true;
+    num_length_only_loci_  = 0;
+    num_assembly_skipped_loci_ = 0;
+    diplotype_prune_LL_    = 0;
     haploid_chroms_        = std::set<std::string>();
     too_few_reads_         = 0;
     too_many_reads_        = 0;
+    over_mem_budget_       = 0;
     num_em_converge_       = 0;
     num_em_fail_           = 0;
+    accelerate_em_         = false;
+    num_em_iter_           = 0;
+    num_em_extrapolations_ = 0;
+    stutter_train_reads_   = 0;
+    num_subsampled_stutter_loci_ = 0;
     num_missing_models_    = 0;
     num_genotype_success_  = 0;
     num_genotype_fail_     = 0;
+    incremental_           = false;
+    num_novel_allele_loci_ = 0;
     MAX_EM_ITER            = 100;
     ABS_LL_CONVERGE        = 0.01;
     FRAC_LL_CONVERGE       = 0.001;
     MIN_TOTAL_READS        = 100;
+    MAX_LOCUS_BYTES        = 0;
     output_gls_            = false;
     output_pls_            = false;
     output_phased_gls_     = false;
     output_all_reads_      = true;
     output_mall_reads_     = true;
-    total_stutter_time_    = 0;
-    locus_stutter_time_    = -1;
-    total_left_aln_time_   = 0;
-    locus_left_aln_time_   = -1;
-    total_genotype_time_   = 0;
-    locus_genotype_time_   = -1;
     max_flank_indel_frac_  = 1.0;
     recalc_stutter_model_  = false;
     def_stutter_model_     = NULL;
     ref_vcf_               = NULL;
+    str_bcf_header_        = NULL;
+
+    // Print floats with exactly 2 decimal places
+    locus_vcf_.precision(2);
+    locus_vcf_.setf(std::ios::fixed, std::ios::floatfield);
+
+    // The binary stutter models retain the full precision of each parameter
+    locus_stutter_table_.precision(17);
   }
 
   ~GenotyperBamProcessor(){
-    for (auto iter = stutter_models_.begin(); iter != stutter_models_.end(); iter++)
-      delete iter->second;
-    stutter_models_.clear();
     if (ref_vcf_ != NULL)
       delete ref_vcf_;
     if (def_stutter_model_ != NULL)
       delete def_stutter_model_;
+    if (str_bcf_header_ != NULL)
+      bcf_hdr_destroy(str_bcf_header_);
+    delete str_columns_;
   }
 
-  double total_stutter_time()  { return total_stutter_time_;  }
-  double locus_stutter_time()  { return locus_stutter_time_;  }
-  double total_left_aln_time() { return total_left_aln_time_; }
-  double locus_left_aln_time() { return locus_left_aln_time_; }
-  double total_genotype_time() { return total_genotype_time_; }
-  double locus_genotype_time() { return locus_genotype_time_; }
-
   void output_gls()         { output_gls_        = true;    }
   void output_pls()         { output_pls_        = true;    }
   void output_phased_gls()  { output_phased_gls_ = true;    }
   void hide_all_reads()     { output_all_reads_  = false;   }
   void hide_mall_reads()    { output_mall_reads_ = false;   }
   void visualize_left_alns(){ viz_left_alns_     = true;    }
+  void use_single_precision_alns(){ single_prec_alns_ = true; }
+  void use_accelerated_em()       { accelerate_em_    = true; }
+  void use_banded_alns()          { banded_alns_      = true; }
+  void use_pruned_alns()          { prune_alns_       = true; }
+  void use_allele_prescreen()     { prescreen_alleles_ = true; }
+  void use_sparse_haplotypes()    { sparse_haps_       = true; }
+  void use_length_fast_path()     { length_fast_path_  = true; }
+  void set_min_flank_var_frac(float frac){ min_flank_var_frac_ = frac; }
+  void skip_run_summary()         { log_run_summary_   = false; }
+  void use_binned_pool_qualities(){ bin_pool_quals_    = true; }
+
+  void set_stutter_train_reads(int num_reads){
+    if (num_reads <= 0)
+      printErrorAndDie("The number of reads used to train each stutter model must be positive");
+    stutter_train_reads_ = num_reads;
+  }
+
+  void set_output_level(int level){
+    if (level < 0 || level > 9)
+      printErrorAndDie("The output compression level must be between 0 and 9");
+    out_level_ = level;
+  }
+  void set_output_threads(int num_threads){
+    if (num_threads < 1)
+      printErrorAndDie("The number of output compression threads must be greater than 0");
+    out_threads_ = num_threads;
+  }
+
+  void set_pool_window(int32_t flank){
+    if (flank < MIN_POOL_WINDOW)
+      printErrorAndDie("The flank size for the read pooling window must be at least " + std::to_string(MIN_POOL_WINDOW) + " bp");
+    pool_window_ = flank;
+  }
+
+  void set_alignment_backend(const std::string& name){
+    aln_backend_ = AlignmentBackend::get(name);
+    if (aln_backend_ == NULL){
+      std::string names;
+      for (const std::string& backend : AlignmentBackend::available())
+	names += (names.empty() ? "" : ", ") + backend;
+      printErrorAndDie("Alignment backend " + name + " is unavailable. This build supports: " + names);
+    }
+  }
+  void set_diplotype_pruning(double prune_LL){ diplotype_prune_LL_ = prune_LL; }
 
   void add_haploid_chrom(std::string chrom){ haploid_chroms_.insert(chrom); }
   void set_max_flank_indel_frac(float frac){  max_flank_indel_frac_ = frac; }
   bool has_default_stutter_model()         { return def_stutter_model_ != NULL; }
+  bool has_input_stutter_models()          { return read_stutter_models_;       }
+  void use_incremental_genotyping()        { incremental_ = true;               }
   void set_default_stutter_model(double inframe_geom,  double inframe_up,  double inframe_down,
 				 double outframe_geom, double outframe_up, double outframe_down){
     if (def_stutter_model_ != NULL)
@@ -165,88 +475,225 @@ public:
 
   void set_output_viz(std::string& viz_file){
     output_viz_ = true;
-    viz_out_.open(viz_file.c_str());
+    viz_file_   = viz_file;
+    viz_out_.open(viz_file.c_str(), out_mode(append_to_output(viz_file) ? "a" : "w").c_str(), out_threads(1));
+  }
+
+  void set_output_locus_stats(std::string& stats_file){
+    output_locus_stats_ = true;
+    locus_stats_file_   = stats_file;
+    if (append_to_output(stats_file)){
+      locus_stats_out_.open(stats_file.c_str(), out_mode("a").c_str(), out_threads(1));
+      return;
+    }
+    locus_stats_out_.open(stats_file.c_str(), out_mode("w").c_str(), out_threads(1));
+    locus_stats_out_ << "CHROM\tSTART\tEND\tSTATUS\tREADS\tPOOLED_READS\tALLELES\tHAP_BLOCKS\tHAPLOTYPES\tDP_CELLS\tEM_ITERATIONS\tSTUTTER_ROUNDS\tPEAK_BYTES"
+		     << "\tSEEK_TIME\tFILTER_TIME\tSNP_TIME\tSTUTTER_TIME\tLEFT_ALN_TIME\tHAP_GEN_TIME\tHAP_ALN_TIME\tPOSTERIOR_TIME\tTRACEBACK_TIME\tASSEMBLY_TIME\tGENOTYPE_TIME";
+    if (AllocCounter::ENABLED)
+      locus_stats_out_ << "\tSEEK_ALLOCS\tFILTER_ALLOCS\tSNP_ALLOCS\tSTUTTER_ALLOCS\tLEFT_ALN_ALLOCS\tHAP_GEN_ALLOCS\tHAP_ALN_ALLOCS\tPOSTERIOR_ALLOCS"
+		       << "\tTRACEBACK_ALLOCS\tASSEMBLY_ALLOCS\tGENOTYPE_ALLOCS\tALLOC_BYTES";
+    locus_stats_out_ << "\n";
+  }
+
+  void set_output_skip_list(std::string& skip_list_file){
+    output_skip_list_ = true;
+    skip_list_file_   = skip_list_file;
+    bool append       = append_to_output(skip_list_file);
+    skip_list_out_.open(skip_list_file, append ? std::ofstream::app : std::ofstream::out);
+    if (!skip_list_out_.is_open())
+      printErrorAndDie("Failed to open output file for the skip list");
+    if (!append)
+      LocusSkipList::write_header(skip_list_out_);
+  }
+  void set_skip_list_min_time(double seconds){
+    if (seconds <= 0)
+      printErrorAndDie("The minimum analysis time for loci in the skip list must be greater than 0");
+    skip_list_min_time_ = seconds;
+  }
+
+  void set_output_batch_summary(std::string& summary_file){
+    output_batch_summary_ = true;
+    batch_summary_file_   = summary_file;
+    if (append_to_output(summary_file)){
+      batch_summary_out_.open(summary_file.c_str(), out_mode("a").c_str(), out_threads(1));
+      return;
+    }
+    batch_summary_out_.open(summary_file.c_str(), out_mode("w").c_str(), out_threads(1));
+    batch_summary_out_ << "#CHROM\tSTART\tEND\tPERIOD\tSTUTTER_READS\tCANDIDATES\n";
   }
 
   void set_ref_vcf(std::string& ref_vcf_file){
     if (ref_vcf_ != NULL)
       delete ref_vcf_;
-    ref_vcf_ = new VCF::VCFReader(ref_vcf_file);
+    ref_vcf_      = new VCF::VCFReader(ref_vcf_file);
+    ref_vcf_file_ = ref_vcf_file;
   }
 
+  void set_ref_allele_index_file(const std::string& index_file){ ref_allele_index_file_ = index_file; }
+  const std::string& ref_allele_index_file() const               { return ref_allele_index_file_;  }
+
+  // Loads the reference allele index, after generating it from the reference VCF if it doesn't exist. Requires set_ref_vcf()
+  void load_ref_allele_index(){
+    ref_allele_index_ = std::shared_ptr<RefAlleleIndex>(loadRefAlleleIndex(ref_vcf_file_, ref_allele_index_file_, logger()));
+  }
+
+  // Loads the stutter models in a text file or a binary table written by --stutter-bin-out
   void set_input_stutter(std::string& model_file){
-    std::ifstream input;
-    input.open(model_file, std::ifstream::in);
-    if (!input.is_open())
-      printErrorAndDie("Failed to open input file for stutter models. Filename = " + model_file);
-    StutterModel::read_models(input, stutter_models_);
+    stutter_models_      = std::make_shared<StutterModelTable>(model_file);
     read_stutter_models_ = true;
-    input.close();
   }
   
+  void set_stutter_db(const std::string& db_file){ stutter_db_ = std::make_shared<StutterModelDatabase>(db_file); }
+  void set_stutter_reuse(int min_reads)          { reuse_stutter_min_reads_ = min_reads; }
+  bool has_stutter_db()                          { return stutter_db_ != NULL; }
+
   void set_output_stutter(std::string& model_file){
     output_stutter_models_ = true;
-    stutter_model_out_.open(model_file, std::ofstream::out);
+    stutter_model_file_    = model_file;
+    stutter_model_out_.open(model_file, append_to_output(model_file) ? std::ofstream::app : std::ofstream::out);
     if (!stutter_model_out_.is_open())
       printErrorAndDie("Failed to open output file for stutter models");
   }
 
-  void set_output_str_vcf(std::string& vcf_file, std::string& full_command, std::set<std::string>& samples_to_output){
-    output_str_gts_ = true;
-    str_vcf_.open(vcf_file.c_str());
+  void set_output_stutter_table(const std::string& table_file){
+    output_stutter_table_ = true;
+    stutter_table_file_   = table_file;
+  }
+
+  void open_batch_output(const std::string& prefix){
+    if (output_str_gts_)
+      open_str_vcf(prefix + ".vcf.gz");
+  }
+
+  void close_batch_output(){
+    if (output_str_gts_)
+      str_vcf_.close();
+  }
+
+  void merge_batch_outputs(const std::vector<std::string>& prefixes);
+
+  // The VCF file is optional when using a work queue, as only the coordinator combines each batch's genotypes into it.
+  // If the file ends in .bcf, the genotypes are written in BCF format, for which CHROMS lists the chromosomes of the regions
+  void set_output_str_vcf(std::string& vcf_file, std::string& full_command, std::set<std::string>& samples_to_output,
+			  const std::vector<std::string>& chroms){
+    output_str_gts_  = true;
+    str_vcf_file_    = vcf_file;
+    str_vcf_command_ = full_command;
 
     // Print floats with exactly 2 decimal places
     str_vcf_.precision(2);
     str_vcf_.setf(std::ios::fixed, std::ios::floatfield);
     
     // Assemble a list of sample names for genotype output
-    samples_to_genotype_.clear();
-    for (auto sample_iter = samples_to_output.begin(); sample_iter != samples_to_output.end(); sample_iter++)
-      if (sample_set_.empty() || sample_set_.find(*sample_iter) != sample_set_.end())
-	samples_to_genotype_.push_back(*sample_iter);
-    std::sort(samples_to_genotype_.begin(), samples_to_genotype_.end());
-    
-    // Write VCF header
-    Genotyper::write_vcf_header(full_command, samples_to_genotype_, output_gls_, output_pls_, output_phased_gls_, str_vcf_);
+    select_output_samples(samples_to_output);
+
+    if (string_ends_with(vcf_file, ".bcf")){
+      std::stringstream vcf_header;
+      Genotyper::write_vcf_header(str_vcf_command_, samples_to_genotype_, output_gls_, output_pls_, output_phased_gls_, incremental_, vcf_header);
+      str_bcf_header_ = create_bcf_header(vcf_header.str(), chroms);
+    }
+
+    // When using a work queue, the genotypes are written to each batch's VCF instead
+    if (using_work_queue())
+      return;
+
+    // Write VCF header, unless it was written before the resumed run was interrupted
+    if (append_to_output(vcf_file))
+      str_vcf_.open(vcf_file.c_str(), out_mode("a").c_str(), out_threads(num_threads()));
+    else
+      open_str_vcf(vcf_file);
+  }
+
+  // Write the genotypes in columnar format to the files <prefix>.<chunk index>.cols.bgz, each of which contains LOCI_PER_CHUNK loci
+  void set_output_str_columns(const std::string& prefix, int loci_per_chunk, std::set<std::string>& samples_to_output){
+    output_str_columns_ = true;
+    select_output_samples(samples_to_output);
+    delete str_columns_;
+    str_columns_ = new ColumnarWriter(prefix, samples_to_genotype_, loci_per_chunk);
   }
 
   void analyze_reads_and_phasing(std::vector<BamAlnList>& alignments,
 				 std::vector< std::vector<double> >& log_p1s,
 				 std::vector< std::vector<double> >& log_p2s,
-				 std::vector<std::string>& rg_names, RegionGroup& region, std::string& chrom_seq);
+				 std::vector<std::string>& rg_names, RegionGroup& region, const ReferenceSequence& chrom_seq);
   void finish(){
     SNPBamProcessor::finish();
     if (output_str_gts_)
       str_vcf_.close();
+    if (output_str_columns_ && str_columns_ != NULL){
+      str_columns_->close();
+      log("Wrote the columnar genotypes for the loci to " + std::to_string(str_columns_->num_chunks()) + " chunk files");
+    }
     if (output_stutter_models_)
       stutter_model_out_.close();
+    if (output_stutter_table_){
+      StutterModelTable::write(stutter_table_builder_, stutter_table_file_);
+      log("Wrote " + std::to_string(stutter_table_builder_.size()) + " stutter models to the binary table " + stutter_table_file_);
+    }
     if (output_viz_)
       viz_out_.close();
+    if (output_locus_stats_)
+      locus_stats_out_.close();
+    if (output_skip_list_)
+      skip_list_out_.close();
+    if (output_batch_summary_)
+      batch_summary_out_.close();
+    if (!log_run_summary_){
+      if (stutter_db_)
+	stutter_db_->save();
+      return;
+    }
 
     log("\n\n\n------HipSTR Execution Summary------");
     if (too_many_reads_ != 0)
       log("Skipped " + std::to_string(too_many_reads_) + " loci with too many reads.\n\t If this comprises a sizeable portion of your loci, see the --max-reads command line option\n");
     if (too_few_reads_ != 0)
       log("Skipped " + std::to_string(too_few_reads_)  + " loci with too few reads for stutter model model training or genotyping.\n\t If this comprises a sizeable portion of your loci, see the --min-reads command line option\n");
+    if (over_mem_budget_ != 0)
+      log("Skipped " + std::to_string(over_mem_budget_) + " loci whose stutter training or genotyping would exceed the per-locus memory budget.\n\t If this comprises a sizeable portion of your loci, see the --max-locus-mem command line option\n");
+    if (num_skip_listed_ != 0)
+      log("Skipped " + std::to_string(num_skip_listed_) + " regions that overlapped a locus in the file provided to --skip-list\n");
+    if (output_skip_list_)
+      log("Wrote " + std::to_string(num_skip_list_loci_) + " slow or failed loci to the skip list " + skip_list_file_ + "\n");
+    if (num_failed_loci_ != 0)
+      log("Skipped " + std::to_string(num_failed_loci_) + " region groups whose analysis encountered an error. See the log for each group's error message\n");
+    if (num_timed_out_loci_ != 0)
+      log("Skipped " + std::to_string(num_timed_out_loci_) + " region groups whose analysis exceeded the time limit.\n\t If this comprises a sizeable portion of your loci, see the --locus-timeout command line option\n");
     if (num_missing_models_ != 0)
       log("Skipped " + std::to_string(num_missing_models_) + " loci that did not have a stutter model in the file provided to --stutter-in\n");
     if (num_em_converge_+num_em_fail_ != 0)
       log("Stutter model training succeeded for " + std::to_string(num_em_converge_) + " out of " + std::to_string(num_em_converge_+num_em_fail_) + " loci");
+    if (stutter_db_){
+      log("Reused " + std::to_string(num_stutter_db_reused_) + " and warm-started the training of " + std::to_string(num_stutter_db_warm_starts_)
+	  + " stutter models using the stutter model database");
+      stutter_db_->save();
+      log("Saved " + std::to_string(stutter_db_->num_updates()) + " newly trained models to the stutter model database");
+    }
+    if (stutter_train_reads_ > 0 && num_em_converge_+num_em_fail_ != 0)
+      log("Trained the stutter models of " + std::to_string(num_subsampled_stutter_loci_) + " loci on subsamples of at most "
+	  + std::to_string(stutter_train_reads_) + " of their informative reads");
+    if (accelerate_em_ && num_em_converge_+num_em_fail_ != 0)
+      log("Accelerated stutter model training required a total of " + std::to_string(num_em_iter_) + " EM iterations, including "
+	  + std::to_string(num_em_extrapolations_) + " accepted SQUAREM extrapolations");
+    if (HugePages::enabled())
+      log(HugePages::usage_summary());
     log("Genotyping succeeded for " + std::to_string(num_genotype_success_) + " out of " + std::to_string(num_genotype_success_+num_genotype_fail_) + " loci");
-
-    logger() << "\nApproximate timing breakdown" << "\n"
-             << " BAM seek time       = " << total_bam_seek_time()       << " seconds\n"
-             << " Read filtering      = " << total_read_filter_time()    << " seconds\n"
-             << " SNP info extraction = " << total_snp_phase_info_time() << " seconds\n"
-             << " Stutter estimation  = " << total_stutter_time()        << " seconds\n"
-             << " Genotyping          = " << total_genotype_time()       << " seconds\n";
-    if (output_str_gts_)
-      logger() << "\t" << " Left alignment        = "  << process_timer_.get_total_time("Left alignment")        << " seconds\n"
-               << "\t" << " Haplotype generation  = "  << process_timer_.get_total_time("Haplotype generation")  << " seconds\n"
-               << "\t" << " Haplotype alignment   = "  << process_timer_.get_total_time("Haplotype alignment")   << " seconds\n"
-	       << "\t" << " Flank assembly        = "  << process_timer_.get_total_time("Flank assembly")        << " seconds\n"
-	       << "\t" << " Posterior computation = "  << process_timer_.get_total_time("Posterior computation") << " seconds\n"
-               << "\t" << " Alignment traceback   = "  << process_timer_.get_total_time("Alignment traceback")   << " seconds\n";
+    if (length_fast_path_)
+      log(std::to_string(num_length_only_loci_) + " loci were genotyped from the lengths of the reads' repeats, as their flanks didn't vary");
+    if (min_flank_var_frac_ > 0)
+      log("Flank reassembly was skipped at " + std::to_string(num_assembly_skipped_loci_) + " loci, as no sample's reads had enough flank variation");
+    if (incremental_)
+      log("The new samples' reads supported alleles missing from the reference VCF at " + std::to_string(num_novel_allele_loci_)
+	  + " loci, which are flagged by the NOVELBPDIFFS INFO field.\n\t These loci require a joint run with all of the samples to genotype the new alleles");
+
+    if (io_only_){
+      logger() << "\n";
+      io_stats_.print(total_timer_, ProcessTimer::wall_clock() - io_start_time_, phasing_with_snps(), 10, logger());
+    }
+
+    logger() << "\nApproximate timing breakdown" << "\n";
+    total_timer_.print(logger());
+    PerfCounters::print(logger());
   }
 
   // EM parameters for length-based stutter learning
@@ -254,6 +701,7 @@ public:
   double ABS_LL_CONVERGE;  // For EM convergence, new_LL - prev_LL < ABS_LL_CONVERGE
   double FRAC_LL_CONVERGE; // For EM convergence, -(new_LL-prev_LL)/prev_LL < FRAC_LL_CONVERGE
   int32_t MIN_TOTAL_READS; // Minimum total reads required to genotype locus
+  int64_t MAX_LOCUS_BYTES; // If positive, skip loci whose stutter training or genotyping would require more memory than this
 };
 
 #endif
@@ -0,0 +1,205 @@
+#include "genotyping_service.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <sstream>
+
+#include "error.h"
+#include "stringops.h"
+
+bool ServiceRequest::parse(const std::string& text, std::string& error){
+  std::istringstream input(text);
+  std::string line;
+  while (std::getline(input, line)){
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty())
+      continue;
+    std::istringstream fields(line);
+    std::string keyword, values;
+    fields >> keyword >> values;
+
+    if (keyword.compare("shutdown") == 0)
+      shutdown = true;
+    else if (keyword.compare("bams") == 0)
+      split_by_delim(values, ',', bam_files);
+    else if (keyword.compare("regions") == 0){
+      std::vector<std::string> region_strs;
+      split_by_delim(values, ',', region_strs);
+      for (auto region_iter = region_strs.begin(); region_iter != region_strs.end(); region_iter++){
+	std::string chrom;
+	int32_t start, end;
+	if (!parseRegionString(*region_iter, chrom, start, end)){
+	  error = "Invalid region " + *region_iter + ". Regions must be formatted as CHROM:START-END";
+	  return false;
+	}
+	intervals.push_back(Region(chrom, start, end, 1));
+      }
+    }
+    else {
+      error = "Unrecognized request line: " + line;
+      return false;
+    }
+  }
+  if (bam_files.empty() && !shutdown){
+    error = "The request doesn't contain any BAM files";
+    return false;
+  }
+  return true;
+}
+
+void ServiceRequest::select_regions(const std::vector<Region>& regions, std::vector<Region>& selected) const {
+  selected.clear();
+  for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++){
+    bool overlaps = intervals.empty();
+    for (auto interval_iter = intervals.begin(); !overlaps && interval_iter != intervals.end(); interval_iter++)
+      overlaps = (region_iter->chrom().compare(interval_iter->chrom()) == 0 && region_iter->start() < interval_iter->stop() && region_iter->stop() > interval_iter->start());
+    if (overlaps)
+      selected.push_back(*region_iter);
+  }
+}
+
+GenotypingService::GenotypingService(const std::string& socket_path, int request_timeout){
+  socket_path_     = socket_path;
+  request_timeout_ = request_timeout;
+  struct sockaddr_un address;
+  if (socket_path_.size() >= sizeof(address.sun_path))
+    printErrorAndDie("Path for the --serve socket is too long: " + socket_path_);
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path_.c_str());
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0)
+    printErrorAndDie("Failed to create the socket for the genotyping service: " + std::string(strerror(errno)));
+  unlink(socket_path_.c_str());
+  if (bind(listen_fd_, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd_, 16) != 0)
+    printErrorAndDie("Failed to listen on the socket " + socket_path_ + ": " + std::string(strerror(errno)));
+
+  // A client that disconnects early mustn't terminate the service when its response is written
+  signal(SIGPIPE, SIG_IGN);
+}
+
+GenotypingService::~GenotypingService(){
+  close(listen_fd_);
+  unlink(socket_path_.c_str());
+}
+
+bool GenotypingService::read_request(int fd, std::string& text, std::string& error){
+  char buffer[4096];
+  text.clear();
+  size_t search_start = 0;
+  std::string timeout_msg = "Timed out after " + std::to_string(request_timeout_) + " seconds waiting for the complete request";
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(request_timeout_);
+  while (text.find("\n\n", search_start) == std::string::npos){
+    search_start = (text.empty() ? 0 : text.size()-1);
+
+    // Limit each read to the time remaining, so that a client that stalls or trickles its request can't block the service
+    int64_t remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0){
+      error = timeout_msg;
+      return false;
+    }
+    struct timeval timeout;
+    timeout.tv_sec  = remaining/1000000;
+    timeout.tv_usec = remaining%1000000;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0){
+      error = "Failed to set the timeout for reading the request: " + std::string(strerror(errno));
+      return false;
+    }
+
+    ssize_t num_read = read(fd, buffer, sizeof(buffer));
+    if (num_read < 0 && errno == EINTR)
+      continue;
+    if (num_read < 0){
+      error = ((errno == EAGAIN || errno == EWOULDBLOCK) ? timeout_msg : "Failed to read the request: " + std::string(strerror(errno)));
+      return false;
+    }
+    if (num_read == 0)
+      break;
+    text.append(buffer, num_read);
+    if (text.size() > MAX_REQUEST_BYTES){
+      error = "The request exceeds the maximum size of " + std::to_string(MAX_REQUEST_BYTES) + " bytes";
+      return false;
+    }
+  }
+  return true;
+}
+
+int GenotypingService::handle_request(int fd, ServiceRequest& request, std::function<int(ServiceRequest&)>& handler){
+  std::cout.flush();
+  std::cerr.flush();
+  fflush(NULL);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0){
+    close(listen_fd_);
+    if (dup2(fd, STDOUT_FILENO) < 0)
+      _exit(1);
+    close(fd);
+    int status = handler(request);
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(NULL);
+    _exit(status);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return -1;
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return -1;
+}
+
+void GenotypingService::run(std::function<int(ServiceRequest&)> handler, std::ostream& logger){
+  logger << "Listening for genotyping requests on " << socket_path_ << std::endl;
+  int num_requests = 0, num_failed = 0;
+  bool shutdown = false;
+  while (!shutdown){
+    int fd = accept(listen_fd_, NULL, NULL);
+    if (fd < 0){
+      if (errno == EINTR)
+	continue;
+      printErrorAndDie("Failed to accept a connection on the socket " + socket_path_ + ": " + std::string(strerror(errno)));
+    }
+
+    std::string text, error;
+    ServiceRequest request;
+    int status = 1;
+    if (read_request(fd, text, error) && request.parse(text, error)){
+      shutdown = request.shutdown;
+      if (!request.bam_files.empty()){
+	logger << "Genotyping request " << num_requests+1 << " for " << request.bam_files.size() << " BAM files and "
+	       << (request.intervals.empty() ? "all" : std::to_string(request.intervals.size())) << " region(s)" << std::endl;
+	status = handle_request(fd, request, handler);
+	if (status != 0)
+	  error = "Genotyping failed with exit status " + std::to_string(status) + ". See the service's log for details";
+	num_requests++;
+      }
+    }
+
+    if (!error.empty()){
+      logger << "Request failed: " << error << std::endl;
+      std::string message = "ERROR: " + error + "\n";
+      ssize_t num_written = write(fd, message.c_str(), message.size());
+      (void)num_written;
+      num_failed++;
+    }
+    close(fd);
+  }
+  logger << "Genotyping service shutting down after handling " << num_requests << " requests (" << num_failed << " failed)" << std::endl;
+}
@@ -0,0 +1,68 @@
+#ifndef GENOTYPING_SERVICE_H_
+#define GENOTYPING_SERVICE_H_
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "region.h"
+
+/*
+ * Request received by the genotyping service, in which each line contains a keyword and its comma-separated values:
+ *   bams     a.bam,b.cram        BAM/CRAM files to genotype (required)
+ *   regions  chr1:1000-2000,...  1-based inclusive intervals whose loci are genotyped (Default = all loci)
+ *   shutdown                     Stop the service once the current request has been handled
+ * The request ends with an empty line or when the client closes its end of the connection for writing
+ */
+class ServiceRequest {
+ public:
+  std::vector<std::string> bam_files;
+  std::vector<Region> intervals;
+  bool shutdown;
+
+  ServiceRequest(){
+    shutdown = false;
+  }
+
+  // Parse the request from the lines in TEXT. Returns false and stores the reason in ERROR if it's malformed
+  bool parse(const std::string& text, std::string& error);
+
+  // Store the catalog's sorted regions that overlap the requested intervals in SELECTED, or all of them if none were requested
+  void select_regions(const std::vector<Region>& regions, std::vector<Region>& selected) const;
+};
+
+/*
+ * Service that genotypes the BAMs in each request received over a Unix domain socket using the state loaded by the listening process,
+ * such as the region catalog, reference sequences and stutter models, so that it isn't reloaded for each set of BAMs.
+ * Each request is handled by a forked child process whose stdout is the connection, which therefore receives the output VCF.
+ * The children share the parent's resident state copy-on-write and can't alter it for subsequent requests, and a request that
+ * fails (e.g. due to a missing BAM) only terminates its child. Requests are handled one at a time in the order they're received,
+ * so a client that doesn't send its complete request within the timeout receives an error rather than blocking the others
+ */
+class GenotypingService {
+ private:
+  static const size_t MAX_REQUEST_BYTES = 16*1048576;
+
+  std::string socket_path_;
+  int listen_fd_;
+  int request_timeout_; // Seconds allowed for receiving each request
+
+  // Read the request's text from the connection until an empty line or the end of the stream. Returns false and stores
+  // the reason in ERROR if it can't be read, isn't received within the request timeout or exceeds MAX_REQUEST_BYTES
+  bool read_request(int fd, std::string& text, std::string& error);
+
+  // Fork a child that writes the output of HANDLER to the connection, and return the child's exit status
+  int handle_request(int fd, ServiceRequest& request, std::function<int(ServiceRequest&)>& handler);
+
+ public:
+  static const int DEFAULT_REQUEST_TIMEOUT = 10;
+
+  explicit GenotypingService(const std::string& socket_path, int request_timeout = DEFAULT_REQUEST_TIMEOUT);
+  ~GenotypingService();
+
+  // Handle requests until a shutdown request is received. HANDLER genotypes a request, writing the VCF to stdout, and returns its exit status
+  void run(std::function<int(ServiceRequest&)> handler, std::ostream& logger);
+};
+
+#endif
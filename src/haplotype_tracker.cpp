@@ -7,58 +7,50 @@ std::ostream& operator<< (std::ostream &out, DiploidEditDistance& edit_distance)
 }
 
 void DiploidHaplotype::add_snp(int gt_a, int gt_b){
-  assert(snps_1_.size() > 0 && snps_2_.size() > 0);
-  if (gt_a == 1) snps_1_.back() |= set_mask_;
-  if (gt_b == 1) snps_2_.back() |= set_mask_;
-  
-  set_mask_ <<= 1;
-  if (set_mask_ == MAX_DIGIT){
+  if (end_bit_ == (int64_t)(snps_1_.size() - head_)*WORD_BITS){
     snps_1_.push_back(0);
     snps_2_.push_back(0);
-    set_mask_ = 1;
-  }
-}
-
-void DiploidHaplotype::extract_set_bits(int64_t value, int offset, std::set<int>& mismatch_indices){
-  while (value){
-    if (value & 1)
-      mismatch_indices.insert(offset);
-    value >>= 1;
-    offset++;
   }
+  uint64_t set_mask = 1ULL << (end_bit_ % WORD_BITS);
+  if (gt_a == 1) snps_1_.back() |= set_mask;
+  if (gt_b == 1) snps_2_.back() |= set_mask;
+  end_bit_++;
 }
 
-void DiploidHaplotype::add_mismatched_sites(int hap_index, DiploidHaplotype& other_hap, int other_index,
-					    std::set<int>& mismatch_indices){
+void DiploidHaplotype::add_mismatched_sites(int hap_index, const DiploidHaplotype& other_hap, int other_index,
+					    std::set<int>& mismatch_indices) const {
   assert((hap_index == 0 || hap_index == 1) && (other_index == 0 || other_index == 1));
-  std::deque<int64_t>& hap_a = (hap_index == 0 ? snps_1_ : snps_2_);
-  std::deque<int64_t>& hap_b = (other_index == 0 ? other_hap.snps_1_ : other_hap.snps_2_);
-  assert(hap_a.size() == hap_b.size());
-  auto iter_a = hap_a.begin();
-  auto iter_b = hap_b.begin();
-
-  int offset = -num_removed_;
-  while (iter_a != hap_a.end()){
-    int64_t set_bits = (*iter_a)^(*iter_b);
-    if (set_bits)
-      extract_set_bits(set_bits, offset, mismatch_indices);
-    offset += 63;
-    iter_a++; iter_b++;
+  const std::vector<uint64_t>& hap_a = (hap_index == 0 ? snps_1_ : snps_2_);
+  const std::vector<uint64_t>& hap_b = (other_index == 0 ? other_hap.snps_1_ : other_hap.snps_2_);
+  assert(hap_a.size() - head_ == hap_b.size() - other_hap.head_);
+
+  int64_t offset = -begin_bit_;
+  for (size_t i = head_, j = other_hap.head_; i < hap_a.size(); i++, j++, offset += WORD_BITS){
+    uint64_t set_bits = hap_a[i] ^ hap_b[j];
+    while (set_bits){
+      mismatch_indices.insert(offset + __builtin_ctzll(set_bits));
+      set_bits &= set_bits-1;
+    }
   }
 }
 
 void DiploidHaplotype::remove_next_snp(){
-  assert(snps_1_.size() > 0 && snps_2_.size() > 0);
-  snps_1_.front() &= erase_mask_;
-  snps_2_.front() &= erase_mask_;
-  erase_mask_ <<= 1;
-  num_removed_++;
-  if (erase_mask_ == 0){
-    snps_1_.pop_front();
-    snps_2_.pop_front();
-    erase_mask_  = -2;
-    num_removed_ = 0;
-  } 
+  assert(begin_bit_ < end_bit_);
+  uint64_t erase_mask = ~(1ULL << (begin_bit_ % WORD_BITS));
+  snps_1_[head_] &= erase_mask;
+  snps_2_[head_] &= erase_mask;
+  if (++begin_bit_ < WORD_BITS)
+    return;
+
+  // Retire the first word, and compact the arrays once most of their words have been retired
+  head_++;
+  begin_bit_ -= WORD_BITS;
+  end_bit_   -= WORD_BITS;
+  if (head_ >= MIN_COMPACT_WORDS && 2*head_ >= snps_1_.size()){
+    snps_1_.erase(snps_1_.begin(), snps_1_.begin()+head_);
+    snps_2_.erase(snps_2_.begin(), snps_2_.begin()+head_);
+    head_ = 0;
+  }
 }
 
 void HaplotypeTracker::add_snp(VCF::Variant& variant){
@@ -88,6 +80,20 @@ void HaplotypeTracker::add_snp(VCF::Variant& variant){
   }
 }
 
+void HaplotypeTracker::read_snps(int32_t end, std::set<std::string>& sites_to_skip){
+  VCF::Variant snp_variant;
+  while (last_snp_position() < end && snp_vcf_.get_next_variant(snp_variant)){
+    if (!sites_to_skip.empty()){
+      std::string key = snp_variant.get_chromosome() + ":" + std::to_string(snp_variant.get_position());
+      if (sites_to_skip.find(key) != sites_to_skip.end())
+	continue;
+    }
+    add_snp(snp_variant);
+    if (listener_ != NULL)
+      listener_->add_snp(snp_variant);
+  }
+}
+
 void HaplotypeTracker::advance(std::string chrom, int32_t position, std::set<std::string>& sites_to_skip, std::ostream& logger){
   logger << "Advancing haplotype tracker";
   int32_t start_of_window = (position >= window_size_ ? position - window_size_ : 0);
@@ -111,13 +117,7 @@ void HaplotypeTracker::advance(std::string chrom, int32_t position, std::set<std
   prev_window_end_   = end_of_window;
 
   // Incorporate new SNPs within the window
-  VCF::Variant snp_variant;
-  while (last_snp_position() < end_of_window && snp_vcf_.get_next_variant(snp_variant)){
-    std::string key = snp_variant.get_chromosome() + ":" + std::to_string(snp_variant.get_position());
-    if (sites_to_skip.find(key) != sites_to_skip.end())
-      continue;
-    add_snp(snp_variant);
-  }
+  read_snps(end_of_window, sites_to_skip);
 
   // Remove SNPs to left of window
   while (next_snp_position() < start_of_window && next_snp_position() != -1)
@@ -138,19 +138,21 @@ void HaplotypeTracker::advance(std::string chrom, int32_t position, std::set<std
 bool HaplotypeTracker::infer_haplotype_inheritance(const NuclearFamily& family, int max_best_score, int min_second_best_score,
 						   std::vector<int>& maternal_indices, std::vector<int>& paternal_indices, std::set<int32_t>& bad_sites){
   assert(maternal_indices.size() == 0 && paternal_indices.size() == 0);
-  DiploidHaplotype& mat_haplotypes = snp_haplotypes_[sample_indices_[family.get_mother()]];
-  DiploidHaplotype& pat_haplotypes = snp_haplotypes_[sample_indices_[family.get_father()]];
+  int mother_index = sample_indices_[family.get_mother()], father_index = sample_indices_[family.get_father()];
+  DiploidHaplotype& mat_haplotypes = snp_haplotypes_[mother_index];
+  DiploidHaplotype& pat_haplotypes = snp_haplotypes_[father_index];
   std::set<int> mismatch_indices;
 
   for (auto child_iter = family.get_children().begin(); child_iter != family.get_children().end(); child_iter++){
-    DiploidEditDistance maternal_distance = edit_distances(*child_iter, family.get_mother());
+    int child_index = sample_indices_[*child_iter];
+    DiploidEditDistance maternal_distance = edit_distances(child_index, mother_index);
     int min_mat_dist, min_mat_index, second_mat_dist, second_mat_index;
     maternal_distance.min_distance(min_mat_dist, min_mat_index);
     maternal_distance.second_min_distance(second_mat_dist, second_mat_index);
     if (min_mat_dist > max_best_score || second_mat_dist < min_second_best_score)
       return false;
 
-    DiploidEditDistance paternal_distance = edit_distances(*child_iter, family.get_father());
+    DiploidEditDistance paternal_distance = edit_distances(child_index, father_index);
     int min_pat_dist, min_pat_index, second_pat_dist, second_pat_index;
     paternal_distance.min_distance(min_pat_dist, min_pat_index);
     paternal_distance.second_min_distance(second_pat_dist, second_pat_index);
@@ -168,7 +170,7 @@ bool HaplotypeTracker::infer_haplotype_inheritance(const NuclearFamily& family,
 
     // Identify the indices of sites that are inconsistent with the inheritance structure
     // Only identifies sites that are Mendelian and have no missing genotypes
-    DiploidHaplotype& child_haplotypes = snp_haplotypes_[sample_indices_[*child_iter]];
+    DiploidHaplotype& child_haplotypes = snp_haplotypes_[child_index];
     int idx_a = (min_mat_index == 0 || min_mat_index == 1 ? 0 : 1);
     int idx_b = (min_mat_index == 0 || min_mat_index == 2 ? 0 : 1);
     child_haplotypes.add_mismatched_sites(idx_a, mat_haplotypes, idx_b, mismatch_indices);
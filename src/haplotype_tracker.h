@@ -2,10 +2,12 @@
 #define HAPLOTYPE_TRACKER_H_
 
 #include <climits>
+#include <stdint.h>
 #include <deque>
 #include <iostream>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "vcf_reader.h"
@@ -60,51 +62,47 @@ class DiploidEditDistance {
   friend std::ostream& operator<< (std::ostream &out, DiploidEditDistance& distances);
 };
 
+/*
+ * Phased SNP haplotypes for a sample, with one bit per SNP in the tracker's window. Each haplotype is stored as a contiguous
+ * array of 64-bit words, where the bits before BEGIN_BIT_ in the first live word belong to SNPs that have left the window
+ * and are always zero. Words are retired from the front as the window advances and the array is compacted once the retired
+ * words dominate it. All haplotypes in a tracker add and remove the same SNPs, so their words are aligned, and edit
+ * distances reduce to hardware popcounts of the XOR of the corresponding words
+ */
 class DiploidHaplotype {
  private:
-  std::deque<int64_t> snps_1_, snps_2_;
-  int64_t erase_mask_, set_mask_;
-  int num_removed_;
-  const static int64_t MAX_DIGIT = (1ULL << 63);
-
-  int num_set_bits(int64_t value){
-    int count = 0;
-    while (value != 0){
-      value &= (value-1);
-      count++;
-    }
-    return count;
-  }
-
-  int edit_distance(std::deque<int64_t>& snp_hap_1, std::deque<int64_t>& snp_hap_2){
-    int distance = 0;
-    assert(snp_hap_1.size() == snp_hap_2.size());
-    auto iter_a = snp_hap_1.begin();
-    auto iter_b = snp_hap_2.begin();
-    while (iter_a != snp_hap_1.end()){
-      distance += num_set_bits((*iter_a) ^ (*iter_b));
-      iter_a++; iter_b++;
-    }
-    return distance;
-  }
-
-  void extract_set_bits(int64_t value, int offset, std::set<int>& mismatch_indices);
+  std::vector<uint64_t> snps_1_, snps_2_;
+  size_t head_;       // Index of the first live word
+  int64_t begin_bit_; // Offset of the first SNP in the window, relative to the first live word
+  int64_t end_bit_;   // Offset one past the last SNP in the window, relative to the first live word
+  const static int WORD_BITS            = 64;
+  const static size_t MIN_COMPACT_WORDS = 1024;
 
  public:  
   DiploidHaplotype(){
     reset();
   }
 
-  DiploidEditDistance edit_distances(DiploidHaplotype& other_hap){
-    int d11 = edit_distance(snps_1_, other_hap.snps_1_);
-    int d12 = edit_distance(snps_1_, other_hap.snps_2_);
-    int d21 = edit_distance(snps_2_, other_hap.snps_1_);
-    int d22 = edit_distance(snps_2_, other_hap.snps_2_);
+  DiploidEditDistance edit_distances(const DiploidHaplotype& other_hap) const {
+    assert(snps_1_.size() - head_ == other_hap.snps_1_.size() - other_hap.head_);
+    const uint64_t* a_1 = snps_1_.data() + head_;
+    const uint64_t* a_2 = snps_2_.data() + head_;
+    const uint64_t* b_1 = other_hap.snps_1_.data() + other_hap.head_;
+    const uint64_t* b_2 = other_hap.snps_2_.data() + other_hap.head_;
+    size_t num_words    = snps_1_.size() - head_;
+    int d11 = 0, d12 = 0, d21 = 0, d22 = 0;
+    for (size_t i = 0; i < num_words; i++){
+      d11 += __builtin_popcountll(a_1[i] ^ b_1[i]);
+      d12 += __builtin_popcountll(a_1[i] ^ b_2[i]);
+      d21 += __builtin_popcountll(a_2[i] ^ b_1[i]);
+      d22 += __builtin_popcountll(a_2[i] ^ b_2[i]);
+    }
     return DiploidEditDistance(d11, d12, d21, d22);
   }
 
-  void add_mismatched_sites(int hap_index, DiploidHaplotype& other_hap, int other_index,
-			    std::set<int>& mismatch_indices);
+  /* Adds the window index of each SNP that differs between the two haplotypes to MISMATCH_INDICES */
+  void add_mismatched_sites(int hap_index, const DiploidHaplotype& other_hap, int other_index,
+			    std::set<int>& mismatch_indices) const;
 
   void add_snp(int gt_a, int gt_b);
 
@@ -113,27 +111,37 @@ class DiploidHaplotype {
   void reset(){
     snps_1_.clear();
     snps_2_.clear();
-    snps_1_.push_back(0);
-    snps_2_.push_back(0);
-    erase_mask_  = -2;
-    set_mask_    = 1;
-    num_removed_ = 0;
+    head_      = 0;
+    begin_bit_ = 0;
+    end_bit_   = 0;
   }
 };
 
+/* Receives each SNP decoded by a HaplotypeTracker, so that other consumers can share the tracker's pass through the SNP VCF */
+class SNPListener {
+ public:
+  virtual ~SNPListener(){}
+
+  /* Invoked whenever the tracker discards its SNPs and restarts its window */
+  virtual void reset_snps() = 0;
+
+  virtual void add_snp(VCF::Variant& variant) = 0;
+};
+
 class HaplotypeTracker {
  private:
   std::string chrom_;
   std::vector<NuclearFamily> families_;
   std::vector<std::string> samples_;
   std::vector<int> vcf_indices_;
-  std::map<std::string, int> sample_indices_;
+  std::unordered_map<std::string, int> sample_indices_;
   std::vector<DiploidHaplotype> snp_haplotypes_;
   VCF::VCFReader snp_vcf_;
   int32_t window_size_;
   int32_t num_snps_;
   std::deque<int32_t> positions_;
   int32_t prev_window_start_, prev_window_end_;
+  SNPListener* listener_;
 
   int32_t next_snp_position(){
     if (num_snps_ == 0)
@@ -157,6 +165,8 @@ class HaplotypeTracker {
   }
 
   void reset(){
+    if (listener_ != NULL)
+      listener_->reset_snps();
     num_snps_  = 0;
     positions_ =  std::deque<int32_t>();
     prev_window_start_ = -1;
@@ -167,14 +177,28 @@ class HaplotypeTracker {
 
   void add_snp(VCF::Variant& variant);
 
+  /* Decodes SNPs until one after END is encountered or the VCF is exhausted */
+  void read_snps(int32_t end, std::set<std::string>& sites_to_skip);
+
  public:
- HaplotypeTracker(std::vector<NuclearFamily>& families, std::string& snp_vcf_file, int32_t window_size):
+  /*
+   * Tracks the haplotypes of the families' members using the phased SNPs in SNP_VCF_FILE. Only the genotypes for the
+   * family members and any EXTRA_SAMPLES are decoded, where the latter are only required by an SNPListener
+   */
+ HaplotypeTracker(std::vector<NuclearFamily>& families, std::string& snp_vcf_file, int32_t window_size,
+		  const std::set<std::string>& extra_samples = std::set<std::string>()):
   snp_vcf_(snp_vcf_file){
     chrom_       = "";
     families_    = families;
     window_size_ = window_size;
     samples_     = std::vector<std::string>();
     vcf_indices_ = std::vector<int>();
+    listener_    = NULL;
+
+    // Only decode the genotypes for the samples that are required
+    std::set<std::string> required_samples(extra_samples);
+    get_family_samples(families_, required_samples);
+    snp_vcf_.restrict_samples(required_samples);
     for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++){
       family_iter->load_vcf_indices(snp_vcf_);
       samples_.insert(samples_.end(),  family_iter->get_samples().begin(),  family_iter->get_samples().end());
@@ -199,9 +223,22 @@ class HaplotypeTracker {
 
   int32_t num_stored_snps() { return num_snps_; }
 
-  DiploidEditDistance edit_distances(const std::string& sample_1, const std::string& sample_2){
-    int index_1 = sample_indices_[sample_1];
-    int index_2 = sample_indices_[sample_2];
+  /* The reader through which the tracker decodes its SNPs, whose sample indices apply to the variants passed to its listener */
+  VCF::VCFReader& snp_vcf() { return snp_vcf_; }
+
+  /* Passes every subsequently decoded SNP to LISTENER, which must not outlive the tracker */
+  void set_listener(SNPListener* listener){ listener_ = listener; }
+
+  /*
+   * Extends the window past END, for listeners whose windows extend beyond the tracker's. Must follow a call
+   * to advance() for the same chromosome
+   */
+  void extend_window(int32_t end){
+    std::set<std::string> sites_to_skip;
+    read_snps(end+1, sites_to_skip);
+  }
+
+  DiploidEditDistance edit_distances(int index_1, int index_2){
     return snp_haplotypes_[index_1].edit_distances(snp_haplotypes_[index_2]);
   }
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <climits>
 #include <fstream>
 #include <getopt.h>
@@ -8,14 +9,22 @@
 #include <vector>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "bam_io.h"
 #include "error.h"
 #include "genotyper_bam_processor.h"
+#include "genotyping_service.h"
 #include "pedigree.h"
+#include "region_catalog.h"
+#include "sampling_profiler.h"
 #include "stringops.h"
+#include "trace_recorder.h"
 #include "vcf_reader.h"
 #include "version.h"
+#include "SeqAlignment/AlignmentKernels.h"
+#include "SeqAlignment/AlignmentModel.h"
+#include "SeqAlignment/HugePageAllocator.h"
 
 bool file_exists(std::string path){
   return (access(path.c_str(), F_OK) != -1);
@@ -26,28 +35,95 @@ void print_usage(int def_mdist, int def_min_reads, int def_max_reads, int def_ma
     
 	    << "Required parameters:" << "\n"
 	    << "\t" << "--bams          <list_of_bams>        "  << "\t" << "Comma separated list of BAM files. Either --bams or --bam-files must be specified"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " A file named - is a coordinate-sorted BAM/CRAM read from stdin without an index"  << "\n"
 	    << "\t" << "--fasta         <dir>                 "  << "\t" << "Directory with FASTA files for each chromosome or the path to a"                     << "\n"
 	    << "\t" << "                                      "  << "\t" << " single FASTA file that contains all of the relevant sequences"                      << "\n"
 	    << "\t" << "--regions       <region_file.bed>     "  << "\t" << "BED file containing coordinates for each STR region"                                 << "\n"
-	    << "\t" << "--str-vcf       <str_gts.vcf.gz>      "  << "\t" << "Bgzipped VCF file to which STR genotypes will be written"                            << "\n" << "\n"
+	    << "\t" << "--str-vcf       <str_gts.vcf.gz>      "  << "\t" << "Bgzipped VCF file to which STR genotypes will be written. If the path"              << "\n"
+	    << "\t" << "                                      "  << "\t" << " ends in .bcf, the genotypes are instead written in BCF format"                      << "\n" << "\n"
 
 	    << "Optional input parameters:" << "\n"
 	    << "\t" << "--bam-files  <bam_files.txt>          "  << "\t" << "File containing BAM files to analyze, one per line "                                 << "\n"
 	    << "\t" << "--ref-vcf    <str_ref_panel.vcf.gz>   "  << "\t" << "Bgzipped input VCF file of a reference panel of STR genotypes. VCF alleles will be"  << "\n"
 	    << "\t" << "                                      "  << "\t" << " used as candidate variants instead of looking for candidates in the BAMs (Default)" << "\n"
+	    << "\t" << "--ref-vcf-index <ref_alleles.rai>     "  << "\t" << "Memory-map the --ref-vcf alleles from this binary index rather than querying the"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " VCF for each locus, which decodes every panel sample. Generated if it doesn't exist" << "\n"
 	    << "\t" << "--snp-vcf    <phased_snps.vcf.gz>     "  << "\t" << "Bgzipped input VCF file containing phased SNP genotypes for the samples"             << "\n" 
 	    << "\t" << "                                      "  << "\t" << " to be genotyped. These SNPs will be used to physically phase STRs "                 << "\n"
-	    << "\t" << "--stutter-in <stutter_models.txt>     "  << "\t" << "Use stutter models in the file to genotype STRs (Default = Learn via EM algorithm)"  << "\n" << "\n"
+	    << "\t" << "--snp-vcf-panel <phased_snps.hpan>   "  << "\t" << "Memory-map the --snp-vcf genotypes from this bit-packed binary panel rather than"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " decoding the VCF records for each locus. Generated if it doesn't exist"             << "\n"
+	    << "\t" << "--stutter-in <stutter_models.txt>     "  << "\t" << "Use stutter models in the file to genotype STRs (Default = Learn via EM algorithm)"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " The file is either a text file or a binary table written by --stutter-bin-out"     << "\n"
+	    << "\t" << "--stutter-db <stutter_db.txt>         "  << "\t" << "Database of the stutter models learned by previous runs, keyed by each locus'"       << "\n"
+	    << "\t" << "                                      "  << "\t" << " coordinates and repeat motif. A locus' entry warm-starts its EM training, and"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " the database is updated with the models trained by this run (created if needed)"   << "\n"
+	    << "\t" << "--reuse-stutter <min_reads>           "  << "\t" << "Skip stutter training for loci whose --stutter-db model was trained with at least"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " this many informative reads, and genotype them using that model instead"           << "\n"
+	    << "\t" << "--incremental                         "  << "\t" << "Genotype new samples against a prior HipSTR call set provided to --ref-vcf, using"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " its alleles, allele frequencies (as priors) and the --stutter-in models. Alleles"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " supported by the new samples but missing from the call set are flagged"           << "\n"
+	    << "\t" << "--packed-ref <ref.packed>             "  << "\t" << "Memory-map reference sequences from this 2-bit packed reference file rather than"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " reading them from the FASTA file(s). Generated from --fasta if it doesn't exist"    << "\n"
+	    << "\t" << "--region-catalog <regions.rcat>       "  << "\t" << "Memory-map the sorted regions from this binary region catalog rather than parsing"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " them from the --regions file. Generated from --regions if it doesn't exist"          << "\n"
+	    << "\t" << "--region-range <start-end>            "  << "\t" << "Only analyze the sorted regions with indices START-END (1-based, inclusive), after"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " applying the --chrom option. Selects a slice of the regions without a separate BED" << "\n"
+	    << "\t" << "                                      "  << "\t" << " Also available as --region-index-range START:END"                                   << "\n"
+	    << "\t" << "--byte-shard <shard/num_shards>       "  << "\t" << "Split the selected regions into NUM_SHARDS contiguous shards with approximately"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " equal numbers of BAM bytes, estimated from the index offsets of the BAMs, and only"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " analyze shard SHARD (1-based). Balances array jobs better than equal region counts"  << "\n"
+	    << "\t" << "--ref-windows                         "  << "\t" << "Only load the reference sequence surrounding each region instead of entire"         << "\n"
+	    << "\t" << "                                      "  << "\t" << " chromosomes. Reduces memory usage for sparse sets of regions (e.g. panels)"        << "\n"
+	    << "\t" << "--prefetch-chroms                     "  << "\t" << "Load the next chromosome's reference sequence in the background while the current"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " chromosome's regions are analyzed. Holds up to two chromosomes in memory"            << "\n"
+	    << "\t" << "--io-only                             "  << "\t" << "Only seek, extract, filter and deduplicate each region's reads (and phase them if"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " --snp-vcf is provided) without genotyping, and log the throughput of these phases" << "\n"
+	    << "\t" << "                                      "  << "\t" << " and the files with the slowest seeks. Used to plan the nodes and storage for a run" << "\n"
+	    << "\t" << "--str-reads-in <str_reads.bgz>        "  << "\t" << "Load the filtered reads for each locus from this STR read store, generated by a"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " previous run's --str-reads-out, instead of extracting them from the BAMs"            << "\n" << "\n"
     
 	    << "Optional output parameters:" << "\n"
 	    << "\t" << "--log           <log.txt>             "  << "\t" << "Output the log information to the provided file (Default = Standard error)"         << "\n"
+	    << "\t" << "--log-level     <summary|locus|debug> "  << "\t" << "Verbosity of the messages logged for each locus. summary only logs the run's"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " settings, summary and errors, while debug also logs each EM iteration used to"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " learn the stutter models (Default = locus)"                                        << "\n"
 	    << "\t" << "--viz-out       <aln_viz.gz>          "  << "\t" << "Output a file of each locus' alignments for visualization with VizAln or VizAlnPdf" << "\n"
-	    << "\t" << "--stutter-out   <stutter_models.txt>  "  << "\t" << "Output stutter models learned by the EM algorithm to the provided file"             << "\n" << "\n"
+	    << "\t" << "--str-columns   <prefix>              "  << "\t" << "Also output the STR genotypes in a columnar binary format, split into chunks of"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " loci that are written to <prefix>.<chunk>.cols.bgz (see columnar_output.h)."      << "\n"
+	    << "\t" << "                                      "  << "\t" << " If --str-vcf isn't specified, only the columnar genotypes are output"             << "\n"
+	    << "\t" << "--str-columns-loci <num_loci>         "  << "\t" << "Number of loci in each chunk of the --str-columns output (Default = 10000)"         << "\n"
+	    << "\t" << "--str-reads-out <str_reads.bgz>       "  << "\t" << "Output the filtered and deduplicated reads for each locus to this STR read store"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " for reuse by --str-reads-in in subsequent runs with different genotyping options"   << "\n"
+	    << "\t" << "--stutter-out   <stutter_models.txt>  "  << "\t" << "Output stutter models learned by the EM algorithm to the provided file"             << "\n"
+	    << "\t" << "--stutter-bin-out <stutter_models.bin>"  << "\t" << "Output the learned stutter models to a binary table sorted by locus, which"        << "\n"
+	    << "\t" << "                                      "  << "\t" << " --stutter-in memory-maps rather than parsing. Written once all loci are analyzed"  << "\n"
+	    << "\t" << "--batch-summary-out <summary.txt.gz>  "  << "\t" << "Instead of genotyping, output the reads' stutter information and candidate allele" << "\n"
+	    << "\t" << "                                      "  << "\t" << " support for this batch of samples. Merge batches with BatchMerger (see README)"   << "\n"
+	    << "\t" << "--locus-stats   <locus_stats.tsv.gz>  "  << "\t" << "Output a table of each locus' read counts, alignment workload, EM iterations, peak"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " memory and the wall-clock time spent in each phase (in seconds)"                    << "\n"
+	    << "\t" << "--skip-list-out <skip_list.tsv>       "  << "\t" << "Output the loci whose analysis took at least --skip-list-time seconds, or that"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " weren't genotyped after a tenth of that time, for future runs' --skip-list option"  << "\n"
+	    << "\t" << "--skip-list-time <seconds>            "  << "\t" << "Minimum analysis time for loci output to --skip-list-out (Default = 60)"            << "\n"
+	    << "\t" << "--trace-out     <trace.json>          "  << "\t" << "Output the duration of each phase of each locus on each thread in the Chrome"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " trace-event format, for viewing with chrome://tracing or Perfetto"                  << "\n"
+	    << "\t" << "--profile-out   <profile.folded>      "  << "\t" << "Sample the CPU usage of each thread and output the samples for each locus and"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " phase in the folded-stack format used by flamegraph.pl and speedscope"              << "\n"
     //    << "\t" << "--viz-left-alns                       "  << "\t" << "Output the original left aligned reads to the HTML output in addition to the "       << "\n"
     //    << "\t" << "                                      "  << "\t" << " haplotype alignments. By default, only the latter is output"                        << "\n"
-    //    << "\t" << "--pass-bam      <used_reads.bam>      "  << "\t" << "Output a BAM file containing the reads used to genotype each region"                 << "\n"
-    //    << "\t" << "--filt-bam      <filt_reads.bam>      "  << "\t" << "Output a BAM file containing the reads filtered in each region. Each BAM entry"      << "\n"
-    //    << "\t" << "                                      "  << "\t" << " has an FT tag specifying the reason for filtering"                                  << "\n" << "\n"
+	    << "\t" << "--pass-bam      <used_reads.bam>      "  << "\t" << "Output a BAM file containing the reads used to genotype each region"                 << "\n"
+	    << "\t" << "--filt-bam      <filt_reads.bam>      "  << "\t" << "Output a BAM file containing the reads filtered in each region. Each BAM entry"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " has an FT tag specifying the reason for filtering"                                  << "\n"
+	    << "\t" << "--bam-out-threads <num_threads>       "  << "\t" << "Number of threads used to compress the --pass-bam and --filt-bam files (Default = 1)" << "\n"
+	    << "\t" << "--bam-out-level   <level>             "  << "\t" << "zlib compression level (0-9) for the --pass-bam and --filt-bam files (Default = 6)"  << "\n"
+	    << "\t" << "--out-level       <level>             "  << "\t" << "zlib compression level (0-9) for the --str-vcf, --viz-out, --locus-stats and"       << "\n"
+	    << "\t" << "                                      "  << "\t" << " --batch-summary-out files. Level 1 is fastest, e.g. for scratch outputs (Default = 6)" << "\n"
+	    << "\t" << "--out-threads     <num_threads>       "  << "\t" << "Number of threads used to compress each of these files (Default = --threads for"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " the --str-vcf file and 1 for the others)"                                          << "\n"
+	    << "\t" << "--debug-sample-rate <frac>            "  << "\t" << "Only write the --viz-out, --pass-bam and --filt-bam output for this fraction of"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " loci, selected using a hash of their coordinates. The remaining loci skip the"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " alignment tracing, rendering and BAM output entirely (Default = 1.0)"               << "\n"
+	    << "\t" << "--debug-max-loci <num_loci>           "  << "\t" << "Only write the --viz-out, --pass-bam and --filt-bam output for the first NUM_LOCI"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " loci selected by --debug-sample-rate (Default = All loci)"                          << "\n" << "\n"
 
 	    << "Optional read filtering parameters:" << "\n"
 	    << "\t" << "--no-rmdup                            "  << "\t" << "Don't remove PCR duplicates. By default, they'll be removed"                         << "\n"
@@ -79,11 +155,108 @@ void print_usage(int def_mdist, int def_min_reads, int def_max_reads, int def_ma
 	    << "\t" << "--def-stutter-model                   "  << "\t" << "For each locus, use a stutter model with PGEOM=0.9 and UP=DOWN=0.05 for in-frame"     << "\n"
 	    << "\t" << "                                      "  << "\t" << " artifacts and PGEOM=0.9 and UP=DOWN=0.01 for out-of-frame artifacts"                 << "\n"
 	    << "\t" << "--chrom              <chrom>          "  << "\t" << "Only consider STRs on this chromosome"                                                << "\n"
+	    << "\t" << "--chrom-list         <list_of_chroms> "  << "\t" << "Comma separated list of chromosomes. Only consider STRs on these chromosomes"         << "\n"
+	    << "\t" << "--locus              <chrom:start-end>"  << "\t" << "Quickly genotype the STRs that overlap this 1-based interval. Opens and reads the"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " BAMs in parallel, only loads the reference around the locus and omits the summary"  << "\n"
+	    << "\t" << "--skip-list          <skip_list.tsv>  "  << "\t" << "Skip the regions that overlap a locus in this file, generated by a previous run's"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " --skip-list-out option, before extracting any of their reads"                      << "\n"
 	    << "\t" << "--haploid-chrs       <list_of_chroms> "  << "\t" << "Comma separated list of chromosomes to treat as haploid (Default = all diploid)"      << "\n"
 	    << "\t" << "--hap-chr-file       <hap_chroms.txt> "  << "\t" << "File containing chromosomes to treat as haploid, one per line"                        << "\n"
 	    << "\t" << "--min-reads          <num_reads>      "  << "\t" << "Minimum total reads required to genotype a locus (Default = " << def_min_reads << ")" << "\n"
 	    << "\t" << "--max-reads          <num_reads>      "  << "\t" << "Skip a locus if it has more than NUM_READS reads (Default = " << def_max_reads << ")" << "\n"
+	    << "\t" << "--max-sample-depth   <num_reads>      "  << "\t" << "Deterministically downsample each sample's reads at a locus to NUM_READS, selecting"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " reads by the hash of their names. --max-reads is then applied to the downsampled reads" << "\n"
+	    << "\t" << "                                      "  << "\t" << " (Default = Off)"                                                                      << "\n"
+	    << "\t" << "--max-locus-mem      <max_MB>         "  << "\t" << "Skip stutter training or genotyping for a locus if its arrays would require more than" << "\n"
+	    << "\t" << "                                      "  << "\t" << " MAX_MB megabytes, and stop adding stutter alleles that would exceed it (Default = Off)" << "\n"
 	    << "\t" << "--max-str-len        <max_bp>         "  << "\t" << "Only genotype STRs in the provided BED file with length < MAX_BP (Default = " << def_max_str_len << ")" << "\n"
+	    << "\t" << "--group-dist         <max_bp>         "  << "\t" << "Jointly genotype consecutive STRs that are within MAX_BP of one another, so that"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " their reads are extracted, filtered and phased once. STRs less than 20bp apart"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " are never grouped. If any STR in a group fails, the group isn't genotyped"         << "\n"
+	    << "\t" << "                                      "  << "\t" << " (Default = 0 = Off)"                                                                 << "\n"
+	    << "\t" << "--max-group-size     <num_strs>       "  << "\t" << "Maximum number of STRs in each --group-dist group (Default = 3)"                      << "\n"
+	    << "\t" << "--bam-threads        <num_threads>    "  << "\t" << "Number of threads used to decompress the BAM/CRAM files (Default = 0)"              << "\n"
+	    << "\t" << "--bam-read-threads   <num_threads>    "  << "\t" << "Read the BAM/CRAM files on NUM_THREADS background threads, which buffer each file's"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " reads for the current locus. Hides the latency of slow or remote storage (Default = 0)" << "\n"
+	    << "\t" << "--prune-diplotypes   <max_LL_diff>    "  << "\t" << "Stop updating a sample's diplotypes once their LL is more than MAX_LL_DIFF below"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " the sample's best diplotype, after at least 10 of its reads. Speeds up the"         << "\n"
+	    << "\t" << "                                      "  << "\t" << " intermediate genotyping passes of loci with many alleles. The reported genotypes,"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " Q, GL, PL and GLDIFF values are recomputed without pruning (Default = Off)"        << "\n"
+	    << "\t" << "--huge-pages                          "  << "\t" << "Allocate large alignment matrices on huge pages to reduce TLB misses, using"       << "\n"
+	    << "\t" << "                                      "  << "\t" << " explicit huge pages if any are reserved and transparent ones otherwise"          << "\n"
+	    << "\t" << "--kernel             <isa>            "  << "\t" << "Only use alignment kernels for at most this instruction set (scalar, sse2, avx2"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " or avx512). For benchmarking and validation (Default = best supported by CPU)"  << "\n"
+	    << "\t" << "--single-prec-alns                    "  << "\t" << "Compute read alignment likelihoods in single precision, falling back to double"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " precision for reads that don't clearly support one haplotype (Default = False)"  << "\n"
+	    << "\t" << "--accelerate-em                       "  << "\t" << "Accelerate the EM algorithm used to learn each locus' stutter model with SQUAREM"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " extrapolation steps that never decrease the likelihood (Default = False)"          << "\n"
+	    << "\t" << "--stutter-train-reads <num_reads>     "  << "\t" << "Train each stutter model on a subsample of at most NUM_READS informative reads,"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " balanced across samples and read sizes, and then refine it with an EM iteration"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " over all of the reads. Genotyping always uses all reads (Default = Off)"          << "\n"
+	    << "\t" << "--banded-alns                         "  << "\t" << "Only align each read within a band around its original alignment, realigning"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " reads that align poorly within the band to the full haplotypes (Default = False)"  << "\n"
+	    << "\t" << "--prune-alns                          "  << "\t" << "Stop aligning each read to haplotypes whose likelihood can't approach that of its"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " most likely haplotype, assigning them an upper bound instead (Default = False)"     << "\n"
+	    << "\t" << "--prescreen-alleles                   "  << "\t" << "Before aligning the reads, remove candidate alleles whose lengths are implausible"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " for every sample under a length-based stutter model (Default = False)"            << "\n"
+	    << "\t" << "--sparse-haps                         "  << "\t" << "When several blocks of a haplotype vary, only align reads to the combinations of"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " their alleles observed together in the reads' original alignments, along with"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " each allele and each sample's most likely haplotypes (Default = False)"          << "\n"
+	    << "\t" << "--fast-length-gts                     "  << "\t" << "Genotype loci whose flanks don't vary from the lengths of the reads' repeats using"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " the stutter model, instead of aligning the reads to each haplotype (Default = False)" << "\n"
+	    << "\t" << "--flank-assembly-frac <min_frac>      "  << "\t" << "Only reassemble a sample's flanking sequences if the same flank SNP or indel occurs"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " in at least MIN_FRAC of its reads' alignments, so loci with clean flanks skip the"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " De Bruijn assembly. 0 < MIN_FRAC <= 1 (Default = Reassemble every sample's flanks)" << "\n"
+	    << "\t" << "--pool-window        <flank_bp>       "  << "\t" << "Pool reads spanning the STR and FLANK_BP bp on either side by their bases within"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " this window, instead of their entire sequences, so that fewer pools are aligned."   << "\n"
+	    << "\t" << "                                      "  << "\t" << " Reads in these pools are trimmed to the window. FLANK_BP >= 10 (Default = Off)"       << "\n"
+	    << "\t" << "--bin-pool-quals                      "  << "\t" << "Bin base qualities using the Illumina 8-level scheme before computing the median"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " qualities of each read pool (Default = False)"                                      << "\n"
+	    << "\t" << "--aln-backend        <name>           "  << "\t" << "Backend used to align the reads to each candidate haplotype. Only the cpu"        << "\n"
+	    << "\t" << "                                      "  << "\t" << " backend is included in this build (Default = cpu)"                             << "\n"
+	    << "\t" << "--stream-bams                         "  << "\t" << "Scan each chromosome in the BAMs once instead of seeking to each STR. Faster when"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " the STRs in the region file are densely spaced (Default = False)"                 << "\n"
+	    << "\t" << "--reuse-read-filters                  "  << "\t" << "Reuse the per-read filter results for reads that overlap several nearby STRs"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " instead of recomputing them for each STR (Default = False)"                      << "\n"
+	    << "\t" << "--max-open-bams      <num_files>      "  << "\t" << "Only open each BAM/CRAM once its reads are required and keep at most NUM_FILES"       << "\n"
+	    << "\t" << "                                      "  << "\t" << " open, closing the least recently used. For runs with many files (Default = Off)"     << "\n"
+	    << "\t" << "--bam-header-cache   <headers.txt>    "  << "\t" << "With --max-open-bams, cache the validated BAM headers in this file so that"           << "\n"
+	    << "\t" << "                                      "  << "\t" << " subsequent runs only reread the headers of new or modified files"                    << "\n"
+	    << "\t" << "--bam-index-cache    <dir>            "  << "\t" << "Memory-map each BAM's .bai index from a compact copy in this directory, which is"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " shared by concurrent runs and regenerated whenever the .bai is modified"          << "\n"
+	    << "\t" << "--threads            <num_threads>    "  << "\t" << "Number of threads used to genotype loci concurrently (Default = 1)"                    << "\n"
+	    << "\t" << "--numa-workers                        "  << "\t" << "Divide the --threads workers among the NUMA nodes, binding each to its node's CPUs" << "\n"
+	    << "\t" << "                                      "  << "\t" << " and giving each node its own copy of the reference sequence (Default = False)"    << "\n"
+	    << "\t" << "--prefetch-loci      <num_loci>       "  << "\t" << "With a single thread, read and filter the reads of up to NUM_LOCI upcoming loci"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " on a separate thread while the current locus is genotyped (Default = Off)"          << "\n"
+	    << "\t" << "--prefetch-ranges    <num_loci>       "  << "\t" << "With a single thread, fetch the BAM/CRAM byte ranges for the next NUM_LOCI loci"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " using a few large concurrent reads. For files accessed via URLs (Default = Off)"   << "\n"
+	    << "\t" << "--prefetch-io-uring                   "  << "\t" << "With --prefetch-ranges, read the ranges of local files in batches using io_uring"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " instead of a pool of threads, for fast local drives such as NVMe SSDs"             << "\n"
+	    << "\t" << "--skip-failed-loci                    "  << "\t" << "Skip loci whose analysis encounters an error, such as a malformed read, instead"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " of exiting. Each skipped locus' error is reported in the log (Default = False)"   << "\n"
+	    << "\t" << "--locus-timeout      <seconds>        "  << "\t" << "Abandon a locus if its analysis takes longer than SECONDS seconds. Timed out loci"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " have the TIMEOUT status in --locus-stats and --skip-list-out (Default = Off)"      << "\n"
+	    << "\t" << "--progress           <seconds>        "  << "\t" << "Report the loci completed, throughput, memory usage and projected finish time"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " to standard error every SECONDS seconds (Default = Off)"                            << "\n"
+	    << "\t" << "--progress-file      <status.txt>     "  << "\t" << "Write each progress report to this file, replacing the previous report, instead"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " of standard error. Reports are made every 60 seconds unless --progress is set"     << "\n"
+	    << "\t" << "--metrics-file       <metrics.prom>   "  << "\t" << "Periodically replace this file with the loci completed and failed by reason, the"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " per-locus phase timings, queue depths, read throughput and memory usage in the"   << "\n"
+	    << "\t" << "                                      "  << "\t" << " Prometheus text format. Written every 60 seconds unless --progress is set"        << "\n"
+	    << "\t" << "--checkpoint         <seconds>        "  << "\t" << "Flush the output files and record the completed regions in <str_vcf>.ckpt every"      << "\n"
+	    << "\t" << "                                      "  << "\t" << " SECONDS seconds, so an interrupted run can be resumed (Default = Off)"               << "\n"
+	    << "\t" << "--resume                              "  << "\t" << "Resume an interrupted run from <str_vcf>.ckpt, skipping the completed regions and"    << "\n"
+	    << "\t" << "                                      "  << "\t" << " appending to the existing output files. Requires identical regions and outputs"      << "\n"
+	    << "\t" << "--work-dir           <shared_dir>     "  << "\t" << "Claim batches of regions from a work queue in this directory, which is shared by"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " HipSTR runs on multiple nodes. Every run writes the genotypes for its batches to"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " the directory. The run with --str-vcf waits for all batches and combines them"     << "\n"
+	    << "\t" << "--work-batch-secs    <seconds>        "  << "\t" << "Size each work queue batch so that it takes roughly SECONDS to analyze (Default = 300)" << "\n"
+	    << "\t" << "--serve              <socket_path>    "  << "\t" << "Run as a service that keeps the regions, reference and stutter models in memory and"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " genotypes the BAMs in each request received on this Unix socket, returning the"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " uncompressed STR VCF. Requests contain a 'bams a.bam,b.bam' line, an optional"     << "\n"
+	    << "\t" << "                                      "  << "\t" << " 'regions chr:start-end,...' line and end with an empty line. 'shutdown' stops it"  << "\n"
+	    << "\t" << "                                      "  << "\t" << " Requests that aren't received within 10 seconds or exceed 16 MB are rejected"    << "\n"
     //<< "\t" << "--skip-genotyping                     "  << "\t" << "Don't perform any STR genotyping and merely compute the stutter model for each STR"  << "\n"
     //<< "\t" << "--dont-use-all-reads                  "  << "\t" << "Only utilize the reads HipSTR thinks will be informative for genotyping"   << "\n"
     //<< "\t" << "                                      "  << "\t" << " Enabling this option usually slightly decreases accuracy but shortens runtimes (~2x)"      << "\n"
@@ -103,10 +276,13 @@ void parse_command_line_args(int argc, char** argv,
 			     std::string& bamfile_string,     std::string& bamlist_string,    std::string& rg_sample_string,  std::string& rg_lib_string,
 			     std::string& haploid_chr_string, std::string& hap_chr_file,      std::string& fasta_dir,         std::string& region_file,   std::string& snp_vcf_file,
 			     std::string& chrom,              std::string& bam_pass_out_file, std::string& bam_filt_out_file,
-			     std::string& str_vcf_out_file,   std::string& fam_file,          std::string& log_file,       int& use_all_reads,
+			     std::string& str_vcf_out_file,   std::string& fam_file,          std::string& log_file,
+			     std::string& str_columns_prefix, int& str_columns_loci,  int& use_all_reads,
 			     int& remove_pcr_dups, int& bams_from_10x,     int& bam_lib_from_samp, int& def_stutter_model, int& skip_genotyping,   int& output_gls,
 			     int& output_pls,      int& output_phased_gls, int& output_all_reads,  int& output_mall_reads, std::string& ref_vcf_file,
-			     GenotyperBamProcessor& bam_processor){
+			     int& stream_bams, int& bam_threads, int& bam_out_threads, int& bam_out_level,
+			     int& max_open_bams, std::string& bam_header_cache, std::string& bam_index_cache, int& prefetch_ranges, int& prefetch_io_uring,
+			     int& bam_read_threads, std::string& serve_socket, GenotyperBamProcessor& bam_processor){
   int def_mdist       = bam_processor.MAX_MATE_DIST;
   int def_min_reads   = bam_processor.MIN_TOTAL_READS;
   int def_max_reads   = bam_processor.MAX_TOTAL_READS;
@@ -118,23 +294,60 @@ void parse_command_line_args(int argc, char** argv,
 
   int print_help    = 0;
   int viz_left_alns = 0;
+  int single_prec_alns = 0, ref_windows = 0, prefetch_chroms = 0, accelerate_em = 0, banded_alns = 0, prune_alns = 0, prescreen_alleles = 0, sparse_haps = 0, fast_length_gts = 0, incremental = 0;
+  int skip_failed_loci = 0, numa_workers = 0, huge_pages = 0, bin_pool_quals = 0, reuse_read_filters = 0, io_only = 0;
   int print_version = 0;
+  int progress_interval = 0;
+  std::string progress_file, metrics_file;
+  int checkpoint_interval = 0, resume = 0;
+  std::string work_dir, locus_chrom;
+  double work_batch_seconds = 300;
+  std::string stutter_db_file;
+  int reuse_stutter_min_reads = 0;
+  std::string stutter_out_file, locus_stats_file, viz_out_file, read_store_out_file, batch_summary_file, skip_list_out_file;
+  std::string stutter_table_file;
 
   static struct option long_options[] = {
     {"10x-bams",        no_argument, &bams_from_10x, 1},
     {"bams",            required_argument, 0, 'b'},
+    {"batch-summary-out", required_argument, 0, 'A'},
     {"bam-files",       required_argument, 0, 'B'},
+    {"bam-threads",     required_argument, 0, 'e'},
+    {"bam-read-threads",required_argument, 0, '!'},
     {"chrom",           required_argument, 0, 'c'},
+    {"locus",           required_argument, 0, '<'},
     {"max-mate-dist",   required_argument, 0, 'd'},
     {"fam",             required_argument, 0, 'D'},
     {"fasta",           required_argument, 0, 'f'},
+    {"packed-ref",      required_argument, 0, 'a'},
+    {"region-catalog",  required_argument, 0, '1'}, // Long-only options whose values aren't in the short option string
+    {"region-range",    required_argument, 0, '2'},
+    {"region-index-range", required_argument, 0, '2'},
+    {"chrom-list",      required_argument, 0, '^'},
+    {"byte-shard",      required_argument, 0, '&'},
+    {"skip-list",       required_argument, 0, '*'},
+    {"skip-list-out",   required_argument, 0, '~'},
+    {"skip-list-time",  required_argument, 0, '+'},
+    {"group-dist",      required_argument, 0, '3'},
+    {"ref-vcf-index",   required_argument, 0, '5'},
+    {"debug-sample-rate", required_argument, 0, '6'},
+    {"debug-max-loci",  required_argument, 0, '7'},
+    {"prefetch-loci",   required_argument, 0, '8'},
+    {"prefetch-ranges", required_argument, 0, '9'},
+    {"aln-backend",     required_argument, 0, '0'},
+    {"kernel",          required_argument, 0, '@'},
+    {"max-group-size",  required_argument, 0, '4'},
     {"bam-samps",       required_argument, 0, 'g'},
     {"bam-libs",        required_argument, 0, 'q'},
     {"lib-from-samp",   no_argument, &bam_lib_from_samp,    1},
     {"min-reads",       required_argument, 0, 'i'},
     {"read-qual-trim",  required_argument, 0, 'j'},
     {"log",             required_argument, 0, 'l'},
+    {"log-level",       required_argument, 0, '#'},
+    {"locus-stats",     required_argument, 0, 'L'},
     {"max-reads",       required_argument, 0, 'n'},
+    {"max-locus-mem",   required_argument, 0, 'M'},
+    {"max-sample-depth",required_argument, 0, 'W'},
     {"h",               no_argument, &print_help, 1},
     {"help",            no_argument, &print_help, 1},
     {"hide-allreads",   no_argument, &output_all_reads,   0},
@@ -146,6 +359,8 @@ void parse_command_line_args(int argc, char** argv,
     {"version",         no_argument, &print_version, 1},
     {"max-flank-indel", required_argument, 0, 'F'},
     {"str-vcf",         required_argument, 0, 'o'},
+    {"str-columns",     required_argument, 0, 'U'},
+    {"str-columns-loci",required_argument, 0, 'V'},
     {"ref-vcf",         required_argument, 0, 'p'},
     {"regions",         required_argument, 0, 'r'},
     {"use-unpaired",       no_argument, &(bam_processor.REQUIRE_PAIRED_READS), 0},
@@ -153,14 +368,61 @@ void parse_command_line_args(int argc, char** argv,
     {"def-stutter-model",  no_argument, &def_stutter_model, 1},
     {"skip-genotyping",    no_argument, &skip_genotyping, 1},
     {"snp-vcf",         required_argument, 0, 'v'},
+    {"str-reads-in",    required_argument, 0, 'I'},
+    {"str-reads-out",   required_argument, 0, 'R'},
+    {"checkpoint",      required_argument, 0, 'K'},
+    {"resume",          no_argument, &resume, 1},
+    {"work-dir",        required_argument, 0, 'C'},
+    {"work-batch-secs", required_argument, 0, 'E'},
+    {"serve",           required_argument, 0, '='},
+    {"prune-diplotypes", required_argument, 0, 'P'},
+    {"progress",         required_argument, 0, 'G'},
+    {"progress-file",    required_argument, 0, 'H'},
+    {"metrics-file",     required_argument, 0, '|'},
+    {"single-prec-alns", no_argument, &single_prec_alns, 1},
+    {"ref-windows",      no_argument, &ref_windows, 1},
+    {"prefetch-chroms",  no_argument, &prefetch_chroms, 1},
+    {"io-only",          no_argument, &io_only, 1},
+    {"accelerate-em",    no_argument, &accelerate_em, 1},
+    {"incremental",      no_argument, &incremental, 1},
+    {"banded-alns",      no_argument, &banded_alns, 1},
+    {"prune-alns",       no_argument, &prune_alns, 1},
+    {"prescreen-alleles", no_argument, &prescreen_alleles, 1},
+    {"sparse-haps",      no_argument, &sparse_haps, 1},
+    {"fast-length-gts",  no_argument, &fast_length_gts, 1},
+    {"pool-window",      required_argument, 0, '('},
+    {"flank-assembly-frac", required_argument, 0, '{'},
+    {"snp-vcf-panel",   required_argument, 0, '}'},
+    {"stutter-train-reads", required_argument, 0, ')'},
+    {"bin-pool-quals",   no_argument, &bin_pool_quals, 1},
+    {"reuse-read-filters", no_argument, &reuse_read_filters, 1},
+    {"skip-failed-loci", no_argument, &skip_failed_loci, 1},
+    {"locus-timeout",    required_argument, 0, '>'},
+    {"numa-workers",     no_argument, &numa_workers, 1},
+    {"huge-pages",       no_argument, &huge_pages, 1},
+    {"stream-bams",     no_argument, &stream_bams, 1},
+    {"prefetch-io-uring", no_argument, &prefetch_io_uring, 1},
+    {"max-open-bams",   required_argument, 0, 'N'},
+    {"bam-header-cache",required_argument, 0, 'J'},
+    {"bam-index-cache", required_argument, 0, '%'},
     {"stutter-in",      required_argument, 0, 'm'},
     {"stutter-out",     required_argument, 0, 's'},
+    {"stutter-bin-out", required_argument, 0, '$'},
+    {"stutter-db",      required_argument, 0, 'Z'},
+    {"reuse-stutter",   required_argument, 0, 'k'},
+    {"threads",         required_argument, 0, 'T'},
+    {"trace-out",       required_argument, 0, 'O'},
+    {"profile-out",     required_argument, 0, 'Q'},
     {"sample-list",     required_argument, 0, 'S'},
     {"haploid-chrs",    required_argument, 0, 't'},
     {"hap-chr-file",    required_argument, 0, 'u'},
     {"pass-bam",        required_argument, 0, 'w'},
     {"max-str-len",     required_argument, 0, 'x'},
     {"filt-bam",        required_argument, 0, 'y'},
+    {"bam-out-threads", required_argument, 0, 'X'},
+    {"bam-out-level",   required_argument, 0, 'Y'},
+    {"out-level",       required_argument, 0, '['},
+    {"out-threads",     required_argument, 0, ']'},
     {"viz-left-alns",   no_argument, &viz_left_alns, 1},
     {"viz-out",         required_argument, 0, 'z'},
     {0, 0, 0, 0}
@@ -170,7 +432,7 @@ void parse_command_line_args(int argc, char** argv,
   int c;
   while (true){
     int option_index = 0;
-    c = getopt_long(argc, argv, "b:B:c:d:D:e:f:F:g:i:j:k:l:m:n:o:p:q:r:s:S:t:u:v:w:x:y:z:", long_options, &option_index);
+    c = getopt_long(argc, argv, "a:A:b:B:c:C:d:D:e:E:f:F:g:G:H:i:I:j:J:k:K:l:L:m:M:n:N:o:O:p:P:q:Q:r:R:s:S:t:T:u:U:v:V:w:W:x:X:y:Y:z:Z:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -183,6 +445,128 @@ void parse_command_line_args(int argc, char** argv,
     switch(c){
     case 0:
       break;
+    case 'a':
+      bam_processor.set_packed_reference(std::string(optarg));
+      break;
+    case '1':
+      bam_processor.set_region_catalog(std::string(optarg));
+      break;
+    case '2': {
+      std::string range(optarg);
+      std::vector<std::string> bounds;
+      split_by_delim(range, (range.find(':') != std::string::npos ? ':' : '-'), bounds);
+      if (bounds.size() != 2)
+	printErrorAndDie("--region-range must be of the form START-END or START:END");
+      bam_processor.set_region_range(atoll(bounds[0].c_str()), atoll(bounds[1].c_str()));
+      break;
+    }
+    case '^': {
+      std::vector<std::string> chroms;
+      split_by_delim(std::string(optarg), ',', chroms);
+      for (auto chrom_iter = chroms.begin(); chrom_iter != chroms.end(); chrom_iter++)
+	if (!chrom_iter->empty())
+	  bam_processor.add_chrom_to_list(*chrom_iter);
+      if (bam_processor.chrom_list().empty())
+	printErrorAndDie("--chrom-list must contain at least one chromosome");
+      break;
+    }
+    case '*':
+      bam_processor.set_skip_list(std::string(optarg));
+      break;
+    case '~':
+      skip_list_out_file = std::string(optarg);
+      break;
+    case '+':
+      bam_processor.set_skip_list_min_time(atof(optarg));
+      break;
+    case '&': {
+      std::vector<std::string> tokens;
+      split_by_delim(std::string(optarg), '/', tokens);
+      if (tokens.size() != 2)
+	printErrorAndDie("--byte-shard must be of the form SHARD/NUM_SHARDS");
+      bam_processor.set_byte_shard(atoi(tokens[0].c_str()), atoi(tokens[1].c_str()));
+      break;
+    }
+    case 'I':
+      bam_processor.set_read_store_input(std::string(optarg));
+      break;
+    case 'R':
+      read_store_out_file = std::string(optarg);
+      break;
+    case 'N':
+      max_open_bams = atoi(optarg);
+      if (max_open_bams <= 0)
+	printErrorAndDie("--max-open-bams must be greater than 0");
+      break;
+    case 'J':
+      bam_header_cache = std::string(optarg);
+      break;
+    case '%': {
+      bam_index_cache = std::string(optarg);
+      struct stat dir_stat;
+      if (stat(bam_index_cache.c_str(), &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode))
+	printErrorAndDie("--bam-index-cache must be an existing directory");
+      break;
+    }
+    case 'C':
+      work_dir = std::string(optarg);
+      break;
+    case '=':
+      serve_socket = std::string(optarg);
+      break;
+    case 'E':
+      work_batch_seconds = atof(optarg);
+      if (work_batch_seconds <= 0)
+	printErrorAndDie("--work-batch-secs must be greater than 0");
+      break;
+    case 'K':
+      checkpoint_interval = atoi(optarg);
+      if (checkpoint_interval <= 0)
+	printErrorAndDie("--checkpoint must be greater than 0");
+      break;
+    case '3':
+      bam_processor.MAX_GROUP_DIST = atoi(optarg);
+      if (bam_processor.MAX_GROUP_DIST < 0)
+	printErrorAndDie("--group-dist must be greater than or equal to 0");
+      break;
+    case '5':
+      bam_processor.set_ref_allele_index_file(std::string(optarg));
+      break;
+    case '6':
+      if (atof(optarg) <= 0 || atof(optarg) > 1)
+	printErrorAndDie("--debug-sample-rate must be in the range (0, 1]");
+      bam_processor.set_debug_sample_rate(atof(optarg));
+      break;
+    case '7':
+      if (atoll(optarg) <= 0)
+	printErrorAndDie("--debug-max-loci must be greater than 0");
+      bam_processor.set_debug_max_loci(atoll(optarg));
+      break;
+    case '8':
+      bam_processor.set_prefetch_loci(atoi(optarg));
+      break;
+    case '0':
+      bam_processor.set_alignment_backend(std::string(optarg));
+      break;
+    case '@':
+      if (!set_kernel_isa(std::string(optarg))){
+	std::string isas;
+	std::vector<std::string> supported = supported_kernel_isas();
+	for (auto isa_iter = supported.begin(); isa_iter != supported.end(); isa_iter++)
+	  isas += (isas.empty() ? "" : ", ") + *isa_iter;
+	printErrorAndDie("--kernel must be one of the instruction sets supported by this CPU: " + isas);
+      }
+      break;
+    case '9':
+      prefetch_ranges = atoi(optarg);
+      if (prefetch_ranges <= 0)
+	printErrorAndDie("--prefetch-ranges must be greater than 0");
+      break;
+    case '4':
+      bam_processor.MAX_GROUP_REGIONS = atoi(optarg);
+      if (bam_processor.MAX_GROUP_REGIONS < 1)
+	printErrorAndDie("--max-group-size must be greater than 0");
+      break;
     case 'b':
       bamlist_string = std::string(optarg);
       break;
@@ -192,12 +576,48 @@ void parse_command_line_args(int argc, char** argv,
     case 'c':
       chrom = std::string(optarg);
       break;
+    case '<': {
+      int32_t start, end;
+      if (!parseRegionString(std::string(optarg), locus_chrom, start, end))
+	printErrorAndDie("--locus must be of the form CHROM:START-END, where 1 <= START <= END");
+      bam_processor.set_locus(locus_chrom, start, end);
+      break;
+    }
+    case '(':
+      bam_processor.set_pool_window(atoi(optarg));
+      break;
+    case '{': {
+      float frac = atof(optarg);
+      if (frac <= 0 || frac > 1)
+	printErrorAndDie("--flank-assembly-frac must be greater than 0 and no more than 1");
+      bam_processor.set_min_flank_var_frac(frac);
+      break;
+    }
+    case '}':
+      bam_processor.set_snp_panel_file(std::string(optarg));
+      break;
+    case ')':
+      bam_processor.set_stutter_train_reads(atoi(optarg));
+      break;
+    case '>':
+      bam_processor.set_locus_timeout(atof(optarg));
+      break;
     case 'd':
       bam_processor.MAX_MATE_DIST = atoi(optarg);
       break;
     case 'D':
       fam_file = std::string(optarg);
       break;
+    case 'e':
+      bam_threads = atoi(optarg);
+      if (bam_threads < 0)
+	printErrorAndDie("--bam-threads must be greater than or equal to 0");
+      break;
+    case '!':
+      bam_read_threads = atoi(optarg);
+      if (bam_read_threads < 0)
+	printErrorAndDie("--bam-read-threads must be greater than or equal to 0");
+      break;
     case 'f':
       fasta_dir = std::string(optarg);
       break;
@@ -217,6 +637,16 @@ void parse_command_line_args(int argc, char** argv,
     case 'l':
       log_file = std::string(optarg);
       break;
+    case '#':
+      if (std::string(optarg).compare("summary") == 0)
+	bam_processor.set_log_level(BamProcessor::LOG_SUMMARY);
+      else if (std::string(optarg).compare("locus") == 0)
+	bam_processor.set_log_level(BamProcessor::LOG_LOCUS);
+      else if (std::string(optarg).compare("debug") == 0)
+	bam_processor.set_log_level(BamProcessor::LOG_DEBUG);
+      else
+	printErrorAndDie("--log-level must be one of summary, locus or debug");
+      break;
     case 'm':
       filename = std::string(optarg);
       bam_processor.set_input_stutter(filename);
@@ -224,12 +654,35 @@ void parse_command_line_args(int argc, char** argv,
     case 'n':
       bam_processor.MAX_TOTAL_READS = atoi(optarg);
       break;
+    case 'M':
+      if (atof(optarg) <= 0)
+	printErrorAndDie("--max-locus-mem must be greater than 0 MB");
+      bam_processor.MAX_LOCUS_BYTES = (int64_t)(atof(optarg)*1024*1024);
+      break;
+    case 'W':
+      bam_processor.MAX_SAMPLE_DEPTH = atoi(optarg);
+      if (bam_processor.MAX_SAMPLE_DEPTH <= 0)
+	printErrorAndDie("--max-sample-depth must be greater than 0");
+      break;
     case 'o':
       str_vcf_out_file = std::string(optarg);
       break;
+    case 'U':
+      str_columns_prefix = std::string(optarg);
+      break;
+    case 'V':
+      str_columns_loci = atoi(optarg);
+      if (str_columns_loci <= 0)
+	printErrorAndDie("--str-columns-loci must be greater than 0");
+      break;
     case 'p':
       ref_vcf_file = std::string(optarg);
       break;
+    case 'P':
+      if (atof(optarg) <= 0)
+	printErrorAndDie("--prune-diplotypes must be greater than 0");
+      bam_processor.set_diplotype_pruning(atof(optarg));
+      break;
     case 'q':
       rg_lib_string = std::string(optarg);
       break;
@@ -237,8 +690,18 @@ void parse_command_line_args(int argc, char** argv,
       region_file = std::string(optarg);
       break;
     case 's':
-      filename = std::string(optarg);
-      bam_processor.set_output_stutter(filename);
+      stutter_out_file = std::string(optarg);
+      break;
+    case '$':
+      stutter_table_file = std::string(optarg);
+      break;
+    case 'Z':
+      stutter_db_file = std::string(optarg);
+      break;
+    case 'k':
+      reuse_stutter_min_reads = atoi(optarg);
+      if (reuse_stutter_min_reads <= 0)
+	printErrorAndDie("--reuse-stutter must be greater than 0");
       break;
     case 'S':
       bam_processor.set_sample_set(std::string(optarg));
@@ -246,6 +709,9 @@ void parse_command_line_args(int argc, char** argv,
     case 't':
       haploid_chr_string = std::string(optarg);
       break;
+    case 'T':
+      bam_processor.set_num_threads(atoi(optarg));
+      break;
     case 'u':
       hap_chr_file = std::string(optarg);
       break;
@@ -261,11 +727,53 @@ void parse_command_line_args(int argc, char** argv,
     case 'y':
       bam_filt_out_file = std::string(optarg);
       break;
+    case 'X':
+      bam_out_threads = atoi(optarg);
+      if (bam_out_threads < 1)
+	printErrorAndDie("--bam-out-threads must be greater than 0");
+      break;
+    case 'Y':
+      bam_out_level = atoi(optarg);
+      if (bam_out_level < 0 || bam_out_level > 9)
+	printErrorAndDie("--bam-out-level must be between 0 and 9");
+      break;
+    case '[':
+      bam_processor.set_output_level(atoi(optarg));
+      break;
+    case ']':
+      bam_processor.set_output_threads(atoi(optarg));
+      break;
+    case 'G':
+      progress_interval = atoi(optarg);
+      if (progress_interval <= 0)
+	printErrorAndDie("--progress must be greater than 0");
+      break;
+    case 'H':
+      progress_file = std::string(optarg);
+      break;
+    case '|':
+      metrics_file = std::string(optarg);
+      break;
+    case 'O':
+      TraceRecorder::instance().enable(std::string(optarg));
+      break;
+    case 'Q':
+      SamplingProfiler::enable(std::string(optarg));
+      break;
+    case 'L':
+      locus_stats_file = std::string(optarg);
+      if (!string_ends_with(locus_stats_file, ".gz"))
+	printErrorAndDie("Path for locus statistics file must end in .gz as it will be bgzipped");
+      break;
+    case 'A':
+      batch_summary_file = std::string(optarg);
+      if (!string_ends_with(batch_summary_file, ".gz"))
+	printErrorAndDie("Path for batch summary file must end in .gz as it will be bgzipped");
+      break;
     case 'z':
-      filename = std::string(optarg);
-      if (!string_ends_with(filename, ".gz"))
+      viz_out_file = std::string(optarg);
+      if (!string_ends_with(viz_out_file, ".gz"))
 	printErrorAndDie("Path for alignment visualization file must end in .gz as it will be bgzipped");
-      bam_processor.set_output_viz(filename);
       break;
     case 'F':
       bam_processor.set_max_flank_indel_frac(atof(optarg));
@@ -296,12 +804,210 @@ void parse_command_line_args(int argc, char** argv,
     print_usage(def_mdist, def_min_reads, def_max_reads, def_max_str_len);
     exit(0);
   }
+
+  // Each run using the work queue writes the output for its batches to the shared directory, so only the STR VCF is supported
+  if (!work_dir.empty()){
+    if (resume || checkpoint_interval > 0)
+      printErrorAndDie("--work-dir is not supported in conjunction with the --checkpoint or --resume options");
+    if (!stutter_out_file.empty() || !locus_stats_file.empty() || !viz_out_file.empty() || !read_store_out_file.empty() || !batch_summary_file.empty())
+      printErrorAndDie("--work-dir is not supported in conjunction with the --stutter-out, --locus-stats, --viz-out, --str-reads-out or --batch-summary-out options");
+    if (!skip_list_out_file.empty() || !stutter_table_file.empty())
+      printErrorAndDie("--work-dir is not supported in conjunction with the --skip-list-out or --stutter-bin-out options");
+    if (!str_columns_prefix.empty() || !stutter_db_file.empty())
+      printErrorAndDie("--work-dir is not supported in conjunction with the --str-columns or --stutter-db options");
+    bam_processor.set_work_queue(work_dir, work_batch_seconds, !str_vcf_out_file.empty());
+  }
+
+  // A single locus only requires the reference window surrounding it, and its run summary would merely repeat its VCF record
+  if (!locus_chrom.empty()){
+    if (!chrom.empty() && chrom.compare(locus_chrom) != 0)
+      printErrorAndDie("The chromosome provided to --chrom doesn't match the one provided to --locus");
+    if (!work_dir.empty() || resume || checkpoint_interval > 0)
+      printErrorAndDie("--locus is not supported in conjunction with the --work-dir, --checkpoint or --resume options");
+    chrom = locus_chrom;
+    bam_processor.use_reference_windows();
+    bam_processor.skip_run_summary();
+  }
+
+  // The service streams each request's STR VCF to its client, so the options for the other output files aren't supported
+  if (!serve_socket.empty()){
+    if (!work_dir.empty() || resume || checkpoint_interval > 0)
+      printErrorAndDie("--serve is not supported in conjunction with the --work-dir, --checkpoint or --resume options");
+    if (!str_vcf_out_file.empty() || !str_columns_prefix.empty() || !bam_pass_out_file.empty() || !bam_filt_out_file.empty())
+      printErrorAndDie("--serve is not supported in conjunction with the --str-vcf, --str-columns, --pass-bam or --filt-bam options");
+    if (!stutter_out_file.empty() || !locus_stats_file.empty() || !viz_out_file.empty() || !read_store_out_file.empty() || !batch_summary_file.empty())
+      printErrorAndDie("--serve is not supported in conjunction with the --stutter-out, --locus-stats, --viz-out, --str-reads-out or --batch-summary-out options");
+    if (!skip_list_out_file.empty() || !stutter_table_file.empty() || !stutter_db_file.empty())
+      printErrorAndDie("--serve is not supported in conjunction with the --skip-list-out, --stutter-bin-out or --stutter-db options");
+    if (skip_genotyping)
+      printErrorAndDie("--serve is not supported in conjunction with the --skip-genotyping option");
+  }
+
+  // The output files are opened once all of the options have been parsed, as a resumed run must
+  // first truncate them to their checkpointed sizes rather than overwriting them
+  if (resume){
+    if (str_vcf_out_file.empty())
+      printErrorAndDie("--resume requires the --str-vcf option, as the checkpoint is stored alongside the STR VCF");
+    if (!bam_pass_out_file.empty() || !bam_filt_out_file.empty() || !read_store_out_file.empty())
+      printErrorAndDie("--resume is not supported in conjunction with the --pass-bam, --filt-bam or --str-reads-out options");
+    bam_processor.resume_from_checkpoint(str_vcf_out_file + ".ckpt");
+  }
+  if (checkpoint_interval > 0 || resume){
+    // The chunk files are written in their entirety, so they can't be truncated to a checkpoint
+    if (!str_columns_prefix.empty())
+      printErrorAndDie("--checkpoint and --resume are not supported in conjunction with the --str-columns option");
+    if (str_vcf_out_file.empty())
+      printErrorAndDie("--checkpoint requires the --str-vcf option, as the checkpoint is stored alongside the STR VCF");
+    bam_processor.set_checkpointing(str_vcf_out_file + ".ckpt", checkpoint_interval > 0 ? checkpoint_interval : 300);
+  }
+  if (!stutter_out_file.empty())
+    bam_processor.set_output_stutter(stutter_out_file);
+  if (!stutter_table_file.empty()){
+    // The table is only written at the end of the run, so it can't be resumed from a checkpoint
+    if (checkpoint_interval > 0 || resume)
+      printErrorAndDie("--stutter-bin-out is not supported in conjunction with the --checkpoint or --resume options");
+    bam_processor.set_output_stutter_table(stutter_table_file);
+  }
+  if (!stutter_db_file.empty()){
+    // The database only applies to loci whose stutter models are learned by this run
+    if (bam_processor.has_input_stutter_models() || def_stutter_model)
+      printErrorAndDie("The --stutter-db option cannot be used together with the --stutter-in or --def-stutter-model options");
+    bam_processor.set_stutter_db(stutter_db_file);
+    if (reuse_stutter_min_reads > 0)
+      bam_processor.set_stutter_reuse(reuse_stutter_min_reads);
+  }
+  else if (reuse_stutter_min_reads > 0)
+    printErrorAndDie("--reuse-stutter requires the --stutter-db option");
+  if (!batch_summary_file.empty()){
+    // Batches are genotyped after their summaries have been merged, so no genotypes are output
+    if (!str_vcf_out_file.empty() || !str_columns_prefix.empty())
+      printErrorAndDie("The --batch-summary-out option cannot be used together with the --str-vcf or --str-columns options");
+    skip_genotyping = 1;
+    bam_processor.set_output_batch_summary(batch_summary_file);
+  }
+  if (io_only){
+    if (!str_vcf_out_file.empty() || !str_columns_prefix.empty() || !batch_summary_file.empty())
+      printErrorAndDie("--io-only doesn't genotype any loci, so it can't be used together with the --str-vcf, --str-columns or --batch-summary-out options");
+    if (!work_dir.empty() || !serve_socket.empty())
+      printErrorAndDie("--io-only is not supported in conjunction with the --work-dir or --serve options");
+    skip_genotyping = 1;
+    bam_processor.io_only();
+  }
+  if (!locus_stats_file.empty())
+    bam_processor.set_output_locus_stats(locus_stats_file);
+  if (!skip_list_out_file.empty())
+    bam_processor.set_output_skip_list(skip_list_out_file);
+  if (!viz_out_file.empty())
+    bam_processor.set_output_viz(viz_out_file);
+  if (!bam_processor.debug_sampler().samples_all() && viz_out_file.empty() && bam_pass_out_file.empty() && bam_filt_out_file.empty())
+    printErrorAndDie("--debug-sample-rate and --debug-max-loci require at least one of the --viz-out, --pass-bam or --filt-bam options");
+  if (!read_store_out_file.empty())
+    bam_processor.set_read_store_output(read_store_out_file);
+
   if (viz_left_alns)
     bam_processor.visualize_left_alns();
+  if (progress_interval > 0 || !progress_file.empty())
+    bam_processor.set_progress_reporting(progress_interval > 0 ? progress_interval : 60, progress_file);
+  if (!metrics_file.empty())
+    bam_processor.set_metrics_file(metrics_file, progress_interval > 0 ? progress_interval : 60);
+  if (ref_windows)
+    bam_processor.use_reference_windows();
+  if (prefetch_chroms)
+    bam_processor.prefetch_chromosomes();
+  if (single_prec_alns)
+    bam_processor.use_single_precision_alns();
+  if (accelerate_em)
+    bam_processor.use_accelerated_em();
+  if (banded_alns)
+    bam_processor.use_banded_alns();
+  if (prune_alns)
+    bam_processor.use_pruned_alns();
+  if (prescreen_alleles)
+    bam_processor.use_allele_prescreen();
+  if (sparse_haps)
+    bam_processor.use_sparse_haplotypes();
+  if (fast_length_gts)
+    bam_processor.use_length_fast_path();
+  if (bin_pool_quals)
+    bam_processor.use_binned_pool_qualities();
+  if (reuse_read_filters)
+    bam_processor.reuse_read_filters();
+  if (numa_workers)
+    bam_processor.use_numa_workers();
+  if (huge_pages)
+    HugePages::enable();
+  if (skip_failed_loci)
+    bam_processor.skip_failed_loci();
+  if (incremental){
+    // The prior call set determines the alleles and stutter models, so only the new samples' reads are required
+    if (ref_vcf_file.empty() || !bam_processor.has_input_stutter_models())
+      printErrorAndDie("--incremental requires the prior call set's VCF and stutter models via the --ref-vcf and --stutter-in options");
+    bam_processor.use_incremental_genotyping();
+  }
+}
+
+// Apply the options for reading the BAM/CRAM files to READER. All record fields are decoded if FULL_RECORDS is true
+void configure_bam_reader(BamCramMultiReader& reader, GenotyperBamProcessor& bam_processor, bool full_records, int stream_bams,
+			  int bam_threads, int max_open_bams, int prefetch_ranges, int prefetch_io_uring, int bam_read_threads){
+  if (prefetch_ranges > 0){
+    if (bam_processor.num_threads() > 1)
+      printErrorAndDie("--prefetch-ranges can only be used with a single thread");
+    reader.EnableRangePrefetch(prefetch_ranges, BamCramMultiReader::DEFAULT_PREFETCH_THREADS, BamCramMultiReader::DEFAULT_PREFETCH_CACHE_MB,
+			       BamCramMultiReader::DEFAULT_MAX_RANGE_GAP, prefetch_io_uring);
+  }
+  else if (prefetch_io_uring)
+    printErrorAndDie("--prefetch-io-uring requires the --prefetch-ranges option");
+  if (stream_bams)
+    reader.EnableStreaming();
+
+  // Genotyping pairs the reads by name and filters them using their RG, HP (10X) and alternate mapping (XA, AS and XS) tags,
+  // so CRAM decoding can skip the template lengths and the regenerated MD and NM tags. The --pass-bam and --filt-bam files
+  // contain complete records, so all of the fields are decoded when they're requested
+  if (!full_records)
+    reader.SetRequiredFields(SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_SEQ | SAM_QUAL | SAM_AUX, false);
+  if (bam_threads > 0)
+    reader.CreateThreadPool(bam_threads);
+  if (bam_read_threads > 0){
+    if (max_open_bams > 0 || prefetch_ranges > 0)
+      printErrorAndDie("--bam-read-threads can't be combined with --max-open-bams or --prefetch-ranges");
+    reader.EnableConcurrentReads(bam_read_threads);
+  }
+}
+
+// Map the read group IDs in the headers of the BAM files to their samples and libraries, which are also stored in RG_SAMPLES and RG_LIBS
+void load_bam_read_groups(BamCramMultiReader& reader, const std::vector<std::string>& bam_files, int bam_lib_from_samp,
+			  std::set<std::string>& rg_samples, std::set<std::string>& rg_libs,
+			  std::map<std::string, std::string>& rg_ids_to_sample, std::map<std::string, std::string>& rg_ids_to_library){
+  for (unsigned int i = 0; i < bam_files.size(); i++){
+    const std::vector<ReadGroup>& read_groups = reader.read_groups(i);
+    if (read_groups.empty())
+      printErrorAndDie("Provided BAM files don't contain read groups in the header and the --bam-samps flag was not specified");
+
+    for (auto rg_iter = read_groups.begin(); rg_iter != read_groups.end(); rg_iter++){
+      if (!rg_iter->HasID())     printErrorAndDie("RG in BAM header is lacking the ID tag");
+      if (!rg_iter->HasSample()) printErrorAndDie("RG in BAM header is lacking the SM tag");
+      if ((bam_lib_from_samp == 0) && !rg_iter->HasLibrary())
+	printErrorAndDie("RG in BAM header is lacking the LB tag");
+      std::string rg_library = (bam_lib_from_samp == 0 ? rg_iter->GetLibrary() : rg_iter->GetSample());
+
+      // Ensure that there aren't identical read group ids that map to different samples or libraries
+      if (rg_ids_to_sample.find(rg_iter->GetID()) != rg_ids_to_sample.end())
+	if (rg_ids_to_sample[rg_iter->GetID()].compare(rg_iter->GetSample()) != 0)
+	  printErrorAndDie("Read group id " + rg_iter->GetID() + " maps to more than one sample");
+      if (rg_ids_to_library.find(rg_iter->GetID()) != rg_ids_to_library.end())
+	if (rg_ids_to_library[rg_iter->GetID()].compare(rg_library) != 0)
+	  printErrorAndDie("Read group id " + rg_iter->GetID() + " maps to more than one library");
+
+      rg_ids_to_sample[bam_files[i] + rg_iter->GetID()]  = rg_iter->GetSample();
+      rg_ids_to_library[bam_files[i] + rg_iter->GetID()] = rg_library;
+      rg_samples.insert(rg_iter->GetSample());
+      rg_libs.insert(rg_library);
+    }
+  }
 }
 
 int main(int argc, char** argv){
-  double total_time = clock();
+  double total_time = ProcessTimer::wall_clock(), total_cpu_time = clock();
   precompute_integer_logs(); // Calculate and cache log of integers from 1 -> 999
 
   std::stringstream full_command_ss;
@@ -317,12 +1023,17 @@ int main(int argc, char** argv){
   std::string bamfile_string="", bamlist_string="", rg_sample_string="", rg_lib_string="", hap_chr_string="", hap_chr_file="";
   std::string region_file="", fasta_dir="", chrom="", snp_vcf_file="";
   std::string bam_pass_out_file="", bam_filt_out_file="", str_vcf_out_file="", fam_file = "", log_file = "";
+  std::string str_columns_prefix="";
+  int str_columns_loci = 10000;
   int output_gls = 0, output_pls = 0, output_phased_gls = 0, output_all_reads = 1, output_mall_reads = 1;
   std::string ref_vcf_file="";
+  int stream_bams = 0, bam_threads = 0, bam_out_threads = 1, bam_out_level = -1, max_open_bams = 0, prefetch_ranges = 0, prefetch_io_uring = 0, bam_read_threads = 0;
+  std::string bam_header_cache = "", bam_index_cache = "", serve_socket = "";
   parse_command_line_args(argc, argv, bamfile_string, bamlist_string, rg_sample_string, rg_lib_string, hap_chr_string, hap_chr_file, fasta_dir, region_file, snp_vcf_file, chrom,
-			  bam_pass_out_file, bam_filt_out_file, str_vcf_out_file, fam_file, log_file, use_all_reads, remove_pcr_dups, bams_from_10x,
+			  bam_pass_out_file, bam_filt_out_file, str_vcf_out_file, fam_file, log_file, str_columns_prefix, str_columns_loci,
+			  use_all_reads, remove_pcr_dups, bams_from_10x,
 			  bam_lib_from_samp, def_stutter_model, skip_genotyping, output_gls, output_pls, output_phased_gls, output_all_reads, output_mall_reads,
-			  ref_vcf_file, bam_processor);
+			  ref_vcf_file, stream_bams, bam_threads, bam_out_threads, bam_out_level, max_open_bams, bam_header_cache, bam_index_cache, prefetch_ranges, prefetch_io_uring, bam_read_threads, serve_socket, bam_processor);
 
   if (!log_file.empty())
     bam_processor.set_log(log_file);
@@ -339,7 +1050,13 @@ int main(int argc, char** argv){
   if (remove_pcr_dups == 0)   bam_processor.allow_pcr_dups();
   if (def_stutter_model == 1) bam_processor.set_default_stutter_model(0.95, 0.05, 0.05, 0.95, 0.01, 0.01);
 
-  if (bamfile_string.empty() && bamlist_string.empty())
+  if (!serve_socket.empty()){
+    if (!bamfile_string.empty() || !bamlist_string.empty())
+      printErrorAndDie("The --bams and --bam-files options can't be used with --serve, as the BAM files are provided by each request");
+    if (!rg_sample_string.empty())
+      printErrorAndDie("--serve is not supported in conjunction with the --bam-samps option");
+  }
+  else if (bamfile_string.empty() && bamlist_string.empty())
     printErrorAndDie("You must specify either the --bams or --bam-files option");
   else if ((!bamfile_string.empty()) && (!bamlist_string.empty()))
     printErrorAndDie("You can only specify one of the --bams or --bam-files options");
@@ -347,7 +1064,7 @@ int main(int argc, char** argv){
     printErrorAndDie("--region option required");
   else if (fasta_dir.empty())
     printErrorAndDie("--fasta option required");
-  else if (!skip_genotyping && str_vcf_out_file.empty())
+  else if (!skip_genotyping && str_vcf_out_file.empty() && str_columns_prefix.empty() && !bam_processor.using_work_queue() && serve_socket.empty())
     printErrorAndDie("--str-vcf option required");
 
   std::vector<std::string> bam_files;
@@ -367,77 +1084,22 @@ int main(int argc, char** argv){
 	bam_files.push_back(line);
     input.close();
   }
-  bam_processor.logger() << "Detected " << bam_files.size() << " BAM files" << std::endl;
-
-  // Open all BAM files
-  std::string cram_fasta_path = "";
-  int merge_type = BamCramMultiReader::ORDER_ALNS_BY_FILE;
-  BamCramMultiReader reader(bam_files, cram_fasta_path, merge_type);
-
-  // Construct filename->read group map (if one has been specified) and determine the list
-  // of samples of interest based on either the specified names or the RG tags in the BAM headers
-  std::set<std::string> rg_samples, rg_libs;
-  std::map<std::string, std::string> rg_ids_to_sample, rg_ids_to_library;
-  if (!rg_sample_string.empty()){
-    if ((bam_lib_from_samp == 0) && rg_lib_string.empty())
-      printErrorAndDie("--bam-libs option required when --bam-samps option specified");
-
-    std::vector<std::string> read_groups, libraries;
-    split_by_delim(rg_sample_string, ',', read_groups);
-    split_by_delim(rg_lib_string, ',', libraries);
-    if (bam_files.size() != read_groups.size())
-      printErrorAndDie("Number of BAM files in --bams and samples in --bam-samps must match");
-    if ((bam_lib_from_samp == 0) && (bam_files.size() != libraries.size()))
-      printErrorAndDie("Number of BAM files in --bams and libraries in --bam-libs must match");
-
-    for (unsigned int i = 0; i < bam_files.size(); i++){
-      rg_ids_to_sample[bam_files[i]]  = read_groups[i];
-      rg_ids_to_library[bam_files[i]] = (bam_lib_from_samp == 0 ? libraries[i]: read_groups[i]);
-      rg_samples.insert(read_groups[i]);
-    }
-    bam_processor.use_custom_read_groups();
-    bam_processor.logger() << "User-specified read groups for " << rg_samples.size() << " unique samples" << std::endl;
-  }
-  else {
-    for (unsigned int i = 0; i < bam_files.size(); i++){
-      const std::vector<ReadGroup>& read_groups = reader.bam_header(i)->read_groups();
-      if (read_groups.empty())
-	printErrorAndDie("Provided BAM files don't contain read groups in the header and the --bam-samps flag was not specified");
-
-      for (auto rg_iter = read_groups.begin(); rg_iter != read_groups.end(); rg_iter++){
-	if (!rg_iter->HasID())     printErrorAndDie("RG in BAM header is lacking the ID tag");
-	if (!rg_iter->HasSample()) printErrorAndDie("RG in BAM header is lacking the SM tag");
-	if ((bam_lib_from_samp == 0) && !rg_iter->HasLibrary())
-	  printErrorAndDie("RG in BAM header is lacking the LB tag");
-	std::string rg_library = (bam_lib_from_samp == 0 ? rg_iter->GetLibrary() : rg_iter->GetSample());
-
-	// Ensure that there aren't identical read group ids that map to different samples or libraries
-	if (rg_ids_to_sample.find(rg_iter->GetID()) != rg_ids_to_sample.end())
-	  if (rg_ids_to_sample[rg_iter->GetID()].compare(rg_iter->GetSample()) != 0)
-	    printErrorAndDie("Read group id " + rg_iter->GetID() + " maps to more than one sample");
-	if (rg_ids_to_library.find(rg_iter->GetID()) != rg_ids_to_library.end())
-	  if (rg_ids_to_library[rg_iter->GetID()].compare(rg_library) != 0)
-	    printErrorAndDie("Read group id " + rg_iter->GetID() + " maps to more than one library");
-
-	rg_ids_to_sample[bam_files[i] + rg_iter->GetID()]  = rg_iter->GetSample();
-	rg_ids_to_library[bam_files[i] + rg_iter->GetID()] = rg_library;
-	rg_samples.insert(rg_iter->GetSample());
-	rg_libs.insert(rg_library);
-      }
-    }
+  if (serve_socket.empty())
+    bam_processor.logger() << "Detected " << bam_files.size() << " BAM files" << std::endl;
 
-    bam_processor.logger() << "BAMs contain unique read group IDs for "
-			   << rg_libs.size()    << " unique libraries and "
-			   << rg_samples.size() << " unique samples" << std::endl;
+  // A file streamed from stdin can only be read once, in order, by a single reader
+  int num_stdin_bams = std::count(bam_files.begin(), bam_files.end(), "-");
+  if (num_stdin_bams > 1)
+    printErrorAndDie("Only one of the BAM files can be read from stdin");
+  if (num_stdin_bams == 1){
+    if (bam_processor.num_threads() > 1)
+      printErrorAndDie("A BAM file read from stdin can't be used with --threads > 1, as each thread reads the files independently");
+    if (max_open_bams > 0 || prefetch_ranges > 0 || bam_read_threads > 0)
+      printErrorAndDie("A BAM file read from stdin can't be used with the --max-open-bams, --prefetch-ranges or --bam-read-threads options");
+    if (bam_processor.using_work_queue())
+      printErrorAndDie("A BAM file read from stdin can't be used with --work-dir");
   }
-
-  BamWriter* bam_pass_writer = NULL;
-  if (!bam_pass_out_file.empty())
-    bam_pass_writer = new BamWriter(bam_pass_out_file, reader.bam_header());
-
-  BamWriter* bam_filt_writer = NULL;
-  if (!bam_filt_out_file.empty())
-    bam_filt_writer = new BamWriter(bam_filt_out_file, reader.bam_header());
+  bam_processor.logger() << "Using the " << align_row_kernel_name() << " alignment kernels" << std::endl;
 
   if (!ref_vcf_file.empty()){
     if (!string_ends_with(ref_vcf_file, ".gz"))
@@ -452,7 +1114,11 @@ int main(int argc, char** argv){
 	printErrorAndDie("No .tbi index found for the ref VCF file. Please index using tabix and rerun HipSTR");
 
     bam_processor.set_ref_vcf(ref_vcf_file);
+    if (!bam_processor.ref_allele_index_file().empty())
+      bam_processor.load_ref_allele_index();
   }
+  else if (!bam_processor.ref_allele_index_file().empty())
+    printErrorAndDie("--ref-vcf-index requires a reference VCF via the --ref-vcf option");
 
   if (!snp_vcf_file.empty()){
     if (!string_ends_with(snp_vcf_file, ".gz"))
@@ -466,14 +1132,11 @@ int main(int argc, char** argv){
     if (!file_exists(snp_vcf_file + ".tbi"))
 	printErrorAndDie("No .tbi index found for the SNP VCF file. Please index using tabix and rerun HipSTR");
 
-    bam_processor.set_input_snp_vcf(snp_vcf_file);
-  }
-
-  if (!skip_genotyping){
-    if (!string_ends_with(str_vcf_out_file, ".gz"))
-      printErrorAndDie("Path for STR VCF output file must end in .gz as it will be bgzipped");
-    bam_processor.set_output_str_vcf(str_vcf_out_file, full_command, rg_samples);
+    if (!bam_processor.snp_panel_file().empty() && !fam_file.empty())
+      printErrorAndDie("The --snp-vcf-panel option can't be used with --fam, as the panel doesn't retain the genotypes required for pedigree-based filtering");
   }
+  else if (!bam_processor.snp_panel_file().empty())
+    printErrorAndDie("--snp-vcf-panel requires a SNP VCF via the --snp-vcf option");
 
   if (!hap_chr_string.empty()){
     std::vector<std::string> haploid_chroms;
@@ -499,26 +1162,152 @@ int main(int argc, char** argv){
     if (snp_vcf_file.empty())
       printErrorAndDie("--fam option only applies if --snp-vcf option has been specified as well");
 
-    // Determine what samples are in the SNP VCF
+    // Restrict the pedigree to the samples in the SNP VCF
     VCF::VCFReader snp_vcf(snp_vcf_file);
-    std::set<std::string> samples_with_data(snp_vcf.get_samples().begin(), snp_vcf.get_samples().end());
-
     std::vector<NuclearFamily> families;
-    extract_pedigree_nuclear_families(fam_file, samples_with_data, families, bam_processor.logger());
+    extract_pedigree_nuclear_families(fam_file, {&snp_vcf}, families, bam_processor.logger());
     if (families.size() != 0)
       bam_processor.use_pedigree_to_filter_snps(families, snp_vcf_file);
   }
 
+  // CRAM files are decoded using the FASTA reference, provided that it's a single file rather than a directory
+  struct stat fasta_stat;
+  std::string cram_fasta_path = ((stat(fasta_dir.c_str(), &fasta_stat) == 0 && S_ISREG(fasta_stat.st_mode)) ? fasta_dir : "");
+  int merge_type = BamCramMultiReader::ORDER_ALNS_BY_FILE;
+  bool full_records = (!bam_pass_out_file.empty() || !bam_filt_out_file.empty());
+
+  // Keep the regions and their reference windows in memory and genotype the BAMs in each request in a forked process
+  // that inherits them, along with the stutter models and reference VCF index loaded above
+  if (!serve_socket.empty()){
+    std::vector<Region> regions;
+    bam_processor.load_regions(region_file, 1000000, chrom, regions);
+    bam_processor.preload_reference(fasta_dir, regions);
+    GenotypingService service(serve_socket);
+    service.run([&](ServiceRequest& request){
+	BamCramMultiReader reader(request.bam_files, cram_fasta_path, merge_type, max_open_bams, bam_header_cache, bam_index_cache);
+	configure_bam_reader(reader, bam_processor, full_records, stream_bams, bam_threads, max_open_bams, prefetch_ranges, prefetch_io_uring, bam_read_threads);
+	std::set<std::string> rg_samples, rg_libs;
+	std::map<std::string, std::string> rg_ids_to_sample, rg_ids_to_library;
+	load_bam_read_groups(reader, request.bam_files, bam_lib_from_samp, rg_samples, rg_libs, rg_ids_to_sample, rg_ids_to_library);
+	if (!snp_vcf_file.empty())
+	  bam_processor.set_input_snp_vcf(snp_vcf_file, rg_samples);
+
+	std::string vcf_file = "-";
+	std::vector<std::string> chroms;
+	bam_processor.set_output_str_vcf(vcf_file, full_command, rg_samples, chroms);
+	std::vector<Region> selected;
+	request.select_regions(regions, selected);
+	bam_processor.process_loaded_regions(reader, selected, fasta_dir, rg_ids_to_sample, rg_ids_to_library, std::cout);
+	bam_processor.finish();
+	return 0;
+      }, bam_processor.logger());
+    return 0;
+  }
+
+  // A single locus is dominated by the latency of opening each file and seeking to the locus, so both use a bounded pool of threads
+  const int LOCUS_IO_THREADS = 16;
+  int open_threads = 1;
+  if (bam_processor.single_locus()){
+    open_threads = std::min(LOCUS_IO_THREADS, (int)bam_files.size());
+    if (bam_read_threads == 0 && max_open_bams == 0 && prefetch_ranges == 0 && num_stdin_bams == 0 && bam_files.size() > 1)
+      bam_read_threads = open_threads;
+  }
+
+  // Open all BAM files
+  BamCramMultiReader reader(bam_files, cram_fasta_path, merge_type, max_open_bams, bam_header_cache, bam_index_cache, open_threads);
+  configure_bam_reader(reader, bam_processor, full_records, stream_bams, bam_threads, max_open_bams, prefetch_ranges, prefetch_io_uring, bam_read_threads);
+
+  // Construct filename->read group map (if one has been specified) and determine the list
+  // of samples of interest based on either the specified names or the RG tags in the BAM headers
+  std::set<std::string> rg_samples, rg_libs;
+  std::map<std::string, std::string> rg_ids_to_sample, rg_ids_to_library;
+  if (!rg_sample_string.empty()){
+    if ((bam_lib_from_samp == 0) && rg_lib_string.empty())
+      printErrorAndDie("--bam-libs option required when --bam-samps option specified");
+
+    std::vector<std::string> read_groups, libraries;
+    split_by_delim(rg_sample_string, ',', read_groups);
+    split_by_delim(rg_lib_string, ',', libraries);
+    if (bam_files.size() != read_groups.size())
+      printErrorAndDie("Number of BAM files in --bams and samples in --bam-samps must match");
+    if ((bam_lib_from_samp == 0) && (bam_files.size() != libraries.size()))
+      printErrorAndDie("Number of BAM files in --bams and libraries in --bam-libs must match");
+
+    for (unsigned int i = 0; i < bam_files.size(); i++){
+      rg_ids_to_sample[bam_files[i]]  = read_groups[i];
+      rg_ids_to_library[bam_files[i]] = (bam_lib_from_samp == 0 ? libraries[i]: read_groups[i]);
+      rg_samples.insert(read_groups[i]);
+    }
+    bam_processor.use_custom_read_groups();
+    bam_processor.logger() << "User-specified read groups for " << rg_samples.size() << " unique samples" << std::endl;
+  }
+  else {
+    load_bam_read_groups(reader, bam_files, bam_lib_from_samp, rg_samples, rg_libs, rg_ids_to_sample, rg_ids_to_library);
+    bam_processor.logger() << "BAMs contain unique read group IDs for "
+			   << rg_libs.size()    << " unique libraries and "
+			   << rg_samples.size() << " unique samples" << std::endl;
+  }
+
+  // The reads are tagged, compressed and written by threads dedicated to each BAM file, so that writing them doesn't delay genotyping
+  const size_t MAX_QUEUED_BAM_RECORDS = 100000;
+  BamWriter* bam_pass_writer = NULL;
+  if (!bam_pass_out_file.empty())
+    bam_pass_writer = new BamWriter(bam_pass_out_file, reader.bam_header(), bam_out_level);
+
+  BamWriter* bam_filt_writer = NULL;
+  if (!bam_filt_out_file.empty())
+    bam_filt_writer = new BamWriter(bam_filt_out_file, reader.bam_header(), bam_out_level);
+
+  BamWriter* bam_writers[2] = {bam_pass_writer, bam_filt_writer};
+  for (int i = 0; i < 2; i++){
+    if (bam_writers[i] == NULL)
+      continue;
+    if (bam_out_threads > 1 && !bam_writers[i]->SetNumThreads(bam_out_threads))
+      printErrorAndDie("Failed to create the compression threads for the BAM output file");
+    bam_writers[i]->EnableAsyncWrites(MAX_QUEUED_BAM_RECORDS);
+  }
+
+  if (!snp_vcf_file.empty())
+    bam_processor.set_input_snp_vcf(snp_vcf_file, rg_samples);
+
+  if (!skip_genotyping){
+    if (!str_vcf_out_file.empty() && !string_ends_with(str_vcf_out_file, ".gz") && !string_ends_with(str_vcf_out_file, ".bcf"))
+      printErrorAndDie("Path for STR VCF output file must end in .gz as it will be bgzipped, or in .bcf for BCF output");
+
+    // The BCF header must list the chromosomes of the regions
+    std::vector<std::string> chroms;
+    if (string_ends_with(str_vcf_out_file, ".bcf")){
+      if (bam_processor.using_work_queue())
+	printErrorAndDie("--work-dir only supports bgzipped VCF output for the --str-vcf option");
+      std::vector<Region> regions;
+      std::stringstream region_log;
+      loadSortedRegions(region_file, bam_processor.region_catalog_path(), -1, chrom, bam_processor.chrom_list(), 0, 0, regions, region_log);
+      for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++)
+	if (chroms.empty() || chroms.back().compare(region_iter->chrom()) != 0)
+	  chroms.push_back(region_iter->chrom());
+    }
+    if (!str_vcf_out_file.empty() || bam_processor.using_work_queue())
+      bam_processor.set_output_str_vcf(str_vcf_out_file, full_command, rg_samples, chroms);
+    if (!str_columns_prefix.empty())
+      bam_processor.set_output_str_columns(str_columns_prefix, str_columns_loci, rg_samples);
+  }
+
   // Run analysis
   bam_processor.process_regions(reader, region_file, fasta_dir, rg_ids_to_sample, rg_ids_to_library, bam_pass_writer, bam_filt_writer, std::cout, 1000000, chrom);
   bam_processor.finish();
+  int64_t num_dropped_events = TraceRecorder::instance().write();
+  if (num_dropped_events != 0)
+    bam_processor.logger() << "WARNING: Discarded the " << num_dropped_events << " oldest events from the trace output as the per-thread buffers were full" << std::endl;
+  if (SamplingProfiler::enabled())
+    bam_processor.logger() << "Wrote " << SamplingProfiler::write() << " CPU profile samples" << std::endl;
 
   if (bam_pass_writer != NULL) delete bam_pass_writer;
   if (bam_filt_writer != NULL) delete bam_filt_writer;
 
 
-  total_time = (clock() - total_time)/CLOCKS_PER_SEC;
-  bam_processor.logger() << "HipSTR execution finished: Total runtime = " << total_time << " sec" << "\n"
+  total_time     = ProcessTimer::wall_clock() - total_time;
+  total_cpu_time = (clock() - total_cpu_time)/CLOCKS_PER_SEC;
+  bam_processor.logger() << "HipSTR execution finished: Total runtime = " << total_time << " sec (CPU = " << total_cpu_time << " sec)" << "\n"
 			 << "-----------------\n\n" << std::endl;
   return 0;  
 }
@@ -0,0 +1,122 @@
+#ifndef IO_THROUGHPUT_STATS_H_
+#define IO_THROUGHPUT_STATS_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "process_timer.h"
+
+/*
+ * Throughput of the I/O phases measured in --io-only mode, in which the reads for each region are extracted, filtered,
+ * deduplicated and (if a SNP VCF is provided) phased, but not genotyped. Used to size nodes and storage before a large run
+ * and to identify slow files. Each thread records its statistics in its own instance, which are merged using add()
+ */
+class IOThroughputStats {
+ private:
+  struct FileSeeks {
+    int64_t num_seeks;
+    double total_time, max_time;
+    std::string max_region; // Region whose seek was the slowest
+    FileSeeks() : num_seeks(0), total_time(0), max_time(0) {}
+  };
+
+  std::vector<std::string> files_;
+  std::vector<FileSeeks> file_seeks_;
+
+  static double rate(double amount, double seconds){ return (seconds > 0 ? amount/seconds : 0); }
+
+ public:
+  int64_t num_loci;    // Loci whose reads were prepared
+  int64_t num_fetched; // Reads decoded from the files, including those discarded by the filters
+  int64_t num_bytes;   // Decompressed sizes of the BAM records for these reads
+  int64_t num_dedup;   // Reads passed to PCR duplicate removal
+  double dedup_time;   // Wall-clock seconds spent removing PCR duplicates
+
+  IOThroughputStats(){
+    num_loci   = num_fetched = num_bytes = num_dedup = 0;
+    dedup_time = 0;
+  }
+
+  // Record the time each file required to seek to REGION, where files with a negative time weren't timed
+  void add_seeks(const std::vector<std::string>& files, const std::vector<double>& seek_times, const std::string& region){
+    if (files_.empty()){
+      files_ = files;
+      file_seeks_.resize(files.size());
+    }
+    for (size_t i = 0; i < seek_times.size() && i < file_seeks_.size(); i++){
+      if (seek_times[i] < 0)
+	continue;
+      FileSeeks& seeks = file_seeks_[i];
+      seeks.num_seeks++;
+      seeks.total_time += seek_times[i];
+      if (seek_times[i] > seeks.max_time){
+	seeks.max_time   = seek_times[i];
+	seeks.max_region = region;
+      }
+    }
+  }
+
+  void add(const IOThroughputStats& other){
+    num_loci    += other.num_loci;
+    num_fetched += other.num_fetched;
+    num_bytes   += other.num_bytes;
+    num_dedup   += other.num_dedup;
+    dedup_time  += other.dedup_time;
+    if (files_.empty()){
+      files_ = other.files_;
+      file_seeks_.resize(files_.size());
+    }
+    for (size_t i = 0; i < other.file_seeks_.size() && i < file_seeks_.size(); i++){
+      const FileSeeks& seeks = other.file_seeks_[i];
+      file_seeks_[i].num_seeks  += seeks.num_seeks;
+      file_seeks_[i].total_time += seeks.total_time;
+      if (seeks.max_time > file_seeks_[i].max_time){
+	file_seeks_[i].max_time   = seeks.max_time;
+	file_seeks_[i].max_region = seeks.max_region;
+      }
+    }
+  }
+
+  /*
+   * Writes the throughput of each phase, using the summed wall-clock times in TIMER, and of the entire run, using its ELAPSED
+   * wall-clock time, followed by the MAX_FILES files with the slowest individual seeks. With multiple threads, the per-phase
+   * rates are those of a single thread, while the overall rates reflect all of the threads
+   */
+  void print(const ProcessTimer& timer, double elapsed, bool snp_phasing, int max_files, std::ostream& out) const {
+    double seek_time = timer.wall_time(PHASE_BAM_SEEK), filter_time = timer.wall_time(PHASE_READ_FILTER);
+    double snp_time  = timer.wall_time(PHASE_SNP_INFO), megabytes   = num_bytes/1048576.0;
+    out << std::fixed << std::setprecision(2)
+	<< "I/O throughput for " << num_loci << " loci (" << num_fetched << " reads and " << megabytes << " MB of decompressed BAM records)\n"
+	<< "\t BAM seeks and read extraction = " << rate(megabytes, seek_time+filter_time) << " MB/s, "
+	<< rate(num_fetched, seek_time+filter_time) << " reads/s (" << seek_time << " seconds seeking, " << filter_time << " seconds filtering)\n"
+	<< "\t PCR duplicate removal         = " << rate(num_dedup, dedup_time) << " reads/s (" << dedup_time << " seconds)\n";
+    if (snp_phasing)
+      out << "\t SNP info extraction           = " << rate(num_loci, snp_time) << " loci/s (" << snp_time << " seconds)\n";
+    out << "\t Overall                       = " << rate(megabytes, elapsed) << " MB/s, " << rate(num_fetched, elapsed) << " reads/s, "
+	<< rate(num_loci, elapsed) << " loci/s (" << elapsed << " seconds elapsed)\n";
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < file_seeks_.size(); i++)
+      if (file_seeks_[i].num_seeks > 0)
+	order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){ return file_seeks_[a].max_time > file_seeks_[b].max_time; });
+    if (order.size() > (size_t)max_files)
+      order.resize(max_files);
+    if (!order.empty())
+      out << "Files with the slowest seeks:\n";
+    for (auto index_iter = order.begin(); index_iter != order.end(); index_iter++){
+      const FileSeeks& seeks = file_seeks_[*index_iter];
+      out << std::setprecision(3) << "\t " << files_[*index_iter] << ": slowest = " << 1000*seeks.max_time << " ms (" << seeks.max_region << "), mean = "
+	  << 1000*seeks.total_time/seeks.num_seeks << " ms over " << seeks.num_seeks << " seeks\n";
+    }
+    out << std::defaultfloat << std::setprecision(6);
+    out.flush();
+  }
+};
+
+#endif
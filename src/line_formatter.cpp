@@ -0,0 +1,97 @@
+#include "line_formatter.h"
+
+#include <math.h>
+#include <stdio.h>
+
+namespace {
+const char DIGIT_PAIRS[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+}
+
+void LineFormatter::append_uint(uint64_t value){
+  // Fill a scratch buffer from its end, two digits at a time
+  char digits[20];
+  char* ptr = digits + sizeof(digits);
+  while (value >= 100){
+    int pair = 2*(value % 100);
+    value   /= 100;
+    *--ptr   = DIGIT_PAIRS[pair+1];
+    *--ptr   = DIGIT_PAIRS[pair];
+  }
+  if (value >= 10){
+    *--ptr = DIGIT_PAIRS[2*value+1];
+    *--ptr = DIGIT_PAIRS[2*value];
+  }
+  else
+    *--ptr = (char)('0' + value);
+  append(ptr, digits + sizeof(digits) - ptr);
+}
+
+void LineFormatter::append_fixed2_slow(double value){
+  char text[512];
+  int length = snprintf(text, sizeof(text), "%.2f", value);
+  append(text, length);
+}
+
+void LineFormatter::append_fixed2(double value){
+  // Large values, NaNs and infinities are left to snprintf
+  double magnitude = fabs(value);
+  if (!(magnitude < 1e7)){
+    append_fixed2_slow(value);
+    return;
+  }
+
+  // For these magnitudes, the error in the scaled value is far below 1e-6, so rounding it to the nearest integer
+  // only disagrees with the exact decimal rounding when the value is within that distance of a tie
+  double scaled = magnitude*100;
+  double whole  = floor(scaled);
+  double frac   = scaled - whole;
+  if (fabs(frac - 0.5) < 1e-6){
+    append_fixed2_slow(value);
+    return;
+  }
+  uint64_t units = (uint64_t)whole + (frac > 0.5 ? 1 : 0);
+
+  // Negative values that round to zero retain their sign, as they do with printf
+  if (signbit(value))
+    append('-');
+  append_uint(units/100);
+  int pair = 2*(units % 100);
+  char* ptr = reserve_space(3);
+  ptr[0] = '.';
+  ptr[1] = DIGIT_PAIRS[pair];
+  ptr[2] = DIGIT_PAIRS[pair+1];
+  size_ += 3;
+}
+
+void LineFormatter::append_read_counts(const ReadCountHistogram& read_counts){
+  if (read_counts.empty()){
+    append('.');
+    return;
+  }
+
+  // The histogram's entries are already sorted in increasing order of the differences
+  for (auto entry_iter = read_counts.begin(); entry_iter != read_counts.end(); entry_iter++){
+    if (entry_iter != read_counts.begin())
+      append(';');
+    append_int(entry_iter->bp_diff);
+    append('|');
+    append_uint(entry_iter->count);
+  }
+}
+
+void LineFormatter::append_read_counts(const std::vector<int>& read_diffs){
+  ReadCountHistogram read_counts;
+  for (auto diff_iter = read_diffs.begin(); diff_iter != read_diffs.end(); diff_iter++)
+    read_counts.add(*diff_iter);
+  append_read_counts(read_counts);
+}
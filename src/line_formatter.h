@@ -0,0 +1,85 @@
+#ifndef LINE_FORMATTER_H_
+#define LINE_FORMATTER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "read_count_histogram.h"
+
+/*
+ * Builds a line of VCF text in a reusable character buffer. Integers are written using a table of two-digit pairs and
+ * floating point values are written with 2 fixed decimal places, producing the same text as an ostream configured with
+ * std::fixed and std::setprecision(2) without any of the stream's locale or formatting overhead
+ */
+class LineFormatter {
+ private:
+  std::vector<char> buffer_;
+  size_t size_;
+
+  char* reserve_space(size_t num_chars){
+    if (size_ + num_chars > buffer_.size())
+      buffer_.resize(std::max(2*buffer_.size(), size_ + num_chars));
+    return buffer_.data() + size_;
+  }
+
+  void append_fixed2_slow(double value);
+
+ public:
+  explicit LineFormatter(size_t capacity = 4096) : buffer_(capacity), size_(0){}
+
+  const char* data() const { return buffer_.data(); }
+  size_t size()      const { return size_;          }
+  void clear()             { size_ = 0;             }
+
+  // Ensure the buffer can hold at least CAPACITY characters without reallocation
+  void reserve(size_t capacity){
+    if (capacity > buffer_.size())
+      buffer_.resize(capacity);
+  }
+
+  void append(const char* text, size_t length){
+    memcpy(reserve_space(length), text, length);
+    size_ += length;
+  }
+
+  void append(char c){
+    *reserve_space(1) = c;
+    size_++;
+  }
+
+  void append_uint(uint64_t value);
+
+  void append_int(int64_t value){
+    if (value < 0){
+      append('-');
+      append_uint(0 - (uint64_t)value);
+    }
+    else
+      append_uint((uint64_t)value);
+  }
+
+  // Write the value rounded to 2 decimal places, matching printf's %.2f
+  void append_fixed2(double value);
+
+  // Write the read counts for each base pair difference in the same format as Genotyper::condense_read_counts
+  void append_read_counts(const ReadCountHistogram& read_counts);
+  void append_read_counts(const std::vector<int>& read_diffs);
+
+  LineFormatter& operator<<(const char* text)        { append(text, strlen(text));       return *this; }
+  LineFormatter& operator<<(const std::string& text) { append(text.data(), text.size()); return *this; }
+  LineFormatter& operator<<(char c)                  { append(c);                        return *this; }
+  LineFormatter& operator<<(int value)               { append_int(value);                return *this; }
+  LineFormatter& operator<<(long value)              { append_int(value);                return *this; }
+  LineFormatter& operator<<(long long value)         { append_int(value);                return *this; }
+  LineFormatter& operator<<(unsigned int value)      { append_uint(value);               return *this; }
+  LineFormatter& operator<<(unsigned long value)     { append_uint(value);               return *this; }
+  LineFormatter& operator<<(unsigned long long value){ append_uint(value);               return *this; }
+  LineFormatter& operator<<(double value)            { append_fixed2(value);             return *this; }
+  LineFormatter& operator<<(float value)             { append_fixed2(value);             return *this; }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef LOCUS_ARENA_H_
+#define LOCUS_ARENA_H_
+
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "error.h"
+
+/*
+ * Monotonic buffer for arrays whose lifetime is bounded by the analysis of a single locus. Allocations simply
+ * bump an offset into a list of large blocks and are never freed individually. Objects using the arena
+ * register with acquire() and unregister with release(); once the last one has been released, the entire
+ * arena is recycled in O(1) while retaining its blocks for the next locus. Each thread has its own arena,
+ * so workers analyzing different loci never contend for it
+ */
+class LocusArena {
+ private:
+  static const size_t BLOCK_SIZE = 1 << 20;
+  static const size_t ALIGNMENT  = 16;
+
+  std::vector< std::pair<char*, size_t> > blocks_;
+  size_t block_index_; // Block from which allocations are currently drawn
+  size_t offset_;      // Number of bytes used in the current block
+  size_t bytes_used_;  // Number of bytes allocated since the arena was last recycled
+  int num_users_;
+
+  char* allocate_bytes(size_t num_bytes){
+    num_bytes    = (num_bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    bytes_used_ += num_bytes;
+    while (block_index_ < blocks_.size() && offset_ + num_bytes > blocks_[block_index_].second){
+      block_index_++;
+      offset_ = 0;
+    }
+    if (block_index_ == blocks_.size()){
+      size_t block_size = (num_bytes > BLOCK_SIZE ? num_bytes : (size_t)BLOCK_SIZE);
+      char* block = (char*)malloc(block_size);
+      if (block == NULL)
+	printErrorAndDie("Failed to allocate memory for the locus arena");
+      blocks_.push_back(std::pair<char*, size_t>(block, block_size));
+      offset_ = 0;
+    }
+    char* ptr = blocks_[block_index_].first + offset_;
+    offset_  += num_bytes;
+    return ptr;
+  }
+
+ public:
+  LocusArena(){
+    block_index_ = 0;
+    offset_      = 0;
+    bytes_used_  = 0;
+    num_users_   = 0;
+  }
+
+  ~LocusArena(){
+    for (auto iter = blocks_.begin(); iter != blocks_.end(); iter++)
+      free(iter->first);
+  }
+
+  /* Returns uninitialized storage for N elements of the trivially destructible type T */
+  template<typename T> T* allocate(size_t n){
+    assert(num_users_ > 0);
+    return reinterpret_cast<T*>(allocate_bytes(std::max((size_t)1, n)*sizeof(T)));
+  }
+
+  void acquire(){ num_users_++; }
+
+  void release(){
+    assert(num_users_ > 0);
+    if (--num_users_ == 0){
+      block_index_ = 0;
+      offset_      = 0;
+      bytes_used_  = 0;
+    }
+  }
+
+  /* As allocations are never freed, this is also the peak usage since the arena was last recycled */
+  size_t bytes_used() const { return bytes_used_; }
+
+  static LocusArena& thread_arena(){
+    static thread_local LocusArena arena;
+    return arena;
+  }
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <queue>
+#include <sstream>
+
+#include "bgzf_streams.h"
+#include "error.h"
+#include "locus_cost.h"
+#include "stringops.h"
+
+ReadCountEstimator::ReadCountEstimator(const std::vector<std::string>& paths){
+  for (auto path_iter = paths.begin(); path_iter != paths.end(); path_iter++){
+    IndexedFile file;
+    file.path = *path_iter;
+    if ((file.fp = hts_open(file.path.c_str(), "r")) == NULL)
+      printErrorAndDie("Failed to open file " + file.path);
+    if ((file.hdr = sam_hdr_read(file.fp)) == NULL)
+      printErrorAndDie("Failed to read the header for file " + file.path);
+    if ((file.idx = sam_index_load(file.fp, file.path.c_str())) == NULL)
+      printErrorAndDie("Failed to load the index for file " + file.path);
+
+    file.bytes_per_read = -1;
+    struct stat file_stats;
+    uint64_t total_reads = 0;
+    bool has_counts = !file.fp->is_cram;
+    for (int tid = 0; tid < file.hdr->n_targets && has_counts; tid++){
+      uint64_t mapped, unmapped;
+      if (hts_idx_get_stat(file.idx, tid, &mapped, &unmapped) == 0)
+	total_reads += mapped + unmapped;
+      else
+	has_counts = false;
+    }
+    if (has_counts && total_reads > 0 && stat(file.path.c_str(), &file_stats) == 0)
+      file.bytes_per_read = 1.0*file_stats.st_size/total_reads;
+    files_.push_back(file);
+  }
+}
+
+ReadCountEstimator::~ReadCountEstimator(){
+  for (auto file_iter = files_.begin(); file_iter != files_.end(); file_iter++){
+    hts_idx_destroy(file_iter->idx);
+    bam_hdr_destroy(file_iter->hdr);
+    hts_close(file_iter->fp);
+  }
+}
+
+int ReadCountEstimator::num_unestimated_files() const {
+  int count = 0;
+  for (auto file_iter = files_.begin(); file_iter != files_.end(); file_iter++)
+    if (file_iter->bytes_per_read <= 0)
+      count++;
+  return count;
+}
+
+double ReadCountEstimator::indexed_bytes(const IndexedFile& file, const Region& region){
+  int tid = bam_name2id(file.hdr, region.chrom().c_str());
+  if (tid < 0)
+    return 0;
+  hts_itr_t* iter = sam_itr_queryi(file.idx, tid, region.start(), region.stop());
+  if (iter == NULL)
+    return 0;
+
+  // Each virtual offset combines the offset of a BGZF block in the file with the offset within the uncompressed block
+  double num_bytes = 0;
+  for (int i = 0; i < iter->n_off; i++){
+    num_bytes += (double)(iter->off[i].v >> 16) - (double)(iter->off[i].u >> 16);
+    num_bytes += ((double)(iter->off[i].v & 0xFFFF) - (double)(iter->off[i].u & 0xFFFF))/BGZF_COMPRESSION_RATIO;
+  }
+  hts_itr_destroy(iter);
+  return std::max(0.0, num_bytes);
+}
+
+double ReadCountEstimator::estimate_reads(const Region& region){
+  double num_reads = 0;
+  for (auto file_iter = files_.begin(); file_iter != files_.end(); file_iter++)
+    if (file_iter->bytes_per_read > 0)
+      num_reads += indexed_bytes(*file_iter, region)/file_iter->bytes_per_read;
+  return num_reads;
+}
+
+double ReadCountEstimator::estimate_bytes(const Region& region){
+  double num_bytes = 0;
+  for (auto file_iter = files_.begin(); file_iter != files_.end(); file_iter++)
+    if (!file_iter->fp->is_cram)
+      num_bytes += indexed_bytes(*file_iter, region);
+  return num_bytes;
+}
+
+double predict_locus_cost(const Region& region, double num_reads){
+  const double HAP_FLANK_LENGTH = 50; // Approximate length of the flanks added to each haplotype
+  const double LOCUS_OVERHEAD   = 1e4;  // Cost of seeking to and filtering a locus' reads, independent of its depth
+  double str_length = region.stop() - region.start();
+  double copies     = str_length/region.period();
+  double hap_length = str_length + 2*HAP_FLANK_LENGTH;
+  double num_alleles = 1 + copies/4.0;
+  return LOCUS_OVERHEAD + (num_reads + 1)*hap_length*num_alleles;
+}
+
+void read_locus_stats_times(const std::string& stats_file, std::map<std::tuple<std::string, int32_t, int32_t>, double>& locus_times){
+  locus_times.clear();
+  bgzfistream input(stats_file.c_str());
+  std::string line;
+  if (!std::getline(input, line))
+    printErrorAndDie("Locus statistics file " + stats_file + " is empty");
+
+  // Identify the columns containing the times for each phase from the header
+  std::vector<std::string> columns;
+  split_by_delim(line, '\t', columns);
+  std::vector<int> time_columns;
+  for (unsigned int i = 0; i < columns.size(); i++)
+    if (string_ends_with(columns[i], "_TIME"))
+      time_columns.push_back(i);
+  if (columns.size() < 3 || columns[0].compare("CHROM") != 0 || time_columns.empty())
+    printErrorAndDie("Locus statistics file " + stats_file + " lacks the header produced by HipSTR's --locus-stats option");
+
+  while (std::getline(input, line)){
+    std::vector<std::string> fields;
+    split_by_delim(line, '\t', fields);
+    if (fields.size() != columns.size())
+      printErrorAndDie("Improperly formatted locus statistics file " + stats_file + "\n Bad line: " + line);
+    double total_time = 0;
+    for (auto col_iter = time_columns.begin(); col_iter != time_columns.end(); col_iter++)
+      total_time += atof(fields[*col_iter].c_str());
+    locus_times[std::make_tuple(fields[0], atoi(fields[1].c_str()), atoi(fields[2].c_str()))] = total_time;
+  }
+  input.close();
+}
+
+void partition_loci(const std::vector<double>& costs, const std::vector<size_t>& order, int num_shards, bool contiguous,
+		    std::vector<int>& shards){
+  if (num_shards < 1)
+    printErrorAndDie("The number of shards must be greater than 0");
+  shards.assign(costs.size(), 0);
+
+  if (contiguous){
+    // Assign each locus to the shard containing the midpoint of its cost in the cumulative cost of the ordered loci
+    double total_cost = 0;
+    for (auto iter = costs.begin(); iter != costs.end(); iter++)
+      total_cost += *iter;
+    double shard_cost = std::max(total_cost/num_shards, 1e-12), prefix = 0;
+    for (auto iter = order.begin(); iter != order.end(); iter++){
+      shards[*iter] = std::min(num_shards-1, (int)((prefix + 0.5*costs[*iter])/shard_cost));
+      prefix += costs[*iter];
+    }
+    return;
+  }
+
+  // Longest processing time first, with ties broken by the locus' position in the ordering so that the shards are reproducible
+  std::vector<size_t> by_cost(order);
+  std::stable_sort(by_cost.begin(), by_cost.end(), [&](size_t a, size_t b){ return costs[a] > costs[b]; });
+  typedef std::pair<double, int> ShardLoad;
+  std::priority_queue<ShardLoad, std::vector<ShardLoad>, std::greater<ShardLoad> > loads;
+  for (int i = 0; i < num_shards; i++)
+    loads.push(ShardLoad(0.0, i));
+  for (auto iter = by_cost.begin(); iter != by_cost.end(); iter++){
+    ShardLoad load = loads.top();
+    loads.pop();
+    shards[*iter] = load.second;
+    loads.push(ShardLoad(load.first + costs[*iter], load.second));
+  }
+}
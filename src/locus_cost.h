@@ -0,0 +1,80 @@
+#ifndef LOCUS_COST_H_
+#define LOCUS_COST_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "htslib/sam.h"
+
+#include "region.h"
+
+/*
+ * Estimates the number of reads overlapping a region in a set of BAM files without reading any alignments. The byte range
+ * spanned by the index bins that overlap the region is converted to a read count using the file's average bytes per read,
+ * which is derived from the file size and the mapped read counts stored in the index. As the finest bins span 16 kb, the
+ * estimate approximates the depth of the surrounding window rather than the exact number of reads overlapping a short region,
+ * which suffices to rank loci by their relative depths. CRAM indices don't provide these
+ * counts, so regions in CRAM files are assigned a read count of 0 and only their lengths and periods contribute to their costs
+ */
+class ReadCountEstimator {
+ private:
+  struct IndexedFile {
+    std::string path;
+    htsFile* fp;
+    bam_hdr_t* hdr;
+    hts_idx_t* idx;
+    double bytes_per_read; // Average compressed bytes per alignment, or -1 if unavailable
+  };
+
+  // Approximate ratio of uncompressed to compressed bytes for BAM records, used to weight offsets within a BGZF block
+  static constexpr double BGZF_COMPRESSION_RATIO = 3.0;
+
+  std::vector<IndexedFile> files_;
+
+  // Returns the compressed bytes spanned by the index bins of FILE that overlap the region
+  static double indexed_bytes(const IndexedFile& file, const Region& region);
+
+ public:
+  explicit ReadCountEstimator(const std::vector<std::string>& paths);
+
+  ~ReadCountEstimator();
+
+  /* Returns the estimated number of reads overlapping the region, summed across all of the files */
+  double estimate_reads(const Region& region);
+
+  /* Returns the estimated number of compressed alignment bytes overlapping the region, summed across all of the BAM files */
+  double estimate_bytes(const Region& region);
+
+  /* Returns the number of files for which read counts couldn't be estimated */
+  int num_unestimated_files() const;
+
+  ReadCountEstimator(const ReadCountEstimator&)            = delete;
+  ReadCountEstimator& operator=(const ReadCountEstimator&) = delete;
+};
+
+/*
+ * Returns the predicted cost of genotyping a locus in arbitrary units. Alignment dominates the runtime, and its cost is
+ * proportional to the number of reads times the haplotype length times the number of candidate alleles. Longer repeats with
+ * shorter periods produce more stutter and length variation, and therefore more candidate alleles
+ */
+double predict_locus_cost(const Region& region, double num_reads);
+
+/*
+ * Reads the total wall time for each locus in a table produced by HipSTR's --locus-stats option, keyed
+ * by the locus' chromosome, 1-based start and end coordinates
+ */
+void read_locus_stats_times(const std::string& stats_file, std::map<std::tuple<std::string, int32_t, int32_t>, double>& locus_times);
+
+/*
+ * Assigns each locus to one of NUM_SHARDS shards so that the shards have similar total costs. By default, loci are greedily
+ * assigned in decreasing order of cost to the shard with the smallest total. If CONTIGUOUS is true, each shard instead
+ * contains a range of consecutive loci in the provided ORDER, which keeps the loci in a shard close together in the genome
+ */
+void partition_loci(const std::vector<double>& costs, const std::vector<size_t>& order, int num_shards, bool contiguous,
+		    std::vector<int>& shards);
+
+#endif
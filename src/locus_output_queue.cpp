@@ -0,0 +1,48 @@
+#include "locus_output_queue.h"
+
+void LocusOutputQueue::run(){
+  while (true){
+    LocusOutput* output;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      output_ready_.wait(lock, [&]{ return pending_.find(next_index_) != pending_.end() || (finished_ && next_index_ >= num_loci_); });
+      auto iter = pending_.find(next_index_);
+      if (iter == pending_.end())
+	return;
+      output = iter->second;
+      pending_.erase(iter);
+    }
+
+    write_fn_(*output);
+    delete output;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      next_index_++;
+    }
+    slot_available_.notify_all();
+  }
+}
+
+void LocusOutputQueue::wait_for_slot(size_t index){
+  std::unique_lock<std::mutex> lock(mutex_);
+  slot_available_.wait(lock, [&]{ return index < next_index_ + max_pending_; });
+}
+
+void LocusOutputQueue::add(size_t index, LocusOutput* output){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_[index] = output;
+  }
+  output_ready_.notify_one();
+}
+
+void LocusOutputQueue::finish(size_t num_loci){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+    num_loci_ = num_loci;
+  }
+  output_ready_.notify_one();
+  writer_.join();
+}
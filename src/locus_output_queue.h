@@ -0,0 +1,73 @@
+#ifndef LOCUS_OUTPUT_QUEUE_H_
+#define LOCUS_OUTPUT_QUEUE_H_
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Text generated while processing a single locus. Output is buffered on a per-locus basis
+// so that loci analyzed concurrently can be written in their original order
+struct LocusOutput {
+  std::string log;
+  std::string str_vcf;
+  std::string str_columns;
+  std::string viz;
+  std::string stutter_models;
+  std::string stutter_table;
+  std::string locus_stats;
+  std::string skip_list;
+  std::string batch_summary;
+};
+
+/*
+ * Reorder buffer with a dedicated writer thread. Loci can be added in any order, but the writer thread
+ * passes them to the provided write function strictly in order of their locus index. As a result,
+ * the compression and flushing of the output files is moved off of the threads that genotype the loci
+ */
+class LocusOutputQueue {
+ private:
+  std::function<void(LocusOutput&)> write_fn_;
+  std::map<size_t, LocusOutput*> pending_;
+  size_t next_index_;  // Index of the next locus to be written
+  size_t num_loci_;    // Total number of loci. Only valid once finish() has been invoked
+  size_t max_pending_; // Maximum distance between the index of an added locus and the next locus to be written
+  bool finished_;
+
+  std::mutex mutex_;
+  std::condition_variable output_ready_, slot_available_;
+  std::thread writer_;
+
+  void run();
+
+ public:
+  LocusOutputQueue(std::function<void(LocusOutput&)> write_fn, size_t max_pending){
+    write_fn_    = write_fn;
+    next_index_  = 0;
+    num_loci_    = 0;
+    max_pending_ = max_pending;
+    finished_    = false;
+    writer_      = std::thread(&LocusOutputQueue::run, this);
+  }
+
+  ~LocusOutputQueue(){
+    if (writer_.joinable())
+      finish(0);
+    for (auto iter = pending_.begin(); iter != pending_.end(); iter++)
+      delete iter->second;
+  }
+
+  // Blocks until the locus with the provided index is close enough to the next locus to be written.
+  // Prevents a single slow locus from causing the output of every subsequent locus to accumulate in memory
+  void wait_for_slot(size_t index);
+
+  // Add the output for the locus with the provided index. The queue takes ownership of the pointer
+  void add(size_t index, LocusOutput* output);
+
+  // Blocks until the output for all NUM_LOCI loci has been written and then stops the writer thread
+  void finish(size_t num_loci);
+};
+
+#endif
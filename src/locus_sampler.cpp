@@ -0,0 +1,35 @@
+#include "locus_sampler.h"
+
+namespace {
+// 64-bit FNV-1a hash, followed by a final mix so that nearby coordinates map to unrelated values
+uint64_t hash_bytes(uint64_t hash, const char* bytes, size_t num_bytes){
+  for (size_t i = 0; i < num_bytes; i++){
+    hash ^= (unsigned char)bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t mix(uint64_t hash){
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+}
+
+bool LocusSampler::in_sample(const std::string& chrom, int32_t start, int32_t stop) const {
+  if (rate_ >= 1.0)
+    return true;
+  if (rate_ <= 0.0)
+    return false;
+  uint64_t hash = hash_bytes(14695981039346656037ULL, chrom.data(), chrom.size());
+  hash = hash_bytes(hash, reinterpret_cast<const char*>(&start), sizeof(start));
+  hash = hash_bytes(hash, reinterpret_cast<const char*>(&stop),  sizeof(stop));
+
+  // Use the top 53 bits as a uniform value in [0, 1)
+  double value = (mix(hash) >> 11)*(1.0/9007199254740992.0);
+  return value < rate_;
+}
@@ -0,0 +1,45 @@
+#ifndef LOCUS_SAMPLER_H_
+#define LOCUS_SAMPLER_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+
+/*
+ * Deterministically selects a fraction of loci using a hash of their coordinates, so that the same loci are selected
+ * regardless of the number of threads, the order in which the loci are analyzed or how the regions are split across runs.
+ * If a maximum number of loci is provided, only the first loci selected are retained. The count is shared by all copies
+ * of the sampler, so the limit applies across worker threads
+ */
+class LocusSampler {
+ private:
+  double rate_;
+  int64_t max_loci_; // 0 if unlimited
+  std::shared_ptr< std::atomic<int64_t> > num_selected_;
+
+ public:
+  LocusSampler(){
+    rate_         = 1.0;
+    max_loci_     = 0;
+    num_selected_ = std::make_shared< std::atomic<int64_t> >(0);
+  }
+
+  void set_rate(double rate)        { rate_     = rate;     }
+  void set_max_loci(int64_t max_loci){ max_loci_ = max_loci; }
+  bool samples_all()   const { return rate_ >= 1.0 && max_loci_ == 0; }
+  int64_t num_selected() const { return std::min<int64_t>(*num_selected_, max_loci_ > 0 ? max_loci_ : INT64_MAX); }
+
+  // Returns true iff the locus on CHROM with 0-based START and STOP is among the hashed fraction of loci
+  bool in_sample(const std::string& chrom, int32_t start, int32_t stop) const;
+
+  // Returns true iff the locus is in the sample and the maximum number of loci hasn't already been selected
+  bool select(const std::string& chrom, int32_t start, int32_t stop){
+    if (!in_sample(chrom, start, stop))
+      return false;
+    return (num_selected_->fetch_add(1) < max_loci_ || max_loci_ == 0);
+  }
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+
+#include "error.h"
+#include "locus_skip_list.h"
+#include "stringops.h"
+
+LocusSkipList::LocusSkipList(const std::string& path){
+  std::ifstream input(path.c_str());
+  if (!input.is_open())
+    printErrorAndDie("Failed to open the skip list file " + path);
+
+  num_loci_ = 0;
+  std::string line;
+  while (std::getline(input, line)){
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::vector<std::string> fields;
+    split_by_delim(line, '\t', fields);
+    if (fields.size() < 3)
+      printErrorAndDie("Improperly formatted skip list file " + path + "\n Bad line: " + line);
+    int32_t start = atoi(fields[1].c_str())-1, stop = atoi(fields[2].c_str());
+    if (start < 0 || stop <= start)
+      printErrorAndDie("Invalid coordinates in skip list file " + path + "\n Bad line: " + line);
+    intervals_[fields[0]].push_back(std::pair<int32_t, int32_t>(start, stop));
+    num_loci_++;
+  }
+  input.close();
+
+  // Merge overlapping loci so that each chromosome's intervals are disjoint and can be binary searched
+  for (auto chrom_iter = intervals_.begin(); chrom_iter != intervals_.end(); chrom_iter++){
+    std::vector< std::pair<int32_t, int32_t> >& intervals = chrom_iter->second;
+    std::sort(intervals.begin(), intervals.end());
+    size_t num_merged = 0;
+    for (size_t i = 1; i < intervals.size(); i++){
+      if (intervals[i].first <= intervals[num_merged].second)
+	intervals[num_merged].second = std::max(intervals[num_merged].second, intervals[i].second);
+      else
+	intervals[++num_merged] = intervals[i];
+    }
+    intervals.resize(num_merged+1);
+  }
+}
+
+bool LocusSkipList::contains(const Region& region) const {
+  auto chrom_iter = intervals_.find(region.chrom());
+  if (chrom_iter == intervals_.end())
+    return false;
+
+  // Find the last interval that starts before the region ends
+  const std::vector< std::pair<int32_t, int32_t> >& intervals = chrom_iter->second;
+  auto iter = std::lower_bound(intervals.begin(), intervals.end(), std::pair<int32_t, int32_t>(region.stop(), INT32_MIN));
+  if (iter == intervals.begin())
+    return false;
+  --iter;
+  return iter->second > region.start();
+}
+
+void LocusSkipList::write_header(std::ostream& out){
+  out << "#CHROM\tSTART\tEND\tREASON\tTIME\n";
+}
+
+void LocusSkipList::write_locus(const std::string& chrom, int32_t start, int32_t stop, const std::string& reason, double time, std::ostream& out){
+  out << chrom << "\t" << start+1 << "\t" << stop << "\t" << reason << "\t" << time << "\n";
+}
@@ -0,0 +1,43 @@
+#ifndef LOCUS_SKIP_LIST_H_
+#define LOCUS_SKIP_LIST_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "region.h"
+
+/*
+ * Set of loci that previous runs found to be pathologically expensive to analyze, either because genotyping took longer than
+ * a threshold or because it failed after considerable work (e.g. loci that are too repetitive to genotype accurately). Regions
+ * that overlap a locus in the list are skipped before any of their reads are extracted
+ *
+ * The file is a tab-delimited table produced by the --skip-list-out option with a header line beginning with #. Each line contains
+ * the locus' chromosome, 1-based start and end coordinates, followed by the reason it was listed and its analysis time in seconds.
+ * Only the first three columns are required, so a BED-like list of loci compiled by other means can also be provided
+ */
+class LocusSkipList {
+ private:
+  // Merged 0-based half-open intervals for each chromosome, sorted by their start coordinates
+  std::map<std::string, std::vector< std::pair<int32_t, int32_t> > > intervals_;
+  int64_t num_loci_;
+
+ public:
+  explicit LocusSkipList(const std::string& path);
+
+  int64_t num_loci() const { return num_loci_; }
+
+  // Returns true iff the region overlaps one of the loci in the list
+  bool contains(const Region& region) const;
+
+  // Writes the header line of a skip list file
+  static void write_header(std::ostream& out);
+
+  // Writes the entry for the locus on CHROM with 0-based START and STOP, which was listed for REASON after being analyzed in TIME seconds
+  static void write_locus(const std::string& chrom, int32_t start, int32_t stop, const std::string& reason, double time, std::ostream& out);
+};
+
+#endif
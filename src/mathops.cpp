@@ -115,15 +115,124 @@ double finish_streaming_log_sum_exp(double max_val, double total){
   return max_val + log(total);
 }
 
-double fast_log_sum_exp(double log_v1, double log_v2){
-  if (log_v1 > log_v2){
-    double diff = log_v2-log_v1;
-    return diff < LOG_THRESH ? log_v1 : log_v1 + fastlog(1 + fastexp(diff));
+// Number of values accumulated between consecutive rescalings in the blocked streaming log-sum-exp functions
+const int LOG_SUM_EXP_BLOCK_SIZE = 64;
+
+// Returns the sum of exp(LOG_VALS[i] - SHIFT) for each i < N using the vectorized fastexp() approximation
+static double fast_sum_exp(const double* log_vals, int n, double shift){
+  int i = 0;
+  double total = 0.0;
+#ifdef __SSE2__
+  const __m128d shift_pd = _mm_set1_pd(shift);
+  __m128d total_lo = _mm_setzero_pd(), total_hi = _mm_setzero_pd();
+  for (; i+4 <= n; i += 4){
+    __m128d diff_lo = _mm_sub_pd(_mm_loadu_pd(log_vals+i),   shift_pd);
+    __m128d diff_hi = _mm_sub_pd(_mm_loadu_pd(log_vals+i+2), shift_pd);
+    v4sf vals = vfastexp(_mm_movelh_ps(_mm_cvtpd_ps(diff_lo), _mm_cvtpd_ps(diff_hi)));
+    total_lo  = _mm_add_pd(total_lo, _mm_cvtps_pd(vals));
+    total_hi  = _mm_add_pd(total_hi, _mm_cvtps_pd(_mm_movehl_ps(vals, vals)));
   }
-  else {
-    double diff = log_v1-log_v2;
-    return diff < LOG_THRESH ? log_v2 : log_v2 + fastlog(1 + fastexp(diff));
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(total_lo, total_hi));
+  total = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++)
+    total += fastexp(log_vals[i] - shift);
+  return total;
+}
+
+void update_streaming_log_sum_exp(const double* log_vals, int n, double& max_val, double& total){
+  for (int start = 0; start < n; start += LOG_SUM_EXP_BLOCK_SIZE){
+    int end = std::min(n, start + LOG_SUM_EXP_BLOCK_SIZE);
+    double block_max = *std::max_element(log_vals+start, log_vals+end);
+    if (block_max > max_val){
+      total  *= exp(max_val-block_max);
+      max_val = block_max;
+    }
+    double block_total = 0.0;
+    for (int i = start; i < end; i++)
+      block_total += exp(log_vals[i] - max_val);
+    total += block_total;
+  }
+}
+
+void fast_update_streaming_log_sum_exp(const double* log_vals, int n, double& max_val, double& total){
+  for (int start = 0; start < n; start += LOG_SUM_EXP_BLOCK_SIZE){
+    int end = std::min(n, start + LOG_SUM_EXP_BLOCK_SIZE);
+    double block_max = *std::max_element(log_vals+start, log_vals+end);
+    if (block_max > max_val){
+      total  *= exp(max_val-block_max);
+      max_val = block_max;
+    }
+    total += fast_sum_exp(log_vals+start, end-start, max_val);
+  }
+}
+
+double fast_log_sum_exp(const double* log_vals, int n){
+  double max_val = *std::max_element(log_vals, log_vals+n);
+  return max_val + log(fast_sum_exp(log_vals, n, max_val));
+}
+
+#ifdef HIPSTR_LOG1P_EXP_TABLE
+namespace {
+  const int LOG1P_EXP_BINS_PER_UNIT = 1024;
+  const int LOG1P_EXP_TABLE_SIZE    = 7*LOG1P_EXP_BINS_PER_UNIT + 2; // Covers [-7, 0], which contains [LOG_THRESH, 0]
+
+  struct Log1pExpTable {
+    double values[LOG1P_EXP_TABLE_SIZE];
+    Log1pExpTable(){
+      for (int i = 0; i < LOG1P_EXP_TABLE_SIZE; i++)
+	values[i] = log1p(exp(-1.0*i/LOG1P_EXP_BINS_PER_UNIT));
+    }
+  };
+  const Log1pExpTable LOG1P_EXP_TABLE;
+}
+
+double table_log1p_exp(double diff){
+  double pos = -diff*LOG1P_EXP_BINS_PER_UNIT;
+  int index  = (int)pos;
+  double lo  = LOG1P_EXP_TABLE.values[index];
+  return lo + (pos-index)*(LOG1P_EXP_TABLE.values[index+1]-lo);
+}
+#endif
+
+double fast_log_sum_exp(double log_v1, double log_v2){
+  double max_val = std::max(log_v1, log_v2);
+  double diff    = std::min(log_v1, log_v2) - max_val;
+  if (diff < LOG_THRESH)
+    return max_val;
+#ifdef HIPSTR_LOG1P_EXP_TABLE
+  return max_val + table_log1p_exp(diff);
+#else
+  return max_val + fastlog(1 + fastexp(diff));
+#endif
+}
+
+void fast_log_sum_exp(const double* log_v1, const double* log_v2, int n, double* log_out){
+  int i = 0;
+#if defined(__SSE2__) && !defined(HIPSTR_LOG1P_EXP_TABLE)
+  const __m128d thresh = _mm_set1_pd(LOG_THRESH);
+  for (; i+4 <= n; i += 4){
+    __m128d v1_lo  = _mm_loadu_pd(log_v1+i), v1_hi = _mm_loadu_pd(log_v1+i+2);
+    __m128d v2_lo  = _mm_loadu_pd(log_v2+i), v2_hi = _mm_loadu_pd(log_v2+i+2);
+    __m128d max_lo = _mm_max_pd(v1_lo, v2_lo), max_hi = _mm_max_pd(v1_hi, v2_hi);
+    __m128d diff_lo = _mm_sub_pd(_mm_min_pd(v1_lo, v2_lo), max_lo);
+    __m128d diff_hi = _mm_sub_pd(_mm_min_pd(v1_hi, v2_hi), max_hi);
+
+    // Evaluate log(1 + exp(diff)) in single precision, exactly as the scalar fastlog and fastexp do
+    v4sf diff    = _mm_movelh_ps(_mm_cvtpd_ps(diff_lo), _mm_cvtpd_ps(diff_hi));
+    v4sf log_inc = vfastlog(v4sfl(1.0f) + vfastexp(diff));
+    __m128d res_lo = _mm_add_pd(max_lo, _mm_cvtps_pd(log_inc));
+    __m128d res_hi = _mm_add_pd(max_hi, _mm_cvtps_pd(_mm_movehl_ps(log_inc, log_inc)));
+
+    // Ignore the smaller value if it's negligible
+    __m128d skip_lo = _mm_cmplt_pd(diff_lo, thresh), skip_hi = _mm_cmplt_pd(diff_hi, thresh);
+    _mm_storeu_pd(log_out+i,   _mm_or_pd(_mm_and_pd(skip_lo, max_lo), _mm_andnot_pd(skip_lo, res_lo)));
+    _mm_storeu_pd(log_out+i+2, _mm_or_pd(_mm_and_pd(skip_hi, max_hi), _mm_andnot_pd(skip_hi, res_hi)));
   }
+#endif
+  for (; i < n; i++)
+    log_out[i] = fast_log_sum_exp(log_v1[i], log_v2[i]);
 }
 
 double fast_log_sum_exp(std::vector<double>& log_vals){
@@ -136,3 +245,18 @@ double fast_log_sum_exp(std::vector<double>& log_vals){
   }
   return max_val + fasterlog(total);
 }
+
+double fast_log_sum_exp(const std::vector<double>& log_vals, const std::vector<int>& weights){
+  assert(log_vals.size() == weights.size());
+  double max_val = *std::max_element(log_vals.begin(), log_vals.end());
+  double total   = 0;
+  for (unsigned int i = 0; i < log_vals.size(); i++)
+    add_weighted_fast_exp(log_vals[i], weights[i], max_val, total);
+  return max_val + fasterlog(total);
+}
+
+void add_weighted_fast_exp(double log_val, int weight, double max_val, double& total){
+  double diff = log_val - max_val;
+  if (diff > LOG_THRESH)
+    total += weight*fasterexp(diff);
+}
@@ -40,10 +40,41 @@ void fast_update_streaming_log_sum_exp(double log_val, double& max_val, double&
 
 double fast_finish_streaming_log_sum_exp(double max_val, double total);
 
+// Batched equivalent of calling update_streaming_log_sum_exp() for each of the N values. The values are processed in blocks,
+// so the running total is rescaled at most once per block rather than whenever a new maximum is encountered
+void update_streaming_log_sum_exp(const double* log_vals, int n, double& max_val, double& total);
+
+// Batched streaming log-sum-exp that evaluates the exponentials with the vectorized fastexp() approximation when SSE2 is
+// available. Its relative error is ~1e-4, versus several percent for the scalar fast_update_streaming_log_sum_exp()
+void fast_update_streaming_log_sum_exp(const double* log_vals, int n, double& max_val, double& total);
+
+// Two-pass log-sum-exp of the N values that finds their maximum and then sums the vectorized exponentials
+double fast_log_sum_exp(const double* log_vals, int n);
+
 // To accelerate logsumexp, ignore values if they're 1/1000th or less than the maximum value
 const double LOG_THRESH   = log(0.001);
 
 double fast_log_sum_exp(double log_v1, double log_v2);
+
+#ifdef HIPSTR_LOG1P_EXP_TABLE
+// Returns log(1 + exp(DIFF)) for LOG_THRESH <= DIFF <= 0 by linearly interpolating a table with 1024 entries per unit,
+// which is built during static initialization. The interpolation error is below 3e-8
+double table_log1p_exp(double diff);
+#endif
 double fast_log_sum_exp(std::vector<double>& log_vals);
 
+// Equivalent to fast_log_sum_exp() for a list in which each LOG_VALS[i] is repeated WEIGHTS[i] times
+double fast_log_sum_exp(const std::vector<double>& log_vals, const std::vector<int>& weights);
+
+// Adds the contribution of LOG_VAL repeated WEIGHT times to the TOTAL of the weighted fast_log_sum_exp() above, given the values'
+// maximum MAX_VAL. Values that are regenerated rather than stored can therefore be summed in two passes: one to find their maximum and
+// another that adds them in their original order to a TOTAL of 0. fast_finish_streaming_log_sum_exp(MAX_VAL, TOTAL) is then identical
+// to fast_log_sum_exp() applied to a list of the values
+void add_weighted_fast_exp(double log_val, int weight, double max_val, double& total);
+
+// Stores fast_log_sum_exp(LOG_V1[i], LOG_V2[i]) in LOG_OUT[i] for each i < N, evaluating four pairs
+// at a time with the vectorized exp/log approximations when SSE2 is available. Results are identical to the scalar version.
+// When built with the log(1 + exp(x)) table, each pair is instead evaluated using the table
+void fast_log_sum_exp(const double* log_v1, const double* log_v2, int n, double* log_out);
+
 #endif
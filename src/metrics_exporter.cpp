@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <cctype>
+#include <fstream>
+#include <new>
+#include <sstream>
+
+#include "error.h"
+#include "metrics_exporter.h"
+#include "progress_reporter.h"
+
+const double MetricsExporter::BUCKET_BOUNDS[MetricsExporter::NUM_BUCKETS] = {0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60, 300};
+
+const char* MetricsExporter::STATUSES[MetricsExporter::NUM_STATUSES] = {
+  "GENOTYPED", "SUMMARIZED", "NOT_GENOTYPED", "TOO_FEW_READS", "TOO_MANY_READS",
+  "NO_STUTTER_MODEL", "MEMORY_BUDGET", "GENOTYPING_FAILED", "TIMEOUT", "ERROR"
+};
+
+static const char* QUEUE_NAMES[MetricsExporter::NUM_QUEUES] = {"regions", "prepared", "output"};
+
+static const char* STUTTER_RESULT_NAMES[MetricsExporter::NUM_STUTTER_RESULTS] = {
+  "em_converged", "em_failed", "too_few_reads", "memory_budget", "missing_model"
+};
+
+// Converts a phase name, such as "BAM seek time", into a label value such as "bam_seek_time"
+static std::string phase_label(int phase){
+  std::string label = ProcessTimer::phase_name(phase);
+  for (unsigned int i = 0; i < label.size(); i++)
+    label[i] = (label[i] == ' ' ? '_' : tolower(label[i]));
+  return label;
+}
+
+static void write_header(const std::string& name, const std::string& type, const std::string& help, std::ostream& out){
+  out << "# HELP " << name << " " << help << "\n"
+      << "# TYPE " << name << " " << type << "\n";
+}
+
+MetricsExporter::MetricsExporter(const std::string& metrics_file, int interval){
+  if (interval <= 0)
+    printErrorAndDie("The metrics reporting interval must be greater than 0 seconds");
+  void* mem = mmap(NULL, sizeof(SharedMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    printErrorAndDie("Failed to map the shared memory for the metrics");
+  metrics_      = new (mem) SharedMetrics();
+  metrics_file_ = metrics_file;
+  interval_     = interval;
+  start_time_   = std::chrono::steady_clock::now();
+  prev_time_    = 0;
+  prev_reads_   = 0;
+  finished_     = false;
+  writer_       = std::thread(&MetricsExporter::run, this);
+}
+
+MetricsExporter::~MetricsExporter(){
+  finish();
+  metrics_->~SharedMetrics();
+  munmap(metrics_, sizeof(SharedMetrics));
+}
+
+void MetricsExporter::run(){
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!finish_cv_.wait_for(lock, std::chrono::seconds(interval_), [&]{ return finished_; })){
+    lock.unlock();
+    write();
+    lock.lock();
+  }
+}
+
+void MetricsExporter::finish(){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_)
+      return;
+    finished_ = true;
+  }
+  finish_cv_.notify_all();
+  writer_.join();
+  write();
+}
+
+void MetricsExporter::record_locus(const std::string& status, const ProcessTimer& locus_timer){
+  int status_index = 0;
+  while (status_index < NUM_STATUSES && status.compare(STATUSES[status_index]) != 0)
+    status_index++;
+  if (status_index == NUM_STATUSES)
+    printErrorAndDie("Invalid locus status for the metrics: " + status);
+  metrics_->statuses[status_index]++;
+
+  for (int phase = 0; phase < NUM_TIMED_PHASES; phase++){
+    if (locus_timer.count((TimedPhase)phase) == 0)
+      continue;
+    double seconds = locus_timer.wall_time((TimedPhase)phase);
+    int bucket = 0;
+    while (bucket < NUM_BUCKETS && seconds > BUCKET_BOUNDS[bucket])
+      bucket++;
+    metrics_->phase_buckets[phase][bucket]++;
+    metrics_->phase_nanos[phase] += (int64_t)(1e9*seconds);
+  }
+}
+
+void MetricsExporter::write(){
+  double elapsed    = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count();
+  int64_t num_reads = metrics_->num_reads;
+  double read_rate  = (elapsed > prev_time_ ? (num_reads - prev_reads_)/(elapsed - prev_time_) : 0.0);
+  prev_time_  = elapsed;
+  prev_reads_ = num_reads;
+
+  std::stringstream ss;
+  write_header("hipstr_loci_completed_total", "counter", "Loci whose analysis has completed", ss);
+  ss << "hipstr_loci_completed_total " << metrics_->num_loci << "\n";
+
+  write_header("hipstr_locus_status_total", "counter", "Analyzed loci by their status in --locus-stats, or ERROR for loci skipped due to an error", ss);
+  for (int i = 0; i < NUM_STATUSES; i++)
+    ss << "hipstr_locus_status_total{status=\"" << STATUSES[i] << "\"} " << metrics_->statuses[i] << "\n";
+
+  write_header("hipstr_stutter_models_total", "counter", "Stutter models by the result of their training or lookup", ss);
+  for (int i = 0; i < NUM_STUTTER_RESULTS; i++)
+    ss << "hipstr_stutter_models_total{result=\"" << STUTTER_RESULT_NAMES[i] << "\"} " << metrics_->stutter_results[i] << "\n";
+
+  write_header("hipstr_reads_total", "counter", "Reads extracted for the analyzed loci", ss);
+  ss << "hipstr_reads_total " << num_reads << "\n";
+  write_header("hipstr_reads_per_second", "gauge", "Reads extracted per second since the previous metrics were written", ss);
+  ss << "hipstr_reads_per_second " << read_rate << "\n";
+
+  write_header("hipstr_queue_depth", "gauge", "Region groups waiting in each stage of the pipeline", ss);
+  for (int i = 0; i < NUM_QUEUES; i++)
+    ss << "hipstr_queue_depth{queue=\"" << QUEUE_NAMES[i] << "\"} " << metrics_->queue_depths[i] << "\n";
+
+  write_header("hipstr_phase_seconds", "histogram", "Wall-clock time spent in each timed phase per locus", ss);
+  for (int phase = 0; phase < NUM_TIMED_PHASES; phase++){
+    std::string label = phase_label(phase);
+    int64_t count = 0;
+    for (int bucket = 0; bucket <= NUM_BUCKETS; bucket++){
+      count += metrics_->phase_buckets[phase][bucket];
+      ss << "hipstr_phase_seconds_bucket{phase=\"" << label << "\",le=\"";
+      if (bucket < NUM_BUCKETS)
+	ss << BUCKET_BOUNDS[bucket];
+      else
+	ss << "+Inf";
+      ss << "\"} " << count << "\n";
+    }
+    ss << "hipstr_phase_seconds_sum{phase=\"" << label << "\"} " << metrics_->phase_nanos[phase]/1e9 << "\n"
+       << "hipstr_phase_seconds_count{phase=\"" << label << "\"} " << count << "\n";
+  }
+
+  int64_t rss = resident_memory();
+  if (rss >= 0){
+    write_header("hipstr_resident_memory_bytes", "gauge", "Resident set size of the HipSTR process", ss);
+    ss << "hipstr_resident_memory_bytes " << rss << "\n";
+  }
+  write_header("hipstr_uptime_seconds", "gauge", "Seconds since the metrics exporter was started", ss);
+  ss << "hipstr_uptime_seconds " << elapsed << "\n";
+
+  // Replace the metrics file atomically, so that a scraper never reads partial metrics
+  std::string tmp_file = metrics_file_ + ".tmp";
+  std::ofstream out(tmp_file.c_str());
+  if (!out.is_open())
+    printErrorAndDie("Failed to write the metrics file " + tmp_file);
+  out << ss.str();
+  out.close();
+  if (rename(tmp_file.c_str(), metrics_file_.c_str()) != 0)
+    printErrorAndDie("Failed to replace the metrics file " + metrics_file_);
+}
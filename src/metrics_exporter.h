@@ -0,0 +1,100 @@
+#ifndef METRICS_EXPORTER_H_
+#define METRICS_EXPORTER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "process_timer.h"
+
+/*
+ * Periodically writes the run's metrics to a file in the Prometheus text exposition format, atomically replacing the previous
+ * metrics so that the file can be scraped by a Prometheus textfile collector while HipSTR is running. The metrics comprise the
+ * loci completed, each locus' outcome and stutter model result, histograms of the time spent in each timed phase per locus,
+ * the depths of the queues between the pipeline stages, the reads processed and their recent rate and the resident memory.
+ *
+ * The counters are stored in an anonymous shared mapping, so the processes forked to handle --serve requests update the metrics
+ * of the listening process. They can be recorded from any thread or process without locking
+ */
+class MetricsExporter {
+ public:
+  enum Queue {
+    QUEUE_REGIONS,  // Region groups that haven't been analyzed yet
+    QUEUE_PREPARED, // Region groups whose reads have been prepared by the --prefetch-loci thread
+    QUEUE_OUTPUT,   // Region groups that have been analyzed but whose output hasn't been written
+    NUM_QUEUES
+  };
+
+  enum StutterResult {
+    STUTTER_EM_CONVERGED,
+    STUTTER_EM_FAILED,
+    STUTTER_TOO_FEW_READS,
+    STUTTER_MEMORY_BUDGET,
+    STUTTER_MISSING_MODEL,
+    NUM_STUTTER_RESULTS
+  };
+
+ private:
+  // Upper bounds (in seconds) of the buckets in each phase's histogram, excluding the +Inf bucket
+  static const int NUM_BUCKETS = 11;
+  static const double BUCKET_BOUNDS[NUM_BUCKETS];
+
+  // Locus statuses reported in --locus-stats, along with ERROR for loci abandoned by --skip-failed-loci
+  static const int NUM_STATUSES = 10;
+  static const char* STATUSES[NUM_STATUSES];
+
+  struct SharedMetrics {
+    std::atomic<int64_t> num_loci;
+    std::atomic<int64_t> num_reads;
+    std::atomic<int64_t> statuses[NUM_STATUSES];
+    std::atomic<int64_t> stutter_results[NUM_STUTTER_RESULTS];
+    std::atomic<int64_t> queue_depths[NUM_QUEUES];
+    std::atomic<int64_t> phase_buckets[NUM_TIMED_PHASES][NUM_BUCKETS+1]; // Counts for each bucket, which aren't cumulative
+    std::atomic<int64_t> phase_nanos[NUM_TIMED_PHASES];
+  };
+
+  SharedMetrics* metrics_;
+  std::string metrics_file_;
+  int interval_; // Seconds between consecutive writes
+  std::chrono::steady_clock::time_point start_time_;
+
+  // Only accessed by the writer thread, or the final write once it has stopped
+  double prev_time_;
+  int64_t prev_reads_;
+
+  bool finished_;
+  std::mutex mutex_;
+  std::condition_variable finish_cv_;
+  std::thread writer_;
+
+  void run();
+  void write();
+
+ public:
+  MetricsExporter(const std::string& metrics_file, int interval);
+
+  ~MetricsExporter();
+
+  void add_reads(int64_t num_reads){ metrics_->num_reads += num_reads; }
+
+  void finish_loci(int num_loci){ metrics_->num_loci += num_loci; }
+
+  void add_stutter_result(StutterResult result){ metrics_->stutter_results[result]++; }
+
+  void add_queue_depth(Queue queue, int64_t delta){ metrics_->queue_depths[queue] += delta; }
+
+  void set_queue_depth(Queue queue, int64_t depth){ metrics_->queue_depths[queue] = depth; }
+
+  /* Records the locus' status, which must be one of the statuses reported in --locus-stats or ERROR, and the time spent in each phase it entered */
+  void record_locus(const std::string& status, const ProcessTimer& locus_timer);
+
+  /* Stops the writer thread and writes the final metrics */
+  void finish();
+};
+
+#endif
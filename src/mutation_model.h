@@ -1,32 +1,55 @@
 #ifndef MUTATION_MODEL_H_
 #define MUTATION_MODEL_H_
 
+#include <assert.h>
 #include <math.h>
 
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
 #include "vcf_reader.h"
 
 class MutationModel {
-  double log_mut_prior_;
+  int num_alleles_;
+  std::vector<double> log_priors_;     // Row-major A x A matrix of log10 mutation priors, with -DBL_MAX/2 along the diagonal
+  std::vector<double> max_log_priors_; // Maximum of each row's off-diagonal entries
 
  public:
   MutationModel(VCF::Variant& str_variant){
     assert(str_variant.num_alleles() > 1);
-    
+    num_alleles_ = str_variant.num_alleles();
+
     // The allele on each haplotype can mutate to N-1 alleles, so assuming a 
     // uniform prior each mutation has a prior of 1/(2*(N-1))
-    log_mut_prior_ = -log10(2) - log10(str_variant.num_alleles()-1);
+    double log_mut_prior = -log10(2) - log10(num_alleles_-1);
+
+    // The priors are evaluated in the innermost loops of the de novo scanners, so compute them once per locus
+    log_priors_.assign(num_alleles_*num_alleles_, log_mut_prior);
+    max_log_priors_.assign(num_alleles_, -DBL_MAX/2);
+    for (int i = 0; i < num_alleles_; i++){
+      log_priors_[i*num_alleles_ + i] = -DBL_MAX/2;
+      for (int j = 0; j < num_alleles_; j++)
+	if (j != i)
+	  max_log_priors_[i] = std::max(max_log_priors_[i], log_priors_[i*num_alleles_ + j]);
+    }
   }
 
   /*
    * Log10-likelihood of mutating from the parental to the child allele,
    * given that a mutation occurred
    */
-  double log_prior_mutation(int parental_allele, int child_allele){
-    return log_mut_prior_;
+  double log_prior_mutation(int parental_allele, int child_allele) const {
+    return log_priors_[parental_allele*num_alleles_ + child_allele];
+  }
+
+  /* Returns the log10 priors of mutating from the parental allele to each allele, stored contiguously */
+  const double* log_priors_mutation(int parental_allele) const {
+    return &log_priors_[parental_allele*num_alleles_];
   }
 
-  double max_log_prior_mutation(int parental_allele){
-    return log_mut_prior_;
+  double max_log_prior_mutation(int parental_allele) const {
+    return max_log_priors_[parental_allele];
   }
 };
 
@@ -0,0 +1,73 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "numa_topology.h"
+#include "stringops.h"
+
+bool parse_cpu_list(const std::string& list, std::vector<int>& cpus){
+  cpus.clear();
+  std::vector<std::string> items;
+  split_by_delim(list, ',', items);
+  for (auto item_iter = items.begin(); item_iter != items.end(); item_iter++){
+    if (item_iter->empty())
+      continue;
+    std::vector<std::string> bounds;
+    split_by_delim(*item_iter, '-', bounds);
+    if (bounds.empty() || bounds.size() > 2)
+      return false;
+    char* end;
+    long first = strtol(bounds[0].c_str(), &end, 10);
+    if (*end != '\0' || first < 0)
+      return false;
+    long last = first;
+    if (bounds.size() == 2){
+      last = strtol(bounds[1].c_str(), &end, 10);
+      if (*end != '\0' || last < first)
+	return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back((int)cpu);
+  }
+  return !cpus.empty();
+}
+
+NumaTopology::NumaTopology(){
+  std::string online;
+  std::ifstream online_input("/sys/devices/system/node/online");
+  std::vector<int> nodes;
+  if (online_input.is_open() && std::getline(online_input, online))
+    parse_cpu_list(online, nodes);
+
+  for (auto node_iter = nodes.begin(); node_iter != nodes.end(); node_iter++){
+    std::ifstream cpu_input("/sys/devices/system/node/node" + std::to_string(*node_iter) + "/cpulist");
+    std::string cpu_list;
+    std::vector<int> cpus;
+    if (cpu_input.is_open() && std::getline(cpu_input, cpu_list) && parse_cpu_list(cpu_list, cpus))
+      node_cpus_.push_back(cpus);
+  }
+
+  if (node_cpus_.empty()){
+    cpu_set_t cpu_set;
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0)
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	if (CPU_ISSET(cpu, &cpu_set))
+	  cpus.push_back(cpu);
+    node_cpus_.push_back(cpus);
+  }
+}
+
+bool NumaTopology::bind_thread(int node){
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (auto cpu_iter = node_cpus_[node].begin(); cpu_iter != node_cpus_[node].end(); cpu_iter++)
+    if (*cpu_iter < CPU_SETSIZE)
+      CPU_SET(*cpu_iter, &cpu_set);
+  if (CPU_COUNT(&cpu_set) == 0)
+    return false;
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+}
@@ -0,0 +1,30 @@
+#ifndef NUMA_TOPOLOGY_H_
+#define NUMA_TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+
+/*
+ * CPUs of each NUMA node that has any, as listed in /sys/devices/system/node. On systems without NUMA information,
+ * all of the CPUs available to the process are reported as a single node
+ */
+class NumaTopology {
+ private:
+  std::vector< std::vector<int> > node_cpus_;
+
+ public:
+  NumaTopology();
+
+  int num_nodes() const                             { return node_cpus_.size(); }
+  const std::vector<int>& node_cpus(int node) const { return node_cpus_[node]; }
+
+  // Restrict the calling thread to the CPUs of NODE. As Linux allocates memory on the node of the thread
+  // that first touches it, the thread's subsequent allocations are then local to the node. Returns false if the
+  // affinity couldn't be set
+  bool bind_thread(int node);
+};
+
+// Parse a list of CPUs of the form used by sysfs (e.g. 0-3,8,10-11)
+bool parse_cpu_list(const std::string& list, std::vector<int>& cpus);
+
+#endif
@@ -0,0 +1,254 @@
+#include "packed_reference.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+
+#include "error.h"
+
+namespace {
+const char MAGIC[]       = "HSTRPREF";
+const size_t MAGIC_LEN   = 8;
+const uint32_t VERSION   = 1;
+const char BASES[]       = "ACGT";
+
+template<typename T> T read_value(const char*& ptr){
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return value;
+}
+
+template<typename T> void append_value(std::string& buffer, T value){
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// The 4 bases encoded by each packed byte
+struct ExpansionTable {
+  char bases[256][4];
+  ExpansionTable(){
+    for (int i = 0; i < 256; i++)
+      for (int j = 0; j < 4; j++)
+	bases[i][j] = BASES[(i >> (2*j)) & 3];
+  }
+};
+
+int base_code(char base){
+  switch(base){
+  case 'A': return 0;
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  default:  return -1;
+  }
+}
+
+// Append the packed record for SEQ to RECORD
+void encode_sequence(const std::string& seq, std::string& record){
+  std::vector<uint32_t> runs, masks;
+  size_t i = 0;
+  while (i < seq.size()){
+    char base = toupper(seq[i]);
+    size_t j  = i+1;
+    if (base_code(base) == -1){
+      while (j < seq.size() && toupper(seq[j]) == base)
+	j++;
+      runs.push_back(i); runs.push_back(j-i); runs.push_back((unsigned char)base);
+    }
+    i = j;
+  }
+  i = 0;
+  while (i < seq.size()){
+    if (islower(seq[i])){
+      size_t j = i+1;
+      while (j < seq.size() && islower(seq[j]))
+	j++;
+      masks.push_back(i); masks.push_back(j-i);
+      i = j;
+    }
+    else
+      i++;
+  }
+
+  append_value<uint32_t>(record, runs.size()/3);
+  for (auto iter = runs.begin(); iter != runs.end(); iter++)
+    append_value<uint32_t>(record, *iter);
+  append_value<uint32_t>(record, masks.size()/2);
+  for (auto iter = masks.begin(); iter != masks.end(); iter++)
+    append_value<uint32_t>(record, *iter);
+
+  size_t packed_start = record.size();
+  record.resize(packed_start + (seq.size()+3)/4, '\0');
+  for (i = 0; i < seq.size(); i++){
+    int code = base_code(toupper(seq[i]));
+    if (code != -1)
+      record[packed_start + i/4] |= (char)(code << (2*(i%4)));
+  }
+}
+}
+
+PackedReference::PackedReference(const std::string& path){
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    printErrorAndDie("Failed to open packed reference file " + path);
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) != 0)
+    printErrorAndDie("Failed to determine the size of packed reference file " + path);
+  size_ = st_buf.st_size;
+  if (size_ < MAGIC_LEN + 2*sizeof(uint32_t))
+    printErrorAndDie("Packed reference file " + path + " is truncated");
+  void* mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    printErrorAndDie("Failed to memory-map packed reference file " + path);
+  data_ = static_cast<const char*>(mapping);
+
+  const char* ptr = data_;
+  if (memcmp(ptr, MAGIC, MAGIC_LEN) != 0)
+    printErrorAndDie("File " + path + " is not a packed reference file");
+  ptr += MAGIC_LEN;
+  if (read_value<uint32_t>(ptr) != VERSION)
+    printErrorAndDie("Packed reference file " + path + " was generated by an incompatible version of HipSTR. Please delete it and rerun the analysis");
+  uint32_t num_seqs = read_value<uint32_t>(ptr);
+  for (uint32_t i = 0; i < num_seqs; i++){
+    if (ptr + sizeof(uint32_t) > data_ + size_)
+      printErrorAndDie("Packed reference file " + path + " is truncated");
+    uint32_t name_len = read_value<uint32_t>(ptr);
+    if (ptr + name_len + 2*sizeof(uint64_t) > data_ + size_)
+      printErrorAndDie("Packed reference file " + path + " is truncated");
+    std::string name(ptr, name_len);
+    ptr += name_len;
+    SequenceInfo info;
+    info.length = read_value<uint64_t>(ptr);
+    info.offset = read_value<uint64_t>(ptr);
+    if (info.offset + (info.length+3)/4 > size_)
+      printErrorAndDie("Packed reference file " + path + " is truncated");
+    sequences_[name] = info;
+  }
+}
+
+PackedReference::~PackedReference(){
+  munmap(const_cast<char*>(data_), size_);
+}
+
+int64_t PackedReference::sequence_length(const std::string& chrom) const {
+  auto seq_iter = sequences_.find(chrom);
+  return (seq_iter == sequences_.end() ? -1 : (int64_t)seq_iter->second.length);
+}
+
+void PackedReference::decode(const SequenceInfo& info, uint64_t start, uint64_t end, std::string& seq) const {
+  const char* ptr   = data_ + info.offset;
+  uint32_t num_runs = read_value<uint32_t>(ptr);
+  const char* runs  = ptr;
+  ptr += 3*sizeof(uint32_t)*num_runs;
+  uint32_t num_masks = read_value<uint32_t>(ptr);
+  const char* masks  = ptr;
+  ptr += 2*sizeof(uint32_t)*num_masks;
+  const unsigned char* packed = reinterpret_cast<const unsigned char*>(ptr);
+
+  static const ExpansionTable table;
+  const char (*expansions)[4] = table.bases;
+
+  seq.resize(end-start);
+  uint64_t pos = start;
+  for (; pos < end && (pos % 4) != 0; pos++)
+    seq[pos-start] = expansions[packed[pos/4]][pos%4];
+  for (; pos + 4 <= end; pos += 4)
+    memcpy(&seq[pos-start], expansions[packed[pos/4]], 4);
+  for (; pos < end; pos++)
+    seq[pos-start] = expansions[packed[pos/4]][pos%4];
+
+  // Restore non-ACGT bases and soft-masking for the runs that overlap the decoded interval
+  for (uint32_t i = 0; i < num_runs; i++){
+    uint32_t run_start = read_value<uint32_t>(runs), run_len = read_value<uint32_t>(runs), base = read_value<uint32_t>(runs);
+    uint64_t lb = std::max<uint64_t>(start, run_start), ub = std::min<uint64_t>(end, (uint64_t)run_start + run_len);
+    for (uint64_t j = lb; j < ub; j++)
+      seq[j-start] = (char)base;
+  }
+  for (uint32_t i = 0; i < num_masks; i++){
+    uint32_t mask_start = read_value<uint32_t>(masks), mask_len = read_value<uint32_t>(masks);
+    uint64_t lb = std::max<uint64_t>(start, mask_start), ub = std::min<uint64_t>(end, (uint64_t)mask_start + mask_len);
+    for (uint64_t j = lb; j < ub; j++)
+      seq[j-start] = tolower(seq[j-start]);
+  }
+}
+
+void PackedReference::get_sequence(const std::string& chrom, std::string& seq) const {
+  auto seq_iter = sequences_.find(chrom);
+  if (seq_iter == sequences_.end())
+    printErrorAndDie("No entry for chromosome " + chrom + " found in the packed reference file");
+  decode(seq_iter->second, 0, seq_iter->second.length, seq);
+}
+
+void PackedReference::get_sequence(const std::string& chrom, int32_t start, int32_t end, std::string& seq) const {
+  auto seq_iter = sequences_.find(chrom);
+  if (seq_iter == sequences_.end())
+    printErrorAndDie("No entry for chromosome " + chrom + " found in the packed reference file");
+
+  // Clamp the interval to the sequence boundaries exactly as faidx_fetch_seq does
+  int64_t length = seq_iter->second.length;
+  int64_t lb = std::min(start, end), ub = end;
+  lb = std::max<int64_t>(0, std::min(lb, length-1));
+  ub = std::max<int64_t>(0, std::min(ub, length-1));
+  if (length == 0)
+    seq.clear();
+  else
+    decode(seq_iter->second, lb, ub+1, seq);
+}
+
+void PackedReference::write(const std::string& path, const std::vector<std::string>& names,
+			    std::function<void(size_t, std::string&)> fetch_seq){
+  std::stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid();
+  FILE* output = fopen(tmp_path.str().c_str(), "wb");
+  if (output == NULL)
+    printErrorAndDie("Failed to open " + tmp_path.str() + " to write the packed reference");
+
+  // Reserve space for the header and index, which are written once the record offsets are known
+  uint64_t index_size = MAGIC_LEN + 2*sizeof(uint32_t);
+  for (auto iter = names.begin(); iter != names.end(); iter++)
+    index_size += sizeof(uint32_t) + iter->size() + 2*sizeof(uint64_t);
+  std::string header(index_size, '\0');
+  bool success = (fwrite(header.data(), 1, header.size(), output) == header.size());
+
+  std::vector<uint64_t> lengths, offsets;
+  uint64_t offset = index_size;
+  std::string seq, record;
+  for (size_t i = 0; i < names.size() && success; i++){
+    fetch_seq(i, seq);
+    record.clear();
+    encode_sequence(seq, record);
+    success &= (fwrite(record.data(), 1, record.size(), output) == record.size());
+    lengths.push_back(seq.size());
+    offsets.push_back(offset);
+    offset += record.size();
+  }
+
+  if (success){
+    header.clear();
+    header.append(MAGIC, MAGIC_LEN);
+    append_value<uint32_t>(header, VERSION);
+    append_value<uint32_t>(header, names.size());
+    for (size_t i = 0; i < names.size(); i++){
+      append_value<uint32_t>(header, names[i].size());
+      header.append(names[i]);
+      append_value<uint64_t>(header, lengths[i]);
+      append_value<uint64_t>(header, offsets[i]);
+    }
+    success &= (fseek(output, 0, SEEK_SET) == 0);
+    success &= (fwrite(header.data(), 1, header.size(), output) == header.size());
+  }
+  success &= (fclose(output) == 0);
+  if (!success){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to write the packed reference to " + tmp_path.str());
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to rename the packed reference file " + tmp_path.str() + " to " + path);
+}
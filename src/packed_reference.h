@@ -0,0 +1,62 @@
+#ifndef PACKED_REFERENCE_H_
+#define PACKED_REFERENCE_H_
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Read-only, memory-mapped reference genome in which each base is packed into 2 bits. Runs of bases other than
+ * A, C, G and T (e.g. N) and runs of soft-masked (lowercase) bases are stored separately, so sequences are
+ * reproduced exactly as they appear in the FASTA file. As the file is mapped rather than read, concurrent
+ * HipSTR processes share a single copy of it through the page cache.
+ *
+ * File layout (all integers little-endian):
+ *   header:   magic "HSTRPREF", uint32 version, uint32 number of sequences
+ *   index:    for each sequence, uint32 name length, name, uint64 sequence length, uint64 record offset
+ *   records:  uint32 number of runs,  then a (uint32 start, uint32 length, uint32 base) triplet per non-ACGT run
+ *             uint32 number of masks, then a (uint32 start, uint32 length) pair per lowercase run
+ *             the bases packed 4 per byte, with the first base of each byte in its 2 lowest bits
+ */
+class PackedReference {
+ private:
+  struct SequenceInfo {
+    uint64_t length;
+    uint64_t offset;
+  };
+
+  std::map<std::string, SequenceInfo> sequences_;
+  const char* data_;
+  size_t size_;
+
+  // Decode the bases in [START, END) of the sequence with the provided record into SEQ
+  void decode(const SequenceInfo& info, uint64_t start, uint64_t end, std::string& seq) const;
+
+ public:
+  explicit PackedReference(const std::string& path);
+
+  ~PackedReference();
+
+  bool has_sequence(const std::string& chrom) const { return sequences_.find(chrom) != sequences_.end(); }
+
+  /* Length of the sequence with name CHROM, or -1 if it isn't present */
+  int64_t sequence_length(const std::string& chrom) const;
+
+  /* Retrieves the entire sequence with name CHROM and stores it in SEQ */
+  void get_sequence(const std::string& chrom, std::string& seq) const;
+
+  /* Retrieves the 0-index based substring from START -> END (inclusive) of the sequence with name CHROM */
+  void get_sequence(const std::string& chrom, int32_t start, int32_t end, std::string& seq) const;
+
+  /*
+   * Writes a packed reference containing the provided sequences to PATH. FETCH_SEQ(i, seq) must store the
+   * sequence for the ith name in SEQ. The file is written under a temporary name and then renamed,
+   * so concurrent processes never observe a partially written file
+   */
+  static void write(const std::string& path, const std::vector<std::string>& names,
+		    std::function<void(size_t, std::string&)> fetch_seq);
+};
+
+#endif
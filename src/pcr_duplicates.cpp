@@ -4,142 +4,131 @@
 #include <assert.h>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 
-class ReadPair {
-private:
-  int32_t min_read_start_;
-  int32_t max_read_start_;
-  BamAlignment aln_1_;
-  BamAlignment aln_2_;
-  std::string library_;
-  std::string name_;
+#include "error.h"
 
-public:
-  ReadPair(BamAlignment& aln_1, std::string& library){
-    aln_1_          = aln_1;
-    min_read_start_ = -1;
-    max_read_start_ = aln_1.Position();
-    library_        = library;
-    name_           = aln_1.Name();
-  }
+namespace {
 
-  ReadPair(BamAlignment& aln_1, BamAlignment& aln_2, std::string& library){
-    aln_1_          = aln_1;
-    aln_2_          = aln_2;
-    min_read_start_ = std::min(aln_1.Position(), aln_2.Position());
-    max_read_start_ = std::max(aln_1.Position(), aln_2.Position());
-    library_        = library;
-    assert(aln_1.Name().compare(aln_2.Name()) == 0);
-    name_           = aln_1.Name();
-  }
-  
-  BamAlignment& aln_one(){ return aln_1_; }
-  BamAlignment& aln_two(){ return aln_2_; }
-  std::string& name()              { return name_;  }
-  bool single_ended()              { return min_read_start_ == -1; }
+// Reads are duplicates if they're from the same library and their pairs start at the same positions
+struct DuplicateKey {
+  int32_t library;
+  int32_t min_read_start;
+  int32_t max_read_start;
 
-  bool duplicate (const ReadPair& pair) const {
-    return (library_.compare(pair.library_) == 0)
-      && (min_read_start_ == pair.min_read_start_)
-      && (max_read_start_ == pair.max_read_start_);
+  bool operator==(const DuplicateKey& key) const {
+    return library == key.library && min_read_start == key.min_read_start && max_read_start == key.max_read_start;
   }
+};
 
-  bool operator < (const ReadPair& pair) const {
-    int lib_comp = library_.compare(pair.library_);
-    if (lib_comp != 0)
-      return lib_comp < 0;
-    if (min_read_start_ != pair.min_read_start_)
-      return min_read_start_ < pair.min_read_start_;
-    if (max_read_start_ != pair.max_read_start_)
-      return max_read_start_ < pair.max_read_start_;
-    return (name_.compare(pair.name_) < 0);
+struct DuplicateKeyHash {
+  size_t operator()(const DuplicateKey& key) const {
+    uint64_t hash = ((uint64_t)(uint32_t)key.min_read_start << 32) | (uint32_t)key.max_read_start;
+    hash ^= (uint64_t)key.library * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+    return (size_t)(hash * 0xBF58476D1CE4E5B9ULL);
   }
 };
 
-std::string get_library(BamAlignment& aln, std::map<std::string, std::string>& rg_to_library){
-  std::string rg;
-  if (!aln.GetStringTag("RG", rg))
-    printErrorAndDie("Failed to retrieve BAM alignment's RG tag");
-  auto iter = rg_to_library.find(aln.Filename() + rg);
-  if (iter == rg_to_library.end())
-    printErrorAndDie("No library found for read group " + rg + " in BAM file headers");
-  return iter->second;
+struct DuplicateSet {
+  size_t best_index;   // Index of the read with the highest total base quality
+  double best_quality;
+  int32_t num_reads;
+  bool include_rev;    // True iff the best pair also occurs with its reads reversed
+};
+
 }
 
-void remove_pcr_duplicates(BaseQuality& base_quality, bool use_bam_rgs,
-			   std::map<std::string, std::string>& rg_to_library,
+void remove_pcr_duplicates(BaseQuality& base_quality, const ReadGroupIndex& read_groups,
 			   std::vector< std::vector<BamAlignment> >& paired_strs_by_rg,
 			   std::vector< std::vector<BamAlignment> >& mate_pairs_by_rg,
 			   std::vector< std::vector<BamAlignment> >& unpaired_strs_by_rg, std::ostream& logger){
   int32_t dup_count = 0;
   assert(paired_strs_by_rg.size() == mate_pairs_by_rg.size() && paired_strs_by_rg.size() == unpaired_strs_by_rg.size());
+  std::unordered_map<DuplicateKey, int32_t, DuplicateKeyHash> set_indices;
+  std::vector<DuplicateSet> dup_sets;
+  std::vector<int32_t> read_sets;
   for (size_t i = 0; i < paired_strs_by_rg.size(); i++){
     assert(paired_strs_by_rg[i].size() == mate_pairs_by_rg[i].size());
+    std::vector<BamAlignment>& paired_strs = paired_strs_by_rg[i];
+    std::vector<BamAlignment>& mate_pairs  = mate_pairs_by_rg[i];
+    std::vector<BamAlignment>& unpaired    = unpaired_strs_by_rg[i];
+    size_t num_paired = paired_strs.size(), num_reads = num_paired + unpaired.size();
+    if (num_reads == 0)
+      continue;
 
-    std::vector<ReadPair> read_pairs;
-    for (size_t j = 0; j < paired_strs_by_rg[i].size(); j++){
-      std::string library = use_bam_rgs ? get_library(paired_strs_by_rg[i][j], rg_to_library): rg_to_library[paired_strs_by_rg[i][j].Filename()];
-      read_pairs.push_back(ReadPair(paired_strs_by_rg[i][j], mate_pairs_by_rg[i][j], library));
-    }
-    for (size_t j = 0; j < unpaired_strs_by_rg[i].size(); j++){
-      std::string library = use_bam_rgs ? get_library(unpaired_strs_by_rg[i][j], rg_to_library): rg_to_library[unpaired_strs_by_rg[i][j].Filename()];
-      read_pairs.push_back(ReadPair(unpaired_strs_by_rg[i][j], library));
-    }
-    std::sort(read_pairs.begin(), read_pairs.end());
+    // Assign each read to its set of duplicates in a single pass, where indices >= NUM_PAIRED refer to the unpaired reads
+    // The best read in each set has the highest total base quality, with ties resolved by the smallest read name
+    set_indices.clear();
+    set_indices.reserve(num_reads);
+    dup_sets.clear();
+    read_sets.resize(num_reads);
+    for (size_t j = 0; j < num_reads; j++){
+      DuplicateKey key;
+      BamAlignment& aln = (j < num_paired ? paired_strs[j] : unpaired[j-num_paired]);
+      key.library = read_groups.library_id(aln);
+      if (j < num_paired){
+	key.min_read_start = std::min(aln.Position(), mate_pairs[j].Position());
+	key.max_read_start = std::max(aln.Position(), mate_pairs[j].Position());
+      }
+      else {
+	key.min_read_start = -1;
+	key.max_read_start = aln.Position();
+      }
 
-    paired_strs_by_rg[i].clear();
-    mate_pairs_by_rg[i].clear();
-    unpaired_strs_by_rg[i].clear();
-    if (read_pairs.size() == 0)
-      continue;
+      double quality = base_quality.sum_log_prob_correct(aln.QualitiesView());
+      auto set_iter  = set_indices.emplace(key, (int32_t)dup_sets.size());
+      read_sets[j]   = set_iter.first->second;
+      if (set_iter.second){
+	DuplicateSet dup_set = {j, quality, 1, false};
+	dup_sets.push_back(dup_set);
+	continue;
+      }
+
+      DuplicateSet& dup_set = dup_sets[set_iter.first->second];
+      dup_set.num_reads++;
+      if (quality > dup_set.best_quality){
+	dup_set.best_index   = j;
+	dup_set.best_quality = quality;
+      }
+      else if (quality == dup_set.best_quality){
+	const BamAlignment& best = (dup_set.best_index < num_paired ? paired_strs[dup_set.best_index] : unpaired[dup_set.best_index-num_paired]);
+	if (aln.Name().compare(best.Name()) < 0)
+	  dup_set.best_index = j;
+      }
+    }
 
     // When both mates in a pair overlap the STR, they generate pseudo PCR duplicates because the read pair is included twice in the input (but reversed).
     // To use both reads for genotyping, we don't want to remove these duplicates for downstream analysis. Instead, we use this flag to track
     // if this issue has occurred and undo the duplicate removal when saving the alignments
-    bool include_rev  = false;
-    size_t best_index = 0;
-    for (size_t j = 1; j < read_pairs.size(); j++){
-      if (read_pairs[j].duplicate(read_pairs[best_index])){
-	dup_count++;
-	// Update index if new pair's STR read has a higher total base quality
-	if (base_quality.sum_log_prob_correct(read_pairs[j].aln_one().Qualities()) >
-	    base_quality.sum_log_prob_correct(read_pairs[best_index].aln_one().Qualities())){
-	  best_index  = j;
-	  include_rev = (read_pairs[best_index].name().compare(read_pairs[j-1].name()) == 0);
-	}
-	else if (j == best_index+1)
-	  include_rev |= (read_pairs[best_index].name().compare(read_pairs[j].name()) == 0);
-      }
-      else {
-	// Keep best pair from prior set of duplicates
-	if (read_pairs[best_index].single_ended())
-	  unpaired_strs_by_rg[i].push_back(read_pairs[best_index].aln_one());
-	else {
-	  paired_strs_by_rg[i].push_back(read_pairs[best_index].aln_one());
-	  mate_pairs_by_rg[i].push_back(read_pairs[best_index].aln_two());
-	  if (include_rev){
-	    dup_count--;
-	    paired_strs_by_rg[i].push_back(read_pairs[best_index].aln_two());
-	    mate_pairs_by_rg[i].push_back(read_pairs[best_index].aln_one());
-	  }
-	}
-	best_index  = j; // Update index for new set of duplicates
-	include_rev = false;
-      }
+    for (size_t j = 0; j < num_paired; j++){
+      DuplicateSet& dup_set = dup_sets[read_sets[j]];
+      if (dup_set.num_reads > 1 && dup_set.best_index != j && dup_set.best_index < num_paired)
+	dup_set.include_rev |= (paired_strs[j].Name().compare(paired_strs[dup_set.best_index].Name()) == 0);
     }
 
-    // Keep best pair for last set of duplicates
-    if (read_pairs[best_index].single_ended())
-      unpaired_strs_by_rg[i].push_back(read_pairs[best_index].aln_one());
-    else {
-      paired_strs_by_rg[i].push_back(read_pairs[best_index].aln_one());
-      mate_pairs_by_rg[i].push_back(read_pairs[best_index].aln_two());
-      if (include_rev){
+    // Keep the best read from each set of duplicates, in the order in which the sets were first observed
+    std::vector<BamAlignment> kept_paired_strs, kept_mate_pairs, kept_unpaired;
+    for (auto set_iter = dup_sets.begin(); set_iter != dup_sets.end(); set_iter++){
+      dup_count += set_iter->num_reads - 1;
+      size_t index = set_iter->best_index;
+      if (index >= num_paired)
+	kept_unpaired.push_back(std::move(unpaired[index-num_paired]));
+      else if (set_iter->include_rev){
 	dup_count--;
-	paired_strs_by_rg[i].push_back(read_pairs[best_index].aln_two());
-	mate_pairs_by_rg[i].push_back(read_pairs[best_index].aln_one());
+	kept_paired_strs.push_back(paired_strs[index]);
+	kept_mate_pairs.push_back(mate_pairs[index]);
+	kept_paired_strs.push_back(std::move(mate_pairs[index]));
+	kept_mate_pairs.push_back(std::move(paired_strs[index]));
+      }
+      else {
+	kept_paired_strs.push_back(std::move(paired_strs[index]));
+	kept_mate_pairs.push_back(std::move(mate_pairs[index]));
       }
     }
+    paired_strs.swap(kept_paired_strs);
+    mate_pairs.swap(kept_mate_pairs);
+    unpaired.swap(kept_unpaired);
   }
   logger << "Removed " << dup_count << " sets of PCR duplicate reads" << std::endl;
 }
@@ -4,6 +4,7 @@
 #include <map>
 #include <set>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include "pedigree.h"
@@ -120,45 +121,54 @@ bool PedigreeGraph::build(std::string filename) {
   return topological_sort(nodes);
 }
 
-void PedigreeGraph::prune(std::set<std::string>& sample_set){
+void PedigreeGraph::prune(const std::vector<const VCF::VCFReader*>& vcfs){
+  // Look up each node's name in the VCFs' sample indices once, after which the nodes are referenced by their topological index
+  std::unordered_map<PedigreeNode*, int> node_indices;
+  std::vector<bool> has_data(nodes_.size(), true);
+  for (int i = 0; i < nodes_.size(); i++){
+    node_indices[nodes_[i]] = i;
+    for (auto vcf_iter = vcfs.begin(); vcf_iter != vcfs.end() && has_data[i]; vcf_iter++)
+      has_data[i] = (*vcf_iter)->has_sample(nodes_[i]->get_name());
+  }
+
   // Determine if each node has an upstream requested sample
-  std::map<PedigreeNode*, bool> upstream_status;
+  std::vector<bool> upstream_status(nodes_.size());
   for (int i = 0; i < nodes_.size(); i++){
-    bool has_upstream = sample_set.find(nodes_[i]->get_name()) != sample_set.end();
-    has_upstream     |= (nodes_[i]->has_father() && upstream_status[nodes_[i]->get_father()]);
-    has_upstream     |= (nodes_[i]->has_mother() && upstream_status[nodes_[i]->get_mother()]);
-    upstream_status[nodes_[i]] = has_upstream;
+    bool has_upstream = has_data[i];
+    has_upstream     |= (nodes_[i]->has_father() && upstream_status[node_indices[nodes_[i]->get_father()]]);
+    has_upstream     |= (nodes_[i]->has_mother() && upstream_status[node_indices[nodes_[i]->get_mother()]]);
+    upstream_status[i] = has_upstream;
   }
   
   // Determine if each node has a downstream requested sample
-  std::map<PedigreeNode*, bool> downstream_status;
+  std::vector<bool> downstream_status(nodes_.size());
   for (int i = nodes_.size()-1; i >= 0; i--) {
-    bool has_downstream = sample_set.find(nodes_[i]->get_name()) != sample_set.end();
+    bool has_downstream = has_data[i];
     for(auto iter = nodes_[i]->get_children().begin(); iter != nodes_[i]->get_children().end(); iter++)
-      has_downstream |= downstream_status[(*iter)];
-    downstream_status[nodes_[i]] = has_downstream;
+      has_downstream |= downstream_status[node_indices[*iter]];
+    downstream_status[i] = has_downstream;
   }
 
   // Determine if nodes have a requested sample both above and below
   // If not, mark them for removal
-  std::map<PedigreeNode*, bool> removal_status;
+  std::vector<bool> removal_status(nodes_.size());
   for (int i = 0; i < nodes_.size(); i++)
-    removal_status[nodes_[i]] = (!upstream_status[nodes_[i]] || !downstream_status[nodes_[i]]);
+    removal_status[i] = (!upstream_status[i] || !downstream_status[i]);
       
   // Remove and modify nodes member data accordingly
   int insert_index = 0;
   for (int i = 0; i < nodes_.size(); i++){
-    if (removal_status[nodes_[i]])
+    if (removal_status[i])
       delete nodes_[i];
     else {
-      if (nodes_[i]->has_father() && removal_status[nodes_[i]->get_father()])
+      if (nodes_[i]->has_father() && removal_status[node_indices[nodes_[i]->get_father()]])
 	nodes_[i]->set_father(NULL);
-      if (nodes_[i]->has_mother() && removal_status[nodes_[i]->get_mother()])
+      if (nodes_[i]->has_mother() && removal_status[node_indices[nodes_[i]->get_mother()]])
 	nodes_[i]->set_mother(NULL);
       int child_ins_index = 0;
       std::vector<PedigreeNode*>& children = nodes_[i]->get_children();;
       for (int j = 0; j < children.size(); j++)
-	if (!removal_status[children[j]])
+	if (!removal_status[node_indices[children[j]]])
 	  children[child_ins_index++] = children[j];
       children.resize(child_ins_index);
       nodes_[insert_index++] = nodes_[i];
@@ -312,7 +322,7 @@ void read_sample_list(std::string input_file, std::set<std::string>& sample_set)
     sample_set.insert(line);
 }
 
-void extract_pedigree_nuclear_families(std::string pedigree_fam_file, std::set<std::string>& samples_with_data,
+void extract_pedigree_nuclear_families(std::string pedigree_fam_file, const std::vector<const VCF::VCFReader*>& vcfs,
 				       std::vector<NuclearFamily>& nuclear_families, std::ostream& logger){
   assert(nuclear_families.size() == 0);
 
@@ -320,7 +330,7 @@ void extract_pedigree_nuclear_families(std::string pedigree_fam_file, std::set<s
   PedigreeGraph pedigree(pedigree_fam_file);
 
   // Remove irrelevant samples from pedigree
-  pedigree.prune(samples_with_data);
+  pedigree.prune(vcfs);
 
   // Identify simple nuclear families in the pedigree
   std::vector<PedigreeGraph> pedigree_components;
@@ -334,3 +344,8 @@ void extract_pedigree_nuclear_families(std::string pedigree_fam_file, std::set<s
   }
   logger << "Detected " << nuclear_families.size() << " nuclear families and " << num_others << " other family structures\n";
 }
+
+void get_family_samples(const std::vector<NuclearFamily>& families, std::set<std::string>& samples){
+  for (auto family_iter = families.begin(); family_iter != families.end(); family_iter++)
+    samples.insert(family_iter->get_samples().begin(), family_iter->get_samples().end());
+}
@@ -31,12 +31,13 @@ class NuclearFamily {
     samples_.insert(samples_.end(), children_.begin(), children_.end());
   }
 
-  void load_vcf_indices(VCF::VCFReader& vcf_reader){
+  void load_vcf_indices(const VCF::VCFReader& vcf_reader){
     vcf_indices_.clear();
     for (int i = 0; i < samples_.size(); i++){
-      if (!vcf_reader.has_sample(samples_[i]))
+      int vcf_index = vcf_reader.get_sample_index(samples_[i]);
+      if (vcf_index == -1)
 	printErrorAndDie("No sample data available in VCF");
-      vcf_indices_.push_back(vcf_reader.get_sample_index(samples_[i]));
+      vcf_indices_.push_back(vcf_index);
     }
   }
 
@@ -52,9 +53,9 @@ class NuclearFamily {
   const std::vector<std::string>& get_children() const { return children_; }
   const std::vector<std::string>& get_samples()  const { return samples_; }
 
-  bool is_missing_sample(std::set<std::string>& samples) const {
+  bool is_missing_sample(const VCF::VCFReader& vcf_reader) const {
     for (auto sample_iter = samples_.begin(); sample_iter != samples_.end(); sample_iter++)
-      if (samples.find(*sample_iter) == samples.end())
+      if (!vcf_reader.has_sample(*sample_iter))
         return true;
     return false;
   }
@@ -219,7 +220,8 @@ class PedigreeGraph {
     out << "Pedigree graph contains " << nodes_.size() << " nodes" << std::endl;
   }
 
-  void prune(std::set<std::string>& sample_set);
+  /* Removes the nodes that don't have a sample with data in every one of the VCFs both above and below them */
+  void prune(const std::vector<const VCF::VCFReader*>& vcfs);
 
   void split_into_connected_components(std::vector<PedigreeGraph>& components);
 
@@ -230,7 +232,11 @@ class PedigreeGraph {
 
 void read_sample_list(std::string input_file, std::set<std::string>& sample_set);
 
-void extract_pedigree_nuclear_families(std::string pedigree_fam_file, std::set<std::string>& samples_with_data,
+/* Extracts the nuclear families in the pedigree after pruning it to the samples with data in every one of the VCFs */
+void extract_pedigree_nuclear_families(std::string pedigree_fam_file, const std::vector<const VCF::VCFReader*>& vcfs,
                                        std::vector<NuclearFamily>& nuclear_families, std::ostream& logger);
 
+/* Adds the names of every parent and child in the nuclear families to SAMPLES */
+void get_family_samples(const std::vector<NuclearFamily>& families, std::set<std::string>& samples);
+
 #endif
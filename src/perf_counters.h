@@ -0,0 +1,181 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <ostream>
+
+// Kernels whose hardware events are counted when HipSTR is built with PERF=1.
+// Counts are inclusive, so the haplotype alignment counts include those of the stutter alignments it invokes
+enum PerfKernel {
+  PERF_HAP_ALIGNMENT,
+  PERF_STUTTER_ALIGNMENT,
+  PERF_POSTERIORS,
+  NUM_PERF_KERNELS
+};
+
+#ifdef HIPSTR_PERF_COUNTERS
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Counts instructions, cycles, cache misses and branch mispredictions within each kernel using Linux's perf_event_open.
+ * Each thread opens its own group of counters the first time it enters a kernel and accumulates its counts without any
+ * synchronization, so print() can only be invoked once the threads that enter kernels have finished. Reading the counters
+ * requires a system call on entry and exit, so the counts include some overhead for kernels with short invocations
+ */
+class PerfCounters {
+ public:
+  static const int NUM_EVENTS = 4;
+
+  struct ThreadCounters {
+    int fds[NUM_EVENTS];
+    bool valid; // False if the counters couldn't be opened, in which case nothing is counted
+    uint64_t totals[NUM_PERF_KERNELS][NUM_EVENTS];
+    uint64_t calls[NUM_PERF_KERNELS];
+  };
+
+ private:
+  std::mutex mutex_;
+  std::vector< std::unique_ptr<ThreadCounters> > threads_;
+
+  static PerfCounters& instance(){
+    static PerfCounters counters;
+    return counters;
+  }
+
+  static ThreadCounters* open_counters(){
+    static const uint64_t EVENTS[NUM_EVENTS] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+						PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    ThreadCounters* counters = new ThreadCounters();
+    memset(counters, 0, sizeof(ThreadCounters));
+    counters->valid = true;
+    for (int i = 0; i < NUM_EVENTS; i++){
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size           = sizeof(attr);
+      attr.type           = PERF_TYPE_HARDWARE;
+      attr.config         = EVENTS[i];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv     = 1;
+      attr.read_format    = PERF_FORMAT_GROUP;
+      counters->fds[i]    = syscall(__NR_perf_event_open, &attr, 0, -1, (i == 0 ? -1 : counters->fds[0]), 0);
+      if (counters->fds[i] == -1){
+	for (int j = 0; j < i; j++)
+	  close(counters->fds[j]);
+	counters->valid = false;
+	break;
+      }
+    }
+
+    PerfCounters& instance = PerfCounters::instance();
+    std::lock_guard<std::mutex> lock(instance.mutex_);
+    instance.threads_.emplace_back(counters);
+    return counters;
+  }
+
+ public:
+  ~PerfCounters(){
+    for (auto iter = threads_.begin(); iter != threads_.end(); iter++)
+      if ((*iter)->valid)
+	for (int i = 0; i < NUM_EVENTS; i++)
+	  close((*iter)->fds[i]);
+  }
+
+  static ThreadCounters* thread_counters(){
+    static thread_local ThreadCounters* counters = open_counters();
+    return counters;
+  }
+
+  /* Stores the current value of each of the thread's counters in VALUES */
+  static bool read_counters(ThreadCounters* counters, uint64_t* values){
+    uint64_t buffer[1+NUM_EVENTS];
+    if (read(counters->fds[0], buffer, sizeof(buffer)) != sizeof(buffer))
+      return false;
+    memcpy(values, buffer+1, NUM_EVENTS*sizeof(uint64_t));
+    return true;
+  }
+
+  static void print(std::ostream& out){
+    PerfCounters& instance = PerfCounters::instance();
+    const char* names[NUM_PERF_KERNELS] = {"Haplotype alignment", "Stutter alignment", "Posterior computation"};
+    uint64_t totals[NUM_PERF_KERNELS][NUM_EVENTS] = {{0}}, calls[NUM_PERF_KERNELS] = {0};
+    bool valid = true;
+    for (auto iter = instance.threads_.begin(); iter != instance.threads_.end(); iter++){
+      valid &= (*iter)->valid;
+      for (int kernel = 0; kernel < NUM_PERF_KERNELS; kernel++){
+	calls[kernel] += (*iter)->calls[kernel];
+	for (int i = 0; i < NUM_EVENTS; i++)
+	  totals[kernel][i] += (*iter)->totals[kernel][i];
+      }
+    }
+
+    out << "\nHardware event counts" << "\n";
+    if (!valid)
+      out << " WARNING: Failed to open the hardware counters for one or more threads. Check /proc/sys/kernel/perf_event_paranoid" << "\n";
+    std::ios::fmtflags flags = out.flags();
+    out << std::fixed << std::setprecision(2);
+    for (int kernel = 0; kernel < NUM_PERF_KERNELS; kernel++){
+      double instructions = std::max((uint64_t)1, totals[kernel][0]), cycles = std::max((uint64_t)1, totals[kernel][1]);
+      out << " " << std::left << std::setw(22) << names[kernel] << std::right << "= " << calls[kernel] << " calls, "
+	  << totals[kernel][0] << " instructions, " << totals[kernel][1] << " cycles, "
+	  << "IPC = " << instructions/cycles << ", "
+	  << "cache misses = " << 1000.0*totals[kernel][2]/instructions << " per 1k instructions, "
+	  << "branch mispredicts = " << 1000.0*totals[kernel][3]/instructions << " per 1k instructions" << "\n";
+    }
+    out.flags(flags);
+  }
+};
+
+/* Adds the hardware events that occur between its construction and destruction to the counts for the provided kernel */
+class PerfScope {
+ private:
+  PerfKernel kernel_;
+  PerfCounters::ThreadCounters* counters_;
+  uint64_t start_[PerfCounters::NUM_EVENTS];
+  bool started_;
+
+ public:
+  explicit PerfScope(PerfKernel kernel){
+    kernel_   = kernel;
+    counters_ = PerfCounters::thread_counters();
+    started_  = counters_->valid && PerfCounters::read_counters(counters_, start_);
+  }
+
+  ~PerfScope(){
+    uint64_t end[PerfCounters::NUM_EVENTS];
+    if (!started_ || !PerfCounters::read_counters(counters_, end))
+      return;
+    counters_->calls[kernel_]++;
+    for (int i = 0; i < PerfCounters::NUM_EVENTS; i++)
+      counters_->totals[kernel_][i] += end[i] - start_[i];
+  }
+
+  PerfScope(const PerfScope&)            = delete;
+  PerfScope& operator=(const PerfScope&) = delete;
+};
+
+#else
+
+// Hardware events aren't counted unless HipSTR is built with PERF=1, in which case these compile away
+class PerfScope {
+ public:
+  explicit PerfScope(PerfKernel kernel){}
+};
+
+class PerfCounters {
+ public:
+  static void print(std::ostream& out){}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+#include "phased_snp_panel.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "error.h"
+#include "vcf_reader.h"
+
+namespace {
+const char MAGIC[]     = "HSTRHPAN";
+const size_t MAGIC_LEN = 8;
+const uint32_t VERSION = 2;
+const uint64_t HET_MASK = 0x5555555555555555ULL; // Bit 2i of each word, which differs from bit 2i+1 for heterozygous samples
+
+template<typename T> T read_value(const char*& ptr){
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return value;
+}
+
+template<typename T> void append_value(std::string& buffer, T value){
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// The VCF's size and modification time, which identify the version of the file from which a panel was generated
+void vcf_file_stat(const std::string& vcf_file, uint64_t& size, int64_t& mtime){
+  struct stat st_buf;
+  if (stat(vcf_file.c_str(), &st_buf) != 0)
+    printErrorAndDie("Failed to open SNP VCF file " + vcf_file);
+  size  = st_buf.st_size;
+  mtime = st_buf.st_mtime;
+}
+
+size_t padding(size_t size){ return (8 - size%8)%8; }
+}
+
+PhasedSNPPanel::PhasedSNPPanel(const std::string& path){
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    printErrorAndDie("Failed to open phased SNP panel file " + path);
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) != 0)
+    printErrorAndDie("Failed to determine the size of phased SNP panel file " + path);
+  size_ = st_buf.st_size;
+  if (size_ < MAGIC_LEN + 3*sizeof(uint32_t) + 2*sizeof(uint64_t) + sizeof(int64_t))
+    printErrorAndDie("Phased SNP panel file " + path + " is truncated");
+  void* mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    printErrorAndDie("Failed to memory-map phased SNP panel file " + path);
+  data_ = static_cast<const char*>(mapping);
+  const char* end = data_ + size_;
+
+  const char* ptr = data_;
+  if (memcmp(ptr, MAGIC, MAGIC_LEN) != 0)
+    printErrorAndDie("File " + path + " is not a phased SNP panel file");
+  ptr += MAGIC_LEN;
+  if (read_value<uint32_t>(ptr) != VERSION)
+    printErrorAndDie("Phased SNP panel file " + path + " was generated by an incompatible version of HipSTR. Please delete it and rerun the analysis");
+  vcf_size_            = read_value<uint64_t>(ptr);
+  vcf_mtime_           = read_value<int64_t>(ptr);
+  uint32_t num_samples = read_value<uint32_t>(ptr);
+  row_words_           = read_value<uint32_t>(ptr);
+  if (num_samples == 0 || row_words_ != (num_samples+31)/32)
+    printErrorAndDie("Phased SNP panel file " + path + " is corrupted");
+  for (uint32_t i = 0; i < num_samples; i++){
+    if (ptr + sizeof(uint32_t) > end)
+      printErrorAndDie("Phased SNP panel file " + path + " is truncated");
+    uint32_t name_len = read_value<uint32_t>(ptr);
+    if (ptr + name_len > end)
+      printErrorAndDie("Phased SNP panel file " + path + " is truncated");
+    panel_samples_.push_back(std::string(ptr, name_len));
+    ptr += name_len;
+  }
+  ptr  += padding(ptr - data_);
+  rows_ = reinterpret_cast<const uint64_t*>(ptr);
+
+  // The chromosomes, positions and bases follow the rows, and are located using the trailer
+  const char* trailer = end - sizeof(uint64_t);
+  uint64_t chroms_offset = read_value<uint64_t>(trailer);
+  if (chroms_offset < (uint64_t)(ptr - data_) || chroms_offset + sizeof(uint32_t) > size_)
+    printErrorAndDie("Phased SNP panel file " + path + " is corrupted");
+  num_rows_ = (chroms_offset - (ptr - data_))/(row_words_*sizeof(uint64_t));
+  if (num_rows_*row_words_*sizeof(uint64_t) != chroms_offset - (ptr - data_))
+    printErrorAndDie("Phased SNP panel file " + path + " is corrupted");
+
+  ptr = data_ + chroms_offset;
+  uint32_t num_chroms = read_value<uint32_t>(ptr);
+  for (uint32_t i = 0; i < num_chroms; i++){
+    if (ptr + sizeof(uint32_t) > end)
+      printErrorAndDie("Phased SNP panel file " + path + " is truncated");
+    uint32_t name_len = read_value<uint32_t>(ptr);
+    if (ptr + name_len + 2*sizeof(uint64_t) > end)
+      printErrorAndDie("Phased SNP panel file " + path + " is truncated");
+    ChromInfo info;
+    info.name = std::string(ptr, name_len);
+    ptr += name_len;
+    info.first_row = read_value<uint64_t>(ptr);
+    info.num_rows  = read_value<uint64_t>(ptr);
+    if (info.first_row + info.num_rows > num_rows_)
+      printErrorAndDie("Phased SNP panel file " + path + " is corrupted");
+    chroms_.push_back(info);
+  }
+  ptr += padding(ptr - data_);
+  if (ptr + num_rows_*(sizeof(int32_t) + 2) + sizeof(uint64_t) != end)
+    printErrorAndDie("Phased SNP panel file " + path + " is corrupted");
+  positions_ = reinterpret_cast<const int32_t*>(ptr);
+  bases_     = ptr + num_rows_*sizeof(int32_t);
+
+  restrict_samples(std::set<std::string>());
+}
+
+PhasedSNPPanel::~PhasedSNPPanel(){
+  munmap(const_cast<char*>(data_), size_);
+}
+
+int PhasedSNPPanel::restrict_samples(const std::set<std::string>& samples){
+  samples_.clear();
+  sample_columns_.clear();
+  sample_map_.assign(panel_samples_.size(), -1);
+  for (uint32_t i = 0; i < panel_samples_.size(); i++){
+    if (samples.find(panel_samples_[i]) != samples.end()){
+      sample_map_[i] = samples_.size();
+      samples_.push_back(panel_samples_[i]);
+      sample_columns_.push_back(i);
+    }
+  }
+
+  // Retain all samples if none of them are present
+  if (samples_.empty()){
+    samples_ = panel_samples_;
+    for (uint32_t i = 0; i < panel_samples_.size(); i++){
+      sample_map_[i] = i;
+      sample_columns_.push_back(i);
+    }
+  }
+  return samples_.size();
+}
+
+int PhasedSNPPanel::find_chrom(const std::string& chrom) const {
+  auto chrom_iter = std::lower_bound(chroms_.begin(), chroms_.end(), chrom,
+				     [](const ChromInfo& info, const std::string& name){ return info.name.compare(name) < 0; });
+  if (chrom_iter != chroms_.end() && chrom_iter->name.compare(chrom) == 0)
+    return chrom_iter - chroms_.begin();
+  return -1;
+}
+
+uint64_t PhasedSNPPanel::lower_bound(int chrom, int32_t pos) const {
+  const int32_t* first = positions_ + chroms_[chrom].first_row;
+  return std::lower_bound(first, first + chroms_[chrom].num_rows, pos) - positions_;
+}
+
+void PhasedSNPPanel::get_phased_heterozygotes(uint64_t row, std::vector<int>& sample_indices, std::vector<int>& gts_a, std::vector<int>& gts_b) const {
+  sample_indices.clear();
+  gts_a.clear();
+  gts_b.clear();
+  const uint64_t* words = rows_ + row*row_words_;
+
+  // For a small subset of the samples, only their words are read. Otherwise, the heterozygous samples are extracted
+  // from each word of the row in bulk and those that weren't retained are discarded
+  if (8*sample_columns_.size() < panel_samples_.size()){
+    for (size_t i = 0; i < sample_columns_.size(); i++){
+      uint32_t column = sample_columns_[i];
+      uint64_t alleles = (words[column/32] >> (2*(column%32))) & 3;
+      if (alleles == 1 || alleles == 2){
+	sample_indices.push_back(i);
+	gts_a.push_back(alleles & 1);
+	gts_b.push_back(alleles >> 1);
+      }
+    }
+    return;
+  }
+
+  for (uint32_t i = 0; i < row_words_; i++){
+    uint64_t hets = (words[i] ^ (words[i] >> 1)) & HET_MASK;
+    while (hets != 0){
+      int bit    = __builtin_ctzll(hets);
+      int sample = sample_map_[32*i + bit/2];
+      if (sample != -1){
+	sample_indices.push_back(sample);
+	gts_a.push_back((words[i] >> bit) & 1);
+	gts_b.push_back(1 - gts_a.back());
+      }
+      hets &= hets-1;
+    }
+  }
+}
+
+void PhasedSNPPanel::write(const std::string& vcf_file, const std::string& path, std::ostream& logger){
+  // Record the VCF's size and modification time before it's read, so that a panel generated while it's modified won't match it
+  uint64_t vcf_size;
+  int64_t vcf_mtime;
+  vcf_file_stat(vcf_file, vcf_size, vcf_mtime);
+  std::string vcf_path(vcf_file);
+  VCF::VCFReader snp_vcf(vcf_path);
+  const std::vector<std::string>& samples = snp_vcf.get_samples();
+  uint32_t row_words = (samples.size()+31)/32;
+  if (row_words == 0)
+    printErrorAndDie("SNP VCF file " + vcf_file + " doesn't contain any samples");
+
+  std::string header(MAGIC, MAGIC_LEN);
+  append_value<uint32_t>(header, VERSION);
+  append_value<uint64_t>(header, vcf_size);
+  append_value<int64_t>(header,  vcf_mtime);
+  append_value<uint32_t>(header, samples.size());
+  append_value<uint32_t>(header, row_words);
+  for (auto sample_iter = samples.begin(); sample_iter != samples.end(); sample_iter++){
+    append_value<uint32_t>(header, sample_iter->size());
+    header.append(*sample_iter);
+  }
+  header.append(padding(header.size()), '\0');
+
+  std::stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid();
+  FILE* output = fopen(tmp_path.str().c_str(), "wb");
+  if (output == NULL)
+    printErrorAndDie("Failed to open " + tmp_path.str() + " to write the phased SNP panel");
+  bool success = (fwrite(header.data(), 1, header.size(), output) == header.size());
+
+  // The rows are written as the VCF is read, as they're too large to retain, while the positions and bases are written at the end
+  std::map<std::string, std::pair<uint64_t, uint64_t> > chrom_rows;
+  std::string positions, bases, prev_chrom;
+  std::vector<uint64_t> row(row_words);
+  std::vector<int> sample_indices, gts_a, gts_b;
+  uint64_t num_rows = 0;
+  int32_t prev_pos  = 0;
+  VCF::Variant variant;
+  while (success && snp_vcf.get_next_variant(variant)){
+    if (!variant.is_biallelic_snp())
+      continue;
+
+    std::string chrom = variant.get_chromosome();
+    int32_t pos       = variant.get_position();
+    if (chrom.compare(prev_chrom) != 0){
+      if (chrom_rows.find(chrom) != chrom_rows.end())
+	printErrorAndDie("SNP VCF file " + vcf_file + " must be sorted by chromosome and position to generate a phased SNP panel");
+      chrom_rows[chrom] = std::pair<uint64_t, uint64_t>(num_rows, 0);
+      prev_chrom = chrom;
+    }
+    else if (pos < prev_pos)
+      printErrorAndDie("SNP VCF file " + vcf_file + " must be sorted by chromosome and position to generate a phased SNP panel");
+    prev_pos = pos;
+
+    std::fill(row.begin(), row.end(), 0);
+    variant.get_phased_heterozygotes(sample_indices, gts_a, gts_b);
+    for (size_t i = 0; i < sample_indices.size(); i++)
+      row[sample_indices[i]/32] |= ((uint64_t)(gts_a[i] | (gts_b[i] << 1))) << (2*(sample_indices[i]%32));
+    success &= (fwrite(row.data(), sizeof(uint64_t), row_words, output) == row_words);
+
+    append_value<int32_t>(positions, pos);
+    bases.push_back(variant.get_allele(0)[0]);
+    bases.push_back(variant.get_allele(1)[0]);
+    chrom_rows[chrom].second++;
+    num_rows++;
+  }
+  logger << "Stored the phased genotypes of " << num_rows << " SNPs for " << samples.size() << " samples from SNP VCF " << vcf_file << std::endl;
+
+  std::string trailer;
+  append_value<uint32_t>(trailer, chrom_rows.size());
+  for (auto chrom_iter = chrom_rows.begin(); chrom_iter != chrom_rows.end(); chrom_iter++){
+    append_value<uint32_t>(trailer, chrom_iter->first.size());
+    trailer.append(chrom_iter->first);
+    append_value<uint64_t>(trailer, chrom_iter->second.first);
+    append_value<uint64_t>(trailer, chrom_iter->second.second);
+  }
+  trailer.append(padding(trailer.size()), '\0');
+  trailer.append(positions);
+  trailer.append(bases);
+  append_value<uint64_t>(trailer, header.size() + num_rows*row_words*sizeof(uint64_t));
+  success &= (fwrite(trailer.data(), 1, trailer.size(), output) == trailer.size());
+  success &= (fclose(output) == 0);
+  if (!success){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to write the phased SNP panel to " + tmp_path.str());
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to rename the phased SNP panel file " + tmp_path.str() + " to " + path);
+}
+
+PhasedSNPPanel* loadPhasedSNPPanel(const std::string& vcf_file, const std::string& path, std::ostream& logger){
+  if (access(path.c_str(), F_OK) != 0){
+    logger << "Generating phased SNP panel file " << path << " from SNP VCF " << vcf_file << std::endl;
+    PhasedSNPPanel::write(vcf_file, path, logger);
+  }
+  logger << "Reading phased SNP panel " << path << std::endl;
+  PhasedSNPPanel* panel = new PhasedSNPPanel(path);
+  uint64_t vcf_size;
+  int64_t vcf_mtime;
+  vcf_file_stat(vcf_file, vcf_size, vcf_mtime);
+  if (panel->vcf_size() != vcf_size || panel->vcf_mtime() != vcf_mtime){
+    delete panel;
+    printErrorAndDie("Phased SNP panel file " + path + " doesn't match the SNP VCF " + vcf_file
+		     + ". Please delete it and rerun the analysis to regenerate it");
+  }
+  return panel;
+}
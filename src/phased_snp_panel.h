@@ -0,0 +1,94 @@
+#ifndef PHASED_SNP_PANEL_H_
+#define PHASED_SNP_PANEL_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Read-only, memory-mapped panel of the phased biallelic SNPs in a --snp-vcf file. Decoding the genotypes of every record in a
+ * locus' window dominates the SNP info extraction for VCFs with many thousands of samples, whereas the panel stores each SNP's
+ * haplotypes as a bit-packed row, so that the window is located using a binary search and each row is scanned at memory bandwidth.
+ * Only the information used to phase reads is retained: each sample's phased heterozygous genotype, with all other genotypes
+ * (homozygous, missing or unphased) stored as 0|0. Rows can be scanned for a subset of the samples, in which case only the words
+ * containing those samples are read
+ *
+ * File layout (all integers little-endian):
+ *   header:    magic "HSTRHPAN", uint32 version, uint64 size and int64 modification time of the VCF, uint32 number of samples,
+ *              uint32 number of 64-bit words per row, and each sample's uint32 name length and name, zero-padded to a multiple of 8 bytes
+ *   rows:      for each SNP in VCF order, a row in which bits 2i and 2i+1 contain sample i's alleles on its first and second haplotypes
+ *   chroms:    uint32 number of chromosomes and for each chromosome (in sorted order), uint32 name length, name, uint64 index of
+ *              its first row and uint64 number of rows, zero-padded to a multiple of 8 bytes
+ *   positions: for each row, the SNP's int32 1-based position
+ *   bases:     for each row, the SNP's reference and alternate bases
+ *   trailer:   uint64 offset of the chroms section
+ */
+class PhasedSNPPanel {
+ private:
+  struct ChromInfo {
+    std::string name;
+    uint64_t first_row;
+    uint64_t num_rows;
+  };
+
+  std::vector<ChromInfo> chroms_;
+  std::vector<std::string> panel_samples_;
+  std::vector<std::string> samples_;     // Samples retained by restrict_samples(), in panel order
+  std::vector<uint32_t> sample_columns_; // Panel index of each retained sample
+  std::vector<int> sample_map_;          // Index of each panel sample among the retained samples, or -1 if it isn't retained
+  uint64_t vcf_size_;
+  int64_t vcf_mtime_;
+  uint64_t num_rows_;
+  uint32_t row_words_;
+  const uint64_t* rows_;
+  const int32_t* positions_;
+  const char* bases_;
+  const char* data_;
+  size_t size_;
+
+ public:
+  explicit PhasedSNPPanel(const std::string& path);
+
+  ~PhasedSNPPanel();
+
+  uint64_t vcf_size()  const { return vcf_size_;  }
+  int64_t  vcf_mtime() const { return vcf_mtime_; }
+
+  /*
+   * Restricts the samples returned by get_samples() and get_phased_heterozygotes() to those in SAMPLES that are present in the
+   * panel, as VCFReader::restrict_samples() does. If none of the samples are present, all samples are retained. Returns the number
+   * of samples retained
+   */
+  int restrict_samples(const std::set<std::string>& samples);
+
+  const std::vector<std::string>& get_samples() const { return samples_; }
+
+  /* Returns the index of the chromosome, or -1 if the panel has no SNPs on it */
+  int find_chrom(const std::string& chrom) const;
+
+  /* Returns the index of the chromosome's first row whose 1-based position is at least POS */
+  uint64_t lower_bound(int chrom, int32_t pos) const;
+
+  /* Returns the index one past the chromosome's last row */
+  uint64_t chrom_end(int chrom) const { return chroms_[chrom].first_row + chroms_[chrom].num_rows; }
+
+  int32_t position(uint64_t row) const { return positions_[row];     }
+  char ref_base(uint64_t row)    const { return bases_[2*row];       }
+  char alt_base(uint64_t row)    const { return bases_[2*row + 1];   }
+
+  /*
+   * Stores the retained samples with phased heterozygous genotypes for the SNP in ROW, in increasing order, along with their
+   * alleles (0 or 1) on each haplotype, as VCF::Variant::get_phased_heterozygotes() does
+   */
+  void get_phased_heterozygotes(uint64_t row, std::vector<int>& sample_indices, std::vector<int>& gts_a, std::vector<int>& gts_b) const;
+
+  /* Writes a panel of the phased SNPs in the bgzipped VCF to PATH, using a temporary file that's renamed once it's complete */
+  static void write(const std::string& vcf_file, const std::string& path, std::ostream& logger);
+};
+
+/* Loads the phased SNP panel at PATH for the SNP VCF, after generating it from the VCF if it doesn't exist */
+PhasedSNPPanel* loadPhasedSNPPanel(const std::string& vcf_file, const std::string& path, std::ostream& logger);
+
+#endif
@@ -1,29 +1,182 @@
 #ifndef PROCESS_TIMER_H_
 #define PROCESS_TIMER_H_
 
-#include <map>
+#include <time.h>
+
+#include <chrono>
+#include <iomanip>
+#include <ostream>
 #include <string>
 
+#include "alloc_counter.h"
+#include "sampling_profiler.h"
+
+// Timed phases of the analysis. Each phase is nested within the parent listed in PHASE_INFO below
+enum TimedPhase {
+  PHASE_BAM_SEEK,
+  PHASE_READ_FILTER,
+  PHASE_SNP_INFO,
+  PHASE_STUTTER_ESTIMATION,
+  PHASE_GENOTYPING,
+  PHASE_LEFT_ALIGNMENT,
+  PHASE_HAP_GENERATION,
+  PHASE_HAP_ALIGNMENT,
+  PHASE_FLANK_ASSEMBLY,
+  PHASE_POSTERIORS,
+  PHASE_ALN_TRACEBACK,
+  NUM_TIMED_PHASES
+};
+
+/*
+ * Accumulates the wall-clock and CPU time spent in each phase, along with the heap allocations made within it when HipSTR
+ * is built with ALLOC_STATS=1. Each thread records its times in its own timer, and the timers are merged using add_times()
+ * once the threads have finished
+ */
 class ProcessTimer {
  private:
-  std::map<std::string, double> total_times_;
+  struct PhaseInfo {
+    const char* name;
+    int parent; // -1 for top-level phases
+  };
+
+  static const PhaseInfo& phase_info(int phase){
+    static const PhaseInfo PHASE_INFO[NUM_TIMED_PHASES] = {
+      {"BAM seek time",         -1},
+      {"Read filtering",        -1},
+      {"SNP info extraction",   -1},
+      {"Stutter estimation",    -1},
+      {"Genotyping",            -1},
+      {"Left alignment",        PHASE_GENOTYPING},
+      {"Haplotype generation",  PHASE_GENOTYPING},
+      {"Haplotype alignment",   PHASE_GENOTYPING},
+      {"Flank assembly",        PHASE_GENOTYPING},
+      {"Posterior computation", PHASE_GENOTYPING},
+      {"Alignment traceback",   PHASE_GENOTYPING}
+    };
+    return PHASE_INFO[phase];
+  }
+
+  double wall_times_[NUM_TIMED_PHASES];
+  double cpu_times_[NUM_TIMED_PHASES];
+  int    counts_[NUM_TIMED_PHASES];
+  AllocCounts allocs_[NUM_TIMED_PHASES];
+
+  void print_phase(int phase, int depth, std::ostream& out) const {
+    out << std::string(depth, '\t') << " " << std::left << std::setw(22) << phase_info(phase).name << std::right
+	<< "= " << wall_times_[phase] << " seconds (CPU = " << cpu_times_[phase] << " seconds";
+    if (AllocCounter::ENABLED)
+      out << ", allocations = " << allocs_[phase].count << " (" << allocs_[phase].bytes/1048576.0 << " MB)";
+    out << ")\n";
+    for (int child = phase+1; child < NUM_TIMED_PHASES; child++)
+      if (phase_info(child).parent == phase && counts_[child] != 0)
+	print_phase(child, depth+1, out);
+  }
 
  public:
-  ProcessTimer(){}
-  
-  void add_time(std::string key, double time){
-    if (total_times_.find(key) == total_times_.end())
-      total_times_[key] = 0.0;
-    total_times_[key] += time;
+  ProcessTimer(){ clear(); }
+
+  static const char* phase_name(int phase){ return phase_info(phase).name; }
+
+  /* Wall-clock time in seconds, measured using a monotonic clock */
+  static double wall_clock(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /* CPU time in seconds consumed by the calling thread */
+  static double thread_cpu_clock(){
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+  }
+
+  void clear(){
+    for (int i = 0; i < NUM_TIMED_PHASES; i++){
+      wall_times_[i] = cpu_times_[i] = 0;
+      counts_[i]     = 0;
+      allocs_[i].count = allocs_[i].bytes = 0;
+    }
   }
 
-  double get_total_time(std::string key){
-    auto iter = total_times_.find(key);
-    if (iter == total_times_.end())
-      return 0.0;
-    return iter->second;
+  void add_time(TimedPhase phase, double wall_time, double cpu_time, uint64_t num_allocs = 0, uint64_t alloc_bytes = 0){
+    wall_times_[phase] += wall_time;
+    cpu_times_[phase]  += cpu_time;
+    counts_[phase]++;
+    allocs_[phase].count += num_allocs;
+    allocs_[phase].bytes += alloc_bytes;
+  }
+
+  void add_times(const ProcessTimer& other){
+    for (int i = 0; i < NUM_TIMED_PHASES; i++){
+      wall_times_[i] += other.wall_times_[i];
+      cpu_times_[i]  += other.cpu_times_[i];
+      counts_[i]     += other.counts_[i];
+      allocs_[i].count += other.allocs_[i].count;
+      allocs_[i].bytes += other.allocs_[i].bytes;
+    }
+  }
+
+  double wall_time(TimedPhase phase) const { return wall_times_[phase]; }
+  double cpu_time(TimedPhase phase)  const { return cpu_times_[phase];  }
+  int count(TimedPhase phase)        const { return counts_[phase];     }
+  const AllocCounts& allocs(TimedPhase phase) const { return allocs_[phase]; }
+
+  /* Writes the time spent in each top-level phase, followed by the phases nested within it that were entered */
+  void print(std::ostream& out) const {
+    for (int phase = 0; phase < NUM_TIMED_PHASES; phase++)
+      if (phase_info(phase).parent == -1)
+	print_phase(phase, 0, out);
   }
 };
 
+/*
+ * Records the time between its construction and either its destruction or the first call to stop() as time spent in
+ * a phase. Scopes for nested phases are simply opened within the scope of their parent phase, so a phase's allocations
+ * include those of its nested phases. If the sampling profiler is enabled, the phase is also added to the thread's
+ * profiling tag for the duration of the scope
+ */
+class ScopedTimer {
+ private:
+  ProcessTimer& timer_;
+  TimedPhase phase_;
+  double wall_start_, cpu_start_;
+  bool running_;
+  bool profiling_;
+  uint64_t prev_tag_;
+  AllocCounts alloc_start_;
+
+ public:
+  ScopedTimer(ProcessTimer& timer, TimedPhase phase) : timer_(timer), phase_(phase){
+    wall_start_ = ProcessTimer::wall_clock();
+    cpu_start_  = ProcessTimer::thread_cpu_clock();
+    running_    = true;
+    profiling_  = SamplingProfiler::enabled();
+    if (AllocCounter::ENABLED)
+      alloc_start_ = AllocCounter::thread_counts();
+    if (profiling_){
+      prev_tag_ = SamplingProfiler::thread_tag().load(std::memory_order_relaxed);
+      SamplingProfiler::thread_tag().store(SamplingProfiler::push_phase(prev_tag_, phase), std::memory_order_relaxed);
+    }
+  }
+
+  ~ScopedTimer(){ stop(); }
+
+  void stop(){
+    if (!running_)
+      return;
+    if (AllocCounter::ENABLED){
+      const AllocCounts& allocs = AllocCounter::thread_counts();
+      timer_.add_time(phase_, ProcessTimer::wall_clock() - wall_start_, ProcessTimer::thread_cpu_clock() - cpu_start_,
+		      allocs.count - alloc_start_.count, allocs.bytes - alloc_start_.bytes);
+    }
+    else
+      timer_.add_time(phase_, ProcessTimer::wall_clock() - wall_start_, ProcessTimer::thread_cpu_clock() - cpu_start_);
+    running_ = false;
+    if (profiling_)
+      SamplingProfiler::thread_tag().store(prev_tag_, std::memory_order_relaxed);
+  }
+
+  ScopedTimer(const ScopedTimer&)            = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
 
 #endif
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "error.h"
+#include "progress_reporter.h"
+
+int64_t resident_memory(){
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return -1;
+  long total_pages, resident_pages;
+  int num_read = fscanf(file, "%ld %ld", &total_pages, &resident_pages);
+  fclose(file);
+  if (num_read != 2)
+    return -1;
+  return (int64_t)resident_pages*sysconf(_SC_PAGESIZE);
+}
+
+static std::string format_duration(double seconds){
+  int64_t total = (int64_t)(seconds + 0.5);
+  std::stringstream ss;
+  ss << total/3600 << ":" << std::setfill('0') << std::setw(2) << (total/60)%60 << ":" << std::setw(2) << total%60;
+  return ss.str();
+}
+
+ProgressReporter::ProgressReporter(size_t total_loci, int interval, const std::string& status_file){
+  if (interval <= 0)
+    printErrorAndDie("The progress reporting interval must be greater than 0 seconds");
+  total_loci_  = total_loci;
+  interval_    = interval;
+  status_file_ = status_file;
+  start_time_  = std::chrono::steady_clock::now();
+  num_loci_    = 0;
+  num_reads_   = 0;
+  finished_    = false;
+  window_.push_back(Sample{0.0, 0, 0});
+  reporter_    = std::thread(&ProgressReporter::run, this);
+}
+
+void ProgressReporter::run(){
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!finish_cv_.wait_for(lock, std::chrono::seconds(interval_), [&]{ return finished_; })){
+    lock.unlock();
+    report(false);
+    lock.lock();
+  }
+}
+
+void ProgressReporter::finish(){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_)
+      return;
+    finished_ = true;
+  }
+  finish_cv_.notify_all();
+  reporter_.join();
+  report(true);
+}
+
+void ProgressReporter::report(bool final_report){
+  double elapsed   = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count();
+  size_t num_loci  = num_loci_;
+  int64_t num_reads = num_reads_;
+  std::string chrom;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    chrom = cur_chrom_;
+  }
+
+  // Only the reporter thread (or the final report, once it has stopped) accesses the window
+  while (window_.size() > 1 && elapsed - window_[1].time >= MOVING_WINDOW)
+    window_.pop_front();
+  const Sample& oldest = window_.front();
+  double window_time   = elapsed - oldest.time;
+  double loci_rate     = (window_time > 0 ? (num_loci - oldest.num_loci)/window_time   : 0.0);
+  double read_rate     = (window_time > 0 ? (num_reads - oldest.num_reads)/window_time : 0.0);
+  window_.push_back(Sample{elapsed, num_loci, num_reads});
+
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1)
+     << (final_report ? "Finished " : "Progress: ") << num_loci << "/" << total_loci_ << " loci ("
+     << (total_loci_ == 0 ? 100.0 : 100.0*num_loci/total_loci_) << "%)"
+     << ", " << loci_rate << " loci/sec, " << read_rate << " reads/sec"
+     << ", chrom " << (chrom.empty() ? "NA" : chrom);
+  int64_t rss = resident_memory();
+  if (rss >= 0)
+    ss << ", RSS " << rss/(1024.0*1024.0) << " MB";
+  ss << ", elapsed " << format_duration(elapsed);
+  if (!final_report){
+    if (loci_rate > 0){
+      double remaining = (total_loci_ - num_loci)/loci_rate;
+      time_t finish_time = time(NULL) + (time_t)remaining;
+      char time_buffer[64];
+      strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", localtime(&finish_time));
+      ss << ", ETA " << format_duration(remaining) << " (" << time_buffer << ")";
+    }
+    else
+      ss << ", ETA NA";
+  }
+
+  if (status_file_.empty()){
+    std::cerr << ss.str() << std::endl;
+    return;
+  }
+
+  // Replace the status file atomically, so that it never contains a partial report
+  std::string tmp_file = status_file_ + ".tmp";
+  std::ofstream out(tmp_file.c_str());
+  if (!out.is_open())
+    printErrorAndDie("Failed to write the progress status file " + tmp_file);
+  out << ss.str() << "\n";
+  out.close();
+  if (rename(tmp_file.c_str(), status_file_.c_str()) != 0)
+    printErrorAndDie("Failed to replace the progress status file " + status_file_);
+}
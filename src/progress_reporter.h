@@ -0,0 +1,70 @@
+#ifndef PROGRESS_REPORTER_H_
+#define PROGRESS_REPORTER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/* Returns the resident set size of the process in bytes, or -1 if it can't be determined */
+int64_t resident_memory();
+
+/*
+ * Periodically reports the number of loci analyzed, the recent locus and read throughput, the process' resident memory
+ * and the projected finish time. Reports are written to standard error, or to a status file that is atomically replaced
+ * with the latest report so that external tools can poll it. Loci and reads can be recorded from any thread
+ */
+class ProgressReporter {
+ private:
+  // Throughput is measured over the reports made during the last MOVING_WINDOW seconds
+  static const int MOVING_WINDOW = 60;
+
+  struct Sample {
+    double time;
+    size_t num_loci;
+    int64_t num_reads;
+  };
+
+  size_t total_loci_;
+  int interval_;            // Seconds between consecutive reports
+  std::string status_file_; // Empty if reports are written to standard error
+  std::chrono::steady_clock::time_point start_time_;
+  std::deque<Sample> window_;
+
+  std::atomic<size_t> num_loci_;
+  std::atomic<int64_t> num_reads_;
+  std::string cur_chrom_;
+
+  bool finished_;
+  std::mutex mutex_;
+  std::condition_variable finish_cv_;
+  std::thread reporter_;
+
+  void run();
+  void report(bool final_report);
+
+ public:
+  ProgressReporter(size_t total_loci, int interval, const std::string& status_file);
+
+  ~ProgressReporter(){ finish(); }
+
+  void add_reads(int64_t num_reads){ num_reads_ += num_reads; }
+
+  void finish_locus(const std::string& chrom){
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cur_chrom_ = chrom;
+    }
+    num_loci_++;
+  }
+
+  /* Stops the reporter and writes a final report */
+  void finish();
+};
+
+#endif
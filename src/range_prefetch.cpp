@@ -0,0 +1,495 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iterator>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HIPSTR_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "error.h"
+#include "range_prefetch.h"
+#include "hfile_internal.h"
+
+void merge_byte_ranges(std::vector<ByteRange>& ranges, int64_t max_gap){
+  if (ranges.empty())
+    return;
+  std::sort(ranges.begin(), ranges.end(), [](const ByteRange& a, const ByteRange& b){ return a.start < b.start; });
+  size_t num_merged = 0;
+  for (size_t i = 1; i < ranges.size(); i++){
+    if (ranges[i].start <= ranges[num_merged].end + max_gap)
+      ranges[num_merged].end = std::max(ranges[num_merged].end, ranges[i].end);
+    else
+      ranges[++num_merged] = ranges[i];
+  }
+  ranges.resize(num_merged+1, ByteRange(0, 0));
+}
+
+bool is_url_path(const std::string& path){
+  size_t pos = path.find("://");
+  return pos != std::string::npos && pos > 0;
+}
+
+bool RangeCache::request(ByteRange& range){
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto next_iter = requested_.upper_bound(range.start);
+  if (next_iter != requested_.begin() && std::prev(next_iter)->second > range.start)
+    range.start = std::prev(next_iter)->second;
+  next_iter = requested_.lower_bound(range.start);
+  if (next_iter != requested_.end() && next_iter->first < range.end)
+    range.end = next_iter->first;
+  if (range.start >= range.end)
+    return false;
+
+  // Coalesce the interval with any adjacent intervals
+  int64_t start = range.start, end = range.end;
+  if (next_iter != requested_.end() && next_iter->first == end){
+    end = next_iter->second;
+    next_iter = requested_.erase(next_iter);
+  }
+  if (next_iter != requested_.begin() && std::prev(next_iter)->second == start)
+    std::prev(next_iter)->second = end;
+  else
+    requested_[start] = end;
+  pending_.push_back(range);
+  return true;
+}
+
+void RangeCache::fill(const ByteRange& range, std::string& data){
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto iter = pending_.begin(); iter != pending_.end(); iter++){
+    if (iter->start == range.start){
+      pending_.erase(iter);
+      break;
+    }
+  }
+  if (!data.empty()){
+    cached_bytes_ += data.size();
+    blocks_[range.start].swap(data);
+    fetch_order_.push_back(range.start);
+    while (cached_bytes_ > max_bytes_ && fetch_order_.size() > 1){
+      auto block_iter = blocks_.find(fetch_order_.front());
+      cached_bytes_ -= block_iter->second.size();
+      blocks_.erase(block_iter);
+      fetch_order_.pop_front();
+    }
+  }
+  fetched_.notify_all();
+}
+
+size_t RangeCache::read(int64_t offset, char* buffer, size_t nbytes){
+  std::unique_lock<std::mutex> lock(mutex_);
+  fetched_.wait(lock, [&]{
+      for (auto iter = pending_.begin(); iter != pending_.end(); iter++)
+	if (offset >= iter->start && offset < iter->end)
+	  return false;
+      return true;
+    });
+
+  auto block_iter = blocks_.upper_bound(offset);
+  if (block_iter == blocks_.begin())
+    return 0;
+  --block_iter;
+  int64_t block_end = block_iter->first + (int64_t)block_iter->second.size();
+  if (offset >= block_end)
+    return 0;
+  size_t num_bytes = std::min(nbytes, (size_t)(block_end - offset));
+  memcpy(buffer, block_iter->second.data() + (offset - block_iter->first), num_bytes);
+  return num_bytes;
+}
+
+
+
+namespace {
+typedef struct {
+  hFILE base;
+  hFILE* file;                          // Underlying file, read whenever the cache doesn't contain the requested bytes
+  std::shared_ptr<RangeCache>* cache;
+  off_t pos;                            // Position of the next read
+  off_t file_pos;                       // Position of the underlying file
+} hFILE_cached;
+
+ssize_t cached_read(hFILE* fpv, void* buffer, size_t nbytes){
+  hFILE_cached* fp = (hFILE_cached*) fpv;
+  size_t num_bytes = (*fp->cache)->read(fp->pos, (char*)buffer, nbytes);
+  if (num_bytes == 0){
+    if (fp->file_pos != fp->pos){
+      if (hseek(fp->file, fp->pos, SEEK_SET) < 0)
+	return -1;
+      fp->file_pos = fp->pos;
+    }
+    ssize_t num_read = hread(fp->file, buffer, nbytes);
+    if (num_read < 0)
+      return num_read;
+    num_bytes     = num_read;
+    fp->file_pos += num_bytes;
+  }
+  fp->pos += num_bytes;
+  return num_bytes;
+}
+
+ssize_t cached_write(hFILE* fpv, const void* buffer, size_t nbytes){
+  errno = EBADF;
+  return -1;
+}
+
+off_t cached_seek(hFILE* fpv, off_t offset, int whence){
+  hFILE_cached* fp = (hFILE_cached*) fpv;
+  if (whence == SEEK_SET)
+    fp->pos = offset;
+  else if (whence == SEEK_CUR)
+    fp->pos += offset;
+  else {
+    off_t pos = hseek(fp->file, offset, whence);
+    if (pos < 0)
+      return pos;
+    fp->pos = fp->file_pos = pos;
+  }
+  return fp->pos;
+}
+
+int cached_flush(hFILE* fpv){
+  return 0;
+}
+
+int cached_close(hFILE* fpv){
+  hFILE_cached* fp = (hFILE_cached*) fpv;
+  delete fp->cache;
+  return hclose(fp->file);
+}
+
+const struct hFILE_backend cached_backend = { cached_read, cached_write, cached_seek, cached_flush, cached_close };
+}
+
+hFILE* open_cached_hfile(const std::string& path, std::shared_ptr<RangeCache> cache){
+  hFILE* file = hopen(path.c_str(), "r");
+  if (file == NULL)
+    return NULL;
+  hFILE_cached* fp = (hFILE_cached*) hfile_init(sizeof(hFILE_cached), "r", 0);
+  if (fp == NULL){
+    if (hclose(file) != 0){}
+    return NULL;
+  }
+  fp->file         = file;
+  fp->cache        = new std::shared_ptr<RangeCache>(cache);
+  fp->pos          = 0;
+  fp->file_pos     = 0;
+  fp->base.backend = &cached_backend;
+  return &fp->base;
+}
+
+
+
+/*
+ * Minimal io_uring submission and completion queue, driven directly through the system calls so that liburing isn't required.
+ * It's only used by a single thread, so the ring's indices only require ordering with respect to the kernel
+ */
+class UringQueue {
+#ifdef HIPSTR_IO_URING
+ private:
+  int ring_fd_;
+  unsigned sq_entries_;
+  unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+  unsigned *cq_head_, *cq_tail_, *cq_mask_;
+  io_uring_sqe* sqes_;
+  io_uring_cqe* cqes_;
+  void *sq_ring_, *cq_ring_;
+  size_t sq_ring_bytes_, cq_ring_bytes_, sqe_bytes_;
+  unsigned num_queued_; // Reads added to the submission queue since the last submission
+
+ public:
+  explicit UringQueue(unsigned entries){
+    sq_ring_ = cq_ring_ = MAP_FAILED;
+    sqes_    = (io_uring_sqe*)MAP_FAILED;
+    num_queued_ = 0;
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0)
+      return;
+    sq_entries_    = params.sq_entries;
+    sq_ring_bytes_ = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cq_ring_bytes_ = params.cq_off.cqes  + params.cq_entries*sizeof(io_uring_cqe);
+    sqe_bytes_     = params.sq_entries*sizeof(io_uring_sqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (single_mmap)
+      sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+    sq_ring_ = mmap(NULL, sq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+      return;
+    cq_ring_ = (single_mmap ? sq_ring_ : mmap(NULL, cq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING));
+    if (cq_ring_ == MAP_FAILED)
+      return;
+    sqes_ = (io_uring_sqe*)mmap(NULL, sqe_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+      return;
+
+    char* sq = (char*)sq_ring_;
+    char* cq = (char*)cq_ring_;
+    sq_head_  = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_  = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask_  = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned*)(sq + params.sq_off.array);
+    cq_head_  = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_  = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_  = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_     = (io_uring_cqe*)(cq + params.cq_off.cqes);
+  }
+
+  ~UringQueue(){
+    if (sqes_ != MAP_FAILED)
+      munmap(sqes_, sqe_bytes_);
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+      munmap(cq_ring_, cq_ring_bytes_);
+    if (sq_ring_ != MAP_FAILED)
+      munmap(sq_ring_, sq_ring_bytes_);
+    if (ring_fd_ >= 0)
+      close(ring_fd_);
+  }
+
+  bool ok() const { return ring_fd_ >= 0 && sqes_ != MAP_FAILED; }
+
+  unsigned capacity() const { return sq_entries_; }
+
+  // Add a read of NBYTES bytes at OFFSET in FD to the submission queue, returning false if the queue is full
+  bool queue_read(int fd, char* buffer, size_t nbytes, int64_t offset, uint64_t user_data){
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+      return false;
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buffer;
+    sqe->len       = nbytes;
+    sqe->off       = offset;
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail+1, __ATOMIC_RELEASE);
+    num_queued_++;
+    return true;
+  }
+
+  unsigned num_completions() const { return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_; }
+
+  // Submit the queued reads and block until at least MIN_COMPLETE completions are available. Returns false if the submission fails
+  bool submit_and_wait(unsigned min_complete){
+    while (num_queued_ > 0 || num_completions() < min_complete){
+      int num_submitted = syscall(__NR_io_uring_enter, ring_fd_, num_queued_, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (num_submitted >= 0)
+	num_queued_ -= num_submitted;
+      else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	return false;
+    }
+    return true;
+  }
+
+  // Retrieve the next completion, returning false if none are available. RESULT is the number of bytes read or a negated error code
+  bool pop_completion(uint64_t& user_data, int32_t& result){
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+      return false;
+    const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+    user_data = cqe.user_data;
+    result    = cqe.res;
+    __atomic_store_n(cq_head_, head+1, __ATOMIC_RELEASE);
+    return true;
+  }
+#else
+ public:
+  explicit UringQueue(unsigned entries){}
+  bool ok() const { return false; }
+  unsigned capacity() const { return 0; }
+  bool queue_read(int fd, char* buffer, size_t nbytes, int64_t offset, uint64_t user_data){ return false; }
+  unsigned num_completions() const { return 0; }
+  bool submit_and_wait(unsigned min_complete){ return false; }
+  bool pop_completion(uint64_t& user_data, int32_t& result){ return false; }
+#endif
+};
+
+// Read RANGE from FILE into DATA, which is shorter than the range at the end of the file and empty if the read fails
+static void read_range(hFILE* file, const ByteRange& range, std::string& data){
+  data.clear();
+  if (file != NULL && hseek(file, range.start, SEEK_SET) == range.start){
+    data.resize(range.end - range.start);
+    ssize_t num_read = hread(file, &data[0], data.size());
+    data.resize(num_read < 0 ? 0 : num_read);
+  }
+}
+
+bool RangePrefetcher::io_uring_supported(){
+  return UringQueue(1).ok();
+}
+
+RangePrefetcher::RangePrefetcher(int num_threads, bool use_io_uring){
+  closing_ = false;
+  if (use_io_uring){
+    uring_.reset(new UringQueue(URING_QUEUE_DEPTH));
+    if (!uring_->ok())
+      printErrorAndDie("Failed to create an io_uring instance for prefetching byte ranges. io_uring may be unsupported or disabled on this system");
+    threads_.push_back(std::thread(&RangePrefetcher::fetch_ranges_uring, this));
+    return;
+  }
+  if (num_threads < 1)
+    printErrorAndDie("The number of range prefetching threads must be greater than 0");
+  for (int i = 0; i < num_threads; i++)
+    threads_.push_back(std::thread(&RangePrefetcher::fetch_ranges, this));
+}
+
+RangePrefetcher::~RangePrefetcher(){
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closing_ = true;
+  }
+  job_added_.notify_all();
+  for (size_t i = 0; i < threads_.size(); i++)
+    threads_[i].join();
+}
+
+void RangePrefetcher::prefetch(const std::string& path, std::shared_ptr<RangeCache> cache, ByteRange range){
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (int64_t start = range.start; start < range.end; start += MAX_FETCH_BYTES){
+    ByteRange piece(start, std::min(range.end, start + MAX_FETCH_BYTES));
+    if (cache->request(piece)){
+      jobs_.push_back(FetchJob(path, cache, piece));
+      job_added_.notify_one();
+    }
+  }
+}
+
+void RangePrefetcher::fetch_ranges(){
+  // Handles to the files fetched by this thread, from most to least recently used
+  std::deque< std::pair<std::string, hFILE*> > handles;
+  while (true){
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_added_.wait(lock, [&]{ return closing_ || !jobs_.empty(); });
+    if (jobs_.empty())
+      break;
+    FetchJob job = jobs_.front();
+    jobs_.pop_front();
+    lock.unlock();
+
+    hFILE* file = NULL;
+    for (auto iter = handles.begin(); iter != handles.end(); iter++){
+      if (iter->first == job.path){
+	file = iter->second;
+	handles.erase(iter);
+	break;
+      }
+    }
+    if (file == NULL)
+      file = hopen(job.path.c_str(), "r");
+
+    // A failed fetch leaves the range uncached, so that it's read on demand instead
+    std::string data;
+    read_range(file, job.range, data);
+    job.cache->fill(job.range, data);
+
+    if (file != NULL){
+      handles.push_front(std::make_pair(job.path, file));
+      if (handles.size() > MAX_HANDLES_PER_THREAD){
+	if (hclose(handles.back().second) != 0){}
+	handles.pop_back();
+      }
+    }
+  }
+  for (auto iter = handles.begin(); iter != handles.end(); iter++)
+    if (hclose(iter->second) != 0){}
+}
+
+void RangePrefetcher::fetch_ranges_uring(){
+  struct Read {
+    FetchJob job;
+    std::string data;
+    Read(const FetchJob& job_) : job(job_){}
+  };
+
+  // Descriptors of the local files read by this thread, from most to least recently used. A descriptor is only closed
+  // once no reads are in flight, as it may otherwise be in use by a submitted read
+  std::deque< std::pair<std::string, int> > handles;
+  std::vector< std::unique_ptr<Read> > reads(uring_->capacity());
+  std::vector<uint64_t> free_slots;
+  for (uint64_t slot = 0; slot < reads.size(); slot++)
+    free_slots.push_back(slot);
+
+  while (true){
+    // Block for new ranges only if no reads are in flight, as completed reads must otherwise be handled
+    std::vector<FetchJob> batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (free_slots.size() == reads.size())
+	job_added_.wait(lock, [&]{ return closing_ || !jobs_.empty(); });
+      if (jobs_.empty() && free_slots.size() == reads.size())
+	break;
+      while (!jobs_.empty() && batch.size() < free_slots.size()){
+	batch.push_back(jobs_.front());
+	jobs_.pop_front();
+      }
+    }
+
+    for (auto job_iter = batch.begin(); job_iter != batch.end(); job_iter++){
+      std::string data;
+      if (is_url_path(job_iter->path)){
+	hFILE* file = hopen(job_iter->path.c_str(), "r");
+	read_range(file, job_iter->range, data);
+	if (file != NULL && hclose(file) != 0){}
+	job_iter->cache->fill(job_iter->range, data);
+	continue;
+      }
+
+      int fd = -1;
+      for (auto iter = handles.begin(); iter != handles.end(); iter++){
+	if (iter->first == job_iter->path){
+	  fd = iter->second;
+	  handles.erase(iter);
+	  break;
+	}
+      }
+      if (fd < 0 && (fd = open(job_iter->path.c_str(), O_RDONLY)) < 0){
+	job_iter->cache->fill(job_iter->range, data);
+	continue;
+      }
+      handles.push_front(std::make_pair(job_iter->path, fd));
+
+      uint64_t slot = free_slots.back();
+      free_slots.pop_back();
+      reads[slot].reset(new Read(*job_iter));
+      reads[slot]->data.resize(job_iter->range.end - job_iter->range.start);
+      if (!uring_->queue_read(fd, &reads[slot]->data[0], reads[slot]->data.size(), job_iter->range.start, slot))
+	printErrorAndDie("Failed to queue an io_uring read for file " + job_iter->path);
+    }
+
+    if (free_slots.size() == reads.size())
+      continue;
+    if (!uring_->submit_and_wait(1))
+      printErrorAndDie("Failed to submit io_uring reads: " + std::string(strerror(errno)));
+
+    // A failed read leaves the range uncached, so that it's read on demand instead
+    uint64_t slot;
+    int32_t result;
+    while (uring_->pop_completion(slot, result)){
+      Read& read = *reads[slot];
+      read.data.resize(result < 0 ? 0 : std::min<size_t>(result, read.data.size()));
+      read.job.cache->fill(read.job.range, read.data);
+      reads[slot].reset();
+      free_slots.push_back(slot);
+    }
+
+    if (free_slots.size() == reads.size()){
+      while (handles.size() > MAX_HANDLES_PER_THREAD){
+	close(handles.back().second);
+	handles.pop_back();
+      }
+    }
+  }
+  for (auto iter = handles.begin(); iter != handles.end(); iter++)
+    close(iter->second);
+}
@@ -0,0 +1,113 @@
+#ifndef RANGE_PREFETCH_H_
+#define RANGE_PREFETCH_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "htslib/hfile.h"
+
+// Half-open interval [start, end) of byte offsets in a file
+struct ByteRange {
+  int64_t start, end;
+  ByteRange(int64_t start_, int64_t end_) : start(start_), end(end_){}
+};
+
+// Sort the ranges and merge those that overlap or are separated by at most MAX_GAP bytes
+void merge_byte_ranges(std::vector<ByteRange>& ranges, int64_t max_gap);
+
+// URLs (e.g. http://, ftp:// or s3://) are opened through htslib's hFILE layer rather than the local file system
+bool is_url_path(const std::string& path);
+
+/*
+ * In-memory cache of byte ranges fetched from a single file, which backs the hFILE opened by open_cached_hfile().
+ * Ranges are fetched by a RangePrefetcher and evicted in the order they were fetched once the cache holds more than
+ * MAX_BYTES bytes. Reads that fall within a range whose fetch is still in progress wait for it to complete rather
+ * than issuing their own request
+ */
+class RangeCache {
+ private:
+  std::mutex mutex_;
+  std::condition_variable fetched_;
+  std::map<int64_t, std::string> blocks_;  // Data for each fetched range, keyed by its start offset
+  std::deque<int64_t> fetch_order_;        // Start offsets of the fetched ranges, from oldest to newest
+  std::vector<ByteRange> pending_;         // Ranges that have been requested but not yet fetched
+  std::map<int64_t, int64_t> requested_;   // Disjoint intervals of the bytes requested so far, mapping each start to its end
+  size_t cached_bytes_, max_bytes_;
+
+ public:
+  explicit RangeCache(size_t max_bytes){
+    cached_bytes_ = 0;
+    max_bytes_    = max_bytes;
+  }
+
+  // Trim RANGE so that it doesn't begin or end with bytes that have already been requested and, if any bytes remain, mark it as pending
+  bool request(ByteRange& range);
+
+  // Store the data fetched for a pending range, which is shorter than the range at the end of the file and empty if the fetch failed
+  void fill(const ByteRange& range, std::string& data);
+
+  // Copy up to NBYTES bytes starting at OFFSET into BUFFER, returning the number of bytes copied or 0 if OFFSET isn't cached
+  size_t read(int64_t offset, char* buffer, size_t nbytes);
+};
+
+class UringQueue;
+
+// Open PATH for reading, serving reads from the ranges in CACHE when possible and otherwise reading from the file itself
+hFILE* open_cached_hfile(const std::string& path, std::shared_ptr<RangeCache> cache);
+
+/*
+ * Pool of threads that fetch the requested byte ranges into their files' caches, so that the ranges for upcoming regions
+ * are transferred using a few large, concurrent requests. Each thread keeps its own handles to recently fetched files.
+ *
+ * Alternatively, a single thread submits the reads for all of the queued ranges of local files in batches through io_uring,
+ * which keeps up to URING_QUEUE_DEPTH reads in flight without a thread per read. Ranges of files accessed through URLs are
+ * then fetched by the same thread using blocking reads
+ */
+class RangePrefetcher {
+ private:
+  struct FetchJob {
+    std::string path;
+    std::shared_ptr<RangeCache> cache;
+    ByteRange range;
+    FetchJob(const std::string& path_, std::shared_ptr<RangeCache> cache_, const ByteRange& range_)
+      : path(path_), cache(cache_), range(range_){}
+  };
+
+  std::mutex mutex_;
+  std::condition_variable job_added_;
+  std::deque<FetchJob> jobs_;
+  std::vector<std::thread> threads_;
+  bool closing_;
+  std::unique_ptr<UringQueue> uring_; // Non-null iff the ranges are fetched using io_uring
+
+  void fetch_ranges();
+  void fetch_ranges_uring();
+
+ public:
+  const static size_t MAX_HANDLES_PER_THREAD = 64;
+  const static int64_t MAX_FETCH_BYTES       = 8388608;  // Larger ranges are split so that their pieces are fetched concurrently
+  const static unsigned URING_QUEUE_DEPTH    = 64;
+
+  // Fetch the ranges using NUM_THREADS threads, or using io_uring if USE_IO_URING is true, in which case NUM_THREADS is ignored
+  explicit RangePrefetcher(int num_threads, bool use_io_uring = false);
+
+  // Returns true iff HipSTR was built with io_uring support and the kernel allows io_uring instances to be created
+  static bool io_uring_supported();
+
+  ~RangePrefetcher();
+
+  // Request the bytes in RANGE from the file at PATH, apart from those CACHE has already requested
+  void prefetch(const std::string& path, std::shared_ptr<RangeCache> cache, ByteRange range);
+
+  RangePrefetcher(const RangePrefetcher&)            = delete;
+  RangePrefetcher& operator=(const RangePrefetcher&) = delete;
+};
+
+#endif
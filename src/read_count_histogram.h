@@ -0,0 +1,66 @@
+#ifndef READ_COUNT_HISTOGRAM_H_
+#define READ_COUNT_HISTOGRAM_H_
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Number of reads observed with each base pair difference, sorted by the difference. A sample's reads typically support only
+ * a handful of distinct differences, so the first INLINE_CAPACITY entries are stored inline and the histogram only allocates
+ * memory for samples with more. This avoids storing one value per read when accumulating the ALLREADS and MALLREADS fields
+ */
+class ReadCountHistogram {
+ public:
+  struct Entry {
+    int bp_diff;
+    int count;
+  };
+
+  const static int INLINE_CAPACITY = 8;
+
+ private:
+  Entry inline_[INLINE_CAPACITY];
+  std::vector<Entry> overflow_;  // Holds all of the entries once there are more than INLINE_CAPACITY
+  int num_entries_;
+  int num_reads_;
+
+  Entry* entries(){ return (overflow_.empty() ? inline_ : overflow_.data()); }
+
+ public:
+  ReadCountHistogram(){
+    num_entries_ = 0;
+    num_reads_   = 0;
+  }
+
+  void add(int bp_diff){
+    num_reads_++;
+    Entry* entry_ptr = std::lower_bound(entries(), entries()+num_entries_, bp_diff,
+					[](const Entry& entry, int diff){ return entry.bp_diff < diff; });
+    int index = entry_ptr - entries();
+    if (index < num_entries_ && entry_ptr->bp_diff == bp_diff){
+      entry_ptr->count++;
+      return;
+    }
+
+    Entry entry = {bp_diff, 1};
+    if (overflow_.empty() && num_entries_ < INLINE_CAPACITY){
+      std::copy_backward(inline_+index, inline_+num_entries_, inline_+num_entries_+1);
+      inline_[index] = entry;
+    }
+    else {
+      if (overflow_.empty())
+	overflow_.assign(inline_, inline_+num_entries_);
+      overflow_.insert(overflow_.begin()+index, entry);
+    }
+    num_entries_++;
+  }
+
+  bool empty()     const { return num_reads_ == 0; }
+  int num_reads()  const { return num_reads_;      }
+  int num_diffs()  const { return num_entries_;    }
+
+  const Entry* begin() const { return (overflow_.empty() ? inline_ : overflow_.data()); }
+  const Entry* end()   const { return begin() + num_entries_; }
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef READ_FILTER_CACHE_H_
+#define READ_FILTER_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#include "bam_io.h"
+#include "read_pair_table.h"
+
+/*
+ * Rolling cache of the filter results for the reads that overlapped recently processed regions. Nearby regions that aren't
+ * grouped together fetch many of the same reads, and the sequence, quality, tag and end match filters applied to each read
+ * don't depend on the region, so their results are reused instead of rescanning the read. Reads are identified by their file,
+ * a hash of their name, their flag and their (trimmed) position and length. Entries are discarded once their reads end
+ * upstream of the window fetched for a region, and the cache is cleared whenever the regions switch chromosomes or move upstream
+ */
+class ReadFilterCache {
+ public:
+  // Region-independent filters applied to each read overlapping a region, in the order they're applied
+  enum ReadFilter : int8_t { PASSES_READ_FILTERS = 0, HAS_SA_TAG, HAS_N_BASES, LOW_BASE_QUALS };
+
+  struct Entry {
+    int32_t end_pos;
+    ReadFilter read_filter;
+    int8_t end_filters; // 1 if the read passed the end match and indel position filters, 0 if it failed them and -1 if they weren't applied
+  };
+
+ private:
+  struct Key {
+    uint64_t name_hash;
+    int32_t pos, length;
+    int32_t file_index;
+    uint16_t flag;
+
+    bool operator==(const Key& other) const {
+      return name_hash == other.name_hash && pos == other.pos && length == other.length && file_index == other.file_index && flag == other.flag;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      uint64_t hash = key.name_hash ^ ((uint64_t)(uint32_t)key.pos << 32) ^ (uint32_t)key.length;
+      hash ^= ((uint64_t)(uint32_t)key.file_index << 16) ^ key.flag;
+      return (size_t)(hash * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  std::string chrom_;
+  int32_t fetch_start_;
+  int64_t num_hits_, num_misses_;
+
+  static Key make_key(const BamAlignment& aln){
+    const char* name = aln.NameChars();
+    Key key;
+    key.name_hash  = ReadPairTable::hash_key(name, ReadPairTable::key_length(name));
+    key.pos        = aln.Position();
+    key.length     = aln.Length();
+    key.file_index = aln.FileIndex();
+    key.flag       = aln.b_->core.flag;
+    return key;
+  }
+
+ public:
+  ReadFilterCache(){
+    fetch_start_ = -1;
+    num_hits_    = num_misses_ = 0;
+  }
+
+  // Discard the entries that can't be reused for a region whose reads are fetched from FETCH_START onwards on CHROM
+  void advance(const std::string& chrom, int32_t fetch_start){
+    if (chrom.compare(chrom_) != 0 || fetch_start < fetch_start_){
+      entries_.clear();
+      chrom_ = chrom;
+    }
+    else {
+      for (auto entry_iter = entries_.begin(); entry_iter != entries_.end(); ){
+	if (entry_iter->second.end_pos <= fetch_start)
+	  entry_iter = entries_.erase(entry_iter);
+	else
+	  ++entry_iter;
+      }
+    }
+    fetch_start_ = fetch_start;
+  }
+
+  // Returns the cached entry for the alignment, or NULL if there isn't one
+  Entry* find(const BamAlignment& aln){
+    auto entry_iter = entries_.find(make_key(aln));
+    if (entry_iter == entries_.end()){
+      num_misses_++;
+      return NULL;
+    }
+    num_hits_++;
+    return &entry_iter->second;
+  }
+
+  // Cache the result of the read filters for the alignment and return its entry, which remains valid until the next call to advance()
+  Entry* insert(const BamAlignment& aln, ReadFilter read_filter){
+    Entry& entry      = entries_[make_key(aln)];
+    entry.end_pos     = aln.GetEndPosition();
+    entry.read_filter = read_filter;
+    entry.end_filters = -1;
+    return &entry;
+  }
+
+  size_t size()         const { return entries_.size();         }
+  int64_t num_hits()    const { return num_hits_;               }
+  int64_t num_lookups() const { return num_hits_ + num_misses_; }
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include <string.h>
+#include <algorithm>
+
+#include "error.h"
+#include "read_group_index.h"
+
+namespace {
+int32_t intern(const std::string& name, std::map<std::string, int32_t>& ids, std::vector<std::string>& names){
+  auto id_iter = ids.emplace(name, (int32_t)names.size());
+  if (id_iter.second)
+    names.push_back(name);
+  return id_iter.first->second;
+}
+}
+
+ReadGroupIndex::ReadGroupIndex(BamCramMultiReader& reader, bool use_bam_rgs,
+			       const std::map<std::string, std::string>& rg_to_sample, const std::map<std::string, std::string>& rg_to_library){
+  use_bam_rgs_ = use_bam_rgs;
+  std::map<std::string, int32_t> sample_ids, library_ids;
+  const std::vector<std::string>& paths = reader.paths();
+  for (int32_t i = 0; i < (int32_t)paths.size(); i++){
+    // Files without an assigned sample or library are mapped to an empty name
+    if (!use_bam_rgs_){
+      auto sample_iter  = rg_to_sample.find(paths[i]);
+      auto library_iter = rg_to_library.find(paths[i]);
+      file_samples_.push_back(intern(sample_iter    != rg_to_sample.end()  ? sample_iter->second  : "", sample_ids,  samples_));
+      file_libraries_.push_back(intern(library_iter != rg_to_library.end() ? library_iter->second : "", library_ids, libraries_));
+      continue;
+    }
+
+    file_read_groups_.push_back(std::vector<ReadGroupIDs>());
+    std::vector<ReadGroupIDs>& file_rgs = file_read_groups_.back();
+    const std::vector<ReadGroup>& read_groups = reader.read_groups(i);
+    for (auto rg_iter = read_groups.begin(); rg_iter != read_groups.end(); rg_iter++){
+      if (!rg_iter->HasID())
+	continue;
+      ReadGroupIDs ids;
+      ids.id = rg_iter->GetID();
+      auto sample_iter  = rg_to_sample.find(paths[i] + ids.id);
+      auto library_iter = rg_to_library.find(paths[i] + ids.id);
+      ids.sample  = (sample_iter  == rg_to_sample.end()  ? -1 : intern(sample_iter->second,  sample_ids,  samples_));
+      ids.library = (library_iter == rg_to_library.end() ? -1 : intern(library_iter->second, library_ids, libraries_));
+      file_rgs.push_back(ids);
+    }
+    std::stable_sort(file_rgs.begin(), file_rgs.end(), [](const ReadGroupIDs& a, const ReadGroupIDs& b){ return a.id < b.id; });
+  }
+}
+
+const ReadGroupIndex::ReadGroupIDs& ReadGroupIndex::find_read_group(const BamAlignment& aln, bool for_library) const {
+  const char* rg = aln.ReadGroupTag();
+  if (rg == NULL)
+    printErrorAndDie("Failed to retrieve BAM alignment's RG tag");
+  const std::vector<ReadGroupIDs>& file_rgs = file_read_groups_[aln.FileIndex()];
+  auto rg_iter = std::lower_bound(file_rgs.begin(), file_rgs.end(), rg,
+				  [](const ReadGroupIDs& ids, const char* id){ return strcmp(ids.id.c_str(), id) < 0; });
+  if (rg_iter == file_rgs.end() || strcmp(rg_iter->id.c_str(), rg) != 0 || (for_library ? rg_iter->library : rg_iter->sample) == -1)
+    printErrorAndDie("No " + std::string(for_library ? "library" : "sample") + " found for read group " + std::string(rg) + " in BAM file headers");
+  return *rg_iter;
+}
@@ -0,0 +1,55 @@
+#ifndef READ_GROUP_INDEX_H_
+#define READ_GROUP_INDEX_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bam_io.h"
+
+/*
+ * Maps each read to dense integer IDs for its sample and library, which are interned once from the BAM headers (or the
+ * user-specified read groups) rather than resolved through std::map lookups keyed on the concatenated file name and RG tag.
+ * Reads are mapped using their file index and, if the read groups come from the BAMs, a binary search of the file's read group IDs
+ */
+class ReadGroupIndex {
+ private:
+  struct ReadGroupIDs {
+    std::string id;
+    int32_t sample, library;  // -1 if the read group has no assigned sample or library
+  };
+
+  bool use_bam_rgs_;
+  std::vector<std::string> samples_, libraries_;
+  std::vector< std::vector<ReadGroupIDs> > file_read_groups_;  // For each file, its read groups sorted by ID
+  std::vector<int32_t> file_samples_, file_libraries_;         // For each file, the IDs of its custom sample and library
+
+  const ReadGroupIDs& find_read_group(const BamAlignment& aln, bool for_library) const;
+
+ public:
+  /*
+   * RG_TO_SAMPLE and RG_TO_LIBRARY map each file name, concatenated with the read group ID if USE_BAM_RGS is true, to its
+   * sample and library, respectively
+   */
+  ReadGroupIndex(BamCramMultiReader& reader, bool use_bam_rgs,
+		 const std::map<std::string, std::string>& rg_to_sample, const std::map<std::string, std::string>& rg_to_library);
+
+  int32_t num_samples()                      const { return samples_.size();     }
+  const std::string& sample_name(int32_t id) const { return samples_[id];        }
+
+  /* Returns the ID of the read's sample, exiting with an error if its read group is missing or unknown */
+  int32_t sample_id(const BamAlignment& aln) const {
+    return (use_bam_rgs_ ? find_read_group(aln, false).sample : file_samples_[aln.FileIndex()]);
+  }
+
+  /* Returns the ID of the read's library, exiting with an error if its read group is missing or unknown */
+  int32_t library_id(const BamAlignment& aln) const {
+    return (use_bam_rgs_ ? find_read_group(aln, true).library : file_libraries_[aln.FileIndex()]);
+  }
+
+  /* Returns the name of the sample for the file with the given index when the read groups are user-specified */
+  const std::string& file_sample(int32_t file_index) const { return samples_[file_samples_[file_index]]; }
+};
+
+#endif
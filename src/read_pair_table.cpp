@@ -0,0 +1,111 @@
+#include <algorithm>
+
+#include "read_pair_table.h"
+
+size_t ReadPairTable::probe(uint64_t hash, const char* name, size_t len) const {
+  size_t mask = slot_mask(), pos = hash & mask;
+  while (slots_[pos].index != -1){
+    if (slots_[pos].hash == hash){
+      const char* other = arena_[slots_[pos].index].NameChars();
+      if (key_length(other) == len && memcmp(name, other, len) == 0)
+	return pos;
+    }
+    pos = (pos+1) & mask;
+  }
+  return pos;
+}
+
+void ReadPairTable::grow(){
+  std::vector<Slot> old_slots(slots_.size()*2, Slot{0, -1});
+  slots_.swap(old_slots);
+  size_t mask = slot_mask();
+  for (auto iter = old_slots.begin(); iter != old_slots.end(); iter++){
+    if (iter->index == -1)
+      continue;
+    size_t pos = iter->hash & mask;
+    while (slots_[pos].index != -1)
+      pos = (pos+1) & mask;
+    slots_[pos] = *iter;
+  }
+}
+
+int32_t ReadPairTable::find(const BamAlignment& aln) const {
+  const char* name = aln.NameChars();
+  size_t len       = key_length(name);
+  return slots_[probe(hash_key(name, len), name, len)].index;
+}
+
+bool ReadPairTable::insert(BamAlignment&& aln){
+  const char* name = aln.NameChars();
+  size_t len       = key_length(name);
+  uint64_t hash    = hash_key(name, len);
+  size_t pos       = probe(hash, name, len);
+  if (slots_[pos].index != -1)
+    return false;
+
+  int32_t index;
+  if (free_indices_.empty()){
+    index = arena_.size();
+    arena_.push_back(std::move(aln));
+    arena_hashes_.push_back(hash);
+  }
+  else {
+    index = free_indices_.back();
+    free_indices_.pop_back();
+    arena_[index]        = std::move(aln);
+    arena_hashes_[index] = hash;
+  }
+  slots_[pos] = Slot{hash, index};
+  size_++;
+
+  // Keep the load factor below 1/2 so that probe sequences remain short
+  if (2*size_ > slots_.size())
+    grow();
+  return true;
+}
+
+void ReadPairTable::erase(int32_t index){
+  size_t mask = slot_mask(), pos = arena_hashes_[index] & mask;
+  while (slots_[pos].index != index)
+    pos = (pos+1) & mask;
+
+  // Shift subsequent entries in the probe sequence back so that lookups never encounter a gap before their entry
+  size_t next = pos;
+  while (true){
+    next = (next+1) & mask;
+    if (slots_[next].index == -1)
+      break;
+    size_t home = slots_[next].hash & mask;
+    bool movable = (pos <= next) ? (home <= pos || home > next) : (home <= pos && home > next);
+    if (movable){
+      slots_[pos] = slots_[next];
+      pos         = next;
+    }
+  }
+  slots_[pos].index = -1;
+  free_indices_.push_back(index);
+  size_--;
+}
+
+void ReadPairTable::clear(){
+  std::fill(slots_.begin(), slots_.end(), Slot{0, -1});
+  arena_.clear();
+  arena_hashes_.clear();
+  free_indices_.clear();
+  size_ = 0;
+}
+
+void ReadPairTable::sorted_indices(std::vector<int32_t>& indices) const {
+  indices.clear();
+  for (auto iter = slots_.begin(); iter != slots_.end(); iter++)
+    if (iter->index != -1)
+      indices.push_back(iter->index);
+
+  // Order the entries by name using the same comparison as std::string
+  std::sort(indices.begin(), indices.end(), [this](int32_t a, int32_t b){
+      const char* name_a = arena_[a].NameChars(), *name_b = arena_[b].NameChars();
+      size_t len_a = key_length(name_a), len_b = key_length(name_b);
+      int cmp = memcmp(name_a, name_b, std::min(len_a, len_b));
+      return (cmp != 0 ? cmp < 0 : len_a < len_b);
+    });
+}
@@ -0,0 +1,79 @@
+#ifndef READ_PAIR_TABLE_H_
+#define READ_PAIR_TABLE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "bam_io.h"
+
+/*
+ * Hash table used to pair reads with their mates, keyed on the read name with any trailing /1 or /2 removed.
+ * Slots are probed linearly and only store a 64-bit hash of the name and the index of the alignment in
+ * a contiguous arena, so lookups don't need to allocate strings. Names are only compared when the hashes match.
+ * Alignment pointers and indices remain valid until the entry is erased or the table is cleared
+ */
+class ReadPairTable {
+ private:
+  struct Slot {
+    uint64_t hash;
+    int32_t index;  // Index of the alignment in the arena, or -1 if the slot is empty
+  };
+
+  std::vector<Slot> slots_;
+  std::vector<BamAlignment> arena_;
+  std::vector<uint64_t> arena_hashes_;
+  std::vector<int32_t> free_indices_;
+  size_t size_;
+
+  size_t slot_mask() const { return slots_.size()-1; }
+
+  // Returns the slot containing the alignment with the provided key, or the empty slot at which it would be inserted
+  size_t probe(uint64_t hash, const char* name, size_t len) const;
+
+  void grow();
+
+ public:
+  // Length of the read name once any trailing /1 or /2 has been removed
+  static size_t key_length(const char* name){
+    size_t len = strlen(name);
+    if (len > 2 && name[len-2] == '/')
+      len -= 2;
+    return len;
+  }
+
+  // Hash of the read name, which is independent of the run and thread count
+  static uint64_t hash_key(const char* name, size_t len){
+    uint64_t hash = 14695981039346656037ULL; // 64-bit FNV-1a
+    for (size_t i = 0; i < len; i++){
+      hash ^= (unsigned char)name[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  ReadPairTable(){
+    slots_.resize(64, Slot{0, -1});
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+  bool empty()  const { return size_ == 0; }
+
+  /* Returns the index of the stored alignment whose name matches that of ALN, or -1 if there isn't one */
+  int32_t find(const BamAlignment& aln) const;
+
+  BamAlignment& get(int32_t index){ return arena_[index]; }
+
+  /* Stores the alignment unless an alignment with the same name is already present. Returns true iff it was stored */
+  bool insert(BamAlignment&& aln);
+
+  void erase(int32_t index);
+
+  void clear();
+
+  /* Indices of all stored alignments, ordered by read name */
+  void sorted_indices(std::vector<int32_t>& indices) const;
+};
+
+#endif
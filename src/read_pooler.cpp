@@ -1,20 +1,117 @@
 #include "read_pooler.h"
 
-int32_t ReadPooler::add_alignment(Alignment& aln){
-  if (pooled_)
-    printErrorAndDie("Cannot call add_alignment function once pool() function has been invoked");
-  
-  auto pool_iter = seq_to_pool_.find(aln.get_sequence());
-  if (pool_iter == seq_to_pool_.end()){
-    seq_to_pool_[aln.get_sequence()] = pool_index_;
+#include <algorithm>
+
+void ReadPooler::bin_qualities(std::string& qualities){
+  for (unsigned int i = 0; i < qualities.size(); i++){
+    int qual = qualities[i] - BaseQuality::MIN_BASE_QUALITY;
+    if (qual < 2)
+      continue;
+    int binned = (qual < 10 ? 6 : (qual < 20 ? 15 : (qual < 25 ? 22 : (qual < 30 ? 27 : (qual < 35 ? 33 : (qual < 40 ? 37 : 40))))));
+    qualities[i] = (char)(BaseQuality::MIN_BASE_QUALITY + binned);
+  }
+}
+
+bool ReadPooler::trim_to_window(const Alignment& aln, Alignment& trimmed, int32_t& base_offset) const {
+  if (aln.get_start() > window_start_ || aln.get_stop() < window_stop_)
+    return false;
+
+  const std::string& bases     = aln.get_sequence();
+  const std::string& qualities = aln.get_base_qualities();
+  std::string sequence, trimmed_quals, alignment;
+  std::vector<CigarElement> cigar_list;
+  int32_t pos = aln.get_start(), seq_index = 0;
+  for (auto cigar_iter = aln.get_cigar_list().begin(); cigar_iter != aln.get_cigar_list().end(); cigar_iter++){
+    int32_t num = cigar_iter->get_num();
+    switch (cigar_iter->get_type()){
+    case '=': case 'X': case 'M': {
+      int32_t first = std::max(pos, window_start_), last = std::min(pos+num-1, window_stop_);
+      if (first <= last){
+	if (sequence.empty())
+	  base_offset = seq_index+first-pos;
+	sequence.append(bases, seq_index+first-pos, last-first+1);
+	alignment.append(bases, seq_index+first-pos, last-first+1);
+	trimmed_quals.append(qualities, seq_index+first-pos, last-first+1);
+	cigar_list.push_back(CigarElement(cigar_iter->get_type(), last-first+1));
+      }
+      pos       += num;
+      seq_index += num;
+      break;
+    }
+    case 'I':
+      if (pos > window_start_ && pos <= window_stop_){
+	sequence.append(bases, seq_index, num);
+	alignment.append(bases, seq_index, num);
+	trimmed_quals.append(qualities, seq_index, num);
+	cigar_list.push_back(*cigar_iter);
+      }
+      seq_index += num;
+      break;
+    case 'D':
+      if (pos > window_start_ && pos+num-1 < window_stop_){
+	alignment.append(num, '-');
+	cigar_list.push_back(*cigar_iter);
+      }
+      else if (pos <= window_stop_ && pos+num-1 >= window_start_)
+	return false;
+      pos += num;
+      break;
+    case 'S':
+      seq_index += num;
+      break;
+    case 'H':
+      break;
+    default:
+      printErrorAndDie("Invalid CIGAR option encountered in trim_to_window()");
+      break;
+    }
+  }
+
+  trimmed = Alignment(window_start_, window_stop_, "READPOOL", trimmed_quals, sequence, alignment);
+  trimmed.set_cigar_list(cigar_list);
+  return true;
+}
+
+int32_t ReadPooler::add_to_pool(const Alignment& aln, std::unordered_map<std::string, int32_t>& seq_to_pool){
+  std::string qualities = aln.get_base_qualities();
+  if (bin_qualities_)
+    bin_qualities(qualities);
+
+  auto pool_iter = seq_to_pool.find(aln.get_sequence());
+  if (pool_iter == seq_to_pool.end()){
+    seq_to_pool[aln.get_sequence()] = pool_index_;
     pooled_alns_.push_back(Alignment(aln.get_start(), aln.get_stop(), "READPOOL", "", aln.get_sequence(), aln.get_alignment()));
     pooled_alns_.back().set_cigar_list(aln.get_cigar_list());
-    qualities_by_pool_.push_back(std::vector<const std::string*>());
-    qualities_by_pool_.back().push_back(new std::string(aln.get_base_qualities()));
+    qualities_by_pool_.push_back(qualities);
+    pool_sizes_.push_back(1);
     return pool_index_++;
   }
   else{
-    qualities_by_pool_[pool_iter->second].push_back(new std::string(aln.get_base_qualities()));
+    std::string& pool_qualities = qualities_by_pool_[pool_iter->second];
+    if (qualities.size()*pool_sizes_[pool_iter->second] != pool_qualities.size())
+      printErrorAndDie("All base quality strings must be of the same length when averaging probabilities");
+    pool_qualities.append(qualities);
+    pool_sizes_[pool_iter->second]++;
     return pool_iter->second;
   }  
 }
+
+int32_t ReadPooler::add_alignment(Alignment& aln){
+  if (pooled_)
+    printErrorAndDie("Cannot call add_alignment function once pool() function has been invoked");
+
+  auto group_iter = seq_to_trace_group_.emplace(aln.get_sequence(), (int32_t)seq_to_trace_group_.size()).first;
+  trace_groups_.push_back(group_iter->second);
+
+  if (window_start_ <= window_stop_){
+    Alignment trimmed("READPOOL");
+    int32_t base_offset;
+    if (trim_to_window(aln, trimmed, base_offset)){
+      num_window_reads_++;
+      base_offsets_.push_back(base_offset);
+      return add_to_pool(trimmed, window_seq_to_pool_);
+    }
+  }
+  base_offsets_.push_back(0);
+  return add_to_pool(aln, seq_to_pool_);
+}
@@ -2,8 +2,8 @@
 #define READ_POOLER_H_
 
 #include <assert.h>
-#include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "base_quality.h"
@@ -13,33 +13,87 @@
 class ReadPooler {
  private:
   std::vector<Alignment> pooled_alns_;
-  std::vector< std::vector<const std::string*> > qualities_by_pool_;
-  std::map<std::string, int32_t> seq_to_pool_;
+  std::vector<std::string> qualities_by_pool_; // Concatenated base quality strings of each pool's reads
+  std::vector<int32_t> pool_sizes_;            // Number of reads in each pool
+  std::unordered_map<std::string, int32_t> seq_to_pool_;
   bool pooled_;         // True iff pool() function has been invoked
   int32_t pool_index_;
+
+  // If WINDOW_START_ <= WINDOW_STOP_, reads that span this inclusive window are trimmed to it and pooled by their bases within it,
+  // so that reads which only differ outside of the window share a pool. Their keys are kept separate from those of full reads
+  int32_t window_start_, window_stop_;
+  std::unordered_map<std::string, int32_t> window_seq_to_pool_;
+  int32_t num_window_reads_;
+
+  // Reads with the same sequence share a trace group, whose alignments to each haplotype are only traced once. These are identical
+  // to the pools unless reads are trimmed to the window, in which case their full alignments are traced
+  std::unordered_map<std::string, int32_t> seq_to_trace_group_;
+  std::vector<int32_t> trace_groups_; // Trace group of each read
+  std::vector<int32_t> base_offsets_; // Index of the first base of each read's pool sequence within the read's sequence
+
+  // If true, each read's base qualities are binned using the Illumina 8-level scheme before the pool medians are computed
+  bool bin_qualities_;
+
+  int32_t add_to_pool(const Alignment& aln, std::unordered_map<std::string, int32_t>& seq_to_pool);
+
+  // Store the portion of ALN aligned to the window in TRIMMED, and the index of its first base within ALN's sequence in BASE_OFFSET.
+  // Returns false if the read doesn't span the window, or if an end of the window lies within one of the read's deletions
+  bool trim_to_window(const Alignment& aln, Alignment& trimmed, int32_t& base_offset) const;
   
  public:
   ReadPooler(){
-    pool_index_ = 0;
-    pooled_     = false;
+    pool_index_       = 0;
+    pooled_           = false;
+    window_start_     = 0;
+    window_stop_      = -1;
+    num_window_reads_ = 0;
+    bin_qualities_    = false;
   }
 
-  ~ReadPooler(){
-    for (unsigned int i = 0; i < qualities_by_pool_.size(); i++)
-      for (unsigned int j = 0; j < qualities_by_pool_[i].size(); j++)
-	delete qualities_by_pool_[i][j];
-    qualities_by_pool_.clear();
+  int32_t num_pools(){ return pool_index_; }
+
+  // Number of reads pooled by their bases within the window
+  int32_t num_window_reads(){ return num_window_reads_; }
+
+  bool pooled(){ return pooled_; }
+
+  int32_t num_trace_groups(){ return seq_to_trace_group_.size(); }
+
+  // The trace group of the READ_INDEX-th read passed to add_alignment()
+  int32_t trace_group(int read_index){ return trace_groups_[read_index]; }
+
+  // Convert a base index within the READ_INDEX-th read's pool sequence to the index of the same base within the read
+  int32_t read_base_index(int read_index, int32_t pool_base_index){
+    return (pool_base_index == -1 ? -1 : pool_base_index + base_offsets_[read_index]);
   }
 
-  int32_t num_pools(){ return pool_index_; }
+  // Pool the reads spanning the 0-based inclusive window [START, STOP] by their bases within it. Must precede add_alignment()
+  void set_window(int32_t start, int32_t stop){
+    assert(pool_index_ == 0);
+    window_start_ = start;
+    window_stop_  = stop;
+  }
+
+  void use_binned_qualities(){ bin_qualities_ = true; }
+
+  // Replace each Phred+33 quality with the representative quality of its Illumina 8-level bin
+  static void bin_qualities(std::string& qualities);
 
   int32_t add_alignment(Alignment& aln);
 
   void pool(BaseQuality& base_quality){
+    // The pools are reused if the reads are regenotyped, as their base qualities have already been computed
+    if (pooled_)
+      return;
+
     // For each pooled set of reads, set the base quality at each position to be the median across the set
     assert(pooled_alns_.size() == qualities_by_pool_.size());
-    for (unsigned int i = 0; i < pooled_alns_.size(); i++)
-      pooled_alns_[i].set_base_qualities(base_quality.median_base_qualities(qualities_by_pool_[i]));
+    // The qualities' log probabilities are then cached, as each pool is aligned to every candidate haplotype
+    for (unsigned int i = 0; i < pooled_alns_.size(); i++){
+      pooled_alns_[i].set_base_qualities(base_quality.median_base_qualities(qualities_by_pool_[i], pool_sizes_[i]));
+      pooled_alns_[i].cache_log_probs(base_quality);
+    }
+    qualities_by_pool_.clear();
     pooled_ = true;
   }
 
@@ -0,0 +1,258 @@
+#include "ref_allele_index.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "error.h"
+#include "vcf_input.h"
+#include "vcf_reader.h"
+
+namespace {
+const char MAGIC[]       = "HSTRRALI";
+const size_t MAGIC_LEN   = 8;
+const uint32_t VERSION   = 2;
+const size_t RECORD_SIZE = 5*sizeof(uint32_t) + sizeof(uint64_t);
+
+template<typename T> T read_value(const char*& ptr){
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return value;
+}
+
+template<typename T> void append_value(std::string& buffer, T value){
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// The VCF's size and modification time, which identify the version of the file from which an index was generated
+void vcf_file_stat(const std::string& vcf_file, uint64_t& size, int64_t& mtime){
+  struct stat st_buf;
+  if (stat(vcf_file.c_str(), &st_buf) != 0)
+    printErrorAndDie("Failed to open reference VCF file " + vcf_file);
+  size  = st_buf.st_size;
+  mtime = st_buf.st_mtime;
+}
+
+struct IndexRecord {
+  int32_t str_start, str_stop, pos;
+  std::vector<std::string> alleles;
+  std::vector<int32_t> allele_counts;
+};
+}
+
+RefAlleleIndex::RefAlleleIndex(const std::string& path){
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    printErrorAndDie("Failed to open reference allele index file " + path);
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) != 0)
+    printErrorAndDie("Failed to determine the size of reference allele index file " + path);
+  size_ = st_buf.st_size;
+  if (size_ < MAGIC_LEN + 2*sizeof(uint32_t) + 2*sizeof(uint64_t) + sizeof(int64_t))
+    printErrorAndDie("Reference allele index file " + path + " is truncated");
+  void* mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    printErrorAndDie("Failed to memory-map reference allele index file " + path);
+  data_ = static_cast<const char*>(mapping);
+
+  const char* ptr = data_;
+  if (memcmp(ptr, MAGIC, MAGIC_LEN) != 0)
+    printErrorAndDie("File " + path + " is not a reference allele index file");
+  ptr += MAGIC_LEN;
+  if (read_value<uint32_t>(ptr) != VERSION)
+    printErrorAndDie("Reference allele index file " + path + " was generated by an incompatible version of HipSTR. Please delete it and rerun the analysis");
+  vcf_size_           = read_value<uint64_t>(ptr);
+  vcf_mtime_          = read_value<int64_t>(ptr);
+  uint32_t num_chroms = read_value<uint32_t>(ptr);
+  num_records_        = read_value<uint64_t>(ptr);
+  for (uint32_t i = 0; i < num_chroms; i++){
+    if (ptr + sizeof(uint32_t) > data_ + size_)
+      printErrorAndDie("Reference allele index file " + path + " is truncated");
+    uint32_t name_len = read_value<uint32_t>(ptr);
+    if (ptr + name_len + 2*sizeof(uint64_t) > data_ + size_)
+      printErrorAndDie("Reference allele index file " + path + " is truncated");
+    ChromInfo info;
+    info.name = std::string(ptr, name_len);
+    ptr += name_len;
+    info.first_record = read_value<uint64_t>(ptr);
+    info.num_records  = read_value<uint64_t>(ptr);
+    if (info.first_record + info.num_records > num_records_)
+      printErrorAndDie("Reference allele index file " + path + " is corrupted");
+    chroms_.push_back(info);
+  }
+  records_ = ptr;
+  pool_    = records_ + num_records_*RECORD_SIZE;
+  if (pool_ > data_ + size_)
+    printErrorAndDie("Reference allele index file " + path + " is truncated");
+}
+
+RefAlleleIndex::~RefAlleleIndex(){
+  munmap(const_cast<char*>(data_), size_);
+}
+
+const RefAlleleIndex::ChromInfo* RefAlleleIndex::find_chrom(const std::string& chrom) const {
+  auto chrom_iter = std::lower_bound(chroms_.begin(), chroms_.end(), chrom,
+				     [](const ChromInfo& info, const std::string& name){ return info.name.compare(name) < 0; });
+  if (chrom_iter != chroms_.end() && chrom_iter->name.compare(chrom) == 0)
+    return &(*chrom_iter);
+  return NULL;
+}
+
+bool RefAlleleIndex::read_alleles(const Region& region, std::vector<std::string>& alleles, int32_t& pos, std::vector<int32_t>& allele_counts) const {
+  assert(alleles.size() == 0 && allele_counts.size() == 0);
+  pos = -1;
+
+  // Retry without the chr prefix if necessary, as read_vcf_alleles() does
+  const ChromInfo* chrom = find_chrom(region.chrom());
+  if (chrom == NULL && region.chrom().size() > 3 && region.chrom().substr(0, 3).compare("chr") == 0)
+    chrom = find_chrom(region.chrom().substr(3));
+  if (chrom == NULL)
+    return false;
+
+  // Binary search for the first record whose START and END match the region
+  int32_t str_start = region.start()+1, str_stop = region.stop();
+  uint64_t low = chrom->first_record, high = chrom->first_record + chrom->num_records;
+  while (low < high){
+    uint64_t mid    = low + (high-low)/2;
+    const char* ptr = records_ + mid*RECORD_SIZE;
+    int32_t start   = read_value<int32_t>(ptr);
+    int32_t stop    = read_value<int32_t>(ptr);
+    if (start < str_start || (start == str_start && stop < str_stop))
+      low = mid+1;
+    else
+      high = mid;
+  }
+  if (low == chrom->first_record + chrom->num_records)
+    return false;
+
+  const char* ptr = records_ + low*RECORD_SIZE;
+  if (read_value<int32_t>(ptr) != str_start || read_value<int32_t>(ptr) != str_stop)
+    return false;
+  int32_t record_pos   = read_value<int32_t>(ptr);
+  uint32_t num_alleles = read_value<uint32_t>(ptr);
+  uint32_t has_counts  = read_value<uint32_t>(ptr);
+  uint64_t offset      = read_value<uint64_t>(ptr);
+
+  const char* data_ptr = pool_ + offset;
+  for (uint32_t i = 0; i < num_alleles; i++){
+    if (data_ptr + sizeof(uint32_t) > data_ + size_)
+      printErrorAndDie("Reference allele index file is truncated");
+    uint32_t allele_len = read_value<uint32_t>(data_ptr);
+    if (data_ptr + allele_len > data_ + size_)
+      printErrorAndDie("Reference allele index file is truncated");
+    alleles.push_back(std::string(data_ptr, allele_len));
+    data_ptr += allele_len;
+  }
+  if (has_counts){
+    if (data_ptr + num_alleles*sizeof(int32_t) > data_ + size_)
+      printErrorAndDie("Reference allele index file is truncated");
+    for (uint32_t i = 0; i < num_alleles; i++)
+      allele_counts.push_back(read_value<int32_t>(data_ptr));
+  }
+  pos = record_pos;
+  return true;
+}
+
+void RefAlleleIndex::write(const std::string& vcf_file, const std::string& path, std::ostream& logger){
+  // Record the VCF's size and modification time before it's read, so that an index generated while it's modified won't match it
+  uint64_t vcf_size;
+  int64_t vcf_mtime;
+  vcf_file_stat(vcf_file, vcf_size, vcf_mtime);
+  std::string vcf_path(vcf_file);
+  VCF::VCFReader ref_vcf(vcf_path);
+  std::map<std::string, std::vector<IndexRecord> > records_by_chrom;
+  VCF::Variant variant;
+  uint64_t num_records = 0;
+  while (ref_vcf.get_next_variant(variant)){
+    // Skip variants without the appropriate INFO fields (as they're not STRs)
+    if (!variant.has_info_field(START_INFO_TAG) || !variant.has_info_field(STOP_INFO_TAG))
+      continue;
+
+    IndexRecord record;
+    variant.get_INFO_value_single_int(START_INFO_TAG, record.str_start);
+    variant.get_INFO_value_single_int(STOP_INFO_TAG,  record.str_stop);
+    record.pos     = variant.get_position()-1;
+    record.alleles = variant.get_alleles();
+    read_vcf_allele_counts(variant, record.allele_counts);
+    records_by_chrom[variant.get_chromosome()].push_back(record);
+    num_records++;
+  }
+  logger << "Indexed the alleles of " << num_records << " STRs in reference VCF " << vcf_file << std::endl;
+
+  std::string header(MAGIC, MAGIC_LEN), records, pool;
+  append_value<uint32_t>(header, VERSION);
+  append_value<uint64_t>(header, vcf_size);
+  append_value<int64_t>(header,  vcf_mtime);
+  append_value<uint32_t>(header, records_by_chrom.size());
+  append_value<uint64_t>(header, num_records);
+  uint64_t first_record = 0;
+  for (auto chrom_iter = records_by_chrom.begin(); chrom_iter != records_by_chrom.end(); chrom_iter++){
+    append_value<uint32_t>(header, chrom_iter->first.size());
+    header.append(chrom_iter->first);
+    append_value<uint64_t>(header, first_record);
+    append_value<uint64_t>(header, chrom_iter->second.size());
+    first_record += chrom_iter->second.size();
+
+    // Records with identical coordinates retain their VCF order, so that lookups return the same record as read_vcf_alleles()
+    std::vector<IndexRecord>& chrom_records = chrom_iter->second;
+    std::stable_sort(chrom_records.begin(), chrom_records.end(), [](const IndexRecord& a, const IndexRecord& b){
+	return (a.str_start != b.str_start ? a.str_start < b.str_start : a.str_stop < b.str_stop); });
+    for (auto record_iter = chrom_records.begin(); record_iter != chrom_records.end(); record_iter++){
+      append_value<int32_t>(records,  record_iter->str_start);
+      append_value<int32_t>(records,  record_iter->str_stop);
+      append_value<int32_t>(records,  record_iter->pos);
+      append_value<uint32_t>(records, record_iter->alleles.size());
+      append_value<uint32_t>(records, record_iter->allele_counts.empty() ? 0 : 1);
+      append_value<uint64_t>(records, pool.size());
+      for (auto allele_iter = record_iter->alleles.begin(); allele_iter != record_iter->alleles.end(); allele_iter++){
+	append_value<uint32_t>(pool, allele_iter->size());
+	pool.append(*allele_iter);
+      }
+      for (auto count_iter = record_iter->allele_counts.begin(); count_iter != record_iter->allele_counts.end(); count_iter++)
+	append_value<int32_t>(pool, *count_iter);
+    }
+  }
+
+  std::stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid();
+  FILE* output = fopen(tmp_path.str().c_str(), "wb");
+  if (output == NULL)
+    printErrorAndDie("Failed to open " + tmp_path.str() + " to write the reference allele index");
+  bool success = (fwrite(header.data(),  1, header.size(),  output) == header.size());
+  success &=     (fwrite(records.data(), 1, records.size(), output) == records.size());
+  success &=     (fwrite(pool.data(),    1, pool.size(),    output) == pool.size());
+  success &=     (fclose(output) == 0);
+  if (!success){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to write the reference allele index to " + tmp_path.str());
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to rename the reference allele index file " + tmp_path.str() + " to " + path);
+}
+
+RefAlleleIndex* loadRefAlleleIndex(const std::string& vcf_file, const std::string& path, std::ostream& logger){
+  if (access(path.c_str(), F_OK) != 0){
+    logger << "Generating reference allele index file " << path << " from reference VCF " << vcf_file << std::endl;
+    RefAlleleIndex::write(vcf_file, path, logger);
+  }
+  logger << "Reading reference allele index " << path << std::endl;
+  RefAlleleIndex* index = new RefAlleleIndex(path);
+  uint64_t vcf_size;
+  int64_t vcf_mtime;
+  vcf_file_stat(vcf_file, vcf_size, vcf_mtime);
+  if (index->vcf_size() != vcf_size || index->vcf_mtime() != vcf_mtime){
+    delete index;
+    printErrorAndDie("Reference allele index file " + path + " doesn't match the reference VCF " + vcf_file
+		     + ". Please delete it and rerun the analysis to regenerate it");
+  }
+  return index;
+}
@@ -0,0 +1,65 @@
+#ifndef REF_ALLELE_INDEX_H_
+#define REF_ALLELE_INDEX_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "region.h"
+
+/*
+ * Read-only, memory-mapped index of the STR alleles in a --ref-vcf reference panel. Looking up a locus' alleles in the VCF requires
+ * a tabix query and parsing each overlapping record, including the genotypes of every panel sample, which dominates the cost for
+ * panels with thousands of samples. The index retains only the fields used by read_vcf_alleles(), so each lookup is a binary search.
+ *
+ * File layout (all integers little-endian):
+ *   header:   magic "HSTRRALI", uint32 version, uint64 size and int64 modification time of the VCF, uint32 number of chromosomes, uint64 number of records
+ *   chroms:   for each chromosome (in sorted order), uint32 name length, name, uint64 index of its first record, uint64 number of records
+ *   records:  fixed-width records sorted by START and END, with ties in VCF order: int32 START INFO value (1-based), int32 END INFO value,
+ *             int32 0-based VCF position, uint32 number of alleles, uint32 1 iff the allele counts are available and uint64 offset of
+ *             the record's data in the data pool
+ *   data:     for each record, each allele's uint32 length and bases, followed by each allele's int32 count if available
+ */
+class RefAlleleIndex {
+ private:
+  struct ChromInfo {
+    std::string name;
+    uint64_t first_record;
+    uint64_t num_records;
+  };
+
+  std::vector<ChromInfo> chroms_;
+  uint64_t vcf_size_;
+  int64_t vcf_mtime_;
+  uint64_t num_records_;
+  const char* records_;
+  const char* pool_;
+  const char* data_;
+  size_t size_;
+
+  const ChromInfo* find_chrom(const std::string& chrom) const;
+
+ public:
+  explicit RefAlleleIndex(const std::string& path);
+
+  ~RefAlleleIndex();
+
+  uint64_t vcf_size()    const { return vcf_size_;    }
+  int64_t vcf_mtime()    const { return vcf_mtime_;   }
+  uint64_t num_records() const { return num_records_; }
+
+  /*
+   * Stores the alleles, 0-based position and allele counts of the VCF record whose START and END INFO fields match the region, as
+   * read_vcf_alleles() does. ALLELE_COUNTS is empty if they weren't available. Returns false, and sets POS to -1, if no record matches
+   */
+  bool read_alleles(const Region& region, std::vector<std::string>& alleles, int32_t& pos, std::vector<int32_t>& allele_counts) const;
+
+  /* Writes an index of the STR alleles in the bgzipped and tabix-indexed VCF to PATH, using a temporary file that's renamed once it's complete */
+  static void write(const std::string& vcf_file, const std::string& path, std::ostream& logger);
+};
+
+/* Loads the allele index at PATH for the reference VCF, after generating it from the VCF if it doesn't exist */
+RefAlleleIndex* loadRefAlleleIndex(const std::string& vcf_file, const std::string& path, std::ostream& logger);
+
+#endif
@@ -0,0 +1,44 @@
+#include "reference_prefetcher.h"
+
+ReferencePrefetcher::ReferencePrefetcher(const std::string& fasta_path, const std::string& packed_ref_path){
+  fasta_reader_.reset(new FastaReader(fasta_path));
+  if (!packed_ref_path.empty())
+    fasta_reader_->use_packed_reference(packed_ref_path);
+  num_hits_ = num_misses_ = 0;
+}
+
+ReferencePrefetcher::~ReferencePrefetcher(){
+  if (loading_.valid())
+    loading_.wait();
+}
+
+void ReferencePrefetcher::wait(){
+  // Rethrows any error encountered while loading the sequence
+  if (loading_.valid())
+    loading_.get();
+}
+
+void ReferencePrefetcher::prefetch(const std::string& chrom){
+  if (chrom.compare(chrom_) == 0)
+    return;
+  wait();
+  chrom_ = chrom;
+  std::string().swap(seq_);
+  loading_ = std::async(std::launch::async, [this](){
+      std::string chrom = chrom_;
+      fasta_reader_->get_sequence(chrom, seq_);
+    });
+}
+
+bool ReferencePrefetcher::take(const std::string& chrom, ReferenceSequence& ref){
+  if (chrom_.empty() || chrom.compare(chrom_) != 0){
+    num_misses_++;
+    return false;
+  }
+  wait();
+  ref.assign(0, seq_.size(), seq_);
+  std::string().swap(seq_);
+  chrom_.clear();
+  num_hits_++;
+  return true;
+}
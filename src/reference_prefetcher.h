@@ -0,0 +1,44 @@
+#ifndef REFERENCE_PREFETCHER_H_
+#define REFERENCE_PREFETCHER_H_
+
+#include <future>
+#include <memory>
+#include <string>
+
+#include "fasta_reader.h"
+#include "reference_sequence.h"
+
+/*
+ * Loads the sequence of the next chromosome in a background thread while the current chromosome's regions are analyzed, so that
+ * reading (and, for bgzipped FASTAs, decompressing) each chromosome doesn't stall the analysis at every chromosome transition.
+ * The sequence is read using a separate FastaReader, as htslib's FASTA indices can't be shared by concurrent threads.
+ * At most one chromosome is loaded at a time, so at most two chromosomes are held in memory (the current one and the next)
+ */
+class ReferencePrefetcher {
+ private:
+  std::unique_ptr<FastaReader> fasta_reader_;
+  std::string chrom_;         // Chromosome that's being loaded or was loaded, or empty if there isn't one
+  std::string seq_;           // Loaded sequence for CHROM_
+  std::future<void> loading_; // Valid while the sequence may still be loading
+  int num_hits_, num_misses_;
+
+  // Wait for the current load, if any, to complete
+  void wait();
+
+ public:
+  // FASTA_PATH and PACKED_REF_PATH are interpreted as in FastaReader and FastaReader::use_packed_reference(), where the latter may be empty
+  ReferencePrefetcher(const std::string& fasta_path, const std::string& packed_ref_path);
+  ~ReferencePrefetcher();
+
+  // Start loading the sequence of CHROM in the background, discarding any previously loaded sequence that wasn't taken.
+  // Has no effect if CHROM is already being loaded
+  void prefetch(const std::string& chrom);
+
+  // If CHROM was prefetched, wait for it to finish loading, store it in REF and return true. Otherwise, return false
+  bool take(const std::string& chrom, ReferenceSequence& ref);
+
+  int num_hits()   const { return num_hits_;   }
+  int num_misses() const { return num_misses_; }
+};
+
+#endif
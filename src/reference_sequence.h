@@ -0,0 +1,64 @@
+#ifndef REFERENCE_SEQUENCE_H_
+#define REFERENCE_SEQUENCE_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * Reference sequence for a chromosome, which contains either the entire chromosome or only a window within it.
+ * All positions are chromosome coordinates, so code that indexes into the reference is unaffected by how much
+ * of the chromosome was loaded. Bases outside of the loaded window are reported as N
+ */
+class ReferenceSequence {
+ private:
+  std::string window_;
+  int32_t window_start_; // Chromosome coordinate of the first base in the window
+  int32_t length_;       // Length of the entire chromosome
+
+ public:
+  ReferenceSequence(){
+    window_start_ = 0;
+    length_       = 0;
+  }
+
+  /* Replace the contents with BASES, which start at WINDOW_START in a chromosome of length LENGTH. BASES is left empty */
+  void assign(int32_t window_start, int32_t length, std::string& bases){
+    assert(window_start >= 0 && window_start + (int64_t)bases.size() <= length);
+    window_.clear();
+    window_.swap(bases);
+    window_start_ = window_start;
+    length_       = length;
+  }
+
+  /* Length of the entire chromosome */
+  int32_t size()                 const { return length_; }
+  int32_t window_start()         const { return window_start_; }
+  int32_t window_end()           const { return window_start_ + (int32_t)window_.size(); }
+  const std::string& window()    const { return window_; }
+  bool empty()                   const { return window_.empty(); }
+
+  /* Returns true iff the bases in [START, END) have been loaded */
+  bool contains(int32_t start, int32_t end) const {
+    return start >= window_start_ && end <= window_end();
+  }
+
+  char operator[](int32_t pos) const {
+    return (pos >= window_start_ && pos < window_end()) ? window_[pos-window_start_] : 'N';
+  }
+
+  /* Same semantics as std::string::substr, where LEN < 0 extends to the end of the chromosome */
+  std::string substr(int32_t pos, int32_t len) const {
+    assert(pos >= 0 && pos <= length_);
+    if (len < 0 || len > length_ - pos)
+      len = length_ - pos;
+    if (contains(pos, pos+len))
+      return window_.substr(pos-window_start_, len);
+    std::string result(len, 'N');
+    for (int32_t i = 0; i < len; i++)
+      result[i] = (*this)[pos+i];
+    return result;
+  }
+};
+
+#endif
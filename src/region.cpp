@@ -70,5 +70,34 @@ void orderRegions(std::vector<Region>& input_regions, std::vector< std::vector<R
     std::sort(output_regions[i].begin(), output_regions[i].end());
 } 
 
+void groupRegions(const std::vector<Region>& regions, int32_t max_dist, int max_regions, int32_t min_gap, std::vector<RegionGroup>& groups){
+  groups.clear();
+  for (auto region_iter = regions.begin(); region_iter != regions.end(); region_iter++){
+    if (!groups.empty()){
+      RegionGroup& group = groups.back();
+      int32_t gap = region_iter->start() - group.stop();
+      if (group.chrom().compare(region_iter->chrom()) == 0 && group.num_regions() < max_regions && gap >= min_gap && gap <= max_dist){
+	group.add_region(*region_iter);
+	continue;
+      }
+    }
+    groups.push_back(RegionGroup(*region_iter));
+  }
+}
 
-
+bool parseRegionString(const std::string& region_str, std::string& chrom, int32_t& start, int32_t& end){
+  size_t colon = region_str.rfind(':');
+  if (colon == std::string::npos || colon == 0)
+    return false;
+  size_t dash = region_str.find('-', colon);
+  if (dash == std::string::npos)
+    return false;
+  std::string start_str = region_str.substr(colon+1, dash-colon-1), end_str = region_str.substr(dash+1);
+  if (start_str.empty() || end_str.empty() || start_str.find_first_not_of("0123456789") != std::string::npos
+      || end_str.find_first_not_of("0123456789") != std::string::npos || start_str.size() > 9 || end_str.size() > 9)
+    return false;
+  chrom = region_str.substr(0, colon);
+  start = atoi(start_str.c_str())-1;
+  end   = atoi(end_str.c_str());
+  return start >= 0 && end > start;
+}
@@ -79,7 +79,7 @@ class RegionGroup {
     stop_  = region.stop();
   }
 
-  const std::vector<Region>& regions(){
+  const std::vector<Region>& regions() const {
     return regions_;
   }
 
@@ -88,6 +88,13 @@ class RegionGroup {
   int32_t  stop()            const { return stop_;           }
   int      num_regions()     const { return regions_.size(); }
 
+  // Region spanning all of the group's regions. A group with a single region returns that region
+  Region span() const {
+    if (regions_.size() == 1)
+      return regions_[0];
+    return Region(chrom_, start_, stop_, regions_[0].period());
+  }
+
   RegionGroup* copy() const {
     RegionGroup* clone = new RegionGroup(regions_[0]);
     for (int i = 1; i < regions_.size(); i++)
@@ -104,4 +111,17 @@ class RegionGroup {
     std::sort(regions_.begin(), regions_.end());
   }
 };
+
+/*
+ * Partition the sorted regions into groups of consecutive regions on the same chromosome, where each region is added to the
+ * preceding region's group if it begins within MAX_DIST bp of the group's end and the group contains fewer than MAX_REGIONS regions.
+ * Regions that begin fewer than MIN_GAP bp after the group's end are never grouped, as their haplotype blocks would overlap
+ */
+void groupRegions(const std::vector<Region>& regions, int32_t max_dist, int max_regions, int32_t min_gap, std::vector<RegionGroup>& groups);
+
+/*
+ * Parses an interval in the format CHROM:START-END, where START and END are 1-based and inclusive, and stores it in CHROM, START and END
+ * as a 0-based, half-open interval. Returns false if the string isn't properly formatted
+ */
+bool parseRegionString(const std::string& region_str, std::string& chrom, int32_t& start, int32_t& end);
 #endif
@@ -0,0 +1,232 @@
+#include "region_catalog.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "error.h"
+
+namespace {
+const char MAGIC[]       = "HSTRRCAT";
+const size_t MAGIC_LEN   = 8;
+const uint32_t VERSION   = 2;
+const size_t RECORD_SIZE = 6*sizeof(uint32_t) + sizeof(uint64_t);
+
+template<typename T> T read_value(const char*& ptr){
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return value;
+}
+
+template<typename T> void append_value(std::string& buffer, T value){
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// The BED file's size and modification time, which identify the version of the file from which a catalog was generated
+void bed_file_stat(const std::string& bed_file, uint64_t& size, int64_t& mtime){
+  struct stat st_buf;
+  if (stat(bed_file.c_str(), &st_buf) != 0)
+    printErrorAndDie("Failed to open region file " + bed_file);
+  size  = st_buf.st_size;
+  mtime = st_buf.st_mtime;
+}
+}
+
+RegionCatalog::RegionCatalog(const std::string& path){
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    printErrorAndDie("Failed to open region catalog file " + path);
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) != 0)
+    printErrorAndDie("Failed to determine the size of region catalog file " + path);
+  size_ = st_buf.st_size;
+  if (size_ < MAGIC_LEN + 2*sizeof(uint32_t) + 2*sizeof(uint64_t) + sizeof(int64_t))
+    printErrorAndDie("Region catalog file " + path + " is truncated");
+  void* mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    printErrorAndDie("Failed to memory-map region catalog file " + path);
+  data_ = static_cast<const char*>(mapping);
+
+  const char* ptr = data_;
+  if (memcmp(ptr, MAGIC, MAGIC_LEN) != 0)
+    printErrorAndDie("File " + path + " is not a region catalog file");
+  ptr += MAGIC_LEN;
+  if (read_value<uint32_t>(ptr) != VERSION)
+    printErrorAndDie("Region catalog file " + path + " was generated by an incompatible version of HipSTR. Please delete it and rerun the analysis");
+  bed_size_           = read_value<uint64_t>(ptr);
+  bed_mtime_          = read_value<int64_t>(ptr);
+  uint32_t num_chroms = read_value<uint32_t>(ptr);
+  num_regions_        = read_value<uint64_t>(ptr);
+  for (uint32_t i = 0; i < num_chroms; i++){
+    if (ptr + sizeof(uint32_t) > data_ + size_)
+      printErrorAndDie("Region catalog file " + path + " is truncated");
+    uint32_t name_len = read_value<uint32_t>(ptr);
+    if (ptr + name_len + 2*sizeof(uint64_t) > data_ + size_)
+      printErrorAndDie("Region catalog file " + path + " is truncated");
+    ChromInfo info;
+    info.name = std::string(ptr, name_len);
+    ptr += name_len;
+    info.first_record = read_value<uint64_t>(ptr);
+    info.num_records  = read_value<uint64_t>(ptr);
+    if (info.first_record + info.num_records > num_regions_)
+      printErrorAndDie("Region catalog file " + path + " is corrupted");
+    chroms_.push_back(info);
+  }
+  records_ = ptr;
+  names_   = records_ + num_regions_*RECORD_SIZE;
+  if (names_ > data_ + size_)
+    printErrorAndDie("Region catalog file " + path + " is truncated");
+}
+
+RegionCatalog::~RegionCatalog(){
+  munmap(const_cast<char*>(data_), size_);
+}
+
+Region RegionCatalog::get_region(const std::string& chrom, uint64_t record_index, uint32_t& line_index, uint32_t& chrom_line_index) const {
+  const char* ptr  = records_ + record_index*RECORD_SIZE;
+  int32_t start    = read_value<int32_t>(ptr);
+  int32_t stop     = read_value<int32_t>(ptr);
+  uint32_t period  = read_value<uint32_t>(ptr);
+  line_index       = read_value<uint32_t>(ptr);
+  chrom_line_index = read_value<uint32_t>(ptr);
+  uint32_t name_len    = read_value<uint32_t>(ptr);
+  uint64_t name_offset = read_value<uint64_t>(ptr);
+  if (names_ + name_offset + name_len > data_ + size_)
+    printErrorAndDie("Region catalog file is truncated");
+  return Region(chrom, start, stop, period, std::string(names_ + name_offset, name_len));
+}
+
+void RegionCatalog::get_regions(uint32_t max_regions, const std::string& chrom_limit, std::vector<Region>& regions, std::ostream& logger) const {
+  regions.clear();
+  uint32_t line_index, chrom_line_index;
+  for (auto chrom_iter = chroms_.begin(); chrom_iter != chroms_.end(); chrom_iter++){
+    if (!chrom_limit.empty() && chrom_iter->name.compare(chrom_limit) != 0)
+      continue;
+    for (uint64_t i = 0; i < chrom_iter->num_records; i++){
+      Region region = get_region(chrom_iter->name, chrom_iter->first_record + i, line_index, chrom_line_index);
+
+      // readRegions() stops once it has accumulated MAX_REGIONS regions on the requested chromosome(s)
+      if ((chrom_limit.empty() ? line_index : chrom_line_index) < max_regions)
+	regions.push_back(region);
+    }
+  }
+
+  logger << "Region catalog contains " << num_regions_ << " regions";
+  if (!chrom_limit.empty())
+    logger << ", of which " << regions.size() << " were located on the requested chromosome";
+  logger << "\n" << std::endl;
+  if (!chrom_limit.empty() && regions.empty())
+    printErrorAndDie("Region catalog did not contain any regions on the requested chromosome: " + chrom_limit);
+}
+
+void RegionCatalog::write(const std::string& bed_file, const std::string& path, std::ostream& logger){
+  // Record the BED file's size and modification time before it's read, so that a catalog generated while it's modified won't match it
+  uint64_t bed_size;
+  int64_t bed_mtime;
+  bed_file_stat(bed_file, bed_size, bed_mtime);
+  std::string bed_path(bed_file);
+  std::vector<Region> regions;
+  readRegions(bed_path, regions, -1, "", logger);
+
+  // Sort the regions by chromosome and position, breaking ties using their order in the BED file
+  std::map<std::string, uint32_t> chrom_counts;
+  std::vector<uint32_t> chrom_line_indices(regions.size());
+  std::vector<uint32_t> order(regions.size());
+  for (uint32_t i = 0; i < regions.size(); i++){
+    chrom_line_indices[i] = chrom_counts[regions[i].chrom()]++;
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){ return regions[a] < regions[b]; });
+
+  std::string header(MAGIC, MAGIC_LEN), records, names;
+  append_value<uint32_t>(header, VERSION);
+  append_value<uint64_t>(header, bed_size);
+  append_value<int64_t>(header,  bed_mtime);
+  append_value<uint32_t>(header, chrom_counts.size());
+  append_value<uint64_t>(header, regions.size());
+  uint64_t first_record = 0;
+  for (auto chrom_iter = chrom_counts.begin(); chrom_iter != chrom_counts.end(); chrom_iter++){
+    append_value<uint32_t>(header, chrom_iter->first.size());
+    header.append(chrom_iter->first);
+    append_value<uint64_t>(header, first_record);
+    append_value<uint64_t>(header, chrom_iter->second);
+    first_record += chrom_iter->second;
+  }
+  for (auto order_iter = order.begin(); order_iter != order.end(); order_iter++){
+    const Region& region = regions[*order_iter];
+    append_value<int32_t>(records,  region.start());
+    append_value<int32_t>(records,  region.stop());
+    append_value<uint32_t>(records, region.period());
+    append_value<uint32_t>(records, *order_iter);
+    append_value<uint32_t>(records, chrom_line_indices[*order_iter]);
+    append_value<uint32_t>(records, region.name().size());
+    append_value<uint64_t>(records, names.size());
+    names.append(region.name());
+  }
+
+  std::stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid();
+  FILE* output = fopen(tmp_path.str().c_str(), "wb");
+  if (output == NULL)
+    printErrorAndDie("Failed to open " + tmp_path.str() + " to write the region catalog");
+  bool success = (fwrite(header.data(),  1, header.size(),  output) == header.size());
+  success &=     (fwrite(records.data(), 1, records.size(), output) == records.size());
+  success &=     (fwrite(names.data(),   1, names.size(),   output) == names.size());
+  success &=     (fclose(output) == 0);
+  if (!success){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to write the region catalog to " + tmp_path.str());
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to rename the region catalog file " + tmp_path.str() + " to " + path);
+}
+
+void loadSortedRegions(std::string& bed_file, const std::string& catalog_file, uint32_t max_regions, const std::string& chrom_limit,
+		       const std::set<std::string>& chrom_list, int64_t first_region, int64_t last_region,
+		       std::vector<Region>& regions, std::ostream& logger){
+  if (catalog_file.empty()){
+    readRegions(bed_file, regions, max_regions, chrom_limit, logger);
+    orderRegions(regions);
+  }
+  else {
+    if (access(catalog_file.c_str(), F_OK) != 0){
+      logger << "Generating region catalog file " << catalog_file << " from region file " << bed_file << std::endl;
+      RegionCatalog::write(bed_file, catalog_file, logger);
+    }
+    logger << "Reading region catalog " << catalog_file << std::endl;
+    RegionCatalog catalog(catalog_file);
+    uint64_t bed_size;
+    int64_t bed_mtime;
+    bed_file_stat(bed_file, bed_size, bed_mtime);
+    if (catalog.bed_size() != bed_size || catalog.bed_mtime() != bed_mtime)
+      printErrorAndDie("Region catalog file " + catalog_file + " doesn't match the region file " + bed_file
+		       + ". Please delete it and rerun the analysis to regenerate it");
+    catalog.get_regions(max_regions, chrom_limit, regions, logger);
+  }
+
+  if (!chrom_list.empty()){
+    regions.erase(std::remove_if(regions.begin(), regions.end(),
+				 [&](const Region& region){ return chrom_list.find(region.chrom()) == chrom_list.end(); }), regions.end());
+    logger << regions.size() << " regions are located on the " << chrom_list.size() << " chromosome(s) in the chromosome list" << std::endl;
+    if (regions.empty())
+      printErrorAndDie("The region file did not contain any regions on the chromosomes in the chromosome list");
+  }
+
+  if (first_region > 0){
+    if (first_region > (int64_t)regions.size())
+      printErrorAndDie("The requested range of regions begins at region " + std::to_string(first_region) + ", but only "
+		       + std::to_string(regions.size()) + " regions are available");
+    last_region = std::min<int64_t>(last_region, regions.size());
+    regions.erase(regions.begin() + last_region, regions.end());
+    regions.erase(regions.begin(), regions.begin() + first_region - 1);
+    logger << "Analyzing sorted regions " << first_region << "-" << last_region << std::endl;
+  }
+}
@@ -0,0 +1,72 @@
+#ifndef REGION_CATALOG_H_
+#define REGION_CATALOG_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "region.h"
+
+/*
+ * Read-only, memory-mapped catalog of the regions in a BED file, in the order produced by readRegions() followed by orderRegions().
+ * Loading the regions from the catalog avoids parsing and sorting the text, which dominates the startup time for BED files with
+ * millions of lines. Each chromosome's records are contiguous, so the regions on a chromosome or within a range of region indices
+ * are selected using the chromosome table without visiting the remaining records.
+ *
+ * File layout (all integers little-endian):
+ *   header:   magic "HSTRRCAT", uint32 version, uint64 size and int64 modification time of the BED file, uint32 number of chromosomes, uint64 number of regions
+ *   chroms:   for each chromosome (in sorted order), uint32 name length, name, uint64 index of its first record, uint64 number of records
+ *   records:  fixed-width records of int32 start (0-based), int32 stop, uint32 period, uint32 index of the region's line in the BED file,
+ *             uint32 index of the line among the chromosome's lines, uint32 name length and uint64 offset of the name in the name pool
+ *   names:    the concatenated region names
+ */
+class RegionCatalog {
+ private:
+  struct ChromInfo {
+    std::string name;
+    uint64_t first_record;
+    uint64_t num_records;
+  };
+
+  std::vector<ChromInfo> chroms_;
+  uint64_t bed_size_;
+  int64_t bed_mtime_;
+  uint64_t num_regions_;
+  const char* records_;
+  const char* names_;
+  const char* data_;
+  size_t size_;
+
+  Region get_region(const std::string& chrom, uint64_t record_index, uint32_t& line_index, uint32_t& chrom_line_index) const;
+
+ public:
+  explicit RegionCatalog(const std::string& path);
+
+  ~RegionCatalog();
+
+  uint64_t bed_size()    const { return bed_size_;    }
+  int64_t bed_mtime()    const { return bed_mtime_;   }
+  uint64_t num_regions() const { return num_regions_; }
+
+  /*
+   * Stores the regions that readRegions(bed_file, regions, MAX_REGIONS, CHROM_LIMIT) and orderRegions(regions) would produce,
+   * where an empty CHROM_LIMIT selects every chromosome
+   */
+  void get_regions(uint32_t max_regions, const std::string& chrom_limit, std::vector<Region>& regions, std::ostream& logger) const;
+
+  /* Writes a catalog of the regions in the BED file to PATH, using a temporary file that's renamed once it's complete */
+  static void write(const std::string& bed_file, const std::string& path, std::ostream& logger);
+};
+
+/*
+ * Loads the sorted regions from the BED file, or from the catalog at CATALOG_FILE if it's non-empty. The catalog is generated
+ * from the BED file if it doesn't exist. If CHROM_LIST is non-empty, only the regions on its chromosomes are retained.
+ * Then, if FIRST_REGION > 0, only the sorted regions FIRST_REGION-LAST_REGION are retained (1-based, inclusive)
+ */
+void loadSortedRegions(std::string& bed_file, const std::string& catalog_file, uint32_t max_regions, const std::string& chrom_limit,
+		       const std::set<std::string>& chrom_list, int64_t first_region, int64_t last_region,
+		       std::vector<Region>& regions, std::ostream& logger);
+
+#endif
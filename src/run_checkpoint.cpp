@@ -0,0 +1,71 @@
+#include "run_checkpoint.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "error.h"
+
+void RunCheckpoint::write(const std::string& path) const {
+  std::string tmp_path = path + ".tmp";
+  std::ofstream output(tmp_path.c_str());
+  if (!output.is_open())
+    printErrorAndDie("Failed to open the checkpoint file " + tmp_path);
+  output << "REGIONS\t" << num_completed << "\t" << num_regions << "\n";
+  for (auto file_iter = files.begin(); file_iter != files.end(); file_iter++)
+    output << "FILE\t" << file_iter->second << "\t" << file_iter->first << "\n";
+  output.close();
+  if (output.fail())
+    printErrorAndDie("Failed to write the checkpoint file " + tmp_path);
+  if (rename(tmp_path.c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to rename the checkpoint file " + tmp_path + " to " + path);
+}
+
+bool RunCheckpoint::read(const std::string& path){
+  std::ifstream input(path.c_str());
+  if (!input.is_open())
+    return false;
+  files.clear();
+  bool has_regions = false;
+  std::string line;
+  while (std::getline(input, line)){
+    std::istringstream iss(line);
+    std::string key;
+    iss >> key;
+    if (key.compare("REGIONS") == 0){
+      if (!(iss >> num_completed >> num_regions))
+	printErrorAndDie("Improperly formatted line in the checkpoint file " + path + ": " + line);
+      has_regions = true;
+    }
+    else if (key.compare("FILE") == 0){
+      int64_t size;
+      std::string file;
+      if (!(iss >> size) || !std::getline(iss >> std::ws, file) || file.empty())
+	printErrorAndDie("Improperly formatted line in the checkpoint file " + path + ": " + line);
+      files.push_back(std::pair<std::string, int64_t>(file, size));
+    }
+    else
+      printErrorAndDie("Improperly formatted line in the checkpoint file " + path + ": " + line);
+  }
+  input.close();
+  if (!has_regions)
+    printErrorAndDie("Checkpoint file " + path + " is truncated");
+  return true;
+}
+
+void RunCheckpoint::truncate_file(const std::string& path, int64_t size){
+  if (file_size(path) < size)
+    printErrorAndDie("Output file " + path + " is smaller than the size recorded in the checkpoint");
+  if (truncate(path.c_str(), size) != 0)
+    printErrorAndDie("Failed to truncate output file " + path + " to its checkpointed size");
+}
+
+int64_t RunCheckpoint::file_size(const std::string& path){
+  struct stat st_buf;
+  if (stat(path.c_str(), &st_buf) != 0)
+    printErrorAndDie("Failed to determine the size of output file " + path);
+  return st_buf.st_size;
+}
@@ -0,0 +1,44 @@
+#ifndef RUN_CHECKPOINT_H_
+#define RUN_CHECKPOINT_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Sidecar file recording the progress of a run, so that an interrupted run can resume after its last completed region. It
+ * contains the number of regions whose output has been fully written and the size of each output file at that point, which
+ * were flushed to complete BGZF blocks beforehand. Resuming truncates each file to its recorded size, discarding any partial
+ * output (and the BGZF EOF marker of a completed run), and appends the output for the remaining regions.
+ *
+ * File layout (tab-delimited):
+ *   REGIONS   <number of completed regions>  <total number of regions>
+ *   FILE      <size in bytes>                <path>
+ */
+class RunCheckpoint {
+ public:
+  size_t num_completed;
+  size_t num_regions;
+  std::vector< std::pair<std::string, int64_t> > files;
+
+  RunCheckpoint(){
+    num_completed = 0;
+    num_regions   = 0;
+  }
+
+  /* Writes the checkpoint to PATH. The file is written under a temporary name and then renamed, so it's never partially written */
+  void write(const std::string& path) const;
+
+  /* Reads the checkpoint from PATH, or returns false if it doesn't exist */
+  bool read(const std::string& path);
+
+  /* Truncates the output file at PATH to the provided size, discarding any output written after the checkpoint */
+  static void truncate_file(const std::string& path, int64_t size);
+
+  /* Returns the size of the file at PATH in bytes */
+  static int64_t file_size(const std::string& path);
+};
+
+#endif
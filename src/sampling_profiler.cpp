@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "error.h"
+#include "process_timer.h"
+#include "sampling_profiler.h"
+
+namespace {
+
+const int SAMPLES_PER_SECOND = 99;      // Slightly offset from 100 Hz to avoid sampling in lockstep with periodic activity
+const int BUFFER_SIZE        = 1 << 16; // Samples a thread can buffer between consecutive flushes
+
+struct ThreadSamples {
+  uint64_t buffer[BUFFER_SIZE];
+  std::atomic<int> num_buffered;
+  int64_t num_dropped;
+  std::unordered_map<uint64_t, int64_t> counts;
+  ThreadSamples() : num_buffered(0), num_dropped(0) {}
+};
+
+std::string output_file;
+std::mutex mutex; // Guards the locus labels and the registration of new threads
+std::deque<std::string> locus_labels;
+std::vector< std::unique_ptr<ThreadSamples> > all_samples;
+std::atomic<int64_t> untracked_samples(0); // Samples from threads that never analyzed a locus (e.g. BAM decompression threads)
+thread_local ThreadSamples* thread_samples = NULL;
+
+void handle_sample(int signal){
+  ThreadSamples* samples = thread_samples;
+  if (samples == NULL){
+    untracked_samples++;
+    return;
+  }
+  int index = samples->num_buffered.load(std::memory_order_relaxed);
+  if (index == BUFFER_SIZE){
+    samples->num_dropped++;
+    return;
+  }
+  samples->buffer[index] = SamplingProfiler::thread_tag().load(std::memory_order_relaxed);
+  samples->num_buffered.store(index+1, std::memory_order_relaxed);
+}
+
+void drain(ThreadSamples* samples){
+  int num_buffered = samples->num_buffered.load(std::memory_order_relaxed);
+  for (int i = 0; i < num_buffered; i++)
+    samples->counts[samples->buffer[i]]++;
+  samples->num_buffered.store(0, std::memory_order_relaxed);
+}
+
+std::string frame_name(const char* name){
+  std::string frame(name);
+  std::replace(frame.begin(), frame.end(), ' ', '_');
+  return frame;
+}
+
+}
+
+void SamplingProfiler::enable(const std::string& file){
+  std::ofstream test(file.c_str());
+  if (!test.is_open())
+    printErrorAndDie("Failed to open the profile output file " + file);
+  output_file = file;
+  enabled()   = true;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_sample;
+  action.sa_flags   = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    printErrorAndDie("Failed to install the profiling signal handler");
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec  = 0;
+  timer.it_interval.tv_usec = 1000000/SAMPLES_PER_SECOND;
+  timer.it_value            = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    printErrorAndDie("Failed to start the profiling timer");
+}
+
+uint32_t SamplingProfiler::register_locus(const std::string& label){
+  std::lock_guard<std::mutex> lock(mutex);
+  locus_labels.push_back(label);
+  return locus_labels.size();
+}
+
+void SamplingProfiler::flush_thread_samples(){
+  if (thread_samples == NULL){
+    ThreadSamples* samples = new ThreadSamples();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      all_samples.emplace_back(samples);
+    }
+    thread_samples = samples;
+    return;
+  }
+
+  // Block the signal so that the handler can't append samples while the buffer is being drained
+  sigset_t signals, prev_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &signals, &prev_signals);
+  drain(thread_samples);
+  pthread_sigmask(SIG_SETMASK, &prev_signals, NULL);
+}
+
+int64_t SamplingProfiler::write(){
+  if (!enabled())
+    return 0;
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+  enabled() = false;
+
+  // Aggregate the samples from every thread by their folded stacks
+  std::map<std::string, int64_t> stacks;
+  int64_t num_samples = untracked_samples, num_dropped = 0;
+  if (untracked_samples > 0)
+    stacks["[untracked_thread]"] += untracked_samples;
+  for (auto iter = all_samples.begin(); iter != all_samples.end(); iter++){
+    ThreadSamples* samples = iter->get();
+    drain(samples);
+    num_dropped += samples->num_dropped;
+    for (auto count_iter = samples->counts.begin(); count_iter != samples->counts.end(); count_iter++){
+      uint64_t tag       = count_iter->first;
+      uint32_t locus_id  = tag >> 32;
+      std::string stack  = (locus_id == 0 ? "[no_locus]" : locus_labels[locus_id-1]);
+      int depth          = tag & 0xF;
+      if (depth == 0)
+	stack += ";[other]";
+      for (int i = 0; i < depth; i++)
+	stack += ";" + frame_name(ProcessTimer::phase_name(((tag >> (4 + 4*i)) & 0xF) - 1));
+      stacks[stack] += count_iter->second;
+      num_samples   += count_iter->second;
+    }
+  }
+  if (num_dropped > 0)
+    stacks["[dropped]"] += num_dropped;
+
+  std::ofstream out(output_file.c_str());
+  if (!out.is_open())
+    printErrorAndDie("Failed to open the profile output file " + output_file);
+  for (auto iter = stacks.begin(); iter != stacks.end(); iter++)
+    out << iter->first << " " << iter->second << "\n";
+  out.close();
+  return num_samples + num_dropped;
+}
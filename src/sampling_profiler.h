@@ -0,0 +1,108 @@
+#ifndef SAMPLING_PROFILER_H_
+#define SAMPLING_PROFILER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+/*
+ * Statistical profiler that periodically interrupts the threads consuming CPU using ITIMER_PROF and attributes each
+ * sample to the locus and the nested phases the interrupted thread was executing. Each thread publishes its current
+ * locus and phases as a single packed tag that the signal handler can read atomically, and the handler appends the tag
+ * to a fixed-size buffer owned by the thread. Threads move their buffered samples into their own tables at each locus
+ * boundary, so the handler never allocates memory or takes a lock. The samples are written in the folded-stack format
+ * consumed by flamegraph.pl and speedscope, with one line per locus and phase stack
+ */
+class SamplingProfiler {
+ public:
+  // Tag layout: bits 0-3 contain the number of nested phases, bits 4-27 contain up to MAX_DEPTH phases (4 bits each,
+  // storing the phase + 1) and bits 32-63 contain the locus ID (0 if the thread isn't analyzing a locus)
+  static const int MAX_DEPTH = 6;
+
+  static std::atomic<uint64_t>& thread_tag(){
+    static thread_local std::atomic<uint64_t> tag(0);
+    return tag;
+  }
+
+  static bool& enabled(){
+    static bool profiling = false;
+    return profiling;
+  }
+
+  static uint64_t push_phase(uint64_t tag, int phase){
+    uint64_t depth = tag & 0xF;
+    if (depth >= MAX_DEPTH)
+      return tag;
+    return ((tag & ~0xFULL) | (uint64_t)(phase+1) << (4 + 4*depth)) + depth + 1;
+  }
+
+  static uint64_t with_locus(uint64_t tag, uint32_t locus_id){
+    return (tag & 0xFFFFFFFFULL) | ((uint64_t)locus_id << 32);
+  }
+
+  /* Start sampling the CPU usage of every thread, with the profile written to OUTPUT_FILE by write() */
+  static void enable(const std::string& output_file);
+
+  /* Returns a unique ID for the provided locus label, for use in thread tags */
+  static uint32_t register_locus(const std::string& label);
+
+  /* Moves the samples buffered by the calling thread into its table. Must not be called from the signal handler */
+  static void flush_thread_samples();
+
+  /* Stops sampling and writes the profile. Threads other than the caller must no longer be running. Returns the number of samples */
+  static int64_t write();
+};
+
+/* Attributes the samples taken on this thread during the scope to the provided locus */
+class ProfileLocusScope {
+ private:
+  bool enabled_;
+  uint64_t prev_tag_;
+
+ public:
+  explicit ProfileLocusScope(const std::string& label){
+    enabled_ = SamplingProfiler::enabled();
+    if (enabled_){
+      SamplingProfiler::flush_thread_samples();
+      prev_tag_ = SamplingProfiler::thread_tag().load(std::memory_order_relaxed);
+      SamplingProfiler::thread_tag().store(SamplingProfiler::with_locus(0, SamplingProfiler::register_locus(label)), std::memory_order_relaxed);
+    }
+  }
+
+  ~ProfileLocusScope(){
+    if (enabled_){
+      SamplingProfiler::flush_thread_samples();
+      SamplingProfiler::thread_tag().store(prev_tag_, std::memory_order_relaxed);
+    }
+  }
+
+  ProfileLocusScope(const ProfileLocusScope&)            = delete;
+  ProfileLocusScope& operator=(const ProfileLocusScope&) = delete;
+};
+
+/* Attributes the samples taken on this thread during the scope to the provided tag, e.g. to that of the thread that created a task */
+class ProfileTagScope {
+ private:
+  bool enabled_;
+  uint64_t prev_tag_;
+
+ public:
+  explicit ProfileTagScope(uint64_t tag){
+    enabled_ = SamplingProfiler::enabled();
+    if (enabled_){
+      prev_tag_ = SamplingProfiler::thread_tag().load(std::memory_order_relaxed);
+      SamplingProfiler::thread_tag().store(tag, std::memory_order_relaxed);
+    }
+  }
+
+  ~ProfileTagScope(){
+    if (enabled_)
+      SamplingProfiler::thread_tag().store(prev_tag_, std::memory_order_relaxed);
+  }
+
+  ProfileTagScope(const ProfileTagScope&)            = delete;
+  ProfileTagScope& operator=(const ProfileTagScope&) = delete;
+};
+
+#endif
@@ -3,22 +3,28 @@
 #include <cstring>
 #include <math.h>
 #include <random>
+#include <stdio.h>
 #include <string>
 #include <sstream>
 #include <time.h>
+#include <unordered_map>
 
 #include "seq_stutter_genotyper.h"
 #include "bam_processor.h"
+#include "bcf_output.h"
+#include "columnar_output.h"
 #include "debruijn_graph.h"
 #include "em_stutter_genotyper.h"
 #include "error.h"
 #include "extract_indels.h"
+#include "line_formatter.h"
 #include "mathops.h"
 #include "stringops.h"
 #include "vcf_input.h"
 #include "zalgorithm.h"
 
 #include "SeqAlignment/AlignmentData.h"
+#include "SeqAlignment/AlignmentKernels.h"
 #include "SeqAlignment/AlignmentModel.h"
 #include "SeqAlignment/AlignmentViz.h"
 #include "SeqAlignment/HaplotypeGenerator.h"
@@ -28,6 +34,141 @@
 
 #include "cephes/cephes.h"
 
+// Genotypes whose length-based LL is within this margin of the sample's best genotype are retained by the allele prescreen
+const double PRESCREEN_LL_MARGIN = 10.0;
+
+// Minimum log-probability of a read's observed length in the prescreen, so that reads with sequencing or alignment errors
+// can't exclude the alleles supported by the remaining reads
+const double PRESCREEN_MIN_LOG_PROB = log(1e-4);
+
+// Returns true and sets BP_DIFF to the net length of the insertions and deletions within [START, END] in the alignment, or false
+// if the alignment doesn't span the interval
+bool aln_bp_diff(const Alignment& aln, int32_t start, int32_t end, int& bp_diff){
+  if (aln.get_start() >= start || aln.get_stop() <= end)
+    return false;
+  bp_diff     = 0;
+  int32_t pos = aln.get_start();
+  for (auto cigar_iter = aln.get_cigar_list().begin(); cigar_iter != aln.get_cigar_list().end(); cigar_iter++){
+    if (pos > end)
+      break;
+    switch(cigar_iter->get_type()){
+    case 'I':
+      if (pos >= start)
+	bp_diff += cigar_iter->get_num();
+      break;
+    case 'D':
+      bp_diff -= std::max(0, std::min(end, pos+cigar_iter->get_num()) - std::max(start, pos));
+      pos     += cigar_iter->get_num();
+      break;
+    case 'M': case '=': case 'X':
+      pos += cigar_iter->get_num();
+      break;
+    default:
+      break;
+    }
+  }
+  return true;
+}
+
+// Stores the read's bases aligned within [START, END) in SEQ, including any insertions at either end of the interval
+void aln_interval_seq(const Alignment& aln, int32_t start, int32_t end, std::string& seq){
+  seq.clear();
+  const std::string& aln_seq = aln.get_alignment();
+  int align_index = 0;
+  int32_t pos     = aln.get_start();
+  for (auto cigar_iter = aln.get_cigar_list().begin(); cigar_iter != aln.get_cigar_list().end() && pos <= end; cigar_iter++){
+    int num = cigar_iter->get_num();
+    switch(cigar_iter->get_type()){
+    case 'I':
+      if (pos >= start)
+	seq.append(aln_seq, align_index, num);
+      break;
+    case 'M': case '=': case 'X': {
+      int32_t first = std::max(pos, start), last = std::min(pos+num, end);
+      if (first < last)
+	seq.append(aln_seq, align_index+first-pos, last-first);
+      pos += num;
+      break;
+    }
+    case 'D':
+      pos += num;
+      break;
+    default:
+      break;
+    }
+    align_index += num;
+  }
+  for (size_t i = 0; i < seq.size(); i++)
+    seq[i] = toupper(seq[i]);
+}
+
+// Returns the index of the block option the read's left alignment supports, or -1 if it doesn't identify a single option.
+// Reads must span interior blocks, but only need to extend past the inner ends of the flanking blocks, which they're matched against
+int observed_block_option(const Alignment& aln, HapBlock* block, bool first_block, bool last_block, std::string& seq){
+  bool left_partial  = (aln.get_start() >= block->start()), right_partial = (aln.get_stop() <= block->end());
+  if ((left_partial && !first_block) || (right_partial && !last_block) || (left_partial && right_partial))
+    return -1;
+  aln_interval_seq(aln, block->start(), block->end(), seq);
+  if (!left_partial && !right_partial)
+    return (block->contains(seq) ? block->index_of(seq) : -1);
+
+  int option = -1;
+  for (int i = 0; i < block->num_options(); i++){
+    const std::string& block_seq = block->get_seq(i);
+    if (seq.size() > block_seq.size())
+      continue;
+    if (block_seq.compare(left_partial ? block_seq.size()-seq.size() : 0, seq.size(), seq) == 0){
+      if (option != -1)
+	return -1;
+      option = i;
+    }
+  }
+  return option;
+}
+
+// Stores the net bp length of the indels in the alignment's CIGAR string that lie within BLOCK and the positions of any
+// mismatches or indels outside of it. Returns false if the alignment contains an indel outside of the block
+bool block_bp_diff(const Alignment& aln, HapBlock* block, int& bp_diff, std::vector<int32_t>* flank_diffs){
+  bool flank_indel = false;
+  bp_diff = 0;
+  int32_t pos = aln.get_start();
+  for (auto cigar_iter = aln.get_cigar_list().begin(); cigar_iter != aln.get_cigar_list().end(); cigar_iter++){
+    int num = cigar_iter->get_num();
+    switch(cigar_iter->get_type()){
+    case 'X':
+      if (flank_diffs != NULL)
+	for (int32_t i = pos; i < pos+num; i++)
+	  if (i < block->start() || i >= block->end())
+	    flank_diffs->push_back(i);
+      pos += num;
+      break;
+    case 'I':
+      if (pos < block->start() || pos > block->end()){
+	flank_indel = true;
+	if (flank_diffs != NULL)
+	  flank_diffs->push_back(pos);
+      }
+      else
+	bp_diff += num;
+      break;
+    case 'D':
+      if (pos < block->start() || pos+num > block->end()){
+	flank_indel = true;
+	if (flank_diffs != NULL)
+	  flank_diffs->push_back(pos);
+      }
+      else
+	bp_diff -= num;
+      pos += num;
+      break;
+    default:
+      pos += num;
+      break;
+    }
+  }
+  return !flank_indel;
+}
+
 int max_index(double* vals, unsigned int num_vals){
   int best_index = 0;
   for (unsigned int i = 1; i < num_vals; i++)
@@ -37,11 +178,24 @@ int max_index(double* vals, unsigned int num_vals){
 }
 
 bool SeqStutterGenotyper::assemble_flanks(std::ostream& logger){
+  TraceScope trace("assemble_flanks");
   std::vector<AlignmentTrace*> traced_alns;
   retrace_alignments(traced_alns);
 
-  double locus_assembly_time = clock();
-  logger << "Reassembling flanking sequences" << std::endl;
+  ScopedTimer assembly_timer(timer_, PHASE_FLANK_ASSEMBLY);
+  std::vector<bool> assemble_sample(num_samples_, true);
+  if (min_flank_var_frac_ > 0){
+    select_assembly_samples(traced_alns, assemble_sample);
+    int num_assembled = std::count(assemble_sample.begin(), assemble_sample.end(), true);
+    if (num_assembled == 0){
+      logger << "Skipping flank reassembly, as no sample has a flank variant in at least " << 100*min_flank_var_frac_ << "% of its reads" << std::endl;
+      skipped_assembly_ = true;
+      return true;
+    }
+    logger << "Reassembling flanking sequences for the " << num_assembled << " sample(s) with recurrent flank variants" << std::endl;
+  }
+  else
+    logger << "Reassembling flanking sequences" << std::endl;
   std::vector< std::vector<std::string> > alleles_to_add (haplotype_->num_blocks());
   std::vector<bool> realign_sample(num_samples_, false);
 
@@ -57,6 +211,11 @@ bool SeqStutterGenotyper::assemble_flanks(std::ostream& logger){
     std::vector< std::pair<std::string,int> > assembly_data;
     int min_read_index = 0, read_index;
     for (int sample_index = 0; sample_index < num_samples_; sample_index++){
+      if (!assemble_sample[sample_index]){
+	while (min_read_index < num_reads_ && sample_label_[min_read_index] == sample_index)
+	  min_read_index++;
+	continue;
+      }
       assembly_data.clear();
       bool acyclic = false;
       for (int k = kmer_length; k <= max_k; k++){
@@ -126,8 +285,7 @@ bool SeqStutterGenotyper::assemble_flanks(std::ostream& logger){
       logger << "\t" << ref_seq << "\t" << "REF_SEQ" << "\n" << std::endl;
     }
   }
-  locus_assembly_time   = (clock() - locus_assembly_time)/CLOCKS_PER_SEC;
-  total_assembly_time_ += locus_assembly_time;
+  assembly_timer.stop();
 
   // Determine which read pools we need to realign and which read's probabilities we should update
   // We need to realign a pool if any of its associated reads has a sample with a new candidate flank
@@ -167,6 +325,104 @@ bool SeqStutterGenotyper::assemble_flanks(std::ostream& logger){
   return true;
 }
 
+void SeqStutterGenotyper::select_assembly_samples(const std::vector<AlignmentTrace*>& traced_alns, std::vector<bool>& assemble_sample){
+  assert(assemble_sample.size() == num_samples_);
+  std::vector<int> num_traced(num_samples_, 0);
+  std::vector< std::map<std::pair<int32_t, int32_t>, int> > indel_counts(num_samples_);
+  std::vector< std::map<std::pair<int32_t, char>, int> > snp_counts(num_samples_);
+  for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
+    if (traced_alns[read_index] == NULL)
+      continue;
+    int sample_index = sample_label_[read_index];
+    num_traced[sample_index]++;
+    std::vector< std::pair<int32_t, int32_t> >& indel_data = traced_alns[read_index]->flank_indel_data();
+    for (auto indel_iter = indel_data.begin(); indel_iter != indel_data.end(); indel_iter++)
+      indel_counts[sample_index][*indel_iter]++;
+    std::vector< std::pair<int32_t, char> >& snp_data = traced_alns[read_index]->flank_snp_data();
+    for (auto snp_iter = snp_data.begin(); snp_iter != snp_data.end(); snp_iter++)
+      snp_counts[sample_index][*snp_iter]++;
+  }
+
+  // Sequencing errors rarely recur at the same position, so only a variant observed in several reads counts towards the threshold
+  for (int sample_index = 0; sample_index < num_samples_; sample_index++){
+    int max_count = 0;
+    for (auto indel_iter = indel_counts[sample_index].begin(); indel_iter != indel_counts[sample_index].end(); indel_iter++)
+      max_count = std::max(max_count, indel_iter->second);
+    for (auto snp_iter = snp_counts[sample_index].begin(); snp_iter != snp_counts[sample_index].end(); snp_iter++)
+      max_count = std::max(max_count, snp_iter->second);
+    assemble_sample[sample_index] = (max_count >= MIN_PATH_WEIGHT && max_count >= min_flank_var_frac_*num_traced[sample_index]);
+  }
+}
+
+void SeqStutterGenotyper::calc_log_hap_priors(std::vector<double>& log_hap_priors){
+  assert(log_hap_priors.empty());
+
+  // Determine the log prior of each block's options. Non-repeat blocks, and repeat blocks whose options
+  // aren't all among the reference VCF's alleles (e.g. after flank reassembly), have uniform priors
+  std::vector< std::vector<double> > log_option_priors(haplotype_->num_blocks());
+  int region_index = 0;
+  for (int block_index = 0; block_index < haplotype_->num_blocks(); block_index++){
+    HapBlock* block = haplotype_->get_block(block_index);
+    int num_options = block->num_options();
+    std::vector<double>& log_priors = log_option_priors[block_index];
+    if (block->get_repeat_info() != NULL && region_index < ref_allele_log_freqs_.size()){
+      const std::map<std::string, double>& log_freqs = ref_allele_log_freqs_[region_index++];
+      double max_val = -DBL_MAX/2, total = 0.0;
+      for (int i = 0; i < num_options; i++){
+	auto freq_iter = log_freqs.find(block->get_seq(i));
+	if (freq_iter == log_freqs.end()){
+	  log_priors.clear();
+	  break;
+	}
+	log_priors.push_back(freq_iter->second);
+	update_streaming_log_sum_exp(freq_iter->second, max_val, total);
+      }
+
+      // Renormalize the priors over the block's options
+      double log_total = finish_streaming_log_sum_exp(max_val, total);
+      for (unsigned int i = 0; i < log_priors.size(); i++)
+	log_priors[i] -= log_total;
+    }
+    if (log_priors.empty())
+      log_priors.resize(num_options, -int_log(num_options));
+  }
+
+  haplotype_->reset();
+  do {
+    double log_prior = 0;
+    for (int block_index = 0; block_index < haplotype_->num_blocks(); block_index++)
+      log_prior += log_option_priors[block_index][haplotype_->cur_index(block_index)];
+    log_hap_priors.push_back(log_prior);
+  } while (haplotype_->next());
+  haplotype_->reset();
+}
+
+void SeqStutterGenotyper::init_log_sample_priors(double* log_sample_ptr){
+  // The haplotypes change whenever alleles are added or removed, so their priors are recomputed before each use
+  log_allele_priors_.clear();
+  if (use_ref_allele_priors_ && !ref_allele_log_freqs_.empty())
+    calc_log_hap_priors(log_allele_priors_);
+  Genotyper::init_log_sample_priors(log_sample_ptr);
+}
+
+void SeqStutterGenotyper::get_novel_bp_diffs(const std::vector<int>& allele_bp_diffs, const std::vector<ReadCountHistogram>& bps_per_sample,
+					     std::vector<int>& novel_bp_diffs){
+  assert(novel_bp_diffs.empty());
+
+  // Use the thresholds for a strongly supporting sample that are used to identify candidate alleles (see HaplotypeGenerator)
+  const int MIN_READS_STRONG_SAMPLE = 2;
+  const double MIN_FRAC_STRONG_SAMPLE = 0.2;
+  std::set<int> known_bp_diffs(allele_bp_diffs.begin(), allele_bp_diffs.end()), novel;
+  for (unsigned int sample_index = 0; sample_index < bps_per_sample.size(); sample_index++){
+    const ReadCountHistogram& diff_counts = bps_per_sample[sample_index];
+    for (auto count_iter = diff_counts.begin(); count_iter != diff_counts.end(); count_iter++)
+      if (count_iter->count >= MIN_READS_STRONG_SAMPLE && count_iter->count >= MIN_FRAC_STRONG_SAMPLE*diff_counts.num_reads())
+	if (known_bp_diffs.find(count_iter->bp_diff) == known_bp_diffs.end())
+	  novel.insert(count_iter->bp_diff);
+  }
+  novel_bp_diffs.insert(novel_bp_diffs.end(), novel.begin(), novel.end());
+}
+
 void SeqStutterGenotyper::haps_to_alleles(int hap_block_index, std::vector<int>& allele_indices){
   assert(allele_indices.empty());
   allele_indices.reserve(haplotype_->num_combs());
@@ -229,7 +485,7 @@ void SeqStutterGenotyper::get_unused_alleles(bool check_spanned, bool check_call
 	      int hap_b    = haps[sample_label_[read_index]].second;
 	      int best_hap = hap_a;
 	      if (!haploid_ && (hap_a != hap_b)){
-		double v1 = log_p1_[read_index]+read_LL_ptr[hap_a], v2 = log_p2_[read_index]+read_LL_ptr[hap_b];
+		double v1 = read_log_p1(read_index)+read_LL_ptr[hap_a], v2 = read_log_p2(read_index)+read_LL_ptr[hap_b];
 		if (std::abs(v1-v2) > TOLERANCE)
 		  best_hap = (v1 > v2 ? hap_a : hap_b);
 	      }
@@ -290,7 +546,7 @@ void SeqStutterGenotyper::add_and_remove_alleles(std::vector< std::vector<int> >
   // Construct new haplotype blocks by removing the unwanted alleles and adding the new alleles
   std::vector<HapBlock*> updated_blocks;
   for (int i = 0; i < hap_blocks_.size(); i++)
-    updated_blocks.push_back(hap_blocks_[i]->remove_alleles(alleles_to_remove[i]));
+    updated_blocks.push_back(hap_blocks_[i]->extract_alleles(alleles_to_remove[i]));
 
   bool added_seq = false;
   for (int i = 0; i < updated_blocks.size(); i++){
@@ -303,6 +559,9 @@ void SeqStutterGenotyper::add_and_remove_alleles(std::vector< std::vector<int> >
   // Construct the new haplotype and record its set of haplotype sequences
   // Determine the mapping from old sequences to new sequences, if they're still present
   Haplotype* updated_haplotype = new Haplotype(updated_blocks);
+  updated_haplotype->derive_reverse(haplotype_, alleles_to_remove, alleles_to_add);
+  updated_haplotype->reuse_ref_alignments(haplotype_);
+  restrict_haplotype_combinations(updated_haplotype, haplotype_, true);
   std::vector<std::string> updated_hap_seqs;
   std::vector<int> allele_mapping(num_alleles_, -1);
   std::vector<bool> realign_to_haplotype;
@@ -319,22 +578,43 @@ void SeqStutterGenotyper::add_and_remove_alleles(std::vector< std::vector<int> >
   updated_haplotype->reset();
   assert(updated_hap_seqs.front().compare(hap_seqs.front()) == 0);
 
-  // Copy over the alignment probabilities for old sequences present in the new haplotype
-  int new_num_alleles         = updated_haplotype->num_combs();
-  double* fixed_log_aln_probs = new double[num_reads_*new_num_alleles];
-  std::fill_n(fixed_log_aln_probs, num_reads_*new_num_alleles, -100000);
-  double* old_log_aln_ptr     = log_aln_probs_;
-  double* new_log_aln_ptr     = fixed_log_aln_probs;
+  // Copy over the alignment probabilities for old sequences present in the new haplotype. If every retained sequence's index
+  // is no larger than its old index, as when alleles are only removed, the rows are compacted within the existing array
+  int new_num_alleles = updated_haplotype->num_combs();
+  std::vector<int> old_indices(new_num_alleles, -1);
+
+  // A sparse haplotype can contain combinations of existing options that weren't previously present, which must also be aligned
+  if (updated_haplotype->sparse())
+    added_seq |= (std::find(realign_to_haplotype.begin(), realign_to_haplotype.end(), true) != realign_to_haplotype.end());
+  for (unsigned int j = 0; j < num_alleles_; ++j)
+    if (allele_mapping[j] != -1){
+      assert(!realign_to_haplotype[allele_mapping[j]]);
+      old_indices[allele_mapping[j]] = j;
+    }
+  bool compact = (new_num_alleles <= num_alleles_);
+  for (int j = 0, prev_index = -1; j < new_num_alleles && compact; ++j){
+    if (old_indices[j] != -1){
+      compact    = (old_indices[j] >= j && old_indices[j] > prev_index);
+      prev_index = old_indices[j];
+    }
+  }
+  double* fixed_log_aln_probs = log_aln_probs_;
+  if (!compact){
+    fixed_log_aln_probs = new double[num_reads_*new_num_alleles];
+    update_peak_bytes(((int64_t)num_reads_)*new_num_alleles*sizeof(double));
+  }
+  // When compacting, each entry is written at or before the entry it's copied from and after every entry that's already been read
+  double* old_log_aln_ptr = log_aln_probs_;
+  double* new_log_aln_ptr = fixed_log_aln_probs;
   for (unsigned int i = 0; i < num_reads_; ++i){
-    for (unsigned int j = 0; j < num_alleles_; ++j, ++old_log_aln_ptr)
-      if (allele_mapping[j] != -1){
-	assert(!realign_to_haplotype[allele_mapping[j]]);
-	new_log_aln_ptr[allele_mapping[j]] = *old_log_aln_ptr;
-      }
-    new_log_aln_ptr += new_num_alleles;
+    for (unsigned int j = 0; j < new_num_alleles; ++j, ++new_log_aln_ptr)
+      *new_log_aln_ptr = (old_indices[j] != -1 ? old_log_aln_ptr[old_indices[j]] : -100000);
+    old_log_aln_ptr += num_alleles_;
+  }
+  if (!compact){
+    delete [] log_aln_probs_;
+    log_aln_probs_ = fixed_log_aln_probs;
   }
-  delete [] log_aln_probs_;
-  log_aln_probs_ = fixed_log_aln_probs;
 
   // Delete the old haplotype data structures and replace them with the updated ones
   delete haplotype_;
@@ -349,29 +629,62 @@ void SeqStutterGenotyper::add_and_remove_alleles(std::vector< std::vector<int> >
     calc_hap_aln_probs(realign_to_haplotype, realign_pool, copy_read);
 
   // Fix alignment traceback cache (as allele indices have changed)
-  std::map<std::pair<int,int>, AlignmentTrace*> new_trace_cache;
-  for (auto cache_iter = trace_cache_.begin(); cache_iter != trace_cache_.end(); cache_iter++){
-    int new_allele_index = allele_mapping[cache_iter->first.second];
-    if (new_allele_index != -1)
-      new_trace_cache[std::pair<int,int>(cache_iter->first.first, new_allele_index)] = cache_iter->second;
-    else
-      delete cache_iter->second;
-  }
-  trace_cache_ = new_trace_cache;
+  remap_trace_cache(allele_mapping, new_num_alleles);
 
   // Resize and recalculate the genotype posterior array
   delete [] log_sample_posteriors_;
-  log_sample_posteriors_ = new double[num_samples_*num_alleles_*num_alleles_];
+  log_sample_posteriors_ = new double[num_samples_*num_sample_gts()];
+  update_peak_bytes(0);
   calc_log_sample_posteriors();
 }
 
+AlignmentTrace* SeqStutterGenotyper::get_trace(HapAligner& hap_aligner, int read_index, int hap_index){
+  if (trace_cache_.empty())
+    trace_cache_.resize(pooler_.num_trace_groups()*num_alleles_, NULL);
+  AlignmentTrace*& trace = trace_cache_[pooler_.trace_group(read_index)*num_alleles_ + hap_index];
+  if (trace == NULL){
+    int64_t prev_dp_cells = hap_aligner.num_dp_cells();
+    trace = hap_aligner.trace_optimal_aln(alns_[read_index], seed_positions_[read_index], hap_index, &base_quality_);
+    num_dp_cells_ += hap_aligner.num_dp_cells() - prev_dp_cells;
+  }
+  return trace;
+}
+
+void SeqStutterGenotyper::remap_trace_cache(const std::vector<int>& allele_mapping, int new_num_alleles){
+  if (trace_cache_.empty())
+    return;
+  int old_num_alleles = allele_mapping.size();
+  int num_groups      = trace_cache_.size()/old_num_alleles;
+  std::vector<AlignmentTrace*> new_trace_cache(num_groups*new_num_alleles, NULL);
+  for (int group = 0; group < num_groups; group++){
+    AlignmentTrace** old_traces = trace_cache_.data() + group*old_num_alleles;
+    AlignmentTrace** new_traces = new_trace_cache.data() + group*new_num_alleles;
+    for (int i = 0; i < old_num_alleles; i++){
+      if (old_traces[i] == NULL)
+	continue;
+      if (allele_mapping[i] != -1)
+	new_traces[allele_mapping[i]] = old_traces[i];
+      else
+	delete old_traces[i];
+    }
+  }
+  trace_cache_.swap(new_trace_cache);
+}
+
+void SeqStutterGenotyper::clear_trace_cache(){
+  for (auto trace_iter = trace_cache_.begin(); trace_iter != trace_cache_.end(); trace_iter++)
+    delete *trace_iter;
+  trace_cache_.clear();
+}
+
 void SeqStutterGenotyper::remove_alleles(std::vector< std::vector<int> >& allele_indices){
   std::vector< std::vector<std::string> > alleles_to_add(hap_blocks_.size());
   add_and_remove_alleles(allele_indices, alleles_to_add);
 }
 
-bool SeqStutterGenotyper::build_haplotype(std::string& chrom_seq, std::vector<StutterModel*>& stutter_models, std::ostream& logger){
-  double locus_hap_build_time = clock();
+bool SeqStutterGenotyper::build_haplotype(const ReferenceSequence& chrom_seq, std::vector<StutterModel*>& stutter_models, std::ostream& logger){
+  TraceScope trace("build_haplotype");
+  ScopedTimer build_timer(timer_, PHASE_HAP_GENERATION);
   assert(hap_blocks_.empty() && haplotype_ == NULL);
   logger << "Generating candidate haplotypes" << std::endl;
 
@@ -395,12 +708,25 @@ bool SeqStutterGenotyper::build_haplotype(std::string& chrom_seq, std::vector<St
     std::vector<std::string> vcf_alleles;
     if (ref_vcf_ != NULL){
       int32_t pos;
-      if (!read_vcf_alleles(ref_vcf_, regions[region_index], vcf_alleles, pos)){
+      std::vector<int32_t> allele_counts;
+      bool found_alleles = (ref_allele_index_ != NULL ? ref_allele_index_->read_alleles(regions[region_index], vcf_alleles, pos, allele_counts) :
+			    read_vcf_alleles(ref_vcf_, regions[region_index], vcf_alleles, pos, allele_counts));
+      if (!found_alleles){
 	logger << "Haplotype construction failed: The alleles could not be extracted from the reference VCF" << std::endl;
 	success = false;
 	break;
       }
 
+      std::map<std::string, double> log_freqs;
+      if (!allele_counts.empty()){
+	int64_t total_count = 0;
+	for (unsigned int i = 0; i < allele_counts.size(); i++)
+	  total_count += allele_counts[i] + 1;
+	for (unsigned int i = 0; i < vcf_alleles.size(); i++)
+	  log_freqs[uppercase(vcf_alleles[i])] = log(allele_counts[i] + 1) - log(total_count);
+      }
+      ref_allele_log_freqs_.push_back(log_freqs);
+
       // Add the haplotype block based on the extracted VCF alleles
       if (!hap_generator.add_vcf_haplotype_block(pos, chrom_seq, vcf_alleles, stutter_models[region_index])){
 	logger << "Haplotype construction failed: " << hap_generator.failure_msg() << std::endl;
@@ -419,48 +745,248 @@ bool SeqStutterGenotyper::build_haplotype(std::string& chrom_seq, std::vector<St
   }
 
   if (success){
+    // The blocks aren't reused across runs, even with --ref-vcf alleles, as the flanks span the batch's reads and the repeat blocks' stutter
+    // aligners depend on the batch's stutter models. Building them, including the haplotype's alignments to the reference, is also a tiny
+    // fraction of the time spent aligning the reads to them
     if (hap_generator.fuse_haplotype_blocks(chrom_seq)){
       // Copy over the constructed haplotype blocks and build the haplotype
       hap_blocks_  = hap_generator.get_haplotype_blocks();
       haplotype_   = new Haplotype(hap_blocks_);
+      restrict_haplotype_combinations(haplotype_, NULL, false);
       num_alleles_ = haplotype_->num_combs();
       call_sample_ = std::vector<std::string>(num_samples_, "");
       haplotype_->print_block_structure(30, 100, true, logger);
+      if (haplotype_->sparse()){
+	double num_combs = 1;
+	for (int i = 0; i < haplotype_->num_blocks(); i++)
+	  num_combs *= haplotype_->num_options(i);
+	logger << "Restricted the haplotypes to the " << num_alleles_ << " of " << num_combs << " combinations of block options observed in the reads" << std::endl;
+      }
     }
     else {
       logger << "Haplotype construction failed: " << hap_generator.failure_msg() << std::endl;
       success = false;
     }
   }
-
-  locus_hap_build_time   = (clock() - locus_hap_build_time)/CLOCKS_PER_SEC;
-  total_hap_build_time_ += locus_hap_build_time;
   return success;
 }
 
-void SeqStutterGenotyper::init(std::vector<StutterModel*>& stutter_models, std::string& chrom_seq, std::ostream& logger){
+void SeqStutterGenotyper::restrict_haplotype_combinations(Haplotype* haplotype, Haplotype* prev_haplotype, bool keep_optimal){
+  if (!sparse_haps_)
+    return;
+  int num_blocks = haplotype->num_blocks(), num_variable_blocks = 0;
+  for (int i = 0; i < num_blocks; i++)
+    if (haplotype->num_options(i) > 1)
+      num_variable_blocks++;
+  if (num_variable_blocks < 2)
+    return;
+
+  std::set< std::vector<int> > combs;
+  std::vector<int> comb(num_blocks, 0);
+  std::string seq;
+  for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
+    for (int i = 0; i < num_blocks; i++){
+      HapBlock* block = haplotype->get_block(i);
+      int option = (block->num_options() == 1 ? 0 : observed_block_option(alns_[read_index], block, i == 0, i == num_blocks-1, seq));
+      comb[i]    = std::max(0, option);
+    }
+    combs.insert(comb);
+  }
+
+  // Retain the previous combinations (or optimal haplotypes) whose options remain, mapping them to the new option indices
+  if (prev_haplotype != NULL && prev_haplotype->num_blocks() == num_blocks && (prev_haplotype->sparse() || keep_optimal)){
+    std::vector<int> prev_indices;
+    if (prev_haplotype->sparse()){
+      for (int i = 0; i < prev_haplotype->num_combs(); i++)
+	prev_indices.push_back(i);
+    }
+    else {
+      std::vector< std::pair<int, int> > haps;
+      get_optimal_haplotypes(haps);
+      for (auto hap_iter = haps.begin(); hap_iter != haps.end(); hap_iter++){
+	prev_indices.push_back(hap_iter->first);
+	prev_indices.push_back(hap_iter->second);
+      }
+    }
+    for (auto index_iter = prev_indices.begin(); index_iter != prev_indices.end(); index_iter++){
+      prev_haplotype->go_to(*index_iter);
+      bool present = true;
+      for (int i = 0; i < num_blocks && present; i++){
+	const std::string& block_seq = prev_haplotype->get_seq(i);
+	present = haplotype->get_block(i)->contains(block_seq);
+	if (present)
+	  comb[i] = haplotype->get_block(i)->index_of(block_seq);
+      }
+      if (present)
+	combs.insert(comb);
+    }
+    prev_haplotype->reset();
+  }
+
+  // Ensure that every block option is present in at least one combination
+  for (int i = 0; i < num_blocks; i++){
+    std::vector<bool> covered(haplotype->num_options(i), false);
+    for (auto comb_iter = combs.begin(); comb_iter != combs.end(); comb_iter++)
+      covered[(*comb_iter)[i]] = true;
+    std::fill(comb.begin(), comb.end(), 0);
+    for (int j = 1; j < haplotype->num_options(i); j++){
+      if (!covered[j]){
+	comb[i] = j;
+	combs.insert(comb);
+      }
+    }
+  }
+  haplotype->set_combinations(std::vector< std::vector<int> >(combs.begin(), combs.end()));
+}
+
+void SeqStutterGenotyper::prescreen_alleles(std::ostream& logger){
+  std::vector< std::vector<int> > alleles_to_remove(haplotype_->num_blocks());
+  int num_removed = 0;
+  for (int block_index = 0; block_index < haplotype_->num_blocks(); block_index++){
+    HapBlock* block = haplotype_->get_block(block_index);
+    std::vector<int>& allele_indices = alleles_to_remove[block_index];
+    if (block->get_repeat_info() != NULL && block->num_options() > 2){
+      StutterModel* stutter_model = block->get_repeat_info()->get_stutter_model();
+      int ref_size = block->size(0);
+
+      // Count the lengths of each sample's reads spanning the block
+      std::vector< std::map<int, int> > sample_read_sizes(num_samples_);
+      int num_spanning = 0;
+      for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
+	int bp_diff;
+	if (!second_mate_[read_index] && aln_bp_diff(alns_[read_index], block->start(), block->end(), bp_diff)){
+	  sample_read_sizes[sample_label_[read_index]][ref_size + bp_diff]++;
+	  num_spanning++;
+	}
+      }
+
+      // Identify the allele lengths within each sample's plausible genotypes
+      std::vector<int> allele_sizes;
+      for (int i = 0; i < block->num_options(); i++)
+	allele_sizes.push_back(block->size(i));
+      std::sort(allele_sizes.begin(), allele_sizes.end());
+      allele_sizes.erase(std::unique(allele_sizes.begin(), allele_sizes.end()), allele_sizes.end());
+      std::set<int> plausible_sizes;
+      plausible_sizes.insert(ref_size);
+      for (unsigned int sample_index = 0; sample_index < num_samples_ && num_spanning > 0; sample_index++){
+	if (sample_read_sizes[sample_index].empty())
+	  continue;
+	std::vector<double> size_LLs;
+	for (auto size_iter = allele_sizes.begin(); size_iter != allele_sizes.end(); size_iter++)
+	  for (auto read_iter = sample_read_sizes[sample_index].begin(); read_iter != sample_read_sizes[sample_index].end(); read_iter++)
+	    size_LLs.push_back(std::max(PRESCREEN_MIN_LOG_PROB, stutter_model->log_stutter_pmf(*size_iter, read_iter->first)));
+
+	int num_read_sizes = sample_read_sizes[sample_index].size();
+	std::vector< std::pair<int, int> > gts;
+	std::vector<double> gt_LLs;
+	for (unsigned int i = 0; i < allele_sizes.size(); i++){
+	  for (unsigned int j = (haploid_ ? i : 0); j <= i; j++){
+	    double LL = 0;
+	    auto read_iter = sample_read_sizes[sample_index].begin();
+	    for (int k = 0; k < num_read_sizes; k++, read_iter++)
+	      LL += read_iter->second*(LOG_ONE_HALF + log_sum_exp(size_LLs[i*num_read_sizes+k], size_LLs[j*num_read_sizes+k]));
+	    gts.push_back(std::pair<int, int>(i, j));
+	    gt_LLs.push_back(LL);
+	  }
+	}
+	double max_LL = *std::max_element(gt_LLs.begin(), gt_LLs.end());
+	for (unsigned int i = 0; i < gts.size(); i++){
+	  if (gt_LLs[i] > max_LL - PRESCREEN_LL_MARGIN){
+	    plausible_sizes.insert(allele_sizes[gts[i].first]);
+	    plausible_sizes.insert(allele_sizes[gts[i].second]);
+	  }
+	}
+      }
+
+      // Retain every allele if no reads span the block, as the lengths provide no information
+      if (num_spanning > 0)
+	for (int i = 1; i < block->num_options(); i++)
+	  if (plausible_sizes.find(block->size(i)) == plausible_sizes.end())
+	    allele_indices.push_back(i);
+    }
+    num_removed += allele_indices.size();
+  }
+  if (num_removed == 0)
+    return;
+
+  logger << "Removed " << num_removed << " candidate alleles whose lengths are implausible for all samples before aligning the reads" << std::endl;
+  std::vector<HapBlock*> updated_blocks;
+  for (unsigned int i = 0; i < hap_blocks_.size(); i++)
+    updated_blocks.push_back(hap_blocks_[i]->extract_alleles(alleles_to_remove[i]));
+  Haplotype* updated_haplotype = new Haplotype(updated_blocks);
+  updated_haplotype->reuse_ref_alignments(haplotype_);
+  restrict_haplotype_combinations(updated_haplotype, haplotype_, false);
+  delete haplotype_;
+  for (unsigned int i = 0; i < hap_blocks_.size(); i++)
+    delete hap_blocks_[i];
+  hap_blocks_  = updated_blocks;
+  haplotype_   = updated_haplotype;
+  num_alleles_ = haplotype_->num_combs();
+  delete [] log_sample_posteriors_;
+  delete [] log_aln_probs_;
+  log_sample_posteriors_ = new double[num_samples_*num_sample_gts()];
+  log_aln_probs_         = new double[num_reads_*num_alleles_];
+}
+
+void SeqStutterGenotyper::init(std::vector<StutterModel*>& stutter_models, const ReferenceSequence& chrom_seq, std::ostream& logger){
   // Allocate and initiate additional data structures
   read_weights_.clear();
-  pool_index_   = new int[num_reads_];
-  second_mate_  = new bool[num_reads_];
+  pool_index_   = arena_->allocate<int>(num_reads_);
+  second_mate_  = arena_->allocate<bool>(num_reads_);
   std::string prev_aln_name = "";
 
   for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
-    pool_index_[read_index]   = pooler_.add_alignment(alns_[read_index]);
     second_mate_[read_index]  = (alns_[read_index].get_name().compare(prev_aln_name) == 0);
     read_weights_.push_back(second_mate_[read_index] ? 0 : 1);
     prev_aln_name = alns_[read_index].get_name();
   }
 
   initialized_ = build_haplotype(chrom_seq, stutter_models, logger);
+  if (initialized_ && max_locus_bytes_ > 0){
+    int64_t num_bytes = estimate_bytes(num_alleles_);
+    if (num_bytes > max_locus_bytes_){
+      logger << "Skipping locus as genotyping its " << num_alleles_ << " haplotypes would require ~" << num_bytes/(1024.0*1024.0)
+	     << " MB, which exceeds the memory budget of " << max_locus_bytes_/(1024.0*1024.0) << " MB" << std::endl;
+      exceeded_mem_budget_ = true;
+      initialized_         = false;
+    }
+  }
   if (initialized_){
     // Allocate the remaining data structures
-    log_sample_posteriors_ = new double[num_samples_*num_alleles_*num_alleles_];
+    log_sample_posteriors_ = new double[num_samples_*num_sample_gts()];
     log_aln_probs_         = new double[num_reads_*num_alleles_];
-    seed_positions_        = new int[num_reads_];
+    seed_positions_        = arena_->allocate<int>(num_reads_);
+    update_peak_bytes(0);
   }
 }
 
+void SeqStutterGenotyper::assign_read_pools(std::ostream& logger){
+  for (unsigned int read_index = 0; read_index < num_reads_; read_index++)
+    pool_index_[read_index] = pooler_.add_alignment(alns_[read_index]);
+  logger << "Pooled " << num_reads_ << " reads into " << pooler_.num_pools() << " pools";
+  if (pooler_.num_window_reads() != 0)
+    logger << ", including " << pooler_.num_window_reads() << " reads pooled by their bases near the repeats";
+  logger << std::endl;
+}
+
+int64_t SeqStutterGenotyper::estimate_bytes(int num_alleles){
+  int64_t max_read_len = 0;
+  for (unsigned int i = 0; i < num_reads_; i++)
+    max_read_len = std::max(max_read_len, (int64_t)alns_[i].get_sequence().size());
+
+  // Each read is in at most one pool, and the batched alignments use matrices for ALIGN_BATCH_LANES reads in addition
+  // to those used to align reads individually
+  int64_t dp_bytes = (1+ALIGN_BATCH_LANES)*3*max_read_len*haplotype_->max_size()*sizeof(double);
+  return posterior_bytes(num_reads_, num_samples_, num_alleles, haploid_) + ((int64_t)num_reads_)*num_alleles*(sizeof(double) + sizeof(AlignmentTrace*))
+    + arena_->bytes_used() + dp_bytes;
+}
+
+void SeqStutterGenotyper::update_peak_bytes(int64_t transient_bytes){
+  int64_t num_bytes = posterior_bytes(num_reads_, num_samples_, num_alleles_, haploid_) + trace_cache_.size()*sizeof(AlignmentTrace*)
+    + pool_aln_capacity_*sizeof(double) + arena_->bytes_used() + AlignmentWorkspace::thread_workspace().bytes() + transient_bytes;
+  peak_bytes_ = std::max(peak_bytes_, num_bytes);
+}
+
 void SeqStutterGenotyper::calc_hap_aln_probs(std::vector<bool>& realign_to_haplotype){
   std::vector<bool> realign_pool = std::vector<bool>(pooler_.num_pools(), true);
   std::vector<bool> copy_read    = std::vector<bool>(num_reads_, true);
@@ -468,15 +994,45 @@ void SeqStutterGenotyper::calc_hap_aln_probs(std::vector<bool>& realign_to_haplo
 }
 
 void SeqStutterGenotyper::calc_hap_aln_probs(std::vector<bool>& realign_to_haplotype, std::vector<bool>& realign_pool, std::vector<bool>& copy_read){
-  double locus_hap_aln_time = clock();
+  TraceScope trace("calc_hap_aln_probs");
+  ScopedTimer aln_timer(timer_, PHASE_HAP_ALIGNMENT);
   assert(haplotype_->num_combs() == realign_to_haplotype.size() && haplotype_->num_combs() == num_alleles_);
-  HapAligner hap_aligner(haplotype_, realign_to_haplotype);
-
-  // Align each pooled read to each haplotype
-  AlnList& pooled_alns       = pooler_.get_alignments();
-  double* log_pool_aln_probs = new double[pooled_alns.size()*num_alleles_];
-  int* pool_seed_positions   = new int[pooled_alns.size()];
-  hap_aligner.process_reads(pooled_alns, 0, &base_quality_, realign_pool, log_pool_aln_probs, pool_seed_positions);
+  HapAligner hap_aligner(haplotype_, realign_to_haplotype, single_prec_alns_, banded_alns_, prune_alns_);
+
+  // Seeds computed in earlier rounds are only reused if the haplotype still has the same flank boundaries and repeat blocks
+  AlnList& pooled_alns = pooler_.get_alignments();
+  std::vector<int32_t> seed_boundaries(1, haplotype_->get_first_block()->start());
+  seed_boundaries.push_back(haplotype_->get_last_block()->end());
+  for (int i = 0; i < haplotype_->num_blocks(); i++){
+    if (haplotype_->get_block(i)->get_repeat_info() != NULL){
+      seed_boundaries.push_back(haplotype_->get_block(i)->start());
+      seed_boundaries.push_back(haplotype_->get_block(i)->end());
+    }
+  }
+  if (pool_seed_positions_ == NULL)
+    pool_seed_positions_ = arena_->allocate<int>(pooled_alns.size());
+  if (seed_boundaries != seed_boundaries_){
+    known_pool_seeds_.assign(pooled_alns.size(), false);
+    seed_boundaries_.swap(seed_boundaries);
+  }
+  hap_aligner.reuse_seeds(&known_pool_seeds_);
+
+  // Align each pooled read to each haplotype, reusing the pooled LL matrix from earlier rounds if it's large enough
+  int64_t num_pool_probs = ((int64_t)pooled_alns.size())*num_alleles_;
+  if (num_pool_probs > pool_aln_capacity_){
+    delete [] pool_log_aln_probs_;
+    pool_log_aln_probs_ = new double[num_pool_probs];
+    pool_aln_capacity_  = num_pool_probs;
+  }
+  if (length_only_)
+    calc_length_aln_probs(hap_aligner, pooled_alns, realign_pool);
+  else
+    aln_backend_->align_reads(hap_aligner, pooled_alns, &base_quality_, realign_pool, pool_log_aln_probs_, pool_seed_positions_, task_queue_);
+  num_dp_cells_ += hap_aligner.num_dp_cells();
+  for (unsigned int i = 0; i < realign_pool.size(); i++)
+    if (realign_pool[i])
+      known_pool_seeds_[i] = true;
+  update_peak_bytes(0);
 
   // Copy each pool's alignment probabilities to the entries for its constituent reads, but only for realigned haplotypes
   double* log_aln_ptr = log_aln_probs_;
@@ -486,17 +1042,17 @@ void SeqStutterGenotyper::calc_hap_aln_probs(std::vector<bool>& realign_to_haplo
       continue;
     }
 
-    seed_positions_[i] = pool_seed_positions[pool_index_[i]];
-    double* src_ptr = log_pool_aln_probs + num_alleles_*pool_index_[i];
+    seed_positions_[i] = pooler_.read_base_index(i, pool_seed_positions_[pool_index_[i]]);
+    double* src_ptr = pool_log_aln_probs_ + num_alleles_*pool_index_[i];
     for (unsigned int j = 0; j < num_alleles_; ++j, ++log_aln_ptr, ++src_ptr)
       if (realign_to_haplotype[j])
 	*log_aln_ptr = *src_ptr;
   }
-  delete [] log_pool_aln_probs;
-  delete [] pool_seed_positions;
 
   // If both mate pairs overlap the STR region, they share the same phasing probabilities and we need to avoid treating them as independent
   // To do so, we combine the alignment probabilities here and set the read weight for the second in the pair to zero during the posterior calculation
+  // The second mate therefore still has to be aligned to every haplotype, as its LLs are part of the pair's, and its traces are used like any other read's.
+  // Mates with identical bases and qualities share a pool and are only aligned once
   // NOTE: It's very important that we don't recombine the values for haplotypes that have already been aligned,
   // or we'll effectively keep doubling those values with each iteration
   for (unsigned int i = 0; i < num_reads_; ++i){
@@ -513,12 +1069,86 @@ void SeqStutterGenotyper::calc_hap_aln_probs(std::vector<bool>& realign_to_haplo
       }
     }
   }
+}
+
+bool SeqStutterGenotyper::check_length_only_locus(){
+  HapBlock* str_block = NULL;
+  for (int i = 0; i < haplotype_->num_blocks(); i++){
+    HapBlock* block = haplotype_->get_block(i);
+    if (block->get_repeat_info() == NULL){
+      if (block->num_options() != 1)
+	return false;
+    }
+    else if (str_block != NULL)
+      return false;
+    else
+      str_block = block;
+  }
+  if (str_block == NULL)
+    return false;
+  std::set<int> allele_lengths;
+  for (int i = 0; i < str_block->num_options(); i++)
+    if (!allele_lengths.insert(str_block->size(i)).second)
+      return false;
 
-  locus_hap_aln_time   = (clock() - locus_hap_aln_time)/CLOCKS_PER_SEC;
-  total_hap_aln_time_ += locus_hap_aln_time;
+  // Sequencing errors only affect a few reads at each position, whereas flank variants are shared by a sizeable fraction of a
+  // sample's reads. The flanks are only invariant if no position has mismatches or indels in that many of a sample's reads
+  const int MIN_VARIANT_READS   = 2;
+  const double MIN_VARIANT_FRAC = 0.2;
+  std::vector<int> sample_reads(num_samples_, 0);
+  std::vector< std::map<int32_t, int> > sample_flank_diffs(num_samples_);
+  std::vector<int32_t> flank_diffs;
+  int bp_diff;
+  for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
+    int sample_index = sample_label_[read_index];
+    sample_reads[sample_index]++;
+    flank_diffs.clear();
+    block_bp_diff(alns_[read_index], str_block, bp_diff, &flank_diffs);
+    for (auto diff_iter = flank_diffs.begin(); diff_iter != flank_diffs.end(); diff_iter++)
+      sample_flank_diffs[sample_index][*diff_iter]++;
+  }
+  for (int i = 0; i < num_samples_; i++)
+    for (auto diff_iter = sample_flank_diffs[i].begin(); diff_iter != sample_flank_diffs[i].end(); diff_iter++)
+      if (diff_iter->second >= MIN_VARIANT_READS && diff_iter->second >= MIN_VARIANT_FRAC*sample_reads[i])
+	return false;
+  return true;
 }
 
-bool SeqStutterGenotyper::id_and_align_to_stutter_alleles(std::string& chrom_seq, std::ostream& logger){
+void SeqStutterGenotyper::calc_length_aln_probs(HapAligner& hap_aligner, AlnList& pooled_alns, std::vector<bool>& realign_pool){
+  int str_block_index = 0;
+  while (haplotype_->get_block(str_block_index)->get_repeat_info() == NULL)
+    str_block_index++;
+  HapBlock* str_block   = haplotype_->get_block(str_block_index);
+  StutterModel* stutter = str_block->get_repeat_info()->get_stutter_model();
+  std::vector<int> hap_alleles, hap_bp_diffs;
+  haps_to_alleles(str_block_index, hap_alleles);
+  for (unsigned int i = 0; i < hap_alleles.size(); i++)
+    hap_bp_diffs.push_back(str_block->size(hap_alleles[i]) - str_block->size(0));
+
+  // A read's flanks match each haplotype equally well, so its LL for a haplotype is the LL of its bases plus the stutter LL
+  // of its repeat length. As with the alignments, reads without a seed have the same zero LL for every haplotype, as do
+  // the reads that don't span the repeat or whose flanks contain an indel
+  int bp_diff;
+  for (unsigned int pool_index = 0; pool_index < pooled_alns.size(); pool_index++){
+    if (!realign_pool[pool_index])
+      continue;
+    Alignment& aln = pooled_alns[pool_index];
+    int seed_base  = hap_aligner.calc_seed_base(aln);
+    pool_seed_positions_[pool_index] = seed_base;
+    double* prob_ptr = pool_log_aln_probs_ + pool_index*num_alleles_;
+    if (seed_base == -1 || aln.get_start() >= str_block->start() || aln.get_stop() <= str_block->end()
+	|| !block_bp_diff(aln, str_block, bp_diff, NULL)){
+      std::fill_n(prob_ptr, num_alleles_, 0.0);
+      continue;
+    }
+
+    double base_LL = aln.sum_log_prob_correct(base_quality_);
+    for (unsigned int hap_index = 0; hap_index < num_alleles_; hap_index++)
+      prob_ptr[hap_index] = base_LL + stutter->log_stutter_pmf(hap_bp_diffs[hap_index], bp_diff);
+  }
+}
+
+bool SeqStutterGenotyper::id_and_align_to_stutter_alleles(const ReferenceSequence& chrom_seq, std::ostream& logger){
   std::vector< std::vector<int> > alleles_to_remove(haplotype_->num_blocks());
   while (true){
     // Look for candidate alleles present in stutter artifacts
@@ -538,13 +1168,26 @@ bool SeqStutterGenotyper::id_and_align_to_stutter_alleles(std::string& chrom_seq
     // Terminate if no new alleles identified in any of the blocks
     if (!added_alleles) break;
 
+    // Also terminate if realigning the reads to the expanded set of haplotypes would exceed the memory budget
+    if (max_locus_bytes_ > 0){
+      int64_t new_num_alleles = 1;
+      for (int i = 0; i < haplotype_->num_blocks(); i++)
+	new_num_alleles *= haplotype_->get_block(i)->num_options() + stutter_seqs[i].size();
+      if (new_num_alleles > INT_MAX || estimate_bytes(new_num_alleles) > max_locus_bytes_){
+	logger << "Not adding the candidate alleles identified in stutter artifacts, as genotyping " << new_num_alleles
+	       << " haplotypes would exceed the memory budget of " << max_locus_bytes_/(1024.0*1024.0) << " MB" << std::endl;
+	break;
+      }
+    }
+
     // Otherwise, add the new alleles to the haplotype and recompute the relevant values
+    num_stutter_rounds_++;
     add_and_remove_alleles(alleles_to_remove, stutter_seqs);
   }
   return true;
 }
 
-bool SeqStutterGenotyper::genotype(std::string& chrom_seq, std::ostream& logger){
+bool SeqStutterGenotyper::genotype(const ReferenceSequence& chrom_seq, std::ostream& logger){
   // Unsuccessful initialization. May be due to
   // 1) Failing to find the corresponding alleles in the VCF (if one has been provided)
   // 2) Large deletion extending past STR
@@ -577,19 +1220,27 @@ bool SeqStutterGenotyper::genotype(std::string& chrom_seq, std::ostream& logger)
     }
   }
 
-  init_alignment_model();
+  if (prescreen_alleles_ && ref_vcf_ == NULL)
+    prescreen_alleles(logger);
+
+  if (!pooler_.pooled())
+    assign_read_pools(logger);
   pooler_.pool(base_quality_);
 
-  // Align each read to each candidate haplotype and store them in the provided arrays
-  logger << "Aligning reads to each candidate haplotype" << std::endl;
+  length_only_ = (length_fast_path_ && check_length_only_locus());
+  if (length_only_)
+    logger << "Computing each read's haplotype LLs from the length of its repeat, as the locus' flanks don't vary" << std::endl;
+  else
+    logger << "Aligning reads to each candidate haplotype" << std::endl;
   std::vector<bool> realign_to_haplotype(num_alleles_, true);
   assert(realign_to_haplotype.size() == haplotype_->num_combs());
   calc_hap_aln_probs(realign_to_haplotype);
   calc_log_sample_posteriors();
 
   if (ref_vcf_ == NULL){
-    // Look for additional alleles in stutter artifacts and align to them (if necessary)
-    if (!id_and_align_to_stutter_alleles(chrom_seq, logger))
+    // Look for additional alleles in stutter artifacts and align to them (if necessary). Alleles in the artifacts of
+    // length-only loci would have the lengths of the existing alleles, so they're only identified for the other loci
+    if (!length_only_ && !id_and_align_to_stutter_alleles(chrom_seq, logger))
       return false;
 
     // Remove alleles with no MAP genotype calls and recompute the posteriors
@@ -612,7 +1263,8 @@ bool SeqStutterGenotyper::genotype(std::string& chrom_seq, std::ostream& logger)
     }
   }
 
-  if (reassemble_flanks_)
+  // The flanks of length-only loci are invariant, and new flanks would require the full haplotype alignments
+  if (reassemble_flanks_ && !length_only_)
     if (!assemble_flanks(logger))
       return false;
 
@@ -635,7 +1287,7 @@ void SeqStutterGenotyper::reorder_alleles(std::vector<std::string>& alleles,
   }
 }
 
-void SeqStutterGenotyper::get_alleles(const Region& region, int block_index, std::string& chrom_seq,
+void SeqStutterGenotyper::get_alleles(const Region& region, int block_index, const ReferenceSequence& chrom_seq,
 				      int32_t& pos, std::vector<std::string>& alleles){
   assert(alleles.size() == 0);
 
@@ -723,7 +1375,7 @@ void SeqStutterGenotyper::debug_sample(int sample_index, std::ostream& logger){
       std::cerr << "\t" << "READ #" << i << ", SEED BASE=" << seed_positions_[i] << ", POOL INDEX=" << pool_index_[i] << ", IS_SECOND_MATE=" << second_mate_[i]
 		<< ", TOTAL QUAL CORRECT= " << alns_[i].sum_log_prob_correct(base_quality_) << ", "
 		<< max_index(read_LL_ptr, num_alleles_) << ", "
-		<< log_p1_[i] << " " << log_p2_[i] <<  ", "
+		<< read_log_p1(i) << " " << read_log_p2(i) <<  ", "
 		<< alns_[i].get_sequence().substr(0, seed_positions_[i])
 		<< " " << alns_[i].get_sequence().substr(seed_positions_[i]+1) << std::endl
 		<< traced_alns[i]->hap_aln() << std::endl
@@ -739,16 +1391,16 @@ void SeqStutterGenotyper::debug_sample(int sample_index, std::ostream& logger){
   }
 
   std::cerr << std::endl << "SAMPLE LL's:" << std::endl;
-  double* sample_LL_ptr = log_sample_posteriors_ + num_alleles_*num_alleles_*sample_index;
+  double* sample_LL_ptr = log_sample_posteriors_ + num_sample_gts()*sample_index;
   for (int index_1 = 0; index_1 < num_alleles_; ++index_1)
-    for (int index_2 = 0; index_2 < num_alleles_; ++index_2, ++sample_LL_ptr)
+    for (int index_2 = (haploid_ ? index_1 : 0); index_2 < (haploid_ ? index_1+1 : num_alleles_); ++index_2, ++sample_LL_ptr)
       std::cerr << index_1 << " " << index_2 << " " << *sample_LL_ptr << "(" << exp(*sample_LL_ptr) << ")" << std::endl;
    std::cerr << "END OF SAMPLE DEBUGGING" << std::endl;
 }
 
 void SeqStutterGenotyper::retrace_alignments(std::vector<AlignmentTrace*>& traced_alns){
   assert(traced_alns.size() == 0);
-  double trace_start = clock();
+  ScopedTimer trace_timer(timer_, PHASE_ALN_TRACEBACK);
   traced_alns.reserve(num_reads_);
   std::vector< std::pair<int, int> > haps;
   get_optimal_haplotypes(haps);
@@ -765,22 +1417,13 @@ void SeqStutterGenotyper::retrace_alignments(std::vector<AlignmentTrace*>& trace
 
     int hap_a    = haps[sample_label_[read_index]].first;
     int hap_b    = haps[sample_label_[read_index]].second;
-    int best_hap = ((LOG_ONE_HALF+log_p1_[read_index]+read_LL_ptr[hap_a] > LOG_ONE_HALF+log_p2_[read_index]+read_LL_ptr[hap_b]) ? hap_a : hap_b);
+    int best_hap = ((LOG_ONE_HALF+read_log_p1(read_index)+read_LL_ptr[hap_a] > LOG_ONE_HALF+read_log_p2(read_index)+read_LL_ptr[hap_b]) ? hap_a : hap_b);
 
-    AlignmentTrace* trace = NULL;
-    std::pair<int,int> trace_key(pool_index_[read_index], best_hap);
-    auto trace_iter = trace_cache_.find(trace_key);
-    if (trace_iter == trace_cache_.end()){
-      trace  = hap_aligner.trace_optimal_aln(alns_[read_index], seed_positions_[read_index], best_hap, &base_quality_);
-      trace_cache_[trace_key] = trace;
-    }
-    else
-      trace = trace_iter->second;
+    AlignmentTrace* trace = get_trace(hap_aligner, read_index, best_hap);
 
     traced_alns.push_back(trace);
     read_LL_ptr += num_alleles_;
   }
-  total_aln_trace_time_ += (clock() - trace_start)/CLOCKS_PER_SEC;
 }
 
 void SeqStutterGenotyper::get_stutter_candidate_alleles(int str_block_index, std::ostream& logger, std::vector<std::string>& candidate_seqs){
@@ -789,9 +1432,10 @@ void SeqStutterGenotyper::get_stutter_candidate_alleles(int str_block_index, std
   std::vector<AlignmentTrace*> traced_alns;
   retrace_alignments(traced_alns);
 
-  // Count the number of reads spanning the STR and the number of reads with stutter
+  // Count the number of reads spanning the STR and the number of reads with stutter. Reads in the same pool that are
+  // aligned to the same haplotype share a trace, so the reads with stutter are counted by trace rather than by sequence
   std::vector<int> sample_counts(num_samples_, 0);
-  std::vector< std::map<std::string, int> > sample_stutter_counts(num_samples_);
+  std::vector< std::unordered_map<AlignmentTrace*, int> > sample_trace_counts(num_samples_);
   for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
     if (traced_alns[read_index] == NULL)
       continue;
@@ -799,21 +1443,53 @@ void SeqStutterGenotyper::get_stutter_candidate_alleles(int str_block_index, std
     if (trace->traced_aln().get_start() < str_block->start()){
       if (trace->traced_aln().get_stop() > str_block->end()){
 	if (trace->stutter_size(str_block_index) != 0)
-	  sample_stutter_counts[sample_label_[read_index]][trace->str_seq(str_block_index)]++;
+	  sample_trace_counts[sample_label_[read_index]][trace]++;
 	sample_counts[sample_label_[read_index]]++;
       }
     }
   }
 
-  // Add frequently observed stutter artifacts as candidate sequences
-  std::set<std::string> candidate_set;
-  for (unsigned int i = 0; i < num_samples_; i++)
-    for (auto seq_iter = sample_stutter_counts[i].begin(); seq_iter != sample_stutter_counts[i].end(); seq_iter++)
-      if (seq_iter->second >= 2 && 1.0*seq_iter->second/sample_counts[i] >= 0.15)
-	if (!str_block->contains(seq_iter->first))
-	  candidate_set.insert(seq_iter->first);
-  candidate_seqs = std::vector<std::string>(candidate_set.begin(), candidate_set.end());
+  // Add frequently observed stutter artifacts as candidate sequences, recording the number of samples and reads supporting each one.
+  // Each sample's counts are combined across its distinct traces, so only the distinct sequences are hashed
+  std::unordered_map<std::string, std::pair<int, int> > candidate_support;
+  std::unordered_map<std::string, int> seq_counts;
+  for (unsigned int i = 0; i < num_samples_; i++){
+    if (sample_trace_counts[i].empty())
+      continue;
+    seq_counts.clear();
+    for (auto trace_iter = sample_trace_counts[i].begin(); trace_iter != sample_trace_counts[i].end(); trace_iter++)
+      seq_counts[trace_iter->first->str_seq(str_block_index)] += trace_iter->second;
+    for (auto seq_iter = seq_counts.begin(); seq_iter != seq_counts.end(); seq_iter++){
+      if (seq_iter->second >= 2 && 1.0*seq_iter->second/sample_counts[i] >= 0.15){
+	if (!str_block->contains(seq_iter->first)){
+	  std::pair<int, int>& support = candidate_support[seq_iter->first];
+	  support.first++;
+	  support.second += seq_iter->second;
+	}
+      }
+    }
+  }
 
+  // Rank the candidates by their supporting samples and reads, so that noisy loci can't add an unbounded number of alleles
+  std::vector< std::pair<std::string, std::pair<int, int> > > ranked_candidates(candidate_support.begin(), candidate_support.end());
+  int num_dropped = 0;
+  if ((int)ranked_candidates.size() > MAX_STUTTER_CANDIDATES){
+    std::sort(ranked_candidates.begin(), ranked_candidates.end(),
+	      [](const std::pair<std::string, std::pair<int, int> >& a, const std::pair<std::string, std::pair<int, int> >& b){
+		if (a.second != b.second)
+		  return a.second > b.second;
+		return a.first < b.first;
+	      });
+    num_dropped = ranked_candidates.size() - MAX_STUTTER_CANDIDATES;
+    ranked_candidates.resize(MAX_STUTTER_CANDIDATES);
+  }
+  for (auto cand_iter = ranked_candidates.begin(); cand_iter != ranked_candidates.end(); cand_iter++)
+    candidate_seqs.push_back(cand_iter->first);
+  std::sort(candidate_seqs.begin(), candidate_seqs.end());
+
+  if (num_dropped != 0)
+    logger << "Discarding " << num_dropped << " candidate alleles from stutter artifacts with the least support, as at most "
+	   << MAX_STUTTER_CANDIDATES << " are added in each round" << "\n";
   if (candidate_seqs.size() != 0){
     logger << "Identified " << candidate_seqs.size() << " additional candidate alleles from stutter artifacts" << "\n";
     for (unsigned int i = 0; i < candidate_seqs.size(); i++)
@@ -924,21 +1600,23 @@ double SeqStutterGenotyper::compute_allele_bias(int hap_a_read_count, int hap_b_
   return log10(std::min(1.0, pvalue));
 }
 
-void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_names, std::string& chrom_seq,
+void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_names, const ReferenceSequence& chrom_seq,
 					   bool output_gls, bool output_pls, bool output_phased_gls, bool output_allreads,
 					   bool output_mallreads, bool output_viz, float max_flank_indel_frac, bool viz_left_alns,
-                                           std::ostream& html_output, std::ostream& out, std::ostream& logger){
+					   const bcf_hdr_t* bcf_header, std::ostream& html_output, std::ostream& out, std::ostream& logger){
+  TraceScope trace("write_vcf_record");
+  calc_unpruned_log_sample_posteriors();
   int region_index = 0;
   for (int block_index = 0; block_index < haplotype_->num_blocks(); block_index++)
     if (haplotype_->get_block(block_index)->get_repeat_info() != NULL)
       write_vcf_record(sample_names, block_index, region_group_->regions()[region_index++], chrom_seq, output_gls, output_pls, output_phased_gls,
-		       output_allreads, output_mallreads, output_viz, max_flank_indel_frac, viz_left_alns, html_output, out, logger);
+		       output_allreads, output_mallreads, output_viz, max_flank_indel_frac, viz_left_alns, bcf_header, html_output, out, logger);
   assert(region_index == region_group_->num_regions());
 }
 
-void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_names, int hap_block_index, const Region& region, std::string& chrom_seq, bool output_gls,
+void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_names, int hap_block_index, const Region& region, const ReferenceSequence& chrom_seq, bool output_gls,
 					   bool output_pls, bool output_phased_gls, bool output_allreads, bool output_mallreads,
-					   bool output_viz, float max_flank_indel_frac, bool viz_left_alns,
+					   bool output_viz, float max_flank_indel_frac, bool viz_left_alns, const bcf_hdr_t* bcf_header,
 					   std::ostream& html_output, std::ostream& out, std::ostream& logger){
   // Extract the alleles and position for the current haplotype block
   int32_t pos;
@@ -970,7 +1648,7 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
   std::vector<int> num_reads_with_stutter(num_samples_, 0), num_reads_with_flank_indels(num_samples_, 0);
   std::vector<int> num_reads_strand_one(num_samples_, 0), num_reads_strand_two(num_samples_, 0);
   std::vector<int> unique_reads_hap_one(num_samples_, 0), unique_reads_hap_two(num_samples_, 0);
-  std::vector< std::vector<int> > bps_per_sample(num_samples_), ml_bps_per_sample(num_samples_);
+  std::vector<ReadCountHistogram> bps_per_sample(num_samples_), ml_bps_per_sample(num_samples_);
   std::vector< std::vector<double> > log_read_phases(num_samples_);
   std::vector<AlnList> max_LL_alns_strand_one(num_samples_), left_alns_strand_one(num_samples_), orig_alns_strand_one(num_samples_);
   std::vector<AlnList> max_LL_alns_strand_two(num_samples_), left_alns_strand_two(num_samples_), orig_alns_strand_two(num_samples_);
@@ -978,6 +1656,10 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
   HapAligner hap_aligner(haplotype_, realign_to_haplotype);
   double* read_LL_ptr = log_aln_probs_;
   int bp_diff; bool got_size;
+
+  // Retracing the ML alignments requires recomputing their alignment matrices, so they're only retraced if an output field or filter
+  // requires them. Otherwise, the DSTUTTER and DFLANKINDEL fields are reported as missing
+  bool trace_reads = (output_mallreads || output_viz || max_flank_indel_frac < 1.0);
   for (unsigned int read_index = 0; read_index < num_reads_; read_index++){
     if (seed_positions_[read_index] < 0){
       read_LL_ptr += num_alleles_;
@@ -987,14 +1669,14 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
     // Extract read's phase posterior conditioned on the determined sample genotype
     int hap_a            = haplotypes[sample_label_[read_index]].first;
     int hap_b            = haplotypes[sample_label_[read_index]].second;
-    double total_read_LL = log_sum_exp(LOG_ONE_HALF+log_p1_[read_index]+read_LL_ptr[hap_a], LOG_ONE_HALF+log_p2_[read_index]+read_LL_ptr[hap_b]);
-    double log_phase_one = LOG_ONE_HALF + log_p1_[read_index] + read_LL_ptr[hap_a] - total_read_LL; 
+    double total_read_LL = log_sum_exp(LOG_ONE_HALF+read_log_p1(read_index)+read_LL_ptr[hap_a], LOG_ONE_HALF+read_log_p2(read_index)+read_LL_ptr[hap_b]);
+    double log_phase_one = LOG_ONE_HALF + read_log_p1(read_index) + read_LL_ptr[hap_a] - total_read_LL; 
     log_read_phases[sample_label_[read_index]].push_back(log_phase_one);
 
     // Determine which of the two genotypes each read is associated with
     int read_strand = 0;
-    if (!haploid_ && ((hap_a != hap_b) || (std::abs(log_p1_[read_index]-log_p2_[read_index]) > TOLERANCE))){
-      double v1 = log_p1_[read_index]+read_LL_ptr[hap_a], v2 = log_p2_[read_index]+read_LL_ptr[hap_b];
+    if (!haploid_ && ((hap_a != hap_b) || (std::abs(read_log_p1(read_index)-read_log_p2(read_index)) > TOLERANCE))){
+      double v1 = read_log_p1(read_index)+read_LL_ptr[hap_a], v2 = read_log_p2(read_index)+read_LL_ptr[hap_b];
       if (std::abs(v1-v2) > TOLERANCE){
 	read_strand = (v1 > v2 ? 0 : 1);
 	if (read_strand == 0)
@@ -1005,35 +1687,31 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
     }
 
     // Retrace alignment and ensure that it's of sufficient quality
-    double trace_start = clock();
     int best_hap = (read_strand == 0 ? hap_a : hap_b);
     AlignmentTrace* trace = NULL;
-    std::pair<int,int> trace_key(pool_index_[read_index], best_hap);
-    auto trace_iter = trace_cache_.find(trace_key);
-    if (trace_iter == trace_cache_.end()){
-      trace  = hap_aligner.trace_optimal_aln(alns_[read_index], seed_positions_[read_index], best_hap, &base_quality_);
-      trace_cache_[trace_key] = trace;
+    if (trace_reads){
+      ScopedTimer trace_timer(timer_, PHASE_ALN_TRACEBACK);
+      trace = get_trace(hap_aligner, read_index, best_hap);
+
+      if (trace->has_stutter())
+	num_reads_with_stutter[sample_label_[read_index]]++;
+      if (trace->flank_ins_size() != 0 || trace->flank_del_size() != 0)
+	num_reads_with_flank_indels[sample_label_[read_index]]++;
+
+      if (output_viz){
+	if (viz_left_alns)
+	  (read_strand == 0 ? left_alns_strand_one : left_alns_strand_two)[sample_label_[read_index]].push_back(alns_[read_index]);
+	(read_strand == 0 ? max_LL_alns_strand_one : max_LL_alns_strand_two)[sample_label_[read_index]].push_back(trace->traced_aln());
+      }
     }
-    else
-      trace = trace_iter->second;
-
-    if (trace->has_stutter())
-      num_reads_with_stutter[sample_label_[read_index]]++;
-    if (trace->flank_ins_size() != 0 || trace->flank_del_size() != 0)
-      num_reads_with_flank_indels[sample_label_[read_index]]++;
-
-    if (viz_left_alns)
-      (read_strand == 0 ? left_alns_strand_one : left_alns_strand_two)[sample_label_[read_index]].push_back(alns_[read_index]);
-    (read_strand == 0 ? max_LL_alns_strand_one : max_LL_alns_strand_two)[sample_label_[read_index]].push_back(trace->traced_aln());
-    total_aln_trace_time_ += (clock() - trace_start)/CLOCKS_PER_SEC;
 
     // Adjust number of aligned reads per sample
     num_aligned_reads[sample_label_[read_index]]++;
 
     // Adjust number of reads with SNP information for each sample
-    if (std::abs(log_p1_[read_index] - log_p2_[read_index]) > TOLERANCE){
+    if (std::abs(read_log_p1(read_index) - read_log_p2(read_index)) > TOLERANCE){
       num_reads_with_snps[sample_label_[read_index]]++;
-      if (log_p1_[read_index] > log_p2_[read_index])
+      if (read_log_p1(read_index) > read_log_p2(read_index))
 	num_reads_strand_one[sample_label_[read_index]]++;
       else
 	num_reads_strand_two[sample_label_[read_index]]++;
@@ -1041,13 +1719,13 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
 
     // Extract the bp difference observed in read from left-alignment
     got_size = ExtractCigar(alns_[read_index].get_cigar_list(), alns_[read_index].get_start(), region.start()-region.period(), region.stop()+region.period(), bp_diff);
-    if (got_size) bps_per_sample[sample_label_[read_index]].push_back(bp_diff);
+    if (got_size) bps_per_sample[sample_label_[read_index]].add(bp_diff);
 
     // Extract the ML bp difference observed in read based on the ML genotype,
     // but only for reads that span the original repeat region by 5 bp
-    if (trace->traced_aln().get_start() < (region.start() > 4 ? region.start()-4 : 0))
+    if (trace != NULL && trace->traced_aln().get_start() < (region.start() > 4 ? region.start()-4 : 0))
       if (trace->traced_aln().get_stop() > region.stop() + 4)
-	ml_bps_per_sample[sample_label_[read_index]].push_back(allele_bp_diffs[hap_to_allele[best_hap]]+trace->total_stutter_size());
+	ml_bps_per_sample[sample_label_[read_index]].add(allele_bp_diffs[hap_to_allele[best_hap]]+trace->total_stutter_size());
 
     read_LL_ptr += num_alleles_;
   }
@@ -1091,46 +1769,21 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
   for (unsigned int i = 0; i < alleles.size(); i++)
     logger << "\t" << alleles[new_to_old[i]] << " " << allele_counts[new_to_old[i]] << std::endl;
 
-  //VCF line format = CHROM POS ID REF ALT QUAL FILTER INFO FORMAT SAMPLE_1 SAMPLE_2 ... SAMPLE_N
-  out << region.chrom() << "\t" << pos << "\t" << (region.name().empty() ? "." : region.name());
-
-  // Add reference allele and alternate alleles
-  out << "\t" << alleles[new_to_old[0]] << "\t";
-  if (alleles.size() == 1)
-    out << ".";
-  else {
-    for (int i = 1; i < alleles.size()-1; i++)
-      out << alleles[new_to_old[i]] << ",";
-    out << alleles[new_to_old.back()];
+  // Flag bp differences supported by the reads that would be candidate alleles in a joint run without the reference VCF
+  std::vector<int> novel_bp_diffs;
+  if (flag_novel_alleles_ && ref_vcf_ != NULL){
+    get_novel_bp_diffs(allele_bp_diffs, bps_per_sample, novel_bp_diffs);
+    if (!novel_bp_diffs.empty()){
+      num_novel_allele_loci_++;
+      logger << "Reads support " << novel_bp_diffs.size() << " alleles that aren't in the reference VCF" << std::endl;
+    }
   }
 
-  // Add QUAL and FILTER fields
-  out << "\t" << "." << "\t" << ".";
-
   // Obtain relevant stutter model
   assert(haplotype_->get_block(hap_block_index)->get_repeat_info() != NULL);
   StutterModel* stutter_model = haplotype_->get_block(hap_block_index)->get_repeat_info()->get_stutter_model();
 
-  // Add INFO field items
-  out << "\tINFRAME_PGEOM=" << stutter_model->get_parameter(true,  'P') << ";"
-      << "INFRAME_UP="      << stutter_model->get_parameter(true,  'U') << ";"
-      << "INFRAME_DOWN="    << stutter_model->get_parameter(true,  'D') << ";"
-      << "OUTFRAME_PGEOM="  << stutter_model->get_parameter(false, 'P') << ";"
-      << "OUTFRAME_UP="     << stutter_model->get_parameter(false, 'U') << ";"
-      << "OUTFRAME_DOWN="   << stutter_model->get_parameter(false, 'D') << ";"
-      << "START="           << region.start()+1 << ";"
-      << "END="             << region.stop()    << ";"
-      << "PERIOD="          << region.period()  << ";"
-      << "NSKIP="           << skip_count       << ";"
-      << "NFILT="           << filt_count       << ";";
-  if (alleles.size() > 1){
-    out << "BPDIFFS=" << allele_bp_diffs[new_to_old[1]];
-    for (unsigned int i = 2; i < alleles.size(); i++)
-      out << "," << allele_bp_diffs[new_to_old[i]];
-    out << ";";
-  }
-
-  // Compute INFO field values for DP, DSTUTTER and DFLANKINDEL and add them to the VCF
+  // Compute INFO field values for DP, DSTUTTER and DFLANKINDEL
   int32_t tot_dp = 0, tot_dsnp = 0, tot_dstutter = 0, tot_dflankindel = 0;
   for (unsigned int i = 0; i < sample_names.size(); i++){
     auto sample_iter = sample_indices_.find(sample_names[i]);
@@ -1148,53 +1801,25 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
     tot_dstutter    += num_reads_with_stutter[sample_index];
     tot_dflankindel += num_reads_with_flank_indels[sample_index];
   }
-  out << "DP="          << tot_dp          << ";"
-      << "DSNP="        << tot_dsnp        << ";"
-      << "DSTUTTER="    << tot_dstutter    << ";"
-      << "DFLANKINDEL=" << tot_dflankindel << ";";
-
-  // Add allele counts
-  out << "AN=" << allele_number << ";" << "REFAC=" << allele_counts[0];
-  if (allele_counts.size() > 1){
-    out << ";AC=";
-    for (unsigned int i = 1; i < allele_counts.size()-1; i++)
-      out << allele_counts[new_to_old[i]] << ",";
-    out << allele_counts[new_to_old.back()];
-  }
-
-  // If we used all reads during genotyping and performed assembly, we'll output the allele bias
-  bool output_allele_bias = (!haploid_ && reassemble_flanks_);
-
-  // Add FORMAT field
-  out << (!haploid_ ? "\tGT:GB:Q:PQ:DP:DSNP:DSTUTTER:DFLANKINDEL:PDP:PSNP:GLDIFF" : "\tGT:GB:Q:DP:DSTUTTER:DFLANKINDEL:GLDIFF");
-  if (output_allele_bias)         out << ":AB:DAB";
-  if (output_allreads)            out << ":ALLREADS";
-  if (output_mallreads)           out << ":MALLREADS";
-  if (output_gls)                 out << ":GL";
-  if (output_pls)                 out << ":PL";
-  if (!haploid_ && output_phased_gls) out << ":PHASEDGL";
 
+  // Determine the index of each output sample whose genotype is reported, or -1 if it isn't reported
+  std::vector<int> output_indices(sample_names.size(), -1);
   std::map<std::string, std::string> sample_results;
   std::map<std::string, int> filter_reasons;
   for (unsigned int i = 0; i < sample_names.size(); i++){
-    out << "\t";
     auto sample_iter = sample_indices_.find(sample_names[i]);
-    if (sample_iter == sample_indices_.end()){
-      out << ".";
+    if (sample_iter == sample_indices_.end())
       continue;
-    }
-    
+
     // Don't report information for a sample if none of its reads were successfully realigned
     if (num_aligned_reads[sample_iter->second] == 0){
       filter_reasons["NO_READS"]++;
-      out << ".";
       continue;
     }
 
     // Don't report information for a sample if flag has been set to false
     if (!call_sample_[sample_iter->second].empty()){
       filter_reasons[call_sample_[sample_iter->second]]++;
-      out << ".";
       continue;
     }
 
@@ -1203,122 +1828,418 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
 	(num_reads_with_flank_indels[sample_iter->second] > num_aligned_reads[sample_iter->second]*max_flank_indel_frac)){
       call_sample_[sample_iter->second] = "FLANK_INDEL_FRAC";
       filter_reasons["FLANK_INDEL_FRAC"]++;
-      out << ".";
       continue;
     }
-    
-    int sample_index    = sample_iter->second;
-    double phase1_reads = (num_aligned_reads[sample_index] == 0 ? 0 : exp(log_sum_exp(log_read_phases[sample_index])));
-    double phase2_reads = num_aligned_reads[sample_index] - phase1_reads;
 
+    int sample_index  = sample_iter->second;
+    output_indices[i] = sample_index;
     std::stringstream samp_info;
     samp_info << allele_bp_diffs[gts[sample_index].first] << "|" << allele_bp_diffs[gts[sample_index].second];
     sample_results[sample_names[i]] = samp_info.str();
+  }
+
+  // Encode the same genotypes in the columnar output, ordering the alleles as in the VCF
+  if (columns_out_ != NULL){
+    LocusColumns columns;
+    columns.chrom  = region.chrom();
+    columns.name   = region.name();
+    columns.pos    = pos;
+    columns.start  = region.start()+1;
+    columns.end    = region.stop();
+    columns.period = region.period();
+    for (unsigned int i = 0; i < alleles.size(); i++){
+      columns.alleles.push_back(alleles[new_to_old[i]]);
+      columns.bp_diffs.push_back(allele_bp_diffs[new_to_old[i]]);
+    }
+    for (unsigned int i = 0; i < sample_names.size(); i++){
+      int sample_index = output_indices[i];
+      if (sample_index == -1){
+	columns.gt_a.push_back(-1);
+	columns.gt_b.push_back(-1);
+	columns.dosage.push_back(NAN);
+	columns.q.push_back(NAN);
+	columns.dp.push_back(-1);
+	continue;
+      }
+      const std::pair<int,int>& gt = gts[sample_index];
+      columns.gt_a.push_back(old_to_new[gt.first]);
+      columns.gt_b.push_back(haploid_ ? -1 : old_to_new[gt.second]);
+      columns.dosage.push_back(allele_bp_diffs[gt.first] + (haploid_ ? 0 : allele_bp_diffs[gt.second]));
+      columns.q.push_back(exp(log_unphased_posteriors[sample_index]));
+      columns.dp.push_back(num_aligned_reads[sample_index]);
+    }
+    columns.write(*columns_out_);
+  }
 
-    double allele_bias = 1;
-    if (!haploid_ && (gts[sample_index].first != gts[sample_index].second))
-      allele_bias = compute_allele_bias(unique_reads_hap_one[sample_index], unique_reads_hap_two[sample_index]);
+  // If we used all reads during genotyping and performed assembly, we'll output the allele bias
+  bool output_allele_bias = (!haploid_ && reassemble_flanks_);
+
+  // The samples' FORMAT values are computed in blocks, which are distributed among any idle threads
+  const int SAMPLE_BLOCK_SIZE = 256;
+  int num_out    = sample_names.size();
+  int num_blocks = std::max(1, (num_out + SAMPLE_BLOCK_SIZE - 1)/SAMPLE_BLOCK_SIZE);
+
+  if (bcf_header != NULL){
+    bcf1_t* record = bcf_init();
+    record->rid    = bcf_hdr_name2id(bcf_header, region.chrom().c_str());
+    record->pos    = pos-1;
+    if (record->rid < 0)
+      printErrorAndDie("Chromosome " + region.chrom() + " is not among the contigs in the BCF header");
+    bcf_float_set_missing(record->qual);
+    bcf_update_id(bcf_header, record, region.name().empty() ? "." : region.name().c_str());
+    std::vector<const char*> allele_seqs;
+    for (unsigned int i = 0; i < alleles.size(); i++)
+      allele_seqs.push_back(alleles[new_to_old[i]].c_str());
+    bcf_update_alleles(bcf_header, record, allele_seqs.data(), allele_seqs.size());
+
+    // Add INFO field items
+    float stutter_params[6] = {round_vcf_float(stutter_model->get_parameter(true,  'P')), round_vcf_float(stutter_model->get_parameter(true,  'U')),
+			       round_vcf_float(stutter_model->get_parameter(true,  'D')), round_vcf_float(stutter_model->get_parameter(false, 'P')),
+			       round_vcf_float(stutter_model->get_parameter(false, 'U')), round_vcf_float(stutter_model->get_parameter(false, 'D'))};
+    const char* stutter_keys[6] = {"INFRAME_PGEOM", "INFRAME_UP", "INFRAME_DOWN", "OUTFRAME_PGEOM", "OUTFRAME_UP", "OUTFRAME_DOWN"};
+    for (int i = 0; i < 6; i++)
+      bcf_update_info_float(bcf_header, record, stutter_keys[i], &stutter_params[i], 1);
+    int32_t locus_info[5] = {(int32_t)region.start()+1, (int32_t)region.stop(), (int32_t)region.period(), skip_count, filt_count};
+    const char* locus_keys[5] = {"START", "END", "PERIOD", "NSKIP", "NFILT"};
+    for (int i = 0; i < 5; i++)
+      bcf_update_info_int32(bcf_header, record, locus_keys[i], &locus_info[i], 1);
+    std::vector<int32_t> alt_bp_diffs, alt_counts;
+    for (unsigned int i = 1; i < alleles.size(); i++){
+      alt_bp_diffs.push_back(allele_bp_diffs[new_to_old[i]]);
+      alt_counts.push_back(allele_counts[new_to_old[i]]);
+    }
+    if (alleles.size() > 1)
+      bcf_update_info_int32(bcf_header, record, "BPDIFFS", alt_bp_diffs.data(), alt_bp_diffs.size());
+    int32_t read_info[6] = {tot_dp, tot_dsnp, tot_dstutter, tot_dflankindel, allele_number, allele_counts[0]};
+    const char* read_keys[6] = {"DP", "DSNP", "DSTUTTER", "DFLANKINDEL", "AN", "REFAC"};
+    for (int i = 0; i < 6; i++)
+      if (trace_reads || (i != 2 && i != 3))
+	bcf_update_info_int32(bcf_header, record, read_keys[i], &read_info[i], 1);
+    if (alleles.size() > 1)
+      bcf_update_info_int32(bcf_header, record, "AC", alt_counts.data(), alt_counts.size());
+    if (!novel_bp_diffs.empty())
+      bcf_update_info_int32(bcf_header, record, "NOVELBPDIFFS", novel_bp_diffs.data(), novel_bp_diffs.size());
+
+    // Assemble each FORMAT field's values across all samples, in which samples without a reported genotype have missing values
+    int ploidy  = (haploid_ ? 1 : 2);
+    int num_gls = (haploid_ ? alleles.size() : alleles.size()*(alleles.size()+1)/2), num_phased_gls = alleles.size()*alleles.size();
+    float missing_float;
+    bcf_float_set_missing(missing_float);
+    std::vector<int32_t> gt_vals(num_out*ploidy, bcf_int32_vector_end), dp_vals(num_out, bcf_int32_missing), dsnp_vals(num_out, bcf_int32_missing);
+    std::vector<int32_t> dstutter_vals(num_out, bcf_int32_missing), dflankindel_vals(num_out, bcf_int32_missing), dab_vals(num_out, bcf_int32_missing);
+    std::vector<int32_t> pl_vals(num_out*num_gls, bcf_int32_vector_end);
+    std::vector<float> q_vals(num_out, missing_float), pq_vals(num_out, missing_float), gldiff_vals(num_out, missing_float), ab_vals(num_out, missing_float);
+    std::vector<float> gl_vals(num_out*num_gls, bcf_float_vector_end), phased_gl_vals(num_out*num_phased_gls, bcf_float_vector_end);
+    std::vector<std::string> gb_vals(num_out, "."), pdp_vals(num_out, "."), psnp_vals(num_out, ".");
+    std::vector<std::string> allreads_vals(num_out, "."), mallreads_vals(num_out, ".");
+    run_chunks(num_blocks, [&](int block){
+	for (int i = block*SAMPLE_BLOCK_SIZE; i < std::min(num_out, (block+1)*SAMPLE_BLOCK_SIZE); i++){
+	  int sample_index = output_indices[i];
+	  if (sample_index == -1){
+	    gt_vals[i*ploidy] = bcf_gt_missing;
+	    bcf_float_set_missing(gl_vals[i*num_gls]);
+	    pl_vals[i*num_gls] = bcf_int32_missing;
+	    bcf_float_set_missing(phased_gl_vals[i*num_phased_gls]);
+	    continue;
+	  }
+
+	  gt_vals[i*ploidy]   = bcf_gt_unphased(old_to_new[gts[sample_index].first]);
+	  gb_vals[i]          = std::to_string(allele_bp_diffs[gts[sample_index].first]);
+	  q_vals[i]           = round_vcf_float(exp(log_unphased_posteriors[sample_index]));
+	  dp_vals[i]          = num_aligned_reads[sample_index];
+	  if (trace_reads){
+	    dstutter_vals[i]    = num_reads_with_stutter[sample_index];
+	    dflankindel_vals[i] = num_reads_with_flank_indels[sample_index];
+	  }
+	  if (alleles.size() > 1)
+	    gldiff_vals[i] = round_vcf_float(gl_diffs[sample_index]);
+	  if (!haploid_){
+	    double phase1_reads = (num_aligned_reads[sample_index] == 0 ? 0 : exp(log_sum_exp(log_read_phases[sample_index])));
+	    double phase2_reads = num_aligned_reads[sample_index] - phase1_reads;
+	    char phased_reads[64];
+	    snprintf(phased_reads, sizeof(phased_reads), "%.2f|%.2f", phase1_reads, phase2_reads);
+	    gt_vals[i*ploidy+1] = bcf_gt_phased(old_to_new[gts[sample_index].second]);
+	    gb_vals[i]         += "|" + std::to_string(allele_bp_diffs[gts[sample_index].second]);
+	    pq_vals[i]          = round_vcf_float(exp(log_phased_posteriors[sample_index]));
+	    dsnp_vals[i]        = num_reads_with_snps[sample_index];
+	    pdp_vals[i]         = phased_reads;
+	    psnp_vals[i]        = std::to_string(num_reads_strand_one[sample_index]) + "|" + std::to_string(num_reads_strand_two[sample_index]);
+	  }
+
+	  // Output the log-10 value of the allele bias p-value
+	  if (output_allele_bias && (gts[sample_index].first != gts[sample_index].second)){
+	    double allele_bias = compute_allele_bias(unique_reads_hap_one[sample_index], unique_reads_hap_two[sample_index]);
+	    if (std::abs(allele_bias-1) >= TOLERANCE){
+	      ab_vals[i]  = round_vcf_float(allele_bias);
+	      dab_vals[i] = unique_reads_hap_one[sample_index] + unique_reads_hap_two[sample_index];
+	    }
+	  }
+	  if (output_allreads)
+	    allreads_vals[i]  = condense_read_counts(bps_per_sample[sample_index]);
+	  if (output_mallreads)
+	    mallreads_vals[i] = condense_read_counts(ml_bps_per_sample[sample_index]);
+
+	  // Genotype and phred-scaled likelihoods, taking into account new allele ordering
+	  for (int j = 0, gl_index = 0; j < new_to_old.size(); j++){
+	    for (int k = 0; k <= (haploid_ ? 0 : j); k++, gl_index++){
+	      int index = new_to_old[j];
+	      if (!haploid_){
+		int index_a = std::min(new_to_old[j], new_to_old[k]);
+		int index_b = std::max(new_to_old[j], new_to_old[k]);
+		index       = index_b*(index_b+1)/2 + index_a;
+	      }
+	      if (output_gls)
+		gl_vals[i*num_gls + gl_index] = round_vcf_float(gls[sample_index][index]);
+	      if (output_pls)
+		pl_vals[i*num_gls + gl_index] = pls[sample_index][index];
+	    }
+	  }
+	  if (!haploid_ && output_phased_gls)
+	    for (int j = 0; j < new_to_old.size(); j++)
+	      for (int k = 0; k < new_to_old.size(); k++)
+		phased_gl_vals[i*num_phased_gls + j*new_to_old.size() + k] = round_vcf_float(phased_gls[sample_index][new_to_old[j]*new_to_old.size() + new_to_old[k]]);
+	}
+      });
 
+    // Add the FORMAT fields in the same order as the VCF
+    bcf_update_genotypes(bcf_header, record, gt_vals.data(), gt_vals.size());
+    update_format_strings(bcf_header, record, "GB", gb_vals);
+    bcf_update_format_float(bcf_header, record, "Q", q_vals.data(), num_out);
     if (!haploid_){
-      out << old_to_new[gts[sample_index].first] << "|" << old_to_new[gts[sample_index].second]     // Genotype
-	  << ":" << allele_bp_diffs[gts[sample_index].first]
-	  << "|" << allele_bp_diffs[gts[sample_index].second]                                       // Base pair differences from reference
-	  << ":" << exp(log_unphased_posteriors[sample_index])                                      // Unphased posterior
-	  << ":" << exp(log_phased_posteriors[sample_index])                                        // Phased posterior
-	  << ":" << num_aligned_reads[sample_index]                                                 // Total reads used to genotype (after filtering)
-	  << ":" << num_reads_with_snps[sample_index]                                               // Total reads with SNP information
-	  << ":" << num_reads_with_stutter[sample_index]                                            // Total reads with a non-zero stutter artifact in ML alignment
-	  << ":" << num_reads_with_flank_indels[sample_index]                                       // Total reads with an indel in flank in ML alignment
-	  << ":" << phase1_reads << "|" << phase2_reads                                             // Reads per allele
-	  << ":" << num_reads_strand_one[sample_index] << "|" << num_reads_strand_two[sample_index]; // Reads with SNPs supporting each haploid genotype
-
-      // Difference in GL between the current and next best genotype
-      if (alleles.size() == 1)
-        out << ":" << ".";
-      else
-        out << ":" << gl_diffs[sample_index];
+      bcf_update_format_float(bcf_header, record, "PQ",   pq_vals.data(),   num_out);
+      bcf_update_format_int32(bcf_header, record, "DP",   dp_vals.data(),   num_out);
+      bcf_update_format_int32(bcf_header, record, "DSNP", dsnp_vals.data(), num_out);
     }
-    else {
-      out << old_to_new[gts[sample_index].first]                                                    // Genotype
-	  << ":" << allele_bp_diffs[gts[sample_index].first]                                        // Base pair differences from reference
-	  << ":" << exp(log_unphased_posteriors[sample_index])                                      // Unphased posterior
-	  << ":" << num_aligned_reads[sample_index]                                                 // Total reads used to genotype (after filtering)
-	  << ":" << num_reads_with_stutter[sample_index]                                            // Total reads with a non-zero stutter artifact in ML alignment
-	  << ":" << num_reads_with_flank_indels[sample_index];                                      // Total reads with an indel in flank in ML alignment
-
-      // Difference in GL between the current and next best genotype
-      if (alleles.size() == 1)
-	out << ":" << ".";
-      else
-	out << ":" << gl_diffs[sample_index];
+    else
+      bcf_update_format_int32(bcf_header, record, "DP", dp_vals.data(), num_out);
+    bcf_update_format_int32(bcf_header, record, "DSTUTTER",    dstutter_vals.data(),    num_out);
+    bcf_update_format_int32(bcf_header, record, "DFLANKINDEL", dflankindel_vals.data(), num_out);
+    if (!haploid_){
+      update_format_strings(bcf_header, record, "PDP",  pdp_vals);
+      update_format_strings(bcf_header, record, "PSNP", psnp_vals);
     }
-
-    // Output the log-10 value of the allele bias p-value
+    bcf_update_format_float(bcf_header, record, "GLDIFF", gldiff_vals.data(), num_out);
     if (output_allele_bias){
-      if (std::abs(allele_bias-1) < TOLERANCE)
-	out << ":.:.";
-      else
-	out << ":" << allele_bias << ":" << (unique_reads_hap_one[sample_index] + unique_reads_hap_two[sample_index]);
+      bcf_update_format_float(bcf_header, record, "AB",  ab_vals.data(),  num_out);
+      bcf_update_format_int32(bcf_header, record, "DAB", dab_vals.data(), num_out);
     }
+    if (output_allreads)  update_format_strings(bcf_header, record, "ALLREADS",  allreads_vals);
+    if (output_mallreads) update_format_strings(bcf_header, record, "MALLREADS", mallreads_vals);
+    if (output_gls)       bcf_update_format_float(bcf_header, record, "GL", gl_vals.data(), gl_vals.size());
+    if (output_pls)       bcf_update_format_int32(bcf_header, record, "PL", pl_vals.data(), pl_vals.size());
+    if (!haploid_ && output_phased_gls)
+      bcf_update_format_float(bcf_header, record, "PHASEDGL", phased_gl_vals.data(), phased_gl_vals.size());
+    write_bcf_record(bcf_header, record, out);
+    bcf_destroy(record);
+  }
+  else {
+    // Format the line in a buffer sized for the samples' fields and write it to the stream in a single call
+    LineFormatter line(1024 + 128*sample_names.size());
 
-    // Add bp diffs from regular left-alignment
-    if (output_allreads)
-	out << ":" << condense_read_counts(bps_per_sample[sample_index]);
+    //VCF line format = CHROM POS ID REF ALT QUAL FILTER INFO FORMAT SAMPLE_1 SAMPLE_2 ... SAMPLE_N
+    line << region.chrom() << "\t" << pos << "\t" << (region.name().empty() ? "." : region.name());
 
-    // Maximum likelihood base pair differences in each read from alignment probabilites
-    if (output_mallreads)
-	out << ":" << condense_read_counts(ml_bps_per_sample[sample_index]);
+    // Add reference allele and alternate alleles
+    line << "\t" << alleles[new_to_old[0]] << "\t";
+    if (alleles.size() == 1)
+      line << ".";
+    else {
+      for (int i = 1; i < alleles.size()-1; i++)
+	line << alleles[new_to_old[i]] << ",";
+      line << alleles[new_to_old.back()];
+    }
 
-    // Genotype and phred-scaled likelihoods, taking into account new allele ordering
-    if (haploid_){
-      if (output_gls){
-	out << ":" << gls[sample_index][0];
-	for (int i = 1; i < new_to_old.size(); i++)
-	  out << "," << gls[sample_index][new_to_old[i]];
-      }
+    // Add QUAL and FILTER fields
+    line << "\t" << "." << "\t" << ".";
+
+    // Add INFO field items
+    line << "\tINFRAME_PGEOM=" << stutter_model->get_parameter(true,  'P') << ";"
+	<< "INFRAME_UP="      << stutter_model->get_parameter(true,  'U') << ";"
+	<< "INFRAME_DOWN="    << stutter_model->get_parameter(true,  'D') << ";"
+	<< "OUTFRAME_PGEOM="  << stutter_model->get_parameter(false, 'P') << ";"
+	<< "OUTFRAME_UP="     << stutter_model->get_parameter(false, 'U') << ";"
+	<< "OUTFRAME_DOWN="   << stutter_model->get_parameter(false, 'D') << ";"
+	<< "START="           << region.start()+1 << ";"
+	<< "END="             << region.stop()    << ";"
+	<< "PERIOD="          << region.period()  << ";"
+	<< "NSKIP="           << skip_count       << ";"
+	<< "NFILT="           << filt_count       << ";";
+    if (alleles.size() > 1){
+      line << "BPDIFFS=" << allele_bp_diffs[new_to_old[1]];
+      for (unsigned int i = 2; i < alleles.size(); i++)
+	line << "," << allele_bp_diffs[new_to_old[i]];
+      line << ";";
+    }
 
-      if (output_pls){
-	out << ":" << pls[sample_index][0];
-	for (int i = 1; i < new_to_old.size(); i++)
-	  out << "," << pls[sample_index][new_to_old[i]];
-      }
+    // Add INFO field values for DP, DSTUTTER and DFLANKINDEL
+    line << "DP="          << tot_dp          << ";"
+	<< "DSNP="        << tot_dsnp        << ";";
+    if (trace_reads)
+      line << "DSTUTTER="    << tot_dstutter    << ";"
+	  << "DFLANKINDEL=" << tot_dflankindel << ";";
+
+    // Add allele counts
+    line << "AN=" << allele_number << ";" << "REFAC=" << allele_counts[0];
+    if (allele_counts.size() > 1){
+      line << ";AC=";
+      for (unsigned int i = 1; i < allele_counts.size()-1; i++)
+	line << allele_counts[new_to_old[i]] << ",";
+      line << allele_counts[new_to_old.back()];
     }
-    else {
-      if (output_gls){
-	out << ":" << gls[sample_index][0];
-	for (int i = 1; i < new_to_old.size(); i++){
-	  for (int j = 0; j <= i; j++){
-	    int index_a = std::min(new_to_old[i], new_to_old[j]);
-	    int index_b = std::max(new_to_old[i], new_to_old[j]);
-	    out << "," << gls[sample_index][index_b*(index_b+1)/2 + index_a];
-	  }
+    if (!novel_bp_diffs.empty()){
+      line << ";NOVELBPDIFFS=" << novel_bp_diffs[0];
+      for (unsigned int i = 1; i < novel_bp_diffs.size(); i++)
+	line << "," << novel_bp_diffs[i];
+    }
+
+    // Add FORMAT field
+    line << (!haploid_ ? "\tGT:GB:Q:PQ:DP:DSNP:DSTUTTER:DFLANKINDEL:PDP:PSNP:GLDIFF" : "\tGT:GB:Q:DP:DSTUTTER:DFLANKINDEL:GLDIFF");
+    if (output_allele_bias)         line << ":AB:DAB";
+    if (output_allreads)            line << ":ALLREADS";
+    if (output_mallreads)           line << ":MALLREADS";
+    if (output_gls)                 line << ":GL";
+    if (output_pls)                 line << ":PL";
+    if (!haploid_ && output_phased_gls) line << ":PHASEDGL";
+
+    // Each sample's columns only depend on its own values, so for wide cohorts blocks of samples are formatted into
+    // separate buffers on any idle threads and then concatenated in order
+    auto format_sample_block = [&](int block, LineFormatter& line){
+      for (int i = block*SAMPLE_BLOCK_SIZE; i < std::min(num_out, (block+1)*SAMPLE_BLOCK_SIZE); i++){
+	line << "\t";
+	int sample_index = output_indices[i];
+	if (sample_index == -1){
+	  line << ".";
+	  continue;
 	}
-      }
 
-      if (output_pls){
-	out << ":" << pls[sample_index][0];
-	for (int i = 1; i < new_to_old.size(); i++){
-	  for (int j = 0; j <= i; j++){
-	    int index_a = std::min(new_to_old[i], new_to_old[j]);
-	    int index_b = std::max(new_to_old[i], new_to_old[j]);
-	    out << "," << pls[sample_index][index_b*(index_b+1)/2 + index_a];
+	double phase1_reads = (num_aligned_reads[sample_index] == 0 ? 0 : exp(log_sum_exp(log_read_phases[sample_index])));
+	double phase2_reads = num_aligned_reads[sample_index] - phase1_reads;
+
+	double allele_bias = 1;
+	if (!haploid_ && (gts[sample_index].first != gts[sample_index].second))
+	  allele_bias = compute_allele_bias(unique_reads_hap_one[sample_index], unique_reads_hap_two[sample_index]);
+
+	if (!haploid_){
+	  line << old_to_new[gts[sample_index].first] << "|" << old_to_new[gts[sample_index].second]     // Genotype
+	      << ":" << allele_bp_diffs[gts[sample_index].first]
+	      << "|" << allele_bp_diffs[gts[sample_index].second]                                       // Base pair differences from reference
+	      << ":" << exp(log_unphased_posteriors[sample_index])                                      // Unphased posterior
+	      << ":" << exp(log_phased_posteriors[sample_index])                                        // Phased posterior
+	      << ":" << num_aligned_reads[sample_index]                                                 // Total reads used to genotype (after filtering)
+	      << ":" << num_reads_with_snps[sample_index];                                              // Total reads with SNP information
+	  if (trace_reads)
+	    line << ":" << num_reads_with_stutter[sample_index]                                         // Total reads with a non-zero stutter artifact in ML alignment
+		<< ":" << num_reads_with_flank_indels[sample_index];                                    // Total reads with an indel in flank in ML alignment
+	  else
+	    line << ":.:.";
+	  line << ":" << phase1_reads << "|" << phase2_reads                                            // Reads per allele
+	      << ":" << num_reads_strand_one[sample_index] << "|" << num_reads_strand_two[sample_index]; // Reads with SNPs supporting each haploid genotype
+
+	  // Difference in GL between the current and next best genotype
+	  if (alleles.size() == 1)
+	    line << ":" << ".";
+	  else
+	    line << ":" << gl_diffs[sample_index];
+	}
+	else {
+	  line << old_to_new[gts[sample_index].first]                                                    // Genotype
+	      << ":" << allele_bp_diffs[gts[sample_index].first]                                        // Base pair differences from reference
+	      << ":" << exp(log_unphased_posteriors[sample_index])                                      // Unphased posterior
+	      << ":" << num_aligned_reads[sample_index];                                                // Total reads used to genotype (after filtering)
+	  if (trace_reads)
+	    line << ":" << num_reads_with_stutter[sample_index]                                         // Total reads with a non-zero stutter artifact in ML alignment
+		<< ":" << num_reads_with_flank_indels[sample_index];                                    // Total reads with an indel in flank in ML alignment
+	  else
+	    line << ":.:.";
+
+	  // Difference in GL between the current and next best genotype
+	  if (alleles.size() == 1)
+	    line << ":" << ".";
+	  else
+	    line << ":" << gl_diffs[sample_index];
+	}
+
+	// Output the log-10 value of the allele bias p-value
+	if (output_allele_bias){
+	  if (std::abs(allele_bias-1) < TOLERANCE)
+	    line << ":.:.";
+	  else
+	    line << ":" << allele_bias << ":" << (unique_reads_hap_one[sample_index] + unique_reads_hap_two[sample_index]);
+	}
+
+	// Add bp diffs from regular left-alignment
+	if (output_allreads){
+	  line << ":";
+	  line.append_read_counts(bps_per_sample[sample_index]);
+	}
+
+	// Maximum likelihood base pair differences in each read from alignment probabilites
+	if (output_mallreads){
+	  line << ":";
+	  line.append_read_counts(ml_bps_per_sample[sample_index]);
+	}
+
+	// Genotype and phred-scaled likelihoods, taking into account new allele ordering
+	if (haploid_){
+	  if (output_gls){
+	    line << ":" << gls[sample_index][0];
+	    for (int i = 1; i < new_to_old.size(); i++)
+	      line << "," << gls[sample_index][new_to_old[i]];
+	  }
+
+	  if (output_pls){
+	    line << ":" << pls[sample_index][0];
+	    for (int i = 1; i < new_to_old.size(); i++)
+	      line << "," << pls[sample_index][new_to_old[i]];
 	  }
 	}
-      }
+	else {
+	  if (output_gls){
+	    line << ":" << gls[sample_index][0];
+	    for (int i = 1; i < new_to_old.size(); i++){
+	      for (int j = 0; j <= i; j++){
+		int index_a = std::min(new_to_old[i], new_to_old[j]);
+		int index_b = std::max(new_to_old[i], new_to_old[j]);
+		line << "," << gls[sample_index][index_b*(index_b+1)/2 + index_a];
+	      }
+	    }
+	  }
+
+	  if (output_pls){
+	    line << ":" << pls[sample_index][0];
+	    for (int i = 1; i < new_to_old.size(); i++){
+	      for (int j = 0; j <= i; j++){
+		int index_a = std::min(new_to_old[i], new_to_old[j]);
+		int index_b = std::max(new_to_old[i], new_to_old[j]);
+		line << "," << pls[sample_index][index_b*(index_b+1)/2 + index_a];
+	      }
+	    }
+	  }
 
-      if (output_phased_gls){
-	out << ":" << phased_gls[sample_index][0];
-	for (int i = 0; i < new_to_old.size(); i++){
-	  for (int j = 0; j < new_to_old.size(); j++){
-	    if (i == 0 && j == 0)
-	      continue;
-	    out << "," << phased_gls[sample_index][new_to_old[i]*new_to_old.size() + new_to_old[j]];
+	  if (output_phased_gls){
+	    line << ":" << phased_gls[sample_index][0];
+	    for (int i = 0; i < new_to_old.size(); i++){
+	      for (int j = 0; j < new_to_old.size(); j++){
+		if (i == 0 && j == 0)
+		  continue;
+		line << "," << phased_gls[sample_index][new_to_old[i]*new_to_old.size() + new_to_old[j]];
+	      }
+	    }
 	  }
 	}
       }
+    };
+    if (num_blocks == 1)
+      format_sample_block(0, line);
+    else {
+      std::vector<LineFormatter> block_lines(num_blocks, LineFormatter(128*SAMPLE_BLOCK_SIZE));
+      run_chunks(num_blocks, [&](int block){ format_sample_block(block, block_lines[block]); });
+      for (int block = 0; block < num_blocks; block++)
+	line.append(block_lines[block].data(), block_lines[block].size());
     }
+    line << "\n";
+    out.write(line.data(), line.size());
   }
-  out << "\n";
 
   if (!filter_reasons.empty()){
     int32_t filt_count = 0;
@@ -1352,8 +2273,9 @@ void SeqStutterGenotyper::write_vcf_record(std::vector<std::string>& sample_name
   }
 }
 
-bool SeqStutterGenotyper::recompute_stutter_models(std::string& chrom_seq, std::ostream& logger,
+bool SeqStutterGenotyper::recompute_stutter_models(const ReferenceSequence& chrom_seq, std::ostream& logger,
 						  int max_em_iter, double abs_ll_converge, double frac_ll_converge){
+  TraceScope trace("recompute_stutter_models");
   logger << "Retraining EM stutter genotyper using maximum likelihood alignments" << std::endl;
   std::vector<AlignmentTrace*> traced_alns;
   retrace_alignments(traced_alns);
@@ -1362,6 +2284,7 @@ bool SeqStutterGenotyper::recompute_stutter_models(std::string& chrom_seq, std::
     HapBlock* block = haplotype_->get_block(block_index);
     if (block->get_repeat_info() == NULL)
       continue;
+    checkLocusDeadline();
 
     std::vector< std::vector<int> > str_num_bps(num_samples_);
     std::vector< std::vector<double> > str_log_p1s(num_samples_), str_log_p2s(num_samples_);
@@ -1371,8 +2294,8 @@ bool SeqStutterGenotyper::recompute_stutter_models(std::string& chrom_seq, std::
 	if (trace->traced_aln().get_start() < block->start()){
 	  if (trace->traced_aln().get_stop() > block->end()){
 	    str_num_bps[sample_label_[read_index]].push_back(((int)trace->str_seq(block_index).size())+trace->stutter_size(block_index));
-	    str_log_p1s[sample_label_[read_index]].push_back(log_p1_[read_index]);
-	    str_log_p2s[sample_label_[read_index]].push_back(log_p2_[read_index]);
+	    str_log_p1s[sample_label_[read_index]].push_back(read_log_p1(read_index));
+	    str_log_p2s[sample_label_[read_index]].push_back(read_log_p2(read_index));
 	  }
 	}
       }
@@ -1380,6 +2303,7 @@ bool SeqStutterGenotyper::recompute_stutter_models(std::string& chrom_seq, std::
 
     int period = block->get_repeat_info()->get_period();
     EMStutterGenotyper length_genotyper(haploid_, period, str_num_bps, str_log_p1s, str_log_p2s, sample_names_, 0);
+    length_genotyper.set_task_queue(task_queue_);
     bool trained = length_genotyper.train(max_em_iter, abs_ll_converge, frac_ll_converge, false, logger);
     if (!trained){
       logger << "Retraining stutter model training failed" << std::endl;
@@ -1387,8 +2311,16 @@ bool SeqStutterGenotyper::recompute_stutter_models(std::string& chrom_seq, std::
     }
 
     logger << "Learned stutter model for block #" << block_index << ":" << (*length_genotyper.get_stutter_model()) << std::endl;
-    block->get_repeat_info()->set_stutter_model(length_genotyper.get_stutter_model());
+    haplotype_->set_stutter_model(block_index, length_genotyper.get_stutter_model());
   }
-  trace_cache_.clear();
-  return genotype(chrom_seq, logger);
+  clear_trace_cache();
+  num_stutter_rounds_++;
+
+  // Only the stutter block terms of the alignments depend on the stutter models, so the existing read pools and candidate
+  // haplotypes are reused and the pooled reads are simply realigned to each haplotype using the retrained models
+  logger << "Realigning reads to each candidate haplotype using the retrained stutter models" << std::endl;
+  std::vector<bool> realign_to_haplotype(num_alleles_, true);
+  calc_hap_aln_probs(realign_to_haplotype);
+  calc_log_sample_posteriors();
+  return true;
 }
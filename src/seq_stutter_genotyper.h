@@ -12,21 +12,29 @@
 #include "bam_io.h"
 #include "base_quality.h"
 #include "genotyper.h"
+#include "locus_arena.h"
 #include "read_pooler.h"
+#include "ref_allele_index.h"
+#include "reference_sequence.h"
 #include "region.h"
 #include "stutter_model.h"
+#include "task_queue.h"
 #include "vcf_input.h"
 #include "vcf_reader.h"
 
+#include "SeqAlignment/AlignmentBackend.h"
 #include "SeqAlignment/AlignmentData.h"
 #include "SeqAlignment/AlignmentTraceback.h"
 #include "SeqAlignment/Haplotype.h"
 #include "SeqAlignment/HapBlock.h"
 
+class HapAligner;
+
 class SeqStutterGenotyper : public Genotyper {
  private:
   int MAX_REF_FLANK_LEN;
   int MAX_FLANK_HAPLOTYPES;
+  int MAX_STUTTER_CANDIDATES; // Maximum number of candidate alleles identified from stutter artifacts in each block and round
   BaseQuality base_quality_;
   ReadPooler pooler_;
   int* pool_index_;                               // Pool index for each read
@@ -44,36 +52,135 @@ class SeqStutterGenotyper : public Genotyper {
   // -1 denotes that no seed position was determined for the read
   int* seed_positions_;
 
+  // Seed base of each pooled read, which is reused across realignment rounds as it only depends on the haplotype's flank
+  // boundaries and repeat blocks. The pools in KNOWN_POOL_SEEDS_ have seeds for the boundaries in SEED_BOUNDARIES_
+  int* pool_seed_positions_;
+  std::vector<bool> known_pool_seeds_;
+  std::vector<int32_t> seed_boundaries_;
+
+  // LLs of the pooled reads for each haplotype, which is reused across realignment rounds and only grows
+  double* pool_log_aln_probs_;
+  int64_t pool_aln_capacity_;
+
   // VCF containing STR and SNP genotypes for a reference panel
   VCF::VCFReader* ref_vcf_;
+  const RefAlleleIndex* ref_allele_index_; // If not NULL, the reference VCF's alleles are read from this index instead
+
+  // Log frequency of each allele sequence in the reference VCF for each region, estimated from its allele counts with
+  // a pseudocount of 1. Empty for regions whose counts are unavailable. If USE_REF_ALLELE_PRIORS_, they determine the genotype priors
+  std::vector< std::map<std::string, double> > ref_allele_log_freqs_;
+  bool use_ref_allele_priors_;
+
+  // If true, flag alleles that are strongly supported by a sample's reads but aren't among the reference VCF's alleles
+  bool flag_novel_alleles_;
+  int num_novel_allele_loci_;
+
+  // Compute the log prior of each haplotype from the allele frequencies of its repeat blocks
+  void calc_log_hap_priors(std::vector<double>& log_hap_priors);
+
+  void init_log_sample_priors(double* log_sample_ptr);
+
+  // Identify the bp differences that are strongly supported by at least one sample's reads but don't match any of the alleles
+  void get_novel_bp_diffs(const std::vector<int>& allele_bp_diffs, const std::vector<ReadCountHistogram>& bps_per_sample,
+			  std::vector<int>& novel_bp_diffs);
 
   // If this flag is set, the genotyper will reassemble the flanking sequencesAfter an initial round of genotyping
   bool reassemble_flanks_;
 
-  // Timing statistics (in seconds)
-  double total_hap_build_time_;
-  double total_hap_aln_time_;
-  double total_aln_trace_time_;
-  double total_assembly_time_;
+  // If positive, only reassemble the flanks of samples in which a single flank SNP or indel occurs in at least this fraction
+  // of the reads' ML alignments (see select_assembly_samples()). Otherwise, every sample's flanks are reassembled
+  float min_flank_var_frac_;
+
+  // True iff flank reassembly was enabled for the locus but no sample had enough flank variation to require it
+  bool skipped_assembly_;
+
+  // If this flag is set, reads are aligned to each haplotype in single precision when possible
+  bool single_prec_alns_;
+
+  // If this flag is set, each read's haplotype alignments are restricted to a band around its original alignment when possible
+  bool banded_alns_;
+
+  // If this flag is set, reads aren't fully aligned to haplotypes that are far less likely than their best haplotype
+  bool prune_alns_;
+
+  // If this flag is set, candidate STR alleles whose lengths are implausible for every sample are removed before the reads
+  // are aligned to the haplotypes. They're only reconsidered if they're identified in stutter artifacts
+  bool prescreen_alleles_;
+
+  // If this flag is set, haplotypes with several variable blocks only contain the combinations of block options observed
+  // jointly in the reads' left alignments, instead of every combination (see restrict_haplotype_combinations())
+  bool sparse_haps_;
+
+  // Restricts HAPLOTYPE to the combinations of its block options observed in the reads' left alignments, where blocks a read
+  // doesn't resolve are assigned their reference option, along with a combination containing each option. Also retains the
+  // combinations of PREV_HAPLOTYPE whose options are still present, or only each sample's optimal haplotypes if it wasn't sparse and
+  // KEEP_OPTIMAL is set. Has no effect unless sparse haplotypes are enabled and at least two blocks have several options
+  void restrict_haplotype_combinations(Haplotype* haplotype, Haplotype* prev_haplotype, bool keep_optimal);
+
+  // If this flag is set, loci whose flanks don't vary are genotyped from the lengths of the reads' repeat sequences,
+  // using LLs from the stutter model instead of aligning the reads to each haplotype
+  bool length_fast_path_;
+  bool length_only_; // True iff the current locus qualified for the fast path and its LLs are computed from the read lengths
+
+  // Returns true iff the haplotype contains a single repeat block whose alleles have distinct lengths, its other blocks
+  // are invariant, and the reads only differ from the reference flanks by isolated mismatches
+  bool check_length_only_locus();
+
+  // Store each realigned pool's LL for each haplotype under the length-based stutter model, along with its seed base
+  void calc_length_aln_probs(HapAligner& hap_aligner, AlnList& pooled_alns, std::vector<bool>& realign_pool);
+
+  // Remove the candidate alleles in each repeat block whose lengths aren't in any sample's plausible genotypes
+  // under a length-only stutter model, using the length of each read's original alignment through the block
+  void prescreen_alleles(std::ostream& logger);
+
+  // Computes the LLs of the pooled reads for each haplotype
+  AlignmentBackend* aln_backend_;
+
+  // If not NULL, each record is also encoded for the columnar genotype output (see columnar_output.h)
+  std::ostream* columns_out_;
 
   // Used to identify candidate haplotypes during flank reassembly
   int MIN_PATH_WEIGHT, MIN_KMER, MAX_KMER;
 
-  // Cache of traced back alignments
-  std::map<std::pair<int,int>, AlignmentTrace*> trace_cache_;
+  // Cache of traced back alignments, indexed by pool index and then by haplotype index. Entries
+  // are NULL until traced. The table is only allocated once the first alignment is traced
+  std::vector<AlignmentTrace*> trace_cache_;
 
   // True iff both the indexed read and its mate overlap the STR and the current read's index is greater
   bool* second_mate_;
 
+  // Storage for the per-read arrays, which are released in bulk once the locus has been genotyped
+  LocusArena* arena_;
+
+  // Work performed for the locus, recorded for the per-locus statistics
+  int64_t num_dp_cells_;     // Alignment matrix cells computed while aligning and retracing reads
+  int num_stutter_rounds_;   // Times the reads were realigned after adding stutter alleles or re-estimating the stutter models
+
+  // If positive, the locus is skipped if its arrays are expected to require more than this many bytes, and stutter
+  // alleles that would exceed the budget aren't added
+  int64_t max_locus_bytes_;
+  bool exceeded_mem_budget_; // True iff the locus was skipped because of its memory budget
+  int64_t peak_bytes_;       // Largest number of bytes used by the locus' arrays and the alignment workspace
+
+  // Approximate number of bytes required to genotype the locus with the provided number of haplotypes, including the
+  // per-read and per-sample arrays, the pooled alignment probabilities, the traceback cache and the alignment matrices
+  int64_t estimate_bytes(int num_alleles);
+
+  // Update the peak memory usage, where TRANSIENT_BYTES are currently used by temporary arrays
+  void update_peak_bytes(int64_t transient_bytes);
+
   // Set up the relevant data structures. Invoked by the constructor 
-  bool build_haplotype(std::string& chrom_seq, std::vector<StutterModel*>& stutter_models, std::ostream& logger);
-  void init(std::vector<StutterModel *>& stutter_models, std::string& chrom_seq, std::ostream& logger);
+  bool build_haplotype(const ReferenceSequence& chrom_seq, std::vector<StutterModel*>& stutter_models, std::ostream& logger);
+  void init(std::vector<StutterModel *>& stutter_models, const ReferenceSequence& chrom_seq, std::ostream& logger);
+
+  // Assign each read to the pool of reads that are aligned to the haplotypes as a single read
+  void assign_read_pools(std::ostream& logger);
 
   void reorder_alleles(std::vector<std::string>& alleles,
 		       std::vector<int>& old_to_new, std::vector<int>& new_to_old);
 
   // Extract the sequences for each allele and the VCF start position
-  void get_alleles(const Region& region, int block_index, std::string& chrom_seq,
+  void get_alleles(const Region& region, int block_index, const ReferenceSequence& chrom_seq,
 		   int32_t& pos, std::vector<std::string>& alleles);
 
   void debug_sample(int sample_index, std::ostream& logger);
@@ -82,11 +189,21 @@ class SeqStutterGenotyper : public Genotyper {
   // Designed to remove alleles who aren't the MAP genotype of any samples
   void remove_alleles(std::vector< std::vector<int> >& allele_indices);
 
+  // Returns the cached alignment trace for the read against the haplotype, tracing and caching it if required
+  AlignmentTrace* get_trace(HapAligner& hap_aligner, int read_index, int hap_index);
+
+  // Update the alignment trace cache after the haplotypes have changed, where ALLELE_MAPPING contains
+  // the new index for each old haplotype (or -1 if it was removed)
+  void remap_trace_cache(const std::vector<int>& allele_mapping, int new_num_alleles);
+
+  void clear_trace_cache();
+
   // Retrace the alignment for each read and store the associated pointers in the provided vector
   // Reads which were unaligned will have a NULL pointer
   void retrace_alignments(std::vector<AlignmentTrace*>& traced_alns);
 
-  // Identify additional candidate STR alleles using the sequences observed in reads with stutter artifacts
+  // Identify additional candidate STR alleles using the sequences observed in reads with stutter artifacts. If more than
+  // MAX_STUTTER_CANDIDATES sequences qualify, only those supported by the most samples (and then reads) are retained
   void get_stutter_candidate_alleles(int block_index, std::ostream& logger, std::vector<std::string>& candidate_seqs);
 
   // Aligns each read to each of the candidate haplotypes and stores the results in internal arrays
@@ -96,7 +213,7 @@ class SeqStutterGenotyper : public Genotyper {
   // Identify alleles present in stutter artifacts. Align each read to the new haplotypes
   // containing these alleles and incorporate these alignment probabilities
   // into the relevant data structures
-  bool id_and_align_to_stutter_alleles(std::string& chrom_seq, std::ostream& logger);
+  bool id_and_align_to_stutter_alleles(const ReferenceSequence& chrom_seq, std::ostream& logger);
 
   // Exploratory function related to identifying indels in the flanking sequences
   void analyze_flank_indels(std::ostream& logger);
@@ -107,6 +224,10 @@ class SeqStutterGenotyper : public Genotyper {
   // Exploratory function related to using local assembly to identify variants in the flanking sequences
   bool assemble_flanks(std::ostream& logger);
 
+  // Flags the samples whose most frequent flank SNP or indel in the traced alignments is supported by at least
+  // MIN_PATH_WEIGHT reads and by at least the minimum fraction of the sample's traced reads
+  void select_assembly_samples(const std::vector<AlignmentTrace*>& traced_alns, std::vector<bool>& assemble_sample);
+
   // Determines the allele index in the given haplotype block that is associated with each haplotype configuration
   // Stores the results in the provided vector
   void haps_to_alleles(int hap_block_index, std::vector<int>& allele_indices);
@@ -127,68 +248,146 @@ class SeqStutterGenotyper : public Genotyper {
 
   double compute_allele_bias(int hap_a_read_count, int hap_b_read_count);
 
-  void write_vcf_record(std::vector<std::string>& sample_names, int hap_block_index, const Region& region, std::string& chrom_seq,
+  void write_vcf_record(std::vector<std::string>& sample_names, int hap_block_index, const Region& region, const ReferenceSequence& chrom_seq,
 			bool output_gls, bool output_pls, bool output_phased_gls, bool output_allreads,
 			bool output_mallreads, bool output_viz, float max_flank_indel_frac, bool viz_left_alns,
-			std::ostream& html_output, std::ostream& out, std::ostream& logger);
+			const bcf_hdr_t* bcf_header, std::ostream& html_output, std::ostream& out, std::ostream& logger);
 
   RegionGroup* region_group_;
 
  public:
-  SeqStutterGenotyper(RegionGroup& region_group, bool haploid, bool reassemble_flanks,
+  SeqStutterGenotyper(RegionGroup& region_group, bool haploid, bool reassemble_flanks, bool single_prec_alns,
 		      std::vector<Alignment>& alignments, std::vector< std::vector<double> >& log_p1, std::vector< std::vector<double> >& log_p2,
-		      std::vector<std::string>& sample_names, std::string& chrom_seq,
-		      std::vector<StutterModel*>& stutter_models, VCF::VCFReader* ref_vcf, std::ostream& logger): Genotyper(haploid, sample_names, log_p1, log_p2){
+		      std::vector<std::string>& sample_names, const ReferenceSequence& chrom_seq,
+		      std::vector<StutterModel*>& stutter_models, VCF::VCFReader* ref_vcf, int64_t max_locus_bytes,
+		      std::ostream& logger): Genotyper(haploid, sample_names, log_p1, log_p2){
     region_group_          = region_group.copy();
-    alns_                  = alignments;
+    alns_.swap(alignments); // Take ownership of the alignments instead of copying the entire list
     seed_positions_        = NULL;
+    pool_seed_positions_   = NULL;
+    pool_log_aln_probs_    = NULL;
+    pool_aln_capacity_     = 0;
     pool_index_            = NULL;
     haplotype_             = NULL;
     second_mate_           = NULL;
+    arena_                 = &LocusArena::thread_arena();
+    arena_->acquire();
     MAX_REF_FLANK_LEN      = 30;
     MAX_FLANK_HAPLOTYPES   = 4;
+    MAX_STUTTER_CANDIDATES = 10;
     MIN_PATH_WEIGHT        = 2;
     MIN_KMER               = 10;
     MAX_KMER               = 15;
     initialized_           = false;
     reassemble_flanks_     = reassemble_flanks;
-    total_hap_build_time_  = total_hap_aln_time_  = 0;
-    total_aln_trace_time_  = total_assembly_time_ = 0;
+    min_flank_var_frac_    = 0;
+    skipped_assembly_      = false;
+    single_prec_alns_      = single_prec_alns;
+    banded_alns_           = false;
+    prune_alns_            = false;
+    prescreen_alleles_     = false;
+    sparse_haps_           = false;
+    length_fast_path_      = false;
+    length_only_           = false;
+    aln_backend_           = AlignmentBackend::cpu();
+    columns_out_           = NULL;
+    num_dp_cells_          = 0;
+    num_stutter_rounds_    = 0;
+    max_locus_bytes_       = max_locus_bytes;
+    exceeded_mem_budget_   = false;
+    peak_bytes_            = 0;
     ref_vcf_               = ref_vcf;
+    ref_allele_index_      = NULL;
+    use_ref_allele_priors_ = false;
+    flag_novel_alleles_    = false;
+    num_novel_allele_loci_ = 0;
     assert(num_reads_ == alns_.size());
     init(stutter_models, chrom_seq, logger);
   }
 
   ~SeqStutterGenotyper(){
     delete region_group_;
-    delete [] seed_positions_;
-    delete [] pool_index_;
-    delete [] second_mate_;
-    for (auto trace_iter = trace_cache_.begin(); trace_iter != trace_cache_.end(); trace_iter++)
-      delete trace_iter->second;
+    delete [] pool_log_aln_probs_;
+    clear_trace_cache();
     for (unsigned int i = 0; i < hap_blocks_.size(); i++)
       delete hap_blocks_[i];
     delete haplotype_;
+    arena_->release();
   }
   
-  void write_vcf_record(std::vector<std::string>& sample_names, std::string& chrom_seq,
+  // Write a record for each STR region to OUT, as a line of VCF text or, if BCF_HEADER isn't NULL, as a binary BCF record
+  void write_vcf_record(std::vector<std::string>& sample_names, const ReferenceSequence& chrom_seq,
 			bool output_gls, bool output_pls, bool output_phased_gls, bool output_allreads,
 			bool output_mallreads, bool output_viz, float max_flank_indel_frac, bool viz_left_alns,
-			std::ostream& html_output, std::ostream& out, std::ostream& logger);
+			const bcf_hdr_t* bcf_header, std::ostream& html_output, std::ostream& out, std::ostream& logger);
+
+
+  void use_banded_alns(){ banded_alns_ = true; }
 
+  void use_pruned_alns(){ prune_alns_ = true; }
 
-  double hap_build_time() { return total_hap_build_time_;  }
-  double hap_aln_time()   { return total_hap_aln_time_;    }
-  double aln_trace_time() { return total_aln_trace_time_;  }
-  double assembly_time()  { return total_assembly_time_;   }
+  void use_allele_prescreen(){ prescreen_alleles_ = true; }
+
+  void use_sparse_haplotypes(){ sparse_haps_ = true; }
+
+  void set_min_flank_var_frac(float frac){ min_flank_var_frac_ = frac; }
+
+  void use_length_fast_path(){ length_fast_path_ = true; }
+
+  // Pool the reads spanning the repeats and FLANK bp on either side by their bases within this window, rather than by their
+  // entire sequences. Such reads are trimmed to the window before they're aligned to the haplotypes
+  void set_pool_window(int32_t flank){
+    pooler_.set_window(std::max(0, region_group_->start()-flank), region_group_->stop()-1+flank);
+  }
+
+  // Bin the reads' base qualities using the Illumina 8-level scheme before computing the median qualities of each pool
+  void use_binned_pool_qualities(){ pooler_.use_binned_qualities(); }
+
+  // True iff the locus was genotyped from the lengths of the reads' repeat sequences
+  bool genotyped_from_lengths(){ return length_only_; }
+  bool skipped_flank_assembly(){ return skipped_assembly_; }
+
+  // Read the reference VCF's alleles from this index rather than querying the VCF
+  void set_ref_allele_index(const RefAlleleIndex* index){ ref_allele_index_ = index; }
+
+  // When genotyping against the alleles in the reference VCF, use their frequencies in the VCF as the genotype priors
+  // and flag alleles supported by the new samples' reads that are missing from the VCF
+  void use_incremental_genotyping(){
+    use_ref_allele_priors_ = true;
+    flag_novel_alleles_    = true;
+  }
+  int num_novel_allele_loci() { return num_novel_allele_loci_; }
+
+  void set_alignment_backend(AlignmentBackend* backend){ aln_backend_ = backend; }
+
+  // Encode each record written by write_vcf_record() for the columnar genotype output to this stream, if provided
+  void set_columns_output(std::ostream* columns_out){ columns_out_ = columns_out; }
+
+  int num_pooled_reads()       { return pooler_.num_pools();     }
+  int64_t num_dp_cells()       { return num_dp_cells_;           }
+  int num_stutter_rounds()     { return num_stutter_rounds_;     }
+  size_t arena_bytes()         { return arena_->bytes_used();    }
+  int64_t peak_bytes()         { return peak_bytes_;             }
+  bool exceeded_mem_budget()   { return exceeded_mem_budget_;    }
+  int num_hap_blocks()         { return (haplotype_ == NULL ? 0 : haplotype_->num_blocks()); }
+  int num_haplotypes()         { return (haplotype_ == NULL ? 0 : haplotype_->num_combs());  }
+
+  // Total number of candidate alleles across the repeat blocks
+  int num_candidate_alleles(){
+    int num_alleles = 0;
+    for (int i = 0; i < num_hap_blocks(); i++)
+      if (haplotype_->get_block(i)->get_repeat_info() != NULL)
+	num_alleles += haplotype_->get_block(i)->num_options();
+    return num_alleles;
+  }
 
-  bool genotype(std::string& chrom_seq, std::ostream& logger);
+  bool genotype(const ReferenceSequence& chrom_seq, std::ostream& logger);
 
   /*
    * Recompute the stutter model(s) using the PCR artifacts obtained from the ML alignments
-   * and regenotype the samples using this new model
+   * and regenotype the samples by realigning the existing read pools to the candidate haplotypes using this new model
   */
-  bool recompute_stutter_models(std::string& chrom_seq, std::ostream& logger, int max_em_iter, double abs_ll_converge, double frac_ll_converge);
+  bool recompute_stutter_models(const ReferenceSequence& chrom_seq, std::ostream& logger, int max_em_iter, double abs_ll_converge, double frac_ll_converge);
 };
 
 #endif
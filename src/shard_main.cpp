@@ -0,0 +1,223 @@
+#include <fstream>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <stdlib.h>
+
+#include "error.h"
+#include "locus_cost.h"
+#include "region.h"
+#include "stringops.h"
+
+void print_usage(){
+  std::cerr << "Usage: RegionSharder --regions <region_file.bed> --shards <num_shards> --out-prefix <prefix> [--bams <list_of_bams>] [--locus-stats <locus_stats.tsv.gz>]" << "\n"
+	    << "\t" << "--regions       <region_file.bed>     " << "\t" << "BED file containing the STR regions that HipSTR will genotype"                  << "\n"
+	    << "\t" << "--shards        <num_shards>          " << "\t" << "Number of shard BED files to create"                                            << "\n"
+	    << "\t" << "--out-prefix    <prefix>              " << "\t" << "Write the regions for shard i to PREFIX.shard_i.bed, for i = 1..NUM_SHARDS"      << "\n"
+	    << "\t" << "--bams          <list_of_bams>        " << "\t" << "Comma separated list of indexed BAM files used to estimate each locus' depth."  << "\n"
+	    << "\t" << "                                      " << "\t" << " Only the BAI/CSI index bins are examined"                                      << "\n"
+	    << "\t" << "--bam-files     <bam_files.txt>       " << "\t" << "File containing BAM files used to estimate each locus' depth, one per line"      << "\n"
+	    << "\t" << "--locus-stats   <locus_stats.tsv.gz>  " << "\t" << "Table produced by HipSTR's --locus-stats option for a previous run. Measured"   << "\n"
+	    << "\t" << "                                      " << "\t" << " times replace the predicted costs for the loci it contains and calibrate the"  << "\n"
+	    << "\t" << "                                      " << "\t" << " predictions for the remaining loci"                                            << "\n"
+	    << "\t" << "--contiguous                          " << "\t" << "Create each shard from consecutive regions in the BED file rather than"         << "\n"
+	    << "\t" << "                                      " << "\t" << " assigning the most costly regions first to the shard with the lowest total"    << "\n"
+	    << "\t" << "--cost-out      <costs.tsv>           " << "\t" << "Output a table of each region's estimated reads, predicted cost and shard"       << "\n"
+	    << "\n";
+}
+
+void parse_command_line_args(int argc, char** argv, std::string& region_file, std::string& out_prefix, std::string& bamlist_string,
+			     std::string& bamfile_string, std::string& stats_file, std::string& cost_file, int& num_shards, int& contiguous){
+  if (argc == 1 || (argc == 2 && std::string("-h").compare(std::string(argv[1])) == 0)){
+    print_usage();
+    exit(0);
+  }
+
+  static struct option long_options[] = {
+    {"bams",        required_argument, 0, 'b'},
+    {"bam-files",   required_argument, 0, 'B'},
+    {"cost-out",    required_argument, 0, 'c'},
+    {"locus-stats", required_argument, 0, 'L'},
+    {"out-prefix",  required_argument, 0, 'o'},
+    {"regions",     required_argument, 0, 'r'},
+    {"shards",      required_argument, 0, 'n'},
+    {"contiguous",  no_argument, &contiguous, 1},
+    {"help",        no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  while (true){
+    int option_index = 0;
+    c = getopt_long(argc, argv, "b:B:c:hL:n:o:r:", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch(c){
+    case 0:
+      break;
+    case 'b':
+      bamlist_string = std::string(optarg);
+      break;
+    case 'B':
+      bamfile_string = std::string(optarg);
+      break;
+    case 'c':
+      cost_file = std::string(optarg);
+      break;
+    case 'h':
+      print_usage();
+      exit(0);
+    case 'L':
+      stats_file = std::string(optarg);
+      break;
+    case 'n':
+      num_shards = atoi(optarg);
+      break;
+    case 'o':
+      out_prefix = std::string(optarg);
+      break;
+    case 'r':
+      region_file = std::string(optarg);
+      break;
+    case '?':
+      printErrorAndDie("Unrecognized command line option");
+      break;
+    default:
+      abort();
+      break;
+    }
+  }
+}
+
+int main(int argc, char** argv){
+  std::string region_file = "", out_prefix = "", bamlist_string = "", bamfile_string = "", stats_file = "", cost_file = "";
+  int num_shards = 0, contiguous = 0;
+  parse_command_line_args(argc, argv, region_file, out_prefix, bamlist_string, bamfile_string, stats_file, cost_file, num_shards, contiguous);
+
+  if (region_file.empty())
+    printErrorAndDie("--regions option required");
+  if (out_prefix.empty())
+    printErrorAndDie("--out-prefix option required");
+  if (num_shards < 1)
+    printErrorAndDie("--shards must be greater than 0");
+  if (!bamlist_string.empty() && !bamfile_string.empty())
+    printErrorAndDie("You can only specify one of the --bams or --bam-files options");
+
+  std::vector<std::string> bam_files;
+  if (!bamlist_string.empty())
+    split_by_delim(bamlist_string, ',', bam_files);
+  else if (!bamfile_string.empty()){
+    std::ifstream input(bamfile_string.c_str());
+    if (!input.is_open())
+      printErrorAndDie("Failed to open BAM file list " + bamfile_string);
+    std::string line;
+    while (std::getline(input, line))
+      if (!line.empty())
+	bam_files.push_back(line);
+    input.close();
+  }
+
+  // Retain each line of the BED file so that the shards reproduce the original entries
+  std::vector<Region> regions;
+  readRegions(region_file, regions, -1, "", std::cerr);
+  std::vector<std::string> lines;
+  std::ifstream bed_input(region_file.c_str());
+  std::string line;
+  while (std::getline(bed_input, line))
+    lines.push_back(line);
+  bed_input.close();
+  if (lines.size() != regions.size())
+    printErrorAndDie("Failed to match the lines in the region file to its regions");
+
+  // Predict each locus' cost from its estimated depth and composition
+  std::vector<double> num_reads(regions.size(), 0), costs(regions.size(), 0);
+  if (!bam_files.empty()){
+    std::cerr << "Estimating the read depth for each region using the indices of " << bam_files.size() << " BAM files" << std::endl;
+    ReadCountEstimator estimator(bam_files);
+    if (estimator.num_unestimated_files() > 0)
+      std::cerr << "WARNING: Read counts couldn't be estimated for " << estimator.num_unestimated_files() << " files, as their indices don't contain"
+		<< " read counts (e.g. CRAM files). Their regions' costs only reflect their lengths and periods" << std::endl;
+    for (unsigned int i = 0; i < regions.size(); i++)
+      num_reads[i] = estimator.estimate_reads(regions[i]);
+  }
+  for (unsigned int i = 0; i < regions.size(); i++)
+    costs[i] = predict_locus_cost(regions[i], num_reads[i]);
+
+  // Replace the predictions with the times measured in a previous run, and rescale the remaining predictions to the same units
+  std::vector<bool> measured(regions.size(), false);
+  if (!stats_file.empty()){
+    std::map<std::tuple<std::string, int32_t, int32_t>, double> locus_times;
+    read_locus_stats_times(stats_file, locus_times);
+    double total_time = 0, total_predicted = 0;
+    int num_measured = 0;
+    for (unsigned int i = 0; i < regions.size(); i++){
+      auto time_iter = locus_times.find(std::make_tuple(regions[i].chrom(), regions[i].start()+1, regions[i].stop()));
+      if (time_iter == locus_times.end())
+	continue;
+      total_time      += time_iter->second;
+      total_predicted += costs[i];
+      costs[i]         = time_iter->second;
+      measured[i]      = true;
+      num_measured++;
+    }
+    std::cerr << "Found measured times for " << num_measured << " of " << regions.size() << " regions in " << stats_file << std::endl;
+    if (num_measured > 0 && total_time > 0 && total_predicted > 0){
+      double scale = total_time/total_predicted;
+      for (unsigned int i = 0; i < regions.size(); i++)
+	if (!measured[i])
+	  costs[i] *= scale;
+    }
+  }
+
+  std::vector<size_t> order(regions.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::vector<int> shards;
+  partition_loci(costs, order, num_shards, contiguous, shards);
+
+  std::vector<double> shard_costs(num_shards, 0);
+  std::vector<int> shard_sizes(num_shards, 0);
+  std::vector<std::ofstream*> outputs;
+  for (int i = 0; i < num_shards; i++){
+    std::string shard_file = out_prefix + ".shard_" + std::to_string(i+1) + ".bed";
+    outputs.push_back(new std::ofstream(shard_file.c_str()));
+    if (!outputs.back()->is_open())
+      printErrorAndDie("Failed to open the shard region file " + shard_file);
+  }
+  for (unsigned int i = 0; i < regions.size(); i++){
+    *outputs[shards[i]] << lines[i] << "\n";
+    shard_costs[shards[i]] += costs[i];
+    shard_sizes[shards[i]]++;
+  }
+  for (int i = 0; i < num_shards; i++){
+    outputs[i]->close();
+    delete outputs[i];
+  }
+
+  if (!cost_file.empty()){
+    std::ofstream cost_out(cost_file.c_str());
+    if (!cost_out.is_open())
+      printErrorAndDie("Failed to open the cost output file " + cost_file);
+    cost_out << "CHROM\tSTART\tEND\tPERIOD\tEST_READS\tCOST\tSOURCE\tSHARD" << "\n";
+    for (unsigned int i = 0; i < regions.size(); i++)
+      cost_out << regions[i].chrom() << "\t" << regions[i].start()+1 << "\t" << regions[i].stop() << "\t" << regions[i].period()
+	       << "\t" << num_reads[i] << "\t" << costs[i] << "\t" << (measured[i] ? "LOCUS_STATS" : "PREDICTED") << "\t" << shards[i]+1 << "\n";
+    cost_out.close();
+  }
+
+  double max_cost = 0, total_cost = 0;
+  for (int i = 0; i < num_shards; i++){
+    std::cerr << "Shard " << i+1 << ": " << shard_sizes[i] << " regions, predicted cost = " << shard_costs[i] << "\n";
+    max_cost    = std::max(max_cost, shard_costs[i]);
+    total_cost += shard_costs[i];
+  }
+  if (total_cost > 0)
+    std::cerr << "Ratio of the largest shard's cost to the mean = " << std::fixed << std::setprecision(3) << max_cost/(total_cost/num_shards) << std::endl;
+  return 0;
+}
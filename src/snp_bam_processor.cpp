@@ -5,18 +5,27 @@
 #include "snp_phasing_quality.h"
 #include "snp_tree.h"
 
+void SNPBamProcessor::collect_str_reads(BamAlnList& paired_strs, BamAlnList& mate_pairs, BamAlnList& unpaired_strs, BamAlnList& alignments){
+  assert(alignments.empty());
+  alignments.swap(paired_strs);
+  alignments.reserve(alignments.size() + unpaired_strs.size());
+  alignments.insert(alignments.end(), std::make_move_iterator(unpaired_strs.begin()), std::make_move_iterator(unpaired_strs.end()));
+  BamAlnList().swap(unpaired_strs);
+  BamAlnList().swap(mate_pairs);
+}
+
 void SNPBamProcessor::process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
 				    std::vector<BamAlnList>& mate_pairs_by_rg,
 				    std::vector<BamAlnList>& unpaired_strs_by_rg,
 				    std::vector<std::string>& rg_names, RegionGroup& region_group,
-				    std::string& chrom_seq, std::ostream& out){
+				    const ReferenceSequence& chrom_seq, std::ostream& out){
   // Only use specialized function for 10X genomics BAMs if flag has been set
   if (bams_from_10x_){
     process_10x_reads(paired_strs_by_rg, mate_pairs_by_rg, unpaired_strs_by_rg, rg_names, region_group, chrom_seq, out);
     return;
   }
 
-  locus_snp_phase_info_time_ = clock();
+  ScopedTimer snp_timer(locus_timer_, PHASE_SNP_INFO);
   assert(paired_strs_by_rg.size() == mate_pairs_by_rg.size() && paired_strs_by_rg.size() == unpaired_strs_by_rg.size());
   
   std::vector<BamAlnList> alignments(paired_strs_by_rg.size());
@@ -24,7 +33,7 @@ void SNPBamProcessor::process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
   const std::vector<Region>& skip_regions = region_group.regions();
   int32_t skip_padding = 15;
   bool got_snp_info = false;
-  if (phased_snp_vcf_ != NULL){
+  if (phased_snp_cursor_ != NULL){
     // If we are tracking SNP haplotypes for pedigree-based filtering, we need to update the haplotypes to the current position
     if (haplotype_tracker_ != NULL){
       std::set<std::string> sites_to_skip;
@@ -33,8 +42,12 @@ void SNPBamProcessor::process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
 
     std::vector<SNPTree*> snp_trees;
     std::map<std::string, unsigned int> sample_indices;      
-    if (create_snp_trees(region_group.chrom(), (region_group.start() > MAX_MATE_DIST ? region_group.start()-MAX_MATE_DIST : 1), region_group.stop()+MAX_MATE_DIST,
-			 skip_regions, skip_padding, phased_snp_vcf_, haplotype_tracker_, sample_indices, snp_trees, logger())){
+    TraceScope snp_trace("create_snp_trees");
+    bool created_trees = create_snp_trees(region_group.chrom(), (region_group.start() > MAX_MATE_DIST ? region_group.start()-MAX_MATE_DIST : 1),
+					  region_group.stop()+MAX_MATE_DIST, skip_regions, skip_padding, phased_snp_cursor_, haplotype_tracker_,
+					  sample_indices, snp_trees, logger());
+    snp_trace.stop();
+    if (created_trees){
       got_snp_info = true;
       std::set<std::string> bad_samples, good_samples;
       for (unsigned int i = 0; i < paired_strs_by_rg.size(); ++i){
@@ -54,10 +67,7 @@ void SNPBamProcessor::process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
 	  log_p1s.push_back(log_p1); log_p2s.push_back(log_p2);
 	  bad_samples.insert(rg_names[i]);
 	}
-	
-	// Copy alignments
-	alignments[i].insert(alignments[i].end(), paired_strs_by_rg[i].begin(),   paired_strs_by_rg[i].end());
-	alignments[i].insert(alignments[i].end(), unpaired_strs_by_rg[i].begin(), unpaired_strs_by_rg[i].end());
+	collect_str_reads(paired_strs_by_rg[i], mate_pairs_by_rg[i], unpaired_strs_by_rg[i], alignments[i]);
       }
       logger() << "Found VCF info for " << good_samples.size() << " out of " << good_samples.size()+bad_samples.size() << " samples with STR reads" << std::endl;
     }
@@ -66,14 +76,13 @@ void SNPBamProcessor::process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
     destroy_snp_trees(snp_trees);      
   }
   if (!got_snp_info){
+    log_p1s.clear();
+    log_p2s.clear();
     for (unsigned int i = 0; i < paired_strs_by_rg.size(); i++){
-      // Copy alignments                                                                                                                                             
-      alignments[i].insert(alignments[i].end(), paired_strs_by_rg[i].begin(),   paired_strs_by_rg[i].end());
-      alignments[i].insert(alignments[i].end(), unpaired_strs_by_rg[i].begin(), unpaired_strs_by_rg[i].end());
-      
       // Assign equal phasing LLs as no SNP info is available
       log_p1s.push_back(std::vector<double>(paired_strs_by_rg[i].size()+unpaired_strs_by_rg[i].size(), 0.0));
       log_p2s.push_back(std::vector<double>(paired_strs_by_rg[i].size()+unpaired_strs_by_rg[i].size(), 0.0));
+      collect_str_reads(paired_strs_by_rg[i], mate_pairs_by_rg[i], unpaired_strs_by_rg[i], alignments[i]);
     }
   }
   
@@ -91,19 +100,16 @@ void SNPBamProcessor::process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
   logger() << "Phased SNPs add info for " << phased_reads << " out of " << total_reads << " reads"
 	   << " and " << phased_samples << " out of " << rg_names.size() <<  " samples" << std::endl;
 
-  locus_snp_phase_info_time_  = (clock() - locus_snp_phase_info_time_)/CLOCKS_PER_SEC;
-  total_snp_phase_info_time_ += locus_snp_phase_info_time_;
+  snp_timer.stop();
 
   // Run any additional analyses using phasing probabilities
   analyze_reads_and_phasing(alignments, log_p1s, log_p2s, rg_names, region_group, chrom_seq);
 }
 
 int SNPBamProcessor::get_haplotype(BamAlignment& aln){
-  if (!aln.HasTag(HAPLOTYPE_TAG.c_str()))
-    return -1;
   int64_t haplotype;
-  if (!aln.GetIntTag(HAPLOTYPE_TAG.c_str(), haplotype))
-    printErrorAndDie("Failed to extract haplotype tag");
+  if (!aln.HaplotypeTag(haplotype))
+    return -1;
   assert(haplotype == 1 || haplotype == 2);
   return (int)haplotype;
 }
@@ -117,18 +123,14 @@ void SNPBamProcessor::process_10x_reads(std::vector<BamAlnList>& paired_strs_by_
 					std::vector<BamAlnList>& mate_pairs_by_rg,
 					std::vector<BamAlnList>& unpaired_strs_by_rg,
 					std::vector<std::string>& rg_names, RegionGroup& region_group,
-					std::string& chrom_seq, std::ostream& out){
-  locus_snp_phase_info_time_ = clock();
+					const ReferenceSequence& chrom_seq, std::ostream& out){
+  ScopedTimer snp_timer(locus_timer_, PHASE_SNP_INFO);
   assert(paired_strs_by_rg.size() == mate_pairs_by_rg.size() && paired_strs_by_rg.size() == unpaired_strs_by_rg.size());
 
   std::vector<BamAlnList> alignments(paired_strs_by_rg.size());
   std::vector< std::vector<double> > log_p1s, log_p2s;
   int32_t phased_reads = 0, total_reads = 0;
   for (unsigned int i = 0; i < paired_strs_by_rg.size(); i++){
-    // Copy alignments
-    alignments[i].insert(alignments[i].end(), paired_strs_by_rg[i].begin(),   paired_strs_by_rg[i].end());
-    alignments[i].insert(alignments[i].end(), unpaired_strs_by_rg[i].begin(), unpaired_strs_by_rg[i].end());
-
     log_p1s.push_back(std::vector<double>());
     log_p2s.push_back(std::vector<double>());
     for (unsigned int j = 0; j < paired_strs_by_rg[i].size(); j++){
@@ -168,11 +170,11 @@ void SNPBamProcessor::process_10x_reads(std::vector<BamAlnList>& paired_strs_by_
 	log_p2s[i].push_back(0.0);
       }
     }
+    collect_str_reads(paired_strs_by_rg[i], mate_pairs_by_rg[i], unpaired_strs_by_rg[i], alignments[i]);
   }
 
   logger() << "Phased SNPs add info for " << phased_reads << " out of " << total_reads << " reads" << std::endl;
-  locus_snp_phase_info_time_  = (clock() - locus_snp_phase_info_time_)/CLOCKS_PER_SEC;
-  total_snp_phase_info_time_ += locus_snp_phase_info_time_;
+  snp_timer.stop();
 
   // Run any additional analyses using phasing probabilities
   analyze_reads_and_phasing(alignments, log_p1s, log_p2s, rg_names, region_group, chrom_seq);
@@ -2,6 +2,7 @@
 #define SNP_BAM_PROCESSOR_H_
 
 #include <iostream>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -11,6 +12,7 @@
 #include "error.h"
 #include "haplotype_tracker.h"
 #include "region.h"
+#include "snp_tree.h"
 #include "vcf_reader.h"
 
 const std::string HAPLOTYPE_TAG = "HP";
@@ -20,82 +22,156 @@ const double OTHER_HAP_LL       = -1000.0; // Log-likelihood read comes from a h
 class SNPBamProcessor : public BamProcessor {
 private:
   VCF::VCFReader* phased_snp_vcf_;
+  PhasedSNPPanel* phased_snp_panel_;
+  SNPVCFCursor* phased_snp_cursor_; // Streams the phased SNPs for successive loci
+  std::string phased_snp_vcf_file_;
+  std::string phased_snp_panel_file_; // Binary panel from which the phased SNPs are read instead of the VCF, if provided
+  std::set<std::string> phased_snp_samples_; // Samples whose phased SNPs are decoded
   int32_t match_count_, mismatch_count_;
 
   // Used to enforce pedigree requirements on SNPs used for phasing
   HaplotypeTracker* haplotype_tracker_;
   std::vector<NuclearFamily> families_;
-
-  // Timing statistics (in seconds)
-  double total_snp_phase_info_time_;
-  double locus_snp_phase_info_time_;
+  std::string pedigree_snp_vcf_file_;
+  const static int32_t HAPLOTYPE_TRACKER_WINDOW = 500000;
+
+  void create_haplotype_tracker(){
+    // If the tracker reads the phased SNP VCF, the phasing cursor listens to it rather than decoding the same records again
+    bool shared_vcf    = (phased_snp_vcf_ != NULL && pedigree_snp_vcf_file_.compare(phased_snp_vcf_file_) == 0);
+    haplotype_tracker_ = new HaplotypeTracker(families_, pedigree_snp_vcf_file_, HAPLOTYPE_TRACKER_WINDOW,
+					      (shared_vcf ? phased_snp_samples_ : std::set<std::string>()));
+    if (shared_vcf){
+      delete phased_snp_cursor_;
+      phased_snp_cursor_ = new SNPVCFCursor(haplotype_tracker_);
+    }
+  }
 
   // Process reads from BAM generated by 10X genomics
   // Requires HP tag, which indicates which haplotype reads came from
   void process_10x_reads(std::vector<BamAlnList>& paired_strs_by_rg,
 			 std::vector<BamAlnList>& mate_pairs_by_rg,
 			 std::vector<BamAlnList>& unpaired_strs_by_rg,
-			 std::vector<std::string>& rg_names, RegionGroup& region_group, std::string& chrom_seq,
+			 std::vector<std::string>& rg_names, RegionGroup& region_group, const ReferenceSequence& chrom_seq,
 			 std::ostream& out);
 
   // Extract the haplotype for an alignment based on the HP tag
   int get_haplotype(BamAlignment& aln);
 
+  // Move a sample's paired and unpaired STR reads into ALIGNMENTS, in that order, and release its mates and the emptied lists.
+  // The mates are only required to compute the phasing likelihoods, so they're freed before the reads are genotyped
+  void collect_str_reads(BamAlnList& paired_strs, BamAlnList& mate_pairs, BamAlnList& unpaired_strs, BamAlnList& alignments);
+
+ protected:
+  void init_worker(const SNPBamProcessor& parent){
+    BamProcessor::init_worker(parent);
+    phased_snp_panel_file_ = parent.phased_snp_panel_file_;
+    if (parent.phased_snp_cursor_ != NULL){
+      std::string vcf_file = parent.phased_snp_vcf_file_;
+      set_input_snp_vcf(vcf_file, parent.phased_snp_samples_);
+    }
+    if (parent.haplotype_tracker_ != NULL){
+      families_              = parent.families_;
+      pedigree_snp_vcf_file_ = parent.pedigree_snp_vcf_file_;
+      create_haplotype_tracker();
+    }
+  }
+
+  void merge_worker_stats(BamProcessor* worker){
+    BamProcessor::merge_worker_stats(worker);
+    SNPBamProcessor* snp_worker = static_cast<SNPBamProcessor*>(worker);
+    match_count_               += snp_worker->match_count_;
+    mismatch_count_            += snp_worker->mismatch_count_;
+  }
+
 
 public:
  SNPBamProcessor(bool use_bam_rgs, bool remove_pcr_dups):BamProcessor(use_bam_rgs, remove_pcr_dups){
     match_count_     = 0;
     mismatch_count_  = 0;
-    total_snp_phase_info_time_  = 0;
-    locus_snp_phase_info_time_  = -1;
     phased_snp_vcf_             = NULL;
+    phased_snp_panel_           = NULL;
+    phased_snp_cursor_          = NULL;
     haplotype_tracker_          = NULL;
   }
 
   ~SNPBamProcessor(){
+    if (phased_snp_cursor_ != NULL)
+      delete phased_snp_cursor_;
     if (phased_snp_vcf_ != NULL)
       delete phased_snp_vcf_;
+    if (phased_snp_panel_ != NULL)
+      delete phased_snp_panel_;
     if (haplotype_tracker_ != NULL)
       delete haplotype_tracker_;
   }
 
-  double total_snp_phase_info_time() { return total_snp_phase_info_time_; }
-  double locus_snp_phase_info_time() { return locus_snp_phase_info_time_; }
-
   void process_reads(std::vector<BamAlnList>& paired_strs_by_rg,
 		     std::vector<BamAlnList>& mate_pairs_by_rg,
 		     std::vector<BamAlnList>& unpaired_strs_by_rg,
-		     std::vector<std::string>& rg_names, RegionGroup& region_group, std::string& chrom_seq,
+		     std::vector<std::string>& rg_names, RegionGroup& region_group, const ReferenceSequence& chrom_seq,
 		     std::ostream& out);
 
   virtual void analyze_reads_and_phasing(std::vector<BamAlnList>& alignments,
 					 std::vector< std::vector<double> >& log_p1s, 
 					 std::vector< std::vector<double> >& log_p2s,
-					 std::vector<std::string>& rg_names, RegionGroup& region_group, std::string& chrom_seq){
+					 std::vector<std::string>& rg_names, RegionGroup& region_group, const ReferenceSequence& chrom_seq){
     log("Ignoring read phasing probabilties");
   }
 
-  void set_input_snp_vcf(std::string& vcf_file){
+  /* Read the phased SNPs from the binary panel at PANEL_FILE, which is generated from the SNP VCF if it doesn't exist */
+  void set_snp_panel_file(const std::string& panel_file){ phased_snp_panel_file_ = panel_file; }
+  const std::string& snp_panel_file() const               { return phased_snp_panel_file_;  }
+
+  /*
+   * Phase reads using the SNPs in VCF_FILE, only decoding the genotypes for the provided SAMPLES. If a panel file was provided,
+   * the SNPs are instead read from the panel for the VCF
+   */
+  void set_input_snp_vcf(std::string& vcf_file, const std::set<std::string>& samples){
+    if (phased_snp_cursor_ != NULL)
+      delete phased_snp_cursor_;
     if (phased_snp_vcf_ != NULL)
       delete phased_snp_vcf_;
-    phased_snp_vcf_ = new VCF::VCFReader(vcf_file);
+    if (phased_snp_panel_ != NULL)
+      delete phased_snp_panel_;
+    phased_snp_vcf_   = NULL;
+    phased_snp_panel_ = NULL;
+    if (!phased_snp_panel_file_.empty()){
+      phased_snp_panel_  = loadPhasedSNPPanel(vcf_file, phased_snp_panel_file_, logger());
+      phased_snp_panel_->restrict_samples(samples);
+      phased_snp_cursor_ = new SNPVCFCursor(phased_snp_panel_);
+    }
+    else {
+      phased_snp_vcf_    = new VCF::VCFReader(vcf_file);
+      phased_snp_vcf_->restrict_samples(samples);
+      phased_snp_cursor_ = new SNPVCFCursor(phased_snp_vcf_);
+    }
+    phased_snp_vcf_file_ = vcf_file;
+    phased_snp_samples_  = samples;
   }
 
+  bool phasing_with_snps() const { return phased_snp_cursor_ != NULL; }
+
   void use_pedigree_to_filter_snps(std::vector<NuclearFamily>& families, std::string snp_vcf_file){
-    if (phased_snp_vcf_ == NULL)
+    if (phased_snp_cursor_ == NULL)
       printErrorAndDie("Cannot enforce pedigree structure on SNPs if no SNP VCF has been specified");
-    if (haplotype_tracker_ != NULL)
+    if (phased_snp_panel_ != NULL)
+      printErrorAndDie("Cannot enforce pedigree structure on SNPs read from a phased SNP panel, as it doesn't retain the missing and unphased genotypes");
+    if (haplotype_tracker_ != NULL){
+      // Detach the phasing cursor from the previous tracker before it's destroyed
+      std::string vcf_file = phased_snp_vcf_file_;
+      set_input_snp_vcf(vcf_file, std::set<std::string>(phased_snp_samples_));
       delete haplotype_tracker_;
+    }
 
     VCF::VCFReader pedigree_vcf_reader(snp_vcf_file);
 
     // Keep only those families where all members are present in the VCF
     families_.clear();
-    std::set<std::string> snp_samples(pedigree_vcf_reader.get_samples().begin(), pedigree_vcf_reader.get_samples().end());
     for (auto family_iter = families.begin(); family_iter != families.end(); family_iter++)
-      if (!family_iter->is_missing_sample(snp_samples))
+      if (!family_iter->is_missing_sample(pedigree_vcf_reader))
 	families_.push_back(*family_iter);
-    haplotype_tracker_ = new HaplotypeTracker(families_, snp_vcf_file, 500000);
+    pedigree_snp_vcf_file_ = snp_vcf_file;
+    create_haplotype_tracker();
   }
 
   void finish(){
@@ -1,6 +1,124 @@
+#include <algorithm>
+
 #include "snp_phasing_quality.h"
 #include "error.h"
 
+namespace {
+void add_snp_log_probs(char base, char qual, char base_one, char base_two, BaseQuality& base_qualities,
+		       double& log_p1, double& log_p2, int32_t& p1_match_count, int32_t& p2_match_count, int32_t& mismatch_count){
+  if (base == base_one){
+    log_p1 += base_qualities.log_prob_correct(qual);
+    log_p2 += base_qualities.log_prob_error(qual);
+    p1_match_count++;
+  }
+  else if (base == base_two){
+    log_p1 += base_qualities.log_prob_error(qual);
+    log_p2 += base_qualities.log_prob_correct(qual);
+    p2_match_count++;
+  }
+  else {
+    log_p1 += base_qualities.log_prob_error(qual);
+    log_p2 += base_qualities.log_prob_error(qual);
+    mismatch_count++;
+  }
+}
+
+/*
+ * Equivalent to add_log_phasing_probs(), where SNP_INDEX is the index of the tree's first SNP at or after the start of the alignment.
+ * Walks the alignment's CIGAR operations alongside the SNPs it overlaps, reading the bases and quality scores directly from its record
+ */
+void add_swept_log_phasing_probs(const BamAlignment& aln, const SNPTree& tree, size_t snp_index, BaseQuality& base_qualities,
+				 double& log_p1, double& log_p2, int32_t& p1_match_count, int32_t& p2_match_count, int32_t& mismatch_count){
+  // NOTE: GetEndPosition() returns a non-inclusive position, so only SNPs before it are overlapped by the read
+  size_t end_index = snp_index;
+  while (end_index < tree.size() && (int64_t)tree.position(end_index) < aln.GetEndPosition())
+    end_index++;
+  if (end_index == snp_index)
+    return;
+
+  CigarSpan cigar     = aln.CigarView();
+  SequenceView bases  = aln.QueryBasesView();
+  QualityView quals   = aln.QualitiesView();
+  assert(!cigar.empty());
+  int32_t pos = aln.Position(), cigar_index = 0, base_index = 0;
+  while (snp_index < end_index && cigar_index < cigar.size()){
+    int32_t snp_pos = tree.position(snp_index), length = cigar.length(cigar_index);
+    switch(cigar.type(cigar_index)){
+    case 'M': case '=': case 'X':
+      if (snp_pos < pos + length){
+	if (snp_pos - pos + base_index >= bases.size())
+	  printErrorAndDie("Invalid CIGAR string for the alignment of read " + std::string(aln.NameChars()));
+	add_snp_log_probs(bases[snp_pos - pos + base_index], quals[snp_pos - pos + base_index], tree.base_one(snp_index), tree.base_two(snp_index),
+			  base_qualities, log_p1, log_p2, p1_match_count, p2_match_count, mismatch_count);
+	snp_index++;
+      }
+      else {
+	pos        += length;
+	base_index += length;
+	cigar_index++;
+      }
+      break;
+    case 'D':
+      if (snp_pos < pos + length)
+	snp_index++;
+      else {
+	pos += length;
+	cigar_index++;
+      }
+      break;
+    case 'I':
+      base_index += length;
+      cigar_index++;
+      break;
+    case 'S':
+      // Ignore bases in soft clips
+      if (snp_pos < pos)
+	snp_index++;
+      else {
+	base_index += length;
+	cigar_index++;
+      }
+      break;
+    case 'H':
+      cigar_index++;
+      break;
+    default:
+      printErrorAndDie("Invalid CIGAR option encountered");
+      break;
+    }
+  }
+  assert(snp_index == end_index);
+}
+
+/*
+ * Adds the phasing log-likelihoods for each read in READS to the corresponding entries of LOG_P1S and LOG_P2S. The reads are visited
+ * in order of their start positions so that the index of each read's first SNP is found by advancing through the tree's SNPs once,
+ * rather than by separately searching the tree for each read
+ */
+void add_batch_log_phasing_probs(std::vector<BamAlignment>& reads, const SNPTree& tree, BaseQuality& base_qualities,
+				 std::vector<double>& log_p1s, std::vector<double>& log_p2s,
+				 int32_t& p1_match_count, int32_t& p2_match_count, int32_t& mismatch_count){
+  assert(log_p1s.size() == reads.size() && log_p2s.size() == reads.size());
+  if (tree.size() == 0)
+    return;
+  std::vector<int> order(reads.size());
+  for (unsigned int i = 0; i < reads.size(); i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](int a, int b){ return reads[a].Position() < reads[b].Position(); });
+
+  size_t snp_index = 0;
+  for (auto order_iter = order.begin(); order_iter != order.end(); order_iter++){
+    const BamAlignment& aln = reads[*order_iter];
+    while (snp_index < tree.size() && (int64_t)tree.position(snp_index) < aln.Position())
+      snp_index++;
+    if (snp_index == tree.size())
+      break;
+    add_swept_log_phasing_probs(aln, tree, snp_index, base_qualities, log_p1s[*order_iter], log_p2s[*order_iter],
+				p1_match_count, p2_match_count, mismatch_count);
+  }
+}
+}
+
 void printCigarString(BamAlignment& aln, std::ostream& out){
   for (unsigned int i = 0; i < aln.CigarData().size(); ++i)
     out << aln.CigarData()[i].Length << aln.CigarData()[i].Type;
@@ -75,25 +193,10 @@ void add_log_phasing_probs(BamAlignment& aln, SNPTree* tree, BaseQuality& base_q
   
     extract_bases_and_qualities(aln, snps, bases, quals);
     assert(snps.size() == bases.size());
-    for (unsigned int i = 0; i < snps.size(); ++i){
-      if (bases[i] != '-'){
-	if (bases[i] == snps[i].base_one()){
-	  log_p1 += base_qualities.log_prob_correct(quals[i]);
-	  log_p2 += base_qualities.log_prob_error(quals[i]);
-	  p1_match_count++;
-	}
-	else if (bases[i] == snps[i].base_two()){
-	  log_p1 += base_qualities.log_prob_error(quals[i]);
-	  log_p2 += base_qualities.log_prob_correct(quals[i]);
-	  p2_match_count++;
-	}
-	else {
-	  log_p1 += base_qualities.log_prob_error(quals[i]);
-	  log_p2 += base_qualities.log_prob_error(quals[i]);
-	  mismatch_count++;
-	}
-      }
-    }
+    for (unsigned int i = 0; i < snps.size(); ++i)
+      if (bases[i] != '-')
+	add_snp_log_probs(bases[i], quals[i], snps[i].base_one(), snps[i].base_two(), base_qualities,
+			  log_p1, log_p2, p1_match_count, p2_match_count, mismatch_count);
   }
 }
 
@@ -103,24 +206,22 @@ void calc_het_snp_factors(std::vector<BamAlignment>& str_reads, std::vector<BamA
 			  std::vector<double>& log_p1s, std::vector<double>& log_p2s, int32_t& match_count, int32_t& mismatch_count) {
   assert(str_reads.size() == mate_reads.size());
   int32_t p1_match_count = 0, p2_match_count = 0;
-  for (unsigned int i = 0; i < str_reads.size(); i++){
-    double log_p1 = 0.0, log_p2 = 0.0;
-    add_log_phasing_probs(str_reads[i],  snp_tree, base_qualities, log_p1, log_p2, p1_match_count, p2_match_count, mismatch_count);
-    add_log_phasing_probs(mate_reads[i], snp_tree, base_qualities, log_p1, log_p2, p1_match_count, p2_match_count, mismatch_count);
-    log_p1s.push_back(log_p1);
-    log_p2s.push_back(log_p2);
-  }
+
+  // Each pair's likelihoods accumulate the STR read's SNPs before its mate's, as when the reads are processed individually
+  std::vector<double> pair_log_p1s(str_reads.size(), 0.0), pair_log_p2s(str_reads.size(), 0.0);
+  add_batch_log_phasing_probs(str_reads,  *snp_tree, base_qualities, pair_log_p1s, pair_log_p2s, p1_match_count, p2_match_count, mismatch_count);
+  add_batch_log_phasing_probs(mate_reads, *snp_tree, base_qualities, pair_log_p1s, pair_log_p2s, p1_match_count, p2_match_count, mismatch_count);
+  log_p1s.insert(log_p1s.end(), pair_log_p1s.begin(), pair_log_p1s.end());
+  log_p2s.insert(log_p2s.end(), pair_log_p2s.begin(), pair_log_p2s.end());
   match_count += (p1_match_count + p2_match_count);
 }
 
 void calc_het_snp_factors(std::vector<BamAlignment>& str_reads, BaseQuality& base_qualities, SNPTree* snp_tree,
 			  std::vector<double>& log_p1s, std::vector<double>& log_p2s, int32_t& match_count, int32_t& mismatch_count){
   int32_t p1_match_count = 0, p2_match_count = 0;
-  for (unsigned int i = 0; i < str_reads.size(); i++){
-    double log_p1 = 0.0, log_p2 = 0.0;
-    add_log_phasing_probs(str_reads[i], snp_tree, base_qualities, log_p1, log_p2, p1_match_count, p2_match_count, mismatch_count);
-    log_p1s.push_back(log_p1);
-    log_p2s.push_back(log_p2);
-  }
+  std::vector<double> read_log_p1s(str_reads.size(), 0.0), read_log_p2s(str_reads.size(), 0.0);
+  add_batch_log_phasing_probs(str_reads, *snp_tree, base_qualities, read_log_p1s, read_log_p2s, p1_match_count, p2_match_count, mismatch_count);
+  log_p1s.insert(log_p1s.end(), read_log_p1s.begin(), read_log_p1s.end());
+  log_p2s.insert(log_p2s.end(), read_log_p2s.begin(), read_log_p2s.end());
   match_count += (p1_match_count + p2_match_count);
 }
@@ -10,10 +10,10 @@ std::ostream& operator<<(std::ostream& out, SNP& snp) {
   return out;
 }
 
-bool in_any_region(VCF::Variant& variant, const std::vector<Region>& skip_regions, int32_t skip_padding){
+bool in_any_region(int32_t position, const std::vector<Region>& skip_regions, int32_t skip_padding){
   for (auto region_iter = skip_regions.begin(); region_iter != skip_regions.end(); region_iter++)
-    if (variant.get_position() >= region_iter->start() - skip_padding)
-      if (variant.get_position() <= region_iter->stop() + skip_padding)
+    if (position >= region_iter->start() - skip_padding)
+      if (position <= region_iter->stop() + skip_padding)
 	return true;
   return false;
 }
@@ -26,60 +26,160 @@ void filter_snps(std::vector<SNP>& snps, std::set<int32_t>& bad_sites){
   snps.resize(insert_index);
 }
 
-bool create_snp_trees(const std::string& chrom, uint32_t start, uint32_t end, const std::vector<Region>& skip_regions, int32_t skip_padding, VCF::VCFReader* snp_vcf, HaplotypeTracker* tracker,
+void SNPVCFCursor::reset(const std::string& chrom, int32_t start, HaplotypeTracker* tracker){
+  sites_.clear();
+  if (tracker != tracker_ || (tracker != NULL && families_.empty())){
+    // The tracker's VCF may retain different samples, so the family members must be reindexed
+    families_.clear();
+    if (tracker != NULL){
+      families_ = tracker->families();
+      for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++)
+	family_iter->load_vcf_indices(*snp_vcf_);
+    }
+  }
+  chrom_        = chrom;
+  tracker_      = tracker;
+  window_start_ = start;
+  last_pos_     = 0;
+  if (source_ != NULL)
+    return;
+
+  // Locate the window in the panel, retrying without the chr prefix if necessary
+  if (panel_ != NULL){
+    panel_chrom_ = panel_->find_chrom(chrom);
+    if (panel_chrom_ == -1 && chrom.size() > 3 && chrom.substr(0, 3).compare("chr") == 0)
+      panel_chrom_ = panel_->find_chrom(chrom.substr(3));
+    chrom_found_ = (panel_chrom_ != -1);
+    exhausted_   = !chrom_found_;
+    if (chrom_found_){
+      next_row_ = panel_->lower_bound(panel_chrom_, start);
+      end_row_  = panel_->chrom_end(panel_chrom_);
+    }
+    return;
+  }
+
+  // Stream from the start of the window to the end of the chromosome, retrying without the chr prefix if necessary
+  chrom_found_ = snp_vcf_->set_region(chrom, start);
+  if (!chrom_found_ && chrom.size() > 3 && chrom.substr(0, 3).compare("chr") == 0)
+    chrom_found_ = snp_vcf_->set_region(chrom.substr(3), start);
+  exhausted_ = !chrom_found_;
+}
+
+void SNPVCFCursor::add_site(VCF::Variant& variant){
+  if (!variant.is_biallelic_snp())
+    return;
+
+  sites_.push_back(Site());
+  Site& site = sites_.back();
+  site.pos   = variant.get_position();
+
+  // When performing pedigree-based filtering, we need to identify sites with any Mendelian
+  // inconsistencies or missing genotypes as these won't be detected by the haplotype tracker
+  if (tracker_ != NULL){
+    int family_index = 0;
+    for (auto family_iter = families_.begin(); family_iter != families_.end(); ++family_iter, ++family_index)
+      if (family_iter->is_missing_genotype(variant) || !family_iter->is_mendelian(variant))
+	site.bad_families.push_back(family_index);
+  }
+
+  // Only the phased heterozygous calls are decoded, as homozygous and missing calls are uninformative for phasing
+  std::vector<int> sample_indices, gts_a, gts_b;
+  variant.get_phased_heterozygotes(sample_indices, gts_a, gts_b);
+  site.het_calls.reserve(sample_indices.size());
+  for (unsigned int i = 0; i < sample_indices.size(); i++){
+    char a1 = variant.get_allele(gts_a[i])[0];
+    char a2 = variant.get_allele(gts_b[i])[0];
+
+    // IMPORTANT NOTE: VCFs are 1-based, but BAMs are 0-based. Decrease VCF coordinate by 1 for consistency
+    site.het_calls.push_back(std::pair<int, SNP>(sample_indices[i], SNP(variant.get_position()-1, a1, a2)));
+  }
+}
+
+void SNPVCFCursor::add_panel_site(uint64_t row){
+  sites_.push_back(Site());
+  Site& site = sites_.back();
+  site.pos   = panel_->position(row);
+
+  std::vector<int> sample_indices, gts_a, gts_b;
+  panel_->get_phased_heterozygotes(row, sample_indices, gts_a, gts_b);
+  site.het_calls.reserve(sample_indices.size());
+  char bases[2] = {panel_->ref_base(row), panel_->alt_base(row)};
+  for (unsigned int i = 0; i < sample_indices.size(); i++)
+    site.het_calls.push_back(std::pair<int, SNP>(sample_indices[i], SNP(site.pos-1, bases[gts_a[i]], bases[gts_b[i]])));
+}
+
+bool SNPVCFCursor::seek(const std::string& chrom, int32_t start, int32_t end, HaplotypeTracker* tracker){
+  if (source_ != NULL){
+    // The tracker has already been advanced to this chromosome, so only the end of the window may need extending
+    assert(tracker == source_);
+    source_->extend_window(end);
+    while (!sites_.empty() && sites_.front().pos < start)
+      sites_.pop_front();
+    return true;
+  }
+
+  if (chrom.compare(chrom_) != 0 || start < window_start_ || tracker != tracker_)
+    reset(chrom, start, tracker);
+  if (!chrom_found_)
+    return false;
+
+  // Discard the sites that precede the window, as subsequent windows will start even further downstream
+  window_start_ = start;
+  while (!sites_.empty() && sites_.front().pos < start)
+    sites_.pop_front();
+
+  // Skip the panel rows between the previous window and this one, and read the rows up to the end of the window
+  if (panel_ != NULL){
+    assert(tracker == NULL);
+    if (next_row_ < end_row_ && panel_->position(next_row_) < start)
+      next_row_ = panel_->lower_bound(panel_chrom_, start);
+    for (; next_row_ < end_row_ && panel_->position(next_row_) <= end; ++next_row_)
+      add_panel_site(next_row_);
+    return true;
+  }
+
+  // Decode records until we've passed the end of the window
+  VCF::Variant variant;
+  while (!exhausted_ && last_pos_ <= end){
+    if (!snp_vcf_->get_next_variant(variant))
+      exhausted_ = true;
+    else {
+      last_pos_ = variant.get_position();
+      if (last_pos_ >= start)
+	add_site(variant);
+    }
+  }
+  return true;
+}
+
+bool create_snp_trees(const std::string& chrom, uint32_t start, uint32_t end, const std::vector<Region>& skip_regions, int32_t skip_padding, SNPVCFCursor* snp_cursor, HaplotypeTracker* tracker,
                       std::map<std::string, unsigned int>& sample_indices, std::vector<SNPTree*>& snp_trees, std::ostream& logger){
   logger << "Building SNP tree for region " << chrom << ":" << start << "-" << end << std::endl;
   assert(sample_indices.size() == 0 && snp_trees.size() == 0);
 
-  if (!snp_vcf->set_region(chrom, start, end)){
-    // Retry setting region if chr is in chromosome name
-    if (chrom.size() <= 3 || chrom.substr(0, 3).compare("chr") != 0 || !snp_vcf->set_region(chrom.substr(3), start, end))
-      return false;
-  }
+  if (!snp_cursor->seek(chrom, start, end, tracker))
+    return false;
 
   // Index samples
   unsigned int sample_count = 0;
-  const std::vector<std::string>& vcf_samples = snp_vcf->get_samples();
+  const std::vector<std::string>& vcf_samples = snp_cursor->get_samples();
   for (auto sample_iter = vcf_samples.begin(); sample_iter != vcf_samples.end(); sample_iter++)
     sample_indices[*sample_iter] = sample_count++;
 
   std::vector< std::set<int32_t> > bad_sites_by_family(tracker != NULL ? tracker->families().size() : 0);
 
-  // Iterate through all VCF entries
+  // Iterate through all SNPs in the window
   std::vector< std::vector<SNP> > snps_by_sample(vcf_samples.size());
-  VCF::Variant variant;
-  uint32_t locus_count = 0, skip_count = 0;
-  while (snp_vcf->get_next_variant(variant)){
-    //if (locus_count % 1000 == 0)   std::cout << "\rProcessing locus #" << locus_count << " (skipped " << skip_count << ") at position " << variant.position << std::flush;
-    if (!variant.is_biallelic_snp() || in_any_region(variant, skip_regions, skip_padding)){
-      skip_count++;
+  uint32_t locus_count = 0;
+  const std::deque<SNPVCFCursor::Site>& sites = snp_cursor->sites();
+  for (auto site_iter = sites.begin(); site_iter != sites.end() && site_iter->pos <= (int64_t)end; ++site_iter){
+    if (in_any_region(site_iter->pos, skip_regions, skip_padding))
       continue;
-    }
-
-    // When performing pedigree-based filtering, we need to identify sites with any Mendelian
-    // inconsistencies or missing genotypes as these won't be detected by the haplotype tracker
-    if (tracker != NULL){
-      const std::vector<NuclearFamily>& families = tracker->families();
-      int family_index = 0;
-      for (auto family_iter = families.begin(); family_iter != families.end(); ++family_iter, ++family_index)
-	if (family_iter->is_missing_genotype(variant) || !family_iter->is_mendelian(variant))
-	  bad_sites_by_family[family_index].insert(variant.get_position());
-    }
-
+    for (auto family_iter = site_iter->bad_families.begin(); family_iter != site_iter->bad_families.end(); ++family_iter)
+      bad_sites_by_family[*family_iter].insert(site_iter->pos);
+    for (auto call_iter = site_iter->het_calls.begin(); call_iter != site_iter->het_calls.end(); ++call_iter)
+      snps_by_sample[call_iter->first].push_back(call_iter->second);
     ++locus_count;
-    int gt_a, gt_b;
-    for (int i = 0; i < vcf_samples.size(); i++){
-      if (variant.sample_call_missing(i) || !variant.sample_call_phased(i))
-	continue;
-      variant.get_genotype(i, gt_a, gt_b);
-      if (gt_a != gt_b){
-	char a1 = variant.get_allele(gt_a)[0];
-	char a2 = variant.get_allele(gt_b)[0];
-
-	// IMPORTANT NOTE: VCFs are 1-based, but BAMs are 0-based. Decrease VCF coordinate by 1 for consistency
-	snps_by_sample[i].push_back(SNP(variant.get_position()-1, a1, a2));
-      }
-    }
   }
   logger << "Region contained a total of " << locus_count << " valid SNPs" << std::endl;
 
@@ -2,12 +2,14 @@
 #define SNP_TREE_H_
 
 #include <algorithm>
+#include <deque>
 #include <iostream>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "haplotype_tracker.h"
+#include "phased_snp_panel.h"
 #include "region.h"
 #include "vcf_reader.h"
 
@@ -43,118 +45,151 @@ class SNPSorter {
   }
 };
 
+/*
+ * Lookup structure for the heterozygous SNPs of a single sample. As SNPs are points rather than intervals,
+ * they're simply kept sorted by position in separate position and base arrays, so that construction is a single
+ * sort and each query is a binary search followed by a contiguous scan over the positions
+ */
 class SNPTree {
-    std::vector<SNP> snps_;
-    SNPTree* left_;
-    SNPTree* right_;
-    uint32_t center_;
+ private:
+  std::vector<uint32_t> positions_;
+  std::vector<char> bases_1_, bases_2_;
 
  public:
-    SNPTree(){
-      left_   = right_ = NULL;
-      center_ = 0;
+  SNPTree(){}
+
+  explicit SNPTree(std::vector<SNP>& snp_vals){
+    SNPSorter snp_sorter;
+    std::sort(snp_vals.begin(), snp_vals.end(), snp_sorter);
+    positions_.reserve(snp_vals.size());
+    bases_1_.reserve(snp_vals.size());
+    bases_2_.reserve(snp_vals.size());
+    for (auto snp_iter = snp_vals.begin(); snp_iter != snp_vals.end(); ++snp_iter){
+      positions_.push_back(snp_iter->pos());
+      bases_1_.push_back(snp_iter->base_one());
+      bases_2_.push_back(snp_iter->base_two());
     }
+  }
 
-    SNPTree(const SNPTree& other) {
-        center_ = other.center_;
-        snps_   = other.snps_;
-	left_   = (other.left_  ? new SNPTree(*other.left_)  : NULL);
-	right_  = (other.right_ ? new SNPTree(*other.right_) : NULL);
-    }
-    
-    SNPTree& operator=(const SNPTree& other) {
-      center_ = other.center_;
-      snps_   = other.snps_;
-      if (other.left_)
-	left_ = new SNPTree(*other.left_);
-      else {
-	if (left_) delete left_;
-	left_ = NULL;
-      }
-
-      if (other.right_)
-	right_ = new SNPTree(*other.right_);
-      else {
-	if (right_) delete right_;
-	right_ = NULL;
-      }
-      return *this;
-    }
+  /* Appends all SNPs with positions in [START, STOP] to OVERLAPPING in order of increasing position */
+  void findContained(uint32_t start, uint32_t stop, std::vector<SNP>& overlapping) const {
+    size_t index = std::lower_bound(positions_.begin(), positions_.end(), start) - positions_.begin();
+    for (; index < positions_.size() && positions_[index] <= stop; ++index)
+      overlapping.push_back(SNP(positions_[index], bases_1_[index], bases_2_[index]));
+  }
 
- SNPTree(std::vector<SNP>& snp_vals,
-	 unsigned int depth = 16,
-	 unsigned int minbucket = 64,
-	 int leftextent  = 0,
-	 int rightextent = 0,
-	 unsigned int maxbucket = 512) {
-   left_ = right_ = NULL;
-   
-   --depth;
-   SNPSorter snp_sorter;
-   if (depth == 0 || (snp_vals.size() < minbucket && snp_vals.size() < maxbucket)) {
-     std::sort(snp_vals.begin(), snp_vals.end(), snp_sorter);
-     snps_ = snp_vals;
-   } else {
-     if (leftextent == 0 && rightextent == 0)
-       std::sort(snp_vals.begin(), snp_vals.end(), snp_sorter); // sort SNPs by position
-     
-     int leftp = 0, rightp = 0, centerp = 0;
-     if (leftextent || rightextent) {
-       leftp  = leftextent;
-       rightp = rightextent;
-     } else {
-       leftp  = snp_vals.front().pos();
-       rightp = snp_vals.back().pos();
-     }
-     
-     centerp = snp_vals.at(snp_vals.size() / 2).pos();
-     center_ = centerp;
-     
-     std::vector<SNP> lefts, rights;
-     for (auto snp_iter = snp_vals.begin(); snp_iter != snp_vals.end(); ++snp_iter){
-       SNP snp = *snp_iter;
-       if (snp.pos() < center_)
-	 lefts.push_back(snp);
-       else if (snp.pos() > center_)
-	 rights.push_back(snp);
-       else
-	 snps_.push_back(snp);
-     }
-     
-     if (!lefts.empty())
-       left_ = new SNPTree(lefts, depth, minbucket, leftp, centerp);
-     if (!rights.empty())
-       right_ = new SNPTree(rights, depth, minbucket, centerp, rightp);
-   }
- }
-
- void findContained(uint32_t start, uint32_t stop, std::vector<SNP>& overlapping) const {
-   if (left_ && start <= center_)
-     left_->findContained(start, stop, overlapping);
-   
-   if (!snps_.empty() && ! (stop < snps_.front().pos())) {
-     for (auto snp_iter = snps_.begin(); snp_iter != snps_.end(); ++snp_iter)
-       if (snp_iter->pos() >= start && snp_iter->pos() <= stop)
-	 overlapping.push_back(*snp_iter);
-   }
-   
-   if (right_ && stop >= center_)
-     right_->findContained(start, stop, overlapping);
- }
- 
- ~SNPTree(void) {
-   // traverse the left and right
-   // delete them all the way down
-   if (left_)
-     delete left_;
-   if (right_)
-     delete right_;
- }
- 
+  // Access to the SNPs by their index in order of position, for callers that sweep through them
+  size_t size()                   const { return positions_.size(); }
+  uint32_t position(size_t index) const { return positions_[index]; }
+  char base_one(size_t index)     const { return bases_1_[index];   }
+  char base_two(size_t index)     const { return bases_2_[index];   }
 };
 
+/*
+ * Forward-only cursor over the biallelic SNPs in a phased VCF. Loci are typically analyzed in increasing order
+ * along each chromosome and the SNP windows of neighboring loci overlap, so rather than issuing a new tabix query
+ * and reparsing the overlapping records for every locus, the cursor streams through each chromosome once and
+ * retains only the decoded records that the current window and any subsequent windows could still require.
+ * A new query is only issued when the chromosome changes or a window starts before the previous one.
+ *
+ * When pedigree-based filtering is enabled, the cursor can instead listen to the HaplotypeTracker, whose window
+ * contains the cursor's. The cursor then receives the records as the tracker decodes them, so that each SNP is
+ * only read and decoded once. Alternatively, the cursor can read the SNPs from a phased SNP panel, in which case the window
+ * is located using a binary search and the records before it are never read
+ */
+class SNPVCFCursor : public SNPListener {
+ public:
+  struct Site {
+    int32_t pos;                                  // 1-based VCF position
+    std::vector< std::pair<int, SNP> > het_calls; // VCF sample index and SNP for each phased heterozygous call
+    std::vector<int> bad_families;                // Families with a missing genotype or Mendelian inconsistency
+  };
+
+ private:
+  VCF::VCFReader* snp_vcf_;
+  const PhasedSNPPanel* panel_; // Panel from which the cursor reads the SNPs, or NULL if they're read from a VCF
+  int panel_chrom_;             // Index of the current chromosome in the panel
+  uint64_t next_row_, end_row_; // Panel rows for the next SNP to read and the end of the current chromosome
+  HaplotypeTracker* source_;  // Tracker whose records the cursor receives, or NULL if the cursor reads SNP_VCF_ itself
+  HaplotypeTracker* tracker_; // Tracker whose families were used to flag each site's pedigree inconsistencies
+  std::vector<NuclearFamily> families_; // The tracker's families, with their sample indices in this cursor's VCF
+  std::string chrom_;
+  bool chrom_found_, exhausted_;
+  int32_t window_start_, last_pos_;
+  std::deque<Site> sites_;
+
+  void reset(const std::string& chrom, int32_t start, HaplotypeTracker* tracker);
+
+  void add_site(VCF::Variant& variant);
+
+  void add_panel_site(uint64_t row);
+
+ public:
+  explicit SNPVCFCursor(VCF::VCFReader* snp_vcf){
+    snp_vcf_      = snp_vcf;
+    panel_        = NULL;
+    panel_chrom_  = -1;
+    next_row_     = end_row_ = 0;
+    source_       = NULL;
+    tracker_      = NULL;
+    chrom_found_  = false;
+    exhausted_    = true;
+    window_start_ = 0;
+    last_pos_     = 0;
+  }
+
+  /* Creates a cursor that receives its SNPs from the tracker. SEEK() must then be provided the same tracker */
+  explicit SNPVCFCursor(HaplotypeTracker* source){
+    snp_vcf_      = &source->snp_vcf();
+    panel_        = NULL;
+    panel_chrom_  = -1;
+    next_row_     = end_row_ = 0;
+    source_       = source;
+    tracker_      = NULL;
+    chrom_found_  = true;
+    exhausted_    = false;
+    window_start_ = 0;
+    last_pos_     = 0;
+    reset("", 0, source);
+    source->set_listener(this);
+  }
+
+  /* Creates a cursor that reads its SNPs from the panel, which doesn't support pedigree-based filtering */
+  explicit SNPVCFCursor(const PhasedSNPPanel* panel){
+    snp_vcf_      = NULL;
+    panel_        = panel;
+    panel_chrom_  = -1;
+    next_row_     = end_row_ = 0;
+    source_       = NULL;
+    tracker_      = NULL;
+    chrom_found_  = false;
+    exhausted_    = true;
+    window_start_ = 0;
+    last_pos_     = 0;
+  }
+
+  ~SNPVCFCursor(){
+    if (source_ != NULL)
+      source_->set_listener(NULL);
+  }
+
+  void reset_snps(){ sites_.clear(); }
+
+  void add_snp(VCF::Variant& variant){ add_site(variant); }
+
+  const std::vector<std::string>& get_samples(){ return (panel_ != NULL ? panel_->get_samples() : snp_vcf_->get_samples()); }
+
+  /*
+   * Advances the cursor to the 1-based window START-END on CHROM, after which sites() begins with the first
+   * SNP at or after START and contains every SNP up to and including END. Returns false iff the VCF has no
+   * entries for the chromosome
+   */
+  bool seek(const std::string& chrom, int32_t start, int32_t end, HaplotypeTracker* tracker);
+
+  const std::deque<Site>& sites() const { return sites_; }
+};
 
-bool create_snp_trees(const std::string& chrom, uint32_t start, uint32_t end, const std::vector<Region>& skip_regions, int32_t skip_padding, VCF::VCFReader* snp_vcf, HaplotypeTracker* tracker,
+bool create_snp_trees(const std::string& chrom, uint32_t start, uint32_t end, const std::vector<Region>& skip_regions, int32_t skip_padding, SNPVCFCursor* snp_cursor, HaplotypeTracker* tracker,
                       std::map<std::string, unsigned int>& sample_indices, std::vector<SNPTree*>& snp_trees, std::ostream& logger);
 
 void destroy_snp_trees(std::vector<SNPTree*>& snp_trees);
@@ -0,0 +1,171 @@
+#include "str_read_store.h"
+
+#include <string.h>
+#include <sstream>
+
+#include "error.h"
+
+namespace {
+const char MAGIC[]       = "HSTRREAD";
+const size_t MAGIC_LEN   = 8;
+const uint32_t VERSION   = 1;
+
+template<typename T> void append_value(std::string& buffer, T value){
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T> bool read_value(const char*& ptr, const char* end, T& value){
+  if (ptr + sizeof(T) > end)
+    return false;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return true;
+}
+
+void append_reads(std::string& buffer, const std::vector<BamAlignment>& alns){
+  append_value<uint32_t>(buffer, alns.size());
+  for (auto aln_iter = alns.begin(); aln_iter != alns.end(); aln_iter++)
+    aln_iter->Serialize(buffer);
+}
+
+bool read_reads(const char*& ptr, const char* end, std::vector<BamAlignment>& alns){
+  uint32_t num_alns;
+  if (!read_value(ptr, end, num_alns))
+    return false;
+  alns.clear();
+  alns.resize(num_alns);
+  for (uint32_t i = 0; i < num_alns; i++)
+    if (!alns[i].Deserialize(ptr, end))
+      return false;
+  return true;
+}
+}
+
+StrReadStoreWriter::StrReadStoreWriter(const std::string& path) : path_(path){
+  output_ = bgzf_open(path.c_str(), "w");
+  if (output_ == NULL)
+    printErrorAndDie("Failed to open the STR read store output file " + path);
+  index_.open((path + ".idx").c_str());
+  if (!index_.is_open())
+    printErrorAndDie("Failed to open the STR read store index file " + path + ".idx");
+
+  std::string header(MAGIC, MAGIC_LEN);
+  append_value<uint32_t>(header, VERSION);
+  append_value<uint32_t>(header, sizeof(bam1_core_t));
+  if (bgzf_write(output_, header.data(), header.size()) != (ssize_t)header.size() || bgzf_flush(output_) != 0)
+    printErrorAndDie("Failed to write to the STR read store output file " + path);
+}
+
+StrReadStoreWriter::~StrReadStoreWriter(){
+  index_.close();
+  if (bgzf_close(output_) != 0)
+    printErrorAndDie("Failed to close the STR read store output file " + path_);
+}
+
+void StrReadStoreWriter::write_locus(const Region& region, bool too_many_reads, const std::vector<std::string>& rg_names,
+				     const std::vector< std::vector<BamAlignment> >& paired_strs_by_rg,
+				     const std::vector< std::vector<BamAlignment> >& mate_pairs_by_rg,
+				     const std::vector< std::vector<BamAlignment> >& unpaired_strs_by_rg){
+  // Serialize the record before acquiring the lock so that threads only contend for the write itself
+  std::string record;
+  append_value<uint64_t>(record, 0);
+  append_value<uint8_t>(record, too_many_reads ? 1 : 0);
+  append_value<uint32_t>(record, rg_names.size());
+  for (size_t i = 0; i < rg_names.size(); i++){
+    append_value<uint32_t>(record, rg_names[i].size());
+    record.append(rg_names[i]);
+    append_reads(record, paired_strs_by_rg[i]);
+    append_reads(record, mate_pairs_by_rg[i]);
+    append_reads(record, unpaired_strs_by_rg[i]);
+  }
+  uint64_t record_length = record.size() - sizeof(uint64_t);
+  memcpy(&record[0], &record_length, sizeof(uint64_t));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64_t offset = bgzf_tell(output_);
+  if (bgzf_write(output_, record.data(), record.size()) != (ssize_t)record.size() || bgzf_flush(output_) != 0)
+    printErrorAndDie("Failed to write to the STR read store output file " + path_);
+  index_ << region.chrom() << "\t" << region.start() << "\t" << region.stop() << "\t" << offset << "\n" << std::flush;
+}
+
+StrReadStoreReader::StrReadStoreReader(const std::string& path) : path_(path){
+  input_ = bgzf_open(path.c_str(), "r");
+  if (input_ == NULL)
+    printErrorAndDie("Failed to open the STR read store file " + path);
+
+  char header[MAGIC_LEN + 2*sizeof(uint32_t)];
+  if (bgzf_read(input_, header, sizeof(header)) != (ssize_t)sizeof(header) || memcmp(header, MAGIC, MAGIC_LEN) != 0)
+    printErrorAndDie("File " + path + " is not an STR read store file");
+  const char* ptr = header + MAGIC_LEN;
+  uint32_t version, core_size;
+  read_value(ptr, header + sizeof(header), version);
+  read_value(ptr, header + sizeof(header), core_size);
+  if (version != VERSION || core_size != sizeof(bam1_core_t))
+    printErrorAndDie("STR read store file " + path + " was generated by an incompatible version of HipSTR. Please delete it and rerun the analysis");
+
+  std::ifstream index((path + ".idx").c_str());
+  if (!index.is_open())
+    printErrorAndDie("Failed to open the STR read store index file " + path + ".idx");
+  std::string line;
+  while (std::getline(index, line)){
+    std::istringstream iss(line);
+    std::string chrom;
+    int32_t start, stop;
+    int64_t offset;
+    if (!(iss >> chrom >> start >> stop >> offset))
+      printErrorAndDie("Improperly formatted line in the STR read store index file " + path + ".idx: " + line);
+    offsets_[std::tuple<std::string, int32_t, int32_t>(chrom, start, stop)] = offset;
+  }
+  index.close();
+}
+
+StrReadStoreReader::~StrReadStoreReader(){
+  bgzf_close(input_);
+}
+
+bool StrReadStoreReader::has_locus(const Region& region) const {
+  return offsets_.find(std::tuple<std::string, int32_t, int32_t>(region.chrom(), region.start(), region.stop())) != offsets_.end();
+}
+
+bool StrReadStoreReader::read_locus(const Region& region, bool& too_many_reads, std::vector<std::string>& rg_names,
+				    std::vector< std::vector<BamAlignment> >& paired_strs_by_rg,
+				    std::vector< std::vector<BamAlignment> >& mate_pairs_by_rg,
+				    std::vector< std::vector<BamAlignment> >& unpaired_strs_by_rg){
+  auto offset_iter = offsets_.find(std::tuple<std::string, int32_t, int32_t>(region.chrom(), region.start(), region.stop()));
+  if (offset_iter == offsets_.end())
+    return false;
+
+  std::string record;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t record_length;
+    if (bgzf_seek(input_, offset_iter->second, SEEK_SET) != 0
+	|| bgzf_read(input_, &record_length, sizeof(uint64_t)) != (ssize_t)sizeof(uint64_t))
+      printErrorAndDie("Failed to read the record for region " + region.chrom() + ":" + std::to_string(region.start()) + "-" + std::to_string(region.stop()) + " from the STR read store file " + path_);
+    record.resize(record_length);
+    if (bgzf_read(input_, &record[0], record_length) != (ssize_t)record_length)
+      printErrorAndDie("STR read store file " + path_ + " is truncated");
+  }
+
+  const char* ptr = record.data();
+  const char* end = ptr + record.size();
+  uint8_t too_many;
+  uint32_t num_samples;
+  if (!read_value(ptr, end, too_many) || !read_value(ptr, end, num_samples))
+    printErrorAndDie("STR read store file " + path_ + " is truncated");
+  too_many_reads = (too_many != 0);
+  rg_names.resize(num_samples);
+  paired_strs_by_rg.resize(num_samples);
+  mate_pairs_by_rg.resize(num_samples);
+  unpaired_strs_by_rg.resize(num_samples);
+  for (uint32_t i = 0; i < num_samples; i++){
+    uint32_t name_len;
+    if (!read_value(ptr, end, name_len) || ptr + name_len > end)
+      printErrorAndDie("STR read store file " + path_ + " is truncated");
+    rg_names[i].assign(ptr, name_len);
+    ptr += name_len;
+    if (!read_reads(ptr, end, paired_strs_by_rg[i]) || !read_reads(ptr, end, mate_pairs_by_rg[i]) || !read_reads(ptr, end, unpaired_strs_by_rg[i]))
+      printErrorAndDie("STR read store file " + path_ + " is truncated");
+  }
+  return true;
+}
@@ -0,0 +1,86 @@
+#ifndef STR_READ_STORE_H_
+#define STR_READ_STORE_H_
+
+#include <stdint.h>
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "htslib/bgzf.h"
+
+#include "bam_io.h"
+#include "region.h"
+
+/*
+ * On-disk store of the reads that HipSTR extracted for each locus after filtering, downsampling and PCR duplicate removal,
+ * grouped by sample. Because extracting these reads from the BAMs often dominates the runtime of a rerun with different
+ * genotyping options, a subsequent run can load them from the store and proceed directly to genotyping.
+ *
+ * The store is a BGZF-compressed file together with a tab-delimited index (PATH + ".idx") containing the chromosome, start,
+ * stop and virtual file offset of each locus' record. Index lines are only added once a record has been flushed, so the
+ * loci written by an interrupted run can still be loaded.
+ *
+ * File layout (all integers little-endian):
+ *   header:   magic "HSTRREAD", uint32 version, uint32 size of the fixed-length BAM record fields
+ *   records:  uint64 record length, uint8 too many reads flag, uint32 number of samples, then for each sample
+ *             its name and its paired STR reads, their mate pairs and its unpaired STR reads
+ *             Names are stored as a uint32 length and the characters, and each read list as a uint32 length
+ *             and the reads in BamAlignment::Serialize() format
+ */
+class StrReadStoreWriter {
+ private:
+  BGZF* output_;
+  std::ofstream index_;
+  std::string path_;
+  std::mutex mutex_;
+
+ public:
+  explicit StrReadStoreWriter(const std::string& path);
+
+  ~StrReadStoreWriter();
+
+  /* Adds the reads for the locus to the store. Thread-safe */
+  void write_locus(const Region& region, bool too_many_reads, const std::vector<std::string>& rg_names,
+		   const std::vector< std::vector<BamAlignment> >& paired_strs_by_rg,
+		   const std::vector< std::vector<BamAlignment> >& mate_pairs_by_rg,
+		   const std::vector< std::vector<BamAlignment> >& unpaired_strs_by_rg);
+
+  StrReadStoreWriter(const StrReadStoreWriter&)            = delete;
+  StrReadStoreWriter& operator=(const StrReadStoreWriter&) = delete;
+};
+
+class StrReadStoreReader {
+ private:
+  BGZF* input_;
+  std::string path_;
+  std::map<std::tuple<std::string, int32_t, int32_t>, int64_t> offsets_;
+  std::mutex mutex_;
+
+ public:
+  explicit StrReadStoreReader(const std::string& path);
+
+  ~StrReadStoreReader();
+
+  int64_t num_loci() const { return offsets_.size(); }
+
+  /* Returns true iff the store contains the reads for the locus */
+  bool has_locus(const Region& region) const;
+
+  /*
+   * Loads the reads for the locus into the provided vectors, replacing their contents. Returns false
+   * if the locus isn't in the store, in which case the vectors are unmodified. Thread-safe
+   */
+  bool read_locus(const Region& region, bool& too_many_reads, std::vector<std::string>& rg_names,
+		  std::vector< std::vector<BamAlignment> >& paired_strs_by_rg,
+		  std::vector< std::vector<BamAlignment> >& mate_pairs_by_rg,
+		  std::vector< std::vector<BamAlignment> >& unpaired_strs_by_rg);
+
+  StrReadStoreReader(const StrReadStoreReader&)            = delete;
+  StrReadStoreReader& operator=(const StrReadStoreReader&) = delete;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include <stdio.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "error.h"
+#include "stutter_model_db.h"
+
+StutterModelDatabase::StutterModelDatabase(const std::string& path){
+  path_ = path;
+  std::ifstream input(path.c_str());
+  if (!input.is_open())
+    return;
+
+  std::string line;
+  while (std::getline(input, line)){
+    if (line.empty())
+      continue;
+    std::istringstream ss(line);
+    std::string chrom, motif;
+    int32_t start, end;
+    int num_reads;
+    if (!(ss >> chrom >> start >> end >> motif >> num_reads))
+      printErrorAndDie("Improperly formatted line in the stutter model database " + path + ":\n\t" + line);
+    StutterModel* model = StutterModel::read(ss);
+    LocusKey key(chrom, start, end, motif);
+    auto entry_iter = entries_.find(key);
+    if (entry_iter != entries_.end())
+      delete entry_iter->second.model;
+    entries_[key] = Entry{model, num_reads};
+  }
+  input.close();
+}
+
+void StutterModelDatabase::clear_entries(std::map<LocusKey, Entry>& entries){
+  for (auto entry_iter = entries.begin(); entry_iter != entries.end(); entry_iter++)
+    delete entry_iter->second.model;
+  entries.clear();
+}
+
+const StutterModelDatabase::Entry* StutterModelDatabase::lookup(const Region& region, const std::string& motif) const {
+  auto entry_iter = entries_.find(LocusKey(region.chrom(), region.start(), region.stop(), motif));
+  return (entry_iter == entries_.end() ? NULL : &(entry_iter->second));
+}
+
+void StutterModelDatabase::update(const Region& region, const std::string& motif, StutterModel* model, int num_reads){
+  std::lock_guard<std::mutex> lock(mutex_);
+  LocusKey key(region.chrom(), region.start(), region.stop(), motif);
+  auto update_iter = updates_.find(key);
+  if (update_iter != updates_.end())
+    delete update_iter->second.model;
+  updates_[key] = Entry{model->copy(), num_reads};
+}
+
+void StutterModelDatabase::save(){
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<LocusKey, Entry> merged(entries_);
+  for (auto update_iter = updates_.begin(); update_iter != updates_.end(); update_iter++)
+    merged[update_iter->first] = update_iter->second;
+
+  std::string tmp_path = path_ + ".tmp";
+  std::ofstream output(tmp_path.c_str());
+  if (!output.is_open())
+    printErrorAndDie("Failed to open the stutter model database file " + tmp_path);
+  for (auto entry_iter = merged.begin(); entry_iter != merged.end(); entry_iter++){
+    output << std::get<0>(entry_iter->first) << "\t" << std::get<1>(entry_iter->first) << "\t" << std::get<2>(entry_iter->first)
+	   << "\t" << std::get<3>(entry_iter->first) << "\t" << entry_iter->second.num_reads << "\t";
+    entry_iter->second.model->write(output);
+  }
+  output.close();
+  if (output.fail())
+    printErrorAndDie("Failed to write the stutter model database file " + tmp_path);
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0)
+    printErrorAndDie("Failed to replace the stutter model database file " + path_);
+}
@@ -0,0 +1,68 @@
+#ifndef STUTTER_MODEL_DB_H_
+#define STUTTER_MODEL_DB_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include "region.h"
+#include "stutter_model.h"
+
+/*
+ * Persistent database of the stutter models learned across runs. Unlike the --stutter-in file, whose models are only applied to loci
+ * with identical coordinates, each entry is keyed by a fingerprint of the locus: its chromosome, start, end and the reference repeat
+ * motif (the first PERIOD bases of the STR), so that an entry isn't applied if the reference at its coordinates has changed.
+ * Each entry also records the number of informative reads used to train the model.
+ *
+ * The database is a tab-delimited text file without a header in which each line contains
+ *   CHROM  START  END  MOTIF  NUM_READS  IGEOM  IDOWN  IUP  OGEOM  ODOWN  OUP  PERIOD
+ *
+ * The entries loaded from the file are immutable during a run, so that they can be queried by any thread. Newly trained models are
+ * recorded separately and replace the corresponding entries when the database is saved
+ */
+class StutterModelDatabase {
+ public:
+  struct Entry {
+    StutterModel* model;
+    int num_reads;
+  };
+
+ private:
+  typedef std::tuple<std::string, int32_t, int32_t, std::string> LocusKey;
+
+  std::string path_;
+  std::map<LocusKey, Entry> entries_;
+  std::map<LocusKey, Entry> updates_;
+  std::mutex mutex_;
+
+  static void clear_entries(std::map<LocusKey, Entry>& entries);
+
+ public:
+  /* Loads the entries in the file at PATH. If the file doesn't exist, the database is initially empty */
+  explicit StutterModelDatabase(const std::string& path);
+
+  ~StutterModelDatabase(){
+    clear_entries(entries_);
+    clear_entries(updates_);
+  }
+
+  /* Returns the entry loaded for the locus, or NULL if there isn't one */
+  const Entry* lookup(const Region& region, const std::string& motif) const;
+
+  /* Records a model trained using NUM_READS informative reads, replacing any existing entry for the locus when saved. Thread-safe */
+  void update(const Region& region, const std::string& motif, StutterModel* model, int num_reads);
+
+  int num_entries() const { return entries_.size(); }
+  int num_updates() const { return updates_.size(); }
+
+  /* Rewrites the database file with the loaded entries and the updates, replacing the file only once it has been fully written */
+  void save();
+
+  StutterModelDatabase(const StutterModelDatabase&)            = delete;
+  StutterModelDatabase& operator=(const StutterModelDatabase&) = delete;
+};
+
+#endif
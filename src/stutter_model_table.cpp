@@ -0,0 +1,225 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "error.h"
+#include "stutter_model_table.h"
+
+namespace {
+const char MAGIC[]     = "HSTRSTUT";
+const size_t MAGIC_LEN = 8;
+const uint32_t VERSION = 1;
+const size_t HEADER_LEN = MAGIC_LEN + 2*sizeof(uint32_t) + 2*sizeof(uint64_t);
+
+template<typename T>
+void append_value(std::string& output, T value){
+  output.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+T read_value(const char*& ptr){
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return value;
+}
+
+bool is_little_endian(){
+  uint16_t value = 1;
+  return *reinterpret_cast<uint8_t*>(&value) == 1;
+}
+}
+
+void StutterModelTable::Builder::add(const std::string& chrom, int32_t start, int32_t end, StutterModel& model){
+  Entry entry;
+  entry.chrom                   = chrom;
+  entry.record.start            = start;
+  entry.record.end              = end;
+  entry.record.period           = model.period();
+  entry.record.padding          = 0;
+  entry.record.in_geom          = model.get_parameter(true,  'P');
+  entry.record.in_down          = model.get_parameter(true,  'D');
+  entry.record.in_up            = model.get_parameter(true,  'U');
+  entry.record.out_geom         = model.get_parameter(false, 'P');
+  entry.record.out_down         = model.get_parameter(false, 'D');
+  entry.record.out_up           = model.get_parameter(false, 'U');
+  entries_.push_back(entry);
+}
+
+void StutterModelTable::Builder::add_text_models(std::istream& input){
+  std::string chrom;
+  int32_t start, end;
+  while (input >> chrom >> start >> end){
+    std::string line;
+    std::getline(input, line);
+    std::istringstream ss(line);
+    Entry entry;
+    entry.chrom          = chrom;
+    entry.record.start   = start;
+    entry.record.end     = end;
+    entry.record.padding = 0;
+    if (!(ss >> entry.record.in_geom >> entry.record.in_down >> entry.record.in_up
+	  >> entry.record.out_geom >> entry.record.out_down >> entry.record.out_up >> entry.record.period))
+      printErrorAndDie("Improperly formatted stutter model file");
+    if (entry.record.period < 1)
+      printErrorAndDie("Improperly formatted stutter model file. One or more entries have a motif length < 1");
+    if (entry.record.period > 9)
+      printErrorAndDie("Improperly formatted stutter model file. One or more entries have a motif length > 9");
+    entries_.push_back(entry);
+  }
+}
+
+void StutterModelTable::Builder::serialize(std::string& output){
+  if (!is_little_endian())
+    printErrorAndDie("Stutter model tables are only supported on little-endian platforms");
+
+  // Only the first model for each locus is retained, as when the models were stored in a map
+  std::stable_sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b){
+      int cmp = a.chrom.compare(b.chrom);
+      if (cmp != 0)
+	return cmp < 0;
+      if (a.record.start != b.record.start)
+	return a.record.start < b.record.start;
+      return a.record.end < b.record.end;
+    });
+  std::vector<ChromEntry> chroms;
+  std::vector<Record> records;
+  std::string names;
+  for (size_t i = 0; i < entries_.size(); i++){
+    if (i > 0 && entries_[i].chrom == entries_[i-1].chrom && entries_[i].record.start == entries_[i-1].record.start
+	&& entries_[i].record.end == entries_[i-1].record.end)
+      continue;
+    if (chroms.empty() || entries_[i].chrom != entries_[i-1].chrom){
+      ChromEntry chrom = {records.size(), 0, names.size(), entries_[i].chrom.size()};
+      chroms.push_back(chrom);
+      names.append(entries_[i].chrom);
+    }
+    records.push_back(entries_[i].record);
+    chroms.back().num_records++;
+  }
+
+  output.append(MAGIC, MAGIC_LEN);
+  append_value<uint32_t>(output, VERSION);
+  append_value<uint32_t>(output, chroms.size());
+  append_value<uint64_t>(output, records.size());
+  append_value<uint64_t>(output, names.size());
+  output.append(reinterpret_cast<const char*>(chroms.data()),  chroms.size()*sizeof(ChromEntry));
+  output.append(reinterpret_cast<const char*>(records.data()), records.size()*sizeof(Record));
+  output.append(names);
+}
+
+bool StutterModelTable::init(const char* data, size_t size){
+  if (size < HEADER_LEN || memcmp(data, MAGIC, MAGIC_LEN) != 0)
+    return false;
+  const char* ptr = data + MAGIC_LEN;
+  if (read_value<uint32_t>(ptr) != VERSION)
+    return false;
+  num_chroms_          = read_value<uint32_t>(ptr);
+  uint64_t num_records = read_value<uint64_t>(ptr);
+  uint64_t names_len   = read_value<uint64_t>(ptr);
+  if (HEADER_LEN + num_chroms_*sizeof(ChromEntry) + num_records*sizeof(Record) + names_len != size)
+    return false;
+
+  // The records are naturally aligned, as the header and chromosome entries are multiples of 8 bytes
+  chroms_  = reinterpret_cast<const ChromEntry*>(data + HEADER_LEN);
+  records_ = reinterpret_cast<const Record*>(chroms_ + num_chroms_);
+  names_   = reinterpret_cast<const char*>(records_ + num_records);
+  return true;
+}
+
+StutterModelTable::StutterModelTable(const std::string& path){
+  data_ = NULL;
+  size_ = 0;
+  if (!is_little_endian())
+    printErrorAndDie("Stutter model tables are only supported on little-endian platforms");
+
+  if (is_binary(path)){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st_buf;
+    if (fd == -1 || fstat(fd, &st_buf) != 0){
+      if (fd != -1)
+	close(fd);
+      printErrorAndDie("Failed to open input file for stutter models. Filename = " + path);
+    }
+    size_ = st_buf.st_size;
+    void* mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+      printErrorAndDie("Failed to memory-map the stutter model table " + path);
+    data_ = static_cast<const char*>(mapping);
+    if (!init(data_, size_))
+      printErrorAndDie("Invalid or truncated binary stutter model table " + path);
+    return;
+  }
+
+  std::ifstream input(path.c_str());
+  if (!input.is_open())
+    printErrorAndDie("Failed to open input file for stutter models. Filename = " + path);
+  Builder builder;
+  builder.add_text_models(input);
+  builder.serialize(buffer_);
+  if (!init(buffer_.data(), buffer_.size()))
+    printErrorAndDie("Failed to construct the stutter model table for " + path);
+}
+
+StutterModelTable::~StutterModelTable(){
+  if (data_ != NULL)
+    munmap(const_cast<char*>(data_), size_);
+}
+
+bool StutterModelTable::is_binary(const std::string& path){
+  std::ifstream input(path.c_str(), std::ifstream::binary);
+  char magic[MAGIC_LEN];
+  return input.read(magic, MAGIC_LEN) && memcmp(magic, MAGIC, MAGIC_LEN) == 0;
+}
+
+void StutterModelTable::write(Builder& builder, const std::string& path){
+  std::string data;
+  builder.serialize(data);
+  std::stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid();
+  FILE* output = fopen(tmp_path.str().c_str(), "wb");
+  if (output == NULL)
+    printErrorAndDie("Failed to open " + tmp_path.str() + " to write the stutter model table");
+  bool success = (fwrite(data.data(), 1, data.size(), output) == data.size());
+  success &= (fclose(output) == 0);
+  if (!success){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to write the stutter model table to " + tmp_path.str());
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0){
+    unlink(tmp_path.str().c_str());
+    printErrorAndDie("Failed to rename " + tmp_path.str() + " to " + path);
+  }
+}
+
+StutterModel* StutterModelTable::lookup(const Region& region) const {
+  const ChromEntry* chrom_end  = chroms_ + num_chroms_;
+  const ChromEntry* chrom_iter = std::lower_bound(chroms_, chrom_end, region.chrom(), [&](const ChromEntry& entry, const std::string& chrom){
+      return region.chrom().compare(0, std::string::npos, names_ + entry.name_offset, entry.name_length) > 0;
+    });
+  if (chrom_iter == chrom_end || region.chrom().compare(0, std::string::npos, names_ + chrom_iter->name_offset, chrom_iter->name_length) != 0)
+    return NULL;
+
+  const Record* record_end  = records_ + chrom_iter->first_record + chrom_iter->num_records;
+  const Record* record_iter = std::lower_bound(records_ + chrom_iter->first_record, record_end, region, [](const Record& record, const Region& key){
+      if (record.start != key.start())
+	return record.start < key.start();
+      return record.end < key.stop();
+    });
+  if (record_iter == record_end || record_iter->start != region.start() || record_iter->end != region.stop())
+    return NULL;
+  return new StutterModel(record_iter->in_geom,  record_iter->in_up,  record_iter->in_down,
+			  record_iter->out_geom, record_iter->out_up, record_iter->out_down, record_iter->period);
+}
+
+uint64_t StutterModelTable::num_models() const {
+  return (num_chroms_ == 0 ? 0 : chroms_[num_chroms_-1].first_record + chroms_[num_chroms_-1].num_records);
+}
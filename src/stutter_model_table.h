@@ -0,0 +1,95 @@
+#ifndef STUTTER_MODEL_TABLE_H_
+#define STUTTER_MODEL_TABLE_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "region.h"
+#include "stutter_model.h"
+
+/*
+ * Immutable table of the stutter models for a set of loci, which replaces a map of heap-allocated StutterModel objects.
+ * The models are stored as fixed-width records sorted by locus, so that a locus' model is found by a binary search and
+ * the table can be shared by all of the threads. The table is either parsed from a --stutter-in text file or
+ * memory-mapped from the binary format written by StutterModelTable::Builder, which loads genome-wide tables instantly
+ *
+ * Binary layout (all integers little-endian):
+ *   header:  magic "HSTRSTUT", uint32 version, uint32 number of chromosomes, uint64 number of records, uint64 length of the names
+ *   chroms:  sorted by name, uint64 index of the first record, uint64 number of records, uint64 name offset and uint64 name length
+ *   records: sorted by start and end within each chromosome, int32 start, int32 end, int32 period, int32 padding and the
+ *            6 model parameters as doubles (IGEOM, IDOWN, IUP, OGEOM, ODOWN, OUP)
+ *   names:   the concatenated chromosome names
+ */
+class StutterModelTable {
+ public:
+  struct Record {
+    int32_t start, end;
+    int32_t period, padding;
+    double in_geom, in_down, in_up;
+    double out_geom, out_down, out_up;
+  };
+
+  // Accumulates the models for a set of loci and serializes them in the binary format
+  class Builder {
+   private:
+    struct Entry {
+      std::string chrom;
+      Record record;
+    };
+    std::vector<Entry> entries_;
+
+   public:
+    void add(const std::string& chrom, int32_t start, int32_t end, StutterModel& model);
+
+    // Parse a --stutter-in text file, in which each line contains CHROM START END IGEOM IDOWN IUP OGEOM ODOWN OUP PERIOD
+    void add_text_models(std::istream& input);
+
+    // Appends the binary representation of the first model added for each locus to OUTPUT
+    void serialize(std::string& output);
+
+    size_t size() const { return entries_.size(); }
+  };
+
+ private:
+  struct ChromEntry {
+    uint64_t first_record;
+    uint64_t num_records;
+    uint64_t name_offset;
+    uint64_t name_length;
+  };
+
+  std::string buffer_;  // Holds the table's data if it was parsed from a text file
+  const char* data_;    // Memory-mapped file, if the table was loaded from a binary file
+  size_t size_;
+  uint32_t num_chroms_;
+  const ChromEntry* chroms_;
+  const Record* records_;
+  const char* names_;
+
+  // Sets the pointers into the table's data, returning false if it isn't a valid table
+  bool init(const char* data, size_t size);
+
+ public:
+  // Loads the models in a text or binary file, which is identified by its magic number
+  explicit StutterModelTable(const std::string& path);
+
+  ~StutterModelTable();
+
+  // Returns true iff the file at PATH is a binary stutter model table
+  static bool is_binary(const std::string& path);
+
+  // Writes the binary table for the models in BUILDER to PATH, using a temporary file that's renamed once it's complete
+  static void write(Builder& builder, const std::string& path);
+
+  // Returns a copy of the model for the locus with the coordinates of REGION, or NULL if there isn't one
+  StutterModel* lookup(const Region& region) const;
+
+  uint64_t num_models() const;
+
+  StutterModelTable(const StutterModelTable&)            = delete;
+  StutterModelTable& operator=(const StutterModelTable&) = delete;
+};
+
+#endif
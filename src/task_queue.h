@@ -0,0 +1,101 @@
+#ifndef TASK_QUEUE_H_
+#define TASK_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "sampling_profiler.h"
+
+/*
+ * Queue of tasks shared by the threads that genotype loci concurrently. A thread that is analyzing a large locus can
+ * split its work into a job that is also executed by any threads that have run out of loci, so that the last few loci
+ * of a run don't leave the remaining cores idle
+ */
+class TaskQueue {
+ private:
+  // Tracks the threads executing a job, so that the job's owner can wait for them
+  struct Job {
+    std::mutex mutex;
+    std::condition_variable done;
+    int num_active;
+    bool closed; // True once the owner has stopped admitting new threads
+    Job(){ num_active = 0; closed = false; }
+  };
+
+  std::deque<std::function<void()> > tasks_;
+  int num_workers_;  // Total number of threads that process loci
+  int num_finished_; // Number of threads that have run out of loci
+  std::mutex mutex_;
+  std::condition_variable task_ready_;
+
+ public:
+  explicit TaskQueue(int num_workers){
+    num_workers_  = num_workers;
+    num_finished_ = 0;
+  }
+
+  /* Number of threads that have run out of loci and are waiting for tasks */
+  int num_idle_workers(){
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (num_finished_ < num_workers_ ? num_finished_ : 0);
+  }
+
+  /*
+   * Executes BODY on the calling thread and on up to NUM_HELPERS idle threads, returning once every invocation has
+   * completed. BODY must claim its work from state shared by all invocations and return once no work remains.
+   * Helpers that only become available after the caller's invocation has returned don't invoke BODY
+   */
+  void run_job(int num_helpers, const std::function<void()>& body){
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    const std::function<void()>* body_ptr = &body;
+    uint64_t profile_tag = SamplingProfiler::thread_tag().load(std::memory_order_relaxed); // Helpers' samples are attributed to the owner's locus and phase
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int i = 0; i < num_helpers; i++){
+	tasks_.push_back([job, body_ptr, profile_tag](){
+	    {
+	      std::lock_guard<std::mutex> job_lock(job->mutex);
+	      if (job->closed)
+		return;
+	      job->num_active++;
+	    }
+	    {
+	      ProfileTagScope profile_scope(profile_tag);
+	      (*body_ptr)();
+	    }
+	    std::lock_guard<std::mutex> job_lock(job->mutex);
+	    if (--job->num_active == 0)
+	      job->done.notify_all();
+	  });
+      }
+    }
+    task_ready_.notify_all();
+
+    body();
+    std::unique_lock<std::mutex> job_lock(job->mutex);
+    job->closed = true;
+    job->done.wait(job_lock, [&]{ return job->num_active == 0; });
+  }
+
+  /* Invoked by a thread once it has run out of loci. Executes queued tasks until every thread has run out of loci */
+  void work_until_finished(){
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (++num_finished_ == num_workers_)
+      task_ready_.notify_all();
+    while (true){
+      task_ready_.wait(lock, [&]{ return !tasks_.empty() || num_finished_ == num_workers_; });
+      if (tasks_.empty())
+	return;
+      std::function<void()> task = tasks_.front();
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+};
+
+#endif
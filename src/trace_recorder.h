@@ -0,0 +1,178 @@
+#ifndef TRACE_RECORDER_H_
+#define TRACE_RECORDER_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "error.h"
+
+/*
+ * Records the duration of each phase of the analysis on each thread and writes them in the Chrome trace-event JSON format,
+ * which can be viewed using chrome://tracing or Perfetto. Each thread appends events to its own fixed-size ring buffer
+ * without any synchronization, so the buffers can only be written once the threads that record events have finished.
+ * If a thread records more events than its ring can hold, its oldest events are discarded
+ */
+class TraceRecorder {
+ private:
+  static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+  struct Event {
+    const char* name;
+    std::string args; // Preformatted JSON object members, or empty if the event has no arguments
+    int64_t start;    // Nanoseconds since the recorder was enabled
+    int64_t duration;
+  };
+
+  struct ThreadBuffer {
+    int thread_id;
+    std::vector<Event> events;
+    size_t next;         // Index in the ring at which the next event is stored once the ring is full
+    int64_t num_dropped;
+    explicit ThreadBuffer(int id){ thread_id = id; next = 0; num_dropped = 0; }
+  };
+
+  bool enabled_;
+  std::string output_file_;
+  std::chrono::steady_clock::time_point start_time_;
+  std::mutex mutex_; // Only guards the registration of new threads' buffers
+  std::vector< std::unique_ptr<ThreadBuffer> > buffers_;
+
+  TraceRecorder(){ enabled_ = false; }
+
+  ThreadBuffer* thread_buffer(){
+    static thread_local ThreadBuffer* buffer = NULL;
+    if (buffer == NULL){
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.emplace_back(new ThreadBuffer(buffers_.size()));
+      buffer = buffers_.back().get();
+    }
+    return buffer;
+  }
+
+  static void write_event(const Event& event, int thread_id, std::ostream& out){
+    out << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread_id
+	<< ",\"ts\":" << event.start/1000.0 << ",\"dur\":" << event.duration/1000.0;
+    if (!event.args.empty())
+      out << ",\"args\":{" << event.args << "}";
+    out << "}";
+  }
+
+ public:
+  static TraceRecorder& instance(){
+    static TraceRecorder recorder;
+    return recorder;
+  }
+
+  /* Start recording events, which will be written to OUTPUT_FILE by write(). Must be invoked before any threads are launched */
+  void enable(const std::string& output_file){
+    std::ofstream test(output_file.c_str());
+    if (!test.is_open())
+      printErrorAndDie("Failed to open the trace output file " + output_file);
+    enabled_     = true;
+    output_file_ = output_file;
+    start_time_  = std::chrono::steady_clock::now();
+  }
+
+  bool enabled() const { return enabled_; }
+
+  int64_t now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time_).count();
+  }
+
+  void record(const char* name, int64_t start, int64_t end, const std::string& args){
+    ThreadBuffer* buffer = thread_buffer();
+    if (buffer->events.size() < MAX_EVENTS_PER_THREAD){
+      buffer->events.push_back(Event{name, args, start, end-start});
+      return;
+    }
+    Event& event   = buffer->events[buffer->next];
+    event.name     = name;
+    event.args     = args;
+    event.start    = start;
+    event.duration = end-start;
+    buffer->next   = (buffer->next+1) % MAX_EVENTS_PER_THREAD;
+    buffer->num_dropped++;
+  }
+
+  /* Write the events recorded by every thread, which must no longer be recording events. Returns the number of discarded events */
+  int64_t write(){
+    if (!enabled_)
+      return 0;
+    std::ofstream out(output_file_.c_str());
+    if (!out.is_open())
+      printErrorAndDie("Failed to open the trace output file " + output_file_);
+
+    // Timestamps are in microseconds, so fixed notation with 3 decimals retains nanosecond resolution
+    out.setf(std::ios::fixed, std::ios::floatfield);
+    out.precision(3);
+    int64_t num_dropped = 0;
+    bool first = true;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (auto iter = buffers_.begin(); iter != buffers_.end(); iter++){
+      ThreadBuffer* buffer = iter->get();
+      out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread_id
+	  << ",\"args\":{\"name\":\"Thread " << buffer->thread_id << "\"}}";
+      first = false;
+      // Once the ring is full, its oldest event is the one that will be overwritten next
+      for (size_t i = 0; i < buffer->events.size(); i++){
+	out << ",\n";
+	write_event(buffer->events[(buffer->next+i) % buffer->events.size()], buffer->thread_id, out);
+      }
+      num_dropped += buffer->num_dropped;
+    }
+    out << "\n]}\n";
+    out.close();
+    return num_dropped;
+  }
+};
+
+/*
+ * Records the time between its construction and either its destruction or the first call to stop() as an event with
+ * the provided name, which must be a string literal. Does nothing unless the TraceRecorder has been enabled
+ */
+class TraceScope {
+ private:
+  const char* name_;
+  std::string args_;
+  int64_t start_;
+  bool enabled_;
+
+ public:
+  explicit TraceScope(const char* name){
+    enabled_ = TraceRecorder::instance().enabled();
+    if (enabled_){
+      name_  = name;
+      start_ = TraceRecorder::instance().now();
+    }
+  }
+
+  /* ARGS contains the members of a JSON object, e.g. "region":"chr1:1000-1020" */
+  TraceScope(const char* name, const std::string& args){
+    enabled_ = TraceRecorder::instance().enabled();
+    if (enabled_){
+      name_  = name;
+      args_  = args;
+      start_ = TraceRecorder::instance().now();
+    }
+  }
+
+  ~TraceScope(){ stop(); }
+
+  /* Record the event now instead of upon destruction */
+  void stop(){
+    if (enabled_)
+      TraceRecorder::instance().record(name_, start_, TraceRecorder::instance().now(), args_);
+    enabled_ = false;
+  }
+
+  TraceScope(const TraceScope&)            = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#endif
@@ -1,6 +1,12 @@
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cfloat>
+#include <cmath>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "trio_denovo_scanner.h"
@@ -37,17 +43,17 @@ void TrioDenovoScanner::write_vcf_header(std::string& full_command){
   denovo_vcf_ << "\n";
 }
 
-void TrioDenovoScanner::initialize_vcf_record(VCF::Variant& str_variant){
+void TrioDenovoScanner::initialize_vcf_record(VCF::Variant& str_variant, std::ostream& out){
   // VCF line format = CHROM POS ID REF ALT QUAL FILTER INFO FORMAT SAMPLE_1 SAMPLE_2 ... SAMPLE_N
-  denovo_vcf_ << str_variant.get_chromosome() << "\t" << str_variant.get_position() << "\t" << str_variant.get_id() << "\t" << str_variant.get_allele(0) << "\t";
+  out << str_variant.get_chromosome() << "\t" << str_variant.get_position() << "\t" << str_variant.get_id() << "\t" << str_variant.get_allele(0) << "\t";
   if (str_variant.num_alleles() > 1){
-    denovo_vcf_ << str_variant.get_allele(1);
+    out << str_variant.get_allele(1);
     for (int i = 2; i < str_variant.num_alleles(); i++)
-      denovo_vcf_ << "," << str_variant.get_allele(i);
+      out << "," << str_variant.get_allele(i);
   }
   else
-    denovo_vcf_ << ".";
-  denovo_vcf_ << "\t" << "." << "\t" << "." << "\t";
+    out << ".";
+  out << "\t" << "." << "\t" << "." << "\t";
 
   // INFO field
   int32_t start;  str_variant.get_INFO_value_single_int(START_KEY, start);
@@ -56,24 +62,302 @@ void TrioDenovoScanner::initialize_vcf_record(VCF::Variant& str_variant){
   std::vector<int32_t> bp_diffs; str_variant.get_INFO_value_multiple_ints(BPDIFFS_KEY, bp_diffs);
   assert(bp_diffs.size()+1 == str_variant.num_alleles());
 
-  denovo_vcf_ << "BPDIFFS=" << bp_diffs[0];
+  out << "BPDIFFS=" << bp_diffs[0];
   for (int i = 2; i < str_variant.num_alleles(); i++)
-    denovo_vcf_ << "," <<  bp_diffs[i-1];
-  denovo_vcf_ << ";START="  << start
+    out << "," <<  bp_diffs[i-1];
+  out << ";START="  << start
 	      << ";END="    << end
 	      << ";PERIOD=" << period;
 
   // FORMAT field
-  denovo_vcf_ << "\t" << "NOMUT:DENOVO:OTHER";
+  out << "\t" << "NOMUT:DENOVO:OTHER";
 }
 
 void TrioDenovoScanner::add_child_to_record(double total_ll_no_mutation, double total_ll_one_denovo, double total_ll_one_other){
-  denovo_vcf_ << "\t" << total_ll_no_mutation << ":" << total_ll_one_denovo << ":" << total_ll_one_other;
+  denovo_vcf_ << "\t" << total_ll_no_mutation;
+  if (std::isnan(total_ll_one_denovo))
+    denovo_vcf_ << ":.:.";
+  else
+    denovo_vcf_ << ":" << total_ll_one_denovo << ":" << total_ll_one_other;
+}
+
+void TrioDenovoScanner::compute_child_lls_log_space(LocusTask& task, const NuclearFamily& family, const std::string& child, double* lls){
+  const double LOG_ONE_FOURTH = -log10(4);
+  const double LOG_TWO        = log10(2);
+  int num_alleles             = task.num_alleles;
+  UnphasedGL& unphased_gls    = task.unphased_gls;
+  MutationModel& mut_model    = task.mut_model;
+  DiploidGenotypePrior* dip_gt_priors = task.dip_gt_priors.get();
+
+  // To accelerate computations, we will ignore configurations that make a neglible contribution (< 0.01%) to the total LL
+  // For mutational scenarios, we aggregate 1/4*A^2*(A+1)^2*4*2*A values. Therefore, to ignore a configuration with LL=X:
+  // X*A^3*(A+1)^2*2 < TOTAL/10000;
+  // logX < log(TOTAL) - log(10000*A^3*(A+1)^2*2) = log(TOTAL) - [log(10000) + 3log(A) + 2log(A+1) + log(2)];
+  double MIN_CONTRIBUTION   = 4 + 3*log10(num_alleles) + 2*log(num_alleles+1) + LOG_TWO;
+  double ll_no_mutation_max = -DBL_MAX/2, ll_no_mutation_total = 0.0;
+  double ll_one_denovo_max  = -DBL_MAX/2, ll_one_denovo_total  = 0.0;
+  double ll_one_other_max   = -DBL_MAX/2, ll_one_other_total   = 0.0;
+  int mother_gl_index       = unphased_gls.get_sample_index(family.get_mother());
+  int father_gl_index       = unphased_gls.get_sample_index(family.get_father());
+  int child_gl_index        = unphased_gls.get_sample_index(child);
+  const double* log_gt_priors = dip_gt_priors->log_unphased_priors();
+
+  // Iterate over all maternal genotypes
+  for (int mat_i = 0; mat_i < num_alleles; mat_i++){
+    for (int mat_j = 0; mat_j <= mat_i; mat_j++){
+      double mat_ll = log_gt_priors[mat_j*num_alleles + mat_i] + unphased_gls.get_gl(mother_gl_index, mat_j, mat_i);
+
+      // Iterate over all paternal genotypes
+      for (int pat_i = 0; pat_i < num_alleles; pat_i++){
+	for (int pat_j = 0; pat_j <= pat_i; pat_j++){
+	  double pat_ll    = log_gt_priors[pat_j*num_alleles + pat_i] + unphased_gls.get_gl(father_gl_index, pat_j, pat_i);
+	  double config_ll = mat_ll + pat_ll + LOG_ONE_FOURTH;
+
+	  // Iterate over all 4 possible inheritance patterns for the child
+	  for (int mat_index = 0; mat_index < 2; ++mat_index){
+	    int mat_allele = (mat_index == 0 ? mat_i : mat_j);
+	    for (int pat_index = 0; pat_index < 2; ++pat_index){
+	      int pat_allele = (pat_index == 0 ? pat_i : pat_j);
+
+	      double no_mutation_config_ll = config_ll + unphased_gls.get_gl(child_gl_index, std::min(mat_allele, pat_allele), std::max(mat_allele, pat_allele));
+	      update_streaming_log_sum_exp(no_mutation_config_ll, ll_no_mutation_max, ll_no_mutation_total);
+
+	      // All putative mutations to the maternal allele
+	      double max_ll_mat_mut = config_ll + unphased_gls.get_max_gl_allele_fixed(child_gl_index, pat_allele) + mut_model.max_log_prior_mutation(mat_allele);
+	      if (max_ll_mat_mut > std::min(ll_one_denovo_max, ll_one_other_max)-MIN_CONTRIBUTION){
+		const double* log_mut_priors = mut_model.log_priors_mutation(mat_allele);
+		for (int mut_allele = 0; mut_allele < num_alleles; mut_allele++){
+		  if (mut_allele == mat_allele)
+		    continue;
+		  double prob = config_ll + unphased_gls.get_gl(child_gl_index, std::min(mut_allele, pat_allele), std::max(mut_allele, pat_allele))
+		    + log_mut_priors[mut_allele];
+		  if (mut_allele != mat_i && mut_allele != mat_j && mut_allele != pat_i && mut_allele != pat_j)
+		    update_streaming_log_sum_exp(prob, ll_one_denovo_max, ll_one_denovo_total);
+		  else
+		    update_streaming_log_sum_exp(prob, ll_one_other_max, ll_one_other_total);
+		}
+	      }
+
+	      // All putative mutations to the paternal allele
+	      double max_ll_pat_mut = config_ll + unphased_gls.get_max_gl_allele_fixed(child_gl_index, mat_allele) + mut_model.max_log_prior_mutation(pat_allele);
+	      if (max_ll_pat_mut > std::min(ll_one_denovo_max, ll_one_other_max)-MIN_CONTRIBUTION){
+		const double* log_mut_priors = mut_model.log_priors_mutation(pat_allele);
+		for (int mut_allele = 0; mut_allele < num_alleles; mut_allele++){
+		  if (mut_allele == pat_allele)
+		    continue;
+		  double prob = config_ll + unphased_gls.get_gl(child_gl_index, std::min(mat_allele, mut_allele), std::max(mat_allele, mut_allele))
+		    + log_mut_priors[mut_allele];
+		  if (mut_allele != mat_i && mut_allele != mat_j && mut_allele != pat_i && mut_allele != pat_j)
+		    update_streaming_log_sum_exp(prob, ll_one_denovo_max, ll_one_denovo_total);
+		  else
+		    update_streaming_log_sum_exp(prob, ll_one_other_max, ll_one_other_total);
+		}
+	      }
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  // Compute total LL for each scenario
+  lls[0] = finish_streaming_log_sum_exp(ll_no_mutation_max, ll_no_mutation_total);
+  lls[1] = finish_streaming_log_sum_exp(ll_one_denovo_max,  ll_one_denovo_total);
+  lls[2] = finish_streaming_log_sum_exp(ll_one_other_max,   ll_one_other_total);
+}
+
+void TrioDenovoScanner::compute_parent_weights(LocusTask& task, const std::string& parent, ParentWeights& weights){
+  int num_alleles = task.num_alleles;
+  const float* gls = task.unphased_gls.get_gls(task.unphased_gls.get_sample_index(parent));
+  const double* log_gt_priors = task.dip_gt_priors->log_unphased_priors();
+  std::vector<double> log_weights;
+  for (int i = 0; i < num_alleles; i++)
+    for (int j = 0; j <= i; j++)
+      log_weights.push_back(log_gt_priors[j*num_alleles + i] + gls[log_weights.size()]);
+  weights.shift = *std::max_element(log_weights.begin(), log_weights.end());
+
+  weights.T.assign(num_alleles, 0.0);
+  weights.U.assign(num_alleles*num_alleles, 0.0);
+  weights.V.assign(num_alleles*num_alleles, 0.0);
+  int gt_index = 0;
+  for (int i = 0; i < num_alleles; i++){
+    for (int j = 0; j <= i; j++, gt_index++){
+      double weight = exp(log_weights[gt_index] - weights.shift);
+      for (int index = 0; index < 2; index++){
+	int allele = (index == 0 ? i : j);
+	weights.T[allele] += weight;
+	double* u_row = &weights.U[allele*num_alleles];
+	double* v_row = &weights.V[allele*num_alleles];
+	for (int m = 0; m < num_alleles; m++)
+	  u_row[m] += weight;
+	u_row[i] -= weight; v_row[i] += weight;
+	if (j != i){
+	  u_row[j] -= weight;
+	  v_row[j] += weight;
+	}
+      }
+    }
+  }
+}
+
+bool TrioDenovoScanner::compute_child_lls(LocusTask& task, const ParentWeights& mother, const ParentWeights& father, const std::string& child, double* lls){
+  const double LOG_ONE_FOURTH = -log10(4);
+  const double MIN_TOTAL      = 1e-280; // Sums below this may have lost significant terms to underflow
+  const double MAX_ROUNDING_ERROR = 1e-6; // Tolerance for the differently ordered DENOVO sum used to reject children
+  int num_alleles    = task.num_alleles;
+  int child_gl_index = task.unphased_gls.get_sample_index(child);
+  const float* gls   = task.unphased_gls.get_gls(child_gl_index);
+  int num_gls        = num_alleles*(num_alleles+1)/2;
+
+  // Symmetric matrix of the child's GLs for each pair of transmitted alleles
+  std::vector<double> child_gls(num_alleles*num_alleles);
+  double child_shift = *std::max_element(gls, gls+num_gls);
+  int gl_index       = 0;
+  for (int a = 0; a < num_alleles; a++)
+    for (int b = 0; b <= a; b++, gl_index++)
+      child_gls[a*num_alleles+b] = child_gls[b*num_alleles+a] = exp(gls[gl_index] - child_shift);
+
+  double no_mutation_total = 0.0;
+  for (int a = 0; a < num_alleles; a++)
+    for (int b = 0; b < num_alleles; b++)
+      no_mutation_total += child_gls[a*num_alleles+b]*mother.T[a]*father.T[b];
+  if (no_mutation_total < MIN_TOTAL)
+    return false;
+  double shift = mother.shift + father.shift + child_shift + LOG_ONE_FOURTH;
+  lls[0] = shift + log(no_mutation_total);
+
+  // The DENOVO sum factors into sums over the maternal and paternal transmitted alleles for each mutant allele m, so it can be
+  // computed in O(A^2) and used to reject children whose de novo likelihood is too low before evaluating both mutation scenarios
+  // in O(A^3). It's only used for this test, as its terms are summed in a different order than those of the reported value
+  const double* mut_priors = task.mut_priors.data();
+  if (min_mutation_lr_ > -DBL_MAX){
+    double denovo_total = 0.0;
+    for (int m = 0; m < num_alleles; m++){
+      double mat_mut = 0.0, mat_child = 0.0, pat_mut = 0.0, pat_child = 0.0;
+      for (int a = 0; a < num_alleles; a++){
+	mat_mut   += mother.U[a*num_alleles+m]*mut_priors[a*num_alleles+m];
+	mat_child += mother.U[a*num_alleles+m]*child_gls[a*num_alleles+m];
+	pat_mut   += father.U[a*num_alleles+m]*mut_priors[a*num_alleles+m];
+	pat_child += father.U[a*num_alleles+m]*child_gls[a*num_alleles+m];
+      }
+      denovo_total += mat_mut*pat_child + mat_child*pat_mut;
+    }
+    if (task.mut_prior_shift + log(denovo_total) - log(no_mutation_total) < min_mutation_lr_ - MAX_ROUNDING_ERROR){
+      lls[1] = lls[2] = NAN;
+      num_skipped_++;
+      return true;
+    }
+  }
+
+  double one_denovo_total = 0.0, one_other_total = 0.0;
+  for (int a = 0; a < num_alleles; a++){
+    const double* mat_u     = &mother.U[a*num_alleles];
+    const double* mat_v     = &mother.V[a*num_alleles];
+    const double* mut_a     = mut_priors + a*num_alleles;
+    const double* child_a   = &child_gls[a*num_alleles];
+    for (int b = 0; b < num_alleles; b++){
+      const double* pat_u   = &father.U[b*num_alleles];
+      const double* pat_v   = &father.V[b*num_alleles];
+      const double* mut_b   = mut_priors + b*num_alleles;
+      const double* child_b = &child_gls[b*num_alleles];
+
+      // Mutations of the maternal allele a to m yield the child genotype (m, b), while mutations of the paternal allele b yield (a, m).
+      // The mutation is de novo iff m is absent from both parental genotypes
+      double pat_total = father.T[b], denovo = 0.0, other = 0.0;
+      for (int m = 0; m < num_alleles; m++){
+	double mutation_ll = mut_a[m]*child_b[m] + mut_b[m]*child_a[m];
+	denovo += mat_u[m]*pat_u[m]*mutation_ll;
+	other  += (mat_v[m]*pat_total + mat_u[m]*pat_v[m])*mutation_ll;
+      }
+      one_denovo_total += denovo;
+      one_other_total  += other;
+    }
+  }
+  if (one_denovo_total < MIN_TOTAL || one_other_total < MIN_TOTAL)
+    return false;
+
+  lls[1] = shift + task.mut_prior_shift + log(one_denovo_total);
+  lls[2] = shift + task.mut_prior_shift + log(one_other_total);
+  return true;
+}
+
+void TrioDenovoScanner::process_block(std::vector< std::unique_ptr<LocusTask> >& tasks){
+  // Each work item is a single family at a single locus, so that the parents' weights are shared by all of their children
+  std::vector<size_t> child_offsets;
+  size_t num_children = 0;
+  for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++){
+    child_offsets.push_back(num_children);
+    num_children += family_iter->get_children().size();
+  }
+  size_t num_items = tasks.size()*families_.size();
+
+  std::atomic<size_t> next_item(0);
+  auto run_worker = [&](){
+    ParentWeights mother, father;
+    size_t item;
+    while ((item = next_item++) < num_items){
+      LocusTask& task             = *tasks[item/families_.size()];
+      size_t family_index         = item % families_.size();
+      const NuclearFamily& family = families_[family_index];
+      size_t child_index          = child_offsets[family_index];
+      bool computed_weights       = false;
+      for (auto child_iter = family.get_children().begin(); child_iter != family.get_children().end(); ++child_iter, ++child_index){
+	if (!task.tested[child_index])
+	  continue;
+	if (!computed_weights){
+	  compute_parent_weights(task, family.get_mother(), mother);
+	  compute_parent_weights(task, family.get_father(), father);
+	  computed_weights = true;
+	}
+	double* lls = &task.child_lls[3*child_index];
+	if (!compute_child_lls(task, mother, father, *child_iter, lls))
+	  compute_child_lls_log_space(task, family, *child_iter, lls);
+      }
+    }
+  };
+  int num_workers = (int)std::min((size_t)num_threads_, num_items);
+  std::vector<std::thread> workers;
+  for (int i = 1; i < num_workers; i++)
+    workers.push_back(std::thread(run_worker));
+  run_worker();
+  for (auto thread_iter = workers.begin(); thread_iter != workers.end(); thread_iter++)
+    thread_iter->join();
+
+  // Write the records in their original order
+  for (auto task_iter = tasks.begin(); task_iter != tasks.end(); task_iter++){
+    LocusTask& task = **task_iter;
+    denovo_vcf_ << task.record_prefix;
+    for (size_t child = 0; child < num_children; child++){
+      if (task.tested[child])
+	add_child_to_record(task.child_lls[3*child], task.child_lls[3*child+1], task.child_lls[3*child+2]);
+      else
+	denovo_vcf_ << "\t" << ".";
+    }
+
+    // End of VCF record line
+    denovo_vcf_ << "\n";
+  }
+  tasks.clear();
 }
 
 void TrioDenovoScanner::scan(VCF::VCFReader& str_vcf, std::ostream& logger){
   VCF::Variant str_variant;
   int32_t num_strs  = 0;
+  std::vector< std::unique_ptr<LocusTask> > tasks;
+
+  // Only extract the GLs for the samples in the nuclear families, as the VCF may contain many other samples
+  std::set<std::string> family_samples;
+  for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++){
+    family_samples.insert(family_iter->get_mother());
+    family_samples.insert(family_iter->get_father());
+    family_samples.insert(family_iter->get_children().begin(), family_iter->get_children().end());
+  }
+  std::vector<int> gl_samples;
+  for (unsigned int i = 0; i < str_vcf.get_samples().size(); i++)
+    if (family_samples.find(str_vcf.get_samples()[i]) != family_samples.end())
+      gl_samples.push_back(i);
+  std::vector<int> founder_counts;
+  PopulationGenotypePrior::count_founders(str_vcf, families_, founder_counts);
   while (str_vcf.get_next_variant(str_variant)){
     num_strs++;
     int num_alleles = str_variant.num_alleles();
@@ -84,104 +368,42 @@ void TrioDenovoScanner::scan(VCF::VCFReader& str_vcf, std::ostream& logger){
     int32_t end;    str_variant.get_INFO_value_single_int(END_KEY, end);
     logger << "Processing STR region " << str_variant.get_chromosome() << ":" << start << "-" << end << " with " << num_alleles << " alleles" << "\n";
 
-    UnphasedGL unphased_gls(str_variant);
-    MutationModel mut_model(str_variant);
-    DiploidGenotypePrior* dip_gt_priors;
+    // Extract everything required from the VCF record, as the record is overwritten when the next locus is read
+    LocusTask* task   = new LocusTask(str_variant, gl_samples);
+    task->num_alleles = num_alleles;
     if (use_pop_priors_)
-      dip_gt_priors = new PopulationGenotypePrior(str_variant, families_);
+      task->dip_gt_priors.reset(new PopulationGenotypePrior(str_variant, founder_counts));
     else
-      dip_gt_priors = new UniformGenotypePrior(str_variant, families_);
-    initialize_vcf_record(str_variant);
-    const double LOG_ONE_FOURTH = -log10(4);
-    const double LOG_TWO        = log10(2);
+      task->dip_gt_priors.reset(new UniformGenotypePrior(str_variant, families_));
 
-    logger << "\t" << "Computing log-likelihoods for mutation scenarios" << "\n";
-    for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++){
-      bool scan_for_denovo = unphased_gls.has_sample(family_iter->get_mother()) && unphased_gls.has_sample(family_iter->get_father());
-      for (auto child_iter = family_iter->get_children().begin(); child_iter != family_iter->get_children().end(); ++child_iter){
-	if (!scan_for_denovo || !unphased_gls.has_sample(*child_iter)){
-	  denovo_vcf_ << "\t" << ".";
-	  continue;
-	}
-
-	// To accelerate computations, we will ignore configurations that make a neglible contribution (< 0.01%) to the total LL
-	// For mutational scenarios, we aggregate 1/4*A^2*(A+1)^2*4*2*A values. Therefore, to ignore a configuration with LL=X:
-	// X*A^3*(A+1)^2*2 < TOTAL/10000;
-	// logX < log(TOTAL) - log(10000*A^3*(A+1)^2*2) = log(TOTAL) - [log(10000) + 3log(A) + 2log(A+1) + log(2)];
-	double MIN_CONTRIBUTION   = 4 + 3*log10(num_alleles) + 2*log(num_alleles+1) + LOG_TWO;
-	double ll_no_mutation_max = -DBL_MAX/2, ll_no_mutation_total = 0.0;
-	double ll_one_denovo_max  = -DBL_MAX/2, ll_one_denovo_total  = 0.0;
-	double ll_one_other_max   = -DBL_MAX/2, ll_one_other_total   = 0.0;
-	int mother_gl_index       = unphased_gls.get_sample_index(family_iter->get_mother());
-	int father_gl_index       = unphased_gls.get_sample_index(family_iter->get_father());
-	int child_gl_index        = unphased_gls.get_sample_index(*child_iter);
-
-	// Iterate over all maternal genotypes
-	for (int mat_i = 0; mat_i < num_alleles; mat_i++){
-	  for (int mat_j = 0; mat_j <= mat_i; mat_j++){
-	    double mat_ll = dip_gt_priors->log_unphased_genotype_prior(mat_j, mat_i, family_iter->get_mother()) + unphased_gls.get_gl(mother_gl_index, mat_j, mat_i);
-
-	    // Iterate over all paternal genotypes
-	    for (int pat_i = 0; pat_i < num_alleles; pat_i++){
-	      for (int pat_j = 0; pat_j <= pat_i; pat_j++){
-		double pat_ll    = dip_gt_priors->log_unphased_genotype_prior(pat_j, pat_i, family_iter->get_father()) + unphased_gls.get_gl(father_gl_index, pat_j, pat_i);
-		double config_ll = mat_ll + pat_ll + LOG_ONE_FOURTH;
-
-		// Iterate over all 4 possible inheritance patterns for the child
-		for (int mat_index = 0; mat_index < 2; ++mat_index){
-		  int mat_allele = (mat_index == 0 ? mat_i : mat_j);
-		  for (int pat_index = 0; pat_index < 2; ++pat_index){
-		    int pat_allele = (pat_index == 0 ? pat_i : pat_j);
-
-		    double no_mutation_config_ll = config_ll + unphased_gls.get_gl(child_gl_index, std::min(mat_allele, pat_allele), std::max(mat_allele, pat_allele));
-		    update_streaming_log_sum_exp(no_mutation_config_ll, ll_no_mutation_max, ll_no_mutation_total);
-
-		    // All putative mutations to the maternal allele
-		    double max_ll_mat_mut = config_ll + unphased_gls.get_max_gl_allele_fixed(child_gl_index, pat_allele) + mut_model.max_log_prior_mutation(mat_allele);
-		    if (max_ll_mat_mut > std::min(ll_one_denovo_max, ll_one_other_max)-MIN_CONTRIBUTION){
-		      for (int mut_allele = 0; mut_allele < num_alleles; mut_allele++){
-			if (mut_allele == mat_allele)
-			  continue;
-			double prob = config_ll + unphased_gls.get_gl(child_gl_index, std::min(mut_allele, pat_allele), std::max(mut_allele, pat_allele))
-			  + mut_model.log_prior_mutation(mat_allele, mut_allele);
-			if (mut_allele != mat_i && mut_allele != mat_j && mut_allele != pat_i && mut_allele != pat_j)
-			  update_streaming_log_sum_exp(prob, ll_one_denovo_max, ll_one_denovo_total);
-			else
-			  update_streaming_log_sum_exp(prob, ll_one_other_max, ll_one_other_total);
-		      }
-		    }
-
-		    // All putative mutations to the paternal allele
-		    double max_ll_pat_mut = config_ll + unphased_gls.get_max_gl_allele_fixed(child_gl_index, mat_allele) + mut_model.max_log_prior_mutation(pat_allele);
-		    if (max_ll_pat_mut > std::min(ll_one_denovo_max, ll_one_other_max)-MIN_CONTRIBUTION){
-		      for (int mut_allele = 0; mut_allele < num_alleles; mut_allele++){
-			if (mut_allele == pat_allele)
-			  continue;
-			double prob = config_ll + unphased_gls.get_gl(child_gl_index, std::min(mat_allele, mut_allele), std::max(mat_allele, mut_allele))
-			  + mut_model.log_prior_mutation(pat_allele, mut_allele);
-			if (mut_allele != mat_i && mut_allele != mat_j && mut_allele != pat_i && mut_allele != pat_j)
-			  update_streaming_log_sum_exp(prob, ll_one_denovo_max, ll_one_denovo_total);
-			else
-			  update_streaming_log_sum_exp(prob, ll_one_other_max, ll_one_other_total);
-		      }
-		    }
-		  }
-		}
-	      }
-	    }
-	  }
-	}
+    // The mutation priors are shared by every child, so exponentiate them once per locus
+    task->mut_prior_shift = -DBL_MAX;
+    for (int i = 0; i < num_alleles; i++)
+      task->mut_prior_shift = std::max(task->mut_prior_shift, task->mut_model.max_log_prior_mutation(i));
+    task->mut_priors.assign(num_alleles*num_alleles, 0.0);
+    for (int i = 0; i < num_alleles; i++){
+      const double* log_mut_priors = task->mut_model.log_priors_mutation(i);
+      for (int j = 0; j < num_alleles; j++)
+	if (i != j)
+	  task->mut_priors[i*num_alleles+j] = exp(log_mut_priors[j] - task->mut_prior_shift);
+    }
 
-	// Compute total LL for each scenario and add it to the VCF
-	double total_ll_no_mutation = finish_streaming_log_sum_exp(ll_no_mutation_max, ll_no_mutation_total);
-	double total_ll_one_denovo  = finish_streaming_log_sum_exp(ll_one_denovo_max,  ll_one_denovo_total);
-	double total_ll_one_other   = finish_streaming_log_sum_exp(ll_one_other_max,   ll_one_other_total);
-	add_child_to_record(total_ll_no_mutation, total_ll_one_denovo, total_ll_one_other);
-      }
+    std::stringstream record_prefix;
+    initialize_vcf_record(str_variant, record_prefix);
+    task->record_prefix = record_prefix.str();
+    for (auto family_iter = families_.begin(); family_iter != families_.end(); family_iter++){
+      bool scan_for_denovo = task->unphased_gls.has_sample(family_iter->get_mother()) && task->unphased_gls.has_sample(family_iter->get_father());
+      for (auto child_iter = family_iter->get_children().begin(); child_iter != family_iter->get_children().end(); ++child_iter)
+	task->tested.push_back(scan_for_denovo && task->unphased_gls.has_sample(*child_iter));
     }
+    task->child_lls.resize(3*task->tested.size());
+    tasks.push_back(std::unique_ptr<LocusTask>(task));
 
-    // End of VCF record line
-    denovo_vcf_ << "\n";
-    delete dip_gt_priors;
+    logger << "\t" << "Computing log-likelihoods for mutation scenarios" << "\n";
+    if (tasks.size() == MAX_BLOCK_LOCI || num_threads_ == 1)
+      process_block(tasks);
   }
+  process_block(tasks);
+  if (min_mutation_lr_ > -DBL_MAX)
+    logger << "Skipped the mutation scenarios for " << num_skipped_ << " children whose de novo likelihood ratio was below --min-mutation-lr" << std::endl;
 }
@@ -3,36 +3,110 @@
 
 #include <assert.h>
 
+#include <atomic>
+#include <cfloat>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <string>
 
 #include "bgzf_streams.h"
+#include "denovo_allele_priors.h"
+#include "error.h"
+#include "mutation_model.h"
 #include "pedigree.h"
+#include "vcf_input.h"
 #include "vcf_reader.h"
 
 class TrioDenovoScanner {
  private:
   static std::string BPDIFFS_KEY, START_KEY, END_KEY, PERIOD_KEY;
 
+  // Maximum number of loci whose children are analyzed concurrently. The record for each locus is parsed
+  // before its children are analyzed, so this bounds the memory used by the parsed genotype likelihoods
+  static const int MAX_BLOCK_LOCI = 64;
+
+  // Everything required to analyze the children at a locus once its VCF record has been parsed
+  struct LocusTask {
+    std::string record_prefix; // Fixed fields of the output VCF record
+    int num_alleles;
+    UnphasedGL unphased_gls;
+    MutationModel mut_model;
+    std::unique_ptr<DiploidGenotypePrior> dip_gt_priors;
+    std::vector<double> mut_priors; // Row-major A x A matrix of exp(log_prior_mutation(a, m) - mut_prior_shift), with a zero diagonal
+    double mut_prior_shift;
+    std::vector<double> child_lls; // NOMUT, DENOVO and OTHER log-likelihoods for each child
+    std::vector<bool> tested;      // False for each child lacking a genotype for itself or either parent
+
+    LocusTask(VCF::Variant& str_variant, const std::vector<int>& gl_samples) : unphased_gls(str_variant, gl_samples), mut_model(str_variant){}
+  };
+
   std::vector<NuclearFamily> families_;
   bgzfostream denovo_vcf_;
   bool use_pop_priors_;
+  int num_threads_;
+  double min_mutation_lr_;          // Children whose DENOVO vs. NOMUT log-likelihood ratio is below this value aren't fully evaluated
+  std::atomic<int64_t> num_skipped_; // Number of children whose mutation scenarios weren't evaluated
 
   void write_vcf_header(std::string& full_command);
-  void initialize_vcf_record(VCF::Variant& str_variant);
+  void initialize_vcf_record(VCF::Variant& str_variant, std::ostream& out);
   void add_child_to_record(double total_ll_no_denovo, double total_ll_one_denovo, double total_ll_one_other);
 
+  /*
+   * Sums of a parent's genotype weights, exp(genotype prior + GL - shift), over the genotypes that can transmit each allele,
+   * counting homozygous genotypes once per haplotype. For an allele a transmitted to the child and an allele m, U[a*A+m]
+   * and V[a*A+m] contain the sums over the genotypes that exclude and include m, and T[a] = U[a*A+m] + V[a*A+m] for any m
+   */
+  struct ParentWeights {
+    std::vector<double> T, U, V;
+    double shift;
+  };
+
+  void compute_parent_weights(LocusTask& task, const std::string& parent, ParentWeights& weights);
+
+  /*
+   * Computes the NOMUT, DENOVO and OTHER log-likelihoods for the child, storing them in LLS. Rather than enumerating
+   * every parental genotype, inheritance pattern and mutant allele, each scenario's likelihood is factored into sums
+   * over the transmitted alleles (a, b) and the mutant allele m of the child's GLs, the mutation priors and the parents'
+   * weights, computed in exp-space relative to their maxima. Returns false if any of these sums underflow.
+   * If the DENOVO log-likelihood doesn't exceed NOMUT by MIN_MUTATION_LR_, DENOVO and OTHER are set to NAN without evaluating
+   * the OTHER scenario. DENOVO alone factors into O(A^2) sums, while OTHER requires the full O(A^3) evaluation
+   */
+  bool compute_child_lls(LocusTask& task, const ParentWeights& mother, const ParentWeights& father, const std::string& child, double* lls);
+
+  /* Computes the child's log-likelihoods by enumerating each parental configuration in log-space. Used if compute_child_lls() underflows */
+  void compute_child_lls_log_space(LocusTask& task, const NuclearFamily& family, const std::string& child, double* lls);
+
+  /* Analyzes every child at each of the loci using NUM_THREADS_ threads and writes the loci's records in order */
+  void process_block(std::vector< std::unique_ptr<LocusTask> >& tasks);
+
  public:
   TrioDenovoScanner(std::vector<NuclearFamily>& families, std::string& output_file, std::string& full_command, bool use_pop_priors){
     families_       = families;
     use_pop_priors_ = use_pop_priors;
+    num_threads_    = 1;
+    min_mutation_lr_ = -DBL_MAX;
+    num_skipped_     = 0;
     denovo_vcf_.open(output_file.c_str());
     denovo_vcf_.precision(3);
     denovo_vcf_.setf(std::ios::fixed, std::ios::floatfield);
     write_vcf_header(full_command);
   }
 
+  void set_num_threads(int num_threads){
+    if (num_threads < 1)
+      printErrorAndDie("The number of threads must be greater than 0");
+    num_threads_ = num_threads;
+  }
+
+  /*
+   * Only evaluate the mutation scenarios for children whose DENOVO log-likelihood exceeds their NOMUT log-likelihood by
+   * at least MIN_LR. The DENOVO and OTHER fields of the remaining children are reported as missing
+   */
+  void set_min_mutation_lr(double min_lr){
+    min_mutation_lr_ = min_lr;
+  }
+
   void scan(VCF::VCFReader& str_vcf, std::ostream& logger);
 
   void finish(){ denovo_vcf_.close(); }
@@ -0,0 +1,142 @@
+#include "vcf_concat.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+
+#include "error.h"
+#include "stringops.h"
+
+#include "htslib/htslib/bgzf.h"
+#include "htslib/htslib/hfile.h"
+#include "htslib/htslib/kstring.h"
+#include "htslib/htslib/tbx.h"
+
+namespace {
+// Empty BGZF block that terminates every BGZF file
+const unsigned char BGZF_EOF_MARKER[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+  0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// Reads the header lines of the bgzipped VCF and stores the virtual offset of its first record in RECORD_OFFSET,
+// or -1 if it doesn't contain any records
+void read_vcf_header(BGZF* input, const std::string& path, std::vector<std::string>& header, int64_t& record_offset){
+  kstring_t line = {0, 0, NULL};
+  record_offset  = -1;
+  while (true){
+    int64_t offset = bgzf_tell(input);
+    int res = bgzf_getline(input, '\n', &line);
+    if (res < -1)
+      printErrorAndDie("Failed to read the bgzipped VCF " + path);
+    if (res == -1)
+      break;
+    if (line.l == 0 || line.s[0] != '#'){
+      record_offset = offset;
+      break;
+    }
+    header.push_back(std::string(line.s, line.l));
+  }
+  free(line.s);
+  if (header.empty() || !string_starts_with(header.back(), "#CHROM"))
+    printErrorAndDie("The VCF " + path + " doesn't contain a header ending with the #CHROM line");
+}
+
+// Append the raw bytes in [START, END) of the file at PATH to the output's underlying file
+void copy_raw_bytes(const std::string& path, int64_t start, int64_t end, BGZF* output){
+  std::ifstream input(path.c_str(), std::ios::binary);
+  input.seekg(start);
+  std::vector<char> buffer(1 << 20);
+  while (start < end){
+    int64_t num_bytes = std::min<int64_t>(buffer.size(), end - start);
+    if (!input.read(buffer.data(), num_bytes) || hwrite(output->fp, buffer.data(), num_bytes) != num_bytes)
+      printErrorAndDie("Failed to copy the BGZF blocks of " + path);
+    start += num_bytes;
+  }
+}
+
+// Returns the size of the file at PATH, excluding its BGZF EOF marker
+int64_t data_size(const std::string& path){
+  struct stat st_buf;
+  if (stat(path.c_str(), &st_buf) != 0)
+    printErrorAndDie("Failed to determine the size of " + path);
+  int64_t size = st_buf.st_size;
+  if (size >= (int64_t)sizeof(BGZF_EOF_MARKER)){
+    unsigned char tail[sizeof(BGZF_EOF_MARKER)];
+    std::ifstream input(path.c_str(), std::ios::binary);
+    input.seekg(size - sizeof(BGZF_EOF_MARKER));
+    if (input.read((char*)tail, sizeof(tail)) && memcmp(tail, BGZF_EOF_MARKER, sizeof(tail)) == 0)
+      size -= sizeof(BGZF_EOF_MARKER);
+  }
+  return size;
+}
+}
+
+void concatenate_bgzipped_vcfs(const std::vector<std::string>& input_files, const std::string& output_file, bool build_index){
+  if (input_files.empty())
+    printErrorAndDie("No VCFs were provided for concatenation");
+  BGZF* output = bgzf_open(output_file.c_str(), "w");
+  if (output == NULL)
+    printErrorAndDie("Failed to open the output VCF " + output_file);
+
+  std::vector<std::string> first_header;
+  for (unsigned int i = 0; i < input_files.size(); i++){
+    const std::string& path = input_files[i];
+    BGZF* input = bgzf_open(path.c_str(), "r");
+    if (input == NULL)
+      printErrorAndDie("Failed to open the bgzipped VCF " + path);
+    if (bgzf_compression(input) != 2)
+      printErrorAndDie("The VCF " + path + " must be bgzipped to be concatenated");
+
+    std::vector<std::string> header;
+    int64_t record_offset;
+    read_vcf_header(input, path, header, record_offset);
+    if (i == 0){
+      first_header = header;
+      for (auto line_iter = header.begin(); line_iter != header.end(); line_iter++)
+	if (bgzf_write(output, line_iter->c_str(), line_iter->size()) < 0 || bgzf_write(output, "\n", 1) < 0)
+	  printErrorAndDie("Failed to write the header of the output VCF " + output_file);
+    }
+    else {
+      // The headers must match, apart from the command line used to generate each file
+      std::vector<std::string> lines_a, lines_b;
+      for (auto line_iter = first_header.begin(); line_iter != first_header.end(); line_iter++)
+	if (!string_starts_with(*line_iter, "##command="))
+	  lines_a.push_back(*line_iter);
+      for (auto line_iter = header.begin(); line_iter != header.end(); line_iter++)
+	if (!string_starts_with(*line_iter, "##command="))
+	  lines_b.push_back(*line_iter);
+      if (lines_a.back().compare(lines_b.back()) != 0)
+	printErrorAndDie("The samples in VCF " + path + " differ from those in VCF " + input_files[0]);
+      if (lines_a != lines_b)
+	printErrorAndDie("The header of VCF " + path + " differs from that of VCF " + input_files[0]);
+    }
+
+    // Complete the current output block so that the input's blocks can be appended
+    if (bgzf_flush(output) != 0)
+      printErrorAndDie("Failed to write to the output VCF " + output_file);
+    if (record_offset != -1){
+      int64_t copy_start = record_offset >> 16;
+      int block_offset   = record_offset & 0xFFFF;
+      if (block_offset != 0){
+	// Recompress the records that share a block with the header
+	if (bgzf_seek(input, copy_start << 16, SEEK_SET) < 0 || bgzf_read_block(input) != 0 || input->block_length < block_offset)
+	  printErrorAndDie("Failed to read the records in the bgzipped VCF " + path);
+	int num_bytes = input->block_length - block_offset;
+	if (bgzf_write(output, (char*)input->uncompressed_block + block_offset, num_bytes) != num_bytes || bgzf_flush(output) != 0)
+	  printErrorAndDie("Failed to write to the output VCF " + output_file);
+	copy_start = htell(input->fp);
+      }
+      copy_raw_bytes(path, copy_start, data_size(path), output);
+    }
+    bgzf_close(input);
+  }
+  if (bgzf_close(output) != 0)
+    printErrorAndDie("Failed to close the output VCF " + output_file);
+
+  if (build_index && tbx_index_build(output_file.c_str(), 0, &tbx_conf_vcf) != 0)
+    printErrorAndDie("Failed to build the tabix index for the VCF " + output_file);
+}
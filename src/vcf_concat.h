@@ -0,0 +1,16 @@
+#ifndef VCF_CONCAT_H_
+#define VCF_CONCAT_H_
+
+#include <string>
+#include <vector>
+
+/*
+ * Concatenates bgzipped VCFs containing different loci for the same samples (e.g. one per shard of the regions) by copying their
+ * compressed BGZF blocks, so that only the header is written anew. Each file's header must be identical apart from its ##command
+ * line, and the output contains the header of the first file. When a file's records begin partway through a BGZF block
+ * rather than in a new block, as in files not written by HipSTR, only the remainder of that block is recompressed.
+ * If BUILD_INDEX is true, a tabix index is also created for the output
+ */
+void concatenate_bgzipped_vcfs(const std::vector<std::string>& input_files, const std::string& output_file, bool build_index);
+
+#endif
@@ -12,14 +12,44 @@ const std::string UNPHASED_GL_KEY = "GL";
 const std::string PHASED_GL_KEY   = "PHASEDGL";
 std::string START_INFO_TAG        = "START";
 std::string STOP_INFO_TAG         = "END";
+const std::string REFAC_INFO_TAG  = "REFAC";
+const std::string AC_INFO_TAG     = "AC";
 
 // Because HipSTR extends putative STR regions if there are nearby indels, the STR coordinates in the VCF may
 // not exactly match the original reference region coordinates. As a result, when looking for a particular STR region,
 // we look for entries a window around the locus. The size of this window is controlled by this parameter
 const int32_t pad = 50;
 
+void read_vcf_allele_counts(VCF::Variant& variant, std::vector<int32_t>& allele_counts){
+  allele_counts.clear();
+  int num_alleles = variant.num_alleles();
+  if (variant.has_info_field(REFAC_INFO_TAG) && (num_alleles == 1 || variant.has_info_field(AC_INFO_TAG))){
+    int32_t ref_count;
+    variant.get_INFO_value_single_int(REFAC_INFO_TAG, ref_count);
+    allele_counts.push_back(ref_count);
+    if (num_alleles == 2){
+      int32_t alt_count;
+      variant.get_INFO_value_single_int(AC_INFO_TAG, alt_count);
+      allele_counts.push_back(alt_count);
+    }
+    else if (num_alleles > 2){
+      std::vector<int32_t> alt_counts;
+      variant.get_INFO_value_multiple_ints(AC_INFO_TAG, alt_counts);
+      allele_counts.insert(allele_counts.end(), alt_counts.begin(), alt_counts.end());
+    }
+    if (allele_counts.size() != num_alleles)
+      allele_counts.clear();
+  }
+}
+
 bool read_vcf_alleles(VCF::VCFReader* ref_vcf, const Region& region, std::vector<std::string>& alleles, int32_t& pos){
-    assert(alleles.size() == 0 && ref_vcf != NULL);
+  std::vector<int32_t> allele_counts;
+  return read_vcf_alleles(ref_vcf, region, alleles, pos, allele_counts);
+}
+
+bool read_vcf_alleles(VCF::VCFReader* ref_vcf, const Region& region, std::vector<std::string>& alleles, int32_t& pos,
+		      std::vector<int32_t>& allele_counts){
+    assert(alleles.size() == 0 && allele_counts.size() == 0 && ref_vcf != NULL);
     int32_t pad_start = (region.start() < pad ? 0 : region.start()-pad);
     if (!ref_vcf->set_region(region.chrom(), pad_start, region.stop()+pad)){
       // Retry setting region if chr is in chromosome name
@@ -43,6 +73,9 @@ bool read_vcf_alleles(VCF::VCFReader* ref_vcf, const Region& region, std::vector
       if (str_start == region.start()+1 && str_stop == region.stop()){
 	pos = variant.get_position()-1;
 	alleles.insert(alleles.end(), variant.get_alleles().begin(), variant.get_alleles().end());
+
+	// Extract the allele counts written by HipSTR, if they're available
+	read_vcf_allele_counts(variant, allele_counts);
 	return true;
       }
       if (variant.get_position() > region.start()+pad)
@@ -53,29 +86,32 @@ bool read_vcf_alleles(VCF::VCFReader* ref_vcf, const Region& region, std::vector
     return false;
 }
 
-bool UnphasedGL::build(VCF::Variant& variant){
-  std::vector< std::vector<float> > values;
-  variant.get_FORMAT_value_multiple_floats(UNPHASED_GL_KEY, values);
-  num_samples_         = 0;
-  num_alleles_         = variant.num_alleles();
-  int vcf_sample_index = 0;
+bool UnphasedGL::build(VCF::Variant& variant, const std::vector<int>& vcf_sample_indices){
+  // Only retain the samples with calls
+  std::vector<int> called_indices;
+  for (auto index_iter = vcf_sample_indices.begin(); index_iter != vcf_sample_indices.end(); index_iter++)
+    if (!variant.sample_call_missing(*index_iter))
+      called_indices.push_back(*index_iter);
 
-  const std::vector<std::string>& samples = variant.get_samples();
-  for (auto sample_iter = samples.begin(); sample_iter != samples.end(); ++sample_iter, ++vcf_sample_index){
-    if (variant.sample_call_missing(vcf_sample_index))
-      continue;
-    unphased_gls_.push_back(values[vcf_sample_index]);
-    sample_indices_[*sample_iter] = num_samples_++;
+  num_alleles_ = variant.num_alleles();
+  num_gls_     = num_alleles_*(num_alleles_+1)/2;
+  num_samples_ = called_indices.size();
+  if (!called_indices.empty() && variant.get_FORMAT_value_multiple_floats(UNPHASED_GL_KEY, called_indices, unphased_gls_) != num_gls_)
+    return false;
 
-    std::vector<float> max_allele_gl(num_alleles_, -DBL_MAX/2);
+  const std::vector<std::string>& samples = variant.get_samples();
+  max_gls_.assign(num_samples_*num_alleles_, -DBL_MAX/2);
+  for (int sample_index = 0; sample_index < num_samples_; sample_index++){
+    sample_indices_[samples[called_indices[sample_index]]] = sample_index;
+    const float* gls     = &unphased_gls_[sample_index*num_gls_];
+    float* max_allele_gl = &max_gls_[sample_index*num_alleles_];
     int gl_index = 0;
     for (int i = 0; i < num_alleles_; ++i){
       for (int j = 0; j <= i; ++j, ++gl_index){
-	max_allele_gl[i] = std::max(max_allele_gl[i], unphased_gls_.back()[gl_index]);
-	max_allele_gl[j] = std::max(max_allele_gl[j], unphased_gls_.back()[gl_index]);
+	max_allele_gl[i] = std::max(max_allele_gl[i], gls[gl_index]);
+	max_allele_gl[j] = std::max(max_allele_gl[j], gls[gl_index]);
       }
     }
-    max_gls_.push_back(max_allele_gl);
   }
 
   return true;
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "error.h"
@@ -16,15 +17,24 @@ extern const std::string UNPHASED_GL_KEY;
 extern const std::string PHASED_GL_KEY;
 extern std::string START_INFO_TAG;
 extern std::string STOP_INFO_TAG;
+extern const std::string REFAC_INFO_TAG;
+extern const std::string AC_INFO_TAG;
 extern const int32_t pad;
 
 bool read_vcf_alleles(VCF::VCFReader* ref_vcf, const Region& region, std::vector<std::string>& alleles, int32_t& pos);
 
+// Extracts the count of each allele from the REFAC and AC INFO fields written by HipSTR. ALLELE_COUNTS is empty if they're unavailable
+void read_vcf_allele_counts(VCF::Variant& variant, std::vector<int32_t>& allele_counts);
+
+// Also extracts the count of each allele from the REFAC and AC INFO fields. ALLELE_COUNTS is empty if the fields are missing
+bool read_vcf_alleles(VCF::VCFReader* ref_vcf, const Region& region, std::vector<std::string>& alleles, int32_t& pos,
+		      std::vector<int32_t>& allele_counts);
+
 class GL{
  protected:
   int num_alleles_;
   int num_samples_;
-  std::map<std::string, int> sample_indices_;
+  std::unordered_map<std::string, int> sample_indices_;
 
  public:
   GL(){
@@ -44,24 +54,46 @@ class GL{
   virtual float get_gl(int sample_index, int gt_a, int gt_b) = 0;
 };
 
+/*
+ * Unphased GLs for each sample, stored in a single contiguous array with one row of (A+1)*A/2 values per sample
+ * in the VCF's packed genotype order, along with a row of the maximum GL for each allele. If a list of VCF sample
+ * indices is provided, only those samples are extracted, which avoids copying the GLs for samples that won't be analyzed
+ */
 class UnphasedGL : public GL {
  private:
-  std::vector< std::vector<float> > unphased_gls_;
-  std::vector< std::vector<float> > max_gls_;
+  int num_gls_;
+  std::vector<float> unphased_gls_;
+  std::vector<float> max_gls_;
 
-  bool build(VCF::Variant& variant);
+  bool build(VCF::Variant& variant, const std::vector<int>& vcf_sample_indices);
 
  public:
   UnphasedGL(VCF::Variant& variant){
+    std::vector<int> vcf_sample_indices;
+    for (int i = 0; i < variant.num_samples(); i++)
+      vcf_sample_indices.push_back(i);
+    init(variant, vcf_sample_indices);
+  }
+
+  UnphasedGL(VCF::Variant& variant, const std::vector<int>& vcf_sample_indices){
+    init(variant, vcf_sample_indices);
+  }
+
+  void init(VCF::Variant& variant, const std::vector<int>& vcf_sample_indices){
     if (!variant.has_format_field(UNPHASED_GL_KEY))
       printErrorAndDie("Required FORMAT field " + UNPHASED_GL_KEY + " not present in VCF");
-    if (!build(variant))
+    if (!build(variant, vcf_sample_indices))
       printErrorAndDie("Failed to construct UnphasedGL instance from VCF record");
   }
 
   float get_gl(int sample_index, int min_gt, int max_gt){
     assert(min_gt <= max_gt);
-    return unphased_gls_[sample_index][max_gt*(max_gt+1)/2 + min_gt];
+    return unphased_gls_[sample_index*num_gls_ + max_gt*(max_gt+1)/2 + min_gt];
+  }
+
+  /* Returns a pointer to the packed GLs for the relevant sample */
+  const float* get_gls(int sample_index) const {
+    return &unphased_gls_[sample_index*num_gls_];
   }
 
   /*
@@ -69,7 +101,7 @@ class UnphasedGL : public GL {
    * that contain GT_A as an allele
    */
   float get_max_gl_allele_fixed(int sample_index, int gt_a){
-    return max_gls_[sample_index][gt_a];
+    return max_gls_[sample_index*num_alleles_ + gt_a];
   }
 };
 
@@ -1,5 +1,7 @@
 #include <sys/stat.h>
 
+#include <algorithm>
+
 #include "vcf_reader.h"
 
 namespace VCF {
@@ -9,6 +11,7 @@ namespace VCF {
   }
 
   void Variant::get_genotype(std::string& sample, int& gt_a, int& gt_b){
+    ensure_genotypes();
     int sample_index = vcf_reader_->get_sample_index(sample);
     if (sample_index == -1)
       gt_a = gt_b = -1;
@@ -19,10 +22,74 @@ namespace VCF {
   }
 
   bool Variant::sample_call_missing(const std::string& sample){
+    ensure_genotypes();
     int sample_index = vcf_reader_->get_sample_index(sample);
     return (sample_index == -1 ? true : missing_[sample_index]);
   }
 
+  void Variant::get_phased_heterozygotes(std::vector<int>& sample_indices, std::vector<int>& gts_a, std::vector<int>& gts_b){
+    sample_indices.clear();
+    gts_a.clear();
+    gts_b.clear();
+    if (genotypes_extracted_){
+      for (int i = 0; i < num_samples_; i++){
+	if (!missing_[i] && phased_[i] && gt_1_[i] != gt_2_[i]){
+	  sample_indices.push_back(i);
+	  gts_a.push_back(gt_1_[i]);
+	  gts_b.push_back(gt_2_[i]);
+	}
+      }
+      return;
+    }
+
+    int   mem = 0;
+    int* gts_ = NULL;
+    if (bcf_get_format_int32(vcf_header_, vcf_record_, "GT", &gts_, &mem) <= 0)
+      printErrorAndDie("Failed to extract the genotypes from the VCF record");
+    int* gt_ptr = gts_;
+    for (int i = 0; i < num_samples_; i++, gt_ptr += 2){
+      if (bcf_gt_is_missing(gt_ptr[0]) || bcf_gt_is_missing(gt_ptr[1]) || !bcf_gt_is_phased(gt_ptr[1]))
+	continue;
+      int gt_a = bcf_gt_allele(gt_ptr[0]), gt_b = bcf_gt_allele(gt_ptr[1]);
+      if (gt_a != gt_b){
+	sample_indices.push_back(i);
+	gts_a.push_back(gt_a);
+	gts_b.push_back(gt_b);
+      }
+    }
+    free(gts_);
+  }
+
+  double Variant::count_alleles(const std::vector<int>& sample_weights, std::vector<double>& counts){
+    int num_weighted = std::min(num_samples_, (int)sample_weights.size());
+    double total = 0;
+    if (genotypes_extracted_){
+      for (int i = 0; i < num_weighted; i++){
+	if (sample_weights[i] == 0 || missing_[i])
+	  continue;
+	counts[gt_1_[i]] += sample_weights[i];
+	counts[gt_2_[i]] += sample_weights[i];
+	total += 2*sample_weights[i];
+      }
+      return total;
+    }
+
+    int   mem = 0;
+    int* gts_ = NULL;
+    if (bcf_get_format_int32(vcf_header_, vcf_record_, "GT", &gts_, &mem) <= 0)
+      printErrorAndDie("Failed to extract the genotypes from the VCF record");
+    int* gt_ptr = gts_;
+    for (int i = 0; i < num_weighted; i++, gt_ptr += 2){
+      if (sample_weights[i] == 0 || bcf_gt_is_missing(gt_ptr[0]) || bcf_gt_is_missing(gt_ptr[1]))
+	continue;
+      counts[bcf_gt_allele(gt_ptr[0])] += sample_weights[i];
+      counts[bcf_gt_allele(gt_ptr[1])] += sample_weights[i];
+      total += 2*sample_weights[i];
+    }
+    free(gts_);
+    return total;
+  }
+
   void Variant::extract_alleles(){
     for (int i = 0; i < vcf_record_->n_allele; i++)
       alleles_.push_back(vcf_record_->d.allele[i]);
@@ -56,6 +123,7 @@ namespace VCF {
       gt_index += 2;
     }
     free(gts_);
+    genotypes_extracted_ = true;
   }
 
 void VCFReader::open(std::string& filename){
@@ -91,17 +159,40 @@ void VCFReader::open(std::string& filename){
   tbx_iter_    = tbx_itr_querys(tbx_input_, chroms_.front().c_str());
   chrom_index_ = 0;
   
+  sample_indices_.reserve(bcf_hdr_nsamples(vcf_header_));
   for (int i = 0; i < bcf_hdr_nsamples(vcf_header_); i++){
     samples_.push_back(vcf_header_->samples[i]);
-    sample_indices_[vcf_header_->samples[i]] = i;
+    sample_indices_.emplace(samples_.back(), i);
   }
 }
 
-bool VCFReader::get_next_variant(Variant& variant){
+int VCFReader::restrict_samples(const std::set<std::string>& samples){
+  std::string sample_list = "";
+  int num_present = 0;
+  for (auto sample_iter = samples.begin(); sample_iter != samples.end(); sample_iter++){
+    if (sample_indices_.find(*sample_iter) == sample_indices_.end())
+      continue;
+    sample_list += (num_present++ == 0 ? "" : ",") + *sample_iter;
+  }
+  if (num_present == 0 || num_present == (int)samples_.size())
+    return samples_.size();
+
+  if (bcf_hdr_set_samples(vcf_header_, sample_list.c_str(), 0) != 0)
+    printErrorAndDie("Failed to restrict the samples decoded from the VCF");
+  samples_.clear();
+  sample_indices_.clear();
+  sample_indices_.reserve(bcf_hdr_nsamples(vcf_header_));
+  for (int i = 0; i < bcf_hdr_nsamples(vcf_header_); i++){
+    samples_.push_back(vcf_header_->samples[i]);
+    sample_indices_.emplace(samples_.back(), i);
+  }
+  return samples_.size();
+}
+
+bool VCFReader::read_record(bcf1_t* record){
   if ((tbx_iter_ != NULL) && tbx_itr_next(vcf_input_, tbx_input_, tbx_iter_, &vcf_line_) >= 0){
-    if (vcf_parse(&vcf_line_, vcf_header_, vcf_record_) < 0)
+    if (vcf_parse(&vcf_line_, vcf_header_, record) < 0)
       printErrorAndDie("Failed to parse VCF record");
-    variant = Variant(vcf_header_, vcf_record_, this);
     return true;
   }
   
@@ -114,13 +205,80 @@ bool VCFReader::get_next_variant(Variant& variant){
     tbx_iter_ = tbx_itr_querys(tbx_input_, chroms_[chrom_index_].c_str());
     
     if ((tbx_iter_ != NULL) && tbx_itr_next(vcf_input_, tbx_input_, tbx_iter_, &vcf_line_) >= 0){
-      if (vcf_parse(&vcf_line_, vcf_header_, vcf_record_) < 0)
+      if (vcf_parse(&vcf_line_, vcf_header_, record) < 0)
 	printErrorAndDie("Failed to parse VCF record");
-      variant = Variant(vcf_header_, vcf_record_, this);
       return true;
     }
   }
   return false;
 }
 
+void VCFReader::prefetch_records(){
+  std::unique_lock<std::mutex> lock(prefetch_mutex_);
+  while (true){
+    space_freed_.wait(lock, [this](){ return stop_prefetch_ || tail_-head_ < (int64_t)slots_.size(); });
+    if (stop_prefetch_)
+      return;
+
+    // The slot after the tail is unused by the consumer, so it can be filled without holding the lock
+    bcf1_t* record = slots_[tail_ % slots_.size()];
+    lock.unlock();
+    bool read = read_record(record);
+    if (read)
+      bcf_unpack(record, BCF_UN_STR);
+    lock.lock();
+
+    if (read)
+      tail_++;
+    else
+      prefetch_done_ = true;
+    records_read_.notify_one();
+    if (!read)
+      return;
+  }
+}
+
+void VCFReader::start_prefetch(){
+  head_          = tail_ = 0;
+  holding_       = false;
+  prefetch_done_ = false;
+  stop_prefetch_ = false;
+  prefetch_thread_ = std::thread(&VCFReader::prefetch_records, this);
+}
+
+void VCFReader::stop_prefetch(){
+  if (!prefetch_thread_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    stop_prefetch_ = true;
+  }
+  space_freed_.notify_one();
+  prefetch_thread_.join();
+}
+
+bool VCFReader::get_next_variant(Variant& variant){
+  if (slots_.empty()){
+    if (!read_record(vcf_record_))
+      return false;
+    variant = Variant(vcf_header_, vcf_record_, this);
+    return true;
+  }
+
+  if (!prefetch_thread_.joinable())
+    start_prefetch();
+  std::unique_lock<std::mutex> lock(prefetch_mutex_);
+  if (holding_){
+    head_++;
+    holding_ = false;
+    space_freed_.notify_one();
+  }
+  records_read_.wait(lock, [this](){ return prefetch_done_ || tail_ > head_; });
+  if (tail_ == head_)
+    return false;
+  holding_ = true;
+  variant  = Variant(vcf_header_, slots_[head_ % slots_.size()], this);
+  return true;
+}
+
 };
@@ -1,10 +1,15 @@
 #ifndef VCF_READER_H_
 #define VCF_READER_H_
 
+#include <condition_variable>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 extern "C" {
@@ -30,24 +35,33 @@ private:
   std::vector<bool> missing_;
   std::vector<bool> phased_;
   std::vector<int> gt_1_, gt_2_;
+  bool genotypes_extracted_;
   
   void extract_alleles();
   void extract_genotypes();
 
+  // The genotypes are only decoded once they're first accessed, as many consumers only require the alleles or INFO fields
+  void ensure_genotypes(){
+    if (!genotypes_extracted_)
+      extract_genotypes();
+  }
+
 public:
   Variant(){
-    vcf_record_ = NULL;
-    vcf_header_ = NULL;
+    vcf_record_          = NULL;
+    vcf_header_          = NULL;
+    genotypes_extracted_ = false;
   }
 
   Variant(bcf_hdr_t* vcf_header, bcf1_t* vcf_record, VCFReader* vcf_reader){
-    vcf_header_  = vcf_header;
-    vcf_record_  = vcf_record;
-    vcf_reader_  = vcf_reader;
-    num_samples_ = bcf_hdr_nsamples(vcf_header_);
-    bcf_unpack(vcf_record_, BCF_UN_ALL);
+    vcf_header_          = vcf_header;
+    vcf_record_          = vcf_record;
+    vcf_reader_          = vcf_reader;
+    num_samples_         = bcf_hdr_nsamples(vcf_header_);
+    genotypes_extracted_ = false;
+    // Only unpack the alleles, as htslib unpacks the INFO and FORMAT fields on their first access
+    bcf_unpack(vcf_record_, BCF_UN_STR);
     extract_alleles();
-    extract_genotypes();
   }
   
   ~Variant(){ }
@@ -103,11 +117,13 @@ public:
     return (bcf_get_info(vcf_header_, vcf_record_, fieldname.c_str()) != NULL);
   }
 
-  bool sample_call_phased(int sample_index) const{
+  bool sample_call_phased(int sample_index){
+    ensure_genotypes();
     return phased_[sample_index];
   }
 
-  bool sample_call_missing(int sample_index) const{
+  bool sample_call_missing(int sample_index){
+    ensure_genotypes();
     return missing_[sample_index];
   }
 
@@ -150,9 +166,44 @@ public:
     free(format_vals);
   }
 
+  /*
+   * Extracts the FORMAT values for only the samples with the provided indices, storing them contiguously
+   * in VALS in the same order. Returns the number of values per sample
+   */
+  int get_FORMAT_value_multiple_floats(const std::string& fieldname, const std::vector<int>& sample_indices, std::vector<float>& vals){
+    vals.clear();
+    int mem            = 0;
+    float* format_vals = NULL;
+    int num_entries    = bcf_get_format_float(vcf_header_, vcf_record_, fieldname.c_str(), &format_vals, &mem);
+    if (num_entries <= num_samples())
+      printErrorAndDie("Failed to extract multiple FORMAT values from the VCF record");
+    int entries_per_sample = num_entries/num_samples();
+    vals.reserve(sample_indices.size()*entries_per_sample);
+    for (auto index_iter = sample_indices.begin(); index_iter != sample_indices.end(); index_iter++){
+      float* ptr = format_vals + (*index_iter)*entries_per_sample;
+      vals.insert(vals.end(), ptr, ptr+entries_per_sample);
+    }
+    free(format_vals);
+    return entries_per_sample;
+  }
+
   void get_genotype(std::string& sample, int& gt_a, int& gt_b);
 
+  /*
+   * Stores the index and alleles of each sample with a phased heterozygous genotype. Unless the genotypes have already been
+   * decoded, the calls are read in a single pass over the GT field without storing the remaining samples' genotypes
+   */
+  void get_phased_heterozygotes(std::vector<int>& sample_indices, std::vector<int>& gts_a, std::vector<int>& gts_b);
+
+  /*
+   * Adds SAMPLE_WEIGHTS[i] copies of each allele in the non-missing genotype of sample i to COUNTS, where samples beyond the
+   * end of SAMPLE_WEIGHTS have a weight of 0, and returns the total number of alleles added. Like get_phased_heterozygotes(),
+   * the GT field is read directly unless the genotypes have already been decoded
+   */
+  double count_alleles(const std::vector<int>& sample_weights, std::vector<double>& counts);
+
   void get_genotype(int sample_index, int& gt_a, int& gt_b){
+    ensure_genotypes();
     gt_a = gt_1_[sample_index];
     gt_b = gt_2_[sample_index];
   }
@@ -170,11 +221,34 @@ private:
   int         chrom_index_;
   std::vector<std::string> samples_;
   std::vector<std::string> chroms_;
-  std::map<std::string, int> sample_indices_;
+  std::unordered_map<std::string, int> sample_indices_; // Hash index of the decoded samples, shared with the pedigree code
+
+  // Instance variables for prefetch mode, in which a background thread reads and parses the upcoming records into a ring of
+  // reusable records. The consumer holds the record of the most recently returned variant until the next call to get_next_variant()
+  std::vector<bcf1_t*> slots_;
+  std::thread prefetch_thread_;
+  std::mutex prefetch_mutex_;
+  std::condition_variable records_read_, space_freed_;
+  int64_t head_, tail_;  // Numbers of records released by the consumer and prefetched
+  bool holding_;         // True iff the consumer holds the record in slot head_
+  bool prefetch_done_;   // True once the prefetch thread has read all of the records for the current region
+  bool stop_prefetch_;
 
   void open(std::string& filename);
 
+  // Reads and parses the next record into RECORD, returning false once all of the records for the current region have been read
+  bool read_record(bcf1_t* record);
+
+  void prefetch_records();
+
+  void start_prefetch();
+
+  // Stops the prefetch thread (if running) and discards its prefetched records, so that the iterator can be changed
+  void stop_prefetch();
+
 public:
+  const static int DEFAULT_PREFETCH_RECORDS = 1024;
+
   VCFReader(std::string& filename){
     vcf_input_  = NULL;
     tbx_input_  = NULL;
@@ -184,10 +258,15 @@ public:
     vcf_line_.m = 0;
     vcf_line_.s = NULL;
     vcf_record_ = bcf_init();
+    head_       = tail_ = 0;
+    holding_    = prefetch_done_ = stop_prefetch_ = false;
     open(filename);
   }
 
   ~VCFReader(){
+    stop_prefetch();
+    for (size_t i = 0; i < slots_.size(); i++)
+      bcf_destroy(slots_[i]);
     //if (vcf_input_  != NULL)   ;
     if (vcf_header_ != NULL)   bcf_hdr_destroy(vcf_header_);
     if (tbx_iter_   != NULL)   tbx_itr_destroy(tbx_iter_);
@@ -196,7 +275,7 @@ public:
     bcf_destroy(vcf_record_);
   }
 
-  bool has_sample(std::string& sample) const{
+  bool has_sample(const std::string& sample) const{
     return sample_indices_.find(sample) != sample_indices_.end();
   }
 
@@ -209,6 +288,7 @@ public:
   }
   
   bool set_region(const std::string& region){
+    stop_prefetch();
     tbx_itr_destroy(tbx_iter_);
     tbx_iter_ = tbx_itr_querys(tbx_input_, region.c_str());
     jumped_  = true;
@@ -224,6 +304,44 @@ public:
 
   const std::vector<std::string>& get_samples(){ return samples_; }
 
+  /* Returns the chromosomes in the tabix index, in the order in which get_next_variant() visits them */
+  const std::vector<std::string>& get_chromosomes(){ return chroms_; }
+
+  /* Returns the chromosome's length from the header's contig lines, or 0 if it isn't available */
+  int64_t get_chromosome_length(const std::string& chrom){
+    int rid = bcf_hdr_name2id(vcf_header_, chrom.c_str());
+    if (rid < 0 || vcf_header_->id[BCF_DT_CTG][rid].val == NULL)
+      return 0;
+    return vcf_header_->id[BCF_DT_CTG][rid].val->info[0];
+  }
+
+  /*
+   * Restricts the samples decoded from each record to those in SAMPLES that are present in the VCF, using htslib's
+   * sample subsetting so that the remaining samples' FORMAT fields are skipped during parsing. If none of the samples are
+   * present, all samples are retained. Must be called before any records are read, as it renumbers the samples.
+   * Returns the number of samples retained
+   */
+  int restrict_samples(const std::set<std::string>& samples);
+
+  // Decompress the VCF's BGZF blocks using a pool of NUM_THREADS threads, which also read ahead of the current block
+  void set_threads(int num_threads){
+    if (hts_set_threads(vcf_input_, num_threads) != 0)
+      printErrorAndDie("Failed to create the thread pool for VCF decompression");
+  }
+
+  /*
+   * Read and parse up to NUM_RECORDS upcoming records on a background thread, so that parsing overlaps with the analysis of
+   * the returned variants. Each variant then remains valid until the next call to get_next_variant(), as it does without prefetching
+   */
+  void enable_prefetch(int num_records = DEFAULT_PREFETCH_RECORDS){
+    if (!slots_.empty())
+      printErrorAndDie("Record prefetching has already been enabled for the VCFReader");
+    if (num_records < 2)
+      printErrorAndDie("At least 2 VCF records must be prefetched");
+    for (int i = 0; i < num_records; i++)
+      slots_.push_back(bcf_init());
+  }
+
   bool get_next_variant(Variant& variant);
 };
 
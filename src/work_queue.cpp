@@ -0,0 +1,159 @@
+#include "work_queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#include "error.h"
+
+namespace {
+std::string host_name(){
+  char name[256];
+  if (gethostname(name, sizeof(name)) != 0)
+    return "unknown";
+  name[sizeof(name)-1] = '\0';
+  return std::string(name);
+}
+}
+
+WorkQueue::WorkQueue(const std::string& dir, int32_t num_regions, double target_seconds){
+  dir_               = dir;
+  num_regions_       = num_regions;
+  target_seconds_    = target_seconds;
+  next_index_        = 0;
+  next_start_        = 0;
+  completed_regions_ = 0;
+  completed_seconds_ = 0;
+  if (target_seconds_ <= 0)
+    printErrorAndDie("The target duration of each batch must be greater than 0 seconds");
+  if (mkdir(dir_.c_str(), 0777) != 0 && errno != EEXIST)
+    printErrorAndDie("Failed to create the work queue directory " + dir_);
+}
+
+std::string WorkQueue::lease_path(int index) const { return dir_ + "/batch_" + std::to_string(index) + ".lease"; }
+std::string WorkQueue::done_path(int index)  const { return dir_ + "/batch_" + std::to_string(index) + ".done";  }
+
+std::string WorkQueue::output_path(const WorkBatch& batch, const std::string& suffix) const {
+  return dir_ + "/batch_" + std::to_string(batch.index) + suffix;
+}
+
+bool WorkQueue::read_lease(int index, int32_t& start, int32_t& end) const {
+  std::ifstream input(lease_path(index).c_str());
+  if (!input.is_open())
+    return false;
+  int32_t num_regions;
+  if (!(input >> start >> end >> num_regions))
+    printErrorAndDie("Improperly formatted lease file " + lease_path(index));
+  if (num_regions != num_regions_)
+    printErrorAndDie("The work queue in " + dir_ + " was created for a run with " + std::to_string(num_regions) + " regions, but "
+		     + std::to_string(num_regions_) + " regions are being analyzed. Each worker must analyze identical regions");
+  return true;
+}
+
+int32_t WorkQueue::choose_batch_size() const {
+  int64_t num_regions = completed_regions_;
+  double seconds      = completed_seconds_;
+
+  // Before this worker has completed a batch, use the runtimes of the batches completed by the other workers
+  if (num_regions == 0){
+    for (int index = 0; index < next_index_; index++){
+      std::ifstream input(done_path(index).c_str());
+      int32_t start, end;
+      double batch_seconds;
+      if (input >> start >> end >> batch_seconds){
+	num_regions += end - start;
+	seconds     += batch_seconds;
+      }
+    }
+  }
+  if (num_regions == 0)
+    return INITIAL_BATCH_SIZE;
+  double seconds_per_region = std::max(seconds/num_regions, 1e-3);
+  return std::max(1, (int32_t)(target_seconds_/seconds_per_region));
+}
+
+bool WorkQueue::claim_batch(WorkBatch& batch){
+  std::string tmp_path = dir_ + "/.lease." + host_name() + "." + std::to_string(getpid());
+  while (true){
+    // Skip past the batches that have already been claimed
+    int32_t start, end;
+    while (read_lease(next_index_, start, end)){
+      if (start != next_start_ || end <= start)
+	printErrorAndDie("Lease file " + lease_path(next_index_) + " doesn't cover the regions following the previous batch");
+      next_start_ = end;
+      next_index_++;
+    }
+    if (next_start_ >= num_regions_)
+      return false;
+
+    // Write the lease under a temporary name and link it into place, which fails if another worker claimed the batch first
+    int32_t batch_end = std::min(num_regions_, next_start_ + choose_batch_size());
+    std::ofstream output(tmp_path.c_str());
+    output << next_start_ << " " << batch_end << " " << num_regions_ << " " << host_name() << " " << getpid() << "\n";
+    output.close();
+    if (output.fail())
+      printErrorAndDie("Failed to write the lease file " + tmp_path);
+    int result = link(tmp_path.c_str(), lease_path(next_index_).c_str());
+    int link_errno = errno;
+    unlink(tmp_path.c_str());
+    if (result == 0){
+      batch.index = next_index_;
+      batch.start = next_start_;
+      batch.end   = batch_end;
+      next_start_ = batch_end;
+      next_index_++;
+      return true;
+    }
+    if (link_errno != EEXIST)
+      printErrorAndDie("Failed to create the lease file " + lease_path(next_index_));
+  }
+}
+
+void WorkQueue::complete_batch(const WorkBatch& batch, double seconds){
+  completed_regions_ += batch.end - batch.start;
+  completed_seconds_ += seconds;
+  std::string path     = done_path(batch.index);
+  std::string tmp_path = path + ".tmp";
+  std::ofstream output(tmp_path.c_str());
+  output << batch.start << " " << batch.end << " " << seconds << " " << host_name() << "\n";
+  output.close();
+  if (output.fail() || rename(tmp_path.c_str(), path.c_str()) != 0)
+    printErrorAndDie("Failed to write the completion file " + path);
+}
+
+void WorkQueue::wait_for_batches(std::vector<WorkBatch>& batches, std::ostream& logger){
+  assert(next_start_ >= num_regions_);
+  batches.clear();
+  int32_t start = 0;
+  for (int index = 0; index < next_index_; index++){
+    WorkBatch batch;
+    batch.index = index;
+    if (!read_lease(index, batch.start, batch.end) || batch.start != start)
+      printErrorAndDie("Lease file " + lease_path(index) + " is missing or doesn't cover the regions following the previous batch");
+    start = batch.end;
+    batches.push_back(batch);
+  }
+
+  // Poll for the completion files, periodically reporting the worker responsible for the first outstanding batch
+  const int POLL_SECONDS = 5, REPORT_POLLS = 60;
+  int num_polls = 0;
+  for (auto batch_iter = batches.begin(); batch_iter != batches.end(); batch_iter++){
+    struct stat st_buf;
+    while (stat(done_path(batch_iter->index).c_str(), &st_buf) != 0){
+      if (num_polls++ % REPORT_POLLS == 0){
+	std::ifstream input(lease_path(batch_iter->index).c_str());
+	std::string owner;
+	std::getline(input, owner);
+	logger << "Waiting for batch " << batch_iter->index << " of " << batches.size() << " (lease: " << owner << ")" << std::endl;
+      }
+      std::this_thread::sleep_for(std::chrono::seconds(POLL_SECONDS));
+    }
+  }
+}
@@ -0,0 +1,76 @@
+#ifndef WORK_QUEUE_H_
+#define WORK_QUEUE_H_
+
+#include <stdint.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * Queue of batches of regions shared by HipSTR processes on multiple nodes through lease files in a shared directory.
+ * Workers claim consecutive batches of the ordered regions until none remain, so that faster nodes analyze more regions.
+ * Each batch is claimed by atomically linking a lease file into place, which fails if another worker already claimed it.
+ * The size of each batch is chosen by its worker, so the lease for batch i must be read to find where batch i+1 starts.
+ *
+ * Once a batch's output has been written, its worker records the batch's runtime in a completion file. Workers size their
+ * batches so that each one takes roughly the target duration, using their own runtimes or, for their first batch, those of
+ * the batches completed by the other workers. The coordinator process, which also analyzes batches, waits until every batch
+ * is complete and then combines their outputs in order.
+ *
+ * File layout (space-delimited):
+ *   batch_<i>.lease  START END NUM_REGIONS HOST PID
+ *   batch_<i>.done   START END SECONDS HOST
+ * where START and END are 0-based indices of the batch's regions in the ordered list, with END exclusive
+ */
+class WorkBatch {
+ public:
+  int index;
+  int32_t start, end;
+
+  WorkBatch(){
+    index = -1;
+    start = end = 0;
+  }
+};
+
+class WorkQueue {
+ private:
+  std::string dir_;        // Shared directory containing the lease and completion files
+  int32_t num_regions_;
+  double target_seconds_;  // Ideal duration of each batch
+  int next_index_;         // Index of the first batch whose lease hasn't been read by this worker
+  int32_t next_start_;     // First region in batch NEXT_INDEX_
+
+  // Total regions and time for the batches completed by this worker
+  int64_t completed_regions_;
+  double completed_seconds_;
+
+  std::string lease_path(int index) const;
+  std::string done_path(int index)  const;
+
+  // Read the region range from batch INDEX's lease. Returns false if it hasn't been claimed
+  bool read_lease(int index, int32_t& start, int32_t& end) const;
+
+  // Returns the number of regions in the next batch this worker claims
+  int32_t choose_batch_size() const;
+
+ public:
+  static const int32_t INITIAL_BATCH_SIZE = 10;
+
+  WorkQueue(const std::string& dir, int32_t num_regions, double target_seconds);
+
+  /* Claims the next unclaimed batch of regions. Returns false if every region has already been claimed */
+  bool claim_batch(WorkBatch& batch);
+
+  /* Records that the output for the batch has been written and that it took the provided number of seconds */
+  void complete_batch(const WorkBatch& batch, double seconds);
+
+  /* Blocks until every batch is complete and stores them in order in BATCHES. Must only be invoked once claim_batch() returns false */
+  void wait_for_batches(std::vector<WorkBatch>& batches, std::ostream& logger);
+
+  /* Path of the output file with the provided suffix for a batch, e.g. batch_<i>.vcf.gz */
+  std::string output_path(const WorkBatch& batch, const std::string& suffix) const;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <iostream>
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../src/SeqAlignment/AlignmentKernels.h"
+#include "../src/SeqAlignment/AlignmentModel.h"
+
+// Maximum absolute difference tolerated between single and double precision rows
+const double SINGLE_PRECISION_TOL = 0.001;
+
+struct RowInput {
+  std::vector<double> emit, correct, prev_match, prev_del;
+  int homop_len;
+};
+
+RowInput random_row(int seq_len){
+  RowInput input;
+  for (int j = 0; j < seq_len; j++){
+    input.emit.push_back(-5.0*rand()/RAND_MAX);
+    input.correct.push_back(-0.1*rand()/RAND_MAX);
+    input.prev_match.push_back(-100.0*rand()/RAND_MAX);
+    input.prev_del.push_back(rand() % 5 == 0 ? -1000000000 : -100.0*rand()/RAND_MAX);
+  }
+  input.homop_len = 1 + rand() % MAX_HOMOP_LEN;
+  return input;
+}
+
+// Fill the match, insertion and deletion rows for the input using the provided kernel
+template<typename T>
+void run_kernel(AlignRowKernel<T> kernel, const RowInput& input, std::vector<T>& match, std::vector<T>& ins, std::vector<T>& del){
+  int seq_len = input.emit.size();
+  std::vector<T> emit(input.emit.begin(), input.emit.end()), correct(input.correct.begin(), input.correct.end());
+  std::vector<T> prev_match(input.prev_match.begin(), input.prev_match.end()), prev_del(input.prev_del.begin(), input.prev_del.end());
+  match = std::vector<T>(seq_len, 0);
+  ins   = std::vector<T>(seq_len, 0);
+  del   = std::vector<T>(seq_len, 0);
+  ins[0] = correct[0];
+  kernel(seq_len, emit.data(), correct.data(), (T)LOG_MATCH_TO_MATCH[input.homop_len], (T)LOG_MATCH_TO_INS[input.homop_len],
+	 (T)LOG_MATCH_TO_DEL[input.homop_len], prev_match.data(), prev_del.data(), match.data(), ins.data(), del.data());
+}
+
+// Verify that a vectorized kernel exactly reproduces the scalar kernel of the same precision
+template<typename T>
+bool compare_kernels(AlignRowKernel<T> kernel, const std::string& name){
+  for (int seq_len = 1; seq_len <= 150; seq_len++){
+    RowInput input = random_row(seq_len);
+    std::vector<T> match_a, ins_a, del_a, match_b, ins_b, del_b;
+    run_kernel<T>(align_row_scalar<T>, input, match_a, ins_a, del_a);
+    run_kernel<T>(kernel, input, match_b, ins_b, del_b);
+    if (match_a != match_b || ins_a != ins_b || del_a != del_b){
+      std::cerr << "Kernel " << name << " does not match the scalar kernel for a read of length " << seq_len << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Verify that a batched kernel reproduces the scalar kernel for each lane, where the lanes contain unrelated rows
+bool compare_batch_kernel(AlignBatchRowKernel kernel, const std::string& name){
+  const int L = ALIGN_BATCH_LANES;
+  for (int seq_len = 1; seq_len <= 150; seq_len++){
+    std::vector<RowInput> inputs;
+    for (int lane = 0; lane < L; lane++)
+      inputs.push_back(random_row(seq_len));
+    int homop_len = inputs[0].homop_len;
+
+    std::vector<double> emit(L*seq_len), correct(L*seq_len), prev_match(L*seq_len), prev_del(L*seq_len);
+    std::vector<double> match(L*seq_len, 0), ins(L*seq_len, 0), del(L*seq_len, 0);
+    for (int lane = 0; lane < L; lane++){
+      inputs[lane].homop_len = homop_len;
+      for (int j = 0; j < seq_len; j++){
+	emit[j*L+lane]       = inputs[lane].emit[j];
+	correct[j*L+lane]    = inputs[lane].correct[j];
+	prev_match[j*L+lane] = inputs[lane].prev_match[j];
+	prev_del[j*L+lane]   = inputs[lane].prev_del[j];
+      }
+      ins[lane] = correct[lane];
+    }
+    kernel(seq_len, emit.data(), correct.data(), LOG_MATCH_TO_MATCH[homop_len], LOG_MATCH_TO_INS[homop_len], LOG_MATCH_TO_DEL[homop_len],
+	   prev_match.data(), prev_del.data(), match.data(), ins.data(), del.data());
+
+    for (int lane = 0; lane < L; lane++){
+      std::vector<double> match_a, ins_a, del_a;
+      run_kernel<double>(align_row_scalar<double>, inputs[lane], match_a, ins_a, del_a);
+      for (int j = 0; j < seq_len; j++){
+	if (match_a[j] != match[j*L+lane] || ins_a[j] != ins[j*L+lane] || del_a[j] != del[j*L+lane]){
+	  std::cerr << "Batched kernel " << name << " does not match the scalar kernel for a read of length " << seq_len << std::endl;
+	  return false;
+	}
+      }
+    }
+  }
+  return true;
+}
+
+// Verify that the single precision kernel agrees with the double precision kernel within SINGLE_PRECISION_TOL
+bool compare_precisions(){
+  for (int seq_len = 1; seq_len <= 150; seq_len++){
+    RowInput input = random_row(seq_len);
+    std::vector<double> match_d, ins_d, del_d;
+    std::vector<float>  match_f, ins_f, del_f;
+    run_kernel<double>(select_align_row_kernel<double>(), input, match_d, ins_d, del_d);
+    run_kernel<float>(select_align_row_kernel<float>(),   input, match_f, ins_f, del_f);
+    for (int j = 0; j < seq_len; j++){
+      if (del_d[j] < -1000000)
+	continue; // Impossible configurations only need to remain impossible
+      if (fabs(match_d[j]-match_f[j]) > SINGLE_PRECISION_TOL || fabs(ins_d[j]-ins_f[j]) > SINGLE_PRECISION_TOL || fabs(del_d[j]-del_f[j]) > SINGLE_PRECISION_TOL){
+	std::cerr << "Single precision kernel differs from the double precision kernel for a read of length " << seq_len << std::endl;
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main(){
+  std::cerr << "Selected alignment kernel: " << align_row_kernel_name() << std::endl;
+
+  bool success = true;
+  success &= compare_batch_kernel(align_batch_row_scalar, "scalar");
+#ifdef HAVE_X86_ALIGN_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    success &= compare_batch_kernel(align_batch_row_sse2, "SSE2");
+  if (__builtin_cpu_supports("avx2"))
+    success &= compare_batch_kernel(align_batch_row_avx2, "AVX2");
+  if (__builtin_cpu_supports("sse2")){
+    success &= compare_kernels<double>(align_row_sse2, "SSE2 (double)");
+    success &= compare_kernels<float>(align_row_sse2,  "SSE2 (float)");
+  }
+  if (__builtin_cpu_supports("avx2")){
+    success &= compare_kernels<double>(align_row_avx2, "AVX2 (double)");
+    success &= compare_kernels<float>(align_row_avx2,  "AVX2 (float)");
+  }
+  if (__builtin_cpu_supports("avx512f")){
+    success &= compare_kernels<double>(align_row_avx512, "AVX-512 (double)");
+    success &= compare_kernels<float>(align_row_avx512,  "AVX-512 (float)");
+  }
+#endif
+  success &= compare_precisions();
+
+  // Restricting the instruction set must select the corresponding kernel, and unsupported instruction sets must be rejected
+  if (set_kernel_isa("avx1024") || !set_kernel_isa("scalar") || align_row_kernel_name() != "scalar"
+      || select_align_batch_row_kernel() != align_batch_row_scalar){
+    std::cerr << "Restricting the kernel instruction set did not select the scalar kernels" << std::endl;
+    success = false;
+  }
+
+  std::cerr << (success ? "All kernels matched" : "Kernel mismatch detected") << std::endl;
+  return (success ? 0 : 1);
+}
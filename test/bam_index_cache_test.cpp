@@ -0,0 +1,181 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/bam_index_cache.h"
+
+#include "htslib/sam.h"
+
+const int NUM_QUERIES = 20000;
+
+// Appends a record to FILE, parsed from the SAM-formatted LINE
+bool write_record(samFile* file, bam_hdr_t* header, bam1_t* read, const std::string& line){
+  kstring_t text = {line.size(), line.size() + 1, const_cast<char*>(line.c_str())};
+  return sam_parse1(&text, header, read) >= 0 && sam_write1(file, header, read) >= 0;
+}
+
+// Writes a coordinate-sorted BAM with reads of varying lengths, including spliced reads that occupy the higher-level bins,
+// an empty chromosome and unmapped reads, and builds its .bai
+bool write_test_bam(const std::string& path){
+  const char* chroms[]      = {"chr1", "chr2", "chr3", "chr4"};
+  const int chrom_lengths[] = {3000000, 200000, 1500000, 800000};
+  const int num_reads[]     = {60000, 3000, 0, 20000};
+  std::stringstream header_text;
+  header_text << "@HD\tVN:1.4\tSO:coordinate\n";
+  for (int tid = 0; tid < 4; tid++)
+    header_text << "@SQ\tSN:" << chroms[tid] << "\tLN:" << chrom_lengths[tid] << "\n";
+  // sam_hdr_parse() only extracts the chromosomes, so the text written to the file is added separately
+  bam_hdr_t* header = sam_hdr_parse(header_text.str().size(), header_text.str().c_str());
+  if (header == NULL)
+    return false;
+  header->l_text = header_text.str().size();
+  header->text   = strdup(header_text.str().c_str());
+  samFile* file  = sam_open(path.c_str(), "wb");
+  if (file == NULL || sam_hdr_write(file, header) < 0)
+    return false;
+
+  std::string seq(150, 'A'), qual(150, 'I');
+  bam1_t* read = bam_init1();
+  bool success = true;
+  int read_id  = 0;
+  for (int tid = 0; tid < 4; tid++){
+    std::vector<int> positions;
+    for (int i = 0; i < num_reads[tid]; i++)
+      positions.push_back(1 + rand() % (chrom_lengths[tid] - 100000));
+    std::sort(positions.begin(), positions.end());
+    for (int pos : positions){
+      // Mostly 150bp reads, along with spliced reads spanning up to 100kb and unmapped reads placed at their mate's position
+      int type = rand() % 100;
+      std::stringstream line;
+      line << "read" << read_id++ << "\t" << (type == 99 ? BAM_FUNMAP : 0) << "\t" << chroms[tid] << "\t" << pos << "\t60\t";
+      if (type == 99)
+	line << "*";
+      else if (type < 2)
+	line << "75M" << 1000 + rand() % 99000 << "N75M";
+      else
+	line << "150M";
+      line << "\t*\t0\t0\t" << seq << "\t" << qual;
+      success &= write_record(file, header, read, line.str());
+    }
+  }
+
+  // Unplaced unmapped reads
+  for (int i = 0; i < 500; i++)
+    success &= write_record(file, header, read, "unmapped" + std::to_string(i) + "\t4\t*\t0\t0\t*\t*\t0\t0\t" + seq + "\t" + qual);
+  bam_destroy1(read);
+  bam_hdr_destroy(header);
+  if (sam_close(file) != 0)
+    return false;
+  return success && sam_index_build(path.c_str(), 0) == 0;
+}
+
+// Returns the names of the reads returned by ITER, consuming it
+std::vector<std::string> read_names(samFile* file, hts_itr_t* iter){
+  std::vector<std::string> names;
+  bam1_t* read = bam_init1();
+  while (sam_itr_next(file, iter, read) >= 0)
+    names.push_back(bam_get_qname(read));
+  bam_destroy1(read);
+  return names;
+}
+
+// Compares the chunks and records of random queries, as well as the read counts, against those of sam_index_load()
+int compare_index(const std::string& bam_path, const std::string& cache_dir){
+  int failures = 0;
+  samFile* file     = sam_open(bam_path.c_str(), "r");
+  bam_hdr_t* header = (file != NULL ? sam_hdr_read(file) : NULL);
+  hts_idx_t* idx    = (file != NULL ? sam_index_load(file, bam_path.c_str()) : NULL);
+  MappedBamIndex* mapped_idx = MappedBamIndex::open(bam_path, cache_dir);
+  if (header == NULL || idx == NULL || mapped_idx == NULL){
+    std::cerr << "Failed to open " << bam_path << " or its indexes" << std::endl;
+    return 1;
+  }
+
+  int num_chroms = header->n_targets;
+  for (int tid = 0; tid < num_chroms; tid++){
+    uint64_t mapped, unmapped, cached_mapped, cached_unmapped;
+    int status = hts_idx_get_stat(idx, tid, &mapped, &unmapped);
+    if (mapped_idx->get_stat(tid, &cached_mapped, &cached_unmapped) != status || (status == 0 && (mapped != cached_mapped || unmapped != cached_unmapped))){
+      std::cerr << "Read counts for chromosome " << tid << " of " << bam_path << " differ" << std::endl;
+      failures++;
+    }
+  }
+
+  for (int i = 0; i < NUM_QUERIES; i++){
+    // Occasionally query past the end of the chromosomes and beyond the last chromosome
+    int tid    = rand() % (num_chroms + 1);
+    int length = (tid < num_chroms ? (int)header->target_len[tid] : 1000000);
+    int beg    = rand() % (length + 1000);
+    int end    = beg + (rand() % 4 == 0 ? rand() % 500000 : rand() % 1000);
+    hts_itr_t* iter        = sam_itr_queryi(idx, tid, beg, end);
+    hts_itr_t* cached_iter = mapped_idx->query(tid, beg, end);
+    if ((iter == NULL) != (cached_iter == NULL)){
+      std::cerr << "Only one index returned an iterator for " << tid << ":" << beg << "-" << end << " in " << bam_path << std::endl;
+      failures++;
+    }
+    else if (iter != NULL){
+      bool same_chunks = (iter->tid == cached_iter->tid && iter->beg == cached_iter->beg && iter->end == cached_iter->end
+			  && iter->finished == cached_iter->finished && iter->n_off == cached_iter->n_off);
+      for (int j = 0; same_chunks && j < iter->n_off; j++)
+	same_chunks = (iter->off[j].u == cached_iter->off[j].u && iter->off[j].v == cached_iter->off[j].v);
+      if (!same_chunks || (i % 20 == 0 && read_names(file, iter) != read_names(file, cached_iter))){
+	std::cerr << "Query " << tid << ":" << beg << "-" << end << " in " << bam_path << " differs" << std::endl;
+	failures++;
+      }
+    }
+    hts_itr_destroy(iter);
+    hts_itr_destroy(cached_iter);
+  }
+
+  delete mapped_idx;
+  hts_idx_destroy(idx);
+  bam_hdr_destroy(header);
+  sam_close(file);
+  return failures;
+}
+
+// Verifies that MappedBamIndex's queries match those of sam_index_load() for a generated BAM and any BAMs provided as arguments
+int main(int argc, char** argv){
+  srand(11);
+  std::string cache_dir = "bam_index_cache_test_dir";
+  std::string bam_path  = "bam_index_cache_test.bam";
+  mkdir(cache_dir.c_str(), 0755);
+  if (!write_test_bam(bam_path)){
+    std::cerr << "Failed to write " << bam_path << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> bam_paths(1, bam_path);
+  for (int i = 1; i < argc; i++)
+    bam_paths.push_back(argv[i]);
+  int failures = 0;
+  for (const std::string& path : bam_paths){
+    // The second pass maps the cache file written by the first
+    failures += compare_index(path, cache_dir);
+    failures += compare_index(path, cache_dir);
+  }
+
+  DIR* dir = opendir(cache_dir.c_str());
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL)
+    if (entry->d_name[0] != '.')
+      unlink((cache_dir + "/" + entry->d_name).c_str());
+  closedir(dir);
+  rmdir(cache_dir.c_str());
+  remove(bam_path.c_str());
+  remove((bam_path + ".bai").c_str());
+
+  if (failures != 0){
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
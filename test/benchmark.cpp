@@ -0,0 +1,474 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "htslib/sam.h"
+
+#include "../src/bam_io.h"
+#include "../src/base_quality.h"
+#include "../src/em_stutter_genotyper.h"
+#include "../src/error.h"
+#include "../src/genotyper.h"
+#include "../src/stutter_model.h"
+#include "../src/SeqAlignment/AlignmentData.h"
+#include "../src/SeqAlignment/AlignmentModel.h"
+#include "../src/SeqAlignment/HapAligner.h"
+#include "../src/SeqAlignment/HapBlock.h"
+#include "../src/SeqAlignment/Haplotype.h"
+#include "../src/SeqAlignment/NeedlemanWunsch.h"
+#include "../src/SeqAlignment/RepeatBlock.h"
+#include "../src/SeqAlignment/StutterAlignerClass.h"
+
+/*
+ * Micro-benchmarks for HipSTR's alignment and genotyping kernels. Each benchmark runs on a synthetic
+ * locus generated from a fixed seed and reports its throughput in reads/sec and ns per cell, where a cell
+ * is the unit of work described alongside each benchmark
+ */
+
+const std::string BASES = "ACGT";
+
+struct BenchmarkOptions {
+  int depth, read_len, period, num_alleles, num_samples, num_loci, reps;
+  unsigned int seed;
+  std::string only;
+};
+
+class SyntheticLocus {
+ public:
+  std::string left_flank, right_flank, motif;
+  std::vector<std::string> alleles; // Repeat sequence for each allele, starting with the reference allele
+  std::vector<int> allele_copies;
+
+  SyntheticLocus(const BenchmarkOptions& opts, std::mt19937& rng){
+    std::uniform_int_distribution<int> base_dist(0, 3);
+    for (int i = 0; i < opts.read_len; i++){
+      left_flank.push_back(BASES[base_dist(rng)]);
+      right_flank.push_back(BASES[base_dist(rng)]);
+    }
+    motif = random_motif(opts.period, rng);
+
+    // Alleles alternate between expansions and contractions of the 10-copy reference allele
+    const int ref_copies = 10;
+    for (int i = 0; i < opts.num_alleles; i++){
+      int copies = ref_copies + (i % 2 == 1 ? (i+1)/2 : -(i/2));
+      allele_copies.push_back(copies);
+      std::string seq;
+      for (int j = 0; j < copies; j++)
+	seq += motif;
+      alleles.push_back(seq);
+    }
+  }
+
+  std::string haplotype_seq(int allele_index) const { return left_flank + alleles[allele_index] + right_flank; }
+
+ private:
+  // Select a motif that isn't itself a shorter repeat, as otherwise alleles could be ambiguous
+  static std::string random_motif(int period, std::mt19937& rng){
+    std::uniform_int_distribution<int> base_dist(0, 3);
+    while (true){
+      std::string motif;
+      for (int i = 0; i < period; i++)
+	motif.push_back(BASES[base_dist(rng)]);
+      bool valid = true;
+      for (int sub_len = 1; sub_len < period; sub_len++){
+	if (period % sub_len != 0)
+	  continue;
+	bool repeats = true;
+	for (int i = sub_len; i < period; i++)
+	  repeats &= (motif[i] == motif[i-sub_len]);
+	valid &= !repeats;
+      }
+      if (valid)
+	return motif;
+    }
+  }
+};
+
+// Simulate reads with ~1% sequencing errors from random haplotypes of the locus. The alignments only
+// contain a single match operation, as HapAligner only uses them to select each read's seed base
+void simulate_reads(const SyntheticLocus& locus, const BenchmarkOptions& opts, int num_reads, std::mt19937& rng,
+		    std::vector<Alignment>& alignments){
+  std::uniform_int_distribution<int> allele_dist(0, locus.alleles.size()-1), base_dist(0, 3), error_dist(0, 99), qual_dist(20, 40);
+  for (int i = 0; i < num_reads; i++){
+    std::string hap_seq = locus.haplotype_seq(allele_dist(rng));
+    std::uniform_int_distribution<int> start_dist(0, hap_seq.size()-opts.read_len);
+    int start       = start_dist(rng);
+    std::string seq = hap_seq.substr(start, opts.read_len), quals;
+    for (int j = 0; j < opts.read_len; j++){
+      if (error_dist(rng) == 0)
+	seq[j] = BASES[base_dist(rng)];
+      quals.push_back((char)(BaseQuality::MIN_BASE_QUALITY + qual_dist(rng)));
+    }
+    Alignment aln(start, start+opts.read_len, "read" + std::to_string(i), quals, seq, seq);
+    aln.add_cigar_element(CigarElement('=', opts.read_len));
+    alignments.push_back(aln);
+  }
+}
+
+// Runs the benchmark function OPTS.REPS times and reports its throughput. The function returns the number of cells it processed
+void report(const std::string& name, const BenchmarkOptions& opts, int64_t num_reads, std::function<int64_t()> benchmark){
+  if (!opts.only.empty() && name.find(opts.only) == std::string::npos)
+    return;
+  int64_t total_cells = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < opts.reps; i++)
+    total_cells += benchmark();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-50s %14.1f reads/sec %12.3f ns/cell\n", name.c_str(), (num_reads*opts.reps)/elapsed, 1e9*elapsed/std::max((int64_t)1, total_cells));
+  fflush(stdout);
+}
+
+/*
+ * Builds the haplotype blocks for the locus. The caller is responsible for deleting them
+ */
+void build_blocks(const SyntheticLocus& locus, StutterModel* stutter_model, std::vector<HapBlock*>& blocks){
+  int32_t lflank_end = locus.left_flank.size();
+  int32_t rep_end    = lflank_end + locus.alleles[0].size();
+  HapBlock* lflank   = new HapBlock(0, lflank_end, locus.left_flank);
+  RepeatBlock* rep   = new RepeatBlock(lflank_end, rep_end, locus.alleles[0], locus.motif.size(), stutter_model);
+  for (unsigned int i = 1; i < locus.alleles.size(); i++){
+    std::string allele = locus.alleles[i];
+    rep->add_alternate(allele);
+  }
+  HapBlock* rflank = new HapBlock(rep_end, rep_end+locus.right_flank.size(), locus.right_flank);
+  blocks.push_back(lflank);
+  blocks.push_back(rep);
+  blocks.push_back(rflank);
+}
+
+// Cell = one entry in the left and right alignment matrices, summed over all haplotypes
+void benchmark_hap_aligner(const BenchmarkOptions& opts, const SyntheticLocus& locus, StutterModel* stutter_model, std::mt19937& rng){
+  std::vector<HapBlock*> blocks;
+  build_blocks(locus, stutter_model, blocks);
+  Haplotype haplotype(blocks);
+  std::vector<bool> realign_to_hap(haplotype.num_combs(), true);
+  HapAligner hap_aligner(&haplotype, realign_to_hap);
+  BaseQuality base_quality;
+
+  int num_reads = opts.depth*opts.num_samples;
+  std::vector<Alignment> alignments;
+  simulate_reads(locus, opts, num_reads, rng, alignments);
+  std::vector<bool> realign_read(num_reads, true);
+  std::vector<double> aln_probs(((int64_t)num_reads)*haplotype.num_combs());
+  std::vector<int> seed_positions(num_reads);
+
+  int64_t total_hap_size = 0;
+  do {
+    total_hap_size += haplotype.cur_size();
+  } while (haplotype.next());
+  haplotype.reset();
+
+  report("HapAligner::process_reads", opts, num_reads, [&]() -> int64_t {
+      hap_aligner.process_reads(alignments, 0, &base_quality, realign_read, aln_probs.data(), seed_positions.data());
+      return total_hap_size*num_reads*(opts.read_len-1);
+    });
+
+  for (unsigned int i = 0; i < blocks.size(); i++)
+    delete blocks[i];
+}
+
+// Cell = one block base compared against a read base, for every stutter artifact size and read position
+void benchmark_stutter_aligner(const BenchmarkOptions& opts, const SyntheticLocus& locus, StutterModel* stutter_model, std::mt19937& rng){
+  std::vector<HapBlock*> blocks;
+  build_blocks(locus, stutter_model, blocks);
+  HapBlock* rep_block       = blocks[1];
+  RepeatStutterInfo* info   = rep_block->get_repeat_info();
+  int block_len             = rep_block->get_seq(0).size();
+  BaseQuality base_quality;
+
+  int num_reads = opts.depth*opts.num_samples;
+  std::vector<Alignment> alignments;
+  simulate_reads(locus, opts, num_reads, rng, alignments);
+  std::vector< std::vector<double> > log_wrong(num_reads), log_correct(num_reads);
+  for (int i = 0; i < num_reads; i++){
+    const std::string& quals = alignments[i].get_base_qualities();
+    for (unsigned int j = 0; j < quals.size(); j++){
+      log_wrong[i].push_back(base_quality.log_prob_error(quals[j]));
+      log_correct[i].push_back(base_quality.log_prob_correct(quals[j]));
+    }
+  }
+
+  report("StutterAlignerClass::align_stutter_region_reverse", opts, num_reads, [&]() -> int64_t {
+      int64_t cells = 0;
+      double total  = 0;
+      for (int i = 0; i < num_reads; i++){
+	const char* seq       = alignments[i].get_sequence().c_str();
+	const double* wrong   = log_wrong[i].data();
+	const double* correct = log_correct[i].data();
+	int seq_len           = opts.read_len;
+	StutterAlignerClass* stutter_aligner = rep_block->get_stutter_aligner(0);
+	stutter_aligner->load_read(seq_len, seq+seq_len-1, wrong+seq_len-1, correct+seq_len-1, info->max_deletion(), info->max_insertion());
+	for (int j = 0, offset = seq_len-1; j < seq_len; ++j, --offset){
+	  for (int artifact_size = info->max_deletion(); artifact_size <= info->max_insertion(); artifact_size += info->get_period()){
+	    int art_pos  = -1;
+	    int base_len = std::min(block_len+artifact_size, j+1);
+	    total += stutter_aligner->align_stutter_region_reverse(base_len, seq+j, offset, wrong+j, correct+j, artifact_size, art_pos);
+	    cells += base_len;
+	  }
+	}
+      }
+      if (total > 0)
+	printErrorAndDie("Invalid stutter alignment log-likelihood");
+      return cells;
+    });
+
+  for (unsigned int i = 0; i < blocks.size(); i++)
+    delete blocks[i];
+}
+
+// Cell = one entry in the dynamic programming matrix
+void benchmark_left_align(const BenchmarkOptions& opts, const SyntheticLocus& locus, std::mt19937& rng){
+  int num_reads = opts.depth*opts.num_samples;
+  std::vector<Alignment> alignments;
+  simulate_reads(locus, opts, num_reads, rng, alignments);
+  std::string ref_seq = locus.haplotype_seq(0);
+
+  report("NeedlemanWunsch::LeftAlign", opts, num_reads, [&]() -> int64_t {
+      std::string ref_seq_al, read_seq_al;
+      std::vector<CigarOp> cigar_list;
+      float score;
+      for (int i = 0; i < num_reads; i++){
+	cigar_list.clear();
+	if (!NeedlemanWunsch::LeftAlign(ref_seq, alignments[i].get_sequence(), ref_seq_al, read_seq_al, &score, cigar_list))
+	  printErrorAndDie("Failed to left align read in benchmark");
+      }
+      return ((int64_t)num_reads)*ref_seq.size()*opts.read_len;
+    });
+}
+
+// Exposes the sample posterior computation for synthetic alignment probabilities
+class SyntheticGenotyper : public Genotyper {
+ public:
+  SyntheticGenotyper(int num_alleles, std::vector<std::string>& sample_names,
+		     std::vector< std::vector<double> >& log_p1, std::vector< std::vector<double> >& log_p2, std::mt19937& rng)
+    : Genotyper(false, sample_names, log_p1, log_p2){
+    std::uniform_real_distribution<double> LL_dist(-20.0, 0.0);
+    num_alleles_           = num_alleles;
+    log_sample_posteriors_ = new double[num_samples_*num_alleles_*num_alleles_];
+    log_aln_probs_         = new double[num_reads_*num_alleles_];
+    for (unsigned int i = 0; i < num_reads_*num_alleles_; i++)
+      log_aln_probs_[i] = LL_dist(rng);
+  }
+
+  double calc_posteriors(){ return calc_log_sample_posteriors(); }
+};
+
+// Generate SNP phasing likelihoods for the reads, where ~10% of reads are informative
+void simulate_phasing(const BenchmarkOptions& opts, std::mt19937& rng, std::vector<std::string>& sample_names,
+		      std::vector< std::vector<double> >& log_p1, std::vector< std::vector<double> >& log_p2){
+  std::uniform_int_distribution<int> phase_dist(0, 9);
+  for (int i = 0; i < opts.num_samples; i++){
+    sample_names.push_back("S" + std::to_string(i));
+    log_p1.push_back(std::vector<double>());
+    log_p2.push_back(std::vector<double>());
+    for (int j = 0; j < opts.depth; j++){
+      int phase = phase_dist(rng);
+      log_p1.back().push_back(phase == 0 ? -0.01 : (phase == 1 ? -2.0 : 0.0));
+      log_p2.back().push_back(phase == 0 ? -2.0  : (phase == 1 ? -0.01 : 0.0));
+    }
+  }
+}
+
+// Cell = one read evaluated for one diplotype
+void benchmark_posteriors(const BenchmarkOptions& opts, std::mt19937& rng){
+  std::vector<std::string> sample_names;
+  std::vector< std::vector<double> > log_p1, log_p2;
+  simulate_phasing(opts, rng, sample_names, log_p1, log_p2);
+  SyntheticGenotyper genotyper(opts.num_alleles, sample_names, log_p1, log_p2, rng);
+
+  int64_t num_reads = ((int64_t)opts.depth)*opts.num_samples;
+  report("Genotyper::calc_log_sample_posteriors", opts, num_reads, [&]() -> int64_t {
+      if (genotyper.calc_posteriors() > 0)
+	printErrorAndDie("Invalid total log-likelihood for posteriors");
+      return num_reads*opts.num_alleles*opts.num_alleles;
+    });
+}
+
+// Cell = one read evaluated for one diplotype, accumulated over all of the EM iterations in a training run
+void benchmark_em_training(const BenchmarkOptions& opts, const SyntheticLocus& locus, std::mt19937& rng){
+  std::vector<std::string> sample_names;
+  std::vector< std::vector<double> > log_p1, log_p2;
+  simulate_phasing(opts, rng, sample_names, log_p1, log_p2);
+
+  // Each read's size is one of its sample's alleles, with stutter artifacts in ~10% of reads
+  std::vector< std::vector<int> > num_bps(opts.num_samples);
+  std::uniform_int_distribution<int> allele_dist(0, opts.num_alleles-1), stutter_dist(0, 19), hap_dist(0, 1);
+  for (int i = 0; i < opts.num_samples; i++){
+    int bp_diffs[2];
+    for (int j = 0; j < 2; j++)
+      bp_diffs[j] = opts.period*(locus.allele_copies[allele_dist(rng)] - locus.allele_copies[0]);
+    for (int j = 0; j < opts.depth; j++){
+      int stutter = stutter_dist(rng);
+      num_bps[i].push_back(bp_diffs[hap_dist(rng)] + (stutter == 0 ? -opts.period : (stutter == 1 ? opts.period : 0)));
+    }
+  }
+
+  // Training modifies the genotyper's state, so each repetition requires a new instance
+  int64_t num_reads = ((int64_t)opts.depth)*opts.num_samples;
+  std::stringstream logger;
+  report("EMStutterGenotyper::train", opts, num_reads, [&]() -> int64_t {
+      EMStutterGenotyper genotyper(false, opts.period, num_bps, log_p1, log_p2, sample_names, 0);
+      genotyper.train(100, 0.01, 0.001, false, logger);
+      return num_reads*opts.num_alleles*opts.num_alleles;
+    });
+}
+
+// Writes a coordinate-sorted, indexed BAM containing OPTS.NUM_LOCI loci with OPTS.DEPTH reads each
+void write_synthetic_bam(const BenchmarkOptions& opts, std::mt19937& rng, const std::string& sam_path, const std::string& bam_path, int32_t& chrom_len){
+  const int32_t locus_spacing = 1000;
+  chrom_len = locus_spacing*(opts.num_loci+1);
+  std::uniform_int_distribution<int> base_dist(0, 3), offset_dist(0, opts.read_len);
+
+  FILE* sam_file = fopen(sam_path.c_str(), "w");
+  if (sam_file == NULL)
+    printErrorAndDie("Failed to open the synthetic SAM file " + sam_path);
+  fprintf(sam_file, "@HD\tVN:1.4\tSO:coordinate\n@SQ\tSN:chr1\tLN:%d\n@RG\tID:S0\tSM:S0\n", chrom_len);
+  std::string quals(opts.read_len, 'I');
+  int read_index = 0;
+  for (int locus = 1; locus <= opts.num_loci; locus++){
+    std::vector<int32_t> starts;
+    for (int i = 0; i < opts.depth; i++)
+      starts.push_back(locus*locus_spacing - offset_dist(rng));
+    std::sort(starts.begin(), starts.end());
+    for (unsigned int i = 0; i < starts.size(); i++){
+      std::string seq;
+      for (int j = 0; j < opts.read_len; j++)
+	seq.push_back(BASES[base_dist(rng)]);
+      fprintf(sam_file, "read%d\t0\tchr1\t%d\t60\t%dM\t*\t0\t0\t%s\t%s\tRG:Z:S0\n",
+	      read_index++, starts[i]+1, opts.read_len, seq.c_str(), quals.c_str());
+    }
+  }
+  fclose(sam_file);
+
+  // Convert the SAM to an indexed BAM
+  samFile* in  = sam_open(sam_path.c_str(), "r");
+  samFile* out = sam_open(bam_path.c_str(), "wb");
+  if (in == NULL || out == NULL)
+    printErrorAndDie("Failed to convert the synthetic SAM file to BAM format");
+  bam_hdr_t* header = sam_hdr_read(in);
+  if (sam_hdr_write(out, header) < 0)
+    printErrorAndDie("Failed to write the synthetic BAM header");
+  bam1_t* b = bam_init1();
+  while (sam_read1(in, header, b) >= 0)
+    if (sam_write1(out, header, b) < 0)
+      printErrorAndDie("Failed to write a synthetic BAM record");
+  bam_destroy1(b);
+  bam_hdr_destroy(header);
+  sam_close(in);
+  sam_close(out);
+  if (bam_index_build(bam_path.c_str(), 0) != 0)
+    printErrorAndDie("Failed to index the synthetic BAM file");
+}
+
+// Cell = one read base
+void benchmark_bam_reader(const BenchmarkOptions& opts, std::mt19937& rng){
+  std::string prefix   = "/tmp/hipstr_benchmark_" + std::to_string(getpid());
+  std::string sam_path = prefix + ".sam", bam_path = prefix + ".bam";
+  int32_t chrom_len;
+  write_synthetic_bam(opts, rng, sam_path, bam_path, chrom_len);
+
+  std::vector<std::string> paths(1, bam_path);
+  int64_t num_reads = ((int64_t)opts.depth)*opts.num_loci;
+  report("BamCramMultiReader::GetNextAlignment", opts, num_reads, [&]() -> int64_t {
+      BamCramMultiReader reader(paths);
+      if (!reader.SetRegion("chr1", 0, chrom_len))
+	printErrorAndDie("Failed to set the region for the synthetic BAM file");
+      BamAlignment aln;
+      int64_t count = 0;
+      while (reader.GetNextAlignment(aln))
+	count++;
+      if (count != num_reads)
+	printErrorAndDie("Synthetic BAM file contained an unexpected number of reads");
+      return count*opts.read_len;
+    });
+
+  remove(sam_path.c_str());
+  remove(bam_path.c_str());
+  remove((bam_path + ".bai").c_str());
+}
+
+void print_usage(){
+  std::cerr << "Usage: benchmark [OPTIONS]" << "\n"
+	    << "\t--depth       <reads>  " << "\t" << "Reads per sample (Default = 50)"                               << "\n"
+	    << "\t--read-len    <bp>     " << "\t" << "Read length (Default = 100)"                                   << "\n"
+	    << "\t--period      <bp>     " << "\t" << "Repeat motif length (Default = 2)"                             << "\n"
+	    << "\t--alleles     <count>  " << "\t" << "Number of STR alleles, at most 15 (Default = 5)"               << "\n"
+	    << "\t--samples     <count>  " << "\t" << "Number of samples (Default = 10)"                              << "\n"
+	    << "\t--loci        <count>  " << "\t" << "Number of loci in the synthetic BAM file (Default = 100)"      << "\n"
+	    << "\t--reps        <count>  " << "\t" << "Number of times each benchmark is repeated (Default = 3)"      << "\n"
+	    << "\t--seed        <int>    " << "\t" << "Seed used to generate the synthetic data (Default = 1)"        << "\n"
+	    << "\t--only        <name>   " << "\t" << "Only run benchmarks whose name contains this string"           << "\n"
+	    << std::endl;
+}
+
+int main(int argc, char** argv){
+  BenchmarkOptions opts;
+  opts.depth       = 50;
+  opts.read_len    = 100;
+  opts.period      = 2;
+  opts.num_alleles = 5;
+  opts.num_samples = 10;
+  opts.num_loci    = 100;
+  opts.reps        = 3;
+  opts.seed        = 1;
+
+  static struct option long_options[] = {
+    {"depth",    required_argument, 0, 'd'},
+    {"read-len", required_argument, 0, 'l'},
+    {"period",   required_argument, 0, 'p'},
+    {"alleles",  required_argument, 0, 'a'},
+    {"samples",  required_argument, 0, 's'},
+    {"loci",     required_argument, 0, 'n'},
+    {"reps",     required_argument, 0, 'r'},
+    {"seed",     required_argument, 0, 'x'},
+    {"only",     required_argument, 0, 'o'},
+    {"help",     no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "d:l:p:a:s:n:r:x:o:h", long_options, NULL)) != -1){
+    switch(c){
+    case 'd': opts.depth       = atoi(optarg); break;
+    case 'l': opts.read_len    = atoi(optarg); break;
+    case 'p': opts.period      = atoi(optarg); break;
+    case 'a': opts.num_alleles = atoi(optarg); break;
+    case 's': opts.num_samples = atoi(optarg); break;
+    case 'n': opts.num_loci    = atoi(optarg); break;
+    case 'r': opts.reps        = atoi(optarg); break;
+    case 'x': opts.seed        = atoi(optarg); break;
+    case 'o': opts.only        = optarg;       break;
+    case 'h': print_usage(); return 0;
+    default:  print_usage(); return 1;
+    }
+  }
+  if (opts.depth <= 0 || opts.read_len < 20 || opts.num_samples <= 0 || opts.num_loci <= 0 || opts.reps <= 0)
+    printErrorAndDie("--depth, --samples, --loci and --reps must be positive and --read-len must be at least 20");
+  if (opts.period < 1 || opts.period > 9)
+    printErrorAndDie("--period must be between 1 and 9");
+  if (opts.num_alleles < 1 || opts.num_alleles > 15)
+    printErrorAndDie("--alleles must be between 1 and 15");
+
+  std::mt19937 rng(opts.seed);
+  SyntheticLocus locus(opts, rng);
+  StutterModel stutter_model(0.9, 0.01, 0.02, 0.7, 0.001, 0.001, opts.period);
+
+  std::cout << "Depth=" << opts.depth << " Read length=" << opts.read_len << " Period=" << opts.period
+	    << " Alleles=" << opts.num_alleles << " Samples=" << opts.num_samples << " Reps=" << opts.reps << std::endl;
+  benchmark_hap_aligner(opts, locus, &stutter_model, rng);
+  benchmark_stutter_aligner(opts, locus, &stutter_model, rng);
+  benchmark_posteriors(opts, rng);
+  benchmark_em_training(opts, locus, rng);
+  benchmark_left_align(opts, locus, rng);
+  benchmark_bam_reader(opts, rng);
+  return 0;
+}
@@ -0,0 +1,616 @@
+#include <errno.h>
+#include <math.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "htslib/faidx.h"
+#include "htslib/sam.h"
+
+#include "../src/error.h"
+#include "../src/stringops.h"
+#include "../src/stutter_model.h"
+
+/*
+ * End-to-end regression benchmark for the HipSTR executable. Simulates a cohort of diploid samples genotyped at
+ * synthetic STR loci, writes the reference, region BED and one BAM per sample, runs HipSTR on the cohort and records
+ * its wall time, peak resident memory and the per-phase timing breakdown from its log in a JSON report. The report can
+ * be compared against the report from a previous release, and the cohort can be swept over a range of values for
+ * any one parameter to chart scaling curves
+ */
+
+const std::string BASES = "ACGT";
+
+struct CohortOptions {
+  int num_samples, depth, num_loci, read_len, threads, reps;
+  std::vector<int> periods;
+  unsigned int seed;
+};
+
+struct SyntheticLocus {
+  int32_t start, end; // 0-based, half-open reference coordinates of the repeat
+  std::string motif;
+  int ref_copies;
+};
+
+// Mean insert size and its spread for the simulated read pairs
+const int INSERT_MEAN = 350;
+const int INSERT_SD   = 50;
+
+// Single-base sequencing error rate
+const double ERROR_RATE = 0.002;
+
+// Allele sizes are drawn from these offsets, in repeat copies, relative to the reference allele
+const int ALLELE_OFFSETS[] = {-2, -1, 0, 0, 0, 1, 2};
+
+// Select a motif that isn't itself a shorter repeat, as otherwise the locus could have multiple periods
+std::string random_motif(int period, std::mt19937& rng){
+  std::uniform_int_distribution<int> base_dist(0, 3);
+  while (true){
+    std::string motif;
+    for (int i = 0; i < period; i++)
+      motif.push_back(BASES[base_dist(rng)]);
+    bool valid = true;
+    for (int sub_len = 1; sub_len < period; sub_len++){
+      if (period % sub_len != 0)
+	continue;
+      bool repeats = true;
+      for (int i = sub_len; i < period; i++)
+	repeats &= (motif[i] == motif[i-sub_len]);
+      valid &= !repeats;
+    }
+    if (valid)
+      return motif;
+  }
+}
+
+int32_t locus_spacing(const CohortOptions& opts){ return 2*(INSERT_MEAN + 4*INSERT_SD + opts.read_len) + 500; }
+
+// Writes the reference FASTA and its index along with the region BED, with loci cycling through the requested periods
+void write_reference(const CohortOptions& opts, const std::string& dir, std::mt19937& rng,
+		     std::string& chrom_seq, std::vector<SyntheticLocus>& loci){
+  int32_t spacing = locus_spacing(opts);
+  std::uniform_int_distribution<int> base_dist(0, 3), copy_dist(8, 14);
+  chrom_seq.clear();
+  for (int32_t i = 0; i < spacing*(opts.num_loci+1); i++)
+    chrom_seq.push_back(BASES[base_dist(rng)]);
+
+  for (int i = 0; i < opts.num_loci; i++){
+    SyntheticLocus locus;
+    locus.motif      = random_motif(opts.periods[i % opts.periods.size()], rng);
+    locus.ref_copies = copy_dist(rng);
+    locus.start      = spacing*(i+1);
+    locus.end        = locus.start + locus.ref_copies*locus.motif.size();
+    for (int32_t j = locus.start; j < locus.end; j++)
+      chrom_seq[j] = locus.motif[(j-locus.start) % locus.motif.size()];
+    loci.push_back(locus);
+  }
+
+  std::string fasta_path = dir + "/ref.fa";
+  std::ofstream fasta(fasta_path.c_str());
+  if (!fasta.is_open())
+    printErrorAndDie("Failed to write the synthetic reference " + fasta_path);
+  fasta << ">chr1\n";
+  for (size_t i = 0; i < chrom_seq.size(); i += 60)
+    fasta << chrom_seq.substr(i, 60) << "\n";
+  fasta.close();
+  if (fai_build(fasta_path.c_str()) != 0)
+    printErrorAndDie("Failed to index the synthetic reference " + fasta_path);
+
+  std::string bed_path = dir + "/regions.bed";
+  std::ofstream bed(bed_path.c_str());
+  if (!bed.is_open())
+    printErrorAndDie("Failed to write the synthetic region file " + bed_path);
+  for (unsigned int i = 0; i < loci.size(); i++)
+    bed << "chr1\t" << loci[i].start+1 << "\t" << loci[i].end << "\t" << loci[i].motif.size() << "\t"
+	<< loci[i].ref_copies << "\tSTR_" << i << "\n";
+  bed.close();
+}
+
+// Stores the haplotype sequence around a locus along with the reference coordinate of each haplotype base,
+// which is -1 for bases inserted relative to the reference. BP_DIFF is the allele's size relative to the reference
+void build_haplotype(const std::string& chrom_seq, const SyntheticLocus& locus, int32_t window, int bp_diff,
+		     std::string& hap_seq, std::vector<int32_t>& ref_pos){
+  hap_seq.clear();
+  ref_pos.clear();
+  for (int32_t i = locus.start-window; i < locus.end; i++){
+    // Deletions remove the last bases of the repeat
+    if (bp_diff < 0 && i >= locus.end+bp_diff)
+      continue;
+    hap_seq.push_back(chrom_seq[i]);
+    ref_pos.push_back(i);
+  }
+  for (int i = 0; i < bp_diff; i++){
+    hap_seq.push_back(locus.motif[i % locus.motif.size()]);
+    ref_pos.push_back(-1);
+  }
+  for (int32_t i = locus.end; i < locus.end+window; i++){
+    hap_seq.push_back(chrom_seq[i]);
+    ref_pos.push_back(i);
+  }
+}
+
+// Returns the CIGAR string for the haplotype bases in [START, END), which must begin and end with reference bases
+std::string cigar_string(const std::vector<int32_t>& ref_pos, int32_t start, int32_t end){
+  std::vector< std::pair<char, int> > ops;
+  int32_t prev = -1;
+  for (int32_t i = start; i < end; i++){
+    char op = 'M';
+    if (ref_pos[i] == -1)
+      op = 'I';
+    else {
+      if (prev != -1 && ref_pos[i] > prev+1)
+	ops.push_back(std::pair<char, int>('D', ref_pos[i]-prev-1));
+      prev = ref_pos[i];
+    }
+    if (!ops.empty() && ops.back().first == op)
+      ops.back().second++;
+    else
+      ops.push_back(std::pair<char, int>(op, 1));
+  }
+  std::stringstream cigar;
+  for (unsigned int i = 0; i < ops.size(); i++)
+    cigar << ops[i].second << ops[i].first;
+  return cigar.str();
+}
+
+std::string add_errors(const std::string& seq, std::mt19937& rng){
+  std::uniform_real_distribution<double> error_dist(0.0, 1.0);
+  std::uniform_int_distribution<int> base_dist(0, 3);
+  std::string result = seq;
+  for (unsigned int i = 0; i < result.size(); i++)
+    if (error_dist(rng) < ERROR_RATE)
+      result[i] = BASES[base_dist(rng)];
+  return result;
+}
+
+struct SamRecord {
+  int32_t pos;
+  std::string line;
+  bool operator<(const SamRecord& other) const { return pos < other.pos; }
+};
+
+// Converts the SAM file to a BAM file and indexes it
+void convert_to_bam(const std::string& sam_path, const std::string& bam_path){
+  samFile* in  = sam_open(sam_path.c_str(), "r");
+  samFile* out = sam_open(bam_path.c_str(), "wb");
+  if (in == NULL || out == NULL)
+    printErrorAndDie("Failed to convert the synthetic SAM file " + sam_path + " to BAM format");
+  bam_hdr_t* header = sam_hdr_read(in);
+  if (sam_hdr_write(out, header) < 0)
+    printErrorAndDie("Failed to write the synthetic BAM header");
+  bam1_t* b = bam_init1();
+  while (sam_read1(in, header, b) >= 0)
+    if (sam_write1(out, header, b) < 0)
+      printErrorAndDie("Failed to write a synthetic BAM record");
+  bam_destroy1(b);
+  bam_hdr_destroy(header);
+  sam_close(in);
+  sam_close(out);
+  if (bam_index_build(bam_path.c_str(), 0) != 0)
+    printErrorAndDie("Failed to index the synthetic BAM file " + bam_path);
+  remove(sam_path.c_str());
+}
+
+/*
+ * Writes a BAM for each sample containing OPTS.DEPTH read pairs per locus. Each pair has one read that spans the repeat
+ * and a mate that lies entirely within the flanking sequence. The repeat in every spanning read contains a stutter
+ * artifact drawn from the locus' stutter model
+ */
+void write_sample_bams(const CohortOptions& opts, const std::string& dir, const std::string& chrom_seq,
+		       const std::vector<SyntheticLocus>& loci, std::mt19937& rng, std::vector<std::string>& bam_paths){
+  int32_t window = INSERT_MEAN + 4*INSERT_SD + opts.read_len;
+  std::uniform_int_distribution<int> offset_dist(0, sizeof(ALLELE_OFFSETS)/sizeof(ALLELE_OFFSETS[0])-1), hap_dist(0, 1), strand_dist(0, 1);
+  std::normal_distribution<double> insert_dist(INSERT_MEAN, INSERT_SD);
+  std::string quals(opts.read_len, 'I');
+
+  for (int sample = 0; sample < opts.num_samples; sample++){
+    std::string name = "S" + std::to_string(sample);
+    std::vector<SamRecord> records;
+    int pair_index = 0;
+    for (unsigned int i = 0; i < loci.size(); i++){
+      const SyntheticLocus& locus = loci[i];
+      int period   = locus.motif.size();
+      int genotype[2];
+      for (int j = 0; j < 2; j++)
+	genotype[j] = period*std::max(1-locus.ref_copies, ALLELE_OFFSETS[offset_dist(rng)]);
+
+      // Stutter artifacts, in bp, are drawn from the model's probability mass function
+      StutterModel stutter_model(0.9, 0.05, 0.08, 0.8, 0.005, 0.005, period);
+      std::vector<int> artifacts;
+      std::vector<double> artifact_probs;
+      for (int bp = -3*period; bp <= 3*period; bp++){
+	artifacts.push_back(bp);
+	artifact_probs.push_back(exp(stutter_model.log_stutter_pmf(0, bp)));
+      }
+      std::discrete_distribution<int> artifact_dist(artifact_probs.begin(), artifact_probs.end());
+
+      std::string hap_seq;
+      std::vector<int32_t> ref_pos;
+      for (int j = 0; j < opts.depth; j++){
+	// The repeat always retains at least one copy of the motif
+	int bp_diff = std::max(period-locus.ref_copies*period, genotype[hap_dist(rng)] + artifacts[artifact_dist(rng)]);
+	build_haplotype(chrom_seq, locus, window, bp_diff, hap_seq, ref_pos);
+
+	// Position the spanning read so that it has at least 10 bp of flank on each side of the repeat, if possible
+	int32_t rep_start = window, rep_end = window + locus.ref_copies*period + bp_diff;
+	int32_t slack     = opts.read_len - (rep_end-rep_start) - 20;
+	if (slack < 0)
+	  continue;
+	std::uniform_int_distribution<int32_t> start_dist(rep_start - 10 - slack, rep_start - 10);
+	int32_t span_start = start_dist(rng), span_end = span_start + opts.read_len;
+	int32_t insert     = std::max(2*opts.read_len + 2*period*locus.ref_copies, (int32_t)insert_dist(rng));
+
+	// The mate lies downstream of the spanning read when the spanning read is on the forward strand and vice versa
+	bool span_forward = (strand_dist(rng) == 0);
+	int32_t mate_start, mate_end;
+	if (span_forward){
+	  mate_end   = std::min((int32_t)hap_seq.size(), span_start + insert);
+	  mate_start = mate_end - opts.read_len;
+	}
+	else {
+	  mate_start = std::max(0, span_end - insert);
+	  mate_end   = mate_start + opts.read_len;
+	}
+	if (ref_pos[span_start] == -1 || ref_pos[span_end-1] == -1 || ref_pos[mate_start] == -1 || ref_pos[mate_end-1] == -1)
+	  continue;
+
+	int32_t span_pos = ref_pos[span_start], mate_pos = ref_pos[mate_start];
+	int32_t frag_start = std::min(span_pos, mate_pos), frag_end = std::max(ref_pos[span_end-1], ref_pos[mate_end-1]) + 1;
+	int32_t tlen = frag_end - frag_start;
+	std::string qname = name + "_" + std::to_string(pair_index++);
+	std::string span_seq = add_errors(hap_seq.substr(span_start, opts.read_len), rng);
+	std::string mate_seq = add_errors(hap_seq.substr(mate_start, opts.read_len), rng);
+
+	// Forward reads are read 1 and reverse reads are read 2, with flags for properly paired reads
+	int span_flag = (span_forward ? 99 : 147), mate_flag = (span_forward ? 147 : 99);
+	std::stringstream span_line, mate_line;
+	span_line << qname << "\t" << span_flag << "\tchr1\t" << span_pos+1 << "\t60\t" << cigar_string(ref_pos, span_start, span_end)
+		  << "\t=\t" << mate_pos+1 << "\t" << (span_pos <= mate_pos ? tlen : -tlen) << "\t" << span_seq << "\t" << quals << "\tRG:Z:" << name;
+	mate_line << qname << "\t" << mate_flag << "\tchr1\t" << mate_pos+1 << "\t60\t" << cigar_string(ref_pos, mate_start, mate_end)
+		  << "\t=\t" << span_pos+1 << "\t" << (mate_pos < span_pos ? tlen : -tlen) << "\t" << mate_seq << "\t" << quals << "\tRG:Z:" << name;
+	records.push_back(SamRecord{span_pos, span_line.str()});
+	records.push_back(SamRecord{mate_pos, mate_line.str()});
+      }
+    }
+    std::stable_sort(records.begin(), records.end());
+
+    std::string sam_path = dir + "/" + name + ".sam";
+    std::ofstream sam(sam_path.c_str());
+    if (!sam.is_open())
+      printErrorAndDie("Failed to write the synthetic SAM file " + sam_path);
+    sam << "@HD\tVN:1.4\tSO:coordinate\n@SQ\tSN:chr1\tLN:" << chrom_seq.size() << "\n"
+	<< "@RG\tID:" << name << "\tSM:" << name << "\tLB:" << name << "\n";
+    for (unsigned int i = 0; i < records.size(); i++)
+      sam << records[i].line << "\n";
+    sam.close();
+
+    bam_paths.push_back(dir + "/" + name + ".bam");
+    convert_to_bam(sam_path, bam_paths.back());
+  }
+}
+
+struct PhaseTime {
+  std::string name;
+  double wall, cpu;
+};
+
+struct RunResult {
+  double wall_seconds;
+  int64_t peak_rss_kb;
+  std::vector<PhaseTime> phases;
+};
+
+// Extracts the timing breakdown that HipSTR writes at the end of its log
+void parse_phase_times(const std::string& log_path, std::vector<PhaseTime>& phases){
+  std::ifstream log(log_path.c_str());
+  if (!log.is_open())
+    printErrorAndDie("Failed to open the HipSTR log " + log_path);
+  std::string line;
+  bool in_breakdown = false;
+  while (std::getline(log, line)){
+    if (line.find("Approximate timing breakdown") != std::string::npos){
+      in_breakdown = true;
+      phases.clear();
+      continue;
+    }
+    if (!in_breakdown)
+      continue;
+    size_t eq = line.find("= "), cpu = line.find(" seconds (CPU = ");
+    if (eq == std::string::npos || cpu == std::string::npos){
+      in_breakdown = false;
+      continue;
+    }
+    PhaseTime phase;
+    size_t name_start = line.find_first_not_of(" \t"), name_end = line.find_last_not_of(" ", eq-1);
+    phase.name = line.substr(name_start, name_end+1-name_start);
+    phase.wall = atof(line.c_str()+eq+2);
+    phase.cpu  = atof(line.c_str()+cpu+16);
+    phases.push_back(phase);
+  }
+}
+
+// Runs HipSTR on the simulated cohort and measures its wall time and peak resident memory
+RunResult run_hipstr(const CohortOptions& opts, const std::string& hipstr, const std::string& extra_args,
+		     const std::string& dir, const std::vector<std::string>& bam_paths){
+  std::string bams;
+  for (unsigned int i = 0; i < bam_paths.size(); i++)
+    bams += (i == 0 ? "" : ",") + bam_paths[i];
+  std::vector<std::string> args = {hipstr, "--bams", bams, "--fasta", dir + "/ref.fa", "--regions", dir + "/regions.bed",
+				   "--str-vcf", dir + "/calls.vcf.gz", "--log", dir + "/hipstr.log",
+				   "--threads", std::to_string(opts.threads), "--min-reads", std::to_string(std::max(1, opts.num_samples*opts.depth/4))};
+  std::vector<std::string> extra;
+  split_by_delim(extra_args, ' ', extra);
+  for (unsigned int i = 0; i < extra.size(); i++)
+    if (!extra[i].empty())
+      args.push_back(extra[i]);
+  std::vector<char*> argv;
+  for (unsigned int i = 0; i < args.size(); i++)
+    argv.push_back(const_cast<char*>(args[i].c_str()));
+  argv.push_back(NULL);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid  = fork();
+  if (pid < 0)
+    printErrorAndDie("Failed to launch HipSTR");
+  if (pid == 0){
+    execv(argv[0], argv.data());
+    perror("execv");
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid)
+    printErrorAndDie("Failed to wait for HipSTR to finish");
+  RunResult result;
+  result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    printErrorAndDie("HipSTR failed on the synthetic cohort. See " + dir + "/hipstr.log for details");
+  result.peak_rss_kb = usage.ru_maxrss;
+  parse_phase_times(dir + "/hipstr.log", result.phases);
+  return result;
+}
+
+// Extracts the numeric values that follow each occurrence of KEY in a report written by this benchmark
+std::vector<double> extract_values(const std::string& report, const std::string& key){
+  std::vector<double> values;
+  std::string pattern = "\"" + key + "\": ";
+  size_t pos = report.find(pattern);
+  while (pos != std::string::npos){
+    values.push_back(atof(report.c_str()+pos+pattern.size()));
+    pos = report.find(pattern, pos+1);
+  }
+  return values;
+}
+
+std::string json_string(const std::string& value){ return "\"" + value + "\""; }
+
+void print_usage(){
+  std::cerr << "Usage: cohort_benchmark --hipstr <HipSTR> [OPTIONS]" << "\n"
+	    << "\t--samples     <count>     " << "\t" << "Number of samples in the cohort (Default = 10)"                            << "\n"
+	    << "\t--depth       <pairs>     " << "\t" << "Read pairs per sample at each locus (Default = 30)"                       << "\n"
+	    << "\t--loci        <count>     " << "\t" << "Number of STR loci (Default = 200)"                                       << "\n"
+	    << "\t--periods     <list>      " << "\t" << "Comma-separated motif lengths that the loci cycle through (Default = 2,3,4)" << "\n"
+	    << "\t--read-len    <bp>        " << "\t" << "Read length (Default = 100)"                                              << "\n"
+	    << "\t--threads     <count>     " << "\t" << "Number of threads used by HipSTR (Default = 1)"                           << "\n"
+	    << "\t--reps        <count>     " << "\t" << "Number of times HipSTR is run on each cohort (Default = 3)"               << "\n"
+	    << "\t--seed        <int>       " << "\t" << "Seed used to simulate the cohort (Default = 1)"                           << "\n"
+	    << "\t--sweep       <knob=list> " << "\t" << "Benchmark a cohort for each comma-separated value of one of the knobs"    << "\n"
+	    << "\t              "             << "\t" << "  samples, depth, loci, read-len or threads, e.g. samples=10,20,40"       << "\n"
+	    << "\t--hipstr-args <args>      " << "\t" << "Additional space-separated options passed to HipSTR"                      << "\n"
+	    << "\t--work-dir    <dir>       " << "\t" << "Directory in which the cohorts are simulated (Default = /tmp/hipstr_cohort_<pid>)" << "\n"
+	    << "\t--json        <file>      " << "\t" << "Write the report to this file instead of the standard output"             << "\n"
+	    << "\t--baseline    <file>      " << "\t" << "Compare the results against the report from a previous run"               << "\n"
+	    << "\t--tolerance   <fraction>  " << "\t" << "Fail if the median wall time exceeds the baseline's by this fraction (Default = 0.1)" << "\n"
+	    << std::endl;
+}
+
+int main(int argc, char** argv){
+  CohortOptions opts;
+  opts.num_samples = 10;
+  opts.depth       = 30;
+  opts.num_loci    = 200;
+  opts.read_len    = 100;
+  opts.threads     = 1;
+  opts.reps        = 3;
+  opts.seed        = 1;
+  opts.periods     = {2, 3, 4};
+  std::string hipstr, hipstr_args, work_dir = "/tmp/hipstr_cohort_" + std::to_string(getpid());
+  std::string json_file, baseline_file, sweep;
+  double tolerance = 0.1;
+
+  static struct option long_options[] = {
+    {"samples",     required_argument, 0, 's'},
+    {"depth",       required_argument, 0, 'd'},
+    {"loci",        required_argument, 0, 'n'},
+    {"periods",     required_argument, 0, 'p'},
+    {"read-len",    required_argument, 0, 'l'},
+    {"threads",     required_argument, 0, 't'},
+    {"reps",        required_argument, 0, 'r'},
+    {"seed",        required_argument, 0, 'x'},
+    {"sweep",       required_argument, 0, 'w'},
+    {"hipstr",      required_argument, 0, 'e'},
+    {"hipstr-args", required_argument, 0, 'a'},
+    {"work-dir",    required_argument, 0, 'o'},
+    {"json",        required_argument, 0, 'j'},
+    {"baseline",    required_argument, 0, 'b'},
+    {"tolerance",   required_argument, 0, 'T'},
+    {"help",        no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  std::vector<std::string> tokens;
+  while ((c = getopt_long(argc, argv, "s:d:n:p:l:t:r:x:w:e:a:o:j:b:T:h", long_options, NULL)) != -1){
+    switch(c){
+    case 's': opts.num_samples = atoi(optarg); break;
+    case 'd': opts.depth       = atoi(optarg); break;
+    case 'n': opts.num_loci    = atoi(optarg); break;
+    case 'l': opts.read_len    = atoi(optarg); break;
+    case 't': opts.threads     = atoi(optarg); break;
+    case 'r': opts.reps        = atoi(optarg); break;
+    case 'x': opts.seed        = atoi(optarg); break;
+    case 'w': sweep            = optarg;       break;
+    case 'e': hipstr           = optarg;       break;
+    case 'a': hipstr_args      = optarg;       break;
+    case 'o': work_dir         = optarg;       break;
+    case 'j': json_file        = optarg;       break;
+    case 'b': baseline_file    = optarg;       break;
+    case 'T': tolerance        = atof(optarg); break;
+    case 'p':
+      tokens.clear();
+      opts.periods.clear();
+      split_by_delim(optarg, ',', tokens);
+      for (unsigned int i = 0; i < tokens.size(); i++)
+	opts.periods.push_back(atoi(tokens[i].c_str()));
+      break;
+    case 'h': print_usage(); return 0;
+    default:  print_usage(); return 1;
+    }
+  }
+  if (hipstr.empty()){
+    print_usage();
+    printErrorAndDie("--hipstr option required");
+  }
+  for (unsigned int i = 0; i < opts.periods.size(); i++)
+    if (opts.periods[i] < 1 || opts.periods[i] > 9)
+      printErrorAndDie("--periods must only contain values between 1 and 9");
+  if (opts.periods.empty())
+    printErrorAndDie("--periods must contain at least one motif length");
+
+  // Each benchmark point is a copy of the base options with the swept knob modified
+  std::string knob;
+  std::vector<int> knob_values(1, 0);
+  if (!sweep.empty()){
+    size_t eq = sweep.find('=');
+    if (eq == std::string::npos)
+      printErrorAndDie("--sweep must have the format knob=value1,value2,...");
+    knob = sweep.substr(0, eq);
+    if (knob != "samples" && knob != "depth" && knob != "loci" && knob != "read-len" && knob != "threads")
+      printErrorAndDie("Invalid --sweep knob " + knob + ". Must be one of samples, depth, loci, read-len or threads");
+    tokens.clear();
+    knob_values.clear();
+    split_by_delim(sweep.substr(eq+1), ',', tokens);
+    for (unsigned int i = 0; i < tokens.size(); i++)
+      knob_values.push_back(atoi(tokens[i].c_str()));
+  }
+
+  if (mkdir(work_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    printErrorAndDie("Failed to create the benchmark directory " + work_dir);
+
+  std::stringstream report;
+  report << "{\n  \"benchmark\": \"cohort\",\n  \"hipstr\": " << json_string(hipstr) << ",\n  \"hipstr_args\": " << json_string(hipstr_args)
+	 << ",\n  \"sweep\": " << json_string(knob) << ",\n  \"points\": [";
+  std::vector<double> median_walls;
+  for (unsigned int point = 0; point < knob_values.size(); point++){
+    CohortOptions point_opts = opts;
+    if (knob == "samples")  point_opts.num_samples = knob_values[point];
+    if (knob == "depth")    point_opts.depth       = knob_values[point];
+    if (knob == "loci")     point_opts.num_loci    = knob_values[point];
+    if (knob == "read-len") point_opts.read_len    = knob_values[point];
+    if (knob == "threads")  point_opts.threads     = knob_values[point];
+    if (point_opts.num_samples <= 0 || point_opts.depth <= 0 || point_opts.num_loci <= 0 || point_opts.threads <= 0 || point_opts.reps <= 0)
+      printErrorAndDie("--samples, --depth, --loci, --threads and --reps must be positive");
+    if (point_opts.read_len < 50)
+      printErrorAndDie("--read-len must be at least 50");
+
+    std::string dir = work_dir + "/point_" + std::to_string(point);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+      printErrorAndDie("Failed to create the benchmark directory " + dir);
+    std::cerr << "Simulating cohort with " << point_opts.num_samples << " samples, " << point_opts.depth << " read pairs/locus, "
+	      << point_opts.num_loci << " loci and " << point_opts.read_len << " bp reads in " << dir << std::endl;
+    std::mt19937 rng(point_opts.seed);
+    std::string chrom_seq;
+    std::vector<SyntheticLocus> loci;
+    std::vector<std::string> bam_paths;
+    write_reference(point_opts, dir, rng, chrom_seq, loci);
+    write_sample_bams(point_opts, dir, chrom_seq, loci, rng, bam_paths);
+
+    std::vector<RunResult> runs;
+    for (int rep = 0; rep < point_opts.reps; rep++){
+      runs.push_back(run_hipstr(point_opts, hipstr, hipstr_args, dir, bam_paths));
+      std::cerr << "\tRun " << rep+1 << ": " << runs.back().wall_seconds << " sec, peak RSS = " << runs.back().peak_rss_kb << " KB" << std::endl;
+    }
+
+    // Report the phase breakdown of the run with the median wall time
+    std::vector<int> order;
+    for (unsigned int i = 0; i < runs.size(); i++)
+      order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](int a, int b){ return runs[a].wall_seconds < runs[b].wall_seconds; });
+    const RunResult& median = runs[order[order.size()/2]];
+    int64_t max_rss = 0;
+    for (unsigned int i = 0; i < runs.size(); i++)
+      max_rss = std::max(max_rss, runs[i].peak_rss_kb);
+    median_walls.push_back(median.wall_seconds);
+
+    std::string periods;
+    for (unsigned int i = 0; i < point_opts.periods.size(); i++)
+      periods += (i == 0 ? "" : ",") + std::to_string(point_opts.periods[i]);
+    report << (point == 0 ? "\n" : ",\n") << "    {\n"
+	   << "      \"samples\": " << point_opts.num_samples << ", \"depth\": " << point_opts.depth << ", \"loci\": " << point_opts.num_loci
+	   << ", \"periods\": " << json_string(periods) << ", \"read_len\": " << point_opts.read_len << ", \"threads\": " << point_opts.threads
+	   << ", \"seed\": " << point_opts.seed << ",\n"
+	   << "      \"median_wall_seconds\": " << median.wall_seconds << ",\n"
+	   << "      \"max_peak_rss_kb\": " << max_rss << ",\n"
+	   << "      \"loci_per_second\": " << point_opts.num_loci/median.wall_seconds << ",\n"
+	   << "      \"runs\": [";
+    for (unsigned int i = 0; i < runs.size(); i++)
+      report << (i == 0 ? "" : ", ") << "{\"wall_seconds\": " << runs[i].wall_seconds << ", \"peak_rss_kb\": " << runs[i].peak_rss_kb << "}";
+    report << "],\n      \"phases\": [";
+    for (unsigned int i = 0; i < median.phases.size(); i++)
+      report << (i == 0 ? "\n" : ",\n") << "        {\"name\": " << json_string(median.phases[i].name)
+	     << ", \"wall_seconds\": " << median.phases[i].wall << ", \"cpu_seconds\": " << median.phases[i].cpu << "}";
+    report << "\n      ]\n    }";
+  }
+  report << "\n  ]";
+
+  // Compare each point's median wall time to that of the corresponding point in the baseline
+  bool regressed = false;
+  if (!baseline_file.empty()){
+    std::ifstream baseline_input(baseline_file.c_str());
+    if (!baseline_input.is_open())
+      printErrorAndDie("Failed to open the baseline report " + baseline_file);
+    std::stringstream baseline;
+    baseline << baseline_input.rdbuf();
+    std::vector<double> baseline_walls = extract_values(baseline.str(), "median_wall_seconds");
+    if (baseline_walls.size() != median_walls.size())
+      printErrorAndDie("The baseline report contains a different number of benchmark points");
+    report << ",\n  \"baseline\": " << json_string(baseline_file) << ",\n  \"wall_time_ratios\": [";
+    for (unsigned int i = 0; i < median_walls.size(); i++){
+      double ratio = median_walls[i]/baseline_walls[i];
+      report << (i == 0 ? "" : ", ") << ratio;
+      std::cerr << "Point " << i << ": " << median_walls[i] << " sec vs. " << baseline_walls[i] << " sec in the baseline (ratio = " << ratio << ")" << std::endl;
+      if (ratio > 1 + tolerance)
+	regressed = true;
+    }
+    report << "]";
+  }
+  report << "\n}\n";
+
+  if (json_file.empty())
+    std::cout << report.str();
+  else {
+    std::ofstream json(json_file.c_str());
+    if (!json.is_open())
+      printErrorAndDie("Failed to write the benchmark report " + json_file);
+    json << report.str();
+  }
+  if (regressed){
+    std::cerr << "Median wall time regressed by more than " << 100*tolerance << "% relative to the baseline" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/embedded_genotyper.h"
+
+const int32_t STR_START  = 1000;
+const int32_t STR_STOP   = 1024;
+const int32_t READ_LEN   = 100;
+const int32_t NUM_READS  = 20;
+
+// Add reads spanning the STR to the sample, using the reference with INS_LEN extra repeat bases inserted at the end of the STR
+void add_reads(const std::string& ref, int32_t ins_len, SampleReads& sample){
+  std::string haplotype = ref.substr(0, STR_STOP) + ref.substr(STR_STOP-ins_len, ins_len) + ref.substr(STR_STOP);
+  for (int i = 0; i < NUM_READS; i++){
+    ReadSpan read;
+    read.name      = sample.sample + "_" + std::to_string(ins_len) + "_" + std::to_string(i);
+    read.pos       = STR_START - 70 + i;
+    read.sequence  = haplotype.substr(read.pos, READ_LEN);
+    read.qualities = std::string(READ_LEN, 'I');
+    read.reverse_strand = (i%2 == 1);
+    read.log_p1 = read.log_p2 = 0;
+    int32_t left_len = STR_STOP - read.pos;
+    if (ins_len == 0)
+      read.cigar = std::to_string(READ_LEN) + "M";
+    else
+      read.cigar = std::to_string(left_len) + "M" + std::to_string(ins_len) + "I" + std::to_string(READ_LEN-left_len-ins_len) + "M";
+    sample.reads.push_back(read);
+  }
+}
+
+// Extract the number of read pools reported in the locus' log, or -1 if it wasn't reported
+int num_read_pools(const std::string& log){
+  size_t pos = log.find(" pools");
+  if (pos == std::string::npos)
+    return -1;
+  size_t start = log.rfind(' ', pos-1);
+  return std::stoi(log.substr(start+1, pos-start-1));
+}
+
+int main(){
+  std::mt19937 generator(7);
+  std::string ref(2000, 'N');
+  for (unsigned int i = 0; i < ref.size(); i++)
+    ref[i] = "ACGT"[generator()%4];
+  for (int32_t i = STR_START; i < STR_STOP; i++)
+    ref[i] = ((i-STR_START)%2 == 0 ? 'C' : 'A');
+
+  std::vector<SampleReads> samples(2);
+  samples[0].sample = "S2";
+  add_reads(ref, 2, samples[0]);
+  add_reads(ref, 4, samples[0]);
+  samples[1].sample = "S1";
+  add_reads(ref, 0, samples[1]);
+  add_reads(ref, 0, samples[1]);
+
+  EmbeddedGenotyper genotyper;
+  genotyper.MIN_TOTAL_READS = 10;
+  genotyper.set_default_stutter_model(0.9, 0.01, 0.01, 0.9, 0.01, 0.01);
+
+  LocusGenotypes result;
+  RegionGroup region_group(Region("chr1", STR_START, STR_STOP, 2, "test_str"));
+  genotyper.genotype(region_group, 0, ref.size(), ref, samples, result);
+  if (!result.genotyped || result.loci.size() != 1 || result.loci[0].gt_a.size() != 2){
+    std::cerr << "Failed to genotype the locus:\n" << result.log << std::endl;
+    return 1;
+  }
+
+  // The genotypes are reported for the samples sorted by name
+  const LocusColumns& locus = result.loci[0];
+  std::vector< std::pair<int32_t, int32_t> > expected = {{0, 0}, {2, 4}};
+  bool success = true;
+  for (unsigned int i = 0; i < expected.size(); i++){
+    int32_t diff_a = locus.bp_diffs[locus.gt_a[i]], diff_b = locus.bp_diffs[locus.gt_b[i]];
+    if (std::min(diff_a, diff_b) != expected[i].first || std::max(diff_a, diff_b) != expected[i].second){
+      std::cerr << "Incorrect genotype for sample " << i << ": " << diff_a << "|" << diff_b << std::endl;
+      success = false;
+    }
+  }
+
+  // Genotyping a second locus with the same genotyper must not retain any state from the first
+  LocusGenotypes repeat_result;
+  genotyper.genotype(region_group, 0, ref.size(), ref, samples, repeat_result);
+  if (repeat_result.loci.size() != 1 || repeat_result.loci[0].gt_a != locus.gt_a || repeat_result.loci[0].gt_b != locus.gt_b){
+    std::cerr << "Genotypes changed when the locus was genotyped again" << std::endl;
+    success = false;
+  }
+
+  // The locus' flanks don't vary, so genotyping it from the read lengths must yield the same genotypes
+  EmbeddedGenotyper length_genotyper;
+  length_genotyper.MIN_TOTAL_READS = 10;
+  length_genotyper.set_default_stutter_model(0.9, 0.01, 0.01, 0.9, 0.01, 0.01);
+  length_genotyper.use_length_fast_path();
+  LocusGenotypes length_result;
+  length_genotyper.genotype(region_group, 0, ref.size(), ref, samples, length_result);
+  if (!length_result.genotyped || length_result.log.find("length of its repeat") == std::string::npos){
+    std::cerr << "The locus wasn't genotyped from the read lengths:\n" << length_result.log << std::endl;
+    success = false;
+  }
+  else if (length_result.loci.size() != 1 || length_result.loci[0].gt_a != locus.gt_a || length_result.loci[0].gt_b != locus.gt_b){
+    std::cerr << "Genotypes changed when the locus was genotyped from the read lengths" << std::endl;
+    success = false;
+  }
+
+  // The reads start at different positions, so pooling them by their bases near the STR must collapse them into far fewer
+  // pools without changing the genotypes
+  EmbeddedGenotyper window_genotyper;
+  window_genotyper.MIN_TOTAL_READS = 10;
+  window_genotyper.set_default_stutter_model(0.9, 0.01, 0.01, 0.9, 0.01, 0.01);
+  window_genotyper.set_pool_window(10);
+  window_genotyper.use_binned_pool_qualities();
+  LocusGenotypes window_result;
+  window_genotyper.genotype(region_group, 0, ref.size(), ref, samples, window_result);
+  int num_pools = num_read_pools(result.log), num_window_pools = num_read_pools(window_result.log);
+  if (!window_result.genotyped || window_result.loci.size() != 1 || window_result.loci[0].gt_a != locus.gt_a || window_result.loci[0].gt_b != locus.gt_b){
+    std::cerr << "Genotypes changed when the reads were pooled by their bases near the STR:\n" << window_result.log << std::endl;
+    success = false;
+  }
+  else if (num_window_pools <= 0 || num_window_pools >= num_pools){
+    std::cerr << "Pooling the reads by their bases near the STR produced " << num_window_pools << " pools instead of fewer than " << num_pools << std::endl;
+    success = false;
+  }
+
+  // Haploid samples only store and evaluate their homozygous genotypes
+  std::vector<SampleReads> haploid_samples(2);
+  haploid_samples[0].sample = "S2";
+  add_reads(ref, 2, haploid_samples[0]);
+  haploid_samples[1].sample = "S1";
+  add_reads(ref, 0, haploid_samples[1]);
+  EmbeddedGenotyper haploid_genotyper;
+  haploid_genotyper.MIN_TOTAL_READS = 10;
+  haploid_genotyper.set_default_stutter_model(0.9, 0.01, 0.01, 0.9, 0.01, 0.01);
+  haploid_genotyper.add_haploid_chrom("chr1");
+  LocusGenotypes haploid_result;
+  haploid_genotyper.genotype(region_group, 0, ref.size(), ref, haploid_samples, haploid_result);
+  if (!haploid_result.genotyped || haploid_result.loci.size() != 1 || haploid_result.loci[0].gt_a.size() != 2){
+    std::cerr << "Failed to genotype the haploid locus:\n" << haploid_result.log << std::endl;
+    success = false;
+  }
+  else {
+    const LocusColumns& haploid_locus = haploid_result.loci[0];
+    std::vector<int32_t> expected_diffs = {0, 2};
+    for (unsigned int i = 0; i < expected_diffs.size(); i++){
+      if (haploid_locus.gt_b[i] != -1 || haploid_locus.bp_diffs[haploid_locus.gt_a[i]] != expected_diffs[i]){
+	std::cerr << "Incorrect haploid genotype for sample " << i << ": " << haploid_locus.bp_diffs[haploid_locus.gt_a[i]] << std::endl;
+	success = false;
+      }
+    }
+  }
+
+  if (success)
+    std::cerr << "All embedded genotyper tests passed" << std::endl;
+  return (success ? 0 : 1);
+}
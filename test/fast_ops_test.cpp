@@ -1,7 +1,10 @@
+#include <algorithm>
+#include <cfloat>
 #include <iostream>
 #include <math.h>
 
 #include "../src/fastonebigheader.h"
+#include "../src/mathops.h"
 
 int main(){
   for (double v = -20; v < 0; v += 0.1){
@@ -12,4 +15,64 @@ int main(){
     double x = exp(v);
     std::cerr << v << "\t" << log(x) << "\t" << fastlog(x) << std::endl;
   }
+
+  // The vectorized pairwise log-sum-exp must exactly match the scalar version
+  std::vector<double> log_v1, log_v2;
+  for (double v1 = -20; v1 < 0; v1 += 0.37)
+    for (double v2 = -20; v2 < 0; v2 += 0.29){
+      log_v1.push_back(v1);
+      log_v2.push_back(v2);
+    }
+  std::vector<double> log_out(log_v1.size());
+  fast_log_sum_exp(log_v1.data(), log_v2.data(), log_v1.size(), log_out.data());
+  int num_mismatches = 0;
+  for (unsigned int i = 0; i < log_out.size(); i++)
+    if (log_out[i] != fast_log_sum_exp(log_v1[i], log_v2[i]))
+      num_mismatches++;
+  std::cerr << "Vectorized fast_log_sum_exp mismatches: " << num_mismatches << " of " << log_out.size() << std::endl;
+
+  // The batched log-sum-exp functions must agree with log_sum_exp() for arrays of every length, including ones whose maxima appear late
+  int num_inaccurate = 0;
+  std::vector<double> log_vals;
+  for (int n = 1; n < 300; n++){
+    log_vals.push_back(-30.0 + fmod(n*7.31, 29.0) + (n % 97 == 0 ? 40 : 0));
+    double expected = log_sum_exp(log_vals);
+    double max_val  = -DBL_MAX/2, total = 0.0, fast_max_val = -DBL_MAX/2, fast_total = 0.0;
+    update_streaming_log_sum_exp(log_vals.data(), n, max_val, total);
+    fast_update_streaming_log_sum_exp(log_vals.data(), n, fast_max_val, fast_total);
+    if (fabs(finish_streaming_log_sum_exp(max_val, total) - expected) > 1e-10)
+      num_inaccurate++;
+    if (fabs(finish_streaming_log_sum_exp(fast_max_val, fast_total) - expected) > 1e-3)
+      num_inaccurate++;
+    if (fabs(fast_log_sum_exp(log_vals.data(), n) - expected) > 1e-3)
+      num_inaccurate++;
+  }
+  std::cerr << "Inaccurate batched log-sum-exp values: " << num_inaccurate << std::endl;
+
+  // The two-pass weighted log-sum-exp must exactly match the weighted fast_log_sum_exp()
+  std::vector<int> weights;
+  for (unsigned int i = 0; i < log_vals.size(); i++)
+    weights.push_back(1 + i%5);
+  double two_pass_total = 0.0, max_log_val = *std::max_element(log_vals.begin(), log_vals.end());
+  for (unsigned int i = 0; i < log_vals.size(); i++)
+    add_weighted_fast_exp(log_vals[i], weights[i], max_log_val, two_pass_total);
+  if (fast_finish_streaming_log_sum_exp(max_log_val, two_pass_total) != fast_log_sum_exp(log_vals, weights))
+    num_mismatches++;
+
+  // Pairwise values can only be off by the terms skipped below LOG_THRESH, plus the error of the approximation used above it
+  double max_pair_error = 0;
+  for (double diff = -10; diff <= 0; diff += 0.0007)
+    max_pair_error = std::max(max_pair_error, fabs(fast_log_sum_exp(-3.0, -3.0+diff) - (-3.0 + log1p(exp(diff)))));
+#ifdef HIPSTR_LOG1P_EXP_TABLE
+  double max_table_error = 0;
+  for (double diff = LOG_THRESH; diff <= 0; diff += 0.00013)
+    max_table_error = std::max(max_table_error, fabs(table_log1p_exp(diff) - log1p(exp(diff))));
+  std::cerr << "Maximum log(1 + exp(x)) table error: " << max_table_error << std::endl;
+  if (max_table_error > 3e-8)
+    num_inaccurate++;
+#endif
+  std::cerr << "Maximum pairwise fast_log_sum_exp error: " << max_pair_error << std::endl;
+  if (max_pair_error > log(1.001) + 1e-4)
+    num_inaccurate++;
+  return (num_mismatches == 0 && num_inaccurate == 0 ? 0 : 1);
 }
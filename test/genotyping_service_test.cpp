@@ -0,0 +1,150 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/genotyping_service.h"
+#include "../src/region.h"
+
+int failures = 0;
+
+void check(bool condition, const std::string& message){
+  if (!condition){
+    std::cerr << "FAILED: " << message << std::endl;
+    failures++;
+  }
+}
+
+void check_parse(){
+  ServiceRequest request;
+  std::string error;
+  check(request.parse("bams a.bam,b.cram\r\nregions chr1:1000-2000,chr2:5-10\r\n\r\n", error), "Valid request wasn't parsed: " + error);
+  check(request.bam_files == std::vector<std::string>({"a.bam", "b.cram"}), "Incorrect BAM files");
+  check(request.intervals.size() == 2 && request.intervals[0].chrom() == "chr1" && request.intervals[0].start() == 999
+	&& request.intervals[0].stop() == 2000 && request.intervals[1].chrom() == "chr2", "Incorrect intervals");
+  check(!request.shutdown, "Request without a shutdown line was marked as a shutdown");
+
+  ServiceRequest shutdown_request;
+  check(shutdown_request.parse("shutdown\n\n", error) && shutdown_request.shutdown, "Shutdown request wasn't parsed");
+
+  const char* invalid_requests[] = {"regions chr1:1-100\n\n", "bams a.bam\nregions chr1:100\n\n", "bams a.bam\nregions chr1:0-10\n\n",
+				    "bams a.bam\nregions chr1:20-10\n\n", "bams a.bam\nsamples A,B\n\n", ""};
+  for (const char* text : invalid_requests){
+    ServiceRequest invalid_request;
+    error.clear();
+    check(!invalid_request.parse(text, error) && !error.empty(), "Invalid request was parsed: " + std::string(text));
+  }
+}
+
+void check_select_regions(){
+  std::vector<Region> regions = {Region("chr1", 100, 120, 2), Region("chr1", 500, 530, 3), Region("chr1", 2000, 2010, 2), Region("chr2", 100, 140, 4)};
+  std::vector<Region> selected;
+  std::string error;
+
+  ServiceRequest all_request;
+  check(all_request.parse("bams a.bam\n\n", error), "Valid request wasn't parsed: " + error);
+  all_request.select_regions(regions, selected);
+  check(selected.size() == regions.size(), "A request without regions didn't select every region");
+
+  // The intervals are 1-based and inclusive, while the regions are 0-based and half-open, so these only overlap the second region
+  ServiceRequest request;
+  check(request.parse("bams a.bam\nregions chr1:121-501,chr2:141-200,chr3:1-1000\n\n", error), "Valid request wasn't parsed: " + error);
+  request.select_regions(regions, selected);
+  check(selected.size() == 1 && selected[0].chrom() == "chr1" && selected[0].start() == 500, "Incorrect regions were selected");
+}
+
+int connect_to_service(const std::string& socket_path){
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path.c_str());
+  for (int attempt = 0; attempt < 100; attempt++){
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0)
+      return fd;
+    close(fd);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return -1;
+}
+
+void send_text(int fd, const std::string& text){
+  size_t offset = 0;
+  while (offset < text.size()){
+    ssize_t num_written = write(fd, text.data() + offset, text.size() - offset);
+    if (num_written <= 0)
+      return;
+    offset += num_written;
+  }
+}
+
+std::string read_response(int fd){
+  std::string response;
+  char buffer[4096];
+  ssize_t num_read;
+  while ((num_read = read(fd, buffer, sizeof(buffer))) > 0)
+    response.append(buffer, num_read);
+  return response;
+}
+
+bool starts_with(const std::string& text, const std::string& prefix){
+  return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Checks that a client that never sends its request, or sends one that's too large, receives an error rather than blocking the service
+void check_service(){
+  const int TIMEOUT = 1;
+  std::string socket_path = "genotyping_service_test.sock";
+  std::stringstream log;
+  GenotypingService service(socket_path, TIMEOUT);
+  std::function<int(ServiceRequest&)> handler = [](ServiceRequest& request){
+    std::cout << "GENOTYPED " << request.bam_files.size() << std::endl;
+    return 0;
+  };
+  std::thread service_thread([&](){ service.run(handler, log); });
+
+  auto start_time = std::chrono::steady_clock::now();
+  int idle_fd     = connect_to_service(socket_path);
+  int request_fd  = connect_to_service(socket_path);
+  send_text(request_fd, "bams a.bam,b.bam\n\n");
+  std::string idle_response    = read_response(idle_fd);
+  std::string request_response = read_response(request_fd);
+  close(idle_fd);
+  close(request_fd);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  check(starts_with(idle_response, "ERROR: Timed out"), "Idle client received an unexpected response: " + idle_response);
+  check(request_response == "GENOTYPED 2\n", "Request received an unexpected response: " + request_response);
+  check(elapsed < TIMEOUT + 5, "Idle client blocked the service for too long");
+
+  // Write the oversized request on another thread, as the service stops reading it before it's complete
+  int large_fd = connect_to_service(socket_path);
+  std::thread writer_thread([&](){ send_text(large_fd, "bams " + std::string(17*1048576, 'a')); });
+  std::string large_response = read_response(large_fd);
+  writer_thread.join();
+  close(large_fd);
+  check(starts_with(large_response, "ERROR: The request exceeds the maximum size"), "Oversized request received an unexpected response: " + large_response);
+
+  int shutdown_fd = connect_to_service(socket_path);
+  send_text(shutdown_fd, "shutdown\n\n");
+  read_response(shutdown_fd);
+  close(shutdown_fd);
+  service_thread.join();
+}
+
+int main(int argc, char** argv){
+  check_parse();
+  check_select_regions();
+  check_service();
+  if (failures != 0){
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
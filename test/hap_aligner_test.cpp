@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/base_quality.h"
+#include "../src/stutter_model.h"
+#include "../src/task_queue.h"
+#include "../src/SeqAlignment/AlignmentData.h"
+#include "../src/SeqAlignment/AlignmentModel.h"
+#include "../src/SeqAlignment/AlignmentTraceback.h"
+#include "../src/SeqAlignment/HapAligner.h"
+#include "../src/SeqAlignment/HapBlock.h"
+#include "../src/SeqAlignment/Haplotype.h"
+#include "../src/SeqAlignment/RepeatBlock.h"
+
+const std::string BASES = "ACGT";
+
+// Simulate a read from the provided haplotype sequence containing sequencing errors
+Alignment simulate_read(const std::string& hap_seq, int read_len){
+  int start = rand() % (hap_seq.size()-read_len+1);
+  std::string seq = hap_seq.substr(start, read_len), quals;
+  for (int i = 0; i < read_len; i++){
+    if (rand() % 20 == 0)
+      seq[i] = BASES[rand() % 4];
+    quals.push_back((char)(BaseQuality::MIN_BASE_QUALITY + 2 + rand() % 39));
+  }
+  return Alignment(start, start+read_len, "read", quals, seq, seq);
+}
+
+// Returns the sequence of each of the haplotype's block option combinations, in iteration order
+std::vector<std::string> get_hap_seqs(Haplotype& haplotype){
+  std::vector<std::string> hap_seqs;
+  do {
+    hap_seqs.push_back(haplotype.get_seq());
+  } while (haplotype.next());
+  haplotype.reset();
+  return hap_seqs;
+}
+
+// Simulate reads from randomly selected haplotype sequences, each with a gap-free CIGAR string so that process_reads() can select its seed
+std::vector<Alignment> simulate_seeded_reads(const std::vector<std::string>& hap_seqs, int num_reads){
+  std::vector<Alignment> alns;
+  for (int read = 0; read < num_reads; read++){
+    alns.push_back(simulate_read(hap_seqs[rand() % hap_seqs.size()], 25 + rand() % 15));
+    alns.back().add_cigar_element(CigarElement('=', alns.back().get_sequence().size()));
+  }
+  return alns;
+}
+
+// Verify that aligning each read to all haplotypes, which reuses alignment rows across haplotypes,
+// produces exactly the same LLs as aligning each read to the haplotypes one at a time
+bool compare_incremental_alignments(Haplotype& haplotype, BaseQuality& base_quality, const std::string& name){
+  int num_combs = haplotype.num_combs();
+  std::vector<std::string> hap_seqs = get_hap_seqs(haplotype);
+
+  std::vector<bool> realign_all(num_combs, true), realign_some(num_combs, true);
+  for (int i = 0; i < num_combs; i += 3)
+    realign_some[i] = false;
+  HapAligner all_aligner(&haplotype, realign_all), some_aligner(&haplotype, realign_some);
+  AlignmentTrace trace(haplotype.num_blocks());
+
+  for (int read = 0; read < 200; read++){
+    Alignment aln = simulate_read(hap_seqs[rand() % num_combs], 12 + rand() % 8);
+    int seed_base = 1 + rand() % (aln.get_sequence().size()-2);
+    std::vector<double> all_LLs(num_combs), some_LLs(num_combs);
+    all_aligner.process_read(aln, seed_base, &base_quality, false, all_LLs.data(), trace);
+    some_aligner.process_read(aln, seed_base, &base_quality, false, some_LLs.data(), trace);
+
+    for (int hap_index = 0; hap_index < num_combs; hap_index++){
+      std::vector<bool> realign_one(num_combs, false);
+      realign_one[hap_index] = true;
+      HapAligner one_aligner(&haplotype, realign_one);
+      std::vector<double> one_LLs(num_combs);
+      one_aligner.process_read(aln, seed_base, &base_quality, false, one_LLs.data(), trace);
+      double LL = one_LLs[hap_index];
+      if (LL != all_LLs[hap_index] || (realign_some[hap_index] && LL != some_LLs[hap_index])){
+	std::cerr << name << ": incremental LL for haplotype " << hap_index << " doesn't match the LL from a full alignment" << std::endl;
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Verify that aligning reads of various lengths in lockstep batches produces exactly the same LLs as aligning them individually
+bool compare_batched_alignments(Haplotype& haplotype, BaseQuality& base_quality, const std::string& name){
+  int num_combs = haplotype.num_combs();
+  std::vector<std::string> hap_seqs = get_hap_seqs(haplotype);
+
+  std::vector<bool> realign_some(num_combs, true);
+  realign_some[num_combs-1] = false;
+  HapAligner hap_aligner(&haplotype, realign_some);
+  AlignmentTrace trace(haplotype.num_blocks());
+
+  std::vector<Alignment> alns = simulate_seeded_reads(hap_seqs, 103);
+  std::vector<bool> realign_read(alns.size(), true);
+  std::vector<double> batch_LLs(alns.size()*num_combs, 0), read_LLs(num_combs, 0);
+  std::vector<int> seed_positions(alns.size());
+  hap_aligner.process_reads(alns, 0, &base_quality, realign_read, batch_LLs.data(), seed_positions.data());
+
+  for (unsigned int read = 0; read < alns.size(); read++){
+    if (seed_positions[read] == -1)
+      continue;
+    hap_aligner.process_read(alns[read], seed_positions[read], &base_quality, false, read_LLs.data(), trace);
+    for (int hap_index = 0; hap_index < num_combs; hap_index++){
+      if (realign_some[hap_index] && read_LLs[hap_index] != batch_LLs[read*num_combs + hap_index]){
+	std::cerr << name << ": batched LL for haplotype " << hap_index << " doesn't match the LL from an individual alignment" << std::endl;
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Verify that the LLs and seeds are bitwise identical regardless of the number of idle threads that help align the reads
+bool compare_threaded_alignments(Haplotype& haplotype, BaseQuality& base_quality, bool single_precision, bool prune_alns, const std::string& name){
+  int num_combs = haplotype.num_combs();
+  std::vector<std::string> hap_seqs = get_hap_seqs(haplotype);
+
+  std::vector<Alignment> alns = simulate_seeded_reads(hap_seqs, 2500);
+  std::vector<bool> realign_all(num_combs, true), realign_read(alns.size(), true);
+  std::vector<double> serial_LLs(alns.size()*num_combs, 0);
+  std::vector<int> serial_seeds(alns.size());
+  HapAligner serial_aligner(&haplotype, realign_all, single_precision, false, prune_alns);
+  serial_aligner.process_reads(alns, 0, &base_quality, realign_read, serial_LLs.data(), serial_seeds.data());
+
+  for (int num_workers = 2; num_workers <= 4; num_workers++){
+    // The other workers have run out of loci, so they're idle and help align the reads
+    TaskQueue task_queue(num_workers);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < num_workers; i++)
+      workers.push_back(std::thread([&](){ task_queue.work_until_finished(); }));
+    while (task_queue.num_idle_workers() != num_workers-1)
+      std::this_thread::yield();
+
+    std::vector<double> threaded_LLs(alns.size()*num_combs, 0);
+    std::vector<int> threaded_seeds(alns.size());
+    HapAligner threaded_aligner(&haplotype, realign_all, single_precision, false, prune_alns);
+    threaded_aligner.process_reads(alns, 0, &base_quality, realign_read, threaded_LLs.data(), threaded_seeds.data(), &task_queue);
+    task_queue.work_until_finished();
+    for (unsigned int i = 0; i < workers.size(); i++)
+      workers[i].join();
+
+    if (threaded_seeds != serial_seeds || threaded_LLs != serial_LLs){
+      std::cerr << name << ": LLs computed using " << num_workers << " threads don't match those computed using one thread" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Verify that retracing the optimal alignment of reads containing stutter artifacts partitions each read into the sequences of
+// its flanks and repeat, with the artifact's size assigned to the repeat and an alignment consistent with the read's bases
+bool check_traced_alignments(Haplotype& haplotype, BaseQuality& base_quality, const std::string& name){
+  std::vector<bool> realign(haplotype.num_combs(), true);
+  HapAligner hap_aligner(&haplotype, realign);
+  const std::string left_flank = haplotype.get_seq(0), repeat = haplotype.get_seq(1), right_flank = haplotype.get_seq(2);
+  for (int read = 0; read < 100; read++){
+    int stutter  = 2*(rand()%3 - 1);
+    std::string str_seq = (stutter < 0 ? repeat.substr(0, repeat.size()+stutter) : repeat + repeat.substr(0, stutter));
+    int start = 5 + rand() % 10, read_len = 45 + rand() % 10;
+    std::string seq = (left_flank + str_seq + right_flank).substr(start, read_len), quals(read_len, (char)(BaseQuality::MIN_BASE_QUALITY + 30));
+    Alignment aln(start, start+read_len, "read", quals, seq, seq);
+    int seed_base = 5 + rand() % (left_flank.size()-start-8);
+
+    AlignmentTrace* trace = hap_aligner.trace_optimal_aln(aln, seed_base, 0, &base_quality);
+    const Alignment& traced_aln = trace->traced_aln();
+    std::string ungapped_aln;
+    for (auto base_iter = traced_aln.get_alignment().begin(); base_iter != traced_aln.get_alignment().end(); base_iter++)
+      if (*base_iter != '-')
+	ungapped_aln.push_back(*base_iter);
+    bool valid = (trace->flank_seq(0) + trace->str_seq(1) + trace->flank_seq(2) == seq && trace->str_seq(1) == str_seq
+		  && trace->stutter_size(1) == stutter && traced_aln.get_start() == start && ungapped_aln == seq);
+    delete trace;
+    if (!valid){
+      std::cerr << name << ": traced alignment for a read with a " << stutter << "bp stutter artifact doesn't match the read" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Verify that aligning reads to a sparse haplotype, which only iterates through a subset of the block option combinations,
+// produces exactly the same LLs as aligning them to the corresponding combinations of the full haplotype
+bool compare_sparse_alignments(Haplotype& haplotype, Haplotype& sparse_haplotype, BaseQuality& base_quality, const std::string& name){
+  std::vector< std::vector<int> > all_combs, subset;
+  std::vector<std::string> hap_seqs;
+  do {
+    all_combs.push_back(haplotype.cur_indices());
+    hap_seqs.push_back(haplotype.get_seq());
+  } while (haplotype.next());
+  haplotype.reset();
+  for (unsigned int i = 1; i < all_combs.size(); i += 2)
+    subset.push_back(all_combs[i]);
+  sparse_haplotype.set_combinations(subset);
+
+  std::vector<int> dense_indices;
+  do {
+    auto comb_iter = std::find(all_combs.begin(), all_combs.end(), sparse_haplotype.cur_indices());
+    dense_indices.push_back(comb_iter - all_combs.begin());
+  } while (sparse_haplotype.next());
+  sparse_haplotype.reset();
+  if (dense_indices.size() != subset.size()+1 || dense_indices[0] != 0){
+    std::cerr << name << ": sparse haplotype iterated through " << dense_indices.size() << " combinations instead of " << subset.size()+1 << std::endl;
+    return false;
+  }
+
+  int num_combs = haplotype.num_combs(), num_sparse = sparse_haplotype.num_combs();
+  std::vector<bool> realign_all(num_combs, true), realign_sparse(num_sparse, true);
+  HapAligner all_aligner(&haplotype, realign_all), sparse_aligner(&sparse_haplotype, realign_sparse);
+  AlignmentTrace trace(haplotype.num_blocks());
+  for (int read = 0; read < 200; read++){
+    Alignment aln = simulate_read(hap_seqs[rand() % num_combs], 12 + rand() % 8);
+    int seed_base = 1 + rand() % (aln.get_sequence().size()-2);
+    std::vector<double> all_LLs(num_combs), sparse_LLs(num_sparse);
+    all_aligner.process_read(aln, seed_base, &base_quality, false, all_LLs.data(), trace);
+    sparse_aligner.process_read(aln, seed_base, &base_quality, false, sparse_LLs.data(), trace);
+    for (int hap_index = 0; hap_index < num_sparse; hap_index++){
+      if (sparse_LLs[hap_index] != all_LLs[dense_indices[hap_index]]){
+	std::cerr << name << ": LL for sparse haplotype " << hap_index << " doesn't match the LL for the full haplotype" << std::endl;
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Verify that the haplotype's block offsets map each position to the same block coordinates as scanning its blocks,
+// both while iterating through the haplotypes and after jumping to them out of order
+bool check_coordinates(Haplotype& haplotype, const std::string& name){
+  std::vector<int> order;
+  for (int i = haplotype.num_combs()-1; i >= 0; i -= 2)
+    order.push_back(i);
+  for (int pass = 0; pass < 2; pass++){
+    haplotype.reset();
+    for (int i = 0; pass == 0 || i < (int)order.size(); i++){
+      if (pass == 1)
+	haplotype.go_to(order[i]);
+      int block_index = 0, block_pos = 0;
+      for (int hap_pos = 0; hap_pos < haplotype.cur_size(); hap_pos++){
+	while (block_pos == (int)haplotype.get_seq(block_index).size()){
+	  block_index++;
+	  block_pos = 0;
+	}
+	int block, coord;
+	haplotype.get_coordinates(hap_pos, block, coord);
+	if (block != block_index || coord != block_pos){
+	  std::cerr << name << ": position " << hap_pos << " of haplotype " << haplotype.cur_index() << " mapped to the wrong block coordinates" << std::endl;
+	  return false;
+	}
+	block_pos++;
+      }
+      if (pass == 0 && !haplotype.next())
+	break;
+    }
+  }
+  haplotype.reset();
+  return true;
+}
+
+int main(){
+  BaseQuality base_quality;
+  StutterModel stutter_model(0.9,  0.01,  0.02, 0.7, 0.001, 0.001, 2);
+
+  std::string l1   = "ACGGTATC", l2   = "ACGGTCTC", l3   = "ACGTC";
+  std::string rep1 = "ATATATAT", rep2 = "ATATATATAT", rep3 = "ATATATATATAT";
+  std::string r1   = "GAATCCC",  r2   = "GAATTCC";
+
+  HapBlock left_flank(0, 8, l1);
+  left_flank.add_alternate(l2);
+  left_flank.add_alternate(l3);
+  RepeatBlock rep_block(8, 16, rep1, 2, &stutter_model);
+  rep_block.add_alternate(rep2);
+  rep_block.add_alternate(rep3);
+  HapBlock right_flank(16, 23, r1);
+  right_flank.add_alternate(r2);
+  HapBlock fixed_right_flank(16, 23, r1);
+
+  // Several variable blocks, aligned using a separate iteration order for each flank
+  std::vector<HapBlock*> variable_blocks;
+  variable_blocks.push_back(&left_flank);
+  variable_blocks.push_back(&rep_block);
+  variable_blocks.push_back(&right_flank);
+  Haplotype variable_haplotype(variable_blocks);
+  Haplotype sparse_haplotype(variable_blocks);
+
+  // A single variable block, aligned using the regular iteration order for both flanks
+  HapBlock fixed_left_flank(0, 8, l1);
+  std::vector<HapBlock*> repeat_blocks;
+  repeat_blocks.push_back(&fixed_left_flank);
+  repeat_blocks.push_back(&rep_block);
+  repeat_blocks.push_back(&fixed_right_flank);
+  Haplotype repeat_haplotype(repeat_blocks);
+
+  // Longer flanks that allow reads to be seeded outside of the repeat
+  HapBlock long_left_flank(0, 30, "ACGGTATCAGTTCAGGACTTAGCATGACCA");
+  RepeatBlock long_rep_block(30, 38, rep1, 2, &stutter_model);
+  long_rep_block.add_alternate(rep2);
+  long_rep_block.add_alternate(rep3);
+  HapBlock long_right_flank(38, 68, "GAATCCCTGAGGTCATTGCAGACCTTAGCA");
+  std::vector<HapBlock*> long_blocks;
+  long_blocks.push_back(&long_left_flank);
+  long_blocks.push_back(&long_rep_block);
+  long_blocks.push_back(&long_right_flank);
+  Haplotype long_haplotype(long_blocks);
+
+  bool success = true;
+  success &= compare_incremental_alignments(variable_haplotype, base_quality, "Multiple variable blocks");
+  success &= compare_incremental_alignments(repeat_haplotype,   base_quality, "Single variable block");
+  success &= compare_batched_alignments(long_haplotype,         base_quality, "Batched reads");
+  success &= compare_threaded_alignments(long_haplotype, base_quality, false, false, "Threaded batched reads");
+  success &= compare_threaded_alignments(long_haplotype, base_quality, true,  true,  "Threaded pruned single-precision reads");
+  success &= check_traced_alignments(long_haplotype, base_quality, "Traced reads");
+  success &= compare_sparse_alignments(variable_haplotype, sparse_haplotype, base_quality, "Sparse haplotype");
+  success &= check_coordinates(variable_haplotype, "Haplotype coordinates");
+  success &= check_coordinates(sparse_haplotype,   "Sparse haplotype coordinates");
+  std::cerr << (success ? "All incremental alignments matched" : "Incremental alignment mismatch detected") << std::endl;
+  return (success ? 0 : 1);
+}
@@ -0,0 +1,94 @@
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <math.h>
+#include <random>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "../src/line_formatter.h"
+
+// The formatter must produce exactly the same text as a stream using std::fixed and std::setprecision(2)
+template<typename T> bool matches_stream(T value){
+  std::stringstream expected;
+  expected << std::fixed << std::setprecision(2) << value;
+  LineFormatter line(4);
+  line << value;
+  if (expected.str().compare(std::string(line.data(), line.size())) != 0){
+    std::cerr << "Mismatch: expected " << expected.str() << " but wrote " << std::string(line.data(), line.size()) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main(){
+  bool success = true;
+
+  std::vector<double> special_values = {0.0, -0.0, 0.005, 0.015, 0.125, -0.125, 2.675, -0.001, -0.004999, 0.995, 9.995, 99.995,
+					9999999.995, 1e7, -1e7, 1e15, 1e300, std::numeric_limits<double>::min(),
+					std::numeric_limits<double>::max(), std::numeric_limits<double>::infinity(),
+					-std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()};
+  for (unsigned int i = 0; i < special_values.size(); i++)
+    success &= matches_stream(special_values[i]);
+
+  std::mt19937_64 generator(13);
+  std::uniform_real_distribution<double> unit(-1.0, 1.0);
+  for (int i = 0; i < 1000000; i++){
+    double scale = pow(10.0, i % 10);
+    success &= matches_stream(unit(generator)*scale);
+
+    // Values lying exactly on, or one ulp away from, a two decimal tie
+    double tie = (std::floor(unit(generator)*scale*100) + 0.5)/100;
+    success &= matches_stream(tie);
+    success &= matches_stream(nextafter(tie, 0.0));
+    success &= matches_stream(nextafter(tie, 2*tie));
+    success &= matches_stream((float)tie);
+  }
+
+  std::vector<int64_t> int_values = {0, 1, -1, 9, 10, 99, 100, -100, 12345, 2147483647, -2147483647-1,
+				     std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min()};
+  for (int i = 0; i < 100000; i++)
+    int_values.push_back((int64_t)(generator() >> (i % 64)) * (i % 2 == 0 ? 1 : -1));
+  for (unsigned int i = 0; i < int_values.size(); i++){
+    LineFormatter line(4);
+    line << (long long)int_values[i];
+    if (std::to_string(int_values[i]).compare(std::string(line.data(), line.size())) != 0){
+      std::cerr << "Integer mismatch for " << int_values[i] << std::endl;
+      success = false;
+    }
+  }
+
+  LineFormatter counts;
+  counts.append_read_counts(std::vector<int>());
+  counts << ":";
+  counts.append_read_counts(std::vector<int>({4, -2, 0, 4, 4, 0}));
+  if (std::string(counts.data(), counts.size()).compare(".:-2|1;0|2;4|3") != 0){
+    std::cerr << "Read count mismatch: " << std::string(counts.data(), counts.size()) << std::endl;
+    success = false;
+  }
+
+  // Enough distinct differences to exceed the histogram's inline capacity
+  LineFormatter many_counts;
+  std::vector<int> many_diffs;
+  std::string expected_counts;
+  for (int i = 0; i < 2*ReadCountHistogram::INLINE_CAPACITY; i++){
+    int diff = (i%2 == 0 ? i : -i);
+    many_diffs.insert(many_diffs.end(), i+1, diff);
+  }
+  for (int i = 2*ReadCountHistogram::INLINE_CAPACITY-1; i >= 0; i--)
+    if (i%2 == 1)
+      expected_counts += (expected_counts.empty() ? "" : ";") + std::to_string(-i) + "|" + std::to_string(i+1);
+  for (int i = 0; i < 2*ReadCountHistogram::INLINE_CAPACITY; i++)
+    if (i%2 == 0)
+      expected_counts += ";" + std::to_string(i) + "|" + std::to_string(i+1);
+  many_counts.append_read_counts(many_diffs);
+  if (std::string(many_counts.data(), many_counts.size()).compare(expected_counts) != 0){
+    std::cerr << "Read count mismatch: " << std::string(many_counts.data(), many_counts.size()) << std::endl;
+    success = false;
+  }
+
+  std::cerr << (success ? "All formatted values matched" : "Formatting mismatch detected") << std::endl;
+  return (success ? 0 : 1);
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../src/range_prefetch.h"
+
+// Prefetches ranges of the file, including one that's split into several pieces, and verifies that they're cached and that
+// reads through the cached hFILE return the file's contents, whether or not they fall within a prefetched range
+int check_prefetcher(const std::string& path, const std::string& contents, bool use_io_uring){
+  std::shared_ptr<RangeCache> cache = std::make_shared<RangeCache>(64*1048576);
+  std::vector<ByteRange> ranges = {ByteRange(0, 65536), ByteRange(1000000, 1000000 + 2*RangePrefetcher::MAX_FETCH_BYTES + 12345),
+				   ByteRange(contents.size() - 5000, contents.size() + 1000)};
+  int failures = 0;
+  {
+    RangePrefetcher prefetcher(4, use_io_uring);
+    for (auto iter = ranges.begin(); iter != ranges.end(); iter++)
+      prefetcher.prefetch(path, cache, *iter);
+
+    char buffer[4096];
+    for (auto iter = ranges.begin(); iter != ranges.end(); iter++){
+      int64_t offsets[] = {iter->start, (iter->start + iter->end)/2, std::min<int64_t>(iter->end, contents.size()) - 1};
+      for (int64_t offset : offsets){
+	size_t num_read = cache->read(offset, buffer, sizeof(buffer));
+	if (num_read == 0 || contents.compare(offset, num_read, buffer, num_read) != 0){
+	  std::cerr << "Incorrect cached bytes at offset " << offset << (use_io_uring ? " using io_uring" : "") << std::endl;
+	  failures++;
+	}
+      }
+    }
+  }
+
+  hFILE* file = open_cached_hfile(path, cache);
+  int64_t offsets[] = {0, 70000, 1000000 + RangePrefetcher::MAX_FETCH_BYTES - 100, (int64_t)contents.size() - 3000};
+  for (int64_t offset : offsets){
+    std::string data(10000, '\0');
+    if (hseek(file, offset, SEEK_SET) != offset){
+      failures++;
+      continue;
+    }
+    ssize_t num_read = hread(file, &data[0], data.size());
+    if (num_read < 0 || contents.compare(offset, data.size(), data, 0, num_read) != 0){
+      std::cerr << "Incorrect bytes read through the cache at offset " << offset << (use_io_uring ? " using io_uring" : "") << std::endl;
+      failures++;
+    }
+  }
+  if (hclose(file) != 0)
+    failures++;
+  return failures;
+}
+
+int main(int argc, char** argv){
+  std::string path = "range_prefetch_test.bin";
+  std::string contents(24*1048576, '\0');
+  srand(17);
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = (char)(rand() & 0xFF);
+  std::ofstream out(path.c_str(), std::ios::binary);
+  out.write(contents.data(), contents.size());
+  out.close();
+
+  int failures = check_prefetcher(path, contents, false);
+  if (RangePrefetcher::io_uring_supported())
+    failures += check_prefetcher(path, contents, true);
+  else
+    std::cerr << "Skipping the io_uring checks, as io_uring isn't supported" << std::endl;
+  unlink(path.c_str());
+
+  if (failures != 0){
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Verifies that HipSTR's VCF is bitwise identical when multiple threads genotype the loci
+# Usage: ./run_thread_determinism_test.sh BAMS FASTA REGIONS [THREAD_COUNTS] [HIPSTR OPTIONS]
+# e.g.   ./run_thread_determinism_test.sh a.bam,b.bam hg19.fa regions.bed "2 8 32" --min-reads 30
+set -o pipefail
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 BAMS FASTA REGIONS [THREAD_COUNTS] [HIPSTR OPTIONS]"
+    exit 1
+fi
+bams=$1
+fasta=$2
+regions=$3
+thread_counts=${4:-"2 4 8"}
+shift 4 2>/dev/null || shift 3
+
+hipstr=$(dirname $0)/../HipSTR
+tmp_dir=$(mktemp -d)
+trap "rm -rf $tmp_dir" EXIT
+
+# The header records the command line and the run date, so only the records are compared
+run_hipstr(){
+    $hipstr --bams $bams --fasta $fasta --regions $regions --str-vcf $tmp_dir/$1.vcf.gz --log $tmp_dir/$1.log --threads $1 "${@:2}" >/dev/null 2>&1 || return 1
+    zcat $tmp_dir/$1.vcf.gz | grep -v "^##" > $tmp_dir/$1.records
+}
+
+if ! run_hipstr 1 "$@"; then
+    echo "HipSTR failed using 1 thread. See $tmp_dir/1.log"
+    trap - EXIT
+    exit 1
+fi
+
+status=0
+for threads in $thread_counts; do
+    if ! run_hipstr $threads "$@"; then
+        echo "HipSTR failed using $threads threads"
+        status=1
+    elif ! cmp -s $tmp_dir/1.records $tmp_dir/$threads.records; then
+        echo "VCF records generated using $threads threads differ from those generated using 1 thread"
+        status=1
+    else
+        echo "VCF records generated using $threads threads match those generated using 1 thread"
+    fi
+done
+exit $status
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include "../src/phased_snp_panel.h"
+#include "../src/region.h"
+#include "../src/snp_tree.h"
+#include "../src/vcf_reader.h"
+
+// Checks that the SNP trees built from the panel match those built from the VCF for a series of windows
+void compare_windows(std::string& vcf_file, PhasedSNPPanel& panel, const std::set<std::string>& samples){
+  VCF::VCFReader vcf_reader(vcf_file);
+  vcf_reader.restrict_samples(samples);
+  panel.restrict_samples(samples);
+  SNPVCFCursor vcf_cursor(&vcf_reader), panel_cursor(&panel);
+  assert(vcf_cursor.get_samples() == panel_cursor.get_samples());
+
+  std::vector<Region> skip_regions;
+  std::stringstream log;
+  uint32_t windows[][2] = {{7000000, 7100000}, {7050000, 7200000}, {30000000, 30500000}, {100000000, 102000000},
+			   {20000000, 20100000}, {200000000, 202000000}};
+  int num_snps = 0;
+  for (int i = 0; i < 6; i++){
+    uint32_t start = windows[i][0], end = windows[i][1];
+    std::vector<SNPTree*> vcf_trees, panel_trees;
+    std::map<std::string, unsigned int> vcf_indices, panel_indices;
+    bool vcf_success   = create_snp_trees("chr1", start, end, skip_regions, 0, &vcf_cursor,   NULL, vcf_indices,   vcf_trees,   log);
+    bool panel_success = create_snp_trees("chr1", start, end, skip_regions, 0, &panel_cursor, NULL, panel_indices, panel_trees, log);
+    assert(vcf_success && panel_success);
+    assert(vcf_indices == panel_indices && vcf_trees.size() == panel_trees.size());
+    for (size_t j = 0; j < vcf_trees.size(); j++){
+      assert(vcf_trees[j]->size() == panel_trees[j]->size());
+      for (size_t k = 0; k < vcf_trees[j]->size(); k++){
+	assert(vcf_trees[j]->position(k) == panel_trees[j]->position(k));
+	assert(vcf_trees[j]->base_one(k) == panel_trees[j]->base_one(k));
+	assert(vcf_trees[j]->base_two(k) == panel_trees[j]->base_two(k));
+      }
+      num_snps += vcf_trees[j]->size();
+    }
+    destroy_snp_trees(vcf_trees);
+    destroy_snp_trees(panel_trees);
+  }
+  assert(num_snps > 0);
+
+  std::vector<SNPTree*> snp_trees;
+  std::map<std::string, unsigned int> sample_indices;
+  bool success = create_snp_trees("chr2", 1, 1000000, skip_regions, 0, &panel_cursor, NULL, sample_indices, snp_trees, log);
+  assert(!success);
+}
+
+int main(int argc, char** argv){
+  std::string vcf_file   = argv[1];
+  std::string panel_file = "snp_panel_test.hpan";
+  unlink(panel_file.c_str());
+  std::stringstream log;
+  PhasedSNPPanel* panel = loadPhasedSNPPanel(vcf_file, panel_file, log);
+
+  // Scan the rows for all of the samples, most of the samples and a small subset of the samples
+  std::set<std::string> all_samples, most_samples, few_samples;
+  const std::vector<std::string>& samples = panel->get_samples();
+  for (size_t i = 0; i < samples.size(); i++){
+    all_samples.insert(samples[i]);
+    if (i%3 != 0)
+      most_samples.insert(samples[i]);
+    if (i%97 == 5)
+      few_samples.insert(samples[i]);
+  }
+  compare_windows(vcf_file, *panel, all_samples);
+  compare_windows(vcf_file, *panel, most_samples);
+  compare_windows(vcf_file, *panel, few_samples);
+
+  delete panel;
+  unlink(panel_file.c_str());
+  return 0;
+}
@@ -0,0 +1,128 @@
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/em_stutter_genotyper.h"
+#include "../src/task_queue.h"
+
+// Simulate reads for many samples, so that the E and M steps are split into several chunks
+void simulate_samples(std::mt19937& generator, std::vector< std::vector<int> >& num_bps, std::vector< std::vector<double> >& log_p1s,
+		      std::vector< std::vector<double> >& log_p2s, std::vector<std::string>& sample_names){
+  std::uniform_int_distribution<int> allele_dist(-3, 5), stutter_dist(0, 9), read_dist(2, 8);
+  for (int sample = 0; sample < 1200; sample++){
+    sample_names.push_back("S" + std::to_string(sample));
+    int allele_1 = 2*allele_dist(generator), allele_2 = 2*allele_dist(generator);
+    num_bps.push_back(std::vector<int>());
+    log_p1s.push_back(std::vector<double>());
+    log_p2s.push_back(std::vector<double>());
+    int num_reads = read_dist(generator);
+    for (int read = 0; read < num_reads; read++){
+      int bps    = (read % 2 == 0 ? allele_1 : allele_2);
+      int draw   = stutter_dist(generator);
+      bps       += (draw == 0 ? -2 : (draw == 1 ? 2 : (draw == 2 ? 1 : 0)));
+      bool phased = (draw > 6);
+      num_bps.back().push_back(bps);
+      log_p1s.back().push_back(phased && read % 2 == 1 ? -3.0 : 0.0);
+      log_p2s.back().push_back(phased && read % 2 == 0 ? -3.0 : 0.0);
+    }
+  }
+}
+
+std::string train_model(bool haploid, bool accelerate, TaskQueue* task_queue, std::vector< std::vector<int> >& num_bps,
+			std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s, std::vector<std::string>& sample_names){
+  EMStutterGenotyper genotyper(haploid, 2, num_bps, log_p1s, log_p2s, sample_names, 0);
+  genotyper.set_task_queue(task_queue);
+  if (accelerate)
+    genotyper.accelerate_em();
+  std::stringstream logger, model;
+  if (!genotyper.train(100, 0.01, 0.001, false, logger))
+    return "FAILED";
+
+  // Record the parameters to full precision to detect any differences
+  StutterModel* stutter_model = genotyper.get_stutter_model();
+  model.precision(17);
+  for (int in_frame = 1; in_frame >= 0; in_frame--)
+    model << stutter_model->get_parameter(in_frame, 'P') << " " << stutter_model->get_parameter(in_frame, 'U') << " "
+	  << stutter_model->get_parameter(in_frame, 'D') << " ";
+  model << genotyper.num_em_iterations();
+  return model.str();
+}
+
+bool compare_threaded_training(bool haploid, bool accelerate, const std::string& name, std::vector< std::vector<int> >& num_bps,
+			       std::vector< std::vector<double> >& log_p1s, std::vector< std::vector<double> >& log_p2s, std::vector<std::string>& sample_names){
+  std::string serial_model = train_model(haploid, accelerate, NULL, num_bps, log_p1s, log_p2s, sample_names);
+  if (serial_model == "FAILED"){
+    std::cerr << name << ": EM training failed" << std::endl;
+    return false;
+  }
+
+  for (int num_workers = 2; num_workers <= 4; num_workers++){
+    // The other workers have run out of loci, so they're idle and help train the model
+    TaskQueue task_queue(num_workers);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < num_workers; i++)
+      workers.push_back(std::thread([&](){ task_queue.work_until_finished(); }));
+    while (task_queue.num_idle_workers() != num_workers-1)
+      std::this_thread::yield();
+
+    std::string threaded_model = train_model(haploid, accelerate, &task_queue, num_bps, log_p1s, log_p2s, sample_names);
+    task_queue.work_until_finished();
+    for (unsigned int i = 0; i < workers.size(); i++)
+      workers[i].join();
+
+    if (threaded_model != serial_model){
+      std::cerr << name << ": Model trained using " << num_workers << " threads (" << threaded_model
+		<< ") doesn't match the one trained using one thread (" << serial_model << ")" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// A model trained to convergence is nearly a fixed point of the EM updates, so refining it with an iteration over the same reads must barely change it
+bool check_refinement(std::vector< std::vector<int> >& num_bps, std::vector< std::vector<double> >& log_p1s,
+		      std::vector< std::vector<double> >& log_p2s, std::vector<std::string>& sample_names){
+  std::stringstream logger;
+  EMStutterGenotyper trained_genotyper(false, 2, num_bps, log_p1s, log_p2s, sample_names, 0);
+  if (!trained_genotyper.train(100, 0.01, 0.001, false, logger)){
+    std::cerr << "EM refinement: EM training failed" << std::endl;
+    return false;
+  }
+  EMStutterGenotyper refined_genotyper(false, 2, num_bps, log_p1s, log_p2s, sample_names, 0);
+  refined_genotyper.refine(trained_genotyper, 1, false, logger);
+  if (refined_genotyper.num_em_iterations() != 1){
+    std::cerr << "EM refinement: Performed " << refined_genotyper.num_em_iterations() << " iterations instead of 1" << std::endl;
+    return false;
+  }
+  for (int in_frame = 1; in_frame >= 0; in_frame--){
+    for (char param : std::string("PUD")){
+      double trained = trained_genotyper.get_stutter_model()->get_parameter(in_frame, param);
+      double refined = refined_genotyper.get_stutter_model()->get_parameter(in_frame, param);
+      if (std::abs(trained - refined) > 0.01){
+	std::cerr << "EM refinement: Parameter " << param << " changed from " << trained << " to " << refined << std::endl;
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main(){
+  std::mt19937 generator(11);
+  std::vector< std::vector<int> > num_bps;
+  std::vector< std::vector<double> > log_p1s, log_p2s;
+  std::vector<std::string> sample_names;
+  simulate_samples(generator, num_bps, log_p1s, log_p2s, sample_names);
+
+  bool success = true;
+  success &= compare_threaded_training(false, false, "Diploid EM",             num_bps, log_p1s, log_p2s, sample_names);
+  success &= compare_threaded_training(false, true,  "Accelerated diploid EM", num_bps, log_p1s, log_p2s, sample_names);
+  success &= compare_threaded_training(true,  false, "Haploid EM",             num_bps, log_p1s, log_p2s, sample_names);
+  success &= check_refinement(num_bps, log_p1s, log_p2s, sample_names);
+  std::cerr << (success ? "All threaded EM models matched" : "Threaded EM mismatch detected") << std::endl;
+  return (success ? 0 : 1);
+}
@@ -0,0 +1,62 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/vcf_reader.h"
+
+// Reads the chromosome and position of each record, along with the genotypes of the first sample
+void read_records(VCF::VCFReader& reader, int max_records, std::vector<std::string>& records){
+  VCF::Variant variant;
+  while ((max_records < 0 || (int)records.size() < max_records) && reader.get_next_variant(variant)){
+    std::string sample = variant.get_samples().front();
+    int gt_a, gt_b;
+    variant.get_genotype(sample, gt_a, gt_b);
+    records.push_back(variant.get_chromosome() + ":" + std::to_string(variant.get_position()) + ":" + variant.get_allele(0) + ":"
+		      + std::to_string(gt_a) + "|" + std::to_string(gt_b));
+  }
+}
+
+// Verifies that the records are unchanged when they're prefetched, including after the region has been changed mid-stream
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: vcf_prefetch_test <indexed.vcf.gz>" << std::endl;
+    return 1;
+  }
+  std::string filename = argv[1];
+
+  // Decoding the genotypes dominates the runtime, so only the leading records are compared
+  const int max_records = 500;
+  VCF::VCFReader reader(filename);
+  std::vector<std::string> expected;
+  read_records(reader, max_records, expected);
+  if (expected.empty()){
+    std::cerr << "The VCF doesn't contain any records" << std::endl;
+    return 1;
+  }
+  const std::string& chrom = reader.get_chromosomes().front();
+
+  int failures = 0;
+  int slot_counts[] = {2, 7, VCF::VCFReader::DEFAULT_PREFETCH_RECORDS};
+  for (int slots : slot_counts){
+    for (int threads = 0; threads <= 2; threads += 2){
+      VCF::VCFReader prefetch_reader(filename);
+      if (threads > 0)
+	prefetch_reader.set_threads(threads);
+      prefetch_reader.enable_prefetch(slots);
+
+      // Abandon the first scan partway through, while records are still being prefetched
+      std::vector<std::string> partial, records;
+      read_records(prefetch_reader, expected.size()/3, partial);
+      if (!prefetch_reader.set_region(chrom, 0))
+	return 1;
+      read_records(prefetch_reader, max_records, records);
+      if (partial != std::vector<std::string>(expected.begin(), expected.begin()+partial.size()) || records != expected){
+	std::cerr << "Prefetched records differ using " << slots << " slots and " << threads << " threads" << std::endl;
+	failures++;
+      }
+    }
+  }
+  if (failures == 0)
+    std::cerr << "Prefetched VCF records match for " << expected.size() << " records" << std::endl;
+  return (failures == 0 ? 0 : 1);
+}
@@ -16,7 +16,8 @@ int main(int argc, char** argv) {
   std::map<std::string, unsigned int> sample_indices;
   std::vector<Region> skip_regions;
   int32_t skip_pad = 0;
-  create_snp_trees(chrom, start, end, skip_regions, skip_pad, &vcf_reader, NULL, sample_indices, snp_trees, std::cerr);
+  SNPVCFCursor snp_cursor(&vcf_reader);
+  create_snp_trees(chrom, start, end, skip_regions, skip_pad, &snp_cursor, NULL, sample_indices, snp_trees, std::cerr);
   destroy_snp_trees(snp_trees);
   return 0;
 }